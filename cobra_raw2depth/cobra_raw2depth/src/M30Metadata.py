@@ -39,6 +39,11 @@ RTD_ALG_STRIPE_GAUSSIAN_SUM           =( 0x01<<2   )
 RTD_ALG_STRIPE_ENABLE_RANGE_MEDIAN    =( 0x01<<3   )
 RTD_ALG_STRIPE_ENABLE_MIN_MAX         =( 0x01<<4   )
 
+TRANSMIT_BITMASK_RANGE      = 0x001
+TRANSMIT_BITMASK_SNR        = 0x002
+TRANSMIT_BITMASK_BACKGROUND = 0x004
+TRANSMIT_BITMASK_SIGNAL     = 0x008
+
 NUM_GPIXEL_PHASES = 3
 NUM_GPIXEL_PERMUTATIONS = 3
 NUM_GPIXEL_FREQUENCIES = 2
@@ -105,6 +110,7 @@ FOV_NUM_ROWS_IDX = 4
 FOV_NUM_ROIS_IDX = 5
 RTD_ALGORITHM_COMMON_IDX = 6
 SNR_THRESH_IDX = 7
+TRANSMIT_BITMASK_IDX = 8
 RANDOM_FOV_TAG_IDX = 10
 RTD_ALGORITHM_GRID_IDX = 11
 RTD_ALGORITHM_STRIPE_IDX = 12
@@ -142,6 +148,11 @@ def printMetadata(metadata) :
 def setSnrThresh(metadata, fov_idx, thresh) :
     getPerFovMetadata(metadata, fov_idx)[SNR_THRESH_IDX] = thresh
 
+# The TRANSMIT_BITMASK_* planes that RawToDepth computes and sends for the FOV. The range is always
+# sent, and 0 sends all of them.
+def setTransmitBitmask(metadata, fov_idx, mask) :
+    getPerFovMetadata(metadata, fov_idx)[TRANSMIT_BITMASK_IDX] = mask
+
 def setStripeWindow(metadata, fov_idx, val) :
     getPerFovMetadata(metadata, fov_idx)[RTD_ALGORITHM_STRIPE_IDX] &= 0xfff8 # unset the least 3 bits
     getPerFovMetadata(metadata, fov_idx)[RTD_ALGORITHM_STRIPE_IDX] |= val
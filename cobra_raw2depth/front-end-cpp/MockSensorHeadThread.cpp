@@ -8,6 +8,7 @@
  */
 
 #include "SensorHeadThread.h"
+#include "PipelineTrace.h"
 #include <cstdio>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -17,7 +18,10 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <climits>
+#include <thread>
 #include "LumoLogger.h"
+#include "RtdMetadata.h"
+#include "RawToDepthDsp.h"
 #include "frontend.h"
 #include "MockSensorHeadThread.h"
 
@@ -25,7 +29,7 @@
  * @brief Construct a MockSensorHeadThread
  *
  * @param headNum The head number for this thread, only allowed to be 0 on NCB
- * @param mockPathPrefix The path prefix for the raw ROI input files that are sent to raw to depth
+ * @param mockPathPrefix The path prefix for the raw ROI input files that are sent to raw to depth, or the first segment file of a recorded session
  * @param mockDelayTimeMs The time delay in milliseconds between the ROIs that are sent to raw to depth
  * @param outPrefix The path prefix for the raw output files when raw streaming is enabled. Set to nullptr to disable raw streaming to files
  * @param outMaxRois The maximum number of ROIs that will be output in a session.
@@ -33,6 +37,8 @@
  * @param calFileName The name of the mapping table file. Set to nullptr to use the system control provided mapping table
  * @param pixmapFileName The name of the pixel map file. Set to nullptr to use the system control provided pixel map
  * @param basePort The TCP base port number for the point cloud data. The ports used will be basePort, basePort + 1, ... basePort + 7
+ * @param stageConfig The processor affinities of the processing stages and the depth of the queue between them
+ * @param replayConfig The replay rate and the number of times the mock data is played
  */
 MockSensorHeadThread::MockSensorHeadThread(int headNum,
                                            std::string mockPathPrefix,
@@ -42,11 +48,25 @@ MockSensorHeadThread::MockSensorHeadThread(int headNum,
                                            int maxNetFrames,
                                            const char *calFileName,
                                            const char *pixmapFileName,
-                                           int basePort) :
-    SensorHeadThread::SensorHeadThread(headNum, outPrefix, outMaxRois, calFileName, pixmapFileName, maxNetFrames, basePort),
+                                           int basePort,
+                                           const SensorHeadStageConfig &stageConfig,
+                                           const MockReplayConfig &replayConfig) :
+    SensorHeadThread::SensorHeadThread(headNum, outPrefix, outMaxRois, calFileName, pixmapFileName, maxNetFrames, basePort, stageConfig),
     m_pathPrefix(mockPathPrefix),
+    m_useRecording(RoiContainerReader::isContainerPath(m_pathPrefix)),
     m_delayTimeUs(mockDelayTimeMs * MICROSECONDS_PER_MILLISECOND),
+    m_replay(replayConfig),
+    m_loopsCompleted(0),
+    m_paceAnchored(false),
+    m_paceSourceStartNs(0),
+    m_paceLastSourceNs(0),
+    m_roisSent(0),
+    m_reportRoisSent(0),
+    m_reportFovs(0),
+    m_lateRois(0),
     m_frame({}) {
+    // mock data has no real-time constraint; throttle to the raw to depth rate rather than drop ROIs
+    m_waitForRtdQueue = true;
 }
 
 MockSensorHeadThread::~MockSensorHeadThread() = default;
@@ -112,6 +132,7 @@ int MockSensorHeadThread::sendFrameFromFile(const char *name, uint32_t size) {
     close(readFd);
 
     // send the data
+    paceRoi((const uint8_t *)m_frame.data(), size, 0);
     sendMipiFrame((const uint8_t *)m_frame.data(), size, 1);
     return 0;
 }
@@ -132,6 +153,9 @@ int MockSensorHeadThread::sendNextFrame(int num) {
         size = sizeOfFile(name.str().c_str());
         if (size < 0) { // file doesn't exist
             if (num != 0) {
+                if (!startNextLoop()) {
+                    return -1;
+                }
                 num = 0; // reset and try to get new data
             } else {
                 LLogErr("no_files:prefix=" << m_pathPrefix <<
@@ -147,6 +171,140 @@ int MockSensorHeadThread::sendNextFrame(int num) {
     return num + 1;
 }
  
+/**
+ * @brief Internal function that sends the next ROI of the recorded session to raw to depth. The ROI is lent
+ * to raw to depth straight from the mapped recording. The recording is replayed from the start once its
+ * last segment has been sent.
+ *
+ * @param num The number of ROIs sent since the recording was last rewound
+ * @return The new number of ROIs sent, or -1 if the recording holds no ROIs or all loops have been played
+ */
+int MockSensorHeadThread::sendNextRecordedFrame(int num) {
+    RoiContainerRecord record;
+    if (!m_recording.next(record)) { // end of the recording
+        if (num == 0) {
+            LLogErr("no_recorded_rois:name=" << m_pathPrefix << ":no ROIs in recording; shutting down thread");
+            return -1;
+        }
+        if (!startNextLoop()) {
+            return -1;
+        }
+        num = 0;
+        if (!m_recording.rewind() || !m_recording.next(record)) {
+            LLogErr("rewind_recording:name=" << m_pathPrefix << ":can't rewind recording; shutting down thread");
+            return -1;
+        }
+    }
+    if (record.packed12) {
+        // Raw to depth takes 16-bit words, so a packed ROI is unpacked into a buffer of its own
+        auto numWords = record.size / 3 * 2;
+        auto unpacked = std::make_shared<std::vector<uint16_t>>(numWords);
+        RawToDepthDsp::unpackRaw12(record.data, unpacked->data(), numWords);
+        record.data = reinterpret_cast<const uint8_t *>(unpacked->data());
+        record.size = numWords * sizeof(uint16_t);
+        record.owner = std::shared_ptr<const uint8_t>(unpacked, record.data);
+    }
+    if (record.size < METADATA_SIZE) {
+        LLogWarning("roi_too_small:name=" << m_pathPrefix << ",size=" << record.size << ":recorded ROI too small for metadata; skipping");
+        return num + 1;
+    }
+    paceRoi(record.data, record.size, record.captureNs);
+    sendMipiFrame(record.data, record.size, 1, record.owner);
+    return num + 1;
+}
+
+/**
+ * @brief Internal function that is called each time the mock data has been played through
+ *
+ * @return false if the configured number of loops has been played
+ */
+bool MockSensorHeadThread::startNextLoop() {
+    m_loopsCompleted++;
+    m_paceAnchored = false; // don't wait out the jump back to the first timestamp
+    if (m_replay.loops != 0 && m_loopsCompleted >= m_replay.loops) {
+        reportReplayStats(true);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Internal function that waits until it is time to send the ROI. The ROIs are sent at the rate given
+ * by their metadata timestamps (or, if the ROI has no timestamp, by the time the ROI was recorded) times
+ * the replay rate. If raw to depth can't keep up, the ROI is sent right away and counted as late.
+ *
+ * @param roi The ROI, starting with its metadata
+ * @param size The size of the ROI in bytes
+ * @param captureNs The time the ROI was recorded, or 0 if it's not known
+ */
+void MockSensorHeadThread::paceRoi(const uint8_t *roi, uint32_t size, uint64_t captureNs) {
+    if (m_replay.rate <= REPLAY_RATE_MAX) {
+        return;
+    }
+    uint64_t sourceNs = RtdMetadata((const uint16_t *)roi, size).getTimestampNs();
+    if (sourceNs == 0) {
+        sourceNs = captureNs;
+    }
+    if (sourceNs == 0) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (!m_paceAnchored || sourceNs < m_paceLastSourceNs || sourceNs - m_paceLastSourceNs > MAX_REPLAY_GAP_NS) {
+        m_paceAnchored = true;
+        m_paceStart = now;
+        m_paceSourceStartNs = sourceNs;
+    }
+    m_paceLastSourceNs = sourceNs;
+
+    auto target = m_paceStart + std::chrono::nanoseconds((uint64_t)((double)(sourceNs - m_paceSourceStartNs) / m_replay.rate));
+    if (target > now) {
+        std::this_thread::sleep_until(target);
+    } else if (now - target > std::chrono::milliseconds(1)) {
+        m_lateRois++;
+    }
+}
+
+/**
+ * @brief Internal function that logs the achieved ROI and FOV rates every REPLAY_REPORTING_INTERVAL_MS, and
+ * the totals once all loops have been played
+ *
+ * @param done true once all loops have been played
+ */
+void MockSensorHeadThread::reportReplayStats(bool done) {
+    auto now = std::chrono::steady_clock::now();
+    if (!done) {
+        if (now - m_reportStart < std::chrono::milliseconds(REPLAY_REPORTING_INTERVAL_MS)) {
+            return;
+        }
+    }
+
+    const int drainTimeoutMs { 10000 };
+    if (done) {
+        waitForRtdQueueEmpty(drainTimeoutMs); // count the FOVs of the ROIs still queued
+    }
+    uint64_t fovs = getNumFovsProduced();
+    auto rate = (m_replay.rate > REPLAY_RATE_MAX) ? std::to_string(m_replay.rate) : std::string(m_replay.rate < REPLAY_RATE_MAX ? "fixed" : "max");
+    auto seconds = std::chrono::duration<double>(now - m_reportStart).count();
+    if (seconds > 0) {
+        LLogInfo("replay_stats:head=" << m_headNum << ",rate=" << rate << ",loop=" << m_loopsCompleted + (done ? 0 : 1) <<
+                 ",rois=" << m_roisSent - m_reportRoisSent << ",fovs=" << fovs - m_reportFovs <<
+                 ",roisPerSec=" << (double)(m_roisSent - m_reportRoisSent) / seconds <<
+                 ",fovsPerSec=" << (double)(fovs - m_reportFovs) / seconds << ",lateRois=" << m_lateRois);
+    }
+    m_reportStart = now;
+    m_reportRoisSent = m_roisSent;
+    m_reportFovs = fovs;
+
+    if (done) {
+        auto totalSeconds = std::chrono::duration<double>(now - m_replayStart).count();
+        LLogInfo("replay_done:head=" << m_headNum << ",rate=" << rate << ",loops=" << m_loopsCompleted <<
+                 ",rois=" << m_roisSent << ",fovs=" << fovs << ",seconds=" << totalSeconds <<
+                 ",roisPerSec=" << (double)m_roisSent / totalSeconds << ",fovsPerSec=" << (double)fovs / totalSeconds <<
+                 ",lateRois=" << m_lateRois);
+    }
+}
+
 /**
  * @brief The mock sensor head thread main loop
  */
@@ -154,9 +312,23 @@ void MockSensorHeadThread::run() {
     int num = 0;
     bool exitThread = false;
 
+    setStageAffinity(LumoAffinity::ROLE_CAPTURE, m_stageConfig.captureAffinity);
+    PipelineTrace::setThreadName("capture", m_headNum);
+
     // on startup, reload the cal data
     reloadCalibrationData();
 
+    if (m_useRecording && !m_recording.open(m_pathPrefix)) {
+        LLogErr("open_recording:name=" << m_pathPrefix << ":can't open recorded session; shutting down thread");
+        exitThread = true;
+    }
+
+    // Pacing by timestamp replaces the fixed delay
+    bool sendRois = m_delayTimeUs >= 0 || m_replay.rate >= REPLAY_RATE_MAX;
+    int delayTimeUs = m_replay.rate >= REPLAY_RATE_MAX ? 0 : m_delayTimeUs;
+    m_replayStart = std::chrono::steady_clock::now();
+    m_reportStart = m_replayStart;
+
     while (!exitThread) {
         uint8_t note = receiveNotification();
         if (note == THR_NOTIFY_EXIT_THREAD) {
@@ -166,11 +338,15 @@ void MockSensorHeadThread::run() {
         }
 
         if (!exitThread) {
-            if (m_delayTimeUs >= 0) {
-                if (m_delayTimeUs > 0) {
-                    usleep(m_delayTimeUs);
+            if (sendRois) {
+                if (delayTimeUs > 0) {
+                    usleep(delayTimeUs);
+                }
+                num = m_useRecording ? sendNextRecordedFrame(num) : sendNextFrame(num);
+                if (num > 0) {
+                    m_roisSent++;
+                    reportReplayStats(false);
                 }
-                num = sendNextFrame(num);
             }
             // If the file name is bad, die
             if (num < 0) {
@@ -10,12 +10,29 @@
  */
 
 #include "SensorHeadThread.h"
+#include <RoiContainer.h>
+#include <chrono>
+
+constexpr double REPLAY_RATE_FIXED_DELAY              { -1.0 };       ///< Send the ROIs with the fixed mock delay between them
+constexpr double REPLAY_RATE_MAX                      { 0.0 };        ///< Send the ROIs as fast as raw to depth takes them
+constexpr unsigned int REPLAY_REPORTING_INTERVAL_MS   { 5000 };       ///< How often the achieved replay rates are logged
+constexpr uint64_t MAX_REPLAY_GAP_NS                  { 1000000000 }; ///< Timestamp jumps larger than this, or backwards, restart the pacing instead of being waited out
+
+/**
+ * @brief How the mock data is replayed.
+ */
+struct MockReplayConfig {
+    double rate { REPLAY_RATE_FIXED_DELAY }; ///< Replay the ROIs at this multiple of the rate they were acquired at (according to their metadata timestamps), or one of the REPLAY_RATE_ values
+    unsigned int loops { 0 };               ///< How many times the mock data is played before the thread exits; 0 to repeat forever
+};
 
 /**
  * @brief MockSensorHeadThread class is responsible for reading mock files
  * from disk and forwarding the data to the MIPI ROI handler in the
  * SensorHeadThread superclass that ultimately sends the ROI data to
- * the raw to depth code.
+ * the raw to depth code. The mock files are either a sequence of
+ * single ROI files, or a session recorded with the --output-prefix
+ * option (see RoiRecorder).
  */
 class MockSensorHeadThread : public SensorHeadThread {
 
@@ -28,7 +45,9 @@ public:
                          int maxNetFrames,
                          const char *calFileName,
                          const char *pixmapFileName,
-                         int basePort);
+                         int basePort,
+                         const SensorHeadStageConfig &stageConfig = {},
+                         const MockReplayConfig &replayConfig = {});
     MockSensorHeadThread(MockSensorHeadThread& shThread) = delete;
     MockSensorHeadThread(MockSensorHeadThread&& shThread) = delete;
     MockSensorHeadThread& operator=(const MockSensorHeadThread&) = delete;
@@ -41,8 +60,28 @@ private:
     static int sizeOfFile(const char *name); // check if file exists and get its size
     int sendFrameFromFile(const char *name, uint32_t size); // send a frame from a file
     int sendNextFrame(int num);
+    int sendNextRecordedFrame(int num);
+    bool startNextLoop();
+    void paceRoi(const uint8_t *roi, uint32_t size, uint64_t captureNs);
+    void reportReplayStats(bool done);
     std::string m_pathPrefix;
+    bool m_useRecording; // true if m_pathPrefix names a recorded segment file
+    RoiContainerReader m_recording;
     int m_delayTimeUs;
+    const MockReplayConfig m_replay;
+    unsigned int m_loopsCompleted;
+    // pacing: the ROI with timestamp m_paceSourceStartNs was sent at m_paceStart
+    bool m_paceAnchored;
+    std::chrono::steady_clock::time_point m_paceStart;
+    uint64_t m_paceSourceStartNs;
+    uint64_t m_paceLastSourceNs;
+    // achieved rates, totals and since the last report
+    std::chrono::steady_clock::time_point m_replayStart;
+    std::chrono::steady_clock::time_point m_reportStart;
+    uint64_t m_roisSent;
+    uint64_t m_reportRoisSent;
+    uint64_t m_reportFovs;
+    uint64_t m_lateRois;
     std::array<uint16_t, METADATA_SIZE + IMAGE_WIDTH * NUM_GPIXEL_PHASES * NUM_GPIXEL_PERMUTATIONS * 2 * MAX_IMAGE_HEIGHT> m_frame;
 };
 
@@ -11,7 +11,10 @@
  * is common to the two concrete classes and supports the following
  * functionality:
  *    1. Communicating with the main thread
- *    2. Sending MIPI frame and ROI data to the Raw to Depth code
+ *    2. Sending MIPI frame and ROI data to the Raw to Depth code, which
+ *       runs on its own thread
+ *    3. Handing the processed FOVs to the network pipelines, also on its
+ *       own thread
  */
 
 #include <cstdio>
@@ -26,10 +29,29 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <iomanip>
+#include <chrono>
 #include "frontend.h"
 #include "LumoLogger.h"
-#include "LumoTimers.h"
+#include "FastTimers.h"
+#include "PipelineTrace.h"
 #include "SensorHeadThread.h"
+#include "RawToDepthV2_float.h"
+#include "RawToDepthStripe_float.h"
+#include "RawToDepthFactory.h"
+#include "RawToDepthDsp.h"
+
+/**
+ * @brief The configuration of the ROI recorder: if the stage config asks for it, the ROIs are packed with
+ *        RawToDepthDsp::packRaw12() as they are copied into the recorder's batches
+ */
+static RoiRecorderConfig recorderConfig(const SensorHeadStageConfig &stageConfig) {
+    RoiRecorderConfig config;
+    if (stageConfig.recordPacked) {
+        config.packRaw12 = RawToDepthDsp::packRaw12;
+    }
+    return config;
+}
 
 /**
  * @brief Construct a SensorHeadThread
@@ -41,24 +63,31 @@
  * @param pixmapFileName The name of the pixel map file. Set to nullptr to use the system control provided pixel map
  * @param maxNetFrames The maximum number of output frames that will be sent over the network. Set to zero for unlimited frames
  * @param basePort The TCP base port number for the point cloud data. The ports used will be basePort, basePort + 1, ... basePort + 7
+ * @param stageConfig The processor affinities of the processing stages and the depth of the queue between capture and raw to depth
  */
-SensorHeadThread::SensorHeadThread(int headNum, const char *outPrefix, int outMaxRois, const char *calFileName, const char *pixmapFileName, int maxNetFrames, int basePort) :
+SensorHeadThread::SensorHeadThread(int headNum, const char *outPrefix, int outMaxRois, const char *calFileName, const char *pixmapFileName, int maxNetFrames, int basePort,
+                                   const SensorHeadStageConfig &stageConfig) :
     m_headNum(headNum),
+    m_stageConfig(stageConfig),
+    m_waitForRtdQueue(false),
     m_rawToFov(std::make_shared<RawToFovs>(headNum)),
     m_netWrappers({}),
-    m_sendFrame_Timers("sendFrame loop"),
-    m_outPrefix(outPrefix),
+    m_recorder(outPrefix != nullptr ? std::make_unique<RoiRecorder>(outPrefix, headNum, recorderConfig(stageConfig)) : nullptr),
     m_outMaxRois(outMaxRois),
     m_maxNetFrames(maxNetFrames),
     m_outSessionNum(0),
-    m_outRoiNum(0),
-    m_outStreaming(false),
     m_calFileName(calFileName),
     m_pixmapFileName(pixmapFileName),
     m_calLoaded(false),
     m_rawStreamingSuspended(true),
     m_firstRawRoi(false),
-    m_stopped(false) {
+    m_stopped(false),
+    m_rtdQueue(stageConfig.rtdQueueDepth),
+    m_outputQueue(OUTPUT_QUEUE_DEPTH),
+    m_rtdRoisProcessed(0),
+    m_roisReceived(0),
+    m_fovsProduced(0),
+    m_stagesStopped(false) {
 
     // create socket pair
     std::array<int, 2> socks = { 0, 0 };
@@ -74,15 +103,49 @@ SensorHeadThread::SensorHeadThread(int headNum, const char *outPrefix, int outMa
 
     // Spin up all our output streams up front (for now -- want to stress performance)
     // TODO (Do this on the fly/per-FOV?)
+    // One event loop serves the clients of all of them
+    m_rawToFov->setXyzOutput(stageConfig.xyzOutput);
+    m_rawToFov->setFovCallback([this](uint32_t fovIdx, std::shared_ptr<FovSegment> fovData) { queueFov(fovIdx, std::move(fovData)); });
+    RawToDepthV2_float::setStreamRows(stageConfig.streamRows);
+    RawToDepthFactory::setFixedPoint(stageConfig.fixedPoint);
+    RawToDepthV2_float::setSchedulerThreads(stageConfig.dspThreads);
+    RawToDepthStripe_float::setOffloadStripes(stageConfig.stripeBatch > 0);
+    RawToDepthStripe_float::setStripeBatch(stageConfig.stripeBatch);
+    RawToDepthV2_float::setAsyncIngest(stageConfig.asyncIngest);
+    RawToDepthV2_float::setDspCpus(stageConfig.dspCpus);
+    for (uint32_t fov = 0; fov < stageConfig.fovEngines.size(); fov++) {
+        RawToDepthFactory::setFovEngine(fov, stageConfig.fovEngines[fov]);
+    }
+    m_netLoop = std::make_shared<LidarPipeline::NetworkEventLoop>("net_loop", headNum);
+    std::shared_ptr<LidarPipeline::ShmFovPublisher> shmPublisher;
+    if (stageConfig.netOutput.shmName != nullptr) {
+        shmPublisher = std::make_shared<LidarPipeline::ShmFovPublisher>(std::string(stageConfig.netOutput.shmName) + std::to_string(headNum));
+    }
+    if (stageConfig.netOutput.recordPrefix != nullptr) {
+        m_fovRecorder = std::make_shared<LidarPipeline::FovRecorder>(stageConfig.netOutput.recordPrefix, headNum);
+    }
     for (unsigned int fov = 0; fov < FOV_STREAMS_PER_HEAD; fov++) {
-        m_netWrappers[fov] = new LidarPipeline::CobraNetPipelineWrapper((int)(fov + FOV_STREAMS_PER_HEAD * headNum), maxNetFrames, basePort);
+        m_frameLatency[fov] = std::make_shared<FrameLatency>();
+        LidarPipeline::NetOutputConfig netOutput = stageConfig.netOutput;
+        netOutput.sendDelayUs = fov * stageConfig.fovStaggerUs;
+        m_netWrappers[fov] = new LidarPipeline::CobraNetPipelineWrapper((int)(fov + FOV_STREAMS_PER_HEAD * headNum), maxNetFrames, basePort,
+                                                                        m_frameLatency[fov], headNum, m_netLoop, netOutput,
+                                                                        shmPublisher, m_fovRecorder);
     }
 
     // Net wrapper for raw data (will be instantiated at runtime)
     m_rawDataNetWrapper = nullptr;
+
+    m_rtdThread = std::thread(&SensorHeadThread::rtdLoop, this);
+    m_outputThread = std::thread(&SensorHeadThread::outputLoop, this);
 }
 
 SensorHeadThread::~SensorHeadThread() {
+    stopStages();
+    m_rawToFov->shutdown(); // no more FOVs are queued once the whole frame threads are done
+    if (m_fovRecorder != nullptr) {
+        m_fovRecorder->Close(); // the output thread, which records the FOVs, has stopped
+    }
     if (m_waitFd >= 0) {
         close(m_waitFd);
         m_waitFd = -1;
@@ -112,12 +175,22 @@ void SensorHeadThread::notifyThread(uint8_t controlByte) const {
 }
 
 /**
- * @brief Loads the mapping table and pixel map from the filesystem. This function is called from the sensor head thread.
+ * @brief Loads the mapping table and pixel map from the filesystem. This function is called from the sensor head thread;
+ *        the raw to depth thread hands the load to a background thread when it reaches this request, and each FOV
+ *        switches to the new data at its next FOV boundary once it is loaded, so the stream doesn't stall.
  */
 void SensorHeadThread::reloadCalibrationData() {
-    m_rawToFov->reloadCalibrationData(std::string(m_calFileName), std::string(m_pixmapFileName));
+    queueRtdCommand(RtdQueueItem::Type::RELOAD_CALIBRATION);
     m_calLoaded = true;
-    LLogInfo("reload_cal:headNum=" << m_headNum << ",calFileName=" << m_calFileName << ",pixmapFileName=" << m_pixmapFileName);
+}
+
+/**
+ * @brief Discards the frames that the FOVs are partway through once raw to depth has processed the ROIs queued so far,
+ *        so that the FOVs start over at their next frame. Called from the sensor head thread when the scan configuration
+ *        changes without the stream stopping.
+ */
+void SensorHeadThread::restartRtdFrames() {
+    queueRtdCommand(RtdQueueItem::Type::RESTART_FRAMES);
 }
 
 /**
@@ -195,6 +268,7 @@ void SensorHeadThread::notifyShutdown() const {
  */
 void SensorHeadThread::exitThread() {
     notifyThread(THR_NOTIFY_EXIT_THREAD);
+    stopStages();
     m_rawToFov->shutdown();
 }
 
@@ -227,10 +301,10 @@ uint8_t SensorHeadThread::receiveNotification() {
         (note & THR_NOTIFY_COMMAND_MASK) == THR_NOTIFY_START_STREAMING_WITH_RELOAD) {
         reloadCalibrationData();
     } else if (note == THR_NOTIFY_START_RAW_STREAMING) {
-        if (m_rawDataNetWrapper != nullptr) {
+        if (m_rawDataNetWrapper == nullptr) {
             LLogInfo("raw_stream:head=" << m_headNum << ":started raw streaming");
             const unsigned int numROIsInBuffer = 91;
-            m_rawDataNetWrapper = new LidarPipeline::CobraRawDataNetPipelineWrapper(m_headNum, m_maxNetFrames, numROIsInBuffer);
+            m_rawDataNetWrapper = new LidarPipeline::CobraRawDataNetPipelineWrapper(m_headNum, m_maxNetFrames, numROIsInBuffer, m_netLoop);
         } else {
             LLogInfo("raw_stream_running:head=" << m_headNum << ":raw streaming already running");
         }
@@ -242,76 +316,336 @@ uint8_t SensorHeadThread::receiveNotification() {
         m_rawStreamingSuspended = true;
     }
 
-    if (m_outPrefix != nullptr) {
+    if (m_recorder != nullptr) {
         if ((note & THR_NOTIFY_COMMAND_MASK) == THR_NOTIFY_START_STREAMING) {
             m_outSessionNum++; // session starts with 1 unfortunately
-            m_outRoiNum = 0;
-            m_outStreaming = true;
+            m_recorder->startSession(m_outSessionNum, m_outMaxRois);
+        } else if (note == THR_NOTIFY_STOP_STREAMING) {
+            m_recorder->endSession();
         }
     }
 
     return note;
 }
 
-#define OUTPUT_FILE_MODE 0666
-
 /**
  * @brief Sends a single ROI to raw to depth
  *
  * @param dataU8            Pointer to the data buffer containing the ROI
  * @param dataSizePerRoi    Size of the ROI data in bytes
+ * @param frameOwner        Optional handle that owns the buffer the ROI lives in; see sendMipiFrame()
+ * @param captureNs         CLOCK_MONOTONIC time the ROI was captured
+ * @param timestamp         The metadata timestamp of the ROI if the caller already decoded it, or 0
  */
-void SensorHeadThread::sendRoi(const uint8_t *dataU8, unsigned int dataSizePerRoi) {
-    // output the data to an output file
-    if (m_outStreaming) {
-
-        std::stringstream name;
-        name << m_outPrefix << '_' <<
-                std::setfill('0') << std::setw(1) << m_headNum << '_' <<
-                std::setw(2) << m_outSessionNum << '_' <<
-                std::setw(4) << m_outRoiNum << ".bin";
-        LLogDebug("open_outfile:name=" << name.str());
-
-        // NOLINTNEXTLINE(hicpp-vararg) calling LINUX vararg API
-        int outFd = open(name.str().c_str(), (unsigned int)O_CREAT | (unsigned int)O_TRUNC | (unsigned int)O_WRONLY, OUTPUT_FILE_MODE);
-        if (outFd < 0) {
-            LLogErr("open_outfile:path=" << name.str() <<
-                    ",errno=" << errno <<
-                    ":can't open output file; streaming to file disabled");
-        } else {
-            ssize_t pos = 0;
-            while (pos < dataSizePerRoi) {
-                ssize_t bytesWritten = write(outFd, dataU8 + pos, dataSizePerRoi - pos);
-                if (bytesWritten < 0) {
-                    LLogErr("write_outfile:errno=" << errno << ":can't write to output file");
-                    break;
-                }
-                pos += bytesWritten;
+void SensorHeadThread::sendRoi(const uint8_t *dataU8, unsigned int dataSizePerRoi, const std::shared_ptr<const uint8_t> &frameOwner,
+                               uint64_t captureNs, uint64_t timestamp) {
+    m_roisReceived.fetch_add(1, std::memory_order_relaxed);
+
+    // Copy the ROI for the recorder; the file system writes happen on the recorder's own thread
+    if (m_recorder != nullptr) {
+        m_recorder->record(dataU8, dataSizePerRoi);
+    }
+
+    if (m_rawDataNetWrapper != nullptr && !m_rawStreamingSuspended) {
+        // The raw stream holds on to the ROI until it has been sent, rather than copying it, if the buffer can be lent out
+        std::shared_ptr<const char> sharedRoi;
+        if (frameOwner) {
+            sharedRoi = std::shared_ptr<const char>(frameOwner, (const char *)dataU8);
+        }
+        m_rawDataNetWrapper->HandInCobraROI((const char *) dataU8, (int)dataSizePerRoi, m_firstRawRoi, std::move(sharedRoi));
+        m_firstRawRoi = false;
+    }
+
+    // Hand the ROI to the raw to depth thread. Unless m_waitForRtdQueue is set, the capture thread never waits for it:
+    // if the queue is full, the ROI is dropped.
+    RtdQueueItem *item = beginRtdQueueItem(m_waitForRtdQueue);
+    if (item == nullptr) {
+        m_rtdQueue.countDrop();
+        return;
+    }
+    item->type = RtdQueueItem::Type::ROI;
+    item->size = dataSizePerRoi;
+    item->captureNs = captureNs;
+    item->timestamp = timestamp;
+    if (frameOwner) {
+        item->owner = frameOwner;
+        item->data = dataU8;
+    } else {
+        item->copy.assign(dataU8, dataU8 + dataSizePerRoi);
+        item->data = item->copy.data();
+    }
+    m_rtdQueue.commitPush();
+}
+
+/**
+ * @brief Gets the next free entry of the raw to depth queue
+ *
+ * @param wait True to wait for the raw to depth thread to make room if the queue is full
+ *
+ * @return The entry, or nullptr if the queue is full and wait is false, or if the stages have been stopped
+ */
+SensorHeadThread::RtdQueueItem *SensorHeadThread::beginRtdQueueItem(bool wait) {
+    RtdQueueItem *item = m_rtdQueue.beginPush();
+    while (item == nullptr && wait && !m_stagesStopped) {
+        if (!m_rtdQueue.waitForSpace()) { // sleeps until the raw to depth thread pops an item, or stopStages()
+            return nullptr;
+        }
+        item = m_rtdQueue.beginPush();
+    }
+    return item;
+}
+
+/**
+ * @brief Queues a command for the raw to depth thread, behind the ROIs already queued. Unlike ROIs, commands are never dropped.
+ *
+ * @param type The command
+ */
+void SensorHeadThread::queueRtdCommand(RtdQueueItem::Type type) {
+    RtdQueueItem *item = beginRtdQueueItem(true);
+    if (item == nullptr) {
+        return; // shutting down
+    }
+    item->type = type;
+    item->data = nullptr;
+    item->size = 0;
+    item->captureNs = 0;
+    item->timestamp = 0;
+    m_rtdQueue.commitPush();
+}
+
+/**
+ * @brief Waits until the raw to depth thread has taken all of the queued ROIs
+ *
+ * @param timeoutMs How long to wait
+ *
+ * @return false if the queue is still not empty after timeoutMs
+ */
+bool SensorHeadThread::waitForRtdQueueEmpty(int timeoutMs) const {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (m_rtdQueue.getStats().depth != 0) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+/**
+ * @brief Sets the processor affinity and scheduling of the calling stage thread
+ *
+ * @param role The role of the stage in the scheduling profile, which overrides processor (see LumoAffinity::setThreadRole())
+ * @param processor The processor (see LumoAffinity), or a negative number to leave the thread unrestricted
+ */
+void SensorHeadThread::setStageAffinity(const char *role, int processor) {
+    LumoAffinity::setThreadRole(role, processor >= 0 ? std::vector<int>{processor} : std::vector<int>{});
+}
+
+/**
+ * @brief The raw to depth thread main loop. Runs the queued ROIs through raw to depth, which passes the completed FOVs to
+ *        the output thread through queueFov().
+ */
+void SensorHeadThread::rtdLoop() {
+    setStageAffinity(LumoAffinity::ROLE_RTD, m_stageConfig.rtdAffinity);
+    PipelineTrace::setThreadName("rtd", m_headNum);
+
+    // Startup work that would otherwise land on the first frames: the explicitly given calibration data is loaded now
+    // (the reload at the start of streaming then swaps it in the background), and the requested FOVs allocate their
+    // processing state with a synthetic frame. Both run on the raw to depth thread of each head, so heads warm up in
+    // parallel, and ROIs that arrive meanwhile wait in the queue.
+    if (m_calFileName != nullptr && m_calFileName[0] != '\0') {
+        m_rawToFov->reloadCalibrationDataAsync(std::string(m_calFileName), std::string(m_pixmapFileName));
+        LLogInfo("preload_cal:headNum=" << m_headNum << ",calFileName=" << m_calFileName);
+    }
+    if (m_stageConfig.prewarmFovs != 0) {
+        auto start = std::chrono::steady_clock::now();
+        bool warmed = m_rawToFov->prewarm(m_stageConfig.prewarmFovs);
+        LLogInfo("prewarm:headNum=" << m_headNum << ",fovs=0x" << std::hex << m_stageConfig.prewarmFovs << std::dec <<
+                 ",ok=" << warmed << ",ms=" <<
+                 std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    while (true) {
+        RtdQueueItem *item = m_rtdQueue.front();
+        if (item == nullptr) {
+            if (!m_rtdQueue.waitForData()) {
+                break;
             }
-            close(outFd);
-            m_outRoiNum++;
-            if (m_outRoiNum >= m_outMaxRois) {
-                m_outStreaming = false;
+            continue;
+        }
+
+        if (item->type == RtdQueueItem::Type::RELOAD_CALIBRATION) {
+            m_rawToFov->reloadCalibrationDataAsync(std::string(m_calFileName), std::string(m_pixmapFileName));
+            LLogInfo("reload_cal:headNum=" << m_headNum << ",calFileName=" << m_calFileName << ",pixmapFileName=" << m_pixmapFileName);
+        } else if (item->type == RtdQueueItem::Type::RESTART_FRAMES) {
+            uint32_t restarted = m_rawToFov->restartFrames();
+            LLogInfo("restart_frames:headNum=" << m_headNum << ",fovs=0x" << std::hex << restarted << std::dec);
+        } else {
+            auto localTimer = FastTimers::Scoped(FAST_TIMER_SENSOR_HEAD_RTD);
+            // A lent buffer is kept by the FOVs still ingesting the ROI (see RawToDepthV2_float::setAsyncIngest()),
+            // while a copy is reused after the pop, so it must be done with on return.
+            m_rawToFov->processRoi((const uint16_t *)item->data, item->size, item->captureNs, item->timestamp, item->owner);
+        }
+        item->owner.reset(); // the capture thread can reuse the buffer now
+        m_rtdQueue.pop();
+
+        if (++m_rtdRoisProcessed % STAGE_STATS_REPORTING_INTERVAL == 0) {
+            reportStageStats();
+        }
+    }
+}
+
+/**
+ * @brief Passes a completed FOV to the output thread. Called by raw to depth as soon as the FOV is done, on the
+ *        whole frame thread of the FOV (or the raw to depth thread), so the output doesn't wait for the next ROI.
+ */
+void SensorHeadThread::queueFov(uint32_t fovIdx, std::shared_ptr<FovSegment> fovData) {
+    m_fovsProduced.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(m_outputPushMutex);
+    OutputQueueItem *out = m_outputQueue.beginPush();
+    if (out == nullptr) {
+        m_outputQueue.countDrop();
+        return;
+    }
+    out->fovIdx = fovIdx;
+    out->fovData = std::move(fovData);
+    m_outputQueue.commitPush();
+}
+
+/**
+ * @brief The output thread main loop. Hands the completed FOVs to the network pipelines.
+ */
+void SensorHeadThread::outputLoop() {
+    setStageAffinity(LumoAffinity::ROLE_OUTPUT, m_stageConfig.outputAffinity);
+    PipelineTrace::setThreadName("output", m_headNum);
+
+    while (true) {
+        OutputQueueItem *item = m_outputQueue.front();
+        if (item == nullptr) {
+            if (!m_outputQueue.waitForData()) {
+                break;
             }
+            continue;
+        }
+        {
+            auto traceSpan = PipelineTrace::Span("HandInCobraDepth");
+            m_netWrappers[item->fovIdx]->HandInCobraDepth(std::move(item->fovData));
         }
+        item->fovData = nullptr;
+        m_outputQueue.pop();
     }
+}
 
-    if (m_rawDataNetWrapper != nullptr && !m_rawStreamingSuspended) {
-        m_rawDataNetWrapper->HandInCobraROI((const char *) dataU8, (int)dataSizePerRoi, m_firstRawRoi);
-        m_firstRawRoi = false;
+/**
+ * @brief Stops the raw to depth and output threads and releases everything still queued for them
+ */
+void SensorHeadThread::stopStages() {
+    m_stagesStopped = true;
+    m_rtdQueue.quit();
+    m_outputQueue.quit();
+    if (m_rtdThread.joinable()) {
+        m_rtdThread.join();
+    }
+    if (m_outputThread.joinable()) {
+        m_outputThread.join();
     }
 
-    {
-        constexpr uint32_t REPORTING_RATIO = { 1000 }; // report every 100 frames
-        auto localTimer = LumoTimers::ScopedTimer(m_sendFrame_Timers, "rtd", REPORTING_RATIO); //alternative to small scope: wrap processRoi() in timers.start()/stop()
-        m_rawToFov->processRoi((uint16_t *)dataU8, dataSizePerRoi);
+    // release any lent buffers still queued
+    for (RtdQueueItem *item = m_rtdQueue.front(); item != nullptr; item = m_rtdQueue.front()) {
+        item->owner.reset();
+        m_rtdQueue.pop();
+    }
+    for (OutputQueueItem *item = m_outputQueue.front(); item != nullptr; item = m_outputQueue.front()) {
+        item->fovData = nullptr;
+        m_outputQueue.pop();
     }
+}
+
+/**
+ * @brief Logs the queue metrics of the processing stages
+ */
+void SensorHeadThread::reportStageStats() {
+    auto rtd = m_rtdQueue.getStats();
+    auto output = m_outputQueue.getStats();
+    LLogInfo("stage_stats:head=" << m_headNum <<
+             ",rtdDepth=" << rtd.depth << ",rtdMaxDepth=" << rtd.maxDepth << ",rtdCapacity=" << rtd.capacity <<
+             ",rtdQueued=" << rtd.pushed << ",rtdDropped=" << rtd.dropped <<
+             ",outputDepth=" << output.depth << ",outputMaxDepth=" << output.maxDepth << ",outputCapacity=" << output.capacity <<
+             ",outputQueued=" << output.pushed << ",outputDropped=" << output.dropped);
+    if (rtd.dropped != 0 || output.dropped != 0) {
+        LLogWarning("stage_drops:head=" << m_headNum << ",rtdDropped=" << rtd.dropped << ",outputDropped=" << output.dropped <<
+                    ":queue(s) overflowed");
+    }
+}
 
-    for(auto fovIdx: m_rawToFov->fovsAvailable()) {
-        auto fovData = m_rawToFov->getData(fovIdx);
+/**
+ * @brief Formats the latency histograms of the FOVs that have sent frames, as recorded from the last ROI of each frame
+ *        being captured to the last network packet of its point cloud being sent. Called from the main thread.
+ *
+ * @returns One "head=H,fov=F,stage=NAME,count=N,p50Us=...,p99Us=...,p999Us=...,maxUs=..." line per stage and FOV
+ */
+std::string SensorHeadThread::getLatencyReport() const {
+    std::string report;
+    for (unsigned int fov = 0; fov < FOV_STREAMS_PER_HEAD; fov++) {
+        report += m_frameLatency[fov]->report("head=" + std::to_string(m_headNum) + ",fov=" + std::to_string(fov) + ",");
+    }
+    return report;
+}
 
-        m_netWrappers[fovIdx]->HandInCobraDepth(fovData);
+/**
+ * @brief Formats the throughput and health counters of the sensor head: the ROI and FOV rates since the previous
+ *        report, the ROIs dropped before and by the capture stage, the occupancy of the capture driver's queue and
+ *        the time frames waited in it, the depths of the stage queues, and, for each
+ *        FOV's point cloud pipeline, the return chunk pool and the clients' backlogs. Only reads counters, so it is
+ *        cheap enough to be scraped every second. Called from the main thread.
+ *
+ * @returns A "head=H,roisPerS=...,..." line, followed by a "head=H,fov=F,submitted=...,..." line per FOV
+ */
+std::string SensorHeadThread::getHealthReport() {
+    const uint64_t nowNs = FrameTrace::now();
+    const uint64_t rois = m_roisReceived.load(std::memory_order_relaxed);
+    const uint64_t fovs = m_fovsProduced.load(std::memory_order_relaxed);
+    const double elapsedS = m_healthReportNs != 0 ? double(nowNs - m_healthReportNs) * 1e-9 : 0.0;
+    const double roisPerS = elapsedS > 0.0 ? double(rois - m_healthReportRois) / elapsedS : 0.0;
+    const double fovsPerS = elapsedS > 0.0 ? double(fovs - m_healthReportFovs) / elapsedS : 0.0;
+    m_healthReportNs = nowNs;
+    m_healthReportRois = rois;
+    m_healthReportFovs = fovs;
+
+    const auto drops = getCaptureDrops();
+    const auto capture = getCaptureQueueStats();
+    const auto rtd = m_rtdQueue.getStats();
+    const auto output = m_outputQueue.getStats();
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(1);
+    report << "head=" << m_headNum << ",roisPerS=" << roisPerS << ",fovsPerS=" << fovsPerS <<
+              ",rois=" << rois << ",fovs=" << fovs <<
+              ",captureDropped=" << drops.droppedRois << ",captureDropEvents=" << drops.dropEvents <<
+              ",captureBuffers=" << capture.buffers << ",captureMaxReady=" << capture.maxReady <<
+              ",captureLatencyUs=" << capture.meanLatencyUs << ",captureMaxLatencyUs=" << capture.maxLatencyUs <<
+              ",rtdDepth=" << rtd.depth << ",rtdMaxDepth=" << rtd.maxDepth << ",rtdCapacity=" << rtd.capacity <<
+              ",rtdDropped=" << rtd.dropped <<
+              ",outputDepth=" << output.depth << ",outputMaxDepth=" << output.maxDepth << ",outputCapacity=" << output.capacity <<
+              ",outputDropped=" << output.dropped;
+    if (m_fovRecorder != nullptr) {
+        const auto recorder = m_fovRecorder->GetStats();
+        report << ",fovsRecorded=" << recorder.recorded << ",fovsRecordDropped=" << recorder.dropped <<
+                  ",fovRecordBytes=" << recorder.bytesWritten << ",fovRecordErrors=" << recorder.writeErrors;
+    }
+    report << "\n";
+    for (unsigned int fov = 0; fov < FOV_STREAMS_PER_HEAD; fov++) {
+        const auto net = m_netWrappers[fov]->GetStats();
+        const auto shed = m_rawToFov->getLoadSheddingStats(fov);
+        report << "head=" << m_headNum << ",fov=" << fov << ",submitted=" << net.submitted << ",skipped=" << net.skipped <<
+                  ",budgetSkipped=" << net.budgetSkipped <<
+                  ",freeChunks=" << net.freeChunks << ",chunkCapacity=" << net.chunkCapacity <<
+                  ",clients=" << net.network.clients << ",evictedClients=" << net.network.evicted <<
+                  ",netDropped=" << net.network.dropped << ",maxClientBacklog=" << net.network.maxPendingBytes <<
+                  ",clientBacklogLimit=" << net.network.maxClientQueueBytes <<
+                  ",shedLevel=" << LoadShedder::getLevelName(shed.level) << ",shedLoad=" << std::setprecision(2) << shed.load <<
+                  std::setprecision(1) << ",shedSteps=" << shed.degraded << ",shedSkipped=" << shed.skippedFrames << "\n";
     }
+    return report.str();
 }
 
 /**
@@ -320,21 +654,33 @@ void SensorHeadThread::sendRoi(const uint8_t *dataU8, unsigned int dataSizePerRo
  * @param data              Pointer to buffer data
  * @param dataSizePerRoi    Size of the data in bytes
  * @param numRoisInFrame    Number of ROIs aggregated in the frame
+ * @param frameOwner        Optional reference-counted handle that owns the buffer. If set, consumers that outlive
+ *                          this call (the raw data network stream) keep a reference instead of copying the ROIs,
+ *                          and the buffer is released once the last reference is dropped. If null, the buffer is
+ *                          only valid for the duration of this call.
+ * @param captureNs         CLOCK_MONOTONIC time the frame was captured, where the latency traces of its FOVs start;
+ *                          0 for the time of this call
+ * @param roiTimestamps     Optional metadata timestamp of each ROI, as decoded by RtdMetadata::scanRoi(), so that raw to
+ *                          depth doesn't decode it again
  */
-void SensorHeadThread::sendMipiFrame(const uint8_t *data, uint32_t dataSizePerRoi, uint32_t numRoisInFrame) {
+void SensorHeadThread::sendMipiFrame(const uint8_t *data, uint32_t dataSizePerRoi, uint32_t numRoisInFrame,
+                                     const std::shared_ptr<const uint8_t> &frameOwner, uint64_t captureNs,
+                                     const uint64_t *roiTimestamps) {
     if (data == nullptr) {
         LLogWarning("bad_frame_data:data=nullptr:ignoring frame");
         return;
     }
 
     auto *dataU8 = (uint8_t *)data;
+    if (captureNs == 0) {
+        captureNs = FrameTrace::now();
+    }
 
     for (unsigned int roi = 0; roi < numRoisInFrame; roi++) {
-        sendRoi(dataU8, dataSizePerRoi);
+        auto traceSpan = PipelineTrace::Span("sendRoi");
+        sendRoi(dataU8, dataSizePerRoi, frameOwner, captureNs, roiTimestamps != nullptr ? roiTimestamps[roi] : 0);
         dataU8 += dataSizePerRoi;
     }
-
-    m_sendFrame_Timers.report();
 }
 
 /**
@@ -14,12 +14,70 @@
 #include <atomic>
 #include <mutex>
 #include <array>
+#include <thread>
 #include <RawToFovs.h>
 #include <cobra_net_pipeline.hpp>
+#include <LumoAffinity.h>
+#include <SpscRing.h>
+#include <RoiRecorder.h>
+#include <LatencyHistogram.h>
 
 constexpr unsigned int METADATA_SIZE                { static_cast<unsigned long>(IMAGE_WIDTH) * NUM_GPIXEL_PHASES * sizeof(uint16_t) };     ///< Size in bytes of metadata
 constexpr unsigned int FOV_STREAMS_PER_HEAD         { 8 };      ///< Number of network threads
 constexpr unsigned int THR_CONTROL_ACK_TIMEOUT_MS   { 10000 };  ///< Timeout in milliseconds to wait for sensor head thread to execute and acknowledge a command
+constexpr unsigned int DEFAULT_RTD_QUEUE_DEPTH      { 64 };     ///< Default number of ROIs queued between the capture and raw to depth stages
+constexpr unsigned int MIN_RTD_QUEUE_DEPTH          { 4 };
+constexpr unsigned int MAX_RTD_QUEUE_DEPTH          { 1024 };
+constexpr unsigned int OUTPUT_QUEUE_DEPTH           { 2 * FOV_STREAMS_PER_HEAD }; ///< Number of FOVs queued between the raw to depth and output stages
+constexpr unsigned int STAGE_STATS_REPORTING_INTERVAL { 10000 }; ///< How many ROIs are processed between logging the stage queue metrics
+
+/**
+ * @brief The processing stages of a sensor head and the processors each stage runs on. A negative affinity
+ *        leaves the stage unrestricted.
+ *        1. Capture: the derived class' thread, which retrieves the ROIs, dumps them to file and hands them
+ *           to the raw data stream
+ *        2. Raw to depth: RawToFovs::processRoi(); the whole frame processing runs on its own threads (or on the
+ *           scheduler shared by all heads), which queue the completed FOVs for the output stage as soon as they are done
+ *        3. Output: building the point cloud network chunks with CobraNetPipelineWrapper::HandInCobraDepth()
+ *        Each stage feeds the next through an SpscRing, so that capture never waits for DSP or TCP.
+ */
+struct SensorHeadStageConfig {
+    int captureAffinity { LumoAffinity::A72_1 };
+    int rtdAffinity { LumoAffinity::A72_1 };
+    int outputAffinity { LumoAffinity::A72_1 };
+    unsigned int rtdQueueDepth { DEFAULT_RTD_QUEUE_DEPTH };
+    LidarPipeline::NetOutputConfig netOutput; // TCP, or UDP (multicast) for the point cloud data, and the shared memory ring
+    unsigned int fovStaggerUs { 0 };          // FOV n is sent n times this late over TCP, so that FOVs don't go out together
+    bool recordPacked { false };              // the raw ROIs are recorded packed to 12 bits per word
+    bool xyzOutput { false };                 // raw to depth also computes the XYZ points (Type F packets)
+    unsigned int streamRows { 0 };            // grid-mode FOVs are sent in segments of at least this many rows, 0 whole
+    bool fixedPoint { false };                // grid-mode FOVs are processed with fixed-point raw frames (RawToDepthV2_fixed)
+    unsigned int dspThreads { 0 };            // grid-mode frames of all heads share a scheduler with this many threads, 0 per-FOV threads
+    unsigned int stripeBatch { 0 };           // stripe-mode ROIs are processed off the rtd thread, this many at once, 0 on the rtd thread
+    bool asyncIngest { false };               // grid-mode ROIs are ingested on a thread per FOV while the rtd thread moves on
+    std::vector<int> dspCpus { LumoAffinity::A72_0, LumoAffinity::A72_1 }; // processors of the whole frame processing, empty for any
+    std::vector<RtdEngine> fovEngines;        // DSP engine of FOV 0, 1, ... (RtdEngine::NONE for the default engines)
+    uint32_t prewarmFovs { 0 };               // bit n: FOV n processes a synthetic frame before streaming
+};
+
+/**
+ * @brief The ROIs the sensor sent that never reached the front end, as counted from the gaps in the ROI counter
+ */
+struct CaptureDropStats {
+    uint64_t droppedRois { 0 };
+    uint64_t dropEvents { 0 };
+};
+
+/**
+ * @brief How full the capture driver's queue gets and how long the frames wait in it before the capture stage
+ *        dequeues them. The latencies are over the period since the previous call.
+ */
+struct CaptureQueueStats {
+    uint32_t buffers { 0 };         // buffers in the driver's ring
+    uint32_t maxReady { 0 };        // most buffers dequeued in a single wakeup, since construction
+    uint64_t meanLatencyUs { 0 };   // driver timestamp to dequeue
+    uint64_t maxLatencyUs { 0 };
+};
 
 /**
  * @brief SensorHeadThread class is the base class for the V4LSensorHeadThread
@@ -34,7 +92,8 @@ constexpr unsigned int THR_CONTROL_ACK_TIMEOUT_MS   { 10000 };  ///< Timeout in
 class SensorHeadThread {
 
 public:
-    SensorHeadThread(int headNum, const char *outPrefix, int outMaxRois, const char *calFileName, const char *pixmapFileName, int maxNetFrames, int basePort);
+    SensorHeadThread(int headNum, const char *outPrefix, int outMaxRois, const char *calFileName, const char *pixmapFileName, int maxNetFrames, int basePort,
+                     const SensorHeadStageConfig &stageConfig = {});
     SensorHeadThread(SensorHeadThread& shThread) = delete;
     SensorHeadThread(SensorHeadThread&& shThread) = delete;
     SensorHeadThread& operator=(const SensorHeadThread&) = delete;
@@ -50,34 +109,85 @@ public:
     virtual void syncTimeOnNextSession() {}
     void markThreadAsStopped() { m_stopped = true; }
     bool threadStopped() const { return m_stopped; }
+    std::string getLatencyReport() const;
+    std::string getHealthReport(); // main thread only
+    virtual CaptureDropStats getCaptureDrops() const { return {}; } // from any thread
+    virtual CaptureQueueStats getCaptureQueueStats() { return {}; } // main thread only
 
 protected:
-    void sendMipiFrame(const uint8_t *data, uint32_t dataSizePerRoi, uint32_t numRoisInFrame); // functionality depends on mode
+    void sendMipiFrame(const uint8_t *data, uint32_t dataSizePerRoi, uint32_t numRoisInFrame,
+                       const std::shared_ptr<const uint8_t> &frameOwner = nullptr, uint64_t captureNs = 0,
+                       const uint64_t *roiTimestamps = nullptr); // functionality depends on mode
     uint8_t receiveNotification();
     int getWaitFd() const;
     void reloadCalibrationData();
+    void restartRtdFrames(); // after the ROIs queued so far, discards the frames that FOVs are partway through
+    static void setStageAffinity(const char *role, int processor);
+    uint64_t getNumFovsProduced() const { return m_fovsProduced.load(std::memory_order_relaxed); } // FOVs completed by raw to depth
+    bool waitForRtdQueueEmpty(int timeoutMs) const;
     int m_headNum;
+    const SensorHeadStageConfig m_stageConfig;
+    bool m_waitForRtdQueue; // true if the capture stage waits for room in the raw to depth queue instead of dropping ROIs
 
 private:
+    /**
+     * @brief An entry of the capture to raw to depth queue: an ROI, or a command that has to be executed
+     *        in order with the ROIs
+     */
+    struct RtdQueueItem {
+        enum class Type { ROI, RELOAD_CALIBRATION, RESTART_FRAMES } type { Type::ROI };
+        const uint8_t *data { nullptr };
+        uint32_t size { 0 };
+        uint64_t captureNs { 0 };             // CLOCK_MONOTONIC time the ROI was captured, for the latency trace
+        uint64_t timestamp { 0 };             // metadata timestamp already decoded by the capture thread, or 0
+        std::shared_ptr<const uint8_t> owner; // keeps a lent buffer alive until raw to depth is done with it
+        std::vector<uint8_t> copy;            // storage for the ROI if the buffer could not be lent
+    };
+    struct OutputQueueItem {
+        uint32_t fovIdx { 0 };
+        std::shared_ptr<FovSegment> fovData;
+    };
+
     void notifyThread(uint8_t controlByte) const;        // does not wait for reply
-    void sendRoi(const uint8_t *dataU8, unsigned int dataSizePerRoi);
+    void sendRoi(const uint8_t *dataU8, unsigned int dataSizePerRoi, const std::shared_ptr<const uint8_t> &frameOwner, uint64_t captureNs,
+                 uint64_t timestamp);
+    RtdQueueItem *beginRtdQueueItem(bool wait);
+    void queueRtdCommand(RtdQueueItem::Type type);
+    void rtdLoop();
+    void queueFov(uint32_t fovIdx, std::shared_ptr<FovSegment> fovData);
+    void outputLoop();
+    void stopStages();
+    void reportStageStats();
     int m_waitFd;
     int m_trigFd;
     std::shared_ptr<RawToFovs> m_rawToFov;
+    std::array<std::shared_ptr<FrameLatency>, FOV_STREAMS_PER_HEAD> m_frameLatency; // DQBUF to last packet latency histograms (1 per FoV), shared with the net wrappers
+    std::shared_ptr<LidarPipeline::NetworkEventLoop> m_netLoop; // sends the processed and raw data of all the net wrappers
     std::array<LidarPipeline::CobraNetPipelineWrapper*, FOV_STREAMS_PER_HEAD> m_netWrappers; // net wrappers for processed data (1 per FoV)
     LidarPipeline::CobraRawDataNetPipelineWrapper* m_rawDataNetWrapper; // net wrapper for raw data (1 per sensor head)
-    LumoTimers m_sendFrame_Timers;
-    const char *m_outPrefix;
+    std::unique_ptr<RoiRecorder> m_recorder; // records the raw ROIs to file when enabled
+    std::shared_ptr<LidarPipeline::FovRecorder> m_fovRecorder; // records the FOVs handed to the net wrappers when enabled
     int m_outMaxRois;
     int m_maxNetFrames;
     int m_outSessionNum;
-    int m_outRoiNum;
-    bool m_outStreaming;
     const char *m_calFileName;
     const char *m_pixmapFileName;
     std::atomic_bool m_calLoaded;
     bool m_rawStreamingSuspended;
     bool m_firstRawRoi;
     bool m_stopped;
+    SpscRing<RtdQueueItem> m_rtdQueue;       // capture -> raw to depth
+    SpscRing<OutputQueueItem> m_outputQueue; // raw to depth -> output
+    std::mutex m_outputPushMutex;            // the FOVs are completed on several threads, which take turns to push
+    uint64_t m_rtdRoisProcessed;
+    std::atomic<uint64_t> m_roisReceived;    // handed to sendRoi() by the capture stage
+    std::atomic<uint64_t> m_fovsProduced;
+    // The counters as of the previous health report, for the rates
+    uint64_t m_healthReportNs { 0 };
+    uint64_t m_healthReportRois { 0 };
+    uint64_t m_healthReportFovs { 0 };
+    std::atomic_bool m_stagesStopped;
+    std::thread m_rtdThread;
+    std::thread m_outputThread;
 };
 
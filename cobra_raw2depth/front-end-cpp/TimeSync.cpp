@@ -20,6 +20,7 @@
 #include <array>
 #include <thread>
 #include "LumoLogger.h"
+#include "LumoAffinity.h"
 #include "TimeSync.h"
 
 #define NS_PER_SEC 1000000000
@@ -407,9 +408,15 @@ TimeSync::TimeSync(startup_mode_enum_t startMode) :
     m_threadP(nullptr)
 {
     if (startMode == STARTUP_MODE_PTP_TIMESYNC) {
-        m_threadP = std::make_unique<std::thread>([this](){ this->startPtpTimesync(); });
+        m_threadP = std::make_unique<std::thread>([this](){
+            LumoAffinity::setThreadRole(LumoAffinity::ROLE_TIMESYNC);
+            this->startPtpTimesync();
+        });
     } else if (startMode == STARTUP_MODE_PPS_TIMESYNC) {
-        m_threadP = std::make_unique<std::thread>([this](){ this->startPpsTimesync(); });
+        m_threadP = std::make_unique<std::thread>([this](){
+            LumoAffinity::setThreadRole(LumoAffinity::ROLE_TIMESYNC);
+            this->startPpsTimesync();
+        });
     } else if (startMode == STARTUP_MODE_NO_TIMESYNC) {
         m_initialized = true;
         LLogInfo("no_timesync:no time synchronization requested; using 25 MHz FPGA clock");
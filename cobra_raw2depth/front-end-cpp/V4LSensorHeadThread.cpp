@@ -7,22 +7,30 @@
  *        a subclass of the SensorHeadThread class.
  */
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
 #include <cerrno>
 #include <unistd.h>
 #include <cstring>
 #include <arpa/inet.h>
 #include <linux/videodev2.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
 #include "frontend.h"
 #include "LumoLogger.h"
 #include "V4LSensorHeadThread.h"
 #include "LumoAffinity.h"
+#include "HugePages.h"
+#include "MemoryBudget.h"
+#include "PipelineTrace.h"
 
 typedef struct {
     int width;
@@ -64,6 +72,8 @@ static const std::array<mode_info_t, NUM_MODES> s_v4lFormatForMode = {{
  * @param calFileName The name of the mapping table file. Set to nullptr to use the system control provided mapping table
  * @param pixmapFileName The name of the pixel map file. Set to nullptr to use the system control provided pixel map
  * @param basePort The TCP base port number for the point cloud data. The ports used will be basePort, basePort + 1, ... basePort + 7
+ * @param bufferConfig The number of V4L buffers and how they are allocated
+ * @param stageConfig The processor affinities of the processing stages and the depth of the queue between them
  */
 V4LSensorHeadThread::V4LSensorHeadThread(int headNum,
                                          std::string devicePath,
@@ -74,16 +84,26 @@ V4LSensorHeadThread::V4LSensorHeadThread(int headNum,
                                          const char *pixmapFileName,
                                          int basePort,
                                          std::shared_ptr<TimeSync> timeSync,
-                                         unsigned int i2cAddress) :
-    SensorHeadThread::SensorHeadThread(headNum, outPrefix, outMaxRois, calFileName, pixmapFileName, maxNetFrames, basePort),
-    m_buffers({}),
+                                         unsigned int i2cAddress,
+                                         const V4LBufferConfig &bufferConfig,
+                                         const SensorHeadStageConfig &stageConfig) :
+    SensorHeadThread::SensorHeadThread(headNum, outPrefix, outMaxRois, calFileName, pixmapFileName, maxNetFrames, basePort, stageConfig),
+    m_bufferConfig(bufferConfig),
+    m_bufferRing(std::make_shared<V4LBufferRing>()),
     m_devicePath(devicePath),
     m_videoFd(-1),
     m_streaming(false),
+    m_mode(-1),
     m_seqNum(0),
     m_frameCount(0),
     m_droppedFrames(0),
     m_dropEvents(0),
+    m_totalDroppedFrames(0),
+    m_totalDropEvents(0),
+    m_maxReadyBuffers(0),
+    m_captureLatencySumUs(0),
+    m_captureLatencyCount(0),
+    m_captureMaxLatencyUs(0),
     m_roiSize(0),
     m_numRois(0),
     m_timeSync(timeSync),
@@ -91,6 +111,9 @@ V4LSensorHeadThread::V4LSensorHeadThread(int headNum,
     m_syncTimeOnNextSession(true),
     m_timeOffset(0),
     m_lastUserTags({ -1, -1, -1, -1, -1, -1, -1, -1 }) {
+    m_bufferRing->memory = m_bufferConfig.memory;
+    m_bufferRing->buffers.resize(m_bufferConfig.numBuffers);
+    m_bufferRing->maxLent = m_bufferConfig.numBuffers / 2;
 }
 
 V4LSensorHeadThread::~V4LSensorHeadThread() = default;
@@ -209,12 +232,7 @@ int V4LSensorHeadThread::uninterruptedIoctl(int deviceFd, int request, void *arg
  * @return 0 if the session is started successfully, -1 if the session fails to start; errors are logged
  */
 int V4LSensorHeadThread::startSession(uint8_t mode, uint8_t note) {
-    // synchronize time if requested
-    if (m_syncTimeOnNextSession && m_timeSync->initialized()) {
-        m_timeOffset = m_timeSync->syncTime(m_i2cAddress);
-        m_syncTimeOnNextSession = false;
-        LLogInfo("sync_time:offset=" << m_timeOffset << ",head=" << m_headNum << ":time synchronized");
-    }
+    syncTimeIfRequested();
     struct v4l2_format fmt{};
 
     ackControlByte(note);
@@ -258,69 +276,13 @@ int V4LSensorHeadThread::startSession(uint8_t mode, uint8_t note) {
     // Initialize sendFrame information
     m_roiSize = s_v4lFormatForMode[mode].roiSize;
     m_numRois = s_v4lFormatForMode[mode].numRois;
+    m_roiTimestamps.assign(m_numRois, 0);
 
-    // now initialize mmap
-    struct v4l2_requestbuffers reqBufs{};
-
-    reqBufs.count = NUM_V4L_BUFFERS;
-    reqBufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    reqBufs.memory = V4L2_MEMORY_MMAP;
-
-    if (uninterruptedIoctl(m_videoFd, VIDIOC_REQBUFS, &reqBufs) < 0) {
-        // unable to allocate the buffers in V4L
-        // EINVAL means that the driver doesn't support MMAP
-        LLogErr("req_bufs:errno=" << errno << ":failed to get V4L buffers; exiting session");
+    if (allocateBuffers() < 0) {
         endSession();
         return -1;
     }
 
-    if (reqBufs.count < NUM_V4L_BUFFERS) {
-        // failed to allocate the correct number of buffers
-        LLogErr("req_bufs_count:count=" << reqBufs.count << ",expected=" << NUM_V4L_BUFFERS <<
-                ":allocated incorrect number of buffers; exiting session");
-        endSession();
-        return -1;
-    }
-
-    // mmap the buffers
-    for (int i = 0; i < NUM_V4L_BUFFERS; i++) {
-        struct v4l2_buffer buf {};
-        struct v4l2_plane plane {};
-
-        buf.m.planes = &plane;
-        buf.length = 1;
-
-        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index  = i;
-        plane.bytesused = m_roiSize * m_numRois;
-        plane.length = m_roiSize * m_numRois;
-
-        if (uninterruptedIoctl(m_videoFd, VIDIOC_QUERYBUF, &buf) < 0) {
-            LLogErr("query_buf:errno=" << errno << ",i=" << i <<
-                    ":failed to get buffer information; exiting session");
-            endSession();
-            return -1;
-        }
-        m_buffers.at(i).length = buf.m.planes->length;
-        m_buffers.at(i).buffer = mmap(NULL,
-                                      buf.m.planes->length,
-                                      (unsigned int)PROT_READ | (unsigned int)PROT_WRITE,
-                                      MAP_SHARED,
-                                      m_videoFd,
-                                      buf.m.planes->m.mem_offset);
-        if (m_buffers.at(i).buffer == MAP_FAILED) {
-            LLogErr("mmap:errno=" << errno << ":failed to mmap buffer; exiting session");
-            endSession();
-            return -1;
-        }
-        if (uninterruptedIoctl(m_videoFd, VIDIOC_QBUF, &buf) < 0) {
-            LLogErr("queue_buf:errno=" << errno << ":failed to queue buffers");
-            endSession();
-            return -1;
-        }
-    }
-
     // initialize frame counters
     m_seqNum = -1;
     m_droppedFrames = 0;
@@ -334,13 +296,75 @@ int V4LSensorHeadThread::startSession(uint8_t mode, uint8_t note) {
         return -1;
     }
     m_streaming = true;
+    m_mode = mode;
     return 0;
 }
 
+/**
+ * @brief Internal function that synchronizes the FPGA timestamps with UTC if it was requested since the last session
+ */
+void V4LSensorHeadThread::syncTimeIfRequested() {
+    if (m_syncTimeOnNextSession && m_timeSync->initialized()) {
+        m_timeOffset = m_timeSync->syncTime(m_i2cAddress);
+        m_syncTimeOnNextSession = false;
+        LLogInfo("sync_time:offset=" << m_timeOffset << ",head=" << m_headNum << ":time synchronized");
+    }
+}
+
+/**
+ * @brief Internal function that switches the session being streamed to another mode without stopping the stream,
+ *        which is possible when both modes have the same MIPI frame geometry, as when only the scan configuration
+ *        changes. The V4L buffers stay queued and streaming, so the switch costs at most the frame in progress:
+ *        raw to depth discards the frames that the FOVs are partway through once it has processed the ROIs received
+ *        before the switch.
+ *
+ * @param mode The desired streaming video mode from the s_v4lFormatForMode table
+ *
+ * @return true if the mode was switched and the control byte acknowledged, false if the session has to be restarted
+ */
+bool V4LSensorHeadThread::switchModeInPlace(uint8_t mode, uint8_t note) {
+    if (!m_streaming || m_mode < 0) {
+        return false;
+    }
+    const mode_info_t &current = s_v4lFormatForMode[m_mode];
+    const mode_info_t &next = s_v4lFormatForMode[mode];
+    if (current.width != next.width || current.height != next.height || current.v4l2_pix_fmt != next.v4l2_pix_fmt ||
+        current.roiSize != next.roiSize || current.numRois != next.numRois) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (current.fps != next.fps) {
+        struct v4l2_streamparm parms{};
+        parms.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        parms.parm.capture.timeperframe.numerator = 1;
+        parms.parm.capture.timeperframe.denominator = next.fps;
+        if (uninterruptedIoctl(m_videoFd, VIDIOC_S_PARM, &parms) < 0) {
+            LLogInfo("switch_mode_set_parms:errno=" << errno << ":can't set fps while streaming; restarting session");
+            return false;
+        }
+    }
+
+    syncTimeIfRequested();
+    restartRtdFrames();
+    m_mode = mode;
+    ackControlByte(note);
+    LLogInfo("switch_mode:dev=" << m_devicePath << ",mode=" << next.name << ",us=" <<
+             std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() <<
+             ":switched without restarting the session");
+    return true;
+}
+
 /**
  * @brief Internal function that ends the current session also used to clean up if starting the session failed
  */
 void V4LSensorHeadThread::endSession() {
+    {
+        // buffers that are still lent out must not be queued back once the stream stops
+        std::lock_guard<std::mutex> lock(m_bufferRing->mutex);
+        m_bufferRing->session++;
+    }
+
     if (m_streaming) {
         enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
         if (uninterruptedIoctl(m_videoFd, VIDIOC_STREAMOFF, &type) < 0) {
@@ -349,25 +373,10 @@ void V4LSensorHeadThread::endSession() {
         m_streaming = false;
         reportDroppedRois();
     }
+    m_mode = -1;
 
-    for (int i = 0; i < NUM_V4L_BUFFERS; i++) {
-        if (m_buffers.at(i).buffer != nullptr && munmap(m_buffers.at(i).buffer, m_buffers.at(i).length) < 0) {
-            LLogErr("munmap:errno=" << errno << ":failed to unmap buffer");
-        }
-        m_buffers.at(i).buffer = nullptr;
-        m_buffers.at(i).length = 0;
-    }
-
-    // free all buffers
-    struct v4l2_requestbuffers reqBufs{};
-
-    reqBufs.count = 0;
-    reqBufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    reqBufs.memory = V4L2_MEMORY_MMAP;
-
-    if (uninterruptedIoctl(m_videoFd, VIDIOC_REQBUFS, &reqBufs) < 0) {
-        LLogErr("reqbufs_free:errno=" << errno << ":failed to free buffers");
-    }
+    waitForLentBuffers();
+    freeBuffers();
 }
 
 /**
@@ -387,29 +396,36 @@ void V4LSensorHeadThread::reportDroppedRois() {
 
 /**
  * @brief Internal function that analyzes a MIPI frame to see if an ROI has been dropped or not
- *        This function also adjust the timestamps in each MIPI frame to UTC
+ *        This function also adjust the timestamps in each MIPI frame to UTC, and leaves the adjusted timestamp
+ *        of each ROI in m_roiTimestamps for raw to depth, so that it doesn't decode it again
  *
  * @param mipiFrameData A buffer of MIPI data; the caller must verify that the size of the data is large enough to hold the metadata
  */
 void V4LSensorHeadThread::lookForDroppedRoisAndAdjustTime(uint8_t *mipiFrameData) {
 
     for (unsigned int roi = 0; roi < m_numRois; roi++) {
+        // Adjust the timestamp and read the fields checked here in one pass over the few metadata words involved
+        const RoiScan scan = RtdMetadata::scanRoi(mipiFrameData, m_timeOffset);
+        m_roiTimestamps[roi] = scan.timestamp;
+
         // look for dropped frames
-        auto metadata = RtdMetadata((const uint16_t *)mipiFrameData, m_roiSize);
-        int seq = (int)metadata.getRoiCounter();
+        int seq = (int)scan.roiCounter;
 
         // There are two ignored cases:
         // 1. Stream start, when m_seqNum is initialized to -1
         // 2. Sequence number wraparound when seq resets to 0
         if (m_seqNum != seq) {
             if (seq > 0 && m_seqNum >= 0) {
+                uint32_t dropped = 1;
                 if (seq <= m_seqNum) {
                     LLogInfo("frame_drop_weird_sequence:seq=" << seq << ",m_seqNum=" << m_seqNum);
-                    m_droppedFrames++;
                 } else {
-                    m_droppedFrames += seq - m_seqNum;
+                    dropped = seq - m_seqNum;
                 }
+                m_droppedFrames += dropped;
                 m_dropEvents++;
+                m_totalDroppedFrames.fetch_add(dropped, std::memory_order_relaxed);
+                m_totalDropEvents.fetch_add(1, std::memory_order_relaxed);
                 LLogDebug("frame_drop:seq=" << seq << ",m_seqNum=" << m_seqNum);
             }
             m_seqNum = seq;
@@ -422,7 +438,7 @@ void V4LSensorHeadThread::lookForDroppedRoisAndAdjustTime(uint8_t *mipiFrameData
 
         // Report on any changed user tags
         for (unsigned int fov = 0; fov < FOV_STREAMS_PER_HEAD; fov++) {
-            int userTag = (int)metadata.getUserTag(fov);
+            int userTag = (int)scan.userTags[fov];
             if (userTag != m_lastUserTags[fov]) {
                 if (m_lastUserTags[fov] > 0) {
                     LLogInfo("user_tag_changed:oldTag=" << m_lastUserTags[fov] << ",newTag=" << userTag);
@@ -431,52 +447,419 @@ void V4LSensorHeadThread::lookForDroppedRoisAndAdjustTime(uint8_t *mipiFrameData
             }
         }
 
-        // This is where we adjust the timestamp
-        RtdMetadata::adjustTimestamp(mipiFrameData, m_timeOffset);
         mipiFrameData += m_roiSize;
     }
 }
 
 
 /**
- * @brief Internal function to receive a frame of MIPI data and send it to raw to depth; called when the video file descriptor has data is available for reading
+ * @brief Internal function that requests the V4L buffers from the driver, allocates the memory behind them
+ *        if the driver does not, and queues them all
+ *
+ * @return 0 if successful, -1 if not; errors are logged
  */
-void V4LSensorHeadThread::retrieveAndSendMipiFrame() {
+int V4LSensorHeadThread::allocateBuffers() {
+    V4LBufferRing &ring = *m_bufferRing;
+
+    // As many of the configured buffers as fit into the memory budget, but at least two, so that the driver can fill
+    // one while the other is being read
+    const auto maxBuffers = (uint32_t)ring.buffers.size();
+    const auto minBuffers = std::min(2U, maxBuffers);
+    const uint64_t bufferBytes = std::max<uint64_t>(uint64_t(m_roiSize) * m_numRois, 1);
+    m_bufferGrant = MemoryBudget::request(MEMORY_POOL_V4L_BUFFERS, minBuffers * bufferBytes, maxBuffers * bufferBytes,
+                                          "head " + std::to_string(m_headNum) + " capture buffers");
+    const auto numBuffers = std::clamp((uint32_t)(m_bufferGrant.bytes() / bufferBytes), minBuffers, maxBuffers);
+    struct v4l2_requestbuffers reqBufs{};
+
+    reqBufs.count = numBuffers;
+    reqBufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    reqBufs.memory = ring.memory;
+
+    if (uninterruptedIoctl(m_videoFd, VIDIOC_REQBUFS, &reqBufs) < 0) {
+        // unable to allocate the buffers in V4L
+        // EINVAL means that the driver doesn't support the memory type
+        LLogErr("req_bufs:errno=" << errno << ",memory=" << ring.memory << ":failed to get V4L buffers; exiting session");
+        return -1;
+    }
+
+    if (reqBufs.count < numBuffers) {
+        // failed to allocate the correct number of buffers
+        LLogErr("req_bufs_count:count=" << reqBufs.count << ",expected=" << numBuffers <<
+                ":allocated incorrect number of buffers; exiting session");
+        return -1;
+    }
+
+    int heapFd = -1;
+    if (ring.memory == V4L2_MEMORY_DMABUF) {
+        heapFd = open(m_bufferConfig.dmaHeapPath.c_str(), (unsigned int)O_RDWR | (unsigned int)O_CLOEXEC, 0);
+        if (heapFd < 0) {
+            LLogErr("open_heap:errno=" << errno << ",heap=" << m_bufferConfig.dmaHeapPath <<
+                    ":failed to open DMA heap; exiting session");
+            return -1;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(ring.mutex);
+    ring.videoFd = m_videoFd;
+    ring.numActive = numBuffers;
+    ring.maxLent = numBuffers / 2;
+    int retVal = 0;
+    for (uint32_t i = 0; i < numBuffers && retVal == 0; i++) {
+        auto &buffer = ring.buffers[i];
+        if (buffer.lent) {
+            // left over from a session whose consumers never returned it
+            LLogErr("alloc_lent:i=" << i << ":buffer still lent out; exiting session");
+            retVal = -1;
+            break;
+        }
+
+        struct v4l2_buffer buf {};
+        struct v4l2_plane plane {};
+
+        buf.m.planes = &plane;
+        buf.length = 1;
+
+        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        buf.memory = ring.memory;
+        buf.index  = i;
+        plane.bytesused = m_roiSize * m_numRois;
+        plane.length = m_roiSize * m_numRois;
+
+        if (uninterruptedIoctl(m_videoFd, VIDIOC_QUERYBUF, &buf) < 0) {
+            LLogErr("query_buf:errno=" << errno << ",i=" << i <<
+                    ":failed to get buffer information; exiting session");
+            retVal = -1;
+            break;
+        }
+        size_t length = std::max((size_t)buf.m.planes->length, (size_t)m_roiSize * m_numRois);
+
+        switch (ring.memory) {
+            case V4L2_MEMORY_USERPTR :
+                buffer.data = allocateUserBuffer(length);
+                buffer.length = length;
+                break;
+            case V4L2_MEMORY_DMABUF :
+                length = (length + getpagesize() - 1) / getpagesize() * getpagesize();
+                buffer.data = allocateDmabuf(heapFd, length, buffer.dmabufFd);
+                buffer.length = length;
+                break;
+            default :
+                // MAP_POPULATE takes the page faults now rather than on the first frames
+                buffer.length = buf.m.planes->length;
+                buffer.data = mmap(NULL,
+                                   buf.m.planes->length,
+                                   (unsigned int)PROT_READ | (unsigned int)PROT_WRITE,
+                                   (unsigned int)MAP_SHARED | (unsigned int)MAP_POPULATE,
+                                   m_videoFd,
+                                   buf.m.planes->m.mem_offset);
+                break;
+        }
+        if (buffer.data == MAP_FAILED || buffer.data == nullptr) {
+            LLogErr("alloc_buf:errno=" << errno << ",i=" << i << ",memory=" << ring.memory <<
+                    ":failed to allocate or map buffer; exiting session");
+            buffer.data = nullptr;
+            retVal = -1;
+            break;
+        }
+        if (queueBuffer(ring, i, false) < 0) {
+            LLogErr("queue_buf:errno=" << errno << ":failed to queue buffers");
+            retVal = -1;
+        }
+    }
+
+    if (heapFd >= 0) {
+        close(heapFd);
+    }
+    return retVal;
+}
+
+/**
+ * @brief Internal function that returns the V4L buffers to the driver and frees the memory behind them
+ */
+void V4LSensorHeadThread::freeBuffers() {
+    V4LBufferRing &ring = *m_bufferRing;
+
+    auto releaseDriverBuffers = [this, &ring]() {
+        struct v4l2_requestbuffers reqBufs{};
+
+        reqBufs.count = 0;
+        reqBufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        reqBufs.memory = ring.memory;
+
+        if (uninterruptedIoctl(m_videoFd, VIDIOC_REQBUFS, &reqBufs) < 0) {
+            LLogErr("reqbufs_free:errno=" << errno << ":failed to free buffers");
+        }
+    };
+
+    // Driver-allocated buffers must be unmapped before they can be freed, imported memory must be
+    // released by the driver before it is freed.
+    if (ring.memory != V4L2_MEMORY_MMAP) {
+        releaseDriverBuffers();
+    }
+
+    std::unique_lock<std::mutex> lock(ring.mutex);
+    for (unsigned int i = 0; i < ring.buffers.size(); i++) {
+        auto &buffer = ring.buffers[i];
+        if (buffer.lent) {
+            // still in use by a consumer; leave it mapped rather than pull it out from under the consumer
+            LLogErr("munmap_lent:i=" << i << ":buffer not returned by its consumers; leaking the mapping");
+            continue;
+        }
+        if (buffer.data != nullptr && munmap(buffer.data, buffer.length) < 0) {
+            LLogErr("munmap:errno=" << errno << ":failed to unmap buffer");
+        }
+        if (buffer.dmabufFd >= 0) {
+            close(buffer.dmabufFd);
+        }
+        buffer = {};
+    }
+    lock.unlock();
+
+    if (ring.memory == V4L2_MEMORY_MMAP) {
+        releaseDriverBuffers();
+    }
+    m_bufferGrant.reset();
+}
+
+/**
+ * @brief Internal function that allocates the memory for a USERPTR buffer, from huge pages if there are any
+ *        reserved (see /proc/sys/vm/nr_hugepages) and otherwise from regular pages with transparent huge
+ *        pages requested. All pages are faulted in up front.
+ *
+ * @param length The size of the buffer in bytes; rounded up to the page size used
+ *
+ * @return The buffer, or MAP_FAILED
+ */
+void *V4LSensorHeadThread::allocateUserBuffer(size_t &length) {
+    void *data = HugePages::allocate(length, HugePages::Mode::EXPLICIT, true);
+    return data != nullptr ? data : MAP_FAILED;
+}
+
+/**
+ * @brief Internal function that allocates a DMABUF buffer from a DMA heap and maps it for CPU access
+ *
+ * @param heapFd The open DMA heap
+ * @param length The size of the buffer in bytes, a multiple of the page size
+ * @param dmabufFd Returns the file descriptor of the DMABUF, or -1 if the allocation failed
+ *
+ * @return The mapped buffer, or MAP_FAILED
+ */
+void *V4LSensorHeadThread::allocateDmabuf(int heapFd, size_t length, int &dmabufFd) {
+    struct dma_heap_allocation_data alloc {};
+    alloc.len = length;
+    alloc.fd_flags = (unsigned int)O_RDWR | (unsigned int)O_CLOEXEC;
+
+    dmabufFd = -1;
+    if (uninterruptedIoctl(heapFd, (int)DMA_HEAP_IOCTL_ALLOC, &alloc) < 0) {
+        return MAP_FAILED;
+    }
+    dmabufFd = (int)alloc.fd;
+    return mmap(NULL, length, (unsigned int)PROT_READ | (unsigned int)PROT_WRITE,
+                (unsigned int)MAP_SHARED | (unsigned int)MAP_POPULATE, dmabufFd, 0);
+}
+
+/**
+ * @brief Internal function to receive all of the MIPI frames the driver has ready and send them to raw to depth;
+ *        called when the video file descriptor has data available for reading. After a stall, the frames that
+ *        queued up are drained in this one wakeup rather than one per trip through epoll_wait(). At most one
+ *        ring's worth is dequeued, so that commands from the main thread are still seen under a full load.
+ */
+void V4LSensorHeadThread::drainMipiFrames() {
+    const auto numBuffers = m_bufferRing->numActive.load(std::memory_order_relaxed);
+    uint32_t ready = 0;
+    while (ready < numBuffers && retrieveAndSendMipiFrame()) {
+        ready++;
+    }
+    if (ready > m_maxReadyBuffers.load(std::memory_order_relaxed)) {
+        m_maxReadyBuffers.store(ready, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Internal function to dequeue a frame of MIPI data and send it to raw to depth
+ *
+ * @return true if a buffer was dequeued, false if the driver had none ready or dequeuing failed
+ */
+bool V4LSensorHeadThread::retrieveAndSendMipiFrame() {
+    V4LBufferRing &ring = *m_bufferRing;
     struct v4l2_buffer buf {};
     struct v4l2_plane plane {};
     buf.m.planes = &plane;
     buf.length = 1;
 
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    buf.memory = V4L2_MEMORY_MMAP;
+    buf.memory = ring.memory;
     if (uninterruptedIoctl(m_videoFd, VIDIOC_DQBUF, &buf) < 0) {
         if (errno != EAGAIN) {
             LLogErr("dequeue:errno=" << errno << ":failed to dequeue buffer");
         }
-        return;
+        return false;
+    }
+    auto traceSpan = PipelineTrace::Span("retrieveAndSendMipiFrame");
+
+    // The latency traces start at the driver's timestamp if it is on the same clock as the trace points
+    uint64_t captureNs = FrameTrace::now();
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+        (buf.timestamp.tv_sec != 0 || buf.timestamp.tv_usec != 0)) {
+        captureNs = uint64_t(buf.timestamp.tv_sec) * uint64_t(NANOSECONDS_PER_SECOND) + uint64_t(buf.timestamp.tv_usec) * uint64_t(NANOSECONDS_PER_MICROSECOND);
+        recordCaptureLatency(captureNs);
     }
 
     uint32_t index = buf.index;
-    if (index >= NUM_V4L_BUFFERS) {
-        LLogErr("buf_num:index=" << index << ",expected_max=" << NUM_V4L_BUFFERS);
-        return;
+    if (index >= ring.buffers.size()) {
+        LLogErr("buf_num:index=" << index << ",expected_max=" << ring.buffers.size());
+        return true;
+    }
+
+    if (ring.memory == V4L2_MEMORY_DMABUF &&
+        syncDmabuf(ring.buffers[index].dmabufFd, (uint64_t)DMA_BUF_SYNC_START | (uint64_t)DMA_BUF_SYNC_RW) < 0) {
+        LLogErr("dmabuf_sync_start:errno=" << errno << ",index=" << index);
     }
 
     if ((buf.flags & V4L2_BUF_FLAG_ERROR) == 0) {
-        auto *ptr = (uint8_t *)m_buffers[index].buffer; // C-style for maximum speed and no error checking
-        uint32_t length = m_buffers[index].length;
+        auto *ptr = (uint8_t *)ring.buffers[index].data; // C-style for maximum speed and no error checking
+        size_t length = ring.buffers[index].length;
 
         // make sure buffer has the size we expect
         if (length >= m_roiSize * m_numRois) {
             lookForDroppedRoisAndAdjustTime(ptr);
-            sendMipiFrame(ptr, m_roiSize, m_numRois);
+            // Lend the buffer to the consumers instead of having them copy it. It is queued back to the driver
+            // when the last reference is dropped, which is at the end of this scope unless the raw data stream
+            // still holds some of its ROIs.
+            auto frameOwner = lendBuffer(index);
+            sendMipiFrame(ptr, m_roiSize, m_numRois, frameOwner, captureNs, m_roiTimestamps.data());
+            if (frameOwner) {
+                return true;
+            }
         } else {
             LLogErr("buffer_too_small:length=" << length << ",roiSize=" << m_roiSize << ",numRois=" << m_numRois);
         }
     }
-    if (uninterruptedIoctl(m_videoFd, VIDIOC_QBUF, &buf) < 0) {
+    if (queueBuffer(ring, index, true) < 0) {
         LLogErr("queueback:errno=" << errno << ":failed to queue buffer back");
     }
+    return true;
+}
+
+/**
+ * @brief Internal function that accumulates the time from the driver's timestamp of a buffer to its dequeue
+ *
+ * @param captureNs The CLOCK_MONOTONIC time of the buffer
+ */
+void V4LSensorHeadThread::recordCaptureLatency(uint64_t captureNs) {
+    const uint64_t nowNs = FrameTrace::now();
+    const uint64_t latencyUs = nowNs > captureNs ? (nowNs - captureNs) / uint64_t(NANOSECONDS_PER_MICROSECOND) : 0;
+    m_captureLatencySumUs.fetch_add(latencyUs, std::memory_order_relaxed);
+    m_captureLatencyCount.fetch_add(1, std::memory_order_relaxed);
+    if (latencyUs > m_captureMaxLatencyUs.load(std::memory_order_relaxed)) {
+        m_captureMaxLatencyUs.store(latencyUs, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Internal function that wraps a dequeued buffer in a reference-counted handle. The buffer is queued
+ *        back to the driver when the last copy of the handle is released, on whichever thread that happens.
+ *
+ * @param index The index of the dequeued buffer
+ *
+ * @return The handle, or nullptr if too many buffers are already lent out; the caller then keeps the buffer
+ */
+std::shared_ptr<const uint8_t> V4LSensorHeadThread::lendBuffer(uint32_t index) {
+    uint32_t session;
+    {
+        std::lock_guard<std::mutex> lock(m_bufferRing->mutex);
+        if (m_bufferRing->numLent >= m_bufferRing->maxLent) {
+            return nullptr;
+        }
+        m_bufferRing->buffers[index].lent = true;
+        m_bufferRing->numLent++;
+        session = m_bufferRing->session;
+    }
+    return { (const uint8_t *)m_bufferRing->buffers[index].data,
+             [ring = m_bufferRing, session, index](const uint8_t * /*unused*/) { returnBuffer(ring, session, index); } };
+}
+
+/**
+ * @brief Internal function called when the last reference to a lent buffer is released
+ *
+ * @param ring The buffers of the sensor head thread that lent the buffer
+ * @param session The value of ring->session when the buffer was lent
+ * @param index The index of the buffer
+ */
+void V4LSensorHeadThread::returnBuffer(const std::shared_ptr<V4LBufferRing> &ring, uint32_t session, uint32_t index) {
+    {
+        std::lock_guard<std::mutex> lock(ring->mutex);
+        if (session == ring->session && queueBuffer(*ring, index, true) < 0) {
+            LLogErr("queueback:errno=" << errno << ",index=" << index << ":failed to queue lent buffer back");
+        }
+        ring->buffers[index].lent = false;
+        ring->numLent--;
+    }
+    ring->returned.notify_all();
+}
+
+/**
+ * @brief Internal function that waits for all lent buffers to be released before the buffers are unmapped
+ */
+void V4LSensorHeadThread::waitForLentBuffers() {
+    std::unique_lock<std::mutex> lock(m_bufferRing->mutex);
+    if (!m_bufferRing->returned.wait_for(lock, std::chrono::milliseconds(V4L_BUFFER_RETURN_TIMEOUT_MS),
+                                         [this] { return m_bufferRing->numLent == 0; })) {
+        LLogErr("lent_buffers_timeout:numLent=" << m_bufferRing->numLent << ",timeoutMs=" << V4L_BUFFER_RETURN_TIMEOUT_MS <<
+                ":buffers still in use at end of session");
+    }
+}
+
+/**
+ * @brief Internal function that queues a buffer (back) to the driver
+ *
+ * @param ring The buffers of the sensor head
+ * @param index The index of the buffer
+ * @param endCpuAccess True if the CPU has been accessing the buffer since it was dequeued (DMABUF only)
+ *
+ * @return 0 if the ioctl succeeds, -1 if it fails
+ */
+int V4LSensorHeadThread::queueBuffer(const V4LBufferRing &ring, uint32_t index, bool endCpuAccess) {
+    const auto &buffer = ring.buffers[index];
+    struct v4l2_buffer buf {};
+    struct v4l2_plane plane {};
+    buf.m.planes = &plane;
+    buf.length = 1;
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    buf.memory = ring.memory;
+    buf.index = index;
+    switch (ring.memory) {
+        case V4L2_MEMORY_USERPTR :
+            plane.m.userptr = (unsigned long)buffer.data;
+            plane.length = buffer.length;
+            break;
+        case V4L2_MEMORY_DMABUF :
+            if (endCpuAccess && syncDmabuf(buffer.dmabufFd, (uint64_t)DMA_BUF_SYNC_END | (uint64_t)DMA_BUF_SYNC_RW) < 0) {
+                LLogErr("dmabuf_sync_end:errno=" << errno << ",index=" << index);
+            }
+            plane.m.fd = buffer.dmabufFd;
+            plane.length = buffer.length;
+            break;
+        default :
+            break;
+    }
+    return uninterruptedIoctl(ring.videoFd, VIDIOC_QBUF, &buf);
+}
+
+/**
+ * @brief Internal function that brackets CPU access to a DMABUF buffer, so that caches are kept coherent
+ *        with the device writing into the buffer
+ *
+ * @param dmabufFd The DMABUF file descriptor
+ * @param flags DMA_BUF_SYNC_START or DMA_BUF_SYNC_END, combined with the access direction
+ *
+ * @return 0 if the ioctl succeeds, -1 if it fails
+ */
+int V4LSensorHeadThread::syncDmabuf(int dmabufFd, uint64_t flags) {
+    struct dma_buf_sync sync {};
+    sync.flags = flags;
+    return uninterruptedIoctl(dmabufFd, (int)DMA_BUF_IOCTL_SYNC, &sync);
 }
 
 /**
@@ -486,7 +869,7 @@ void V4LSensorHeadThread::retrieveAndSendMipiFrame() {
  */
 int V4LSensorHeadThread::handleNotification(uint8_t note) {
     switch(note) {
-        case THR_NOTIFY_NOTHING_HAPPENED : // this should never happen because of the select
+        case THR_NOTIFY_NOTHING_HAPPENED : // this should never happen because of the epoll_wait
             ackControlByte(note);
             break;
         case THR_NOTIFY_EXIT_THREAD :
@@ -499,6 +882,9 @@ int V4LSensorHeadThread::handleNotification(uint8_t note) {
                 // start streaming
                 uint8_t format = note & THR_NOTIFY_PARAM_MASK;
                 LLogInfo("start_streaming:dev=" << m_devicePath << ",format=" << (int)format);
+                if (format < NUM_MODES && switchModeInPlace(format, note)) {
+                    break;
+                }
                 if (m_streaming) {
                     LLogInfo("start_currently_streaming:dev=" << m_devicePath <<
                              ",m_streaming=" << m_streaming <<
@@ -536,43 +922,69 @@ int V4LSensorHeadThread::handleNotification(uint8_t note) {
  * @brief The MIPI video sensor head thread main loop
  */
 void V4LSensorHeadThread::run() {
-    LumoAffinity::setAffinity(LumoAffinity::A72_1);
+    setStageAffinity(LumoAffinity::ROLE_CAPTURE, m_stageConfig.captureAffinity);
+    PipelineTrace::setThreadName("capture", m_headNum);
 
     if (openDevice() < 0) {
         SensorHeadThread::notifyShutdown();
         return;
     }
 
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        LLogErr("epoll_create:errno=" << errno << ":exiting thread");
+        SensorHeadThread::notifyShutdown();
+        return;
+    }
+    struct epoll_event waitEvent {};
+    waitEvent.events = EPOLLIN;
+    waitEvent.data.fd = SensorHeadThread::getWaitFd();
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, waitEvent.data.fd, &waitEvent) < 0) {
+        LLogErr("epoll_add_wait:errno=" << errno << ":exiting thread");
+        close(epollFd);
+        SensorHeadThread::notifyShutdown();
+        return;
+    }
+
+    // The video device is only watched while streaming; it reports an error when it isn't.
+    bool videoWatched = false;
     while(true) {
-        // set up select
-        fd_set fds;
-        int waitFd = SensorHeadThread::getWaitFd();
-        FD_ZERO(&fds);
-        FD_SET(waitFd, &fds);
-        int maxFd = waitFd;
-        if (m_streaming) {
-            FD_SET(m_videoFd, &fds);
-            if (maxFd < m_videoFd) {
-                maxFd = m_videoFd;
+        if (videoWatched != m_streaming) {
+            struct epoll_event videoEvent {};
+            videoEvent.events = EPOLLIN;
+            videoEvent.data.fd = m_videoFd;
+            if (epoll_ctl(epollFd, m_streaming ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, m_videoFd, &videoEvent) < 0) {
+                LLogErr("epoll_video:errno=" << errno << ",streaming=" << m_streaming << ":exiting thread");
+                SensorHeadThread::notifyShutdown();
+                break;
             }
+            videoWatched = m_streaming;
         }
 
         // wait for something to happen
-        int ret = select(maxFd + 1, &fds, NULL, NULL, NULL); // no timeout
+        std::array<struct epoll_event, V4L_MAX_EPOLL_EVENTS> events {};
+        int ret = epoll_wait(epollFd, events.data(), int(events.size()), -1); // no timeout
         if (ret < 0) {
             if (errno == EINTR) {
                 continue; // back to the well if interrupted
             }
-            LLogErr("select:errno=" << errno << ":exiting thread");
+            LLogErr("epoll_wait:errno=" << errno << ":exiting thread");
             SensorHeadThread::notifyShutdown();
             break;
         }
 
-        if (m_streaming && FD_ISSET(m_videoFd, &fds)) {
-            retrieveAndSendMipiFrame();
+        bool videoReady = false;
+        bool waitReady = false;
+        for (int i = 0; i < ret; i++) {
+            videoReady = videoReady || events[i].data.fd == m_videoFd;
+            waitReady = waitReady || events[i].data.fd == waitEvent.data.fd;
+        }
+
+        if (m_streaming && videoReady) {
+            drainMipiFrames();
         }
 
-        if (FD_ISSET(waitFd, &fds)) {
+        if (waitReady) {
             uint8_t note = receiveNotification();
             if (handleNotification(note) < 0) {
                 SensorHeadThread::notifyShutdown();
@@ -580,9 +992,25 @@ void V4LSensorHeadThread::run() {
             }
         }
     }
+    close(epollFd);
 }
 
 
+CaptureDropStats V4LSensorHeadThread::getCaptureDrops() const {
+    return { m_totalDroppedFrames.load(std::memory_order_relaxed), m_totalDropEvents.load(std::memory_order_relaxed) };
+}
+
+CaptureQueueStats V4LSensorHeadThread::getCaptureQueueStats() {
+    CaptureQueueStats stats;
+    stats.buffers = m_bufferRing->numActive.load(std::memory_order_relaxed);
+    stats.maxReady = m_maxReadyBuffers.load(std::memory_order_relaxed);
+    const uint64_t count = m_captureLatencyCount.exchange(0, std::memory_order_relaxed);
+    const uint64_t sumUs = m_captureLatencySumUs.exchange(0, std::memory_order_relaxed);
+    stats.meanLatencyUs = count > 0 ? sumUs / count : 0;
+    stats.maxLatencyUs = m_captureMaxLatencyUs.exchange(0, std::memory_order_relaxed);
+    return stats;
+}
+
 void V4LSensorHeadThread::syncTimeOnNextSession() {
     LLogInfo("time will be synchronized for sensor head " << m_headNum);
     m_syncTimeOnNextSession = true;
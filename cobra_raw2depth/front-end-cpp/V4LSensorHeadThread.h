@@ -7,11 +7,62 @@
  *
  * @brief This file provides the interface for the V4LSensorHeadThread class.
  */
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <linux/videodev2.h>
 #include "SensorHeadThread.h"
 #include "TimeSync.h"
+#include "MemoryBudget.h"
 #include "frontend.h"
 
-#define NUM_V4L_BUFFERS 32
+#define NUM_V4L_BUFFERS 32                         // default number of V4L buffers
+#define MIN_V4L_BUFFERS 2
+#define MAX_V4L_BUFFERS 64
+#define V4L_BUFFER_RETURN_TIMEOUT_MS 2000          // how long ending a session waits for lent buffers to come back
+#define V4L_MAX_EPOLL_EVENTS 2                     // the wait file descriptor and the video device
+#define DEFAULT_DMA_HEAP_PATH "/dev/dma_heap/system"
+
+/**
+ * @brief How the V4L buffers are allocated, set from the frontend command line
+ *        1. V4L2_MEMORY_MMAP: the driver allocates the buffers and they are mmap'ed
+ *        2. V4L2_MEMORY_USERPTR: the buffers are allocated here, from huge pages if available
+ *        3. V4L2_MEMORY_DMABUF: the buffers are allocated from a DMA heap (e.g. a CMA heap) and
+ *           imported into the driver, so they can also be shared with other processes
+ */
+struct V4LBufferConfig {
+    unsigned int numBuffers { NUM_V4L_BUFFERS };
+    enum v4l2_memory memory { V4L2_MEMORY_MMAP };
+    std::string dmaHeapPath { DEFAULT_DMA_HEAP_PATH }; // DMABUF only
+};
+
+/**
+ * @brief The V4L buffers of a sensor head and the bookkeeping for the buffers that have been lent
+ *        out to the consumers of a MIPI frame. A lent buffer is only queued back to the driver when
+ *        the last consumer (raw to depth, the raw data network stream, ...) releases its reference,
+ *        which may happen on another thread. The structure is shared with the outstanding buffer
+ *        handles so that it outlives the sensor head thread if it has to.
+ */
+struct V4LBufferRing {
+    struct Buffer {
+        void *data { nullptr };
+        size_t length { 0 };
+        int dmabufFd { -1 }; // DMABUF only
+        bool lent { false };
+    };
+    std::mutex mutex;
+    std::condition_variable returned;
+    int videoFd { -1 };
+    enum v4l2_memory memory { V4L2_MEMORY_MMAP };
+    uint32_t session { 0 }; // incremented when a session ends; buffers lent in an earlier session are not queued back
+    std::vector<Buffer> buffers;
+    std::atomic<uint32_t> numActive { 0 }; // the first buffers, requested from the driver for the session (see MemoryBudget)
+    uint32_t numLent { 0 };
+    uint32_t maxLent { 0 }; // always leave the rest of the buffers to the driver
+};
 
 /**
  * @brief V4LSensorHeadThread class is a subclass of SensorHeadThread.
@@ -33,7 +84,9 @@ public:
                         const char *pixmapFileName,
                         int basePort,
                         std::shared_ptr<TimeSync> timesync,
-                        unsigned int i2cAddress);
+                        unsigned int i2cAddress,
+                        const V4LBufferConfig &bufferConfig = {},
+                        const SensorHeadStageConfig &stageConfig = {});
     V4LSensorHeadThread(V4LSensorHeadThread& shThread) = delete;
     V4LSensorHeadThread(V4LSensorHeadThread&& shThread) = delete;
     V4LSensorHeadThread& operator=(const V4LSensorHeadThread&) = delete;
@@ -41,6 +94,8 @@ public:
     ~V4LSensorHeadThread() override;
     void run() override;
     void syncTimeOnNextSession() override;
+    CaptureDropStats getCaptureDrops() const override;
+    CaptureQueueStats getCaptureQueueStats() override;
     static int uninterruptedIoctl(int deviceFd, int request, void *arg);
 
 private:
@@ -48,26 +103,44 @@ private:
     void closeDevice();
     int getMetadata(); // returns the mode
     int startSession(uint8_t mode, uint8_t note);
+    bool switchModeInPlace(uint8_t mode, uint8_t note);
+    void syncTimeIfRequested();
     void endSession();
-    void retrieveAndSendMipiFrame();
+    void drainMipiFrames();
+    bool retrieveAndSendMipiFrame();
+    void recordCaptureLatency(uint64_t captureNs);
     void reportDroppedRois();
     void lookForDroppedRoisAndAdjustTime(uint8_t *mipiFrameData);
     int handleNotification(uint8_t note);
-    static void adjustMetadataTimestamp(uint8_t *ptr, uint64_t offset);
-    typedef struct {
-        void *buffer;
-        size_t length;
-    } membuf_t;
-    std::array<membuf_t, NUM_V4L_BUFFERS> m_buffers;
+    int allocateBuffers();
+    void freeBuffers();
+    static void *allocateUserBuffer(size_t &length);
+    static void *allocateDmabuf(int heapFd, size_t length, int &dmabufFd);
+    std::shared_ptr<const uint8_t> lendBuffer(uint32_t index);
+    void waitForLentBuffers();
+    static void returnBuffer(const std::shared_ptr<V4LBufferRing> &ring, uint32_t session, uint32_t index);
+    static int queueBuffer(const V4LBufferRing &ring, uint32_t index, bool endCpuAccess);
+    static int syncDmabuf(int dmabufFd, uint64_t flags);
+    V4LBufferConfig m_bufferConfig;
+    std::shared_ptr<V4LBufferRing> m_bufferRing;
+    MemoryBudget::Grant m_bufferGrant;              // of the buffers of the current session
     std::string m_devicePath;
     int m_videoFd;
     bool m_streaming;
+    int m_mode;                                     // the mode being streamed, or -1
     int m_seqNum;
     uint32_t m_frameCount;
     uint32_t m_droppedFrames;
     uint32_t m_dropEvents;
+    std::atomic<uint64_t> m_totalDroppedFrames; // since construction, for the health report
+    std::atomic<uint64_t> m_totalDropEvents;
+    std::atomic<uint32_t> m_maxReadyBuffers;        // most buffers dequeued in one wakeup
+    std::atomic<uint64_t> m_captureLatencySumUs;    // since the previous getCaptureQueueStats()
+    std::atomic<uint64_t> m_captureLatencyCount;
+    std::atomic<uint64_t> m_captureMaxLatencyUs;
     uint32_t m_roiSize;
     uint32_t m_numRois;
+    std::vector<uint64_t> m_roiTimestamps;          // adjusted timestamp of each ROI of the current MIPI frame
     std::shared_ptr<TimeSync> m_timeSync;
     unsigned int m_i2cAddress;
     std::atomic_bool m_syncTimeOnNextSession;
@@ -38,6 +38,7 @@ static void usage(void)
     std::cerr << "       -R|--raw 0-3                      start/unsuspend raw streaming" << std::endl;
     std::cerr << "       -S|--suspend 0-3                  suspend raw streaming" << std::endl;
     std::cerr << "       -t|--timesync 0-3                 synchronize time" << std::endl;
+    std::cerr << "       -T|--trace 0-1                    start (1) or stop and write (0) the pipeline trace" << std::endl;
 }
 
 /**
@@ -51,9 +52,10 @@ static void usage(void)
  * @param raw raw streaming head number or -1 if -R was not specified on the command line
  * @param suspend suspend head number or -1 if -S was not specified on the command line
  * @param timesync timesync head number or -1 if -t was not specified on the command line
+ * @param trace 1 to start the trace, 0 to stop it, or -1 if -T was not specified on the command line
  * @return true if the options are NOT legal together, false otherwise
  */
-static bool are_bad_options(int start, int end, int debug, int reload, int format, int raw, int suspend, int tsync)
+static bool are_bad_options(int start, int end, int debug, int reload, int format, int raw, int suspend, int tsync, int trace)
 {
     bool retVal = false;
     int num_options_set = (start >= 0   ? 1 : 0) +
@@ -62,7 +64,8 @@ static bool are_bad_options(int start, int end, int debug, int reload, int forma
                           (reload >= 0  ? 1 : 0) +
                           (raw >= 0     ? 1 : 0) +
                           (suspend >= 0 ? 1 : 0) +
-                          (tsync >= 0   ? 1 : 0);
+                          (tsync >= 0   ? 1 : 0) +
+                          (trace >= 0   ? 1 : 0);
 
     if (num_options_set != 1) {
         retVal = true;
@@ -74,7 +77,8 @@ static bool are_bad_options(int start, int end, int debug, int reload, int forma
         debug > HIGHEST_DEBUG_LEVEL ||
         raw > HIGHEST_HEAD ||
         suspend > HIGHEST_HEAD ||
-        tsync > HIGHEST_HEAD) {
+        tsync > HIGHEST_HEAD ||
+        trace > 1) {
         retVal = true;
     }
     if (start >= 0 && format < 0) {
@@ -100,10 +104,11 @@ int main(int argc, char *argv[])
     int raw = -1;
     int suspend = -1;
     int tsync = -1;
+    int trace = -1;
     int optIndex;
     uint8_t command;
 
-    const std::array<struct option, 10> opts = {{
+    const std::array<struct option, 11> opts = {{
         { "help", no_argument, NULL, 'h' },
         { "debug", required_argument, NULL, 'd' },
         { "start", required_argument, NULL, 's' },
@@ -113,11 +118,12 @@ int main(int argc, char *argv[])
         { "raw", required_argument, NULL, 'R' },
         { "suspend", required_argument, NULL, 'S' },
         { "timesync", required_argument, NULL, 't' },
+        { "trace", required_argument, NULL, 'T' },
         { NULL, 0, NULL, 0 }
     }};
 
     // NOLINTNEXTLINE(hicpp-vararg) calling Linux vararg API
-    while ((opt = getopt_long(argc, argv, "hd:s:f:e:r:R:S:t:", (const struct option *)opts.data(), &optIndex)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hd:s:f:e:r:R:S:t:T:", (const struct option *)opts.data(), &optIndex)) != -1) {
         switch(opt) {
             case 'd' : debug = atoi(optarg);   break;
             case 's' : start = atoi(optarg);   break;
@@ -127,6 +133,7 @@ int main(int argc, char *argv[])
             case 'R' : raw = atoi(optarg);     break;
             case 'S' : suspend = atoi(optarg); break;
             case 't' : tsync = atoi(optarg);   break;
+            case 'T' : trace = atoi(optarg);   break;
             case 'h' : {
                 usage();
                 exit(0);
@@ -139,7 +146,7 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (are_bad_options(start, end, debug, reload, format, raw, suspend, tsync)) {
+    if (are_bad_options(start, end, debug, reload, format, raw, suspend, tsync, trace)) {
         usage();
         exit(1);
     }
@@ -158,6 +165,8 @@ int main(int argc, char *argv[])
         command = FEC_NOTIFY_SUSPEND_RAW_STREAMING | (unsigned int)suspend;
     } else if (tsync >= 0) {
         command = FEC_NOTIFY_SYNC_TIME | (unsigned int)tsync;
+    } else if (trace >= 0) {
+        command = FEC_NOTIFY_TRACE | (trace == 1 ? FEC_NOTIFY_TRACE_START : 0);
     }
 
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -20,6 +20,7 @@
  * 010100HH -- start raw streaming on head HH
  * 010101HH -- suspend raw streaming on head HH
  * 010110HH -- resynchronize with 1PPS on head HH
+ * 0101110T -- start (T=1) the pipeline trace, or stop it and write the trace file (T=0)
  *
  * We can add a bunch more commands 
  *
@@ -56,6 +57,9 @@ constexpr unsigned int FEC_NOTIFY_SUSPEND_RAW_STREAMING          { 0x54 };
 constexpr unsigned int FEC_NOTIFY_SUSPEND_RAW_STREAMING_MASK     { 0xfc };
 constexpr unsigned int FEC_NOTIFY_SYNC_TIME                      { 0x58 };
 constexpr unsigned int FEC_NOTIFY_SYNC_TIME_MASK                 { 0xfc };
+constexpr unsigned int FEC_NOTIFY_TRACE                          { 0x5c };
+constexpr unsigned int FEC_NOTIFY_TRACE_MASK                     { 0xfe };
+constexpr unsigned int FEC_NOTIFY_TRACE_START                    { 0x01 };
 constexpr unsigned int FEC_NOTIFY_ERROR                          { 0xff }; // only gets returned
 
 constexpr unsigned int THR_NOTIFY_COMMAND_MASK                   { 0xf0 };
@@ -70,9 +74,12 @@ constexpr unsigned int THR_NOTIFY_START_RAW_STREAMING            { 0xf4 };
 constexpr unsigned int THR_NOTIFY_SUSPEND_RAW_STREAMING          { 0xf5 };
 
 constexpr unsigned int LISTEN_PORT                              { 1234 };
+constexpr const char *DEFAULT_TRACE_FILE                   { "/tmp/frontend_trace.json" };
 
 constexpr int MILLISECONDS_PER_SECOND                       { 1000 };
 constexpr int MICROSECONDS_PER_MILLISECOND                  { 1000 };
+constexpr long NANOSECONDS_PER_SECOND                       { 1000000000 };
+constexpr int NANOSECONDS_PER_MICROSECOND                   { 1000 };
 
 typedef enum {
     STARTUP_MODE_NO_TIMESYNC,
@@ -7,6 +7,10 @@
 #include <ctime>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <vector>
 
 static constexpr short STREAMING_PORT              { 12566 };
@@ -44,6 +48,32 @@ static constexpr int FAILURE_NONE                  { 0 };
 static constexpr int FAILURE_IO                    { -1 };
 static constexpr int FAILURE_BAD_PACKET_LENGTH     { -2 };
 
+// Throughput mode
+static constexpr int FOV_STREAMS_PER_HEAD          { 8 };      // point cloud ports per sensor head, see SensorHeadThread.h
+static constexpr int CONSUMERS_PER_PORT            { 1 };
+static constexpr int LOAD_BUFFER_SIZE              { 256 * 1024 };
+static constexpr uint32_t MAX_FRAMED_LENGTH        { 64 * 1024 };
+static constexpr uint32_t FH_PADDING_ONLY          { 1 };      // FramingHeader flags, see network_streamer.cpp
+static constexpr uint8_t PROTO_TYPEC_CODE          { 0xC };
+static constexpr uint8_t PROTO_TYPED_CODE          { 0xD };
+static constexpr uint8_t TSCALE_UTC                { 1 };
+static constexpr uint8_t LAST_SCENE_VALID          { 3 };      // lastSceneBeginSequenceValid | lastSceneEndSequenceValid
+static constexpr uint8_t SCENE_END_VALID           { 8 };      // currentSceneEndSequenceValid
+static constexpr uint8_t RANGE_PRESENT_AND_VALID   { 1 };
+static constexpr int TYPE_D_RETURNS                { 64 };
+static constexpr int TYPE_D_RETURN_SIZE            { 10 };
+
+// Offsets into a packet, after its framing header
+static constexpr int PKT_VERSION_TYPE_OFFSET       { 4 };
+static constexpr int PKT_SEQ_OFFSET                { 9 };
+static constexpr int PKT_TIME_OFFSET               { 21 };
+static constexpr int PKT_FLAGS_OFFSET              { 31 };
+static constexpr int PKT_LAST_SCENE_START_OFFSET   { 32 };     // aolsstartSeq
+static constexpr int PKT_SCENE_START_OFFSET        { 40 };     // aocsstartSeq
+static constexpr int PKT_SCENE_END_OFFSET          { 44 };     // aocsendSeq
+static constexpr int PKT_RETURNS_OFFSET            { 66 };
+static constexpr int RETURN_FLAGS_OFFSET           { 9 };
+
 static const char *SCANPARAM_FORMAT =
     "POST /scan_parameters HTTP/1.1\r\n"
     "Host: localhost\r\n"
@@ -102,12 +132,19 @@ struct thread_context {
 static void usage()
 {
     std::cerr << "usage -- latency_test [-h <addr>] [-r <rawtodepth_port>] [-a <api_port>] [-u <user_tag>] [-n <trials>] [-d <dsp_mode>] [-f <frame_count>] [-?]\n" <<
+                 "         latency_test -t <seconds> [-h <addr>] [-r <rawtodepth_port>] [-H <heads>] [-F <fovs>] [-c <consumers>]\n" <<
                  "         addr            is the IP address of the NCB (default " << IP_ADDR << ")\n" <<
                  "         rawtodepth_port is the port number of the raw to depth output (default " << STREAMING_PORT << ")\n" <<
                  "         user_tag        must be between 0 and " << MAX_USER_TAG << " (default " << USER_TAG << ")\n" <<
                  "         trials          must be greater than 0 (default " << TRIALS << ")\n" <<
                  "         dsp_mode        0 for grid mode or nonzero for stripe mode (default)\n" <<
-                 "         frame_count     number of frames per trial for latency statistics (default " << TARGET_FRAME_COUNT << ")\n";
+                 "         frame_count     number of frames per trial for latency statistics (default " << TARGET_FRAME_COUNT << ")\n" <<
+                 "         seconds         runs in throughput mode for this long instead of the trials: consumes the streams\n" <<
+                 "                         as they are, without any API requests, and reports the sustained rates, the lost\n" <<
+                 "                         packets and the photon to frame latency percentiles\n" <<
+                 "         heads           number of sensor heads to consume (default 1)\n" <<
+                 "         fovs            number of FOV ports per head to consume (default " << FOV_STREAMS_PER_HEAD << ")\n" <<
+                 "         consumers       number of concurrent clients of each port (default " << CONSUMERS_PER_PORT << ")\n";
 }
 
 static int open_stream(const char *ip_addr, short r2d_port)
@@ -147,6 +184,10 @@ static int read_from_sock(int sock, std::array<uint8_t, MAX_PACKET_SIZE> &buf, i
             LLogErr("recv:errno=" << errno);
             return -1;
         }
+        if (numRead == 0) {
+            LLogErr("recv:connection closed");
+            return -1;
+        }
         index += numRead;
     }
     return 0;
@@ -722,6 +763,349 @@ int test_one_time(const char *ip_addr, short r2d_port, short api_port,
     return FAILURE_NONE;
 }
 
+/**
+ * @brief One client of a point cloud port in throughput mode, and what it received
+ *
+ * The counters are only touched by the consumer's thread until it has been joined.
+ **/
+struct load_consumer {
+    int head = 0;
+    int fov = 0;
+    int client = 0;
+    short port = 0;
+    int sock = -1;
+    int result = FAILURE_NONE;
+    std::vector<uint8_t> buf;
+    size_t begin = 0;
+    size_t end = 0;
+
+    uint64_t bytes = 0;
+    uint64_t type_d_packets = 0;
+    uint64_t type_c_packets = 0;
+    uint64_t other_packets = 0;
+    uint64_t points = 0;
+    uint64_t frames = 0;
+    uint64_t incomplete_frames = 0;
+    uint64_t lost_frames = 0;
+    uint64_t untimed_frames = 0;
+    uint64_t gap_events = 0;
+    uint64_t lost_packets = 0;
+    uint64_t type_c_gap_events = 0;
+    std::vector<uint64_t> latency_ns;
+
+    // where the stream is at
+    bool seq_valid = false;
+    uint32_t last_seq = 0;
+    bool type_c_seq_valid = false;
+    uint32_t last_type_c_seq = 0;
+    bool scene_open = false;        // received packets of scene_start, but not its last one
+    bool scene_counted = false;     // received the first packet of scene_start
+    bool scene_known = false;       // scene_start has been seen at all
+    uint32_t scene_start = 0;
+    uint32_t scene_packets = 0;
+    uint64_t scene_min_photon_ns = 0;
+    bool scene_utc = false;
+};
+
+static std::atomic<bool> load_stopping { false };
+
+static inline uint32_t be32(const uint8_t *data)
+{
+    // NOLINTNEXTLINE(readability-magic-numbers) Clearest expression of endian conversion
+    return ((uint32_t)data[0] << 24U) | ((uint32_t)data[1] << 16U) | ((uint32_t)data[2] << 8U) | data[3];
+}
+
+static uint64_t get_now_ns()
+{
+    ptp_time_t now = ZERO_TIME;
+    get_now(now);
+    return now.tv_sec * NSECS_PER_SEC + now.tv_nsec;
+}
+
+// The photon time of a Type D packet, in the same layout as get_packet_time() reads it from a framed packet
+static uint64_t get_photon_ns(const uint8_t *pkt)
+{
+    uint64_t sec = 0;
+    for (int index = 0; index < 6; index++) {                   // NOLINT(readability-magic-numbers) 48-bit seconds
+        sec = (sec << 8U) + pkt[PKT_TIME_OFFSET + index];       // NOLINT(readability-magic-numbers)
+    }
+    return sec * NSECS_PER_SEC + be32(pkt + PKT_TIME_OFFSET + 6); // NOLINT(readability-magic-numbers) 32-bit nanoseconds
+}
+
+// Reads from the socket until at least needed bytes are buffered. Returns false once the stream ends
+static bool load_fill(load_consumer &consumer, size_t needed)
+{
+    if (consumer.end - consumer.begin >= needed) {
+        return true;
+    }
+    if (consumer.begin > 0) {
+        memmove(consumer.buf.data(), consumer.buf.data() + consumer.begin, consumer.end - consumer.begin);
+        consumer.end -= consumer.begin;
+        consumer.begin = 0;
+    }
+    while (consumer.end < needed) {
+        ssize_t numRead = recv(consumer.sock, consumer.buf.data() + consumer.end, consumer.buf.size() - consumer.end, 0);
+        if (numRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (numRead <= 0) {
+            if (!load_stopping.load()) {
+                LLogErr("load_recv:port=" << consumer.port << ",client=" << consumer.client << ",errno=" << (numRead < 0 ? errno : 0));
+                consumer.result = FAILURE_IO;
+            }
+            return false;
+        }
+        consumer.end += numRead;
+        consumer.bytes += numRead;
+    }
+    return true;
+}
+
+static void handle_load_type_d(load_consumer &consumer, const uint8_t *pkt, uint64_t now_ns)
+{
+    consumer.type_d_packets++;
+
+    // the packets of a stream are numbered without gaps, so any gap is a loss
+    uint32_t seq = be32(pkt + PKT_SEQ_OFFSET);
+    if (consumer.seq_valid && seq != consumer.last_seq + 1) {
+        consumer.gap_events++;
+        auto missing = (int32_t)(seq - consumer.last_seq - 1);
+        if (missing > 0) {
+            consumer.lost_packets += missing;
+        }
+    }
+    consumer.seq_valid = true;
+    consumer.last_seq = seq;
+
+    uint8_t flags = pkt[PKT_FLAGS_OFFSET];
+    uint32_t scene_start = be32(pkt + PKT_SCENE_START_OFFSET);
+    if (!consumer.scene_known || scene_start != consumer.scene_start) {
+        // the scene before this one is announced by aolsstartSeq and aolsendSeq; if it isn't the one we saw last, we
+        // missed all of it, and if we saw it but not its last packet, we missed the end of it
+        if (consumer.scene_known && (flags & LAST_SCENE_VALID) == LAST_SCENE_VALID &&
+            be32(pkt + PKT_LAST_SCENE_START_OFFSET) != consumer.scene_start) {
+            consumer.lost_frames++;
+        }
+        if (consumer.scene_open && consumer.scene_counted) {
+            consumer.incomplete_frames++;
+        }
+        consumer.scene_known = true;
+        consumer.scene_open = true;
+        consumer.scene_counted = seq == scene_start;      // a scene joined part way through isn't counted
+        consumer.scene_start = scene_start;
+        consumer.scene_packets = 0;
+        consumer.scene_min_photon_ns = UINT64_MAX;
+        consumer.scene_utc = true;
+    }
+    consumer.scene_packets++;
+
+    const uint8_t *ret = pkt + PKT_RETURNS_OFFSET;
+    for (int index = 0; index < TYPE_D_RETURNS; index++, ret += TYPE_D_RETURN_SIZE) {
+        if ((ret[RETURN_FLAGS_OFFSET] & RANGE_PRESENT_AND_VALID) != 0) {
+            consumer.points++;
+        }
+    }
+
+    // only UTC timestamps can be compared with our clock
+    if ((flags >> 4U) == TSCALE_UTC) {
+        consumer.scene_min_photon_ns = std::min(consumer.scene_min_photon_ns, get_photon_ns(pkt));
+    } else {
+        consumer.scene_utc = false;
+    }
+
+    // the last packet of a scene carries aocsendSeq
+    if ((flags & SCENE_END_VALID) == 0 || seq != be32(pkt + PKT_SCENE_END_OFFSET) || !consumer.scene_open) {
+        return;
+    }
+    consumer.scene_open = false;
+    if (!consumer.scene_counted) {
+        return;
+    }
+    if (consumer.scene_packets != seq - scene_start + 1) {
+        consumer.incomplete_frames++;
+        return;
+    }
+    consumer.frames++;
+    if (consumer.scene_utc && now_ns >= consumer.scene_min_photon_ns) {
+        consumer.latency_ns.push_back(now_ns - consumer.scene_min_photon_ns);
+    } else {
+        consumer.untimed_frames++;
+    }
+}
+
+static void handle_load_type_c(load_consumer &consumer, const uint8_t *pkt)
+{
+    consumer.type_c_packets++;
+
+    // the mapping table is numbered from 0 each time it is sent
+    uint32_t seq = be32(pkt + PKT_SEQ_OFFSET);
+    if (consumer.type_c_seq_valid && seq != 0 && seq != consumer.last_type_c_seq + 1) {
+        consumer.type_c_gap_events++;
+    }
+    consumer.type_c_seq_valid = true;
+    consumer.last_type_c_seq = seq;
+}
+
+// Decodes framed packets straight out of a large receive buffer, so that one recv() serves many packets
+static void load_consumer_run(load_consumer *consumer)
+{
+    consumer->buf.resize(LOAD_BUFFER_SIZE);
+    while (load_fill(*consumer, TCP_HEADER_SIZE)) {
+        const uint8_t *framing = consumer->buf.data() + consumer->begin;
+        uint32_t length = be32(framing);
+        uint32_t flags = be32(framing + 4);                     // NOLINT(readability-magic-numbers) FramingHeader::flags
+        if (length > MAX_FRAMED_LENGTH) {
+            LLogErr("load_bad_length:port=" << consumer->port << ",client=" << consumer->client << ",length=" << length);
+            consumer->result = FAILURE_BAD_PACKET_LENGTH;
+            return;
+        }
+        if (!load_fill(*consumer, TCP_HEADER_SIZE + length)) {
+            return;
+        }
+        uint64_t now_ns = get_now_ns();
+        const uint8_t *pkt = consumer->buf.data() + consumer->begin + TCP_HEADER_SIZE;
+        consumer->begin += TCP_HEADER_SIZE + length;
+
+        if ((flags & FH_PADDING_ONLY) != 0) {
+            continue;
+        }
+        if (length <= PKT_VERSION_TYPE_OFFSET || be32(pkt) != PACKET_MAGIC) {
+            LLogErr("load_bad_magic:port=" << consumer->port << ",client=" << consumer->client << ",length=" << length);
+            consumer->result = FAILURE_BAD_PACKET_LENGTH;
+            return;
+        }
+        uint8_t type = pkt[PKT_VERSION_TYPE_OFFSET] & 0xFU;     // NOLINT(readability-magic-numbers) type is the low 4 bits
+        if (type == PROTO_TYPED_CODE && length >= TYPE_D_LENGTH) {
+            handle_load_type_d(*consumer, pkt, now_ns);
+        } else if (type == PROTO_TYPEC_CODE) {
+            handle_load_type_c(*consumer, pkt);
+        } else {
+            consumer->other_packets++;
+        }
+    }
+}
+
+// NOLINTBEGIN(readability-magic-numbers)
+static const std::array<std::pair<const char *, int>, 5> LATENCY_PERCENTILES {{
+    { "p50=", 500 }, { "p90=", 900 }, { "p99=", 990 }, { "p99.9=", 999 }, { "max=", 1000 }
+}};
+// NOLINTEND(readability-magic-numbers)
+
+static void print_percentiles(const char *name, std::vector<uint64_t> &stat_data)
+{
+    std::cout << "statistics for " << name << std::endl;
+
+    std::sort(stat_data.begin(), stat_data.end());
+    std::cout << "count=" << stat_data.size() << std::endl;
+    if (!stat_data.empty()) {
+        for (const auto &percentile : LATENCY_PERCENTILES) {
+            const char *heading = percentile.first;
+            int permille = percentile.second;
+            size_t index = std::min(stat_data.size() - 1, stat_data.size() * permille / 1000);
+            ptp_time_t value = { stat_data[index] / NSECS_PER_SEC, (uint32_t)(stat_data[index] % NSECS_PER_SEC) };
+            print_time(heading, value);
+        }
+    }
+
+    std::cout << std::endl;
+}
+
+/**
+ * @brief Consumes the point cloud ports of all of the given heads and FOVs for a while, with a number of concurrent
+ * clients on each, and reports what they received
+ *
+ * Nothing is sent to the API, so the streams must already be running. Each client has a thread of its own, which
+ * decodes the Type D and Type C packets as they come, counts the valid points, and detects lost packets from the gaps
+ * in the packet sequence numbers and lost or incomplete frames from the scene sequence numbers (aocsstartSeq and
+ * aocsendSeq of the scene, and aolsstartSeq and aolsendSeq of the one before it). A frame's latency is the time from
+ * the earliest photon time of its packets to the arrival of its last packet, so the clocks of the NCB and of this
+ * host must be synchronized.
+ **/
+static int run_throughput(const char *ip_addr, short base_port, int heads, int fovs, int consumers_per_port, int seconds)
+{
+    std::vector<load_consumer> consumers(heads * fovs * consumers_per_port);
+    auto consumer = consumers.begin();
+    for (int head = 0; head < heads; head++) {
+        for (int fov = 0; fov < fovs; fov++) {
+            for (int client = 0; client < consumers_per_port; client++, consumer++) {
+                consumer->head = head;
+                consumer->fov = fov;
+                consumer->client = client;
+                consumer->port = (short)(base_port + fov + FOV_STREAMS_PER_HEAD * head);
+                consumer->sock = open_stream(ip_addr, consumer->port);
+                if (consumer->sock < 0) {
+                    LLogErr("load_connect:port=" << consumer->port << ",client=" << client);
+                    for (auto &opened : consumers) {
+                        if (opened.sock >= 0) {
+                            close(opened.sock);
+                        }
+                    }
+                    return FAILURE_IO;
+                }
+            }
+        }
+    }
+
+    LLogInfo("load_start:consumers=" << consumers.size() << ",seconds=" << seconds);
+    std::vector<std::thread> threads;
+    threads.reserve(consumers.size());
+    auto start = std::chrono::steady_clock::now();
+    for (auto &started : consumers) {
+        threads.emplace_back(load_consumer_run, &started);
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+    // shutting the sockets down ends each consumer's recv()
+    load_stopping.store(true);
+    for (auto &stopped : consumers) {
+        shutdown(stopped.sock, SHUT_RDWR);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    load_consumer total;
+    int result = FAILURE_NONE;
+    for (auto &done : consumers) {
+        close(done.sock);
+        std::cout << "consumer:head=" << done.head << ",fov=" << done.fov << ",port=" << done.port << ",client=" << done.client <<
+                     ",packets=" << done.type_d_packets << ",pointsPerSec=" << (uint64_t)((double)done.points / elapsed) <<
+                     ",framesPerSec=" << (double)done.frames / elapsed << ",incompleteFrames=" << done.incomplete_frames <<
+                     ",lostFrames=" << done.lost_frames << ",gapEvents=" << done.gap_events << ",lostPackets=" << done.lost_packets <<
+                     ",typeCPackets=" << done.type_c_packets << ",result=" << done.result << std::endl;
+        total.bytes += done.bytes;
+        total.type_d_packets += done.type_d_packets;
+        total.type_c_packets += done.type_c_packets;
+        total.other_packets += done.other_packets;
+        total.points += done.points;
+        total.frames += done.frames;
+        total.incomplete_frames += done.incomplete_frames;
+        total.lost_frames += done.lost_frames;
+        total.untimed_frames += done.untimed_frames;
+        total.gap_events += done.gap_events;
+        total.lost_packets += done.lost_packets;
+        total.type_c_gap_events += done.type_c_gap_events;
+        total.latency_ns.insert(total.latency_ns.end(), done.latency_ns.begin(), done.latency_ns.end());
+        if (done.result != FAILURE_NONE) {
+            result = done.result;
+        }
+    }
+
+    std::cout << "throughput:seconds=" << elapsed << ",consumers=" << consumers.size() <<
+                 ",mbitPerSec=" << (double)total.bytes * 8 / elapsed / 1e6 <<      // NOLINT(readability-magic-numbers)
+                 ",packetsPerSec=" << (uint64_t)((double)total.type_d_packets / elapsed) <<
+                 ",pointsPerSec=" << (uint64_t)((double)total.points / elapsed) <<
+                 ",framesPerSec=" << (double)total.frames / elapsed <<
+                 ",incompleteFrames=" << total.incomplete_frames << ",lostFrames=" << total.lost_frames <<
+                 ",untimedFrames=" << total.untimed_frames << ",gapEvents=" << total.gap_events <<
+                 ",lostPackets=" << total.lost_packets << ",typeCPackets=" << total.type_c_packets <<
+                 ",typeCGapEvents=" << total.type_c_gap_events << ",otherPackets=" << total.other_packets << std::endl << std::endl;
+    print_percentiles("photon to frame latency", total.latency_ns);
+
+    return result;
+}
+
 int main(int argc, char *argv[])
 {
     const char *ip_addr = IP_ADDR;
@@ -731,9 +1115,13 @@ int main(int argc, char *argv[])
     int trials = TRIALS;
     int dsp_mode = STRIPE_DSP_MODE;
     int target_frame_count = TARGET_FRAME_COUNT;
+    int load_seconds = 0;
+    int heads = 1;
+    int fovs = FOV_STREAMS_PER_HEAD;
+    int consumers_per_port = CONSUMERS_PER_PORT;
     int opt;
 
-    while ((opt = getopt(argc, argv, "h:r:a:u:n:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "h:r:a:u:n:d:f:t:H:F:c:")) != -1) {
         switch(opt) {
         case 'h' :
             ip_addr = optarg;
@@ -769,6 +1157,34 @@ int main(int argc, char *argv[])
                  target_frame_count = TARGET_FRAME_COUNT;
             }
             break;
+        case 't' :
+            load_seconds = atoi(optarg);
+            if (load_seconds < 1) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'H' :
+            heads = atoi(optarg);
+            if (heads < 1) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'F' :
+            fovs = atoi(optarg);
+            if (fovs < 1 || fovs > FOV_STREAMS_PER_HEAD) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'c' :
+            consumers_per_port = atoi(optarg);
+            if (consumers_per_port < 1) {
+                usage();
+                return 1;
+            }
+            break;
         default:
             usage();
             return 1;
@@ -781,6 +1197,15 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (load_seconds > 0) {
+        int retVal = run_throughput(ip_addr, r2d_port, heads, fovs, consumers_per_port, load_seconds);
+        if (retVal < 0) {
+            std::cerr << "failed:code=" << retVal << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
     std::vector<ptp_time_t> latency_history;
     latency_history.reserve(trials);
 
@@ -20,6 +20,8 @@
 #include <thread>
 #include <array>
 #include <memory>
+#include <vector>
+#include <algorithm>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -31,12 +33,22 @@
 #include "V4LSensorHeadThread.h"
 #include "MockSensorHeadThread.h"
 #include "LumoLogger.h"
+#include "FastTimers.h"
+#include "FloatVectorPool.h"
+#include "HugePages.h"
+#include "MemoryBudget.h"
+#include "PerfCounters.h"
+#include "DspCapture.h"
+#include "PipelineTrace.h"
 #include "TimeSync.h"
+#include "RawToDepthFactory.h"
+#include "RawToDepthV2_float.h"
 
 constexpr unsigned int MAX_HEADS            { 1 };
 constexpr unsigned int READ_TIMEOUT_MSEC    { 2000 };
 constexpr unsigned int VIDEO_DEVICE         { 3 };
 constexpr unsigned int BASE_FPGA_I2C_ADDR   { 0x10 };
+constexpr uint64_t BYTES_PER_MEGABIT        { 125000 };
 
 #define LOGMASK_WITHOUT_DEBUG (LOG_MASK(LOG_WARNING) | LOG_MASK(LOG_INFO) | LOG_MASK(LOG_ERR))
 #define LOGMASK_WITH_DEBUG (LOGMASK_WITHOUT_DEBUG | LOG_MASK(LOG_DEBUG))
@@ -44,8 +56,30 @@ constexpr unsigned int BASE_FPGA_I2C_ADDR   { 0x10 };
 static int s_numHeads = MAX_HEADS;
 static std::array<std::shared_ptr<SensorHeadThread>, MAX_HEADS> s_shThreads {};
 static int s_listenFd = -1;
+static int s_statsFd = -1;
 static int s_signalFd = -1;
 static int s_exitFd = -1;
+static const char *s_traceFileName = DEFAULT_TRACE_FILE;
+
+constexpr uint8_t SIGNAL_EXIT         { 0 }; // written to the signal socket pair on SIGINT and SIGTERM
+constexpr uint8_t SIGNAL_TOGGLE_TRACE { 1 }; // written to the signal socket pair on SIGUSR1
+
+/**
+ * @brief Internal function that starts the pipeline trace, or stops it and writes the trace file
+ *
+ * @param start true to start tracing, false to stop tracing and write the spans to s_traceFileName
+ */
+static void setTracing(bool start)
+{
+    if (start) {
+        PipelineTrace::start();
+        LLogInfo("trace_start:traceFileName=" << s_traceFileName);
+    } else if (PipelineTrace::enabled()) {
+        PipelineTrace::stop();
+        auto spans = PipelineTrace::write(s_traceFileName);
+        LLogInfo("trace_stop:traceFileName=" << s_traceFileName << ",spans=" << spans);
+    }
+}
 
 /**
  * @brief Internal function to translate control bytes from socket to thread control bytes. See the README.md file for more details.
@@ -108,6 +142,8 @@ void handleAccept(int connectedFd)
                 unsigned int level = LUMO_LOG_INFO + (controlByte & FEC_NOTIFY_DEBUG_LEVEL_MASK);
                 LLogSetLogLevel(level);
                 LLogInfo("set_log_level:level=" << level);
+            } else if ((controlByte & FEC_NOTIFY_TRACE_MASK) == FEC_NOTIFY_TRACE) {
+                setTracing((controlByte & FEC_NOTIFY_TRACE_START) != 0);
             } else {
                 unsigned int headNum = controlByte & FEC_NOTIFY_HEADNUM_MASK;
                 LLogInfo("accept_control:received_byte=" << (int)controlByte << ",headNum=" << headNum);
@@ -139,7 +175,7 @@ struct fe_event {
     event_handler_t handler;
 };
 
-#define MAX_EVENTS 6 // four sensor heads, listenerFd, exitFd
+#define MAX_EVENTS 7 // four sensor heads, listenerFd, statsFd, exitFd
 static std::array<struct fe_event, MAX_EVENTS> s_events{};
 static unsigned int s_numEvents = 0;
 
@@ -160,18 +196,65 @@ static void handleListenEvent(int fileDes)
 }
 
 /**
- * @brief Internal function to handle a read on the signal file descriptor; tells the sensor head threads to exit
+ * @brief Internal function to handle a read on the stats listen file descriptor: writes the latency and health
+ *        reports of all the sensor heads, and the process' buffer pool usage, to the accepted connection and closes it
+ *
+ * @param fileDes The stats listen file descriptor that has available read data
+ */
+static void handleStatsEvent(int fileDes)
+{
+    int connectedFd = accept(fileDes, NULL, NULL);
+    if (connectedFd < 0) {
+        LLogErr("stats_accept:errno=" << errno);
+        return;
+    }
+
+    std::string report;
+    for (int head = 0; head < s_numHeads; head++) {
+        report += s_shThreads.at(head)->getLatencyReport();
+    }
+    report += *FastTimers::getLastReport();
+    if (report.empty()) {
+        report = "no_frames\n";
+    }
+    for (int head = 0; head < s_numHeads; head++) {
+        report += s_shThreads.at(head)->getHealthReport();
+    }
+    const auto pool = FloatVectorPool::getStats();
+    report += "floatPoolBusy=" + std::to_string(pool.numBusy) + ",floatPoolHighWaterBusy=" +
+              std::to_string(pool.highWaterBusy) + ",floatPoolBytes=" + std::to_string(pool.pooledBytes) + "\n";
+    report += MemoryBudget::getReport();
+    report += HugePages::getReport();
+    report += PerfCounters::getReport();
+    report += DspCapture::getReport();
+
+    // The report fits in the socket buffer; never let a slow client stall the main thread
+    if (send(connectedFd, report.data(), report.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        LLogErr("stats_send:errno=" << errno);
+    }
+    shutdown(connectedFd, SHUT_RDWR);
+    close(connectedFd);
+}
+
+/**
+ * @brief Internal function to handle a read on the signal file descriptor; toggles the pipeline trace on SIGUSR1,
+ *        otherwise tells the sensor head threads to exit
  *
  * @param fileDes The listen file descriptor that has available read data
  */
 static void handleSignalEvent(int fileDes)
 {
-    uint8_t zero = 0;
+    uint8_t signalByte = SIGNAL_EXIT;
 
-    if (read(fileDes, &zero, sizeof(zero)) < 0) {
+    if (read(fileDes, &signalByte, sizeof(signalByte)) < 0) {
         LLogErr("read_signal_event:errno=" << errno);
     }
 
+    if (signalByte == SIGNAL_TOGGLE_TRACE) {
+        setTracing(!PipelineTrace::enabled());
+        return;
+    }
+
     for (int head = 0; head < s_numHeads; head++) {
         s_shThreads.at(head)->exitThread();
     }
@@ -274,12 +357,24 @@ static void usage(bool error)
 "                               end will play the mock files in sequence until\n"
 "                               a break in the sequence is found and then\n"
 "                               repeat the sequence again starting from 0000.\n"
+"                               If PATH names a recorded segment file\n"
+"                               ('<base>_ggg.rois'), the recorded session is\n"
+"                               replayed instead.\n"
 "                               If you enable mocking, you must also specify\n"
 "                               the calibration file path using --cal-path and\n"
 "                               the pixel mask file path using --pixmap-path\n"
 "  -t, --mock-delay=DELAY     when mocking is enabled, set the delay (in\n"
 "                               milliseconds) between the times ROIs are\n"
 "                               presented to Raw2Depth\n"
+"  -X, --replay-rate=RATE     when mocking is enabled, present the ROIs to\n"
+"                               Raw2Depth at RATE times the rate given by\n"
+"                               their timestamps (e.g., 1 or 2) instead of\n"
+"                               with a fixed delay, or as fast as Raw2Depth\n"
+"                               takes them if RATE is 'max'; the achieved\n"
+"                               ROI and FOV rates are logged\n"
+"  -L, --replay-loops=NUM     when mocking is enabled, exit after the mock\n"
+"                               data has been played NUM times; 0 (default)\n"
+"                               to repeat forever\n"
 "  -c, --cal-path=PATH        get sensor mapping table from the specified path\n"
 "                               instead of the file provided by the system\n"
 "                               control code\n"
@@ -287,19 +382,145 @@ static void usage(bool error)
 "                               the file provided by the system control code\n"
 "  -n, --num-heads=NUM        set the maximum number of heads to enable; for\n"
 "                               the NCB, the maximum number of heads is 1\n"
-"  -o, --output-prefix=PATH   enable raw output streaming to files; the\n"
-"                               output file names are 'PATH_h_ss_dddd.bin'\n"
-"                               where h is the head number (0-3), ss is the\n"
-"                               session number, and dddd is the ROI number\n"
+"  -o, --output-prefix=PATH   enable raw output streaming to files; each\n"
+"                               session is recorded into segment files named\n"
+"                               'PATH_h_ss_ggg.rois' where h is the head\n"
+"                               number (0-3), ss is the session number, and\n"
+"                               ggg is the segment number\n"
+"  -k, --output-packed        when raw output streaming is enabled, record the\n"
+"                               raw words packed to 12 bits (the bits of\n"
+"                               DEFAULT_RAW_MASK), 25% less data to write\n"
 "  -r, --output-rois=NUM      when raw output streaming is enabled, set the\n"
 "                               maximum number of ROIs that will be output\n"
 "                               in a single session; defaults to 91 of omitted\n"
+"  -I, --dsp-capture=PATH     capture the raw ROIs and the DSP intermediates\n"
+"                               of one grid-mode frame in every N of each FOV\n"
+"                               into files named 'PATH_h_ff_nnnnnn.dsp' and\n"
+"                               'PATH_h_ff_nnnnnn_000.rois', written in the\n"
+"                               background; frames are skipped, not waited\n"
+"                               for, while the writer is behind\n"
+"  -i, --dsp-capture-every=N  when DSP capture is enabled, capture one frame\n"
+"                               in every N (default 100)\n"
 "  --max-net-frames=NUM       stop network streaming after NUM frames; set\n"
 "                               to 0 to disable network output\n"
 "  -s, --start-mode=MODE      set the startup time synchronization mode to\n"
 "                               MODE. Ignored if mocking is eanbled.\n"
 "                               Possible values are none (default), ptp,\n"
 "                               and pps\n"
+"  -B, --v4l-buffers=NUM      set the number of Video for Linux buffers\n"
+"                               (default 32, minimum 2, maximum 64)\n"
+"  -M, --v4l-memory=TYPE      set how the Video for Linux buffers are\n"
+"                               allocated: mmap (default) for driver buffers,\n"
+"                               userptr for buffers allocated by the front end\n"
+"                               from huge pages, or dmabuf for buffers\n"
+"                               allocated from a DMA heap\n"
+"  -H, --dma-heap=PATH        set the DMA heap used by --v4l-memory=dmabuf\n"
+"                               (default /dev/dma_heap/system); for example\n"
+"                               /dev/dma_heap/linux,cma for the CMA heap\n"
+"  -C, --capture-cpu=CPU      run the capture stage of each sensor head on\n"
+"                               processor CPU (default 5); -1 for any\n"
+"  -R, --rtd-cpu=CPU          run the raw to depth stage (per ROI processing)\n"
+"                               on processor CPU (default 5); -1 for any\n"
+"  -O, --output-cpu=CPU       run the output stage (building network packets)\n"
+"                               on processor CPU (default 5); -1 for any\n"
+"  -Q, --rtd-queue-depth=NUM  set the number of ROIs that can be queued\n"
+"                               between the capture and raw to depth stages\n"
+"                               before ROIs are dropped (default 64, minimum\n"
+"                               4, maximum 1024)\n"
+"  -S, --stats-port=PORT      set the TCP port on which the frame latency\n"
+"                               statistics are served (default disabled); each\n"
+"                               connection receives the p50/p99/p999 latency\n"
+"                               of every processing stage of each FOV, from\n"
+"                               the capture of the last ROI of a frame to\n"
+"                               the last packet of its point cloud, followed\n"
+"                               by the throughput, drop and queue depth\n"
+"                               counters of each sensor head and FOV\n"
+"  -T, --trace-file=PATH      write the pipeline trace to PATH (default\n"
+"                               /tmp/frontend_trace.json) when it is stopped;\n"
+"                               tracing is started and stopped with\n"
+"                               'fectrl --trace 1|0' or toggled with SIGUSR1\n"
+"  -U, --udp-group=ADDR       send the point cloud data as UDP datagrams to\n"
+"                               the multicast (or broadcast) address ADDR on\n"
+"                               the base port and up, instead of serving it\n"
+"                               over TCP\n"
+"  -u, --udp-mtu=BYTES        set the MTU of the UDP point cloud datagrams\n"
+"                               (default 1500); 9000 for jumbo frames\n"
+"  -e, --pacing-rate=MBPS     pace each point cloud socket to at most MBPS\n"
+"                               megabits per second instead of line rate\n"
+"                               (default 0: unpaced); UDP sockets are only\n"
+"                               paced with the fq queueing discipline\n"
+"  -g, --fov-stagger=US       hold FOV n back by n times US microseconds\n"
+"                               before sending it over TCP, so that the FOVs\n"
+"                               that complete together don't go out in one\n"
+"                               burst (default 0)\n"
+"  -Z, --shm-name=NAME        also publish the FOVs of sensor head n into the\n"
+"                               shared memory ring NAMEn (e.g. /lumotive_fov0)\n"
+"                               for the consumers on the same board\n"
+"  -J, --record-fovs=PREFIX   also record the FOVs of sensor head n, as sent\n"
+"                               to the network, into indexed segment files\n"
+"                               named 'PREFIX_n_ggg.fovs', written in the\n"
+"                               background; FOVs are dropped, not waited for,\n"
+"                               while the writer is behind\n"
+"  -x, --xyz                  also compute the XYZ point of each pixel with the\n"
+"                               mapping table, for the TCP clients that ask\n"
+"                               for Type F packets\n"
+"  -w, --stream-rows=ROWS     send grid-mode FOVs in segments of at least ROWS\n"
+"                               rows as their ROIs arrive, instead of once\n"
+"                               they are complete (default 0: whole FOVs)\n"
+"  -F, --fixed-point          process grid-mode FOVs with 16-bit fixed-point\n"
+"                               raw frames and integer binning and phase\n"
+"  -D, --dsp-threads=NUM      process the grid-mode frames of all sensor heads\n"
+"                               on one shared pool of NUM threads, usually the\n"
+"                               number of --dsp-cpus, with the heads taking\n"
+"                               turns (default 0: one thread per FOV, maximum 64)\n"
+"  -K, --stripe-batch=NUM     process the stripe-mode ROIs on a thread per FOV\n"
+"                               on the --dsp-cpus instead of the rtd thread,\n"
+"                               taking up to NUM queued stripes at once\n"
+"                               (default 0: on the rtd thread, maximum 16)\n"
+"  -j, --async-ingest         ingest each grid-mode ROI into its FOVs on a\n"
+"                               thread per FOV on the --dsp-cpus, while the\n"
+"                               rtd thread moves on to the next ROI\n"
+"  -a, --load-shedding=LIST   while the grid-mode whole-frame processing of an\n"
+"                               FOV can't keep up with its frame rate, turn\n"
+"                               off its nearest-neighbor filter, then its ghost\n"
+"                               median filter, then use the 3-tap smoothing\n"
+"                               kernel, and restore them once there is\n"
+"                               headroom; the comma-separated low-priority FOVs\n"
+"                               LIST (or none) then also skip every other frame\n"
+"  -W, --prewarm=LIST         before streaming, run a synthetic full-size grid\n"
+"                               frame through each of the comma-separated FOVs\n"
+"                               LIST (or none) of each head, so their buffers\n"
+"                               and threads are set up before the first frame\n"
+"  -E, --dsp-engine=LIST      process FOV 0, 1, ... with the comma-separated\n"
+"                               DSP engines LIST (stripe_float, grid_float\n"
+"                               or grid_fixed), where an empty entry\n"
+"                               keeps the default engines and auto benchmarks\n"
+"                               the grid-mode engines at startup and picks the\n"
+"                               fastest; an FOV in a scan mode its engine can't\n"
+"                               process uses the default engine for that mode\n"
+"  -P, --dsp-cpus=LIST        run the grid-mode whole-frame processing on the\n"
+"                               comma-separated processors LIST (default 4,5:\n"
+"                               the A72s); any for no restriction\n"
+"  -d, --huge-pages=MODE      back the long-lived buffers (raw frames, vector\n"
+"                               pools, frame arenas, CSV mapping tables) with\n"
+"                               huge pages: off (default), thp (transparent)\n"
+"                               or explicit (the hugetlbfs pool for buffers\n"
+"                               that aren't on the heap, falling back to thp)\n"
+"  -N, --memory-budget=MIB    share MIB mebibytes between the memory pools\n"
+"                               (capture buffers, recorders, vector pools,\n"
+"                               FOVs waiting for the network); pools shrink\n"
+"                               or skip FOVs instead of growing past it\n"
+"                               (default 0: no budget, only accounting)\n"
+"  -V, --perf-counters        count the cycles, instructions, cache misses\n"
+"                               and branch misses of each pipeline stage and\n"
+"                               FOV with the hardware performance counters,\n"
+"                               reported on the stats port\n"
+"  -A, --sched-profile=PATH   load the scheduling profile PATH, which assigns\n"
+"                               processors, SCHED_FIFO priorities and memory\n"
+"                               locking to the capture, rtd, output,\n"
+"                               whole_frame, network and timesync threads,\n"
+"                               overriding the CPU options above (see\n"
+"                               sched_profile.conf)\n"
 "  -h, --help                 print this help message\n";
     exit(error ? 1 : 0);
 }
@@ -328,22 +549,24 @@ static void addEvent(int fileDes, event_handler_t handler)
  * @brief Internl function to create listener socket and bind it to the 0.0.0.0 with the specified port
  *
  * @param listenPort The IP port to which the listener is bound; defaults to 1234
+ * @param listenFd Receives the listener socket, or -1 on failure
+ * @param handler The function that handles a connection on the socket
  */
-static int setUpListener(int listenPort)
+static int setUpListener(int listenPort, int *listenFd, event_handler_t handler)
 {
     const int oneOpt = 1;
 
-    s_listenFd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s_listenFd < 0) {
+    *listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*listenFd < 0) {
         LLogErr("listen_socket:errno=" << errno << ":can't create listen socket; shutting down");
         return -1;
     }
 
-    if (setsockopt(s_listenFd, SOL_SOCKET, SO_REUSEADDR, &oneOpt, sizeof(oneOpt)) < 0) {
+    if (setsockopt(*listenFd, SOL_SOCKET, SO_REUSEADDR, &oneOpt, sizeof(oneOpt)) < 0) {
         LLogErr("listen_setsockopt:errno=" << errno << ":can't set sockopt; shutting down");
-        shutdown(s_listenFd, SHUT_RDWR);
-        close(s_listenFd);
-        s_listenFd = -1;
+        shutdown(*listenFd, SHUT_RDWR);
+        close(*listenFd);
+        *listenFd = -1;
         return -1;
     }
 
@@ -351,30 +574,31 @@ static int setUpListener(int listenPort)
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(listenPort);
-    if (bind(s_listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (bind(*listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         LLogErr("listen_bind:errno=" << errno << ":can't bind listen socket; shutting down");
-        shutdown(s_listenFd, SHUT_RDWR);
-        close(s_listenFd);
-        s_listenFd = -1;
+        shutdown(*listenFd, SHUT_RDWR);
+        close(*listenFd);
+        *listenFd = -1;
         return -1;
     }
 
-    if (listen(s_listenFd, 1) < 0) {
+    if (listen(*listenFd, 1) < 0) {
         LLogErr("listen_listen:errno=" << errno << ":listen failed; shutting down");
-        shutdown(s_listenFd, SHUT_RDWR);
-        close(s_listenFd);
-        s_listenFd = -1;
+        shutdown(*listenFd, SHUT_RDWR);
+        close(*listenFd);
+        *listenFd = -1;
         return -1;
     }
-    addEvent(s_listenFd, handleListenEvent);
+    addEvent(*listenFd, handler);
     return 0;
 }
 
 static void handleSignal(int signal)
 {
-    uint8_t zero = 0;
-    if (signal == SIGTERM || signal == SIGINT) {
-        if (write(s_signalFd, &zero, sizeof(zero)) < 0) {
+    uint8_t signalByte = SIGNAL_EXIT;
+    if (signal == SIGTERM || signal == SIGINT || signal == SIGUSR1) {
+        signalByte = signal == SIGUSR1 ? SIGNAL_TOGGLE_TRACE : SIGNAL_EXIT;
+        if (write(s_signalFd, &signalByte, sizeof(signalByte)) < 0) {
             LLogErr("signal_write:errno=" << errno);
         }
     }
@@ -403,6 +627,7 @@ static void setUpSignals(void)
     sigaction(SIGINT, &action, NULL);
     sigaction(SIGTERM, &action, NULL);
     sigaction(SIGPIPE, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
 }
 
 /**
@@ -424,7 +649,129 @@ static startup_mode_enum_t start_mode_for_string(const char *mode)
     return ret;
 }
 
+/**
+ * @brief Internal function to convert the V4L memory type command line option to a v4l2_memory
+ *
+ * @return The memory type, or 0 if the string is not a known memory type
+ */
+static unsigned int v4l_memory_for_string(const char *memory)
+{
+    unsigned int ret = 0;
+    if (strcmp(memory, "mmap") == 0) {
+        ret = V4L2_MEMORY_MMAP;
+    } else if (strcmp(memory, "userptr") == 0) {
+        ret = V4L2_MEMORY_USERPTR;
+    } else if (strcmp(memory, "dmabuf") == 0) {
+        ret = V4L2_MEMORY_DMABUF;
+    } else {
+        LLogErr("unknown V4L memory type " << memory);
+    }
+    return ret;
+}
+
+/**
+ * @brief Internal function to convert a processor list command line option ("4,5", or "any") to processor numbers
+ *
+ * @return false if the string is not a list of processors
+ */
+static bool cpus_for_string(const char *list, std::vector<int> &cpus)
+{
+    cpus.clear();
+    if (strcmp(list, "any") == 0) {
+        return true;
+    }
+    std::istringstream stream(list);
+    std::string cpu;
+    while (std::getline(stream, cpu, ',')) {
+        char *end = nullptr;
+        auto processor = strtol(cpu.c_str(), &end, 10);
+        if (cpu.empty() || *end != '\0' || processor < 0) {
+            LLogErr("bad processor list " << list);
+            return false;
+        }
+        cpus.push_back(int(processor));
+    }
+    return !cpus.empty();
+}
+
+/**
+ * @brief Internal function to parse the comma-separated FOVs of the --load-shedding and --prewarm options into a bit
+ *        mask, e.g. "2,3"
+ */
+static bool fovs_for_string(const char *list, uint32_t &fovMask)
+{
+    fovMask = 0;
+    if (strcmp(list, "none") == 0) {
+        return true;
+    }
+    std::istringstream stream(list);
+    std::string fov;
+    while (std::getline(stream, fov, ',')) {
+        char *end = nullptr;
+        auto fovIdx = strtol(fov.c_str(), &end, 10);
+        if (fov.empty() || *end != '\0' || fovIdx < 0 || fovIdx >= MAX_ACTIVE_FOVS) {
+            LLogErr("bad FOV list " << list);
+            return false;
+        }
+        fovMask |= 1U << fovIdx;
+    }
+    return fovMask != 0;
+}
+
+/**
+ * @brief Internal function to parse the comma-separated DSP engines of the FOVs, e.g. "grid_fixed,,auto"
+ */
+static bool engines_for_string(const char *list, std::vector<std::string> &names)
+{
+    names.clear();
+    std::istringstream stream(list);
+    std::string name;
+    while (std::getline(stream, name, ',')) {
+        if (!name.empty() && name != "auto" && RawToDepthFactory::findEngine(name) == nullptr) {
+            LLogErr("unknown or unbuilt DSP engine " << name);
+            return false;
+        }
+        names.push_back(name);
+    }
+    if (names.size() > MAX_ACTIVE_FOVS) {
+        LLogErr("bad DSP engine list " << list << ": there are " << MAX_ACTIVE_FOVS << " FOVs");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Internal function to format a DSP engine list for logging
+ */
+static std::string optarg_for_engines(const std::vector<std::string> &names)
+{
+    if (names.empty()) {
+        return "<default>";
+    }
+    std::ostringstream list;
+    for (auto name = names.begin(); name != names.end(); name++) {
+        list << (name != names.begin() ? "," : "") << *name;
+    }
+    return list.str();
+}
+
+/**
+ * @brief Internal function to format a processor list for logging
+ */
+static std::string optarg_for_cpus(const std::vector<int> &cpus)
+{
+    if (cpus.empty()) {
+        return "any";
+    }
+    std::ostringstream list;
+    for (auto cpu = cpus.begin(); cpu != cpus.end(); cpu++) {
+        list << (cpu != cpus.begin() ? "," : "") << *cpu;
+    }
+    return list.str();
+}
+
 #define DEFAULT_MAX_ROIS 91
+#define DEFAULT_DSP_CAPTURE_INTERVAL 100
 #define VIDEO_DEVICE_NAME_SIZE 20
 #define EVENT_LOOP_ITERATION_TIME 1000
 
@@ -443,6 +790,7 @@ int main(int argc, char *argv[])
     const char *mockPrefix = nullptr;
     int port = LISTEN_PORT;
     int basePort = -1;
+    int statsPort = 0;
     int mockRoiDelay = -1;
     const char *outPrefix = nullptr;
     int outMaxRois = -1;
@@ -450,21 +798,67 @@ int main(int argc, char *argv[])
     int maxNetFrames = -1;
     const char *calFileName = nullptr;
     const char *pixmapFileName = nullptr;
+    const char *schedProfileName = nullptr;
+    HugePages::Mode hugePageMode = HugePages::Mode::OFF;
+    bool perfCounters = false;
+    uint64_t memoryBudgetMiB = 0;
+    const char *dspCapturePrefix = nullptr;
+    int dspCaptureInterval = DEFAULT_DSP_CAPTURE_INTERVAL;
+    std::vector<std::string> dspEngineNames;
+    bool loadShedding = false;
+    uint32_t lowPriorityFovs = 0;
     startup_mode_enum_t startMode = STARTUP_MODE_NO_TIMESYNC;
+    V4LBufferConfig v4lBufferConfig;
+    SensorHeadStageConfig stageConfig;
+    MockReplayConfig replayConfig;
 
-    constexpr unsigned int NUM_OPTIONS {13}; // Keep this in sync with the array below
+    constexpr unsigned int NUM_OPTIONS {47}; // Keep this in sync with the array below
     const std::array<struct option, NUM_OPTIONS> longOptions = {{
         { "local-port",     required_argument, nullptr, 'l' },
         { "base-port",      required_argument, nullptr, 'b' },
         { "mock-prefix",    required_argument, nullptr, 'm' },
         { "mock-delay",     required_argument, nullptr, 't' },
+        { "replay-rate",    required_argument, nullptr, 'X' },
+        { "replay-loops",   required_argument, nullptr, 'L' },
         { "cal-path",       required_argument, nullptr, 'c' },
         { "pixmap-path",    required_argument, nullptr, 'p' },
         { "num-heads",      required_argument, nullptr, 'n' },
         { "output-prefix",  required_argument, nullptr, 'o' },
+        { "output-packed",  no_argument,       nullptr, 'k' },
         { "output-rois",    required_argument, nullptr, 'r' },
         { "max-net-frames", required_argument, nullptr, 'f' },
         { "start-mode",     required_argument, nullptr, 's' },
+        { "v4l-buffers",    required_argument, nullptr, 'B' },
+        { "v4l-memory",     required_argument, nullptr, 'M' },
+        { "dma-heap",       required_argument, nullptr, 'H' },
+        { "capture-cpu",    required_argument, nullptr, 'C' },
+        { "rtd-cpu",        required_argument, nullptr, 'R' },
+        { "output-cpu",     required_argument, nullptr, 'O' },
+        { "rtd-queue-depth", required_argument, nullptr, 'Q' },
+        { "stats-port",     required_argument, nullptr, 'S' },
+        { "trace-file",     required_argument, nullptr, 'T' },
+        { "udp-group",      required_argument, nullptr, 'U' },
+        { "udp-mtu",        required_argument, nullptr, 'u' },
+        { "pacing-rate",    required_argument, nullptr, 'e' },
+        { "fov-stagger",    required_argument, nullptr, 'g' },
+        { "shm-name",       required_argument, nullptr, 'Z' },
+        { "record-fovs",    required_argument, nullptr, 'J' },
+        { "xyz",            no_argument,       nullptr, 'x' },
+        { "stream-rows",    required_argument, nullptr, 'w' },
+        { "fixed-point",    no_argument,       nullptr, 'F' },
+        { "dsp-threads",    required_argument, nullptr, 'D' },
+        { "stripe-batch",   required_argument, nullptr, 'K' },
+        { "async-ingest",   no_argument,       nullptr, 'j' },
+        { "load-shedding",  required_argument, nullptr, 'a' },
+        { "prewarm",        required_argument, nullptr, 'W' },
+        { "dsp-engine",     required_argument, nullptr, 'E' },
+        { "dsp-cpus",       required_argument, nullptr, 'P' },
+        { "sched-profile",  required_argument, nullptr, 'A' },
+        { "huge-pages",     required_argument, nullptr, 'd' },
+        { "memory-budget",  required_argument, nullptr, 'N' },
+        { "perf-counters",  no_argument,       nullptr, 'V' },
+        { "dsp-capture",    required_argument, nullptr, 'I' },
+        { "dsp-capture-every", required_argument, nullptr, 'i' },
         { "help",           no_argument,       nullptr, 'h' },
         { nullptr,          0,                 nullptr, 0   }
     }};
@@ -472,12 +866,28 @@ int main(int argc, char *argv[])
     LLogDebug("debug_mode::debug mode is enabled");
 
     // NOLINTNEXTLINE(hicpp-vararg) calling Linux vararg API
-    while ((opt = getopt_long(argc, argv, "l:b:m:t:c:p:n:o:r:f:s:h", (const struct option *)longOptions.data(), &optionIndex)) != -1) {
+    while ((opt = getopt_long(argc, argv, "l:b:m:t:X:L:c:p:n:o:kr:f:s:B:M:H:C:R:O:Q:S:T:U:u:e:g:Z:J:xw:FD:K:ja:W:E:P:A:d:N:VI:i:h", (const struct option *)longOptions.data(), &optionIndex)) != -1) {
         switch(opt) {
         case 'l' : port = atoi(optarg); break;
         case 'b' : basePort = atoi(optarg); break;
         case 'm' : mockPrefix = optarg; break;
         case 't' : mockRoiDelay = atoi(optarg); break;
+        case 'X' :
+            if (strcmp(optarg, "max") == 0) {
+                replayConfig.rate = REPLAY_RATE_MAX;
+            } else {
+                replayConfig.rate = atof(optarg);
+                if (replayConfig.rate <= 0) {
+                    usage(true);
+                }
+            }
+            break;
+        case 'L' :
+            if (atoi(optarg) < 0) {
+                usage(true);
+            }
+            replayConfig.loops = atoi(optarg);
+            break;
         case 'n' :
             s_numHeads = atoi(optarg);
             if (s_numHeads > MAX_HEADS || s_numHeads < 0) {
@@ -487,6 +897,9 @@ int main(int argc, char *argv[])
         case 'o' :
             outPrefix = optarg;
             break;
+        case 'k' :
+            stageConfig.recordPacked = true;
+            break;
         case 'r' :
             outMaxRois = atoi(optarg);
             break;
@@ -505,6 +918,152 @@ int main(int argc, char *argv[])
         case 's' :
             startMode = start_mode_for_string(optarg);
             break;
+        case 'B' :
+            v4lBufferConfig.numBuffers = atoi(optarg);
+            if (v4lBufferConfig.numBuffers < MIN_V4L_BUFFERS || v4lBufferConfig.numBuffers > MAX_V4L_BUFFERS) {
+                usage(true);
+            }
+            break;
+        case 'M' :
+        {
+            unsigned int memory = v4l_memory_for_string(optarg);
+            if (memory == 0) {
+                usage(true);
+            }
+            v4lBufferConfig.memory = (enum v4l2_memory)memory;
+            break;
+        }
+        case 'H' :
+            v4lBufferConfig.dmaHeapPath = optarg;
+            break;
+        case 'C' :
+            stageConfig.captureAffinity = atoi(optarg);
+            break;
+        case 'R' :
+            stageConfig.rtdAffinity = atoi(optarg);
+            break;
+        case 'O' :
+            stageConfig.outputAffinity = atoi(optarg);
+            break;
+        case 'Q' :
+            stageConfig.rtdQueueDepth = atoi(optarg);
+            if (stageConfig.rtdQueueDepth < MIN_RTD_QUEUE_DEPTH || stageConfig.rtdQueueDepth > MAX_RTD_QUEUE_DEPTH) {
+                usage(true);
+            }
+            break;
+        case 'S' :
+            statsPort = atoi(optarg);
+            if (statsPort < 0) {
+                usage(true);
+            }
+            break;
+        case 'T' :
+            s_traceFileName = optarg;
+            break;
+        case 'U' :
+            stageConfig.netOutput.udpGroup = optarg;
+            break;
+        case 'u' :
+            if (atoi(optarg) < UDP_MIN_MTU || atoi(optarg) > UDP_JUMBO_MTU) {
+                usage(true);
+            }
+            stageConfig.netOutput.udpMtu = atoi(optarg);
+            break;
+        case 'e' :
+            if (atoi(optarg) < 0) {
+                usage(true);
+            }
+            stageConfig.netOutput.pacingRate = uint64_t(atoi(optarg)) * BYTES_PER_MEGABIT;
+            break;
+        case 'g' :
+            if (atoi(optarg) < 0) {
+                usage(true);
+            }
+            stageConfig.fovStaggerUs = atoi(optarg);
+            break;
+        case 'Z' :
+            if (optarg[0] != '/') {
+                usage(true);
+            }
+            stageConfig.netOutput.shmName = optarg;
+            break;
+        case 'J' :
+            stageConfig.netOutput.recordPrefix = optarg;
+            break;
+        case 'x' :
+            stageConfig.xyzOutput = true;
+            break;
+        case 'w' :
+            if (atoi(optarg) < 0) {
+                usage(true);
+            }
+            stageConfig.streamRows = atoi(optarg);
+            break;
+        case 'F' :
+            stageConfig.fixedPoint = true;
+            break;
+        case 'D' :
+            if (atoi(optarg) < 0) {
+                usage(true);
+            }
+            stageConfig.dspThreads = atoi(optarg);
+            break;
+        case 'K' :
+            if (atoi(optarg) < 0) {
+                usage(true);
+            }
+            stageConfig.stripeBatch = atoi(optarg);
+            break;
+        case 'j' :
+            stageConfig.asyncIngest = true;
+            break;
+        case 'a' :
+            if (!fovs_for_string(optarg, lowPriorityFovs)) {
+                usage(true);
+            }
+            loadShedding = true;
+            break;
+        case 'W' :
+            if (!fovs_for_string(optarg, stageConfig.prewarmFovs)) {
+                usage(true);
+            }
+            break;
+        case 'E' :
+            if (!engines_for_string(optarg, dspEngineNames)) {
+                usage(true);
+            }
+            break;
+        case 'P' :
+            if (!cpus_for_string(optarg, stageConfig.dspCpus)) {
+                usage(true);
+            }
+            break;
+        case 'A' :
+            schedProfileName = optarg;
+            break;
+        case 'd' :
+            if (!HugePages::parseMode(optarg, hugePageMode)) {
+                usage(true);
+            }
+            break;
+        case 'N' :
+            if (atoll(optarg) < 0) {
+                usage(true);
+            }
+            memoryBudgetMiB = uint64_t(atoll(optarg));
+            break;
+        case 'V' :
+            perfCounters = true;
+            break;
+        case 'I' :
+            dspCapturePrefix = optarg;
+            break;
+        case 'i' :
+            dspCaptureInterval = atoi(optarg);
+            if (dspCaptureInterval < 1) {
+                usage(true);
+            }
+            break;
         default :
             usage(true);
             break;
@@ -531,24 +1090,97 @@ int main(int argc, char *argv[])
         pixmapFileName = "";
     }
 
+    // From here on, logging only queues the records, so it doesn't stall the capture and processing threads
+    LumoLogger::startAsync();
+
     // Log the command line arguments
     LLogInfo("s_numHeads=" << s_numHeads);
     LLogInfo("port=" << port);
     LLogInfo("basePort=" << basePort);
     LLogInfo("mockPrefix=\"" << (mockPrefix != nullptr ? mockPrefix : "<none>") << "\"");
     LLogInfo("mockRoiDelay=" << mockRoiDelay);
+    LLogInfo("replayRate=" << replayConfig.rate);
+    LLogInfo("replayLoops=" << replayConfig.loops);
     LLogInfo("calFileName=\"" << (calFileName != nullptr ? calFileName : "<none>") << "\"");
     LLogInfo("pixmapFileName=\"" << (pixmapFileName != nullptr ? pixmapFileName : "<none>") << "\"");
     LLogInfo("outPrefix=\"" << (outPrefix != nullptr ? outPrefix : "<none>") << "\"");
     LLogInfo("outMaxRois=" << outMaxRois);
+    LLogInfo("recordPacked=" << stageConfig.recordPacked);
     LLogInfo("maxNetFrames=" << maxNetFrames);
     LLogInfo("startMode=" << startMode);
+    LLogInfo("v4lBuffers=" << v4lBufferConfig.numBuffers);
+    LLogInfo("v4lMemory=" << v4lBufferConfig.memory);
+    LLogInfo("dmaHeap=\"" << v4lBufferConfig.dmaHeapPath << "\"");
+    LLogInfo("captureCpu=" << stageConfig.captureAffinity);
+    LLogInfo("rtdCpu=" << stageConfig.rtdAffinity);
+    LLogInfo("outputCpu=" << stageConfig.outputAffinity);
+    LLogInfo("rtdQueueDepth=" << stageConfig.rtdQueueDepth);
+    LLogInfo("statsPort=" << statsPort);
+    LLogInfo("traceFileName=\"" << s_traceFileName << "\"");
+    LLogInfo("udpGroup=\"" << (stageConfig.netOutput.udpGroup != nullptr ? stageConfig.netOutput.udpGroup : "<none>") << "\"");
+    LLogInfo("udpMtu=" << stageConfig.netOutput.udpMtu);
+    LLogInfo("pacingRate=" << stageConfig.netOutput.pacingRate);
+    LLogInfo("fovStaggerUs=" << stageConfig.fovStaggerUs);
+    LLogInfo("shmName=\"" << (stageConfig.netOutput.shmName != nullptr ? stageConfig.netOutput.shmName : "<none>") << "\"");
+    LLogInfo("recordPrefix=\"" << (stageConfig.netOutput.recordPrefix != nullptr ? stageConfig.netOutput.recordPrefix : "<none>") << "\"");
+    LLogInfo("xyzOutput=" << stageConfig.xyzOutput);
+    LLogInfo("streamRows=" << stageConfig.streamRows);
+    LLogInfo("fixedPoint=" << stageConfig.fixedPoint);
+    LLogInfo("dspThreads=" << stageConfig.dspThreads);
+    LLogInfo("stripeBatch=" << stageConfig.stripeBatch);
+    LLogInfo("asyncIngest=" << stageConfig.asyncIngest);
+    LLogInfo("loadShedding=" << loadShedding << ",lowPriorityFovs=0x" << std::hex << lowPriorityFovs << std::dec);
+    LLogInfo("prewarmFovs=0x" << std::hex << stageConfig.prewarmFovs << std::dec);
+    LLogInfo("dspCpus=" << optarg_for_cpus(stageConfig.dspCpus));
+    LLogInfo("dspEngines=" << optarg_for_engines(dspEngineNames));
+    LLogInfo("schedProfileName=\"" << (schedProfileName != nullptr ? schedProfileName : "<none>") << "\"");
+    LLogInfo("hugePages=" << HugePages::getModeName(hugePageMode));
+    LLogInfo("memoryBudgetMiB=" << memoryBudgetMiB);
+    LLogInfo("perfCounters=" << perfCounters);
+    LLogInfo("dspCapturePrefix=\"" << (dspCapturePrefix != nullptr ? dspCapturePrefix : "<none>") << "\"");
+    LLogInfo("dspCaptureInterval=" << dspCaptureInterval);
+
+    // Before any threads start, so that they all inherit the TLB miss counter
+    HugePages::configure(hugePageMode);
+    PerfCounters::configure(perfCounters);
+    // Before the heads size their pools from it
+    MemoryBudget::configure(memoryBudgetMiB << 20U);
 
-    if (setUpListener(port) < 0) {
+    // The profile is applied by each thread as it starts, so it's loaded before any of them
+    if (schedProfileName != nullptr) {
+        if (!LumoAffinity::loadProfile(schedProfileName)) {
+            return 1;
+        }
+        if (LumoAffinity::getLockMemory()) {
+            LumoAffinity::lockMemory();
+        }
+    }
+
+    // The benchmark runs the engines on the DSP processors of the profile, once for all of the heads
+    if (std::find(dspEngineNames.begin(), dspEngineNames.end(), "auto") != dspEngineNames.end()) {
+        RawToDepthV2_float::setDspCpus(stageConfig.dspCpus);
+        const auto fastest = RawToDepthFactory::benchmarkGridEngines();
+        std::replace(dspEngineNames.begin(), dspEngineNames.end(), std::string("auto"),
+                     std::string(RawToDepthFactory::findEngine(fastest)->name));
+    }
+    for (const auto &name : dspEngineNames) {
+        stageConfig.fovEngines.push_back(name.empty() ? RtdEngine::NONE : RawToDepthFactory::findEngine(name)->engine);
+    }
+    RawToFovs::setLoadShedding(loadShedding, {}, lowPriorityFovs);
+    if (dspCapturePrefix != nullptr) {
+        DspCapture::configure(dspCapturePrefix, uint32_t(dspCaptureInterval));
+    }
+
+    if (setUpListener(port, &s_listenFd, handleListenEvent) < 0) {
+        return 1;
+    }
+
+    if (statsPort > 0 && setUpListener(statsPort, &s_statsFd, handleStatsEvent) < 0) {
         return 1;
     }
 
     setUpSignals();
+    FastTimers::startPublisher();
 
     std::shared_ptr<TimeSync> timeSyncP = nullptr;
 
@@ -563,7 +1195,9 @@ int main(int argc, char *argv[])
                                                                maxNetFrames,
                                                                calFileName,
                                                                pixmapFileName,
-                                                               basePort);
+                                                               basePort,
+                                                               stageConfig,
+                                                               replayConfig);
             s_shThreads.at(head) = mock;
             threads.at(head) = std::make_shared<std::thread>(MockSensorHeadThread::selfRun, mock.get());
             addEvent(s_shThreads.at(head)->getTrigFd(), handleThreadEvent);
@@ -583,7 +1217,9 @@ int main(int argc, char *argv[])
                                                              pixmapFileName,
                                                              basePort,
                                                              timeSyncP,
-                                                             BASE_FPGA_I2C_ADDR + 2 * head);
+                                                             BASE_FPGA_I2C_ADDR + 2 * head,
+                                                             v4lBufferConfig,
+                                                             stageConfig);
             s_shThreads.at(head) = v4l;
             threads.at(head) = std::make_shared<std::thread>(V4LSensorHeadThread::selfRun, v4l.get());
             addEvent(s_shThreads.at(head)->getTrigFd(), handleThreadEvent);
@@ -599,9 +1235,15 @@ int main(int argc, char *argv[])
         threads.at(head)->join();
         s_shThreads.at(head) = nullptr; // free the memory associated with the shared pointer
     }
+    FastTimers::stopPublisher();
+    DspCapture::flush();
 
     shutdown(s_listenFd, SHUT_RDWR);
     close(s_listenFd);
+    if (s_statsFd >= 0) {
+        shutdown(s_statsFd, SHUT_RDWR);
+        close(s_statsFd);
+    }
     LLogInfo("exiting");
     return 0;
 }
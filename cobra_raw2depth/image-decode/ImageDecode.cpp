@@ -0,0 +1,68 @@
+/**
+ * @file ImageDecode.cpp
+ * @brief A C interface to the decoding of raw ROIs, for Python scripts that load libimage_decode.so through ctypes.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "ImageDecode.h"
+#include "RawToDepthDsp.h"
+#include "RtdMetadata.h"
+
+namespace
+{
+void fillInfo(const RtdMetadata &mdat, ImageDecodeRoiInfo *info)
+{
+  *info = {};
+  info->timestampNs = mdat.getTimestampNs();
+  info->numElements = mdat.getRoiNumElements();
+  info->numPixelElements = info->numElements - MD_ROW_SHORTS;
+  info->roiStartRow = mdat.getRoiStartRow();
+  info->roiNumRows = mdat.getRoiNumRows();
+  info->roiNumColumns = RtdMetadata::getRoiNumColumns();
+  info->roiCounter = mdat.getRoiCounter();
+  info->roiId = mdat.getRoiId();
+  info->sensorMode = mdat.getSensorMode();
+  info->numModulationFrequencies = mdat.getNumModulationFrequencies();
+  info->f0ModulationIndex = mdat.getF0ModulationIndex();
+  info->f1ModulationIndex = mdat.getF1ModulationIndex();
+  info->activeFovsBitmask = mdat.getActiveFovsBitmask();
+  info->doTapAccumulation = mdat.getDoTapAccumulation() ? 1 : 0;
+}
+} // namespace
+
+int32_t imageDecodeRoiInfo(const uint16_t *roi, uint32_t numBytes, ImageDecodeRoiInfo *info)
+{
+  if (numBytes < MD_ROW_BYTES)
+  {
+    return IMAGE_DECODE_ERROR_SHORT_INPUT;
+  }
+  fillInfo(RtdMetadata(roi, numBytes), info);
+  return 0;
+}
+
+int32_t imageDecodeRoi(const uint16_t *roi, uint32_t numBytes, float *pixels, uint32_t numPixels, ImageDecodeRoiInfo *info)
+{
+  auto result = imageDecodeRoiInfo(roi, numBytes, info);
+  if (result < 0)
+  {
+    return result;
+  }
+  if (uint64_t(info->numElements) * sizeof(uint16_t) > numBytes)
+  {
+    return IMAGE_DECODE_ERROR_SHORT_INPUT;
+  }
+  if (info->numPixelElements > numPixels)
+  {
+    return IMAGE_DECODE_ERROR_SHORT_OUTPUT;
+  }
+  RawToDepthDsp::sh2f(roi + MD_ROW_SHORTS, pixels, info->numPixelElements, INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask());
+  return int32_t(info->numPixelElements);
+}
+
+int32_t imageDecodeWords(const uint16_t *words, uint32_t numWords, float *dst, uint32_t shiftr, uint16_t rawMask)
+{
+  RawToDepthDsp::sh2f(words, dst, numWords, shiftr, rawMask);
+  return int32_t(numWords);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file ImageDecode.h
+ * @brief A C interface to the decoding of raw ROIs, for Python scripts that load libimage_decode.so through ctypes.
+ *
+ * The image reader of cobra_system_control passes its buffers and numpy arrays by pointer, so that the ROIs are
+ * decoded straight from the received buffer into the caller's arrays, without going through Python bytes or
+ * intermediate numpy conversions. The metadata is decoded by RtdMetadata and the pixels are converted to float by
+ * RawToDepthDsp::sh2f(), exactly as the raw to depth pipeline does it.
+ *
+ * All functions return a negative IMAGE_DECODE_ERROR_* if a buffer is too small for the ROI.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <cstdint>
+
+extern "C" {
+
+constexpr int32_t IMAGE_DECODE_ERROR_SHORT_INPUT  { -1 }; ///< The input doesn't hold the metadata row, or the pixels it announces.
+constexpr int32_t IMAGE_DECODE_ERROR_SHORT_OUTPUT { -2 }; ///< The output can't hold all of the pixels of the ROI.
+
+/**
+ * @brief The metadata fields of a ROI that the calibration and bring-up scripts use.
+ */
+struct ImageDecodeRoiInfo
+{
+  uint64_t timestampNs;
+  uint32_t numElements;             ///< The 16-bit words of the ROI, including the metadata row
+  uint32_t numPixelElements;        ///< The 16-bit words after the metadata row
+  uint16_t roiStartRow;
+  uint16_t roiNumRows;
+  uint16_t roiNumColumns;
+  uint16_t roiCounter;
+  uint16_t roiId;
+  uint16_t sensorMode;
+  uint16_t numModulationFrequencies;
+  uint16_t f0ModulationIndex;
+  uint16_t f1ModulationIndex;
+  uint16_t activeFovsBitmask;
+  uint16_t doTapAccumulation;       ///< 1 if the taps are accumulated by the CPU, so there are NUM_GPIXEL_PERMUTATIONS of them
+  uint16_t reserved;
+};
+
+/**
+ * @brief Decodes the metadata row of the ROI of numBytes bytes at roi into info.
+ *
+ * @return 0
+ */
+int32_t imageDecodeRoiInfo(const uint16_t *roi, uint32_t numBytes, ImageDecodeRoiInfo *info);
+
+/**
+ * @brief Decodes the metadata of a ROI into info, and converts its pixels to float into pixels, which has room
+ * for numPixels values, with the same shift and mask as the raw to depth ingest.
+ *
+ * @return The number of pixel values written, info->numPixelElements
+ */
+int32_t imageDecodeRoi(const uint16_t *roi, uint32_t numBytes, float *pixels, uint32_t numPixels, ImageDecodeRoiInfo *info);
+
+/**
+ * @brief Converts numWords raw words without metadata to float with the given shift and mask.
+ *
+ * @return numWords
+ */
+int32_t imageDecodeWords(const uint16_t *words, uint32_t numWords, float *dst, uint32_t shiftr, uint16_t rawMask);
+
+}
@@ -9,6 +9,8 @@
 #include "cobra_net_pipeline.hpp"
 #include "network_streamer.hpp"
 #include "LumoLogger.h"
+#include "PerfCounters.h"
+#include "MemoryBudget.h"
 #include <cstdio>
 #include <ctime>
 #include <cstring>
@@ -24,7 +26,6 @@ using namespace LidarPipeline;
 #define NUM_TOTAL_CHANNELS_PER_LOOK_ANGLE (NUM_VIRT_CHANNELS_PER_CPI * NUM_VIRT_CPI_PER_LOOK_ANGLE)
 
 #define NUM_FRAME_BUFFERS 5
-#define NUM_CPI_BUFFERS (NUM_LOOK_ANGLES * NUM_VIRT_CPI_PER_LOOK_ANGLE * NUM_FRAME_BUFFERS)
 
 #define FAKED_FRAME_TIME_US 100000 
 
@@ -47,13 +48,31 @@ using namespace LidarPipeline;
 #define NET_RAWDATA_BUFFER_SOFT_LIMIT   (NET_RAWDATA_FRAME_SIZE * 1L)
 #define NET_RAWDATA_BUFFER_HARD_LIMIT   (NET_RAWDATA_FRAME_SIZE * 2L)
 
-constexpr unsigned int PTP_TIMESTAMP_COARSE_SIZE    { 6 };
-constexpr unsigned int PTP_TIMESTAMP_FINE_SIZE      { 4 };
+namespace {
 
-CobraNetPipelineWrapper::CobraNetPipelineWrapper(int sensorHeadNum, int maxNetFrames, int basePort)
+// The memory of the planes that a FOV holds while it waits for the network
+uint64_t FovPlaneBytes(const FovSegment &fov)
 {
+    uint64_t bytes = 0;
+    for (const auto &plane : { fov.getRange(), fov.getSnr(), fov.getSignal(), fov.getBackground(), fov.getRoiIndexRows() })
+    {
+        bytes += plane ? plane->capacity() * sizeof(uint16_t) : 0;
+    }
+    bytes += fov.getXyz() ? fov.getXyz()->capacity() * sizeof(int32_t) : 0;
+    bytes += fov.getTimestamps() ? fov.getTimestamps()->capacity() * sizeof(uint64_t) : 0;
+    return bytes;
+}
 
-  m_mm = new PipelineDataMM(NUM_FRAME_BUFFERS, NUM_CPI_BUFFERS, this->outputType_);
+}
+
+CobraNetPipelineWrapper::CobraNetPipelineWrapper(int sensorHeadNum, int maxNetFrames, int basePort, std::shared_ptr<FrameLatency> frameLatency,
+                                                 int traceHead, std::shared_ptr<NetworkEventLoop> eventLoop,
+                                                 const NetOutputConfig &netOutput, std::shared_ptr<ShmFovPublisher> shmPublisher,
+                                                 std::shared_ptr<FovRecorder> fovRecorder)
+  : m_shmPublisher(std::move(shmPublisher)), m_fovRecorder(std::move(fovRecorder))
+{
+
+  m_mm = new PipelineDataMM(NUM_FRAME_BUFFERS, this->outputType_);
 
   if((sensorHeadNum >= NET_OUTPUT_MAX_PORTS) || (sensorHeadNum < 0)) {
       LLogErr("CobraNetPipelineWrapper maximum TCP port count exceeded");
@@ -64,68 +83,51 @@ CobraNetPipelineWrapper::CobraNetPipelineWrapper(int sensorHeadNum, int maxNetFr
     basePort = NET_OUTPUT_BASE_PORT;
   }
 
-  m_ns = new TCPWrappedStreamer(1, 1, basePort + sensorHeadNum, NET_SEND_BUFFER, this->outputType_);
+  if (netOutput.udpGroup != nullptr) {
+    m_ns = new UDPStreamer(1, 1, netOutput.udpGroup, basePort + sensorHeadNum, netOutput.udpMtu, this->outputType_,
+                           netOutput.pacingRate);
+  } else {
+    if (!eventLoop) {
+      eventLoop = std::make_shared<NetworkEventLoop>("net_loop port " + std::to_string(basePort + sensorHeadNum), traceHead);
+    }
+
+    // Clients more than a couple of frames behind are evicted
+    NetworkPacing pacing;
+    pacing.rateBytesPerSec = netOutput.pacingRate;
+    pacing.sendDelayNs = uint64_t(netOutput.sendDelayUs) * 1000U;
+    m_tcp = new TCPWrappedStreamer(1, 1, basePort + sensorHeadNum, NET_SEND_BUFFER, NET_BUFFER_HARD_LIMIT, this->outputType_,
+                                   std::move(eventLoop), pacing);
+    m_ns = m_tcp;
+  }
 
   m_iteration = 0;
   m_submittedFrames = 0;
   m_skippedFrames = 0;
+  m_budgetSkippedFrames = 0;
+  m_freeChunks = m_mm->GetReturnChunkPoolCapacity();
 
   m_latchMetaUpdateNeeded = false;
 
   m_ns->set_dbg_MaxFrames(maxNetFrames);
+  m_ns->SetFrameLatency(std::move(frameLatency));
 
-  if(!m_ns->SetCircularBufferSize(NUM_FRAME_BUFFERS+1))
-  {
-    LLogErr("CobraNetPipelineWrapper set circular buffer size failed");
-    exit(1);
-  }
-
+  // Encode on the caller's thread; the event loop does the sending (or the caller, for UDP)
+  m_ns->SetInline(true);
   m_ns->SetMemMgr(m_mm);
   m_ns->StartModule();
 }
 
-constexpr uint64_t SHIFT32                  { 32 };
-constexpr uint64_t PTP_COARSE_MASK          { 0x0000FFFFFFFFFFFF };
-constexpr uint64_t PTP_FINE_MASK            { 0x3FFFFFFF };
-constexpr uint64_t ARB_TIME_FILTER          { 0x40000000 }; // coarse timestamps before this time (Y2004) are considered ARB and not UTC
-constexpr uint32_t FPGA_TIMESTAMP_UNITS     { 10U };        // FPGA fine timestamps are in 10ns units
-
-// If using chunky timestamps instead of frame-based timestamps,
-// pick/generate a "nominal" by TBD policy, then overwrite standard/frame-based
-// timestamp with that for this packet/chunk. If no points were "valid" in this
-// chunk don't overwrite the old style frame timestamp.
-static inline void fillInTimestamp(CPIReturn *cpir,
-                                   std::vector<uint16_t> &seenRoiIndices,
-                                   std::vector<std::vector<uint32_t>> &fullTimestampByIdxVector)
-{
-    std::vector<uint32_t>& medianTimestamp = fullTimestampByIdxVector.at(0);
-    if (!seenRoiIndices.empty())
-    {
-        size_t count = seenRoiIndices.size();
-                
-        // Data/scene dependent selections
-        std::sort(seenRoiIndices.begin(), seenRoiIndices.end());
-        uint16_t medianRoiIdx = seenRoiIndices[count / 2];
-
-        medianTimestamp = fullTimestampByIdxVector.at(medianRoiIdx);
-    }
-
-    uint64_t coarse = ((uint64_t)medianTimestamp[2] << SHIFT32) + medianTimestamp[1];
-    uint64_t ptp_sec = htobe64((coarse) & PTP_COARSE_MASK);
-    uint32_t ptp_nsec = htobe32((medianTimestamp[0] & PTP_FINE_MASK) * FPGA_TIMESTAMP_UNITS);
-
-    memcpy(cpir->timestamp.data(), ((uint8_t *)&ptp_sec) + 2, PTP_TIMESTAMP_COARSE_SIZE);
-    memcpy(&(cpir->timestamp.at(PTP_TIMESTAMP_COARSE_SIZE)), ((uint8_t *)&ptp_nsec), PTP_TIMESTAMP_FINE_SIZE);
-    cpir->tscale = coarse < ARB_TIME_FILTER ? TimestampScale::ARB : TimestampScale::UTC;
-}
-
-// Reformat Cobra frames into Barracuda/Thunderbird-style CPIs
+// Hand a Cobra FOV to the network streamer, which encodes it straight into
+// Barracuda/Thunderbird-style Type D packets (and/or compressed Type E packets, for the clients
+// that asked for them) on this thread and queues them for the event loop. The segments of an FOV
+// that is streamed in row bands are sent as they come, continuing the scene of the FOV
 void CobraNetPipelineWrapper::HandInCobraDepth(std::shared_ptr<FovSegment> processedFov)
 {
     if (!processedFov)
     {
         return;
     }
+    auto perfCounters = PerfCounters::Scoped(PERF_STAGE_NET_HAND_IN, processedFov->getFovIdx());
 
     if(processedFov->isNewMappingTableAvailable())
     {
@@ -137,186 +139,126 @@ void CobraNetPipelineWrapper::HandInCobraDepth(std::shared_ptr<FovSegment> proce
     // Will only update if stream is not active
     m_ns->setDeviceID(processedFov->getSensorId());
 
-    auto ranges = processedFov->getRange();
-    auto signals = processedFov->getSignal();
-    auto snr = processedFov->getSnrSquared();
-    auto background = processedFov->getBackground();
-    auto roiIdx = processedFov->getRoiIndexFov();
-    
-    // Makes using operator[] easier
-    auto *rangeVector = ranges.get();
-    auto *signalVector = signals.get();
-    auto *snrVector = snr.get();
-    auto *bgVector = background.get();
-    auto *roiIdxVector = roiIdx.get();
-
-    // Indexed by ROI Index, *not* image coordinates (one level of indirection not present in other
-    // data)
-    auto fullTimestampByIdx = processedFov->getTimestampsVec();
-    auto *fullTimestampByIdxVector = fullTimestampByIdx.get();
-
-    // TODO: Accept some subset of these vectors -- even more urgent for SWDL
+    // The signal, SNR and background are optional (see RtdMetadata::getOutputPlanes()), and are
+    // sent as absent when the FOV doesn't output them
     // MAYBE: If timestamps aren't available, just override policy/configuration (not yet present)
     //        for chunky timestamps
-    if (rangeVector == nullptr ||
-        signalVector == nullptr ||
-        snrVector == nullptr ||
-        bgVector == nullptr || 
-        roiIdxVector  == nullptr || 
-        fullTimestampByIdxVector == nullptr)
+    if (processedFov->getRange() == nullptr ||
+        processedFov->getRoiIndexRows() == nullptr ||
+        processedFov->getTimestampsVec() == nullptr)
     { // valid data not available.
+        m_skippedFrames++;
         return;
     }
 
-    // Image Size
-    std::vector<uint32_t> sizes = processedFov->getImageSize();
-    uint32_t sizeSteerDim = sizes[0];
-    uint32_t sizeStareDim = sizes[1];
-
-    // Image Steps
-    std::vector<uint32_t> steps = processedFov->getMappingTableStep();
-    uint32_t stepSteerDim = steps[0];
-    uint32_t stepStareDim = steps[1];
-
-    // Image Top Left
-    std::vector<uint32_t> topLeft = processedFov->getMappingTableTopLeft();
-    auto tlSteerDimRaw = static_cast<int32_t>(topLeft[0]);
-    auto tlStareDimRaw = static_cast<int32_t>(topLeft[1]);
-//  tlSteerDimRaw -= stepSteerDim / 2;
-//  tlStareDimRaw -= stepStareDim / 2;
-//  assert(tlSteerDimRaw >= 0);
-//  assert(tlStareDimRaw == 0);
-    uint32_t tlSteerDim = tlSteerDimRaw; 
-    uint32_t tlStareDim = tlStareDimRaw;
-
-
-    // Binning
-    //size_t bc = processedFov->getBinning();
-    //(void) bc; // Nothing for now -- put in metadata someday?
+    // Local consumers read the planes straight out of shared memory
+    if (m_shmPublisher)
+    {
+        m_shmPublisher->Publish(*processedFov, processedFov->isNewMappingTableAvailable());
+    }
 
-    // Network level dimensions
-    size_t steerAngles = sizeSteerDim;
-    size_t stareSteps = (sizeStareDim + (NUM_CHANNELS_PER_TYPE2_PACKET - 1))/ NUM_CHANNELS_PER_TYPE2_PACKET;
+    // Recorded on this thread as well; the recorder drops the FoV rather than wait for the disk
+    if (m_fovRecorder)
+    {
+        m_fovRecorder->Record(*processedFov, processedFov->isNewMappingTableAvailable());
+    }
 
     // If we're out of returnchunk pool we'll generate a warning for now
     ReturnChunk *returnChunk = m_mm->GetReturnChunk();
+    m_freeChunks.store(m_mm->GetNumAvailableReturnChunk(), std::memory_order_relaxed);
     if(returnChunk == nullptr)
     {
         LLogWarning("NetWrapper/TCP: No Return Chunk available. Skipping ROI.");
+        m_skippedFrames++;
         return;
     }
 
-    // Allocate and Fill-In Full Scene of Data
-    // Note from X10/X20, we implicitly have 64 channels everywhere, and
-    // we generate 10 "virtual CPIs" per look angle
-    for (unsigned int i = 0; i < steerAngles; i++)
+    // Past the memory budget, the FOV is skipped rather than queued behind another one still in flight; with
+    // none in flight, it is sent anyway so that the output keeps going
+    const uint64_t fovBytes = FovPlaneBytes(*processedFov);
+    if (!MemoryBudget::tryAccount(MEMORY_POOL_NET_FOVS, fovBytes))
     {
-        for (unsigned int j = 0; j < stareSteps; j++)
+        if (m_mm->GetNumAvailableReturnChunk() + 1 < m_mm->GetReturnChunkPoolCapacity())
         {
-            uint32_t pktNum = i * stareSteps + j;
-
-            // Allocate
-            CPIReturn *cpir = m_mm->GetCPIReturn();
-
-            returnChunk->cpiReturns.at(pktNum) = cpir;
-            returnChunk->cpiReturnsUsed++; // TODO: Move me into the index above, kill pktNum
-
-            // Looks like we've passed all the potential drop points -- transfer the
-            // latched metadata update signal as a one-shot
-            if(m_latchMetaUpdateNeeded)
+            if (m_budgetSkippedFrames.fetch_add(1, std::memory_order_relaxed) == 0)
             {
-                cpir->prefixMetaDataUpdate = true;
-                m_latchMetaUpdateNeeded = false;
+                LLogWarning("net_fov_budget:fovIdx=" << processedFov->getFovIdx() << ",bytes=" << fovBytes <<
+                            ":over the memory budget; skipping FOVs while others are in flight");
             }
-
-            // Update calibration table pointers regardless of if we're sending a
-            // metadata update immediately. May need them later, and should do it
-            // coherently from the same thread that may be reading
-            cpir->calibrationX = processedFov->getCalibrationX();
-            cpir->calibrationY = processedFov->getCalibrationY();
-            cpir->calibrationTheta = processedFov->getCalibrationTheta();
-            cpir->calibrationPhi = processedFov->getCalibrationPhi();
-
-            // Fill in Header
-            cpir->completeSizeSteerDim = sizeSteerDim;
-            cpir->completeSizeStareDim = sizeStareDim;
-
-            cpir->startingSteerOrder = i;
-            cpir->startingStareOrder = NUM_CHANNELS_PER_TYPE2_PACKET * j;
-
-            // Hack in SWDL variable vertical crop and bin for now
-            cpir->bs_SteerOffset = (tlSteerDim + i * stepSteerDim);
-            cpir->bs_SteerStep = stepSteerDim;
-            cpir->bs_StareOffset = (tlStareDim + cpir->startingStareOrder * stepStareDim);
-            cpir->bs_StareStep = stepStareDim;
-
-            // And hack in user tag, too
-            cpir->bs_UserTag = processedFov->getUserTag();
-
-            // Are we the last packet of the frame?
-            cpir->metaLastCpiInFrame = (i == steerAngles - 1) && (j == stareSteps - 1);
-
-            // Copy out
-            std::vector<uint16_t> seenRoiIndices;
-            seenRoiIndices.reserve(NUM_CHANNELS_PER_TYPE2_PACKET);
-
-            for (uint32_t channel = 0; channel < NUM_CHANNELS_PER_TYPE2_PACKET; channel++)
-            {
-                if((channel + cpir->startingStareOrder) >= cpir->completeSizeStareDim)
-                {
-                    break;
-                }
-
-                size_t inIndex = cpir->startingSteerOrder * sizeStareDim + cpir->startingStareOrder + channel;
-
-                if((*rangeVector)[inIndex] != 0)
-                {
-                    cpir->rangeValid.at(channel) = true;
-                    cpir->range.at(channel) = (*rangeVector)[inIndex];
-
-                    // Note that we only select a "chunky" timestamp from/with candidates whose points were deemed 
-                    // present/valid
-                    seenRoiIndices.push_back(roiIdxVector->at(inIndex));
-                }
-                cpir->intensityValid.at(channel) = true;
-                cpir->intensity.at(channel) = (*signalVector)[inIndex];
-                cpir->backgroundValid.at(channel) = true;
-                cpir->background.at(channel) = (*bgVector)[inIndex];
-                cpir->snrValid.at(channel) = true;
-                cpir->snr.at(channel) = (*snrVector)[inIndex];
-            }
-
-            fillInTimestamp(cpir, seenRoiIndices, *fullTimestampByIdxVector);
+            m_mm->RecycleReturnChunk(returnChunk);
+            m_skippedFrames++;
+            return;
         }
+        MemoryBudget::account(MEMORY_POOL_NET_FOVS, int64_t(fovBytes));
     }
+    returnChunk->budgetBytes = fovBytes;
 
+    // Looks like we've passed all the potential drop points -- transfer the
+    // latched metadata update signal as a one-shot
+    returnChunk->prefixMetaDataUpdate = m_latchMetaUpdateNeeded;
+    m_latchMetaUpdateNeeded = false;
+
+    returnChunk->frameTrace = processedFov->getFrameTrace();
+    returnChunk->fov = std::move(processedFov);
+    if (returnChunk->frameTrace.valid())
+    {
+        returnChunk->frameTrace.stamp(TRACE_CHUNK_BUILT);
+    }
     m_ns->HandChunkIn(returnChunk);
 }
 
+NetPipelineStats CobraNetPipelineWrapper::GetStats() const
+{
+    NetPipelineStats stats {};
+    stats.submitted = m_submittedFrames.load(std::memory_order_relaxed);
+    stats.skipped = m_skippedFrames.load(std::memory_order_relaxed);
+    stats.budgetSkipped = m_budgetSkippedFrames.load(std::memory_order_relaxed);
+    stats.freeChunks = m_freeChunks.load(std::memory_order_relaxed);
+    stats.chunkCapacity = m_mm->GetReturnChunkPoolCapacity();
+    if (m_tcp != nullptr)
+    {
+        stats.network = m_tcp->GetStreamStats();
+    }
+    return stats;
+}
+
 // Raw Data
-CobraRawDataNetPipelineWrapper::CobraRawDataNetPipelineWrapper(int sensorHeadNum, int maxNetFrames, unsigned int numROIsInBuffer) {
+CobraRawDataNetPipelineWrapper::CobraRawDataNetPipelineWrapper(int sensorHeadNum, int maxNetFrames, unsigned int numROIsInBuffer,
+                                                               std::shared_ptr<NetworkEventLoop> eventLoop) :
+    m_sensorHeadNum(sensorHeadNum) {
 
-    m_mm = new PipelineDataMM(numROIsInBuffer, 0, this->outputType_);
-    m_ns = new TCPWrappedStreamer(1, 1, NET_OUTPUT_RAWDATA_BASE_PORT + sensorHeadNum, NET_RAWDATA_SEND_BUFFER, this->outputType_);
+    m_mm = new PipelineDataMM(numROIsInBuffer, this->outputType_);
+    if (!eventLoop) {
+        eventLoop = std::make_shared<NetworkEventLoop>("raw_stream", sensorHeadNum);
+    }
+
+    // Clients that fall a whole buffer of ROIs behind are evicted
+    m_ns = new TCPWrappedStreamer(1, 1, NET_OUTPUT_RAWDATA_BASE_PORT + sensorHeadNum, NET_RAWDATA_SEND_BUFFER,
+                                  (size_t)numROIsInBuffer * ROI_SIZE, this->outputType_, std::move(eventLoop));
 
     m_ns->set_dbg_MaxFrames(-1); // always disable max frame count. We could add at some point max ROI count but for now
                                  // we can simply specify the desired number of ROIs on the receiving end
 
-    if(!m_ns->SetCircularBufferSize((size_t) numROIsInBuffer+1)) {
-        LLogErr("CobraNetPipelineWrapper set circular buffer size failed");
-        exit(1);
-    }
-
+    // Queue the ROIs on the caller's thread; the event loop does the sending
+    m_ns->SetInline(true);
     m_ns->SetMemMgr(m_mm);
     m_ns->StartModule();
 }
 
-bool CobraRawDataNetPipelineWrapper::HandInCobraROI(const char *roi, int roiSize, bool firstRawRoi)
+/**
+ * @brief Hands a raw ROI to the raw data network pipeline
+ *
+ * @param roi        Pointer to the ROI, metadata first
+ * @param roiSize    Size of the ROI in bytes
+ * @param firstRawRoi True for the first ROI after raw streaming was (re)started
+ * @param sharedRoi  Optional reference-counted handle to the same ROI. If set, the handle is held until the
+ *                   ROI has been sent instead of copying the ROI; the producer must not reuse the buffer
+ *                   until the last handle is released.
+ *
+ * @return true if the ROI was accepted by the pipeline
+ */
+bool CobraRawDataNetPipelineWrapper::HandInCobraROI(const char *roi, int roiSize, bool firstRawRoi, std::shared_ptr<const char> sharedRoi)
 {
-
-    static bool fovTransmitInProgress = false;
-    static uint16_t numROIs = 0;
-
     if (roiSize != ROI_SIZE) {
         LLogErr("RawData/NetWrapper: roi passed on has the wrong size: " << roiSize <<
                 " (actual) vs " << ROI_SIZE << " (expected)");
@@ -328,73 +270,61 @@ bool CobraRawDataNetPipelineWrapper::HandInCobraROI(const char *roi, int roiSize
         return false;
     }
 
+    if (++m_stats.handedIn % RAW_STREAM_STATS_INTERVAL == 0) {
+        RawStreamStats stats = GetStats();
+        LLogInfo("raw_stream_stats:head=" << m_sensorHeadNum << ",handedIn=" << stats.handedIn <<
+                 ",skipped=" << stats.skipped << ",cutShort=" << stats.cutShort << ",queued=" << stats.network.queued <<
+                 ",dropped=" << stats.network.dropped << ",sends=" << stats.network.sends <<
+                 ",evictedClients=" << stats.evictedClients);
+        uint64_t drops = stats.network.dropped + stats.cutShort;
+        if (drops != m_reportedDrops) {
+            LLogWarning("raw_stream_drops:head=" << m_sensorHeadNum << ",dropped=" << stats.network.dropped <<
+                        ",cutShort=" << stats.cutShort << ":raw stream clients fell behind");
+            m_reportedDrops = drops;
+        }
+    }
+
     if (firstRawRoi) {
-        fovTransmitInProgress = false;
-        numROIs = 0;
+        m_fovInProgress = false;
+        m_fovRois = 0;
     }
 
     // Read the ROI start/stop flags from the metadata
     // We will be focusing on transmitting the raw data for FoV 0. All other FoVs are ignored.
-    // We will drop entire frames of FoV 0 to make sure that we aren't slowing down other processes.
+    // A FoV is streamed from its first ROI on, if anyone is listening, up to the ROI that completes it. If the
+    // network has no room for some of it, the rest of the FoV is skipped and streaming picks up at the next one.
     RtdMetadata metadata((uint16_t *) roi, roiSize);
 
     if (!metadata.getIsFovActive(0))
     { // if this ROI does not contain data for FOV 0, skip it
-        return false;
-    }
-    if (metadata.getFovNumRois(0) > m_mm->GetReturnChunkPoolCapacity()) // Need to make sure that the memory pool size is large enough for 1 frame
-    {
-        LLogErr("RawData/NetWrapper: Attempting to output raw ROIs but the memory pool size ("
-                << m_mm->GetReturnChunkPoolCapacity() << ") is smaller than the number of ROIs ("
-                << metadata.getFovNumRois(0) << ")");
+        m_stats.skipped++;
         return false;
     }
 
-    if (numROIs >= metadata.getFovNumRois(0)) // if we are full already
+    if (metadata.getFirstRoi(0))
     {
-        if (m_mm->GetNumAvailableReturnChunk() == m_mm->GetReturnChunkPoolCapacity()) // If we've sent out everything, we are ready to transmit again
-        {
-            numROIs = 0;
-            fovTransmitInProgress = false;
-        } else { // Wait until buffer is emptied
-            return false;
-        }
-    }
-    
-    // When a "start ROI" gets in, we will accept up to numROIs ROIs from FoV 0 (which should be the entire frame).
-    // Then we will block all others ROIs coming in until the transmission is done (controlled by fovTransmitInProgress)
-    // Once fovTransmitInProgress is false again and a "start ROI" gets in, we can restart sending a frame
-    if (metadata.getFirstRoi(0)) // if current roi is a "start ROI"
-    {
-        if (!fovTransmitInProgress) // Not currently transmitting, kick off new frame transmit
-        {
-            fovTransmitInProgress = true;
-        } else { // Already transmitting, return and wait for buffer to be emptied
-            return false;
-        }
+        m_fovInProgress = m_ns->HasClient();
+        m_fovRois = 0;
     }
 
-    if (!fovTransmitInProgress) // If the current is not a start ROI and a frame is not already in progress, return
+    if (!m_fovInProgress)
     {
+        m_stats.skipped++;
         return false;
     }
-        
-
-    // At this point, there are only two possibilities. The ROI will be pushed in because:
-    // 1) it is the starting ROI of a new frame and we are ready to transmit
-    // or
-    // 2) it belongs to the frame currently being pushed out
-    numROIs++;
 
-    // Error check: if the current ROI is the last one of the current frame, we can check that we received all of them,
-    //              otherwise a problem occurred
-    if (metadata.getFrameCompleted(0))
+    m_fovRois++;
+    bool lastOfFov = metadata.getFrameCompleted(0);
+    if (lastOfFov)
     {
-        assert(numROIs == metadata.getFovNumRois(0));
+        // Error check: if the current ROI is the last one of the current frame, we can check that we received all of them,
+        //              otherwise a problem occurred
+        assert(m_fovRois == metadata.getFovNumRois(0));
+        m_fovInProgress = false;
     }
 
     ReturnChunk *returnChunk = m_mm->GetReturnChunk();
-    if(returnChunk != nullptr)
+    if(returnChunk == nullptr)
     { // If we're out of returnchunk pool something went terribly wrong, error out (this shouldn't be attainable)
         LLogErr("RawData/NetWrapper: No Return Chunk available. Skipping an ROI is forbidden.");
         return false;
@@ -402,12 +332,35 @@ bool CobraRawDataNetPipelineWrapper::HandInCobraROI(const char *roi, int roiSize
 
     ROIReturn *roir = m_mm->GetROIReturn();
     returnChunk->roiReturn = roir;
-
-    // Copy input data into the buffer 
-    memcpy(roir->roi.data(), roi, (size_t) roiSize);
+    roir->lastOfFov = lastOfFov;
+
+    // Borrow the producer's buffer if it lent it to us, otherwise copy input data into the buffer
+    if (sharedRoi) {
+        roir->sharedRoi = std::move(sharedRoi);
+    } else {
+        roir->roi.resize(ROI_SIZE);
+        memcpy(roir->roi.data(), roi, (size_t) roiSize);
+    }
     
-    // Hand to network streamer (other thread)
-    m_ns->HandChunkIn(returnChunk);
+    // Hand to network streamer, which queues it for the event loop
+    uint64_t dropped = m_ns->GetROIStreamStats().dropped;
+    bool accepted = m_ns->HandChunkIn(returnChunk);
+    if (m_ns->GetROIStreamStats().dropped != dropped)
+    {
+        m_fovInProgress = false;
+        m_stats.cutShort += metadata.getFovNumRois(0) - m_fovRois;
+        accepted = false;
+    }
+    return accepted;
+}
 
-    return true; // successfully handed in the ROI
+/**
+ * @brief Gets the counters of the raw data pipeline. Call it from the thread that hands in the ROIs.
+ */
+RawStreamStats CobraRawDataNetPipelineWrapper::GetStats() const
+{
+    RawStreamStats stats = m_stats;
+    stats.network = m_ns->GetROIStreamStats();
+    stats.evictedClients = m_ns->GetStreamStats().evicted;
+    return stats;
 }
@@ -18,12 +18,50 @@
 
 #include "pipeline_modules.hpp"
 #include "network_streamer.hpp"
+#include "shm_fov_publisher.hpp"
+#include "fov_recorder.hpp"
 #include <RawToDepth.h>
 #include <FovSegment.h>
+#include <PipelineTrace.h>
 #include <atomic>
 
 namespace LidarPipeline {
 
+/**
+ * @brief How the point cloud data leaves the sensor head. By default, the
+ *        FoVs are served over TCP. With a udpGroup, they are sent as UDP
+ *        datagrams of up to udpMtu bytes to that (multicast) address instead,
+ *        on the same port numbers. With a shmName, the FoVs of sensor head n
+ *        are also published into the shared memory ring shmName followed by
+ *        n, for the consumers on the same board (see shm_fov_ring.hpp).
+ *        With a recordPrefix, they are also recorded into the files
+ *        recordPrefix_n_ggg.fovs (see fov_recorder.hpp).
+ *        With a pacingRate, each socket is paced to that many bytes per
+ *        second; over TCP, sendDelayUs also holds each FoV back for that long
+ *        (see NetworkPacing).
+ */
+struct NetOutputConfig {
+    const char *udpGroup { nullptr };
+    unsigned int udpMtu { UDP_DEFAULT_MTU };
+    const char *shmName { nullptr };
+    const char *recordPrefix { nullptr };
+    uint64_t pacingRate { 0 };
+    unsigned int sendDelayUs { 0 };
+};
+
+/**
+ * @brief The counters of a point cloud pipeline, for the health report
+ *        (see CobraNetPipelineWrapper::GetStats()).
+ */
+struct NetPipelineStats {
+    uint64_t submitted;       // FoV segments handed in
+    uint64_t skipped;         // handed in, but not sent: no planes, no free return chunk, or over the memory budget
+    uint64_t budgetSkipped;   // of the skipped, over the memory budget (see MemoryBudget)
+    size_t freeChunks;        // return chunks free as of the last FoV segment
+    size_t chunkCapacity;
+    NetworkStreamStats network; // all zero for UDP output
+};
+
 /**
  * @brief CobraNetPipelineWrapper creates and manages the pipelines that send
  *        point cloud data to the network. It also provides the external API
@@ -33,23 +71,55 @@ namespace LidarPipeline {
  *        2. The CobraNetPipelineWrapper::HandInCobraDepth() method, which
  *           sends raw to depth data to the pipeline. It is called from the
  *           SensorHeadThread::sendRoi() method
+ *        If a FrameLatency is given, the latency traces of the FOVs are
+ *        stamped as the chunks are built and sent, and recorded into it.
+ *        The FOVs are encoded on the caller's thread and sent to all clients
+ *        by eventLoop, which the pipelines of a sensor head share. Without
+ *        one, the pipeline gets a loop of its own, shown with traceHead in
+ *        the pipeline trace. If netOutput selects UDP, the FOVs are sent
+ *        from the caller's thread and eventLoop is not used. With a
+ *        shmPublisher, which the pipelines of a sensor head share, the FoVs
+ *        are also copied into its shared memory ring, whether or not the
+ *        network has room for them. Likewise, with a fovRecorder, which the
+ *        pipelines of a sensor head share too, they are also recorded.
  */
 class CobraNetPipelineWrapper
 {
     public:
-        CobraNetPipelineWrapper(int sensorHeadNum, int maxNetFrames, int basePort);
+        CobraNetPipelineWrapper(int sensorHeadNum, int maxNetFrames, int basePort, std::shared_ptr<FrameLatency> frameLatency = nullptr,
+                                int traceHead = PIPELINE_TRACE_SHARED_HEAD, std::shared_ptr<NetworkEventLoop> eventLoop = nullptr,
+                                const NetOutputConfig &netOutput = {}, std::shared_ptr<ShmFovPublisher> shmPublisher = nullptr,
+                                std::shared_ptr<FovRecorder> fovRecorder = nullptr);
         void HandInCobraDepth(std::shared_ptr<FovSegment> processedFov);
+        NetPipelineStats GetStats() const;  // from any thread
     protected:
         PipelineDataMM *m_mm;
         NetworkStreamer *m_ns;
+        TCPWrappedStreamer *m_tcp { nullptr };  // m_ns, unless the output is UDP
+        std::shared_ptr<ShmFovPublisher> m_shmPublisher;
+        std::shared_ptr<FovRecorder> m_fovRecorder;
         uint64_t m_iteration;
-        uint64_t m_submittedFrames;
-        uint64_t m_skippedFrames;
+        std::atomic<uint64_t> m_submittedFrames;
+        std::atomic<uint64_t> m_skippedFrames;
+        std::atomic<uint64_t> m_budgetSkippedFrames;
+        std::atomic<size_t> m_freeChunks;
         bool m_latchMetaUpdateNeeded;
     private:
         const PipelineOutputType outputType_ = PipelineOutputType::ProcessedData;
 };
 
+/**
+ * @brief The counters of a raw data pipeline, in ROIs. The ROIs that reach
+ *        the network are counted once per RawFormat that has clients.
+ */
+struct RawStreamStats {
+    uint64_t handedIn;   // ROIs handed in while the pipeline was running
+    uint64_t skipped;    // not streamed: of other FoVs, without clients, or before the start of a FoV
+    uint64_t cutShort;   // skipped for the rest of a FoV after the network dropped some of it
+    ROIStreamStats network;
+    uint64_t evictedClients;
+};
+
 /**
  * @brief CobraNetPipelineWrapper creates and manages the pipelines that send
  *        point cloud data to the network. It also provides the external API
@@ -61,17 +131,32 @@ class CobraNetPipelineWrapper
  *        2. The CobraRawDataNetPipelineWrapper::HandInCobraROI() method,
  *           which sends raw ROI data to the raw ROI network pipeline. It is
  *           called from the SensorHeadThread::sendRoi() method.
+ *        Like the processed data, the ROIs are sent by an event loop that
+ *        may be shared with the other pipelines of the sensor head. Whole
+ *        FoVs of FoV 0 are streamed, in batches to the clients that ask for
+ *        them (see RawFormat). When the network drops part of a FoV, the rest
+ *        of it is skipped, and the counters (see GetStats()) are logged every
+ *        RAW_STREAM_STATS_INTERVAL ROIs.
  */
 class CobraRawDataNetPipelineWrapper
 {
     public:
-        CobraRawDataNetPipelineWrapper(int sensorHeadNum, int maxNetFrames, unsigned int numROIsInBuffer);
-        bool HandInCobraROI(const char *roi, int roiSize, bool firstRawRoi);
+        CobraRawDataNetPipelineWrapper(int sensorHeadNum, int maxNetFrames, unsigned int numROIsInBuffer,
+                                       std::shared_ptr<NetworkEventLoop> eventLoop = nullptr);
+        bool HandInCobraROI(const char *roi, int roiSize, bool firstRawRoi, std::shared_ptr<const char> sharedRoi = nullptr);
+        RawStreamStats GetStats() const;  // on the thread that hands in the ROIs
+
+        static constexpr uint64_t RAW_STREAM_STATS_INTERVAL { 10000 };
     protected:
         PipelineDataMM *m_mm;
-        NetworkStreamer *m_ns;
+        TCPWrappedStreamer *m_ns;
     private:
         const PipelineOutputType outputType_ = PipelineOutputType::RawData;
+        int m_sensorHeadNum;
+        bool m_fovInProgress { false };  // streaming the ROIs of the current FoV
+        uint16_t m_fovRois { 0 };        // of the current FoV so far
+        RawStreamStats m_stats {};
+        uint64_t m_reportedDrops { 0 };  // dropped or cut short as of the last report
 };
 
 }
@@ -0,0 +1,306 @@
+#ifndef FOV_CONTAINER_HPP
+#define FOV_CONTAINER_HPP
+
+/**
+ * @file fov_container.hpp
+ * @brief The layout of the files that the FovRecorder records the processed
+ *        FoVs of a sensor head into (see fov_recorder.hpp), and
+ *        FovContainerReader, which maps them and serves any FoV in place.
+ *        Like shm_fov_ring.hpp, this header only depends on the standard
+ *        library and Linux, so that offline tools can include it on its own.
+ *
+ *        A recording is a sequence of segment files named
+ *        '<base>_ggg.fovs', where ggg is the segment number starting from
+ *        000. Each segment is laid out as:
+ *        1. A FileHeader, padded to ALIGNMENT bytes.
+ *        2. The records, each a multiple of RECORD_ALIGNMENT bytes: a
+ *           RecordHeader with the metadata of the FoV segment, then the
+ *           planes it lists, in the layout of a shared memory ring slot
+ *           (see ShmFov::Plane). Records of type RECORD_PADDING carry no FoV
+ *           and are skipped; they keep the writes aligned for O_DIRECT.
+ *        3. Once the segment has been closed, an index of IndexEntry, one
+ *           for each FoV, at indexOffset.
+ *        The header is rewritten after every write, so a segment that was
+ *        never closed (e.g. after a power loss) can still be read up to
+ *        dataEnd by walking the records.
+ *
+ * @copyright Copyright (C) 2024 Lumotive, Inc. All rights reserved
+ */
+
+#include "shm_fov_ring.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace LidarPipeline {
+namespace FovContainer {
+
+constexpr char MAGIC[8] { 'L', 'U', 'M', 'O', 'F', 'O', 'V', 'S' };
+constexpr uint32_t VERSION { 1 };
+constexpr uint32_t ALIGNMENT { 4096 };                          // of the header, the writes and the index, as O_DIRECT requires
+constexpr uint32_t RECORD_ALIGNMENT { ShmFov::PLANE_ALIGNMENT }; // of the records and of the planes within them
+constexpr uint32_t RECORD_FOV { 0x30564f46 };                   // "FOV0"
+constexpr uint32_t RECORD_PADDING { 0x30444150 };               // "PAD0"
+constexpr const char *EXTENSION { ".fovs" };
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;            // offset of the first record
+    uint32_t sensorHead;
+    uint32_t segmentNum;
+    uint32_t closed;                 // non-zero once the index has been written
+    uint32_t reserved;
+    uint64_t firstFovNumber;         // of the first FoV in this segment
+    uint64_t numFovs;                // in this segment
+    uint64_t dataEnd;                // offset past the last record
+    uint64_t indexOffset;            // only valid if closed is set
+    uint64_t startNs;                // CLOCK_REALTIME when the recording started
+    uint64_t droppedFovs;            // of the recording, as of the last update of this segment
+};
+
+struct RecordHeader {
+    uint32_t type;                   // RECORD_FOV or RECORD_PADDING
+    uint32_t bytes;                  // of the whole record, this header and the padding included
+    uint64_t fovNumber;              // counted from 0 over the FoVs handed to the recorder, so dropped ones leave gaps
+    uint64_t recordNs;               // CLOCK_MONOTONIC when the FoV was handed to the recorder
+    uint32_t sensorHead;
+    uint32_t fovIdx;
+    uint32_t sensorId;
+    uint32_t userTag;
+    uint64_t timestamp;
+    uint32_t rows;                   // of this segment
+    uint32_t columns;
+    uint32_t firstRow;               // of this segment, in the rows of the whole FoV
+    uint32_t fovNumRows;             // of the whole FoV
+    uint32_t frameCompleted;         // this is the last (or only) segment of the FoV
+    uint32_t newMappingTable;        // the mapping table changed since the previous FoV
+    double gcf;
+    double maxUnambiguousRange;
+    uint32_t mappingTableTopLeft[2];
+    uint32_t mappingTableStep[2];
+    uint32_t fovTopLeft[2];
+    uint32_t fovStep[2];
+    uint32_t numRois;
+    uint32_t reserved;
+    ShmFov::PlaneRef planes[ShmFov::NUM_PLANES];  // offsets from the start of the record
+};
+
+struct IndexEntry {
+    uint64_t offset;                 // of the RecordHeader within the segment
+    uint64_t fovNumber;
+    uint64_t timestamp;
+    uint32_t bytes;
+    uint32_t fovIdx;
+};
+
+inline uint64_t alignUp(uint64_t bytes, uint64_t alignment) { return (bytes + alignment - 1) / alignment * alignment; }
+
+inline std::string segmentPath(const std::string &base, uint32_t segmentNum) {
+    std::ostringstream name;
+    name << base << '_' << std::setfill('0') << std::setw(3) << segmentNum << EXTENSION;
+    return name.str();
+}
+
+// True if path names a segment file, '<base>_ggg.fovs'
+inline bool isSegmentPath(const std::string &path) {
+    const std::string extension(EXTENSION);
+    const size_t suffixBytes = 4 + extension.size();
+    if (path.size() <= suffixBytes || path.compare(path.size() - extension.size(), extension.size(), extension) != 0) {
+        return false;
+    }
+    const size_t pos = path.size() - suffixBytes;
+    return path[pos] == '_' && std::all_of(path.begin() + (long)pos + 1, path.begin() + (long)pos + 4, ::isdigit);
+}
+
+} // namespace FovContainer
+
+/**
+ * @brief A recorded FoV, read in place. The pointers are valid for as long
+ *        as the FovContainerReader that returned it is open.
+ */
+class FovRecordView {
+    public:
+        const FovContainer::RecordHeader &header() const { return *m_header; }
+
+        // nullptr if the FoV doesn't have the plane
+        const void *plane(ShmFov::Plane plane) const {
+            const auto &ref = m_header->planes[plane];
+            return ref.bytes == 0 ? nullptr : reinterpret_cast<const uint8_t *>(m_header) + ref.offset;
+        }
+        const uint16_t *range() const { return static_cast<const uint16_t *>(plane(ShmFov::RANGE)); }
+        const uint16_t *snr() const { return static_cast<const uint16_t *>(plane(ShmFov::SNR)); }
+        const uint16_t *signal() const { return static_cast<const uint16_t *>(plane(ShmFov::SIGNAL)); }
+        const uint16_t *background() const { return static_cast<const uint16_t *>(plane(ShmFov::BACKGROUND)); }
+        const uint16_t *roiIndex() const { return static_cast<const uint16_t *>(plane(ShmFov::ROI_INDEX)); }
+        const uint32_t *timestamps() const { return static_cast<const uint32_t *>(plane(ShmFov::TIMESTAMPS)); }
+        const int32_t *xyz() const { return static_cast<const int32_t *>(plane(ShmFov::XYZ)); }
+
+    private:
+        friend class FovContainerReader;
+        const FovContainer::RecordHeader *m_header { nullptr };
+};
+
+/**
+ * @brief Maps all of the segments of a recording read-only and indexes
+ *        their FoVs, so that any FoV can be read in place in constant time,
+ *        in any order. The segments are mapped lazily by the kernel, so
+ *        opening a long recording doesn't read it.
+ */
+class FovContainerReader {
+    public:
+        FovContainerReader() = default;
+        FovContainerReader(const FovContainerReader &) = delete;
+        FovContainerReader &operator=(const FovContainerReader &) = delete;
+        ~FovContainerReader() { close(); }
+
+        /**
+         * @brief Opens a recording.
+         *
+         * @param path The name of a segment file ('<base>_ggg.fovs'), in
+         *             which case the recording is read starting from that
+         *             segment; or the base name, in which case it is read
+         *             from segment 000
+         * @return false if the first segment can't be opened or is not a
+         *         valid container
+         */
+        bool open(const std::string &path) {
+            close();
+            std::string base = path;
+            uint32_t segmentNum = 0;
+            if (FovContainer::isSegmentPath(path)) {
+                const size_t suffixBytes = 4 + std::string(FovContainer::EXTENSION).size();
+                base = path.substr(0, path.size() - suffixBytes);
+                segmentNum = (uint32_t)std::stoul(path.substr(path.size() - suffixBytes + 1, 3));
+            }
+            while (mapSegment(FovContainer::segmentPath(base, segmentNum))) {
+                segmentNum++;
+            }
+            return !m_segments.empty();
+        }
+
+        void close() {
+            for (const auto &segment : m_segments) {
+                munmap(const_cast<uint8_t *>(segment.map), segment.mapBytes);
+            }
+            m_segments.clear();
+            m_fovs.clear();
+        }
+
+        size_t size() const { return m_fovs.size(); }   // FoVs in the recording
+        size_t numSegments() const { return m_segments.size(); }
+        const FovContainer::FileHeader &header(size_t segment) const { return m_segments[segment].header; }
+
+        // The FoV at position 0 <= position < size(), in recording order
+        FovRecordView at(size_t position) const {
+            FovRecordView view;
+            view.m_header = reinterpret_cast<const FovContainer::RecordHeader *>(m_fovs[position]);
+            return view;
+        }
+
+        /**
+         * @brief Finds a FoV by its fovNumber, which counts the dropped FoVs
+         *        too (see RecordHeader::fovNumber).
+         *
+         * @return The position of the FoV, or size() if it wasn't recorded
+         */
+        size_t find(uint64_t fovNumber) const {
+            auto it = std::lower_bound(m_fovs.begin(), m_fovs.end(), fovNumber, [](const uint8_t *record, uint64_t number) {
+                return reinterpret_cast<const FovContainer::RecordHeader *>(record)->fovNumber < number;
+            });
+            if (it == m_fovs.end() || reinterpret_cast<const FovContainer::RecordHeader *>(*it)->fovNumber != fovNumber) {
+                return m_fovs.size();
+            }
+            return (size_t)(it - m_fovs.begin());
+        }
+
+    private:
+        struct Segment {
+            const uint8_t *map;
+            size_t mapBytes;
+            FovContainer::FileHeader header;
+        };
+
+        bool mapSegment(const std::string &name) {
+            int fd = ::open(name.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat st {};
+            void *map = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(FovContainer::FileHeader)) {
+                map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            ::close(fd);
+            if (map == MAP_FAILED) {
+                return false;
+            }
+            Segment segment { static_cast<const uint8_t *>(map), (size_t)st.st_size, {} };
+            memcpy(&segment.header, segment.map, sizeof(segment.header));
+            if (memcmp(segment.header.magic, FovContainer::MAGIC, sizeof(FovContainer::MAGIC)) != 0 ||
+                segment.header.version != FovContainer::VERSION || !indexSegment(segment)) {
+                munmap(map, segment.mapBytes);
+                return false;
+            }
+            m_segments.push_back(segment);
+            return true;
+        }
+
+        // Takes the index of a closed segment, or walks the records of one that was never closed
+        bool indexSegment(const Segment &segment) {
+            const auto &header = segment.header;
+            const size_t first = m_fovs.size();
+            auto validRecord = [&](uint64_t offset, uint64_t end) {
+                if (offset + sizeof(FovContainer::RecordHeader) > end) {
+                    return false;
+                }
+                const auto *record = reinterpret_cast<const FovContainer::RecordHeader *>(segment.map + offset);
+                if (record->bytes < sizeof(FovContainer::RecordHeader) || record->bytes > end - offset ||
+                    (record->type != FovContainer::RECORD_FOV && record->type != FovContainer::RECORD_PADDING)) {
+                    return false;
+                }
+                return std::all_of(std::begin(record->planes), std::end(record->planes), [&](const ShmFov::PlaneRef &ref) {
+                    return ref.bytes == 0 || (uint64_t)ref.offset + ref.bytes <= record->bytes;
+                });
+            };
+            if (header.closed != 0) {
+                const uint64_t indexBytes = header.numFovs * sizeof(FovContainer::IndexEntry);
+                if (header.indexOffset > segment.mapBytes || indexBytes > segment.mapBytes - header.indexOffset) {
+                    return false;
+                }
+                const auto *index = reinterpret_cast<const FovContainer::IndexEntry *>(segment.map + header.indexOffset);
+                for (uint64_t entry = 0; entry < header.numFovs; entry++) {
+                    if (!validRecord(index[entry].offset, header.indexOffset)) {
+                        m_fovs.resize(first);
+                        return false;
+                    }
+                    m_fovs.push_back(segment.map + index[entry].offset);
+                }
+                return true;
+            }
+            const uint64_t dataEnd = std::min<uint64_t>(header.dataEnd, segment.mapBytes);
+            for (uint64_t offset = header.headerBytes; validRecord(offset, dataEnd);) {
+                const auto *record = reinterpret_cast<const FovContainer::RecordHeader *>(segment.map + offset);
+                if (record->type == FovContainer::RECORD_FOV) {
+                    m_fovs.push_back(segment.map + offset);
+                }
+                offset += record->bytes;
+            }
+            return true;
+        }
+
+        std::vector<Segment> m_segments;
+        std::vector<const uint8_t *> m_fovs;  // the RecordHeader of each FoV, in recording order
+};
+
+} // namespace LidarPipeline
+
+#endif
@@ -0,0 +1,423 @@
+/**
+ * @file fov_recorder.cpp
+ * @brief This file contains the implementation of the FovRecorder, which
+ *        records the processed FoVs of a sensor head into indexed segment
+ *        files on a background thread.
+ *
+ * @copyright Copyright (C) 2024 Lumotive, Inc. All rights reserved
+ */
+#include "fov_recorder.hpp"
+#include "LumoLogger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+using namespace LidarPipeline;
+
+#define FOV_RECORDER_FILE_MODE 0666
+
+static uint64_t nowNs(std::chrono::nanoseconds sinceEpoch)
+{
+    return (uint64_t)sinceEpoch.count();
+}
+
+// Whole aligned batches, and as many of them as the memory budget grants, but at least two
+static FovRecorderConfig BudgetedConfig(const FovRecorderConfig &config, uint32_t sensorHead, MemoryBudget::Grant &grant)
+{
+    FovRecorderConfig budgeted = config;
+    budgeted.batchBytes = (uint32_t)FovContainer::alignUp(std::max(config.batchBytes, 2 * FovContainer::ALIGNMENT), FovContainer::ALIGNMENT);
+    const uint32_t numBatches = std::max(config.numBatches, 2U);
+    grant = MemoryBudget::request(MEMORY_POOL_RECORDERS, 2ULL * budgeted.batchBytes, (uint64_t)numBatches * budgeted.batchBytes,
+                                  "head " + std::to_string(sensorHead) + " FoV recorder batches");
+    budgeted.numBatches = std::clamp((uint32_t)(grant.bytes() / budgeted.batchBytes), 2U, numBatches);
+    return budgeted;
+}
+
+void FovRecorder::AlignedDeleter::operator()(uint8_t *ptr) const
+{
+    free(ptr);  // NOLINT(cppcoreguidelines-no-malloc) pairs with aligned_alloc
+}
+
+FovRecorder::AlignedBuffer FovRecorder::AllocateAligned(size_t bytes)
+{
+    // NOLINTNEXTLINE(cppcoreguidelines-no-malloc) O_DIRECT needs aligned memory
+    return AlignedBuffer((uint8_t *)aligned_alloc(FovContainer::ALIGNMENT, FovContainer::alignUp(bytes, FovContainer::ALIGNMENT)));
+}
+
+std::string FovRecorder::SegmentPath(const std::string &prefix, uint32_t sensorHead, uint32_t segmentNum)
+{
+    return FovContainer::segmentPath(prefix + "_" + std::to_string(sensorHead), segmentNum);
+}
+
+FovRecorder::FovRecorder(std::string prefix, uint32_t sensorHead, const FovRecorderConfig &config) :
+    m_prefix(std::move(prefix)),
+    m_sensorHead(sensorHead),
+    m_config(BudgetedConfig(config, sensorHead, m_batchGrant)),
+    m_batches(m_config.numBatches),
+    m_writerQueue(m_config.numBatches),
+    m_freeBatches(m_config.numBatches),
+    m_headerBuffer(AllocateAligned(FovContainer::ALIGNMENT)),
+    m_startNs(nowNs(std::chrono::system_clock::now().time_since_epoch()))
+{
+    for (auto &batch : m_batches) {
+        m_batchMemory.push_back(AllocateAligned(m_config.batchBytes));
+        batch.data = m_batchMemory.back().get();
+        if (batch.data == nullptr) {
+            LLogErr("fov_recorder_alloc:head=" << m_sensorHead << ",bytes=" << m_config.batchBytes << ":can't allocate recorder batch");
+            continue;
+        }
+        *m_freeBatches.beginPush() = &batch;
+        m_freeBatches.commitPush();
+    }
+    m_writerThread = std::thread(&FovRecorder::WriterLoop, this);
+    LLogInfo("fov_recorder:head=" << m_sensorHead << ",prefix=" << m_prefix << ",batchBytes=" << m_config.batchBytes <<
+             ",batches=" << m_config.numBatches << ":recording FoVs");
+}
+
+FovRecorder::~FovRecorder()
+{
+    Close();
+}
+
+FovRecorderStats FovRecorder::GetStats() const
+{
+    FovRecorderStats stats {};
+    stats.recorded = m_recorded.load(std::memory_order_relaxed);
+    stats.dropped = m_dropped.load(std::memory_order_relaxed);
+    stats.bytesWritten = m_bytesWritten.load(std::memory_order_relaxed);
+    stats.segments = m_segments.load(std::memory_order_relaxed);
+    stats.writeErrors = m_writeErrors.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool FovRecorder::Record(const FovSegment &fov, bool newMappingTable)
+{
+    if (m_closed) {
+        return false;
+    }
+    const uint64_t fovNumber = m_fovNumber++;
+    const auto &imageSize = fov.getImageSize();
+    const uint64_t numPixels = (uint64_t)imageSize[0] * imageSize[1];
+    const auto timestampsVec = fov.getTimestampsVec();
+    const uint64_t numRois = timestampsVec ? timestampsVec->size() : 0;
+
+    // The planes, in the order of ShmFov::Plane, as in a shared memory ring slot
+    const std::array<std::shared_ptr<std::vector<uint16_t>>, ShmFov::ROI_INDEX> pixelPlanes {
+        fov.getRange(), fov.getSnr(), fov.getSignal(), fov.getBackground()
+    };
+    const auto roiIndexRows = fov.getRoiIndexRows();
+    const auto xyz = fov.getXyz();
+    std::array<uint64_t, ShmFov::NUM_PLANES> planeBytes {};
+    for (uint32_t plane = ShmFov::RANGE; plane < ShmFov::ROI_INDEX; plane++) {
+        planeBytes[plane] = pixelPlanes[plane] ? numPixels * sizeof(uint16_t) : 0;
+    }
+    planeBytes[ShmFov::ROI_INDEX] = roiIndexRows ? (uint64_t)imageSize[0] * sizeof(uint16_t) : 0;
+    planeBytes[ShmFov::TIMESTAMPS] = numRois * 3 * sizeof(uint32_t);
+    planeBytes[ShmFov::XYZ] = xyz ? numPixels * 3 * sizeof(int32_t) : 0;
+    uint64_t recordBytes = FovContainer::alignUp(sizeof(FovContainer::RecordHeader), FovContainer::RECORD_ALIGNMENT);
+    for (auto bytes : planeBytes) {
+        recordBytes += FovContainer::alignUp(bytes, FovContainer::RECORD_ALIGNMENT);
+    }
+
+    // A sealed batch always has room left for the header of the padding record
+    if (recordBytes + sizeof(FovContainer::RecordHeader) > m_config.batchBytes) {
+        LLogErr("fov_recorder_fov_too_big:head=" << m_sensorHead << ",fovIdx=" << fov.getFovIdx() << ",bytes=" << recordBytes <<
+                ",batchBytes=" << m_config.batchBytes << ":FoV not recorded");
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (m_current != nullptr && m_current->length + recordBytes + sizeof(FovContainer::RecordHeader) > m_config.batchBytes) {
+        SealBatch();
+    }
+    if (m_current == nullptr && !TakeBatch()) {
+        // The writer is behind; dropping the FoV keeps the network output from waiting for the disk
+        if (m_dropped.fetch_add(1, std::memory_order_relaxed) == 0) {
+            LLogWarning("fov_recorder_drop:head=" << m_sensorHead << ":the disk can't keep up; dropping FoVs");
+        }
+        return false;
+    }
+
+    uint8_t *record = m_current->data + m_current->length;
+    FovContainer::RecordHeader header {};
+    header.type = FovContainer::RECORD_FOV;
+    header.bytes = (uint32_t)recordBytes;
+    header.fovNumber = fovNumber;
+    header.recordNs = nowNs(std::chrono::steady_clock::now().time_since_epoch());
+    header.sensorHead = fov.getHeaderNum();
+    header.fovIdx = fov.getFovIdx();
+    header.sensorId = fov.getSensorId();
+    header.userTag = fov.getUserTag();
+    header.timestamp = fov.getTimestamp();
+    header.rows = imageSize[0];
+    header.columns = imageSize[1];
+    header.firstRow = fov.getFirstRow();
+    header.fovNumRows = fov.getFovNumRows();
+    header.frameCompleted = fov.getFrameCompleted() ? 1 : 0;
+    header.newMappingTable = newMappingTable ? 1 : 0;
+    header.gcf = fov.getGcf();
+    header.maxUnambiguousRange = fov.getMaxUnambiguousRange();
+    for (int idx = 0; idx < 2; idx++) {
+        header.mappingTableTopLeft[idx] = fov.getMappingTableTopLeft()[idx];
+        header.mappingTableStep[idx] = fov.getMappingTableStep()[idx];
+        header.fovTopLeft[idx] = fov.getFovTopLeft()[idx];
+        header.fovStep[idx] = fov.getFovStep()[idx];
+    }
+    header.numRois = (uint32_t)numRois;
+
+    // Copying straight into the batch, so a FoV is only copied once before it reaches the disk
+    uint64_t offset = FovContainer::alignUp(sizeof(header), FovContainer::RECORD_ALIGNMENT);
+    auto copyPlane = [&](ShmFov::Plane plane, const void *data) {
+        header.planes[plane] = { planeBytes[plane] != 0 ? (uint32_t)offset : 0, (uint32_t)planeBytes[plane] };
+        if (planeBytes[plane] != 0) {
+            memcpy(record + offset, data, planeBytes[plane]);
+            offset += FovContainer::alignUp(planeBytes[plane], FovContainer::RECORD_ALIGNMENT);
+        }
+    };
+    for (uint32_t plane = ShmFov::RANGE; plane < ShmFov::ROI_INDEX; plane++) {
+        copyPlane((ShmFov::Plane)plane, pixelPlanes[plane] ? pixelPlanes[plane]->data() : nullptr);
+    }
+    copyPlane(ShmFov::ROI_INDEX, roiIndexRows ? roiIndexRows->data() : nullptr);
+    header.planes[ShmFov::TIMESTAMPS] = { numRois > 0 ? (uint32_t)offset : 0, (uint32_t)planeBytes[ShmFov::TIMESTAMPS] };
+    auto *timestamps = reinterpret_cast<uint32_t *>(record + offset);
+    for (uint64_t roi = 0; roi < numRois; roi++) {
+        const auto &roiTimestamp = (*timestampsVec)[roi];
+        for (uint64_t word = 0; word < 3; word++) {
+            timestamps[3 * roi + word] = word < roiTimestamp.size() ? roiTimestamp[word] : 0;
+        }
+    }
+    offset += FovContainer::alignUp(planeBytes[ShmFov::TIMESTAMPS], FovContainer::RECORD_ALIGNMENT);
+    copyPlane(ShmFov::XYZ, xyz ? xyz->data() : nullptr);
+    memcpy(record, &header, sizeof(header));
+
+    m_current->entries.push_back({ m_current->length, fovNumber, header.timestamp, header.bytes, header.fovIdx });
+    m_current->length += (uint32_t)recordBytes;
+    m_recorded.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void FovRecorder::Close()
+{
+    if (m_closed) {
+        return;
+    }
+    m_closed = true;
+    if (m_current != nullptr && m_current->length > 0) {
+        SealBatch();
+    }
+    m_writerQueue.quit();
+    if (m_writerThread.joinable()) {
+        m_writerThread.join();
+    }
+    const auto stats = GetStats();
+    LLogInfo("fov_recorder_closed:head=" << m_sensorHead << ",recorded=" << stats.recorded << ",dropped=" << stats.dropped <<
+             ",segments=" << stats.segments << ",bytesWritten=" << stats.bytesWritten << ",writeErrors=" << stats.writeErrors);
+}
+
+bool FovRecorder::TakeBatch()
+{
+    Batch **batch = m_freeBatches.front();
+    if (batch == nullptr) {
+        return false;
+    }
+    m_current = *batch;
+    m_freeBatches.pop();
+    m_current->length = 0;
+    m_current->entries.clear();
+    return true;
+}
+
+// Pads the current batch to FovContainer::ALIGNMENT and hands it to the writer thread
+void FovRecorder::SealBatch()
+{
+    uint64_t aligned = FovContainer::alignUp(m_current->length, FovContainer::ALIGNMENT);
+    if (aligned - m_current->length < sizeof(FovContainer::RecordHeader)) {
+        aligned += FovContainer::ALIGNMENT;
+    }
+    FovContainer::RecordHeader padding {};
+    padding.type = FovContainer::RECORD_PADDING;
+    padding.bytes = (uint32_t)(aligned - m_current->length);
+    memcpy(m_current->data + m_current->length, &padding, sizeof(padding));
+    m_current->length = (uint32_t)aligned;
+
+    // Never full: it has room for all of the batches
+    *m_writerQueue.beginPush() = m_current;
+    m_writerQueue.commitPush();
+    m_current = nullptr;
+}
+
+void FovRecorder::WriterLoop()
+{
+    while (true) {
+        Batch **batch = m_writerQueue.front();
+        if (batch == nullptr) {
+            if (!m_writerQueue.waitForData()) {
+                break;
+            }
+            continue;
+        }
+        WriteBatch(**batch);
+        m_writerQueue.pop();
+    }
+    for (Batch **batch = m_writerQueue.front(); batch != nullptr; batch = m_writerQueue.front()) {
+        WriteBatch(**batch);
+        m_writerQueue.pop();
+    }
+    CloseSegment();
+}
+
+void FovRecorder::WriteBatch(Batch &batch)
+{
+    if (m_fd >= 0 && m_writeOffset > m_header.headerBytes && m_writeOffset + batch.length > m_config.segmentBytes) {
+        CloseSegment();
+    }
+    if ((m_fd >= 0 || (!m_failed && OpenSegment())) && WriteAligned(batch.data, batch.length, m_writeOffset)) {
+        if (m_header.numFovs == 0 && !batch.entries.empty()) {
+            m_header.firstFovNumber = batch.entries.front().fovNumber;
+        }
+        for (auto entry : batch.entries) {
+            entry.offset += m_writeOffset;
+            m_index.push_back(entry);
+        }
+        m_writeOffset += batch.length;
+        m_header.numFovs = m_index.size();
+        m_header.dataEnd = m_writeOffset;
+        m_header.droppedFovs = m_dropped.load(std::memory_order_relaxed);
+        WriteHeader();
+    }
+    // Otherwise the FoVs in this batch are lost; the error has been logged
+    *m_freeBatches.beginPush() = &batch;  // never full: it has room for all of the batches
+    m_freeBatches.commitPush();
+}
+
+bool FovRecorder::OpenSegment()
+{
+    const auto name = SegmentPath(m_prefix, m_sensorHead, m_segmentNum);
+    const int flags = O_CREAT | O_TRUNC | O_WRONLY;
+    m_directIo = m_config.directIo;
+    // NOLINTNEXTLINE(hicpp-vararg) calling LINUX vararg API
+    m_fd = open(name.c_str(), m_directIo ? flags | O_DIRECT : flags, FOV_RECORDER_FILE_MODE);
+    if (m_fd < 0 && m_directIo && errno == EINVAL) {
+        // e.g. tmpfs
+        LLogInfo("fov_recorder_no_direct_io:name=" << name << ":file system does not support O_DIRECT; using buffered writes");
+        m_directIo = false;
+        m_fd = open(name.c_str(), flags, FOV_RECORDER_FILE_MODE);  // NOLINT(hicpp-vararg) calling LINUX vararg API
+    }
+    if (m_fd < 0) {
+        LLogErr("fov_recorder_open:name=" << name << ",errno=" << errno << ":can't open segment file; recording disabled");
+        m_failed = true;
+        m_writeErrors.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Allocating the segment up front keeps the file system from having to find free blocks during each write
+    int error = posix_fallocate(m_fd, 0, (off_t)m_config.segmentBytes);
+    if (error != 0) {
+        LLogWarning("fov_recorder_fallocate:name=" << name << ",error=" << error << ":can't preallocate segment file");
+    }
+
+    m_header = {};
+    memcpy(m_header.magic, FovContainer::MAGIC, sizeof(m_header.magic));
+    m_header.version = FovContainer::VERSION;
+    m_header.headerBytes = FovContainer::ALIGNMENT;
+    m_header.sensorHead = m_sensorHead;
+    m_header.segmentNum = m_segmentNum;
+    m_header.dataEnd = m_header.headerBytes;
+    m_header.startNs = m_startNs;
+    m_writeOffset = m_header.headerBytes;
+    m_index.clear();
+    m_segments.fetch_add(1, std::memory_order_relaxed);
+    LLogDebug("fov_recorder_open:name=" << name << ",directIo=" << m_directIo);
+    return WriteHeader();
+}
+
+// Writes the index after the last record, marks the segment as closed, and trims the preallocated space
+void FovRecorder::CloseSegment()
+{
+    if (m_fd < 0) {
+        return;
+    }
+    const uint64_t indexBytes = m_index.size() * sizeof(FovContainer::IndexEntry);
+    auto indexBuffer = AllocateAligned(std::max<uint64_t>(indexBytes, 1));
+    if (indexBuffer != nullptr) {
+        memcpy(indexBuffer.get(), m_index.data(), indexBytes);
+        if (WriteAligned(indexBuffer.get(), FovContainer::alignUp(indexBytes, FovContainer::ALIGNMENT), m_writeOffset)) {
+            m_header.indexOffset = m_writeOffset;
+            m_header.closed = 1;
+            m_header.droppedFovs = m_dropped.load(std::memory_order_relaxed);
+            WriteHeader();
+        }
+    }
+    if (m_fd >= 0) {
+        if (ftruncate(m_fd, (off_t)(m_writeOffset + indexBytes)) < 0) {
+            LLogWarning("fov_recorder_truncate:errno=" << errno << ":can't trim segment file");
+        }
+        fdatasync(m_fd);
+        close(m_fd);
+        m_fd = -1;
+    }
+    m_segmentNum++;
+    m_index.clear();
+}
+
+bool FovRecorder::WriteHeader()
+{
+    memset(m_headerBuffer.get(), 0, FovContainer::ALIGNMENT);
+    memcpy(m_headerBuffer.get(), &m_header, sizeof(m_header));
+    return WriteAligned(m_headerBuffer.get(), FovContainer::ALIGNMENT, 0);
+}
+
+// Writes an aligned buffer at an aligned offset. On failure the segment is closed as is, and the rest of the recording is discarded
+bool FovRecorder::WriteAligned(const uint8_t *data, size_t bytes, uint64_t offset)
+{
+    size_t pos = 0;
+    while (pos < bytes) {
+        ssize_t written = pwrite(m_fd, data + pos, bytes - pos, (off_t)(offset + pos));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            LLogErr("fov_recorder_write:head=" << m_sensorHead << ",segment=" << m_segmentNum << ",errno=" << errno <<
+                    ":can't write segment file; recording disabled");
+            m_writeErrors.fetch_add(1, std::memory_order_relaxed);
+            m_failed = true;
+            close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+        pos += (size_t)written;
+    }
+    m_bytesWritten.fetch_add(bytes, std::memory_order_relaxed);
+    return true;
+}
+
+std::shared_ptr<FovSegment> FovRecorder::ToFovSegment(const FovRecordView &view)
+{
+    const auto &header = view.header();
+    const uint64_t numPixels = (uint64_t)header.rows * header.columns;
+    auto copyPlane = [&](const uint16_t *data, uint64_t size) {
+        return data != nullptr ? std::make_shared<std::vector<uint16_t>>(data, data + size) : nullptr;
+    };
+    std::shared_ptr<std::vector<std::vector<uint32_t>>> timestampsVec;
+    if (view.timestamps() != nullptr) {
+        timestampsVec = std::make_shared<std::vector<std::vector<uint32_t>>>(header.numRois);
+        for (uint32_t roi = 0; roi < header.numRois; roi++) {
+            (*timestampsVec)[roi].assign(view.timestamps() + 3 * roi, view.timestamps() + 3 * roi + 3);
+        }
+    }
+    auto fov = std::make_shared<FovSegment>(header.fovIdx, header.sensorHead, header.timestamp, (uint16_t)header.sensorId,
+                                            header.userTag, header.frameCompleted != 0, header.gcf, header.maxUnambiguousRange,
+                                            std::array<uint32_t, 2> { header.rows, header.columns }, copyPlane(view.range(), numPixels),
+                                            std::array<uint32_t, 2> { header.mappingTableTopLeft[0], header.mappingTableTopLeft[1] },
+                                            std::array<uint32_t, 2> { header.mappingTableStep[0], header.mappingTableStep[1] },
+                                            std::array<uint32_t, 2> { header.fovTopLeft[0], header.fovTopLeft[1] },
+                                            std::array<uint32_t, 2> { header.fovStep[0], header.fovStep[1] },
+                                            copyPlane(view.snr(), numPixels), copyPlane(view.signal(), numPixels),
+                                            copyPlane(view.background(), numPixels), copyPlane(view.roiIndex(), header.rows),
+                                            nullptr, timestampsVec);
+    fov->setNewMappingTable(header.newMappingTable != 0);
+    fov->setSegmentRows(header.firstRow, header.fovNumRows);
+    if (view.xyz() != nullptr && view.range() != nullptr) {
+        fov->setXyz(std::make_shared<std::vector<int32_t>>(view.xyz(), view.xyz() + 3 * numPixels));
+    }
+    return fov;
+}
@@ -0,0 +1,157 @@
+#ifndef FOV_RECORDER_HPP
+#define FOV_RECORDER_HPP
+
+/**
+ * @file fov_recorder.hpp
+ * @brief This file contains the definition of the FovRecorder, which records
+ *        the processed FoVs of a sensor head, as they are handed to the
+ *        network pipelines, into the indexed segment files described in
+ *        fov_container.hpp. Offline tools and replay then read any FoV
+ *        straight out of the mapped files, without running raw to depth
+ *        again.
+ *
+ *        The thread that hands in the FoVs copies each one into a large
+ *        aligned batch buffer, and hands full batches to a writer thread,
+ *        which appends them to a preallocated segment file with a single
+ *        pwrite() each. Neither blocks on the disk: if the writer falls
+ *        behind and all of the batches are in use, FoVs are dropped and
+ *        counted, rather than holding up the network output. The segments
+ *        are opened with O_DIRECT where the file system supports it, so that
+ *        recording does not evict the page cache.
+ *
+ * @copyright Copyright (C) 2024 Lumotive, Inc. All rights reserved
+ */
+
+#include "fov_container.hpp"
+#include <FovSegment.h>
+#include <MemoryBudget.h>
+#include <SpscRing.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define FOV_RECORDER_SEGMENT_BYTES  (1ULL << 30U)   // preallocated for each segment file
+#define FOV_RECORDER_BATCH_BYTES    (8U << 20U)     // written to disk at once; the largest FoV must fit
+#define FOV_RECORDER_NUM_BATCHES    4               // that can be waiting for the disk, if the memory budget allows
+
+namespace LidarPipeline {
+
+struct FovRecorderConfig {
+    uint64_t segmentBytes { FOV_RECORDER_SEGMENT_BYTES };
+    uint32_t batchBytes { FOV_RECORDER_BATCH_BYTES };
+    uint32_t numBatches { FOV_RECORDER_NUM_BATCHES };
+    bool directIo { true };  // open the segments with O_DIRECT if the file system supports it
+};
+
+struct FovRecorderStats {
+    uint64_t recorded;       // FoV segments copied into a batch
+    uint64_t dropped;        // not recorded: no batch was free, or larger than a batch
+    uint64_t bytesWritten;
+    uint32_t segments;       // segment files started
+    uint32_t writeErrors;
+};
+
+/**
+ * @brief Records the FoVs of a sensor head into '<prefix>_h_ggg.fovs', where
+ *        h is the head number and ggg the segment number. The
+ *        CobraNetPipelineWrappers of the sensor head share one recorder,
+ *        and hand it their FoVs on the output thread, one at a time.
+ */
+class FovRecorder
+{
+    public:
+        /**
+         * @brief Allocates the batches and starts the writer thread. The
+         *        first segment is created with the first FoV.
+         */
+        FovRecorder(std::string prefix, uint32_t sensorHead, const FovRecorderConfig &config = {});
+        FovRecorder(const FovRecorder &) = delete;
+        FovRecorder &operator=(const FovRecorder &) = delete;
+        ~FovRecorder();  // Close()
+
+        /**
+         * @brief Copies the FoV into the current batch. Always called from
+         *        the same thread.
+         *
+         * @param newMappingTable The mapping table changed since the previous FoV
+         * @return false if the FoV was dropped, or the recorder is closed
+         */
+        bool Record(const FovSegment &fov, bool newMappingTable);
+
+        /**
+         * @brief Writes out the partially filled batch, closes the last
+         *        segment and stops the writer thread. Call it from the thread
+         *        that records, once it has stopped recording.
+         */
+        void Close();
+
+        FovRecorderStats GetStats() const;  // from any thread
+
+        /**
+         * @brief Rebuilds a FovSegment from a recorded FoV, for replay into
+         *        a CobraNetPipelineWrapper. The planes are copied.
+         */
+        static std::shared_ptr<FovSegment> ToFovSegment(const FovRecordView &view);
+
+        static std::string SegmentPath(const std::string &prefix, uint32_t sensorHead, uint32_t segmentNum);
+
+    private:
+        struct AlignedDeleter {
+            void operator()(uint8_t *ptr) const;
+        };
+        using AlignedBuffer = std::unique_ptr<uint8_t, AlignedDeleter>;
+
+        struct Batch {
+            uint8_t *data { nullptr };  // batchBytes aligned to FovContainer::ALIGNMENT
+            uint32_t length { 0 };      // filled in; a multiple of FovContainer::ALIGNMENT once sealed
+            std::vector<FovContainer::IndexEntry> entries;  // offsets from the start of the batch
+        };
+
+        static AlignedBuffer AllocateAligned(size_t bytes);
+        bool TakeBatch();
+        void SealBatch();
+        void WriterLoop();
+        void WriteBatch(Batch &batch);
+        bool OpenSegment();
+        void CloseSegment();
+        bool WriteHeader();
+        bool WriteAligned(const uint8_t *data, size_t bytes, uint64_t offset);
+
+        const std::string m_prefix;
+        const uint32_t m_sensorHead;
+        MemoryBudget::Grant m_batchGrant;  // before m_config, which sizes the batches from it
+        const FovRecorderConfig m_config;
+        std::vector<Batch> m_batches;
+        std::vector<AlignedBuffer> m_batchMemory;
+        SpscRing<Batch *> m_writerQueue;  // recording thread -> writer
+        SpscRing<Batch *> m_freeBatches;  // writer -> recording thread
+
+        // Recording thread state
+        Batch *m_current { nullptr };
+        bool m_closed { false };
+        uint64_t m_fovNumber { 0 };
+        std::atomic<uint64_t> m_recorded { 0 };
+        std::atomic<uint64_t> m_dropped { 0 };
+
+        // Writer thread state
+        int m_fd { -1 };
+        bool m_directIo { false };
+        bool m_failed { false };  // a write failed; the rest of the recording is discarded
+        FovContainer::FileHeader m_header {};
+        AlignedBuffer m_headerBuffer;
+        std::vector<FovContainer::IndexEntry> m_index;
+        uint64_t m_writeOffset { 0 };
+        uint32_t m_segmentNum { 0 };
+        uint64_t m_startNs { 0 };
+        std::atomic<uint64_t> m_bytesWritten { 0 };
+        std::atomic<uint32_t> m_segments { 0 };
+        std::atomic<uint32_t> m_writeErrors { 0 };
+
+        std::thread m_writerThread;
+};
+
+}
+
+#endif
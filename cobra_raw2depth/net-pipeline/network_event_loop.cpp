@@ -0,0 +1,936 @@
+/**
+ * @file network_event_loop.cpp
+ * @brief This file contains the implementation of the NetworkEventLoop, the
+ *        single epoll thread that serves the TCP clients of all the streams
+ *        of a sensor head.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved
+ */
+
+#include "network_event_loop.hpp"
+#include "LumoLogger.h"
+#include "PipelineTrace.h"
+#include "LumoAffinity.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define TCP_SERVE_BACKLOG 20
+#define EPOLL_MAX_EVENTS 32
+#define FLUSH_MAX_IOVECS 128            // Written per sendmsg: two per item, plus its segments
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+#define SCENE_INTERVAL_SLACK 8          // A scene may start up to 1/8 of the profile's frame time early
+
+using namespace LidarPipeline;
+
+/**
+ * @brief Reads the body of a profile request: the first row, number of rows (big-endian 16 bits each),
+ *        row step, first packet column, number of packet columns and maximum frame rate (8 bits each).
+ *        Zeros select the defaults, so an all-zero body goes back to the full profile.
+ */
+ClientProfile ClientProfile::Parse(const char *request)
+{
+    const auto *bytes = (const uint8_t *)request;
+    ClientProfile profile;
+    profile.firstRow = ((uint32_t)bytes[0] << 8U) | bytes[1];
+    profile.numRows = ((uint32_t)bytes[2] << 8U) | bytes[3];
+    profile.rowStep = std::max<uint32_t>(bytes[4], 1);
+    profile.firstColumn = bytes[5];
+    profile.numColumns = bytes[6];
+    profile.maxFps = bytes[7];
+    return profile;
+}
+
+NetworkEventLoop::NetworkEventLoop(const std::string &traceName, int traceHead) :
+    m_epollfd(-1),
+    m_wakeup({EndpointType::Wakeup, -1}),
+    m_timer({EndpointType::Timer, -1}),
+    m_timerDueNs(0),
+    m_quit(false),
+    m_streamSlots {},
+    m_traceName(traceName),
+    m_traceHead(traceHead)
+{
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollfd < 0)
+    {
+        LLogErr("NetworkEventLoop::NetworkEventLoop epoll_create1, errno=" << errno);
+        exit(1);
+    }
+
+    // Producers poke the loop through an eventfd once they have queued something
+    m_wakeup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeup.fd < 0)
+    {
+        LLogErr("NetworkEventLoop::NetworkEventLoop eventfd, errno=" << errno);
+        exit(1);
+    }
+
+    struct epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.ptr = &m_wakeup;
+    if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_wakeup.fd, &event) < 0)
+    {
+        LLogErr("NetworkEventLoop::NetworkEventLoop epoll_ctl, errno=" << errno);
+        exit(1);
+    }
+
+    // Streams that delay their items have the loop woken up when the next one is due
+    m_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timer.fd < 0)
+    {
+        LLogErr("NetworkEventLoop::NetworkEventLoop timerfd_create, errno=" << errno);
+        exit(1);
+    }
+    event.data.ptr = &m_timer;
+    if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_timer.fd, &event) < 0)
+    {
+        LLogErr("NetworkEventLoop::NetworkEventLoop epoll_ctl, errno=" << errno);
+        exit(1);
+    }
+
+    m_thread = std::thread(&NetworkEventLoop::Run, this);
+}
+
+NetworkEventLoop::~NetworkEventLoop()
+{
+    m_quit = true;
+    Wake();
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+
+    for (auto &stream : m_streams)
+    {
+        for (auto &client : stream->clients)
+        {
+            if (client->endpoint.fd >= 0)
+            {
+                close(client->endpoint.fd);
+            }
+        }
+        close(stream->listener.fd);
+    }
+    close(m_wakeup.fd);
+    close(m_timer.fd);
+    close(m_epollfd);
+}
+
+/**
+ * @brief Listens on a new TCP port. May be called while the loop is running.
+ *
+ * @param tcpPort             The port to listen on
+ * @param minSockBuffer       Minimum send buffer size of the client sockets, or 0 for the system default
+ * @param maxClientQueueBytes A client that has more than this waiting to be sent is evicted
+ * @param sendsClientMeta     New clients wait for a clientMeta item before they get any data
+ * @param verbosePrefix       Prefixed to the log messages of the stream
+ * @param formatParser        Reads the format requests of the clients, or nullptr if they all get format 0
+ * @param pacing              How the stream spreads out what it sends, by default not at all
+ *
+ * @return The stream to Send() to
+ */
+int NetworkEventLoop::AddStream(uint16_t tcpPort, ssize_t minSockBuffer, size_t maxClientQueueBytes,
+                                bool sendsClientMeta, const std::string &verbosePrefix,
+                                NetworkFormatParser formatParser, const NetworkPacing &pacing)
+{
+    auto stream = std::make_unique<Stream>();
+    stream->listener = {EndpointType::Listener, -1};
+    stream->port = tcpPort;
+    stream->reqSockBuffer = minSockBuffer;
+    stream->maxClientQueueBytes = maxClientQueueBytes;
+    stream->sendsClientMeta = sendsClientMeta;
+    stream->verbosePrefix = verbosePrefix;
+    stream->formatParser = formatParser;
+    stream->pacing = pacing;
+
+    // Grab a socket
+    int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listenfd < 0)
+    {
+        LLogErr(verbosePrefix << "NetworkEventLoop::AddStream socket, errno=" << errno);
+        exit(1);
+    }
+
+    // Reuse it
+    const int REUSEADDR_true = 1;
+    if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &REUSEADDR_true, sizeof(REUSEADDR_true)) < 0)
+    {
+        LLogErr(verbosePrefix << "NetworkEventLoop::AddStream setsockopt, errno=" << errno);
+        exit(1);
+    }
+
+    // Bind
+    struct sockaddr_in servAddr {};
+    servAddr.sin_family = AF_INET;
+    servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servAddr.sin_port = htons(tcpPort);
+    if (bind(listenfd, (struct sockaddr *) &servAddr, sizeof(servAddr)) < 0)
+    {
+        LLogErr(verbosePrefix << "NetworkEventLoop::AddStream bind, errno=" << errno);
+        exit(1);
+    }
+
+    // Listen
+    if (listen(listenfd, TCP_SERVE_BACKLOG) < 0)
+    {
+        LLogErr(verbosePrefix << "NetworkEventLoop::AddStream listen, errno=" << errno);
+        exit(1);
+    }
+    stream->listener.fd = listenfd;
+
+    // Publish the stream before the loop can see a connection on it, or a producer can send to it
+    int streamIdx = 0;
+    Stream *streamPtr = stream.get();
+    {
+        std::lock_guard<std::mutex> lock(m_streamsMut);
+        streamIdx = (int)m_streams.size();
+        if (streamIdx >= NETWORK_MAX_STREAMS)
+        {
+            LLogErr(verbosePrefix << "NetworkEventLoop::AddStream more than " << NETWORK_MAX_STREAMS << " streams");
+            exit(1);
+        }
+        m_streams.push_back(std::move(stream));
+        m_streamSlots[streamIdx].store(streamPtr, std::memory_order_release);
+    }
+
+    struct epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.ptr = &streamPtr->listener;
+    if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, listenfd, &event) < 0)
+    {
+        LLogErr(verbosePrefix << "NetworkEventLoop::AddStream epoll_ctl, errno=" << errno);
+        exit(1);
+    }
+
+    return streamIdx;
+}
+
+/**
+ * @brief Queues an item for all clients of the stream. Only one thread may send to a stream.
+ *
+ * @return false if the stream's queue was full and the item was dropped
+ */
+bool NetworkEventLoop::Send(int stream, std::shared_ptr<NetworkItem> item)
+{
+    Stream &target = GetStream(stream);
+
+    std::shared_ptr<NetworkItem> *slot = target.queue.beginPush();
+    if (slot == nullptr)
+    {
+        target.queue.countDrop();
+        return false;
+    }
+    if (target.pacing.sendDelayNs != 0)
+    {
+        item->queuedNs = FrameTrace::now();
+    }
+    *slot = std::move(item);
+    target.queue.commitPush();
+    Wake();
+    return true;
+}
+
+uint32_t NetworkEventLoop::NumClients(int stream) const
+{
+    return GetStream(stream).numClients.load(std::memory_order_relaxed);
+}
+
+uint32_t NetworkEventLoop::NumClients(int stream, int format) const
+{
+    return GetStream(stream).formatClients.at(format).load(std::memory_order_relaxed);
+}
+
+NetworkStreamStats NetworkEventLoop::GetStreamStats(int stream) const
+{
+    const Stream &target = GetStream(stream);
+    NetworkStreamStats stats {};
+    stats.accepted = target.accepted.load(std::memory_order_relaxed);
+    stats.evicted = target.evicted.load(std::memory_order_relaxed);
+    stats.dropped = target.queue.getStats().dropped;
+    stats.clients = target.numClients.load(std::memory_order_relaxed);
+    stats.maxPendingBytes = target.maxPendingBytes.load(std::memory_order_relaxed);
+    stats.maxClientQueueBytes = target.maxClientQueueBytes;
+    return stats;
+}
+
+/**
+ * @brief The stream that AddStream() returned as stream. Streams live as long as the loop, so this doesn't take
+ *        m_streamsMut, which the loop holds while it writes to the sockets.
+ */
+NetworkEventLoop::Stream &NetworkEventLoop::GetStream(int stream) const
+{
+    Stream *target = m_streamSlots.at(stream).load(std::memory_order_acquire);
+    if (target == nullptr)
+    {
+        LLogErr("NetworkEventLoop::GetStream no stream " << stream);
+        exit(1);
+    }
+    return *target;
+}
+
+void NetworkEventLoop::Wake()
+{
+    uint64_t one = 1;
+    if (write(m_wakeup.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        LLogErr("NetworkEventLoop::Wake write, errno=" << errno);
+    }
+}
+
+void NetworkEventLoop::Run()
+{
+    PipelineTrace::setThreadName(m_traceName, m_traceHead);
+    LumoAffinity::setThreadRole(LumoAffinity::ROLE_NETWORK);
+
+    std::array<struct epoll_event, EPOLL_MAX_EVENTS> events {};
+    while (!m_quit)
+    {
+        int numEvents = epoll_wait(m_epollfd, events.data(), (int)events.size(), -1);
+        if (numEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LLogErr("NetworkEventLoop::Run epoll_wait, errno=" << errno);
+            }
+            continue;
+        }
+
+        auto traceSpan = PipelineTrace::Span("NetworkEventLoop");
+        for (int eventNum = 0; eventNum < numEvents; eventNum++)
+        {
+            auto *endpoint = (Endpoint *)events.at(eventNum).data.ptr;
+            uint32_t flags = events.at(eventNum).events;
+            switch (endpoint->type)
+            {
+                case EndpointType::Wakeup:
+                {
+                    uint64_t count = 0;
+                    if (read(m_wakeup.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    {
+                        LLogErr("NetworkEventLoop::Run read, errno=" << errno);
+                    }
+                    DrainStreams();
+                    break;
+                }
+                case EndpointType::Timer:
+                {
+                    uint64_t expirations = 0;
+                    if (read(m_timer.fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    {
+                        LLogErr("NetworkEventLoop::Run read timer, errno=" << errno);
+                    }
+                    m_timerDueNs = 0;
+                    DrainStreams();
+                    break;
+                }
+                case EndpointType::Listener:
+                {
+                    std::lock_guard<std::mutex> lock(m_streamsMut);
+                    for (auto &stream : m_streams)
+                    {
+                        if (&stream->listener == endpoint)
+                        {
+                            AcceptClients(stream.get());
+                        }
+                    }
+                    break;
+                }
+                case EndpointType::Client:
+                {
+                    // endpoint is the first member of the client
+                    auto *client = (Client *)endpoint;
+                    if (client->endpoint.fd < 0)
+                    {
+                        break; // closed earlier in this batch
+                    }
+                    if ((flags & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0)
+                    {
+                        CloseClient(client, "disconnected");
+                        break;
+                    }
+                    if ((flags & EPOLLIN) != 0 && !ReadRequests(client))
+                    {
+                        break;
+                    }
+                    if ((flags & EPOLLOUT) != 0)
+                    {
+                        Flush(client);
+                    }
+                    break;
+                }
+            }
+        }
+
+        // Clients closed in this batch can go now that no event refers to them
+        std::lock_guard<std::mutex> lock(m_streamsMut);
+        for (auto &stream : m_streams)
+        {
+            RemoveClosedClients(stream.get());
+            size_t maxPendingBytes = 0;
+            for (const auto &client : stream->clients)
+            {
+                maxPendingBytes = std::max(maxPendingBytes, client->pendingBytes);
+            }
+            stream->maxPendingBytes.store(maxPendingBytes, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Hands everything the producers queued to the clients of their streams, apart from the items that their
+// stream holds back for a while yet
+void NetworkEventLoop::DrainStreams()
+{
+    std::lock_guard<std::mutex> lock(m_streamsMut);
+    const uint64_t now = FrameTrace::now();
+    uint64_t nextDueNs = UINT64_MAX;
+    for (auto &stream : m_streams)
+    {
+        std::shared_ptr<NetworkItem> *slot = nullptr;
+        while ((slot = stream->queue.front()) != nullptr)
+        {
+            const uint64_t dueNs = (*slot)->queuedNs + stream->pacing.sendDelayNs;
+            if (stream->pacing.sendDelayNs != 0 && dueNs > now)
+            {
+                nextDueNs = std::min(nextDueNs, dueNs);
+                break; // the items behind it are due later still
+            }
+            std::shared_ptr<NetworkItem> item = std::move(*slot);
+            stream->queue.pop();
+
+            // Write right away where the socket has room, so that only what a client
+            // can't take yet counts against it
+            for (auto &client : stream->clients)
+            {
+                if (client->endpoint.fd >= 0)
+                {
+                    Queue(client.get(), item);
+                }
+                if (client->endpoint.fd >= 0 && !client->writeWatched)
+                {
+                    Flush(client.get());
+                }
+            }
+        }
+    }
+    if (nextDueNs != UINT64_MAX)
+    {
+        ArmTimer(nextDueNs);
+    }
+}
+
+// Wakes the loop up at dueNs (CLOCK_MONOTONIC), unless the timer already fires before then
+void NetworkEventLoop::ArmTimer(uint64_t dueNs)
+{
+    if (m_timerDueNs != 0 && m_timerDueNs <= dueNs)
+    {
+        return;
+    }
+    struct itimerspec spec {};
+    spec.it_value.tv_sec = (time_t)(dueNs / NANOSECONDS_PER_SECOND);
+    spec.it_value.tv_nsec = (long)(dueNs % NANOSECONDS_PER_SECOND);
+    if (timerfd_settime(m_timer.fd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+    {
+        LLogErr("NetworkEventLoop::ArmTimer timerfd_settime, errno=" << errno);
+        return;
+    }
+    m_timerDueNs = dueNs;
+}
+
+void NetworkEventLoop::AcceptClients(Stream *stream)
+{
+    while (true)
+    {
+        struct sockaddr_in clientAddr {};
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        int clientfd = accept4(stream->listener.fd, (struct sockaddr *)&clientAddr, &clientAddrLen,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd < 0)
+        {
+            if ((errno != EWOULDBLOCK) && (errno != EAGAIN))
+            {
+                LLogErr(stream->verbosePrefix << "NetworkEventLoop::AcceptClients accept:errno=" << errno);
+            }
+            return; // in all cases leave the listening socket open
+        }
+
+        ConfigureClient(stream, clientfd);
+
+        auto client = std::make_unique<Client>();
+        client->endpoint = {EndpointType::Client, clientfd};
+        client->stream = stream;
+        client->addr = clientAddr;
+        client->pendingBytes = 0;
+        client->needsMeta = stream->sendsClientMeta;
+        client->format = 0;
+        client->requestLen = 0;
+        client->profileNext = false;
+        client->profile = {};
+        client->skipScene = false;
+        client->lastSceneNs = 0;
+        client->writeWatched = false;
+
+        struct epoll_event event {};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = &client->endpoint;
+        if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, clientfd, &event) < 0)
+        {
+            LLogErr(stream->verbosePrefix << "NetworkEventLoop::AcceptClients epoll_ctl, errno=" << errno);
+            close(clientfd);
+            continue;
+        }
+
+        std::array<char, INET_ADDRSTRLEN> clientAddrString {};
+        if(inet_ntop(AF_INET, (void *) &clientAddr.sin_addr, clientAddrString.data(), clientAddrString.size()) == nullptr)
+        {
+            strncpy(clientAddrString.data(), "--", clientAddrString.size() - 1);
+        }
+        LLogInfo(stream->verbosePrefix << "TCP: Got connection on port " << stream->port << " from " << clientAddrString.data() <<
+                 " (" << stream->clients.size() + 1 << " clients)");
+
+        // The producer notices the new count and sends the mapping table for it
+        stream->clients.push_back(std::move(client));
+        CountClients(stream);
+        stream->accepted.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Reads what the client sent: format requests, if the stream takes them. Returns false if the client was closed.
+bool NetworkEventLoop::ReadRequests(Client *client)
+{
+    Stream *stream = client->stream;
+    while (true)
+    {
+        ssize_t bytesRead = recv(client->endpoint.fd, client->request.data() + client->requestLen,
+                                 client->request.size() - client->requestLen, MSG_DONTWAIT);
+        if (bytesRead == 0)
+        {
+            CloseClient(client, "disconnected");
+            return false;
+        }
+        if (bytesRead < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                return true;
+            }
+            CloseClient(client, "receive failed");
+            return false;
+        }
+
+        client->requestLen += (size_t)bytesRead;
+        if (client->requestLen < client->request.size())
+        {
+            continue;
+        }
+        client->requestLen = 0;
+        if (stream->formatParser == nullptr)
+        {
+            continue; // nothing to ask for
+        }
+
+        if (client->profileNext)
+        {
+            client->profileNext = false;
+            client->profile = ClientProfile::Parse(client->request.data());
+            client->skipScene = false;
+            const ClientProfile &profile = client->profile;
+            LLogInfo(stream->verbosePrefix << "TCP: Client on port " << stream->port << " switched to profile firstRow=" <<
+                     profile.firstRow << ",numRows=" << profile.numRows << ",rowStep=" << profile.rowStep <<
+                     ",firstColumn=" << profile.firstColumn << ",numColumns=" << profile.numColumns <<
+                     ",maxFps=" << profile.maxFps);
+            continue;
+        }
+
+        int format = stream->formatParser(client->request.data());
+        if (format == NETWORK_PROFILE_REQUEST)
+        {
+            client->profileNext = true;
+            continue;
+        }
+        if (format < 0 || format >= NETWORK_MAX_FORMATS)
+        {
+            LLogWarning(stream->verbosePrefix << "TCP: Ignoring an invalid request on port " << stream->port);
+            continue;
+        }
+        if (format != client->format)
+        {
+            LLogInfo(stream->verbosePrefix << "TCP: Client on port " << stream->port << " switched to format " << format);
+            client->format = format;
+            CountClients(stream);
+        }
+    }
+}
+
+// Publishes how many clients the stream has, of each format
+void NetworkEventLoop::CountClients(Stream *stream)
+{
+    std::array<uint32_t, NETWORK_MAX_FORMATS> formatClients {};
+    for (auto &client : stream->clients)
+    {
+        if (client->endpoint.fd >= 0)
+        {
+            formatClients.at(client->format)++;
+        }
+    }
+    for (size_t format = 0; format < formatClients.size(); format++)
+    {
+        stream->formatClients.at(format).store(formatClients.at(format), std::memory_order_relaxed);
+    }
+    stream->numClients.store((uint32_t)stream->clients.size(), std::memory_order_relaxed);
+}
+
+// Per-connection socket options
+void NetworkEventLoop::ConfigureClient(Stream *stream, int clientfd)
+{
+    int option = 0; // we will reuse this integer to set socket options
+    const std::string &prefix = stream->verbosePrefix;
+
+    // Disable Nagle's Algorithm; every item is written out whole with one sendmsg
+    option = 1;
+    if(setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof (option)) < 0)
+    {
+        LLogErr(prefix << "NetworkEventLoop::ConfigureClient setsockopt TCP_NODELAY, errno=" << errno);
+    }
+
+    // Set a minimum send buffer size, if so requested.
+    // Note that Linux will likely get *more* buffer space than we request.
+    if (stream->reqSockBuffer != 0)
+    {
+        option = (int)stream->reqSockBuffer;
+        if (setsockopt(clientfd, SOL_SOCKET, SO_SNDBUF, &option, sizeof(option)) < 0)
+        {
+            LLogErr(prefix << "NetworkEventLoop::ConfigureClient setsockopt SO_SNDBUF");
+        }
+    }
+
+    // Let the kernel pace the packets out, rather than at line rate. TCP paces by itself once a rate is set.
+    if (stream->pacing.rateBytesPerSec != 0)
+    {
+        auto rate = (unsigned int)std::min<uint64_t>(stream->pacing.rateBytesPerSec, UINT32_MAX);
+        if (setsockopt(clientfd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0)
+        {
+            LLogErr(prefix << "NetworkEventLoop::ConfigureClient setsockopt SO_MAX_PACING_RATE, errno=" << errno);
+        }
+    }
+
+    socklen_t length = sizeof(option);
+    if (getsockopt(clientfd, SOL_SOCKET, SO_SNDBUF, &option, &length) < 0)
+    {
+        LLogErr(prefix << "NetworkEventLoop::ConfigureClient getsockopt SO_SNDBUF");
+    }
+    LLogDebug(prefix << "TCP: send buffer size requested: " << stream->reqSockBuffer << " actual: " << option);
+    if (option < stream->reqSockBuffer)
+    {
+        LLogErr(prefix << "NetworkEventLoop::ConfigureClient: Could not set minimum send buffer size as requested");
+    }
+
+    // Lets fail fast on hung connections.
+
+    // Enable TCP KEEPALIVE, TCP_KEEPIDLE = 1 second, TCP_KEEPINTVL = 11 seconds (1, 11 are
+    // relatively prime), TCP_KEEPCNT = 3 probes. Effectively ~34 seconds of timeout
+    // if connection idle.
+    constexpr int KEEPALIVE_TIME_SEC { 1 };
+    option = KEEPALIVE_TIME_SEC;
+    if (setsockopt(clientfd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option)) < 0)
+    {
+        LLogErr(prefix << "NetworkEventLoop::ConfigureClient setsockopt SO_KEEPALIVE");
+    }
+    constexpr int KEEPIDLE_TIME_SEC { 1 };
+    option = KEEPIDLE_TIME_SEC;
+    if (setsockopt(clientfd, IPPROTO_TCP, TCP_KEEPIDLE, &option, sizeof(option)) < 0)
+    {
+        LLogErr(prefix << "NetworkEventLoop::ConfigureClient setsockopt TCP_KEEPIDLE");
+    }
+    constexpr int KEEPINTVL_TIME_SEC { 11 };
+    option = KEEPINTVL_TIME_SEC;
+    if (setsockopt(clientfd, IPPROTO_TCP, TCP_KEEPINTVL, &option, sizeof(option)) < 0)
+    {
+        LLogErr(prefix << "NetworkEventLoop::ConfigureClient setsockopt TCP_KEEPINTVL");
+    }
+    constexpr int KEEPCOUNT { 3 };
+    option = KEEPCOUNT;
+    if (setsockopt(clientfd, IPPROTO_TCP, TCP_KEEPCNT, &option, sizeof(option)) < 0)
+    {
+        LLogErr(prefix << "NetworkEventLoop::ConfigureClient setsockopt TCP_KEEPCNT");
+    }
+
+    // Set TCP_USER_TIMEOUT = 30 seconds. Timeout after ~30 seconds when there is
+    // outstanding unacknowledged send data. Of same order as idle timeout above
+    // by design.
+    constexpr int USER_TIMEOUT_MS { 30000 };
+    option = USER_TIMEOUT_MS;
+    if (setsockopt(clientfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &option, sizeof(option)) < 0)
+    {
+        LLogErr(prefix << "NetworkEventLoop::ConfigureClient setsockopt TCP_USER_TIMEOUT");
+    }
+}
+
+// Appends the item to the client's queue, evicting the client if it can't keep up
+void NetworkEventLoop::Queue(Client *client, const std::shared_ptr<NetworkItem> &item)
+{
+    if (item->clientMeta)
+    {
+        if (item->newClientsOnly && !client->needsMeta)
+        {
+            return;
+        }
+        client->needsMeta = false; // an empty one has no mapping table to send, it just lets the client have data
+    }
+    else if (client->needsMeta || item->format != client->format)
+    {
+        return; // no data before the mapping table, nor in formats the client didn't ask for
+    }
+
+    // Clients with a profile only get part of the FOVs
+    std::shared_ptr<NetworkItem> toQueue = item;
+    if (!item->clientMeta && item->grid.packetsPerRow > 0 && !client->profile.IsFull())
+    {
+        if (item->grid.startsScene)
+        {
+            client->skipScene = !TakeScene(client);
+        }
+        if (client->skipScene)
+        {
+            return;
+        }
+        toQueue = SelectPackets(client->profile, item);
+    }
+
+    size_t itemLen = toQueue->Length();
+    if (itemLen == 0)
+    {
+        return;
+    }
+    if (!item->clientMeta)
+    {
+        if (client->pendingBytes > client->stream->maxClientQueueBytes)
+        {
+            client->stream->evicted.fetch_add(1, std::memory_order_relaxed);
+            CloseClient(client, "too slow to keep up, evicting");
+            return;
+        }
+        client->pendingBytes += itemLen;
+    }
+    client->pending.push_back({std::move(toQueue), 0});
+}
+
+// Decides whether a client with a profile takes the scene that starts now, given its frame rate limit
+bool NetworkEventLoop::TakeScene(Client *client)
+{
+    const uint32_t maxFps = client->profile.maxFps;
+    if (maxFps == 0)
+    {
+        return true;
+    }
+    const uint64_t interval = NANOSECONDS_PER_SECOND / maxFps;
+    const uint64_t now = FrameTrace::now();
+    if (client->lastSceneNs != 0 && now - client->lastSceneNs + interval / SCENE_INTERVAL_SLACK < interval)
+    {
+        return false;
+    }
+    client->lastSceneNs = now;
+    return true;
+}
+
+// Returns an item holding the packets of the item that the profile selects, as segments of the item's
+// payload. The new item keeps the original alive, and with it the payload.
+std::shared_ptr<NetworkItem> NetworkEventLoop::SelectPackets(const ClientProfile &profile,
+                                                             const std::shared_ptr<NetworkItem> &item)
+{
+    const NetworkItem::PacketGrid &grid = item->grid;
+    auto packetStart = [&grid](uint32_t packet) -> size_t {
+        return grid.offsets ? (*grid.offsets)[packet] : packet * grid.slotSize;
+    };
+
+    auto selected = std::make_shared<NetworkItem>();
+    selected->format = item->format;
+    selected->owner = item;
+
+    // Adjacent packets are sent as one segment
+    uint32_t selectedEnd = 0;
+    auto addPackets = [&](uint32_t first, uint32_t end) {
+        const char *data = item->payload + packetStart(first);
+        size_t len = packetStart(end) - packetStart(first);
+        if (!selected->segments.empty() && first == selectedEnd)
+        {
+            selected->segments.back().len += len;
+        }
+        else
+        {
+            selected->segments.push_back({data, len});
+        }
+        selectedEnd = end;
+    };
+
+    const uint32_t packetsPerRow = grid.packetsPerRow;
+    const uint32_t numRows = grid.numPackets / packetsPerRow;
+    const uint32_t firstColumn = std::min(profile.firstColumn, packetsPerRow);
+    const uint32_t endColumn = profile.numColumns == 0 ? packetsPerRow : std::min(packetsPerRow, firstColumn + profile.numColumns);
+    const uint32_t endRow = profile.numRows == 0 ? UINT32_MAX : profile.firstRow + profile.numRows;
+    for (uint32_t row = 0; row < numRows && firstColumn < endColumn; row++)
+    {
+        const uint32_t fovRow = grid.firstRow + row;
+        if (fovRow < profile.firstRow || fovRow >= endRow || (fovRow - profile.firstRow) % profile.rowStep != 0)
+        {
+            continue;
+        }
+        addPackets(row * packetsPerRow + firstColumn, row * packetsPerRow + endColumn);
+    }
+    if (grid.endsScene && grid.numPackets > 0 && selectedEnd != grid.numPackets)
+    {
+        addPackets(grid.numPackets - 1, grid.numPackets);
+    }
+    return selected;
+}
+
+// Writes as much of the client's queue as the socket takes. Returns false if the client was closed.
+bool NetworkEventLoop::Flush(Client *client)
+{
+    while (!client->pending.empty())
+    {
+        // The header, payload and segments of each item, minus what was already sent
+        std::array<struct iovec, FLUSH_MAX_IOVECS> iov {};
+        size_t iovCount = 0;
+        for (size_t itemNum = 0; itemNum < client->pending.size() && iovCount < iov.size(); itemNum++)
+        {
+            const Pending &pending = client->pending[itemNum];
+            const NetworkItem &item = *pending.item;
+            size_t skip = pending.offset;
+            auto addIovec = [&](const char *data, size_t len) {
+                if (skip >= len)
+                {
+                    skip -= len;
+                    return;
+                }
+                if (iovCount < iov.size())
+                {
+                    iov.at(iovCount).iov_base = const_cast<char *>(data + skip); // NOLINT(cppcoreguidelines-pro-type-const-cast) iovec is not const-correct
+                    iov.at(iovCount).iov_len = len - skip;
+                    iovCount++;
+                }
+                skip = 0;
+            };
+            addIovec(item.header.data(), item.headerLen);
+            addIovec(item.payload, item.payloadLen);
+            for (const auto &segment : item.segments)
+            {
+                addIovec(segment.data, segment.len);
+            }
+        }
+
+        struct msghdr msg {};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iovCount;
+        ssize_t bytesSent = sendmsg(client->endpoint.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (bytesSent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                WatchWrites(client, true); // wait for room in the socket
+                return true;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno != ECONNRESET) && (errno != EPIPE))
+            {
+                LLogErr(client->stream->verbosePrefix << "NetworkEventLoop::Flush send, errno=" << errno);
+            }
+            CloseClient(client, "send failed");
+            return false;
+        }
+
+        // Skip past whatever was sent
+        auto remaining = (size_t)bytesSent;
+        while (remaining > 0)
+        {
+            Pending &pending = client->pending.front();
+            NetworkItem &item = *pending.item;
+            size_t itemLen = item.Length();
+            if (pending.offset == 0 && item.frameLatency && item.frameTrace.ns[TRACE_FIRST_PACKET_SENT] == 0)
+            {
+                item.frameTrace.stamp(TRACE_FIRST_PACKET_SENT);
+            }
+            size_t step = std::min(remaining, itemLen - pending.offset);
+            pending.offset += step;
+            remaining -= step;
+            if (pending.offset < itemLen)
+            {
+                break;
+            }
+
+            // Fully sent. The first client to get there records the frame's latency.
+            if (item.frameLatency && item.frameTrace.valid() && item.frameTrace.ns[TRACE_LAST_PACKET_SENT] == 0)
+            {
+                item.frameTrace.stamp(TRACE_LAST_PACKET_SENT);
+                item.frameLatency->record(item.frameTrace);
+            }
+            if (!item.clientMeta)
+            {
+                client->pendingBytes -= itemLen;
+            }
+            client->pending.pop_front();
+        }
+    }
+
+    WatchWrites(client, false);
+    return true;
+}
+
+void NetworkEventLoop::WatchWrites(Client *client, bool watch)
+{
+    if (client->writeWatched == watch)
+    {
+        return;
+    }
+
+    struct epoll_event event {};
+    event.events = EPOLLIN | EPOLLRDHUP | (watch ? EPOLLOUT : 0);
+    event.data.ptr = &client->endpoint;
+    if (epoll_ctl(m_epollfd, EPOLL_CTL_MOD, client->endpoint.fd, &event) < 0)
+    {
+        LLogErr(client->stream->verbosePrefix << "NetworkEventLoop::WatchWrites epoll_ctl, errno=" << errno);
+        return;
+    }
+    client->writeWatched = watch;
+}
+
+// Closes the connection right away. The client itself is removed by RemoveClosedClients(), as
+// events of the current batch may still refer to it.
+void NetworkEventLoop::CloseClient(Client *client, const char *reason)
+{
+    std::array<char, INET_ADDRSTRLEN> clientAddrString {};
+    if(inet_ntop(AF_INET, (void *) &client->addr.sin_addr, clientAddrString.data(), clientAddrString.size()) == nullptr)
+    {
+        strncpy(clientAddrString.data(), "---", clientAddrString.size() - 1);
+    }
+    LLogInfo(client->stream->verbosePrefix << "TCP: Closing connection to " << clientAddrString.data() <<
+             " on port " << client->stream->port << ": " << reason);
+
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, client->endpoint.fd, nullptr);
+    close(client->endpoint.fd);
+    client->endpoint.fd = -1;
+    client->pending.clear(); // releases the buffers
+    client->pendingBytes = 0;
+}
+
+void NetworkEventLoop::RemoveClosedClients(Stream *stream)
+{
+    auto &clients = stream->clients;
+    clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                 [](const std::unique_ptr<Client> &client) { return client->endpoint.fd < 0; }),
+                  clients.end());
+    CountClients(stream);
+}
@@ -0,0 +1,284 @@
+#ifndef NETWORK_EVENT_LOOP_HPP
+#define NETWORK_EVENT_LOOP_HPP
+
+/**
+ * @file network_event_loop.hpp
+ * @brief This file contains the definition of the NetworkEventLoop, the single
+ *        epoll thread that serves the TCP clients of all the streams of a
+ *        sensor head. Each stream listens on its own port and can have any
+ *        number of clients; everything handed to a stream is sent to all of
+ *        them, each client draining its own queue at its own pace.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <SpscRing.h>
+#include <LatencyHistogram.h>
+
+#define NETWORK_ITEM_HEADER_MAX_SIZE    16
+#define NETWORK_STREAM_QUEUE_DEPTH      64
+#define NETWORK_MAX_STREAMS             64
+#define NETWORK_MAX_FORMATS             3
+#define NETWORK_FORMAT_REQUEST_SIZE     8
+#define NETWORK_PROFILE_REQUEST         (-2)
+
+namespace LidarPipeline {
+
+    /**
+     *  @brief Reads a NETWORK_FORMAT_REQUEST_SIZE byte request that a client sent,
+     *         and returns the format (below NETWORK_MAX_FORMATS) that it asks
+     *         for, or -1 if the request is not valid.
+     */
+    using NetworkFormatParser = int (*)(const char *request);
+
+    /**
+     *  @brief The part of a stream's FOVs that a client gets, for clients that
+     *         only need a preview, e.g. visualization and monitoring: a window
+     *         of rows, every rowStep-th of them, a window of the packets of
+     *         each row (64 pixel columns each for point cloud packets), and at
+     *         most maxFps FOVs per second. The default profile gets everything.
+     *
+     *         A client asks for a profile by sending a request for which the
+     *         stream's NetworkFormatParser returns NETWORK_PROFILE_REQUEST,
+     *         followed by the NETWORK_FORMAT_REQUEST_SIZE bytes that Parse()
+     *         reads. The profile applies to the items that describe their
+     *         PacketGrid; the packets are picked out of the shared buffers
+     *         when the item is queued for the client, so nothing is encoded
+     *         or copied per client.
+     */
+    struct ClientProfile {
+        uint32_t firstRow { 0 };
+        uint32_t numRows { 0 };     // 0 for every row from firstRow
+        uint32_t rowStep { 1 };
+        uint32_t firstColumn { 0 }; // in packets
+        uint32_t numColumns { 0 };  // 0 for every packet from firstColumn
+        uint32_t maxFps { 0 };      // 0 for every FOV
+
+        bool IsFull() const {
+            return firstRow == 0 && numRows == 0 && rowStep <= 1 && firstColumn == 0 && numColumns == 0 && maxFps == 0;
+        }
+        static ClientProfile Parse(const char *request);
+    };
+
+    /**
+     *  @brief Something to send to every client of a stream: an optional header
+     *         followed by a payload and any further segments, which are sent
+     *         as one, e.g. the ROIs of a batch that sit in different buffers.
+     *         owner keeps the payload and the segments alive until every client
+     *         has sent them, so producers hand their buffers over instead of
+     *         copying them.
+     *
+     *         On a stream that sends client metadata (the mapping table), a client
+     *         that connects gets nothing until a clientMeta item has been sent to it;
+     *         a newClientsOnly clientMeta item only goes to such clients, and an empty
+     *         one just releases them. Other items only go to the clients that asked for
+     *         their format (0 unless they asked otherwise). If frameLatency is set,
+     *         frameTrace is stamped and recorded into it once the first client has sent
+     *         the whole item.
+     *
+     *         The payload of a FOV's packets may describe how they are laid out
+     *         in its grid, so that clients with a ClientProfile get only some of
+     *         them. Packet k starts at offsets[k] if set, or else at k * slotSize
+     *         into the payload; there are packetsPerRow of them to each row of the
+     *         FOV, starting at row firstRow. Clients with a frame rate limit take
+     *         or skip a whole scene at the item that starts it, and the packet that
+     *         ends a scene is always sent, so that clients can still tell where
+     *         each scene ends.
+     */
+    struct NetworkItem {
+        struct Segment {
+            const char *data;
+            size_t len;
+        };
+        struct PacketGrid {
+            uint32_t numPackets;
+            uint32_t packetsPerRow;  // 0 if the payload is not a grid of packets
+            uint32_t firstRow;
+            size_t slotSize;
+            std::shared_ptr<const std::vector<uint32_t>> offsets; // numPackets + 1 of them, if the packets vary in size
+            bool startsScene;
+            bool endsScene;
+        };
+        std::array<char, NETWORK_ITEM_HEADER_MAX_SIZE> header;
+        size_t headerLen;
+        const char *payload;
+        size_t payloadLen;
+        std::vector<Segment> segments; // after the payload
+        std::shared_ptr<const void> owner;
+        bool clientMeta;
+        bool newClientsOnly;
+        int format;
+        FrameTrace frameTrace;
+        std::shared_ptr<FrameLatency> frameLatency;
+        PacketGrid grid;
+        uint64_t queuedNs;  // when it was handed to Send(), on streams that delay their items
+
+        size_t Length() const {
+            size_t len = headerLen + payloadLen;
+            for (const auto &segment : segments) {
+                len += segment.len;
+            }
+            return len;
+        }
+    };
+
+    /**
+     *  @brief How a stream spreads out what it sends. Each client socket is
+     *         paced by the kernel to at most rateBytesPerSec (SO_MAX_PACING_RATE),
+     *         rather than going out at line rate, and every item is held for
+     *         sendDelayNs before it is sent. Giving the streams of a sensor head
+     *         different delays staggers the FOVs that complete together, so that
+     *         they don't hit the link in one burst. Zeros turn either off.
+     */
+    struct NetworkPacing {
+        uint64_t rateBytesPerSec { 0 };
+        uint64_t sendDelayNs { 0 };
+    };
+
+    /**
+     *  @brief The counters of a stream of a NetworkEventLoop.
+     */
+    struct NetworkStreamStats {
+        uint64_t accepted;  // clients that connected
+        uint64_t evicted;   // clients that were closed for falling behind
+        uint64_t dropped;   // items the stream's queue had no room for
+        uint32_t clients;   // clients currently connected
+        size_t maxPendingBytes;     // the largest backlog of a client, as of the loop's last wakeup
+        size_t maxClientQueueBytes; // the backlog at which a client is evicted
+    };
+
+    /**
+     *  @brief One epoll thread that accepts, feeds and closes the TCP clients
+     *         of several streams. Streams are added with AddStream() from any
+     *         thread, then each stream must be fed by a single producer thread
+     *         with Send(), which never blocks: the stream is looked up without a
+     *         lock, the item goes through a lock-free SpscRing and the loop writes
+     *         it to the clients' non-blocking sockets.
+     *
+     *         Clients of a stream with a NetworkFormatParser may ask for another
+     *         format of the data at any time, by sending a request.
+     *
+     *         A client that has more than the stream's maxClientQueueBytes of
+     *         items waiting (not counting the mapping table) is too slow to keep
+     *         up and is evicted, so that it can neither hold on to buffers nor
+     *         hold back the other clients.
+     *
+     *         A stream can have its sends paced and delayed (see NetworkPacing);
+     *         the loop then keeps the delayed items in the stream's queue and
+     *         sets a timer for the first one that is due.
+     */
+    class NetworkEventLoop {
+        public:
+            NetworkEventLoop(const std::string &traceName, int traceHead);
+            NetworkEventLoop(NetworkEventLoop &other) = delete;
+            NetworkEventLoop(NetworkEventLoop &&other) = delete;
+            NetworkEventLoop &operator=(NetworkEventLoop &rhs) = delete;
+            NetworkEventLoop &operator=(NetworkEventLoop &&rhs) = delete;
+            ~NetworkEventLoop();
+
+            int AddStream(uint16_t tcpPort, ssize_t minSockBuffer, size_t maxClientQueueBytes,
+                          bool sendsClientMeta, const std::string &verbosePrefix,
+                          NetworkFormatParser formatParser = nullptr, const NetworkPacing &pacing = {});
+            bool Send(int stream, std::shared_ptr<NetworkItem> item);
+            uint32_t NumClients(int stream) const;
+            uint32_t NumClients(int stream, int format) const;
+            NetworkStreamStats GetStreamStats(int stream) const;
+
+        private:
+            enum class EndpointType { Wakeup, Timer, Listener, Client };
+
+            // What an epoll event refers to
+            struct Endpoint {
+                EndpointType type;
+                int fd;
+            };
+
+            struct Client;
+
+            struct Stream {
+                Endpoint listener;
+                uint16_t port;
+                ssize_t reqSockBuffer;
+                size_t maxClientQueueBytes;
+                bool sendsClientMeta;
+                std::string verbosePrefix;
+                NetworkFormatParser formatParser;
+                NetworkPacing pacing;
+                SpscRing<std::shared_ptr<NetworkItem>> queue; // producer -> loop
+                std::vector<std::unique_ptr<Client>> clients;  // loop only
+                std::atomic<uint32_t> numClients;
+                std::array<std::atomic<uint32_t>, NETWORK_MAX_FORMATS> formatClients; // clients of each format
+                std::atomic<uint64_t> accepted;
+                std::atomic<uint64_t> evicted;
+                std::atomic<size_t> maxPendingBytes;
+                Stream() : queue(NETWORK_STREAM_QUEUE_DEPTH), numClients(0), formatClients {}, accepted(0), evicted(0),
+                           maxPendingBytes(0) {}
+            };
+
+            // A queued item, and how much of it the client has sent
+            struct Pending {
+                std::shared_ptr<NetworkItem> item;
+                size_t offset;
+            };
+
+            struct Client {
+                Endpoint endpoint;
+                Stream *stream;
+                struct sockaddr_in addr;
+                std::deque<Pending> pending;
+                size_t pendingBytes;  // not counting the mapping table
+                bool needsMeta;       // connected since the last clientMeta item
+                int format;           // of the data items it gets
+                std::array<char, NETWORK_FORMAT_REQUEST_SIZE> request; // being received
+                size_t requestLen;
+                bool profileNext;     // the next request is the ClientProfile
+                ClientProfile profile;
+                bool skipScene;       // the scene being sent is over the profile's frame rate
+                uint64_t lastSceneNs; // when the last scene the client took started
+                bool writeWatched;    // EPOLLOUT is enabled
+            };
+
+            Stream &GetStream(int stream) const;
+            void Run();
+            void Wake();
+            void DrainStreams();
+            void ArmTimer(uint64_t dueNs);
+            void AcceptClients(Stream *stream);
+            void ConfigureClient(Stream *stream, int clientfd);
+            bool ReadRequests(Client *client);
+            void CountClients(Stream *stream);
+            void Queue(Client *client, const std::shared_ptr<NetworkItem> &item);
+            static bool TakeScene(Client *client);
+            static std::shared_ptr<NetworkItem> SelectPackets(const ClientProfile &profile,
+                                                              const std::shared_ptr<NetworkItem> &item);
+            bool Flush(Client *client);
+            void WatchWrites(Client *client, bool watch);
+            void CloseClient(Client *client, const char *reason);
+            void RemoveClosedClients(Stream *stream);
+
+            int m_epollfd;
+            Endpoint m_wakeup;
+            Endpoint m_timer;      // fires when the next delayed item is due
+            uint64_t m_timerDueNs; // 0 if the timer is not armed
+            std::atomic_bool m_quit;
+            std::mutex m_streamsMut; // guards m_streams, not the streams themselves
+            std::vector<std::unique_ptr<Stream>> m_streams;
+            std::array<std::atomic<Stream *>, NETWORK_MAX_STREAMS> m_streamSlots; // m_streams by index, read without the mutex
+            std::string m_traceName;
+            int m_traceHead;
+            std::thread m_thread;
+    };
+
+};
+
+#endif
@@ -2,7 +2,6 @@
  * @file network_streamer.cpp
  * @brief This file contains the implementations of the network streamer
  *        classes: NetworkStreamer, UDPStreamer, and TCPWrappedStreamer.
- *        The UDPStreamer is not supported at this time.
  *        
  * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved
  */
@@ -10,8 +9,12 @@
 #include "network_streamer.hpp"
 #include "pipeline_data.hpp"
 #include "LumoLogger.h"
+#include "PipelineTrace.h"
+#include "PerfCounters.h"
 #include "MappingTable.h"
+#include "RawToDepthDsp.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cassert>
 #include <cstdlib>
@@ -19,13 +22,16 @@
 #include <cerrno>
 #include <cstring>
 #include <iostream>
+#include <mutex>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <endian.h>
 #include <fcntl.h>
 
 #define PROTO_MAGIC_0   'B'
@@ -134,6 +140,94 @@ struct TypeDPacket {
     TypeDReturn ret[MAX_CPI_PER_RETURN];        // NOLINT(hicpp-avoid-c-arrays) Use of a packed structure
 } __attribute__((packed));
 
+// Type E Packet: Compressed Returns
+// Same pixels, header and sequence numbers as the Type D packet it replaces, but only the pixels
+// with a valid range are sent. Bit n of validMask is set if pixel payloadStareOrderOffset + n is
+// valid. The header is followed by, for the numValid valid pixels in order:
+//   - numValid - 1 range deltas of rangeBits bits each, packed MSB first and padded to a byte. Each
+//     one is the zigzag-coded difference (modulo 2^16) between the range of a pixel and the one
+//     before it, the first range being firstRange
+//   - numValid intensities, then numValid backgrounds, then numValid SNRs, 16 bits each, except
+//     for the planes flagged in absentPlanes (TypeDReturnFlags: itensityPresentAndValid,
+//     backgroundPresentAndValid, snrPresentAndValid), which the FOV doesn't output
+// Sent instead of Type D to the TCP clients that request it (see FormatRequest).
+
+#define PROTO_TYPEE_CODE 0xEU
+#define TYPE_E_NARROW_RANGE_BITS 12U
+#define TYPE_E_WIDE_RANGE_BITS 16U
+
+struct TypeEHeader {
+    uint8_t numPixels;
+    uint8_t numValid;
+    uint8_t rangeBits;
+    uint8_t absentPlanes;
+    uint16_t firstRange;
+    uint64_t validMask;
+} __attribute__((packed));
+
+struct TypeEPacket {
+    GlobalHeader globalHeader;
+    TypeDHeader tDh;
+    TypeEHeader tEh;
+    // Packed returns follow
+} __attribute__((packed));
+
+// Range deltas, intensities, backgrounds and SNRs of a full packet
+constexpr size_t TYPE_E_PACKET_MAX_SIZE { sizeof(TypeEPacket) + 4 * MAX_CPI_PER_RETURN * sizeof(uint16_t) };
+
+// Type F Packet: XYZ Returns
+// Same pixels, header and sequence numbers as the Type D packet it replaces, but each return
+// carries the point (x, y, z) in 1/1024 m, from the range and the pixel's mapping table angles,
+// instead of the range. Points without a valid range are at the origin, without the
+// rangePresentAndValid flag. Only sent when the sensor head computes points (--xyz), to the TCP
+// clients that request it (see FormatRequest).
+
+#define PROTO_TYPEF_CODE 0xFU
+
+struct TypeFReturn {
+    int32_t x;
+    int32_t y;
+    int32_t z;
+    uint16_t intensity;
+    uint16_t background;
+    uint16_t snr;
+    uint8_t extraAnnotation;
+    uint8_t retFlags;
+} __attribute__((packed));
+
+struct TypeFPacket {
+    GlobalHeader globalHeader;
+    TypeDHeader tDh;
+    TypeFReturn ret[MAX_CPI_PER_RETURN];        // NOLINT(hicpp-avoid-c-arrays) Use of a packed structure
+} __attribute__((packed));
+
+// Sent by a TCP client to pick the packet type of the returns it gets: PROTO_TYPED_CODE (the
+// default), PROTO_TYPEE_CODE or PROTO_TYPEF_CODE. Raw data clients pick the RawFormat of the ROIs
+// instead: PROTO_RAW_ROI_CODE (the default), PROTO_RAW_BATCHED_CODE or PROTO_RAW_PACKED_CODE.
+// With PROTO_PROFILE_CODE, a point cloud client picks the part of the FOVs it gets instead; the
+// request is followed by the profile (see ClientProfile::Parse()).
+struct FormatRequest {
+    uint8_t magic[MAGIC_SIZE];          // NOLINT(hicpp-avoid-c-arrays) Use of a packed structure
+    uint8_t version_type;
+    uint8_t reserved[3];                // NOLINT(hicpp-avoid-c-arrays) Use of a packed structure
+} __attribute__((packed));
+static_assert(sizeof(FormatRequest) == NETWORK_FORMAT_REQUEST_SIZE, "the event loop reads whole FormatRequests");
+
+#define PROTO_PROFILE_CODE 0x5U
+
+// Raw ROI batches: one framed message (see FramingHeader) with the roiBatch flag, the number of ROIs
+// in flagDependentVal1 and the size of each ROI in flagDependentVal2, followed by the ROIs back to
+// back. Packed ROIs hold each pair of 16-bit words (the 12 significant bits of which are the sample
+// or metadata value, see DEFAULT_RAW_MASK and MD_SHIFT) in 3 bytes, in the MIPI CSI-2 RAW12 layout:
+// the top 8 bits of the first, the top 8 bits of the second, then the next 4 bits of the first in
+// the low nibble and of the second in the high nibble.
+
+#define PROTO_RAW_ROI_CODE      0x0U
+#define PROTO_RAW_BATCHED_CODE  0x1U
+#define PROTO_RAW_PACKED_CODE   0x2U
+
+static_assert(ROI_SIZE % 4 == 0, "packed ROIs hold whole pairs of words");
+
 
 // Type C Packet: Sensor Information Update
 // Sequential "fill" of sensor parameters in (U, V) space. Likely happens at "beginning" 
@@ -155,6 +249,9 @@ struct TypeDPacket {
 // These parameters should apply to *all future reports* until replaced by another Type 4
 // packet.
 
+// The Type C packets of a table are numbered from 0 in their global headers, separately from
+// the sequence numbers of the returns, since the same packets are sent to every new client.
+
 // Sequential "fill" of returns starting at (payloadStartU, payloadStartV), filled
 // in "U-Major" order, sequentually in single-unit step. If that fill exceeds
 // imageEndV, wrap to (0, payloadStartV + 1). 
@@ -211,7 +308,9 @@ NetworkStreamer::NetworkStreamer(uint32_t deviceVersion,
                                  uint32_t deviceID,
                                  PipelineOutputType outputType) :
     m_configLocked(false),
-    m_payloadBufferSpace({}),
+    m_frameLatency(nullptr),
+    m_compressedLen(0),
+    m_xyzLen(0),
     m_deviceVersion(deviceVersion), 
     m_deviceID(deviceID),
     m_seq(0),
@@ -221,6 +320,8 @@ NetworkStreamer::NetworkStreamer(uint32_t deviceVersion,
     m_lastSceneEndSeq(0),
     m_thisSceneBeginSeq(0),
     m_thisSceneLastSeq(0),
+    m_thisSceneFirstRow(0),
+    m_thisSceneNextRow(0),
     m_dbg_maxFrames(0),
     m_dbg_maxFramesActive(false),
     m_dbg_maxFramesRemaining(0),
@@ -246,7 +347,7 @@ NetworkStreamer::NetworkStreamer(uint32_t deviceVersion,
 // after network streamer is constructed, but before it actually talks to anything
 bool NetworkStreamer::setDeviceID(uint32_t deviceID)
 {
-    if(m_configLocked)
+    if(ConfigLocked())
     {
         return false;
     }
@@ -276,6 +377,13 @@ void NetworkStreamer::set_dbg_MaxFrames(int maxFrames)
      }
  }
 
+// Frames whose chunks carry a valid trace are recorded into frameLatency once their last packet has been
+// sent to a connected client. Must be called before StartModule(); nullptr disables the recording.
+void NetworkStreamer::SetFrameLatency(std::shared_ptr<FrameLatency> frameLatency)
+{
+    m_frameLatency = std::move(frameLatency);
+}
+
 void NetworkStreamer::WorkOnSingleChunk(ReturnChunk *chunk)
 {
 
@@ -320,162 +428,615 @@ static inline void fillInGlobalHeader(GlobalHeader *globalHeader,
     globalHeader->deviceID = htonl(deviceID);
 }
 
-static inline void fillInTypeDReturnData(TypeDPacket *packet, CPIReturn *cpir)
+constexpr unsigned int PTP_TIMESTAMP_COARSE_SIZE    { 6 };
+constexpr unsigned int PTP_TIMESTAMP_FINE_SIZE      { 4 };
+constexpr uint64_t SHIFT32                  { 32 };
+constexpr uint64_t PTP_COARSE_MASK          { 0x0000FFFFFFFFFFFF };
+constexpr uint64_t PTP_FINE_MASK            { 0x3FFFFFFF };
+constexpr uint64_t ARB_TIME_FILTER          { 0x40000000 }; // coarse timestamps before this time (Y2004) are considered ARB and not UTC
+constexpr uint32_t FPGA_TIMESTAMP_UNITS     { 10U };        // FPGA fine timestamps are in 10ns units
+
+// Chunky timestamps instead of frame-based timestamps: each packet/chunk is one
+// row of the FOV, and so comes from a single ROI, whose timestamp overwrites the
+// standard/frame-based one.
+// The PTP timestamps of the ROIs are converted once per FOV (see ConvertRoiTimestamps()).
+// Returns the timescale of the timestamp written to the header.
+static inline TimestampScale fillInTimestamp(TypeDHeader *tDh, uint16_t roiIdx,
+                                             const std::vector<uint64_t> &roiPtpSec,
+                                             const std::vector<uint32_t> &roiPtpNsec,
+                                             const std::vector<uint8_t> &roiTimestampArb)
+{
+    uint64_t ptp_sec = roiPtpSec.at(roiIdx);
+    uint32_t ptp_nsec = roiPtpNsec[roiIdx];
+    memcpy(&tDh->timestamp[0], ((uint8_t *)&ptp_sec) + 2, PTP_TIMESTAMP_COARSE_SIZE);
+    memcpy(&tDh->timestamp[PTP_TIMESTAMP_COARSE_SIZE], ((uint8_t *)&ptp_nsec), PTP_TIMESTAMP_FINE_SIZE);
+    return roiTimestampArb[roiIdx] != 0 ? TimestampScale::ARB : TimestampScale::UTC;
+}
+
+// Straight-line loop over contiguous spans so that it is auto-vectorized into byte shuffles
+static inline void swapToBigEndian(const uint16_t *in, uint16_t *out, size_t count)
 {
-    for(unsigned int channel = 0; channel < MAX_CPI_PER_RETURN; channel++)
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        out[idx] = htobe16(in[idx]);
+    }
+}
+
+constexpr auto ALL_PLANE_FLAGS = (uint8_t)((uint8_t)TypeDReturnFlags::itensityPresentAndValid |
+                                           (uint8_t)TypeDReturnFlags::backgroundPresentAndValid |
+                                           (uint8_t)TypeDReturnFlags::snrPresentAndValid);
+
+// The return flags of the planes that are present; signal, background and snr are nullptr for the
+// planes that the FOV doesn't output (see FovSegment)
+static inline uint8_t presentPlaneFlags(const uint16_t *signal, const uint16_t *background, const uint16_t *snr)
+{
+    return (uint8_t)((signal != nullptr ? (uint8_t)TypeDReturnFlags::itensityPresentAndValid : 0U) |
+                     (background != nullptr ? (uint8_t)TypeDReturnFlags::backgroundPresentAndValid : 0U) |
+                     (snr != nullptr ? (uint8_t)TypeDReturnFlags::snrPresentAndValid : 0U));
+}
+
+// Fills in the returns of one Type D packet from count consecutive pixels of the FOV planes.
+// Channels past count are left zeroed (not present), and so are the absent (nullptr) planes.
+static inline void fillInTypeDReturnData(TypeDPacket *packet, size_t count,
+                                         const uint16_t *range, const uint16_t *signal,
+                                         const uint16_t *background, const uint16_t *snr)
+{
+    std::array<uint16_t, MAX_CPI_PER_RETURN> rangeBe {};
+    std::array<uint16_t, MAX_CPI_PER_RETURN> signalBe {};
+    std::array<uint16_t, MAX_CPI_PER_RETURN> backgroundBe {};
+    std::array<uint16_t, MAX_CPI_PER_RETURN> snrBe {};
+    swapToBigEndian(range, rangeBe.data(), count);
+    if (signal != nullptr)
+    {
+        swapToBigEndian(signal, signalBe.data(), count);
+    }
+    if (background != nullptr)
+    {
+        swapToBigEndian(background, backgroundBe.data(), count);
+    }
+    if (snr != nullptr)
+    {
+        swapToBigEndian(snr, snrBe.data(), count);
+    }
+
+    const uint8_t planeFlags = presentPlaneFlags(signal, background, snr);
+    for (size_t channel = 0; channel < count; channel++)
     {
-        TypeDReturn* tDr = &packet->ret[channel];
-        
         // Only single return in Type 2 packets
-        if(cpir->rangeValid.at(channel))
+        TypeDReturn* tDr = &packet->ret[channel];
+        tDr->intensity = signalBe[channel];
+        tDr->background = backgroundBe[channel];
+        tDr->snr = snrBe[channel];
+        tDr->retFlags = planeFlags;
+        if (range[channel] != 0)
         {
-            tDr->range = htons(cpir->range.at(channel));
+            tDr->range = rangeBe[channel];
             tDr->retFlags |= (uint8_t)TypeDReturnFlags::rangePresentAndValid;
         }
-        if(cpir->intensityValid.at(channel))
-        {
-            tDr->intensity = htons(cpir->intensity.at(channel));
-            tDr->retFlags |= (uint8_t)TypeDReturnFlags::itensityPresentAndValid;
-        }
-        if(cpir->backgroundValid.at(channel))
-        {
-            tDr->background = htons(cpir->background.at(channel));
-            tDr->retFlags |= (uint8_t)TypeDReturnFlags::backgroundPresentAndValid;
-        }
-        if(cpir->snrValid.at(channel))
-        {
-            tDr->snr = htons(cpir->snr.at(channel));
-            tDr->retFlags |= (uint8_t)TypeDReturnFlags::snrPresentAndValid;
-        }            
-        if(cpir->extraAnnotationType.at(channel) != 0)
+    }
+}
+
+// The points of a Type F packet; x, y and z are the planes of FovSegment::getXyz()
+static inline void fillInTypeFReturnData(TypeFPacket *packet, size_t count, const uint16_t *range,
+                                         const int32_t *x, const int32_t *y, const int32_t *z,
+                                         const uint16_t *signal, const uint16_t *background, const uint16_t *snr)
+{
+    const uint8_t planeFlags = presentPlaneFlags(signal, background, snr);
+    for (size_t channel = 0; channel < count; channel++)
+    {
+        TypeFReturn* tFr = &packet->ret[channel];
+        tFr->x = (int32_t)htonl((uint32_t)x[channel]);
+        tFr->y = (int32_t)htonl((uint32_t)y[channel]);
+        tFr->z = (int32_t)htonl((uint32_t)z[channel]);
+        tFr->intensity = signal != nullptr ? htons(signal[channel]) : 0;
+        tFr->background = background != nullptr ? htons(background[channel]) : 0;
+        tFr->snr = snr != nullptr ? htons(snr[channel]) : 0;
+        tFr->retFlags = planeFlags;
+        if (range[channel] != 0)
         {
-            tDr->extraAnnotation = cpir->extraAnnotation.at(channel);
-            tDr->retFlags |= (unsigned int)cpir->extraAnnotationType.at(channel) << 4U;
+            tFr->retFlags |= (uint8_t)TypeDReturnFlags::rangePresentAndValid;
         }
     }
 }
 
-void NetworkStreamer::WorkOnCPIChunk(ReturnChunk *chunk)
+static inline uint16_t zigzag16(uint16_t delta)
 {
-    // For now, generate advisory-only scene markers (which is safe, since
-    // the are in fact advisory-only) assuming one receive chunk per scene
-    // if we have no other information. I.e. set newScene to true at the 
-    // beginning of an RC.
-
-    // If "lastCpiInFrame" flag is set on a CPI, this indicates it's the last CPI
-    // in a frame, and we should increment the frame counters on the next one.
-    // I.e. set newScene to true on next iteration when emitFrame is set on
-    // current CPI.
-    bool newScene = true;
-
-    // For each return in the chunk, generate a packet
-    for(uint32_t rNum = 0; rNum < chunk->cpiReturnsUsed; rNum ++)
-    {
-        CPIReturn* cpir = chunk->cpiReturns.at(rNum);
-
-        // If we want to suppress streaming of this CPI, make sure we skip
-        // scene and sequence management so we don't confuse consumers about
-        // missing data!
-        if(cpir->metaSupressStream)
+    auto value = (int16_t)delta;
+    return (uint16_t)(((uint16_t)value << 1U) ^ (uint16_t)(value >> 15));
+}
+
+// Fills in the packed returns of one Type E packet from count consecutive pixels of the FOV planes.
+// The absent (nullptr) planes are left out. Returns the size of the packet.
+static inline size_t fillInTypeEReturnData(TypeEPacket *packet, size_t count,
+                                           const uint16_t *range, const uint16_t *signal,
+                                           const uint16_t *background, const uint16_t *snr)
+{
+    std::array<uint8_t, MAX_CPI_PER_RETURN> valid {};
+    uint64_t validMask = 0;
+    size_t numValid = 0;
+    for (size_t channel = 0; channel < count; channel++)
+    {
+        if (range[channel] != 0)
         {
-            continue;
+            validMask |= 1ULL << channel;
+            valid[numValid++] = (uint8_t)channel;
         }
+    }
 
-        // Update calibration pointers coherently (want to do it in same thread)
-        // as they're read from, regardless of if they're used at this moment or
-        // later. If any are null -- a full update isn't available in this CpiReturn, 
-        // and we shouldn't update our cached version.
-        if ((cpir->calibrationX && cpir->calibrationY && cpir->calibrationTheta && cpir->calibrationPhi))
+    // Neighboring pixels are mostly at similar ranges, so the deltas usually fit the narrow width
+    std::array<uint16_t, MAX_CPI_PER_RETURN> deltas {};
+    uint16_t widest = 0;
+    for (size_t validNum = 1; validNum < numValid; validNum++)
+    {
+        deltas[validNum - 1] = zigzag16((uint16_t)(range[valid[validNum]] - range[valid[validNum - 1]]));
+        widest |= deltas[validNum - 1];
+    }
+    unsigned int rangeBits = (widest >> TYPE_E_NARROW_RANGE_BITS) == 0 ? TYPE_E_NARROW_RANGE_BITS : TYPE_E_WIDE_RANGE_BITS;
+
+    TypeEHeader *tEh = &packet->tEh;
+    tEh->numPixels = (uint8_t)count;
+    tEh->numValid = (uint8_t)numValid;
+    tEh->rangeBits = (uint8_t)rangeBits;
+    tEh->absentPlanes = (uint8_t)(presentPlaneFlags(signal, background, snr) ^ ALL_PLANE_FLAGS);
+    tEh->firstRange = numValid > 0 ? htons(range[valid[0]]) : 0;
+    tEh->validMask = htobe64(validMask);
+
+    auto *out = (uint8_t *)(packet + 1);
+    uint32_t bits = 0;
+    unsigned int numBits = 0;
+    for (size_t deltaNum = 0; deltaNum + 1 < numValid; deltaNum++)
+    {
+        bits = (bits << rangeBits) | deltas[deltaNum];
+        numBits += rangeBits;
+        while (numBits >= 8)
         {
-            m_calibrationX = cpir->calibrationX;
-            m_calibrationY = cpir->calibrationY;
-            m_calibrationTheta = cpir->calibrationTheta;
-            m_calibrationPhi = cpir->calibrationPhi;
+            numBits -= 8;
+            *out++ = (uint8_t)(bits >> numBits);
         }
+    }
+    if (numBits > 0)
+    {
+        *out++ = (uint8_t)(bits << (8 - numBits));
+    }
 
-        if(cpir->prefixMetaDataUpdate)
+    for (const uint16_t *plane : {signal, background, snr})
+    {
+        if (plane == nullptr)
         {
-            UpdateClientMeta();
+            continue;
         }
-
-        // Scene Management
-        if(newScene)
+        for (size_t validNum = 0; validNum < numValid; validNum++)
         {
-            // Last Scene <- This Scene
-            m_lastSceneSeqsValid = m_thisSceneSeqsValid;
-            m_lastSceneBeginSeq = m_thisSceneBeginSeq;
-            m_lastSceneEndSeq = m_thisSceneLastSeq;
+            uint16_t value = htobe16(plane[valid[validNum]]);
+            memcpy(out, &value, sizeof(value));
+            out += sizeof(value);
+        }
+    }
+    return (size_t)(out - (uint8_t *)packet);
+}
 
-            // This Scene <- Fresh
-            m_thisSceneSeqsValid = true;
-            m_thisSceneBeginSeq = m_seq;
+// Only TCP clients can ask for a packet type; returns the PointFormat asked for, or -1
+int NetworkStreamer::ParseFormatRequest(const char *request)
+{
+    const auto *formatRequest = (const FormatRequest *)request;
+    if (formatRequest->magic[0] != PROTO_MAGIC_0 || formatRequest->magic[1] != PROTO_MAGIC_1 ||
+        formatRequest->magic[2] != PROTO_MAGIC_2 || formatRequest->magic[3] != PROTO_MAGIC_3 ||
+        (formatRequest->version_type >> HEADER_VERSION_SHIFT) != PROTO_VER)
+    {
+        return -1;
+    }
+    switch (formatRequest->version_type & ((1U << HEADER_VERSION_SHIFT) - 1U))
+    {
+        case PROTO_TYPED_CODE: return (int)PointFormat::TypeD;
+        case PROTO_TYPEE_CODE: return (int)PointFormat::Compressed;
+        case PROTO_TYPEF_CODE: return (int)PointFormat::Xyz;
+        case PROTO_PROFILE_CODE: return NETWORK_PROFILE_REQUEST;
+        default: return -1;
+    }
+}
 
-            // We've consumed the newScene flag
-            newScene = false;
-        }
+// Returns the RawFormat asked for by a raw data client, or -1
+int NetworkStreamer::ParseRawFormatRequest(const char *request)
+{
+    const auto *formatRequest = (const FormatRequest *)request;
+    if (formatRequest->magic[0] != PROTO_MAGIC_0 || formatRequest->magic[1] != PROTO_MAGIC_1 ||
+        formatRequest->magic[2] != PROTO_MAGIC_2 || formatRequest->magic[3] != PROTO_MAGIC_3 ||
+        (formatRequest->version_type >> HEADER_VERSION_SHIFT) != PROTO_VER)
+    {
+        return -1;
+    }
+    switch (formatRequest->version_type & ((1U << HEADER_VERSION_SHIFT) - 1U))
+    {
+        case PROTO_RAW_ROI_CODE: return (int)RawFormat::Roi;
+        case PROTO_RAW_BATCHED_CODE: return (int)RawFormat::Batched;
+        case PROTO_RAW_PACKED_CODE: return (int)RawFormat::Packed;
+        default: return -1;
+    }
+}
 
-        std::fill(m_payloadBufferSpace.begin(), m_payloadBufferSpace.end(), 0);
-        auto* packet = (TypeDPacket *) m_payloadBufferSpace.data();
+// Converts the 94-bit timestamp of each ROI of the FOV into the PTP timestamp of the Type D header,
+// once per FOV rather than once per packet. The timestamps are first copied into flat planes, so
+// that the conversion is a straight-line loop that the compiler vectorizes.
+void NetworkStreamer::ConvertRoiTimestamps(const std::vector<std::vector<uint32_t>> &fullTimestampByIdxVector)
+{
+    const size_t numRois = fullTimestampByIdxVector.size();
+    m_roiTimestamps.assign(3 * numRois, 0);
+    uint32_t *fine = m_roiTimestamps.data();
+    uint32_t *coarseLo = fine + numRois;
+    uint32_t *coarseHi = coarseLo + numRois;
+    for (size_t roi = 0; roi < numRois; roi++)
+    {
+        const auto &timestamp = fullTimestampByIdxVector[roi];
+        fine[roi] = timestamp[0];
+        coarseLo[roi] = timestamp[1];
+        coarseHi[roi] = timestamp[2];
+    }
 
-        // Global Header
-        fillInGlobalHeader(&packet->globalHeader, PROTO_TYPED_CODE, m_deviceVersion, m_deviceID, m_seq);
+    m_roiPtpSec.resize(numRois);
+    m_roiPtpNsec.resize(numRois);
+    m_roiTimestampArb.resize(numRois);
+    uint64_t *ptpSec = m_roiPtpSec.data();
+    uint32_t *ptpNsec = m_roiPtpNsec.data();
+    uint8_t *arb = m_roiTimestampArb.data();
+    for (size_t roi = 0; roi < numRois; roi++)
+    {
+        uint64_t coarse = ((uint64_t)coarseHi[roi] << SHIFT32) + coarseLo[roi];
+        ptpSec[roi] = htobe64(coarse & PTP_COARSE_MASK);
+        ptpNsec[roi] = htobe32((fine[roi] & PTP_FINE_MASK) * FPGA_TIMESTAMP_UNITS);
+        arb[roi] = coarse < ARB_TIME_FILTER ? 1 : 0;
+    }
+}
 
-        // Type D Header
-        TypeDHeader* tDh = &packet->tDh;
+// Encodes the whole FOV into m_frameBuffer as consecutive Type D packets if typeD is set, into
+// m_compressedBuffer as Type E packets if compressed is set, and into m_xyzBuffer as Type F packets
+// if xyz is set (and the FOV has points), each packet preceded by its FramingSize() bytes of framing.
+// All get the same sequence numbers. Returns the number of packets.
+// An FOV streamed in segments (FovSegment::getFirstRow()) is sent as one scene, as long as each
+// segment continues the one before it; its packets are numbered as if the FOV were sent whole.
+// The transport may hold on to the buffers after the send, in which case the next FOV gets new ones.
+size_t NetworkStreamer::EncodeFov(const FovSegment &fov, bool typeD, bool compressed, bool xyz)
+{
+    auto traceSpan = PipelineTrace::Span("EncodeFov");
+
+    const auto &rangeVector = *fov.getRange();
+    const auto &roiIdxRows = *fov.getRoiIndexRows();
+    // The planes that the FOV doesn't output are nullptr, and are sent as absent
+    const std::vector<uint16_t> *signalVector = fov.getSignal().get();
+    const std::vector<uint16_t> *snrVector = fov.getSnrSquared().get();
+    const std::vector<uint16_t> *bgVector = fov.getBackground().get();
+    auto planeAt = [](const std::vector<uint16_t> *plane, size_t index) -> const uint16_t *
+    {
+        return plane != nullptr ? plane->data() + index : nullptr;
+    };
+    const auto xyzVector = fov.getXyz();
+    xyz = xyz && xyzVector;
+
+    // Indexed by ROI Index, *not* image coordinates (one level of indirection not present in other
+    // data)
+    ConvertRoiTimestamps(*fov.getTimestampsVec());
+
+    // Image Size
+    const std::vector<uint32_t> &sizes = fov.getImageSize();
+    uint32_t sizeSteerDim = sizes[0];
+    uint32_t sizeStareDim = sizes[1];
+
+    // Image Steps
+    const std::vector<uint32_t> &steps = fov.getMappingTableStep();
+    uint32_t stepSteerDim = steps[0];
+    uint32_t stepStareDim = steps[1];
+
+    // Image Top Left
+    const std::vector<uint32_t> &topLeft = fov.getMappingTableTopLeft();
+    uint32_t tlSteerDim = topLeft[0];
+    uint32_t tlStareDim = topLeft[1];
+
+    // Network level dimensions
+    // Note from X10/X20, we implicitly have 64 channels everywhere
+    size_t steerAngles = sizeSteerDim;
+    size_t stareSteps = (sizeStareDim + (NUM_CHANNELS_PER_TYPE2_PACKET - 1))/ NUM_CHANNELS_PER_TYPE2_PACKET;
+    size_t numPackets = steerAngles * stareSteps;
+
+    // Reuse the buffers unless the last frame is still being sent from them
+    const size_t slotSize = FramingSize() + sizeof(TypeDPacket);
+    if (typeD)
+    {
+        if (!m_frameBuffer || m_frameBuffer.use_count() > 1)
+        {
+            m_frameBuffer = std::make_shared<std::vector<char>>();
+        }
+        if (m_frameBuffer->size() < numPackets * slotSize)
+        {
+            m_frameBuffer->resize(numPackets * slotSize);
+        }
+        memset(m_frameBuffer->data(), 0, numPackets * slotSize);
+    }
+    m_compressedLen = 0;
+    if (compressed)
+    {
+        if (!m_compressedBuffer || m_compressedBuffer.use_count() > 1)
+        {
+            m_compressedBuffer = std::make_shared<std::vector<char>>();
+        }
+        if (!m_compressedOffsets || m_compressedOffsets.use_count() > 1)
+        {
+            m_compressedOffsets = std::make_shared<std::vector<uint32_t>>();
+        }
+        m_compressedOffsets->clear();
+        if (m_compressedBuffer->size() < numPackets * (FramingSize() + TYPE_E_PACKET_MAX_SIZE))
+        {
+            m_compressedBuffer->resize(numPackets * (FramingSize() + TYPE_E_PACKET_MAX_SIZE));
+        }
+    }
 
-        // Timestamp should already be in network order
-        memcpy(&tDh->timestamp, cpir->timestamp.data(), cpir->timestamp.size());
-        tDh->tscale_aoSeqFlags = ((uint8_t) cpir->tscale) << 4U;
-        if(m_lastSceneSeqsValid)
+    const size_t xyzSlotSize = FramingSize() + sizeof(TypeFPacket);
+    m_xyzLen = 0;
+    if (xyz)
+    {
+        if (!m_xyzBuffer || m_xyzBuffer.use_count() > 1)
         {
-            tDh->tscale_aoSeqFlags |= (uint8_t)TypeDAOSeqFlags::lastSceneBeginSequenceValid;
-            tDh->tscale_aoSeqFlags |= (uint8_t)TypeDAOSeqFlags::lastSceneEndSequenceValid;
-            tDh->aolsstartSeq = htonl(m_lastSceneBeginSeq);
-            tDh->aolsendSeq = htonl(m_lastSceneEndSeq);
+            m_xyzBuffer = std::make_shared<std::vector<char>>();
         }
-        if(m_thisSceneSeqsValid)
+        if (m_xyzBuffer->size() < numPackets * xyzSlotSize)
         {
+            m_xyzBuffer->resize(numPackets * xyzSlotSize);
+        }
+        memset(m_xyzBuffer->data(), 0, numPackets * xyzSlotSize);
+        m_xyzLen = numPackets * xyzSlotSize;
+    }
+
+    if (numPackets == 0)
+    {
+        return 0;
+    }
+
+    // The packets of one FOV make up one scene
+    const uint32_t firstRow = fov.getFirstRow();
+    const uint32_t fovRows = fov.getFovNumRows();
+    const bool startsScene = firstRow == 0 || firstRow != m_thisSceneNextRow;
+    if (startsScene)
+    {
+        // Last Scene <- This Scene
+        m_lastSceneSeqsValid = m_thisSceneSeqsValid;
+        m_lastSceneBeginSeq = m_thisSceneBeginSeq;
+        m_lastSceneEndSeq = m_thisSceneLastSeq;
+
+        // This Scene <- Fresh
+        m_thisSceneSeqsValid = true;
+        m_thisSceneBeginSeq = m_seq;
+        m_thisSceneFirstRow = firstRow;
+    }
+    m_packetGrid = {};
+    m_packetGrid.numPackets = (uint32_t)numPackets;
+    m_packetGrid.packetsPerRow = (uint32_t)stareSteps;
+    m_packetGrid.firstRow = firstRow;
+    m_packetGrid.startsScene = startsScene;
+    m_packetGrid.endsScene = firstRow + sizeSteerDim == fovRows;
+    m_thisSceneNextRow = firstRow + sizeSteerDim;
+    const size_t scenePackets = (fovRows - m_thisSceneFirstRow) * stareSteps;
+
+    TypeDHeader headerOnly {}; // the Type D header, when there is no Type D packet to build it in
+    char *slot = typeD ? m_frameBuffer->data() : nullptr;
+    char *compressedSlot = compressed ? m_compressedBuffer->data() : nullptr;
+    char *xyzSlot = xyz ? m_xyzBuffer->data() : nullptr;
+    const size_t fovArea = rangeVector.size();
+    for (size_t i = 0; i < steerAngles; i++)
+    {
+        for (size_t j = 0; j < stareSteps; j++)
+        {
+            uint32_t startingStareOrder = NUM_CHANNELS_PER_TYPE2_PACKET * j;
+            bool lastInFrame = (firstRow + i == fovRows - 1) && (j == stareSteps - 1);
+
+            // Return Data, a contiguous span of one steering angle
+            size_t count = std::min<size_t>(NUM_CHANNELS_PER_TYPE2_PACKET, sizeStareDim - startingStareOrder);
+            size_t inIndex = i * sizeStareDim + startingStareOrder;
+            TypeDHeader* tDh = &headerOnly;
+            if (typeD)
+            {
+                auto *packet = (TypeDPacket *)(slot + FramingSize());
+                FillInFraming(slot, sizeof(TypeDPacket));
+                slot += slotSize;
+
+                // Global Header
+                fillInGlobalHeader(&packet->globalHeader, PROTO_TYPED_CODE, m_deviceVersion, m_deviceID, m_seq);
+
+                fillInTypeDReturnData(packet, count,
+                                      &rangeVector[inIndex], planeAt(signalVector, inIndex),
+                                      planeAt(bgVector, inIndex), planeAt(snrVector, inIndex));
+                tDh = &packet->tDh;
+            }
+            else
+            {
+                headerOnly = {};
+            }
+
+            // Type D Header
+            TimestampScale tscale = fillInTimestamp(tDh, roiIdxRows[i], m_roiPtpSec, m_roiPtpNsec, m_roiTimestampArb);
+            tDh->tscale_aoSeqFlags = ((uint8_t) tscale) << 4U;
+            if(m_lastSceneSeqsValid)
+            {
+                tDh->tscale_aoSeqFlags |= (uint8_t)TypeDAOSeqFlags::lastSceneBeginSequenceValid;
+                tDh->tscale_aoSeqFlags |= (uint8_t)TypeDAOSeqFlags::lastSceneEndSequenceValid;
+                tDh->aolsstartSeq = htonl(m_lastSceneBeginSeq);
+                tDh->aolsendSeq = htonl(m_lastSceneEndSeq);
+            }
             tDh->tscale_aoSeqFlags |= (uint8_t)
                 TypeDAOSeqFlags::currentSceneBeginSequenceValid;
             tDh->aocsstartSeq = htonl(m_thisSceneBeginSeq);
-
-            if (cpir->metaLastCpiInFrame)
+            // The size of the scene is known up front, so its end is too; transports that
+            // may lose packets announce it in every packet
+            if (lastInFrame || AnnouncesSceneEnd())
             {
                 tDh->tscale_aoSeqFlags |= (uint8_t)
                     TypeDAOSeqFlags::currentSceneEndSequenceValid;
-                tDh->aocsendSeq = htonl(m_seq);
+                tDh->aocsendSeq = htonl(m_thisSceneBeginSeq + scenePackets - 1);
             }
+            tDh->completeSizeSteerDim = htons(fovRows);
+            tDh->completeSizeStareDim = htons(sizeStareDim);
+            tDh->payloadSteerOrderOffset = htons(firstRow + i);
+            tDh->payloadStareOrderOffset = htons(startingStareOrder);
+
+            // Hack in SWDL variable vertical crop and bin for now
+            tDh->bs_SteerOffset = htons(tlSteerDim + i * stepSteerDim);
+            tDh->bs_SteerStep = htons(stepSteerDim);
+            tDh->bs_StareOffset = htons(tlStareDim + startingStareOrder * stepStareDim);
+            tDh->bs_StareStep = htons(stepStareDim);
+
+            // And hack in user tag, too
+            tDh->bs_UserTag = htons(fov.getUserTag());
+
+            // Type E Packet, with the same header
+            if (compressed)
+            {
+                m_compressedOffsets->push_back((uint32_t)m_compressedLen);
+                auto *packet = (TypeEPacket *)(compressedSlot + FramingSize());
+                memset(packet, 0, sizeof(TypeEPacket));
+                fillInGlobalHeader(&packet->globalHeader, PROTO_TYPEE_CODE, m_deviceVersion, m_deviceID, m_seq);
+                packet->tDh = *tDh;
+                size_t packetLen = fillInTypeEReturnData(packet, count,
+                                                         &rangeVector[inIndex], planeAt(signalVector, inIndex),
+                                                         planeAt(bgVector, inIndex), planeAt(snrVector, inIndex));
+                FillInFraming(compressedSlot, packetLen);
+                compressedSlot += FramingSize() + packetLen;
+                m_compressedLen += FramingSize() + packetLen;
+            }
+
+            // Type F Packet, with the same header
+            if (xyz)
+            {
+                auto *packet = (TypeFPacket *)(xyzSlot + FramingSize());
+                FillInFraming(xyzSlot, sizeof(TypeFPacket));
+                xyzSlot += xyzSlotSize;
+                fillInGlobalHeader(&packet->globalHeader, PROTO_TYPEF_CODE, m_deviceVersion, m_deviceID, m_seq);
+                packet->tDh = *tDh;
+                fillInTypeFReturnData(packet, count, &rangeVector[inIndex],
+                                      &(*xyzVector)[inIndex], &(*xyzVector)[fovArea + inIndex],
+                                      &(*xyzVector)[2 * fovArea + inIndex],
+                                      planeAt(signalVector, inIndex), planeAt(bgVector, inIndex),
+                                      planeAt(snrVector, inIndex));
+            }
+
+            // Sequence Management
+            m_thisSceneLastSeq = m_seq;
+            m_seq++;
         }
-        tDh->completeSizeSteerDim = htons(cpir->completeSizeSteerDim);
-        tDh->completeSizeStareDim = htons(cpir->completeSizeStareDim);
-        tDh->payloadSteerOrderOffset = htons(cpir->startingSteerOrder);
-        tDh->payloadStareOrderOffset = htons(cpir->startingStareOrder);
-        tDh->bs_SteerOffset = htons(cpir->bs_SteerOffset);
-        tDh->bs_SteerStep = htons(cpir->bs_SteerStep);
-        tDh->bs_StareOffset = htons(cpir->bs_StareOffset);
-        tDh->bs_StareStep = htons(cpir->bs_StareStep);
-        tDh->bs_UserTag = htons(cpir->bs_UserTag);
-
-        // Return Data
-        fillInTypeDReturnData(packet, cpir);
-
-        // Scene and Sequence Management
-        m_thisSceneLastSeq = m_seq;
-        m_seq++;
-        if(cpir->metaLastCpiInFrame)
-        {
-            newScene = true;
-        }
+    }
+    if (compressed)
+    {
+        m_compressedOffsets->push_back((uint32_t)m_compressedLen);
+    }
 
-        // Fire the packet off
-        this->NetworkSend((char *)packet, sizeof(TypeDPacket));
+    return numPackets;
+}
+
+void NetworkStreamer::WorkOnCPIChunk(ReturnChunk *chunk)
+{
+    auto traceSpan = PipelineTrace::Span("WorkOnCPIChunk");
+
+    if (!chunk->fov)
+    {
+        return;
+    }
+    const FovSegment &fov = *chunk->fov;
+    auto perfCounters = PerfCounters::Scoped(PERF_STAGE_NET_CPI_CHUNK, fov.getFovIdx());
+
+    // Update calibration pointers coherently (want to do it in same thread)
+    // as they're read from, regardless of if they're used at this moment or
+    // later. If any are null -- a full update isn't available in this FOV,
+    // and we shouldn't update our cached version.
+    auto calibrationX = fov.getCalibrationX();
+    auto calibrationY = fov.getCalibrationY();
+    auto calibrationTheta = fov.getCalibrationTheta();
+    auto calibrationPhi = fov.getCalibrationPhi();
+    if (calibrationX && calibrationY && calibrationTheta && calibrationPhi)
+    {
+        m_calibrationX = std::move(calibrationX);
+        m_calibrationY = std::move(calibrationY);
+        m_calibrationTheta = std::move(calibrationTheta);
+        m_calibrationPhi = std::move(calibrationPhi);
     }
 
+    // A new mapping table goes to everyone, otherwise new clients get the current one
+    if(chunk->prefixMetaDataUpdate)
+    {
+        UpdateClientMeta(false);
+    }
+    else if (TakeNewClients())
+    {
+        UpdateClientMeta(true);
+    }
+
+    // Only encode what somebody gets
+    bool typeD = WantsFormat(PointFormat::TypeD);
+    bool compressed = WantsFormat(PointFormat::Compressed);
+    bool xyz = fov.getXyz() && WantsFormat(PointFormat::Xyz);
+    if (!typeD && !compressed && !xyz)
+    {
+        return;
+    }
+    size_t numPackets = EncodeFov(fov, typeD, compressed, xyz);
+    if (numPackets == 0)
+    {
+        return;
+    }
+
+    // The frame latency is recorded once, by the first stream sent
+    FrameTrace frameTrace = chunk->frameTrace;
+    if (typeD)
+    {
+        NetworkSendFrame(m_frameBuffer, sizeof(TypeDPacket), numPackets, false, false, frameTrace);
+        frameTrace = {};
+    }
+    if (compressed)
+    {
+        NetworkSendStream(m_compressedBuffer, m_compressedLen, PointFormat::Compressed, frameTrace);
+        frameTrace = {};
+    }
+    if (xyz)
+    {
+        NetworkSendStream(m_xyzBuffer, m_xyzLen, PointFormat::Xyz, frameTrace);
+    }
+}
+
+// Default: only Type D is sent
+void NetworkStreamer::NetworkSendStream(std::shared_ptr<std::vector<char>> /*stream*/, size_t /*len*/, PointFormat /*format*/,
+                                        FrameTrace /*frameTrace*/)
+{
+    LLogErr(m_verbosePrefix << "NetworkStreamer::NetworkSendStream This transport only sends Type D packets");
+}
+
+// Default: one NetworkSend per packet of the frame. The whole frame goes out in one go, so its
+// first and last packets leave together.
+void NetworkStreamer::NetworkSendFrame(std::shared_ptr<const std::vector<char>> frame, size_t packetLen, size_t numPackets,
+                                       bool /*clientMeta*/, bool /*newClientsOnly*/, FrameTrace frameTrace)
+{
+    const size_t slotSize = FramingSize() + packetLen;
+    for (size_t packetNum = 0; packetNum < numPackets; packetNum++)
+    {
+        this->NetworkSend(frame->data() + packetNum * slotSize + FramingSize(), packetLen);
+    }
+
+    // Frames that nobody received would only skew the send latencies
+    if (m_frameLatency != nullptr && frameTrace.valid() && HasClient())
+    {
+        frameTrace.stamp(TRACE_FIRST_PACKET_SENT);
+        frameTrace.stamp(TRACE_LAST_PACKET_SENT);
+        m_frameLatency->record(frameTrace);
+    }
 }
 
 void NetworkStreamer::WorkOnROIChunk(ReturnChunk *chunk)
 {
-    this->NetworkROISend(chunk->roiReturn->roi.data(), ROI_SIZE);
+    // The ROI has to outlive the send: hand on the producer's buffer if it was lent to us, otherwise our
+    // copy, which the ROIReturn gives up and reallocates for the next ROI
+    ROIReturn *roir = chunk->roiReturn;
+    if (roir->sharedRoi)
+    {
+        this->NetworkROISend(roir->sharedRoi, roir->sharedRoi.get(), ROI_SIZE, roir->lastOfFov);
+        return;
+    }
+    auto copy = std::make_shared<std::vector<char>>(std::move(roir->roi));
+    const char *roi = copy->data();
+    this->NetworkROISend(std::move(copy), roi, ROI_SIZE, roir->lastOfFov);
 }
 
 // Trivial Implementation -- No prep work
@@ -495,14 +1056,44 @@ void NetworkStreamer::FinishROISend()
 constexpr size_t MAPPING_TABLE_WIDTH    { IMAGE_WIDTH * 2U - 1U };
 constexpr size_t MAPPING_TABLE_HEIGHT   { MAX_IMAGE_HEIGHT * 2U - 1U };
 
-void NetworkStreamer::UpdateClientMeta()
+// The Type C packets of a mapping table, encoded once per load of the table and shared by every
+// streamer that frames its packets the same way and sends as the same device. Read-only once built.
+struct EncodedMappingTable {
+    std::weak_ptr<const CalibrationPlane> calibrationTheta;
+    std::weak_ptr<const CalibrationPlane> calibrationPhi;
+    size_t framingSize;
+    uint32_t deviceVersion;
+    uint32_t deviceID;
+    std::shared_ptr<const std::vector<char>> packets;
+    size_t numPackets;
+};
+
+static std::mutex s_encodedMappingTablesMut;
+static std::vector<EncodedMappingTable> s_encodedMappingTables;
+
+// Returns the Type C packets of the current mapping table, encoding them only if no streamer has yet.
+// The packets are numbered from 0 within the table, apart from the sequence numbers of the returns.
+std::shared_ptr<const std::vector<char>> NetworkStreamer::EncodeMappingTable(size_t *numPackets)
 {
-    // Send mapping table
-    if(!(m_calibrationX && m_calibrationY && m_calibrationTheta && m_calibrationPhi))
+    std::lock_guard<std::mutex> lock(s_encodedMappingTablesMut);
+
+    // Drop the tables that were replaced
+    s_encodedMappingTables.erase(std::remove_if(s_encodedMappingTables.begin(), s_encodedMappingTables.end(),
+                                                [](const EncodedMappingTable &encoded) {
+                                                    return encoded.calibrationTheta.expired() || encoded.calibrationPhi.expired();
+                                                }),
+                                 s_encodedMappingTables.end());
+    for (const auto &encoded : s_encodedMappingTables)
     {
-        return;
+        if (encoded.calibrationTheta.lock() == m_calibrationTheta && encoded.calibrationPhi.lock() == m_calibrationPhi &&
+            encoded.framingSize == FramingSize() && encoded.deviceVersion == m_deviceVersion && encoded.deviceID == m_deviceID)
+        {
+            *numPackets = encoded.numPackets;
+            return encoded.packets;
+        }
     }
-    StartROISend();
+
+    auto traceSpan = PipelineTrace::Span("EncodeMappingTable");
     auto *calibrationTheta = m_calibrationTheta.get();
     auto *calibrationPhi = m_calibrationPhi.get();
     assert(calibrationTheta->size() == calibrationPhi->size());
@@ -516,16 +1107,23 @@ void NetworkStreamer::UpdateClientMeta()
     size_t height = MAPPING_TABLE_HEIGHT;
     assert(len == width * height);
 
+    size_t packetsPerLine = (width + TYPE_C_POINTS_PER_PACKET_MAX - 1) / TYPE_C_POINTS_PER_PACKET_MAX;
+    *numPackets = packetsPerLine * height;
+    const size_t slotSize = FramingSize() + sizeof(TypeCMappingTable);
+    auto table = std::make_shared<std::vector<char>>(*numPackets * slotSize);
+    char *slot = table->data();
+    uint32_t seq = 0;
+
     for (size_t payloadV = 0; payloadV < height; payloadV++)
     {
-        for (size_t payloadU = 0; payloadU < width; payloadU += TYPE_C_POINTS_PER_PACKET_MAX)
+        for (size_t payloadU = 0; payloadU < width; payloadU += TYPE_C_POINTS_PER_PACKET_MAX, slot += slotSize)
         {
-            memset(m_payloadBufferSpace.data(), 0, m_payloadBufferSpace.size());
-            auto *packet = (TypeCMappingTable *)m_payloadBufferSpace.data();
+            auto *packet = (TypeCMappingTable *)(slot + FramingSize());
+            FillInFraming(slot, sizeof(TypeCMappingTable));
 
             // Global Header
-            fillInGlobalHeader(&packet->globalHeader, PROTO_TYPEC_CODE, m_deviceVersion, m_deviceID, m_seq);
-            m_seq++;
+            fillInGlobalHeader(&packet->globalHeader, PROTO_TYPEC_CODE, m_deviceVersion, m_deviceID, seq);
+            seq++;
 
             // Type C Header
             TypeCHeader *tCh = &packet->tCh;
@@ -544,19 +1142,42 @@ void NetworkStreamer::UpdateClientMeta()
                     continue;
                 } 
                 // to a signed host to network conversion for azimuth/elevation
-                uint32_t theta = htonl(*reinterpret_cast<uint32_t*>(&(*calibrationTheta)[mappingTableIndex]));
-                uint32_t phi = htonl(*reinterpret_cast<uint32_t*>(&(*calibrationPhi)[mappingTableIndex]));
+                uint32_t theta = htonl(*reinterpret_cast<const uint32_t*>(&(*calibrationTheta)[mappingTableIndex]));
+                uint32_t phi = htonl(*reinterpret_cast<const uint32_t*>(&(*calibrationPhi)[mappingTableIndex]));
                 packet->mappingTableEntry[mapPktIndex].theta = *(reinterpret_cast<int32_t*>(&theta));
                 packet->mappingTableEntry[mapPktIndex].phi = *(reinterpret_cast<int32_t*>(&phi));
                 mappingTableIndex++;
             }
+        }
+    }
+
+    s_encodedMappingTables.push_back({m_calibrationTheta, m_calibrationPhi, FramingSize(), m_deviceVersion, m_deviceID,
+                                      table, *numPackets});
+    return table;
+}
+
+// Sends the mapping table as Type C packets, to all clients or only to those that connected since
+// the last time. Without a mapping table new clients are just let through to the data.
+void NetworkStreamer::UpdateClientMeta(bool newClientsOnly)
+{
+    if (!HasClient())
+    {
+        return;
+    }
 
-            // Pull trigger
-            this->NetworkSend((char *)packet, sizeof(TypeCMappingTable));
+    if(!(m_calibrationX && m_calibrationY && m_calibrationTheta && m_calibrationPhi))
+    {
+        if (newClientsOnly)
+        {
+            NetworkSendFrame(std::make_shared<std::vector<char>>(), sizeof(TypeCMappingTable), 0, true, true, FrameTrace {});
         }
+        return;
     }
 
-    FinishROISend();
+    // The same packets every time, so they are sent straight from the shared encoding
+    size_t numPackets = 0;
+    auto table = EncodeMappingTable(&numPackets);
+    NetworkSendFrame(std::move(table), sizeof(TypeCMappingTable), numPackets, true, newClientsOnly, FrameTrace {});
 }
 
 UDPStreamer::UDPStreamer(
@@ -565,11 +1186,34 @@ UDPStreamer::UDPStreamer(
     const char* targetHost,
     uint16_t targetPort,
     PipelineOutputType outputType
+) : UDPStreamer(deviceVersion, deviceID, targetHost, targetPort, UDP_DEFAULT_MTU, outputType)
+{
+}
+
+constexpr size_t IP_UDP_HEADERS_SIZE    { 28 };             // IPv4 and UDP headers, without options
+constexpr uint8_t UDP_MULTICAST_TTL     { 8 };              // Enough to cross the routers of a vehicle network
+constexpr int UDP_SEND_BUFFER           { 8 * 1024 * 1024 }; // A few FOVs, as each one is sent in a burst
+
+UDPStreamer::UDPStreamer(
+    uint32_t deviceVersion,
+    uint32_t deviceID,
+    const char* targetHost,
+    uint16_t targetPort,
+    size_t mtu,
+    PipelineOutputType outputType,
+    uint64_t pacingRate
 ) : NetworkStreamer (deviceVersion, deviceID, outputType),
-    m_targetAddr ({})
+    m_targetAddr ({}),
+    m_maxDatagram (mtu > IP_UDP_HEADERS_SIZE ? mtu - IP_UDP_HEADERS_SIZE : 0)
 {
     struct hostent *targetHe;
 
+    if (m_maxDatagram < sizeof(TypeDPacket) || m_maxDatagram < sizeof(TypeCMappingTable))
+    {
+        LLogErr(m_verbosePrefix << "UDPStreamer::UDPStreamer MTU of " << mtu << " is too small for a packet");
+        exit(1);
+    }
+
     // Note that we are not running threads yet -- non-reentrant syscalls
     // are okay during setup, and keeps us more POSIX compliant.
     targetHe = gethostbyname(targetHost);
@@ -586,115 +1230,191 @@ UDPStreamer::UDPStreamer(
         exit(1);
     }
 
-    // For now, assume broadcast permission required
-    const int SO_BROADCAST_true = 1;
-    if (setsockopt(m_fd, SOL_SOCKET, SO_BROADCAST, &SO_BROADCAST_true, sizeof(SO_BROADCAST_true)) < 0)
-    {
-        LLogErr("NetworkStreamer::NetworkStreamer setsockopt, errno=" << errno);
-        exit(1);
-    }
-
     m_targetAddr.sin_family = AF_INET; 
     m_targetAddr.sin_port = htons(targetPort);
     m_targetAddr.sin_addr = *((struct in_addr *)targetHe->h_addr);
     memset((void *)m_targetAddr.sin_zero, 0, sizeof m_targetAddr.sin_zero);
+
+    if (IN_MULTICAST(ntohl(m_targetAddr.sin_addr.s_addr)))
+    {
+        uint8_t ttl = UDP_MULTICAST_TTL;
+        if (setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+        {
+            LLogErr("UDPStreamer::UDPStreamer setsockopt IP_MULTICAST_TTL, errno=" << errno);
+            exit(1);
+        }
+    }
+    else
+    {
+        // Otherwise, assume broadcast permission required
+        const int SO_BROADCAST_true = 1;
+        if (setsockopt(m_fd, SOL_SOCKET, SO_BROADCAST, &SO_BROADCAST_true, sizeof(SO_BROADCAST_true)) < 0)
+        {
+            LLogErr("NetworkStreamer::NetworkStreamer setsockopt, errno=" << errno);
+            exit(1);
+        }
+    }
+
+    // Linux will likely get *more* buffer space than we request, or less if wmem_max is lower
+    int option = UDP_SEND_BUFFER;
+    if (setsockopt(m_fd, SOL_SOCKET, SO_SNDBUF, &option, sizeof(option)) < 0)
+    {
+        LLogErr(m_verbosePrefix << "UDPStreamer::UDPStreamer setsockopt SO_SNDBUF");
+    }
+    socklen_t length = sizeof(option);
+    if (getsockopt(m_fd, SOL_SOCKET, SO_SNDBUF, &option, &length) == 0 && option < UDP_SEND_BUFFER)
+    {
+        LLogWarning(m_verbosePrefix << "UDP: send buffer size requested: " << UDP_SEND_BUFFER << " actual: " << option);
+    }
+
+    // Unlike TCP, UDP sockets are only paced by the fq queueing discipline
+    if (pacingRate != 0)
+    {
+        auto rate = (unsigned int)std::min<uint64_t>(pacingRate, UINT32_MAX);
+        if (setsockopt(m_fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0)
+        {
+            LLogErr(m_verbosePrefix << "UDPStreamer::UDPStreamer setsockopt SO_MAX_PACING_RATE, errno=" << errno);
+        }
+    }
 }
 
-void UDPStreamer::NetworkSend(char *buffer, size_t len)
+void UDPStreamer::NetworkSend(const char *buffer, size_t len)
 {
     // After we fire the first packet, don't accept config changes
     m_configLocked = true;
 
     // Fire off a UDP packet to prescribed target
-    if (sendto(m_fd, buffer, sizeof(Type1Packet), 0, (struct sockaddr *)&m_targetAddr, sizeof(m_targetAddr)) < 0)
+    if (sendto(m_fd, buffer, len, 0, (struct sockaddr *)&m_targetAddr, sizeof(m_targetAddr)) < 0)
     {
         perror("NetworkStreamer::WorkOnSingleChunk sendto");
     }
 }
 
+// Packs as many consecutive packets of the frame into each datagram as fit, and sends all the datagrams
+// with as few sendmmsg calls as the kernel allows
+void UDPStreamer::NetworkSendFrame(std::shared_ptr<const std::vector<char>> frame, size_t packetLen, size_t numPackets,
+                                   bool /*clientMeta*/, bool /*newClientsOnly*/, FrameTrace frameTrace)
+{
+    auto traceSpan = PipelineTrace::Span("NetworkSend");
+
+    if (m_outputType != PipelineOutputType::ProcessedData)
+    {
+        LLogErr("UDPStreamer::NetworkSendFrame Can't use NetworkSendFrame with something else than ProcessedData");
+        return;
+    }
+    if (numPackets == 0)
+    {
+        return;
+    }
+
+    // After we fire the first packet, don't accept config changes
+    m_configLocked = true;
+
+    const size_t packetsPerDatagram = m_maxDatagram / packetLen;
+    const size_t numDatagrams = (numPackets + packetsPerDatagram - 1) / packetsPerDatagram;
+    if (m_msgs.size() < numDatagrams)
+    {
+        m_iovs.resize(numDatagrams);
+        m_msgs.resize(numDatagrams);
+    }
+    for (size_t datagramNum = 0; datagramNum < numDatagrams; datagramNum++)
+    {
+        size_t firstPacket = datagramNum * packetsPerDatagram;
+        size_t count = std::min(packetsPerDatagram, numPackets - firstPacket);
+        m_iovs[datagramNum].iov_base = const_cast<char *>(frame->data() + firstPacket * packetLen);
+        m_iovs[datagramNum].iov_len = count * packetLen;
+        m_msgs[datagramNum] = {};
+        m_msgs[datagramNum].msg_hdr.msg_name = &m_targetAddr;
+        m_msgs[datagramNum].msg_hdr.msg_namelen = sizeof(m_targetAddr);
+        m_msgs[datagramNum].msg_hdr.msg_iov = &m_iovs[datagramNum];
+        m_msgs[datagramNum].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t sent = 0;
+    while (sent < numDatagrams)
+    {
+        int ret = sendmmsg(m_fd, &m_msgs[sent], (unsigned int)std::min<size_t>(numDatagrams - sent, UIO_MAXIOV), 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LLogErr(m_verbosePrefix << "UDPStreamer::NetworkSendFrame sendmmsg, errno=" << errno);
+            return;
+        }
+        if (sent == 0 && frameTrace.valid())
+        {
+            frameTrace.stamp(TRACE_FIRST_PACKET_SENT);
+        }
+        sent += (size_t)ret;
+    }
+
+    if (m_frameLatency != nullptr && frameTrace.valid())
+    {
+        frameTrace.stamp(TRACE_LAST_PACKET_SENT);
+        m_frameLatency->record(frameTrace);
+    }
+}
+
+void UDPStreamer::NetworkROISend(std::shared_ptr<const void> /*owner*/, const char * /*roi*/, size_t /*len*/, bool /*lastOfFov*/)
+{
+    LLogErr("UDPStreamer::NetworkROISend Raw data is only streamed over TCP");
+}
+
 struct FramingHeader {
     uint32_t len;
     uint32_t flags;
     uint32_t flagDependentVal1;
     uint32_t flagDependentVal2;
 } __attribute__((packed));
+static_assert(sizeof(FramingHeader) == FRAMEING_HEADER_SIZE, "m_framingHeaders holds FramingHeaders");
 
 enum class FHFlags {
     paddingOnly = 1,
     echoValValid = 2,
     echoValNew = 4,
-    skipStats = 8
+    skipStats = 8,
+    roiBatch = 16
 };
 
-// For now, just testing TCP performance. Probably want to listen/accept in a more
-// sane way (separate thread?) if this works out
-// Also, if this works out:
-//      Should we stream to *both* UDP and TCP, or swap on-the-fly if we get a TCP connection?
-//      Should we send beacon broadcast/multicast frames (even if not the full stream) such that
-//           a GUI might auto-populate guessed addresses? The beacon might not punch through
-//           firewalls however, so we might not want to depend on this.
+// Registers a stream on the event loop, or on a loop of its own if none is given. Clients that
+// have more than maxClientQueueBytes waiting to be sent are evicted.
 TCPWrappedStreamer::TCPWrappedStreamer(uint32_t deviceVersion,
                                        uint32_t deviceID,
                                        uint16_t tcpPort,
                                        ssize_t minSockBuffer,
-                                       PipelineOutputType outputType) :
+                                       size_t maxClientQueueBytes,
+                                       PipelineOutputType outputType,
+                                       std::shared_ptr<NetworkEventLoop> eventLoop,
+                                       const NetworkPacing &pacing) :
     NetworkStreamer(deviceVersion, deviceID, outputType),
-    m_listenfd(-1),
-    m_clientfd(-1),
-    m_reqSockBuffer(minSockBuffer),
-    m_servAddr({}),
-    m_clientAddr({}),
-    m_clientAddrLen(0),
-    m_tcpBufferSpace({}),
-    m_tcpROIBufferSpace({})
+    m_eventLoop(std::move(eventLoop)),
+    m_stream(-1),
+    m_seenAccepted(0),
+    m_newClients(false),
+    m_batchOwners(std::make_shared<std::vector<std::shared_ptr<const void>>>()),
+    m_batchRois(0),
+    m_roiStats {}
 {
-    // Grab a socket
-    m_listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(m_listenfd < 0)
+    if (!m_eventLoop)
     {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::TCPWrappedStreamer socket, errno=" << errno);
-        exit(1);
+        m_eventLoop = std::make_shared<NetworkEventLoop>("net_loop port " + std::to_string(tcpPort), PIPELINE_TRACE_SHARED_HEAD);
     }
 
-    // Reuse it
-    const int REUSEADDR_true = 1;
-    if(setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &REUSEADDR_true, sizeof(REUSEADDR_true)) < 0)
-    {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::TCPWrappedStreamer setsockopt, errno=" << errno);
-        exit(1);
-    }
-
-    // Nonblocking accept
-    if(fcntl(m_listenfd, F_SETFL, O_NONBLOCK) < 0) // NOLINT(hicpp-vararg) Must call C API
-    {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::TCPWrappedStreamer fcntl, errno=" << errno);
-        exit(1);
-    }
-
-    // Bind
-    m_servAddr.sin_family = AF_INET;
-    m_servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    m_servAddr.sin_port = htons(tcpPort);
-    
-    if (bind (m_listenfd, (struct sockaddr *) &m_servAddr, sizeof(m_servAddr)) < 0)
-    {
-        LLogErr(m_verbosePrefix << "NetworkStreamer::NetworkStreamer bind, errno=" << errno);
-        exit(1);
-    }
-
-    // Listen
-    if (listen(m_listenfd, TCP_SERVE_BACKLOG) < 0)
-    {
-        LLogErr(m_verbosePrefix << "NetworkStreamer::NetworkStreamer listen, errno=" << errno);
-        exit(1);
-    }
+    // Processed data clients need the mapping table first, and may ask for compressed packets; raw data
+    // clients may ask for batched ROIs
+    bool processedData = m_outputType == PipelineOutputType::ProcessedData;
+    m_stream = m_eventLoop->AddStream(tcpPort, minSockBuffer, maxClientQueueBytes, processedData, m_verbosePrefix,
+                                      processedData ? &NetworkStreamer::ParseFormatRequest : &NetworkStreamer::ParseRawFormatRequest,
+                                      pacing);
 }
 
 TCPWrappedStreamer::TCPWrappedStreamer(uint32_t deviceVersion,
                                        uint32_t deviceID,
                                        uint16_t tcpPort,
                                        PipelineOutputType outputType)
-    : TCPWrappedStreamer(deviceVersion, deviceID, tcpPort, 0, outputType)
+    : TCPWrappedStreamer(deviceVersion, deviceID, tcpPort, 0, SIZE_MAX, outputType)
 {
 }
 
@@ -707,47 +1427,74 @@ void TCPWrappedStreamer::StartROISend()
 {
     NetworkStreamer::StartROISend();
 
-    // Check for new connections (new ones should preempt old ones, since we
-    // only handle one client -- multiples might need a "reflector"-style
-    // proxy that can handle bufering frameskip-per-client.
+    // Someone connected since the last chunk: they need the mapping table, and the frame limits start over
+    uint64_t accepted = m_eventLoop->GetStreamStats(m_stream).accepted;
+    if (accepted != m_seenAccepted)
+    {
+        m_seenAccepted = accepted;
+        m_newClients = true;
+        set_dbg_MaxFrames(m_dbg_maxFrames);
+    }
+}
 
-    AcceptNewConnection();
+// True once after clients have connected
+bool TCPWrappedStreamer::TakeNewClients()
+{
+    bool newClients = m_newClients;
+    m_newClients = false;
+    return newClients;
+}
 
-    // Is anyone there? If not, nothing to handle
-    if (m_clientfd < 0)
+void TCPWrappedStreamer::FillInFraming(char *framing, size_t packetLen) const
+{
+    FramingHeader framingHeader {};
+    framingHeader.len = htonl(packetLen);
+    memcpy(framing, &framingHeader, sizeof(FramingHeader));
+}
+
+// The packets are already framed, so the stream goes to the clients of its format as it is
+void TCPWrappedStreamer::NetworkSendStream(std::shared_ptr<std::vector<char>> stream, size_t len, PointFormat format,
+                                           FrameTrace frameTrace)
+{
+    auto traceSpan = PipelineTrace::Span("NetworkSend");
+
+    auto item = std::make_shared<NetworkItem>();
+    item->headerLen = 0;
+    item->payload = stream->data();
+    item->payloadLen = len;
+    item->owner = std::move(stream);
+    item->format = (int)format;
+    if (m_frameLatency != nullptr && frameTrace.valid())
     {
-        return;
+        item->frameTrace = frameTrace;
+        item->frameLatency = m_frameLatency;
     }
-
-    // Cork till entire ROI is submitted to take advantage of larger packets
-    // when available
-    const int TCP_CORK_true = 1;
-    if(setsockopt(m_clientfd, IPPROTO_TCP, TCP_CORK, &TCP_CORK_true, sizeof (TCP_CORK_true)) < 0)
+    item->grid = m_packetGrid;
+    if (format == PointFormat::Compressed)
     {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::NetworkSend setsockopt TCP_CORK, errno=" << errno);
+        item->grid.offsets = m_compressedOffsets;
     }
+    else
+    {
+        item->grid.slotSize = FramingSize() + sizeof(TypeFPacket);
+    }
+    Send(std::move(item));
 }
 
-void TCPWrappedStreamer::FinishROISend()
+bool TCPWrappedStreamer::Send(std::shared_ptr<NetworkItem> item)
 {
-    NetworkStreamer::FinishROISend();
-    
-    // Uncork -- we're done with ROI
-    if (m_clientfd >= 0)
+    if (!m_eventLoop->Send(m_stream, std::move(item)))
     {
-        const int zero = 0;
-        if (setsockopt(m_clientfd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero)) < 0)
-        {
-            LLogErr(m_verbosePrefix << "TCPWrappedStreamer::NetworkSend setsockopt TCP_CORK, errno=" << errno);
-        }
+        LLogWarning(m_verbosePrefix << "TCPWrappedStreamer::Send Network queue is full, dropping (" <<
+                    m_eventLoop->GetStreamStats(m_stream).dropped << " dropped so far)");
+        return false;
     }
+    return true;
 }
 
-void TCPWrappedStreamer::NetworkROISend(char *roi, size_t len)
+// Each ROI goes to the clients that asked for one message per ROI right away, and into the batch of the others
+void TCPWrappedStreamer::NetworkROISend(std::shared_ptr<const void> owner, const char *roi, size_t len, bool lastOfFov)
 {
-    bool sendFailed = false;
-    char *buf;
-
     if (m_outputType != PipelineOutputType::RawData)
     {
         LLogErr("TCPWrappedStreamer::NetworkROISend Network");
@@ -760,271 +1507,185 @@ void TCPWrappedStreamer::NetworkROISend(char *roi, size_t len)
         return;
     }
 
-    // Is anyone there? If not, nowhere to send -- do nothing and try again later
-    if (m_clientfd < 0)
+    // Is anyone there? If not, nowhere to send -- do nothing and try again later. A batch that nobody
+    // wants any more is dropped rather than holding on to the capture buffers.
+    bool batched = WantsRawFormat(RawFormat::Batched) || WantsRawFormat(RawFormat::Packed);
+    if (!batched && m_batchRois > 0)
+    {
+        m_batchOwners->clear();
+        m_batchSegments.clear();
+        m_batchRois = 0;
+    }
+    if (!HasClient())
     {
         return;
     }
 
-    // TODO: Scatter-gather send if these memcpys have too much perf impact
-
-    // Slap on our frame header
-    memset(m_tcpROIBufferSpace.data(), 0, m_tcpROIBufferSpace.size());
-    auto *framingHeader = (FramingHeader *)m_tcpROIBufferSpace.data();
-    framingHeader->len = htonl(len);
-
-    // Copy over the original payload
-    memcpy(m_tcpROIBufferSpace.data() + sizeof(FramingHeader), roi, len);
-    len += sizeof(FramingHeader);
-    buf = m_tcpROIBufferSpace.data();
-
-    while (len > 0)
+    if (WantsRawFormat(RawFormat::Roi))
     {
-        ssize_t bytesRead = send(m_clientfd, buf, len, 0);
-        if (bytesRead < 0)
-        {
-            sendFailed = true;
-            break;
-        }
-        len -= bytesRead;
-        buf += bytesRead;
+        // Slap on our frame header; the payload is sent straight from the owner's buffer
+        auto item = std::make_shared<NetworkItem>();
+        item->payload = roi;
+        item->payloadLen = len;
+        item->owner = owner;
+        SendROIs(std::move(item), RawFormat::Roi, 1, 0);
     }
 
-    // Did we fail?
-    if (sendFailed)
+    if (batched)
     {
-        if ((errno == ECONNRESET) || (errno == EPIPE))
+        // ROIs that follow each other in the same buffer are sent as one segment
+        if (!m_batchSegments.empty() && m_batchSegments.back().data + m_batchSegments.back().len == roi)
         {
-            CloseConnection();
+            m_batchSegments.back().len += len;
         }
         else
         {
-            LLogErr("TCPWrappedStreamer::NetworkROISend send, errno=" << errno);
+            m_batchSegments.push_back({roi, len});
+        }
+        m_batchOwners->push_back(std::move(owner));
+        m_batchRois++;
+        if (m_batchRois == RAWDATA_BATCH_MAX_ROIS || lastOfFov)
+        {
+            SendROIBatch();
         }
     }
 }
 
-void TCPWrappedStreamer::NetworkSend(char *buffer, size_t len)
+// Sends the batched ROIs to the clients of the batched formats, and starts a new batch
+void TCPWrappedStreamer::SendROIBatch()
 {
-    bool sendFailed = false;
-    char *buf;
+    auto traceSpan = PipelineTrace::Span("SendROIBatch");
 
-    if (m_outputType != PipelineOutputType::ProcessedData)
+    if (WantsRawFormat(RawFormat::Batched))
     {
-        LLogErr("TCPWrappedStreamer::NetworkSend Can't use NetworkSend with something else than ProcessedData");
-        return;
+        auto item = std::make_shared<NetworkItem>();
+        item->payload = m_batchSegments.front().data;
+        item->payloadLen = m_batchSegments.front().len;
+        item->segments.assign(m_batchSegments.begin() + 1, m_batchSegments.end());
+        item->owner = m_batchOwners;
+        SendROIs(std::move(item), RawFormat::Batched, m_batchRois, ROI_SIZE);
     }
 
-    if (len > PROCESSEDDATA_PAYLOAD_MAX_SIZE)
+    if (WantsRawFormat(RawFormat::Packed))
     {
-        LLogErr("TCPWrappedStreamer::NetworkSend Payload Too Large");
-        return;
-    }
-
-    // Is anyone there? If not, nowhere to send -- do nothing and try again later
-    if (m_clientfd < 0)
-    {
-        return;
-    }
-
-    // TODO: Scatter-gather send if these memcpys have too much perf impact
-
-    // Slap on our frame header
-    memset(m_tcpBufferSpace.data(), 0, m_tcpBufferSpace.size());
-    auto *framingHeader = (FramingHeader *)m_tcpBufferSpace.data();
-    framingHeader->len = htonl(len);
-
-    // Copy over the original payload
-    memcpy(m_tcpBufferSpace.data() + sizeof(FramingHeader), buffer, len);
-    len += sizeof(FramingHeader);
-    buf = m_tcpBufferSpace.data();
-
-
-    while (len > 0)
-    {
-        ssize_t bytesRead = send(m_clientfd, buf, len, 0);
-        if (bytesRead < 0)
+        auto packed = std::make_shared<std::vector<char>>((size_t)m_batchRois * RAWDATA_PACKED_ROI_SIZE);
+        char *out = packed->data();
+        for (const auto &segment : m_batchSegments)
         {
-            sendFailed = true;
-            break;
+            for (size_t offset = 0; offset < segment.len; offset += ROI_SIZE)
+            {
+                PackRoi(segment.data + offset, out);
+                out += RAWDATA_PACKED_ROI_SIZE;
+            }
         }
-        len -= bytesRead;
-        buf += bytesRead;
+        auto item = std::make_shared<NetworkItem>();
+        item->payload = packed->data();
+        item->payloadLen = packed->size();
+        item->owner = std::move(packed);
+        SendROIs(std::move(item), RawFormat::Packed, m_batchRois, RAWDATA_PACKED_ROI_SIZE);
     }
 
-    // Did we fail?
-    if (sendFailed)
-    {
-        if ((errno == ECONNRESET) || (errno == EPIPE))
-        {
-            CloseConnection();
-        }
-        else
-        {
-            LLogErr("TCPWrappedStreamer::NetworkSend send, errno=" << errno);
-        }
-    }
+    // The items own the buffers of this batch now
+    m_batchOwners = std::make_shared<std::vector<std::shared_ptr<const void>>>();
+    m_batchSegments.clear();
+    m_batchRois = 0;
 }
 
-
-bool TCPWrappedStreamer::AcceptNewConnection()
+// Frames the numRois ROIs of item, of roiSize bytes each if they are batched (roiSize 0 for a single
+// ROI), and queues them for the clients of format
+bool TCPWrappedStreamer::SendROIs(std::shared_ptr<NetworkItem> item, RawFormat format, uint32_t numRois, uint32_t roiSize)
 {
-    int option = 0; // we will reuse this integer to set socket options
-
-    // Look for a new connection
-    struct sockaddr_in clientAddr {};
-    socklen_t clientAddrLen = sizeof(clientAddr);
-    int clientfd = -1;
-
-    clientfd = accept(m_listenfd, (struct sockaddr *)&clientAddr, &clientAddrLen);
-    if (clientfd < 0)
-    {
-        if ((errno != EWOULDBLOCK) && (errno != EAGAIN))
-        {
-            LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection accept:errno=" << errno);
-        }
-        return false; // in all cases leave the listening socket open
-    }
-
-    // We got something new -- close existing connection (if present)
-    if(m_clientfd >= 0)
+    FramingHeader framingHeader {};
+    framingHeader.len = htonl(item->Length());
+    if (roiSize != 0)
     {
-        CloseConnection();
+        framingHeader.flags = htonl((uint32_t)FHFlags::roiBatch);
+        framingHeader.flagDependentVal1 = htonl(numRois);
+        framingHeader.flagDependentVal2 = htonl(roiSize);
     }
+    memcpy(item->header.data(), &framingHeader, sizeof(FramingHeader));
+    item->headerLen = sizeof(FramingHeader);
+    item->format = (int)format;
 
-    // Lock config changes while connection is open
-    m_configLocked = true;
-
-    // Keep the new connection
-    m_clientfd = clientfd;
-    memcpy(&m_clientAddr, &clientAddr, sizeof(clientAddr));
-    m_clientAddrLen = clientAddrLen;
-
-    std::array<char, INET_ADDRSTRLEN> clientAddrString {};
-    memset(clientAddrString.data(), 0, clientAddrString.size());
-
-    LLogInfo(m_verbosePrefix << "TCP: Got connection.");
-
-    if(inet_ntop(AF_INET, (void *) &m_clientAddr.sin_addr, clientAddrString.data(), clientAddrString.size()) != nullptr)
-    {
-        LLogInfo(m_verbosePrefix << "TCP: to " << clientAddrString.data());
-    }
-    else
+    if (!Send(std::move(item)))
     {
-        LLogInfo(m_verbosePrefix << "TCP: to --.");
+        m_roiStats.dropped += numRois;
+        return false;
     }
+    m_roiStats.queued += numRois;
+    m_roiStats.sends++;
+    return true;
+}
 
-    // Might want to flush the tube with a large padding-only send to get TCP
-    // going at a reasonable-speed
+// Packs the ROI_SIZE bytes of roi into RAWDATA_PACKED_ROI_SIZE bytes at packed, dropping the low
+// nibble of each word (see RawToDepthDsp::packRaw12())
+void TCPWrappedStreamer::PackRoi(const char *roi, char *packed)
+{
+    RawToDepthDsp::packRaw12((const uint16_t *)roi, (uint8_t *)packed, ROI_SIZE / sizeof(uint16_t));
+}
 
-    // Or other Linux/kernel-specific TCP/socket/qdisc vodoo
-    
-    // Disable Nagle's Algorithm
-    // NOTE: Later on, TCP_CORK will override this during normal operation. Turning
-    //       off Nagle as default during non-corked operation.
-    option = 1;
-    if(setsockopt(m_clientfd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof (option)) < 0)
+// Single packets get a buffer of their own
+void TCPWrappedStreamer::NetworkSend(const char *buffer, size_t len)
+{
+    if (m_outputType != PipelineOutputType::ProcessedData)
     {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection setsockopt TCP_NODELAY, errno=" << errno);
+        LLogErr("TCPWrappedStreamer::NetworkSend Can't use NetworkSend with something else than ProcessedData");
+        return;
     }
 
-    // Set a minimum send buffer size, if so requested.
-    // (We'll later use this when checking for sufficient space for a wrapped UDP payload --
-    //  it'll make no sense to wait later on for buffer space to open up if we'll never get
-    //  the amount we're waiting for).
-    // Note that Linux will likely get *more* buffer space than we request.
-    if (m_reqSockBuffer != 0)
+    if (len > PROCESSEDDATA_PAYLOAD_MAX_SIZE)
     {
-        option = (int)m_reqSockBuffer;
-        if (setsockopt(m_clientfd, SOL_SOCKET, SO_SNDBUF, &option, sizeof(option)) < 0)
-        {
-            LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection setsockopt SO_SNDBUF");
-        }
+        LLogErr("TCPWrappedStreamer::NetworkSend Payload Too Large");
+        return;
     }
 
-    socklen_t length = sizeof(option);
-    if (getsockopt(m_clientfd, SOL_SOCKET, SO_SNDBUF, &option, &length) < 0)
-    {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection getsockopt SO_SNDBUF");
-    }
-    LLogDebug(m_verbosePrefix << "TCP: send buffer size requested: " << m_reqSockBuffer << " actual: " << option);
-    if (option < m_reqSockBuffer)
-    {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection: Could not set minimum send buffer size as requested");
-    }
+    auto packet = std::make_shared<std::vector<char>>(FRAMEING_HEADER_SIZE + len);
+    FillInFraming(packet->data(), len);
+    memcpy(packet->data() + FRAMEING_HEADER_SIZE, buffer, len);
+    NetworkSendFrame(std::move(packet), len, 1, false, false, FrameTrace {});
+}
 
-    // Lets fail fast on hung connections, as we're only accepting a single connection
-    // for now, and we don't want re-connect attempts to fail.
+// The packets of the frame are already framed, so the whole frame goes to the event loop as it is,
+// which sends it to every client
+void TCPWrappedStreamer::NetworkSendFrame(std::shared_ptr<const std::vector<char>> frame, size_t packetLen, size_t numPackets,
+                                          bool clientMeta, bool newClientsOnly, FrameTrace frameTrace)
+{
+    auto traceSpan = PipelineTrace::Span("NetworkSend");
 
-    // Enable TCP KEEPALIVE, TCP_KEEPIDLE = 1 second, TCP_KEEPINTVL = 11 seconds (1, 11 are
-    // relatively prime), TCP_KEEPCNT = 3 probes. Effectively ~34 seconds of timeout
-    // if connection idle.
-    constexpr int KEEPALIVE_TIME_SEC { 1 };
-    option = KEEPALIVE_TIME_SEC;
-    if (setsockopt(m_clientfd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option)) < 0)
-    {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection setsockopt SO_KEEPALIVE");
-    }
-    constexpr int KEEPIDLE_TIME_SEC { 1 };
-    option = KEEPIDLE_TIME_SEC;
-    if (setsockopt(m_clientfd, IPPROTO_TCP, TCP_KEEPIDLE, &option, sizeof(option)) < 0)
-    {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection setsockopt TCP_KEEPIDLE");
-    }
-    constexpr int KEEPINTVL_TIME_SEC { 11 };
-    option = KEEPINTVL_TIME_SEC;
-    if (setsockopt(m_clientfd, IPPROTO_TCP, TCP_KEEPINTVL, &option, sizeof(option)) < 0)
-    {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection setsockopt TCP_KEEPINTVL");
-    }
-    constexpr int KEEPCOUNT { 3 };
-    option = KEEPCOUNT;
-    if (setsockopt(m_clientfd, IPPROTO_TCP, TCP_KEEPCNT, &option, sizeof(option)) < 0)
+    if (m_outputType != PipelineOutputType::ProcessedData)
     {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection setsockopt TCP_KEEPCNT");
+        LLogErr("TCPWrappedStreamer::NetworkSendFrame Can't use NetworkSendFrame with something else than ProcessedData");
+        return;
     }
 
-    // Set TCP_USER_TIMEOUT = 30 seconds. Timeout after ~30 seconds when there is
-    // outstanding unacknowledged send data. Of same order as idle timeout above
-    // by design.
-    constexpr int USER_TIMEOUT_MS { 30000 };
-    option = USER_TIMEOUT_MS;
-    if (setsockopt(m_clientfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &option, sizeof(option)) < 0)
+    if (packetLen > PROCESSEDDATA_PAYLOAD_MAX_SIZE)
     {
-        LLogErr(m_verbosePrefix << "TCPWrappedStreamer::AcceptNewConnection setsockopt TCP_USER_TIMEOUT");
+        LLogErr("TCPWrappedStreamer::NetworkSendFrame Payload Too Large");
+        return;
     }
 
-    if (m_outputType == PipelineOutputType::ProcessedData)
+    // Is anyone there? If not, nowhere to send -- do nothing and try again later
+    if (!HasClient())
     {
-        UpdateClientMeta();
+        return;
     }
 
-    // Reset frame limits
-    set_dbg_MaxFrames(m_dbg_maxFrames);
-
-    return true;
-}
-
-
-void TCPWrappedStreamer::CloseConnection()
-{
-    std::array<char, INET_ADDRSTRLEN> clientAddrString {};
-    memset(clientAddrString.data(), 0, clientAddrString.size());
-
-    LLogInfo(m_verbosePrefix << "TCP: Closing connection");
-
-    if(inet_ntop(AF_INET, (void *) &m_clientAddr.sin_addr, clientAddrString.data(), clientAddrString.size()) != nullptr)
+    auto item = std::make_shared<NetworkItem>();
+    item->headerLen = 0;
+    item->payload = frame->data();
+    item->payloadLen = numPackets * (sizeof(FramingHeader) + packetLen);
+    item->owner = std::move(frame);
+    item->clientMeta = clientMeta;
+    item->newClientsOnly = newClientsOnly;
+    if (m_frameLatency != nullptr && frameTrace.valid())
     {
-        LLogInfo(m_verbosePrefix << "TCP: to " << clientAddrString.data() << ".");
+        item->frameTrace = frameTrace;
+        item->frameLatency = m_frameLatency;
     }
-    else
+    if (!clientMeta)
     {
-        LLogInfo(m_verbosePrefix << "TCP: to ---.");
+        item->grid = m_packetGrid;
+        item->grid.slotSize = sizeof(FramingHeader) + packetLen;
     }
-
-    close(m_clientfd);
-    m_clientfd = -1;
-
-    // Allow config changes until new connection established
-    m_configLocked = false;
+    Send(std::move(item));
 }
@@ -5,11 +5,10 @@
  * @file network_streamer.hpp
  * @brief This file contains the definitions for the NetworkStreamer,
  *        UDPStreamer, and TCPWrappedStreamer classes.
- *        2. UDPStreamer, a subclass of NetworkStreamer that sends data
- *           over UDP
+ *        2. UDPStreamer, a subclass of NetworkStreamer that sends processed
+ *           data over UDP (multicast), several packets per datagram
  *        3. TCPWrappedStreamer, a subclass of NetworkStreamer that sends
  *           data over TCP
- *        The UDPStreamer is not supported at this time.
  *        
  * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved
  */
@@ -19,6 +18,7 @@
 #include <random>
 #include <memory>
 #include "pipeline_modules.hpp"
+#include "network_event_loop.hpp"
 
 #ifdef __APPLE__
 #include <libkern/OSByteOrder.h>
@@ -26,13 +26,52 @@
 #endif
 
 #define RAWDATA_PAYLOAD_MAX_SIZE        ROI_SIZE
+#define RAWDATA_PACKED_ROI_SIZE         (ROI_SIZE / 4 * 3)
+#define RAWDATA_BATCH_MAX_ROIS          16
 #define PROCESSEDDATA_PAYLOAD_MAX_SIZE  1472
 #define FRAMEING_HEADER_SIZE 16 
-#define TCP_SERVE_BACKLOG 20
+#define UDP_MIN_MTU                     1280
+#define UDP_DEFAULT_MTU                 1500
+#define UDP_JUMBO_MTU                   9000
 #define NUM_CHANNELS_PER_TYPE2_PACKET 64
 
 using namespace LidarPipeline;
 
+/**
+ *  @brief The packet types that processed data can be sent as. TCP clients get
+ *         TypeD unless they ask for Compressed (Type E: only the valid pixels,
+ *         with delta coded ranges) or Xyz (Type F: points instead of ranges, if
+ *         the sensor head computes them), so that older clients are unaffected.
+ */
+enum class PointFormat {
+    TypeD = 0,
+    Compressed = 1,
+    Xyz = 2
+};
+
+/**
+ *  @brief The forms that raw ROIs can be sent in. TCP clients get one framed
+ *         message per ROI (Roi) unless they ask for Batched (the ROIs of up to
+ *         RAWDATA_BATCH_MAX_ROIS in one framed message, sent straight from the
+ *         capture buffers) or Packed (batched, with the 12 significant bits of
+ *         each word packed into 1.5 bytes), so that older clients are unaffected.
+ */
+enum class RawFormat {
+    Roi = 0,
+    Batched = 1,
+    Packed = 2
+};
+
+/**
+ *  @brief The counters of a raw data stream, in ROIs. Each format that has
+ *         clients is counted separately.
+ */
+struct ROIStreamStats {
+    uint64_t queued;   // ROIs handed to the event loop
+    uint64_t dropped;  // ROIs the event loop's queue had no room for
+    uint64_t sends;    // framed messages handed to the event loop
+};
+
 /**
  *  @brief NetworkStreamer is a pipeline module and therefore a subclass of the
  *         PipelineModule class. It is designed to send depth data over the network
@@ -42,6 +81,7 @@ class NetworkStreamer : public PipelineModule {
     public:
         bool setDeviceID(uint32_t deviceID);
         void set_dbg_MaxFrames(int maxFrames);
+        void SetFrameLatency(std::shared_ptr<FrameLatency> frameLatency);
     protected:
         NetworkStreamer(
             uint32_t deviceVersion,
@@ -51,14 +91,43 @@ class NetworkStreamer : public PipelineModule {
         virtual void StartROISend();
         virtual void FinishROISend();
         bool m_configLocked;
-        virtual void UpdateClientMeta();
+        virtual bool ConfigLocked() const { return m_configLocked; }
+        void UpdateClientMeta(bool newClientsOnly);
+        virtual bool HasClient() const { return true; }
+        virtual bool TakeNewClients() { return false; }
+        virtual size_t FramingSize() const { return 0; }
+        virtual bool AnnouncesSceneEnd() const { return false; }
+        virtual bool WantsFormat(PointFormat format) const { return format == PointFormat::TypeD; }
+        virtual void FillInFraming(char * /*framing*/, size_t /*packetLen*/) const {}
+        static int ParseFormatRequest(const char *request);
+        static int ParseRawFormatRequest(const char *request);
         void net_perror(const char * className, const char * netOp, const char * msg);
+        std::shared_ptr<FrameLatency> m_frameLatency;
+        NetworkItem::PacketGrid m_packetGrid; // of the FOV being sent, apart from the size of the packets
+        std::shared_ptr<std::vector<uint32_t>> m_compressedOffsets; // where each Type E packet starts, plus the end
     private:
-        virtual void NetworkSend(char* buffer, size_t len) = 0;
-        virtual void NetworkROISend(char* roi, size_t len) = 0;
+        virtual void NetworkSend(const char* buffer, size_t len) = 0;
+        virtual void NetworkSendFrame(std::shared_ptr<const std::vector<char>> frame, size_t packetLen, size_t numPackets,
+                                      bool clientMeta, bool newClientsOnly, FrameTrace frameTrace);
+        virtual void NetworkSendStream(std::shared_ptr<std::vector<char>> stream, size_t len, PointFormat format,
+                                       FrameTrace frameTrace);
+        virtual void NetworkROISend(std::shared_ptr<const void> owner, const char* roi, size_t len, bool lastOfFov) = 0;
         void WorkOnCPIChunk(ReturnChunk *chunk);
         void WorkOnROIChunk(ReturnChunk *chunk);
-        std::array<char, PROCESSEDDATA_PAYLOAD_MAX_SIZE> m_payloadBufferSpace;
+        size_t EncodeFov(const FovSegment &fov, bool typeD, bool compressed, bool xyz);
+        void ConvertRoiTimestamps(const std::vector<std::vector<uint32_t>> &fullTimestampByIdxVector);
+        std::shared_ptr<const std::vector<char>> EncodeMappingTable(size_t *numPackets);
+        std::shared_ptr<std::vector<char>> m_frameBuffer; // Type D packets of the FOV being sent, FramingSize() bytes in front of each
+        std::shared_ptr<std::vector<char>> m_compressedBuffer; // Type E packets of the FOV being sent, each one framed
+        size_t m_compressedLen;
+        std::shared_ptr<std::vector<char>> m_xyzBuffer; // Type F packets of the FOV being sent, each one framed
+        size_t m_xyzLen;
+        // The timestamps of the ROIs of the FOV being sent: the three 32-bit words of each, one plane after the
+        // other, and the big-endian PTP seconds and nanoseconds they convert to, indexed by ROI index
+        std::vector<uint32_t> m_roiTimestamps;
+        std::vector<uint64_t> m_roiPtpSec;
+        std::vector<uint32_t> m_roiPtpNsec;
+        std::vector<uint8_t> m_roiTimestampArb;
         uint32_t m_deviceVersion;
         uint32_t m_deviceID;
         uint32_t m_seq;
@@ -68,10 +137,12 @@ class NetworkStreamer : public PipelineModule {
         uint32_t m_lastSceneEndSeq;
         uint32_t m_thisSceneBeginSeq;
         uint32_t m_thisSceneLastSeq;
-        std::shared_ptr<std::vector<int32_t>> m_calibrationX;
-        std::shared_ptr<std::vector<int32_t>> m_calibrationY;
-        std::shared_ptr<std::vector<int32_t>> m_calibrationTheta;
-        std::shared_ptr<std::vector<int32_t>> m_calibrationPhi;
+        uint32_t m_thisSceneFirstRow; // the FOV row that the scene started at, if the FOV is sent in segments
+        uint32_t m_thisSceneNextRow;  // the FOV row that continues the scene
+        std::shared_ptr<const CalibrationPlane> m_calibrationX;
+        std::shared_ptr<const CalibrationPlane> m_calibrationY;
+        std::shared_ptr<const CalibrationPlane> m_calibrationTheta;
+        std::shared_ptr<const CalibrationPlane> m_calibrationPhi;
     protected:
         int m_dbg_maxFrames;
         bool m_dbg_maxFramesActive;
@@ -81,8 +152,14 @@ class NetworkStreamer : public PipelineModule {
 };
 
 /**
- *  @brief UDPStreamer is a NetworkStreamer used to send data over UDP. It is not currently
- *         supported.
+ *  @brief UDPStreamer is a NetworkStreamer used to send processed data over UDP,
+ *         typically to a multicast group. The packets of a FOV are packed into
+ *         datagrams of up to the MTU (e.g. UDP_JUMBO_MTU for jumbo frames) and
+ *         sent with a few sendmmsg calls, straight from the encode buffer. As
+ *         datagrams can be lost, every Type D packet carries the sequence number
+ *         that will end its scene, so that receivers can tell whether they got
+ *         the whole scene. The mapping table is sent whenever it is updated.
+ *         Raw data is not supported.
  */
 class UDPStreamer : public NetworkStreamer {
     public:
@@ -92,14 +169,35 @@ class UDPStreamer : public NetworkStreamer {
             const char* targetHost,
             uint16_t targetPort,
             PipelineOutputType outputType);
+        UDPStreamer(
+            uint32_t deviceVersion,
+            uint32_t deviceID,
+            const char* targetHost,
+            uint16_t targetPort,
+            size_t mtu,
+            PipelineOutputType outputType,
+            uint64_t pacingRate = 0);
+    bool AnnouncesSceneEnd() const override { return true; }
     private:
-        void NetworkSend(char* buffer, size_t len) override;
+        void NetworkSend(const char* buffer, size_t len) override;
+        void NetworkSendFrame(std::shared_ptr<const std::vector<char>> frame, size_t packetLen, size_t numPackets,
+                              bool clientMeta, bool newClientsOnly, FrameTrace frameTrace) override;
+        void NetworkROISend(std::shared_ptr<const void> owner, const char* roi, size_t len, bool lastOfFov) override;
         int m_fd;
         struct sockaddr_in m_targetAddr;
+        size_t m_maxDatagram;                   // UDP payload that fits in the MTU
+        std::vector<struct iovec> m_iovs;       // one per datagram of the frame being sent
+        std::vector<struct mmsghdr> m_msgs;
 };
 
 /**
- *  @brief TCPWrappedStreamer is a NetworkStreamer used to send data over TCP.
+ *  @brief TCPWrappedStreamer is a NetworkStreamer used to send data over TCP to
+ *         any number of clients. It only encodes; the sockets are served by a
+ *         NetworkEventLoop, which may be shared with the other streams of the
+ *         sensor head. The encoded buffers are handed to the loop as they are,
+ *         so each one is sent to every client without copies. Raw ROIs are
+ *         sent in each RawFormat that has clients; the batches are sent once
+ *         they are full or the ROI that completes the FoV is in.
  */
 class TCPWrappedStreamer : public NetworkStreamer {
     public:
@@ -113,22 +211,40 @@ class TCPWrappedStreamer : public NetworkStreamer {
             uint32_t deviceID,
             uint16_t tcpPort,
             ssize_t minSockBuffer,
-            PipelineOutputType outputType);
+            size_t maxClientQueueBytes,
+            PipelineOutputType outputType,
+            std::shared_ptr<NetworkEventLoop> eventLoop = nullptr,
+            const NetworkPacing &pacing = {});
+        NetworkStreamStats GetStreamStats() const { return m_eventLoop->GetStreamStats(m_stream); }
+        const ROIStreamStats &GetROIStreamStats() const { return m_roiStats; }
+        static void PackRoi(const char *roi, char *packed);
     void StartROISend() override;
-    void FinishROISend() override;
+    bool HasClient() const override { return m_eventLoop->NumClients(m_stream) > 0; }
+    bool ConfigLocked() const override { return HasClient(); }
+    bool TakeNewClients() override;
+    bool WantsFormat(PointFormat format) const override { return m_eventLoop->NumClients(m_stream, (int)format) > 0; }
+    size_t FramingSize() const override { return FRAMEING_HEADER_SIZE; }
+    void FillInFraming(char *framing, size_t packetLen) const override;
     private:
-        void NetworkSend(char* buffer, size_t len) override;
-        void NetworkROISend(char* roi, size_t len) override;
-        bool AcceptNewConnection();
-        void CloseConnection();
-        int m_listenfd;
-        int m_clientfd;
-        ssize_t m_reqSockBuffer;
-        struct sockaddr_in m_servAddr;
-        struct sockaddr_in m_clientAddr;
-        socklen_t m_clientAddrLen;
-        std::array<char, PROCESSEDDATA_PAYLOAD_MAX_SIZE + FRAMEING_HEADER_SIZE> m_tcpBufferSpace;
-        std::array<char, RAWDATA_PAYLOAD_MAX_SIZE + FRAMEING_HEADER_SIZE> m_tcpROIBufferSpace;
+        void NetworkSend(const char* buffer, size_t len) override;
+        void NetworkSendFrame(std::shared_ptr<const std::vector<char>> frame, size_t packetLen, size_t numPackets,
+                              bool clientMeta, bool newClientsOnly, FrameTrace frameTrace) override;
+        void NetworkSendStream(std::shared_ptr<std::vector<char>> stream, size_t len, PointFormat format,
+                               FrameTrace frameTrace) override;
+        void NetworkROISend(std::shared_ptr<const void> owner, const char* roi, size_t len, bool lastOfFov) override;
+        void SendROIBatch();
+        bool SendROIs(std::shared_ptr<NetworkItem> item, RawFormat format, uint32_t numRois, uint32_t roiSize);
+        bool WantsRawFormat(RawFormat format) const { return m_eventLoop->NumClients(m_stream, (int)format) > 0; }
+        bool Send(std::shared_ptr<NetworkItem> item);
+        std::shared_ptr<NetworkEventLoop> m_eventLoop;
+        int m_stream;
+        uint64_t m_seenAccepted; // clients accepted as of the last StartROISend()
+        bool m_newClients;
+        // The raw ROIs waiting to be sent as one batch: the buffers they are in, and the ROIs, adjacent ones merged
+        std::shared_ptr<std::vector<std::shared_ptr<const void>>> m_batchOwners;
+        std::vector<NetworkItem::Segment> m_batchSegments;
+        uint32_t m_batchRois;
+        ROIStreamStats m_roiStats;
 };
 
 #endif
@@ -5,9 +5,8 @@
  * @file pipeline_data.hpp
  * @brief This file contains definitions for two things:
  *        1. The structures used to pass data between network pipeline modules:
- *           a. The CPI return, which contains 64 pixels of depth data
- *           b. The ROI return, which contains a raw ROI
- *           c. The return chunk, which holds a bunch of CPI returns OR a single ROI return
+ *           a. The ROI return, which contains a raw ROI
+ *           b. The return chunk, which holds a processed FOV OR a single ROI return
  *        2. The pipeline memory manager, which maintains memory pools for said structures
  *        The raw ROI return is used for raw ROI streaming, which is currently not fully
  *        implemented.
@@ -15,13 +14,16 @@
  */
 
 #include <stdint.h>
+#include <algorithm>
+#include <cassert>
 #include <vector>
-#include <pthread.h>
 #include <memory>
 #include <RtdMetadata.h>
+#include <FovSegment.h>
+#include <LatencyHistogram.h>
+#include <SpscRing.h>
 
 constexpr unsigned int MAX_CPI_PER_RETURN       { 64 };
-constexpr unsigned int MAX_CPI_PER_CHUNK        { 480*10 };
 constexpr unsigned int MAX_EXTRA_DATA_PER_CHUNK { 8 };
 constexpr unsigned int TIMESTAMP_SIZE           { 10 };
 
@@ -58,78 +60,41 @@ namespace LidarPipeline {
         ARB = 3
     };
 
+    // ROIs
     /**
-     *  @brief This structure contains depth information for MAX_CPI_FOR_RETURN
-     *         (64) pixels. The CPI return structure conveys this depth
-     *         information from the thread that computes the it to the thread
-     *         that sends it out. This structure is also used when sending out the
-     *         mapping table, which is why the calibration fields are in the
-     *         structure too. The calibration data is static and does not change
-     *         over the lifetime of the pipeline.
-     *
-     *         CPI stands for Coherent Processing Interval, but this terminology
-     *         is out of date, and now it simply refers to a collection of 64
-     *         output pixels. This is also the same number of pixels sent in a
-     *         single TCP packet.
+     *  @brief A raw ROI. When the producer can lend out its input buffer (e.g. a V4L2 buffer),
+     *         sharedRoi references that buffer and keeps it from being reused until the ROI
+     *         has been sent. Otherwise the ROI is copied into roi, which is handed on to the
+     *         network with the ROI, so it is allocated again for the next copy.
+     *         lastOfFov marks the ROI that completes its FoV, which sends the
+     *         ROIs batched so far.
      */
-    struct CPIReturn {
-        std::array<uint16_t, MAX_CPI_PER_RETURN> range;
-        std::array<bool, MAX_CPI_PER_RETURN> rangeValid;
-        std::array<uint16_t, MAX_CPI_PER_RETURN> intensity;
-        std::array<bool, MAX_CPI_PER_RETURN> intensityValid;
-        std::array<uint16_t, MAX_CPI_PER_RETURN> background;
-        std::array<bool, MAX_CPI_PER_RETURN> backgroundValid;
-        std::array<uint16_t, MAX_CPI_PER_RETURN> snr;
-        std::array<bool, MAX_CPI_PER_RETURN> snrValid;
-        std::array<uint8_t, MAX_CPI_PER_RETURN> extraAnnotation;
-        std::array<uint8_t, MAX_CPI_PER_RETURN> extraAnnotationType;
-        std::array<uint8_t, TIMESTAMP_SIZE> timestamp;
-        TimestampScale tscale;
-        uint16_t completeSizeSteerDim;
-        uint16_t completeSizeStareDim;
-        uint16_t startingSteerOrder;
-        uint16_t startingStareOrder;
-        // Hack in SWDL variable vertical crop and bin for now
-        uint16_t bs_SteerOffset;
-        uint16_t bs_SteerStep;
-        uint16_t bs_StareOffset;
-        uint16_t bs_StareStep;
-        uint16_t bs_UserTag;
-
-        bool metaSupressStream;
-        bool metaLastCpiInFrame;
-        bool metaLastCpiInBuffer;
-
-        bool prefixMetaDataUpdate;
-
-        std::shared_ptr<std::vector<int32_t>> calibrationX;
-        std::shared_ptr<std::vector<int32_t>> calibrationY;
-        std::shared_ptr<std::vector<int32_t>> calibrationTheta;
-        std::shared_ptr<std::vector<int32_t>> calibrationPhi;
-    };
-
-    // ROIs
     struct ROIReturn {
-        std::array<char, ROI_SIZE> roi;
+        std::vector<char> roi;
+        std::shared_ptr<const char> sharedRoi;
+        bool lastOfFov { false };
+        const char *GetData() const { return sharedRoi ? sharedRoi.get() : roi.data(); }
     };
 
     /**
-     *  @brief This structure contains a collection of CPI return structures
-     *         and represents an entire field of view (FoV). It is the parent
-     *         struct that conveys depth information from the thread
-     *         generating depth information and the thread sending it.
+     *  @brief This structure represents an entire field of view (FoV). It is
+     *         the parent struct that conveys depth information from the thread
+     *         generating depth information and the thread sending it, which
+     *         encodes the packets straight from the FovSegment.
      *
      *         The return chunk is also used in the raw data pipeline, but
-     *         in this case it contain roiReturn and not cpiReturns.
+     *         in this case it contain roiReturn and not fov.
      *
      *         The extraDataItems member is not currently being used.
      */
     struct ReturnChunk {
-        std::array<CPIReturn*, MAX_CPI_PER_CHUNK> cpiReturns;
-        uint32_t cpiReturnsUsed;
+        std::shared_ptr<FovSegment> fov;
+        bool prefixMetaDataUpdate; // send the mapping table before the FOV
         ROIReturn* roiReturn; // 1 RoiReturn per ReturnChunk
         std::array<ReturnChunkExtraData*, MAX_EXTRA_DATA_PER_CHUNK> extraDataItems;
         uint32_t extraDataItemsUsed;
+        FrameTrace frameTrace; // latency trace of the FOV
+        uint64_t budgetBytes; // of the FOV, accounted to MEMORY_POOL_NET_FOVS until the chunk is cleaned
     };
 
     /**
@@ -139,37 +104,91 @@ namespace LidarPipeline {
     };
 
     /**
-     *  @brief Pipeline data memory manager singleton class. Maintains three memory pools:
+     *  @brief A fixed set of preallocated objects handed from one producer thread to one
+     *         consumer thread and back, without locks. The producer takes objects from its
+     *         own cache, which it refills in bulk from the objects the consumer gave back
+     *         through an SpscRing, so it touches shared state once per refill at most.
+     */
+    template <typename T>
+    class ReturnPool {
+        public:
+            explicit ReturnPool(std::vector<T> &objects) :
+                m_freed(std::max<uint32_t>(1, objects.size())),
+                m_capacity(objects.size())
+            {
+                m_cache.reserve(objects.size());
+                for(auto &object : objects) {
+                    m_cache.push_back(&object);
+                }
+            }
+            // Producer only. Returns nullptr if every object is in flight.
+            T *Get() {
+                if(m_cache.empty()) {
+                    Refill();
+                }
+                if(m_cache.empty()) {
+                    return nullptr;
+                }
+                T *object = m_cache.back();
+                m_cache.pop_back();
+                return object;
+            }
+            // Producer only. Takes back an object that was never handed to the consumer.
+            void PutBack(T *object) { m_cache.push_back(object); }
+            // Consumer only. Gives an object back to the producer.
+            void Put(T *object) {
+                T **slot = m_freed.beginPush();
+                assert(slot != nullptr); // the ring has room for every object
+                *slot = object;
+                m_freed.commitPush();
+            }
+            // Producer only. The number of objects that are not in flight.
+            size_t Available() {
+                Refill();
+                return m_cache.size();
+            }
+            size_t Capacity() const { return m_capacity; }
+        private:
+            void Refill() {
+                T **slot = nullptr;
+                while((slot = m_freed.front()) != nullptr) {
+                    m_cache.push_back(*slot);
+                    m_freed.pop();
+                }
+            }
+            std::vector<T*> m_cache;  // producer side
+            SpscRing<T*> m_freed;     // consumer -> producer
+            size_t m_capacity;
+    };
+
+    /**
+     *  @brief Pipeline data memory manager singleton class. Maintains two memory pools:
      *         1. Return chunk pool, which contains return chunks
-     *         2. CPI return pool, which contains CPI returns
-     *         3. Raw ROI return pool, which contains entire raw ROIs
+     *         2. Raw ROI return pool, which contains entire raw ROIs
      *         Memory pools allow O(0) memory allocation overhead
+     *
+     *         The pools are lock-free ReturnPools: returns are taken by the thread that
+     *         hands chunks to the pipeline, and disposed of by the pipeline module's thread.
+     *         A chunk that the producer ends up not handing in goes back with
+     *         RecycleReturnChunk() instead.
      */
     class PipelineDataMM {
         public:
-            PipelineDataMM(unsigned int ReturnChunkCount, 
-                unsigned int CPIReturnCount, PipelineOutputType outputType);
+            PipelineDataMM(unsigned int ReturnChunkCount, PipelineOutputType outputType);
             ReturnChunk* GetReturnChunk();
             size_t GetNumAvailableReturnChunk();
             size_t GetReturnChunkPoolCapacity() const;
-            CPIReturn* GetCPIReturn();
             ROIReturn* GetROIReturn();
             void DisposeReturnChunk(ReturnChunk *done);
-            void DisposeCPIReturn(CPIReturn *done);
-            void DisposeROIReturn(ROIReturn *done);
+            void RecycleReturnChunk(ReturnChunk *unused);
         private:
-            size_t m_returnChunkPoolCapacity;
             std::vector<ReturnChunk> m_ReturnChunks;
-            std::vector<ReturnChunk*> m_ReturnChunkPool;
-            std::vector<CPIReturn> m_CPIReturns;
-            std::vector<CPIReturn*> m_CPIReturnPool;
             std::vector<ROIReturn> m_ROIReturns;
-            std::vector<ROIReturn*> m_ROIReturnPool;
+            ReturnPool<ReturnChunk> m_ReturnChunkPool;
+            ReturnPool<ROIReturn> m_ROIReturnPool;
 
-            pthread_mutex_t m_PoolMut;
             PipelineOutputType m_outputType;
             static void CleanReturnChunk(ReturnChunk *toClean);
-            static void CleanCPIReturn(CPIReturn *toClean);
             static void CleanROIReturn(ROIReturn *toClean);
     };
 
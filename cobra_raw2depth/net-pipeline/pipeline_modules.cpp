@@ -13,29 +13,25 @@
 #include <pthread.h>
 
 #include "pipeline_modules.hpp"
+#include "PipelineTrace.h"
+#include "LumoAffinity.h"
 
 using namespace LidarPipeline;
 
 PipelineModule::PipelineModule() :
-    m_ownedChunksMut(PTHREAD_MUTEX_INITIALIZER),
-    m_ownedChunks({}),
-    m_newChunkSig(PTHREAD_COND_INITIALIZER),
+    m_fullQueuePolicy(FullQueuePolicy::Drop),
+    m_inline(false),
+    m_queueStalls(0),
     m_thread(0)
 {
     m_inModule = nullptr;
     m_outModule = nullptr;
     m_running = false;
     m_memMgr = nullptr;
-    m_ownedChunks_readIdx = 0;
-    m_ownedChunks_writeIdx = 0;
+    m_traceName = "pipeline_module";
+    m_traceHead = PIPELINE_TRACE_SHARED_HEAD;
 
     m_ownedChunks_len = 0; // This needs to be set to the proper size by each net-pipeline to optimize memory usage
-
-    for (int i = 0; i < RETURNCHUNK_MAX_CIRCULAR_BUFFER_SIZE; i++)
-    {
-        m_ownedChunks.at(i) = nullptr;
-    }
-
 }
 
 bool PipelineModule::SetCircularBufferSize(size_t requestedSize)
@@ -56,6 +52,35 @@ bool PipelineModule::SetCircularBufferSize(size_t requestedSize)
     return true;
 }
 
+bool PipelineModule::SetFullQueuePolicy(FullQueuePolicy policy)
+{
+    if (m_running)
+    {
+        return false;
+    }
+
+    m_fullQueuePolicy = policy;
+    return true;
+}
+
+// Work on chunks on the thread that hands them in, instead of queuing them for a module thread
+bool PipelineModule::SetInline(bool isInline)
+{
+    if (m_running)
+    {
+        return false;
+    }
+
+    m_inline = isInline;
+    return true;
+}
+
+// Queue depth and drop counters; all zero until the module has been started
+SpscRingStats PipelineModule::GetQueueStats() const
+{
+    return m_ownedChunks ? m_ownedChunks->getStats() : SpscRingStats {};
+}
+
 void PipelineModule::SetMemMgr(PipelineDataMM *memMgr)
 {
     if(!m_running && memMgr != nullptr)
@@ -74,6 +99,12 @@ bool PipelineModule::IsPipelineRunning()
     return m_running;
 }
 
+void PipelineModule::SetTraceThreadName(const std::string &name, int head)
+{
+    m_traceName = name;
+    m_traceHead = head;
+}
+
 // Spin up thread for module
 void PipelineModule::StartModule()
 {
@@ -83,6 +114,15 @@ void PipelineModule::StartModule()
         exit(1);
     }
 
+    if (m_inline)
+    {
+        m_running = true; // the caller's thread keeps its own trace name
+        return;
+    }
+
+    size_t ownedChunks_len = (m_ownedChunks_len != 0) ? m_ownedChunks_len : RETURNCHUNK_MAX_CIRCULAR_BUFFER_SIZE;
+    m_ownedChunks = std::make_unique<SpscRing<ReturnChunk*>>(ownedChunks_len);
+
     int ret = pthread_create(&m_thread, NULL, &PipelineModule::ThreadEntry, (void *) this);
 
     if(ret != 0)
@@ -98,91 +138,86 @@ void *PipelineModule::ThreadEntry(void *module)
 {
     auto *ctx = (PipelineModule*) module;
 
-    ctx->m_ownedChunksMut = PTHREAD_MUTEX_INITIALIZER;
-    ctx->m_newChunkSig = PTHREAD_COND_INITIALIZER;
-
     ctx->m_running = true;
+    PipelineTrace::setThreadName(ctx->m_traceName, ctx->m_traceHead);
+    LumoAffinity::setThreadRole(LumoAffinity::ROLE_NETWORK);
     ctx->PumpPipeline();
     return nullptr;
 }
 
 // Hand in a ReturnChunk to this PipelineModule for processing. 
-// Transfers ownership of ReturnChunk -- caller must not access the chunk again
-void PipelineModule::HandChunkIn(ReturnChunk *inputChunk)
+// Transfers ownership of ReturnChunk -- caller must not access the chunk again.
+// Only one thread at a time may hand chunks in. If the queue is full, the chunk is
+// either disposed of or waited on, depending on the FullQueuePolicy.
+// Returns false if the chunk was dropped.
+bool PipelineModule::HandChunkIn(ReturnChunk *inputChunk)
 {
-    // Pass chunk over
-    pthread_mutex_lock(&m_ownedChunksMut);
-    m_ownedChunks.at(m_ownedChunks_writeIdx) = inputChunk;
-    
-    size_t ownedChunks_len = (m_ownedChunks_len != 0) ? m_ownedChunks_len : RETURNCHUNK_MAX_CIRCULAR_BUFFER_SIZE;
-
-    uint32_t next_m_ownedChunks_writeIdx = m_ownedChunks_writeIdx + 1;
-    if (next_m_ownedChunks_writeIdx >= ownedChunks_len)
+    if (m_inline)
     {
-        next_m_ownedChunks_writeIdx = 0;
+        WorkOnSingleChunk(inputChunk);
+        if(m_outModule != nullptr)
+        {
+            return m_outModule->HandChunkIn(inputChunk);
+        }
+        m_memMgr->RecycleReturnChunk(inputChunk); // we're on the producer's thread
+        return true;
     }
 
-    if (next_m_ownedChunks_writeIdx != m_ownedChunks_readIdx)
+    ReturnChunk **slot = m_ownedChunks->beginPush();
+    if (slot == nullptr && m_fullQueuePolicy == FullQueuePolicy::Block)
     {
-        m_ownedChunks_writeIdx = next_m_ownedChunks_writeIdx;
+        m_queueStalls.fetch_add(1, std::memory_order_relaxed);
+        while (slot == nullptr && m_ownedChunks->waitForSpace()) // sleeps until the module pops a chunk
+        {
+            slot = m_ownedChunks->beginPush();
+        }
     }
-    else
+
+    if (slot == nullptr)
     {
-        LLogErr("PipelineModule::HandChunkIn Circular buffer is full");
-        exit(1);
+        m_ownedChunks->countDrop();
+        LLogWarning("PipelineModule::HandChunkIn Circular buffer is full, dropping chunk (" <<
+                    m_ownedChunks->getStats().dropped << " dropped so far)");
+        m_memMgr->RecycleReturnChunk(inputChunk); // we're on the producer's thread
+        return false;
     }
 
-    pthread_cond_signal(&m_newChunkSig);
-    pthread_mutex_unlock(&m_ownedChunksMut);
+    // Pass chunk over
+    *slot = inputChunk;
+    m_ownedChunks->commitPush();
+    return true;
 }
 
-// Wait for one new ReturnChunk, process it, and pass it on
+// Wait for new ReturnChunks, process all of them, and pass them on
 // May want to override if waiting-for/inspecting multiple chunks
 void PipelineModule::PumpPipeline()
 {
-    while(true)
+    while(m_ownedChunks->waitForData())
     {
-        // Wait for signal that we may have something new
-        //pthread_cond_wait(&m_newChunkSig, &m_newChunkMut);
-        //pthread_mutex_unlock(&m_newChunkMut);
-
-        // Do we have what we need?
+        // Drain everything that was queued while we slept or worked
         // (May want to inspect multiple chunks in a derived class)
-        pthread_mutex_lock(&m_ownedChunksMut);
-        while(m_ownedChunks_readIdx == m_ownedChunks_writeIdx)
-        {
-            pthread_cond_wait(&m_newChunkSig, &m_ownedChunksMut);
-        }
-
-        // Get the chunk, then unlock the mutex so we can asyncrhonously
-        // work
-        ReturnChunk* targetChunk = m_ownedChunks.at(m_ownedChunks_readIdx);
-        m_ownedChunks.at(m_ownedChunks_readIdx) = nullptr;
-
-        size_t ownedChunks_len = (m_ownedChunks_len != 0) ? m_ownedChunks_len : RETURNCHUNK_MAX_CIRCULAR_BUFFER_SIZE;
-
-        m_ownedChunks_readIdx++;
-        if (m_ownedChunks_readIdx >= ownedChunks_len)
+        ReturnChunk **slot = nullptr;
+        while ((slot = m_ownedChunks->front()) != nullptr)
         {
-            m_ownedChunks_readIdx = 0;
+            // Take the chunk and free its slot right away, so the producer has room while we work
+            ReturnChunk* targetChunk = *slot;
+            m_ownedChunks->pop();
+
+            // Process the chunk
+            auto traceSpan = PipelineTrace::Span("PumpPipeline");
+            WorkOnSingleChunk(targetChunk);
+
+            // Pass it on
+            if(m_outModule != nullptr)
+            {
+                m_outModule->HandChunkIn(targetChunk);
+            }
+            // Or discard it    
+            else 
+            {
+                m_memMgr->DisposeReturnChunk(targetChunk);
+            }
         }
-
-        pthread_mutex_unlock(&m_ownedChunksMut);
-
-        // Process the chunk
-        WorkOnSingleChunk(targetChunk);
-
-        // Pass it on
-        if(m_outModule != nullptr)
-        {
-            m_outModule->HandChunkIn(targetChunk);
-        }
-        // Or discard it    
-        else 
-        {
-            m_memMgr->DisposeReturnChunk(targetChunk);
-        }
-
     }
 }
 
@@ -190,6 +225,6 @@ void PipelineModule::PumpPipeline()
 void TestPrintModule::WorkOnSingleChunk(ReturnChunk *chunk)
 {
     std::cout << "Got Something: Return Chunk " << (void *)chunk <<
-    " : SO in Chunk = " << chunk->cpiReturnsUsed << "\n";
+    " : FOV in Chunk = " << (chunk->fov ? int(chunk->fov->getFovIdx()) : -1) << "\n";
 }
 
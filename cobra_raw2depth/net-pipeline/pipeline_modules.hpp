@@ -18,12 +18,26 @@
  */
 
 #include <pthread.h>
+#include <atomic>
+#include <memory>
 #include <queue>
+#include <string>
+#include <SpscRing.h>
 #include "pipeline_data.hpp"
 
 #define RETURNCHUNK_MAX_CIRCULAR_BUFFER_SIZE    100
 
 namespace LidarPipeline {
+    /**
+     *  @brief What HandChunkIn() does when the module's queue is full.
+     *         Drop     - the chunk is handed back to the memory manager and counted as dropped
+     *         Block    - the producer waits until the module has made room (backpressure)
+     */
+    enum class FullQueuePolicy {
+        Drop,
+        Block
+    };
+
     /**
      *  @brief Base class for pipeline modules. Every pipeline module represents a
      *         stage of the pipeline that encapsulates a queue of "chunks" and a
@@ -38,15 +52,29 @@ namespace LidarPipeline {
      *         which is the main loop for the thread. This function pulls chunks
      *         from the queue and calls the pure virtual WorkOnSingleChunk
      *         function, which is the one function that subclasses MUST implement.
+     *
+     *         The queue is a lock-free SpscRing: chunks must be handed in from a
+     *         single thread at a time. The module thread only sleeps when the
+     *         queue is empty, and drains everything queued before sleeping again.
+     *
+     *         An inline module (SetInline()) has neither queue nor thread: chunks
+     *         are worked on by the thread that hands them in. This suits stages
+     *         that only hand their output on to another thread anyway.
      */
     class PipelineModule {
         public:
             PipelineModule();
             virtual void StartModule();
             virtual void SetMemMgr(PipelineDataMM *memMgr);
-            virtual void HandChunkIn(ReturnChunk *inputChunk);
+            virtual bool HandChunkIn(ReturnChunk *inputChunk);
             virtual bool SetCircularBufferSize(size_t requestedSize);
+            virtual bool SetFullQueuePolicy(FullQueuePolicy policy);
+            virtual bool SetInline(bool isInline);
+            SpscRingStats GetQueueStats() const;
+            uint64_t GetQueueStalls() const { return m_queueStalls.load(std::memory_order_relaxed); }
             virtual bool IsPipelineRunning();
+            // Names the module's thread in the pipeline trace; call before StartModule()
+            virtual void SetTraceThreadName(const std::string &name, int head);
         protected:
             // A common case is processing a single chunk, so we build it in 
             // here as the default. It is possible to override PumpPipeline()
@@ -55,17 +83,18 @@ namespace LidarPipeline {
         private:
             static void *ThreadEntry(void *Module);
             virtual void PumpPipeline();
-            pthread_mutex_t m_ownedChunksMut;
-            std::array<ReturnChunk*, RETURNCHUNK_MAX_CIRCULAR_BUFFER_SIZE> m_ownedChunks;
-            uint32_t m_ownedChunks_readIdx;
-            uint32_t m_ownedChunks_writeIdx;
-            pthread_cond_t m_newChunkSig;
+            std::unique_ptr<SpscRing<ReturnChunk*>> m_ownedChunks; // created by StartModule()
             PipelineModule *m_inModule;
             PipelineModule *m_outModule;
             size_t m_ownedChunks_len;
+            FullQueuePolicy m_fullQueuePolicy;
+            bool m_inline;
+            std::atomic<uint64_t> m_queueStalls; // HandChunkIn() calls that had to wait for room
             pthread_t m_thread;
             bool m_running;
             PipelineDataMM *m_memMgr;
+            std::string m_traceName;
+            int m_traceHead;
     };
 
     class TestPrintModule : public PipelineModule {
@@ -0,0 +1,152 @@
+/**
+ * @file shm_fov_publisher.cpp
+ * @brief This file contains the implementation of the ShmFovPublisher, which
+ *        publishes the FoVs of a sensor head into a shared memory ring.
+ *
+ * @copyright Copyright (C) 2024 Lumotive, Inc. All rights reserved
+ */
+#include "shm_fov_publisher.hpp"
+#include "LumoLogger.h"
+#include <algorithm>
+
+using namespace LidarPipeline;
+
+static uint64_t alignedBytes(uint64_t bytes)
+{
+    return (bytes + ShmFov::PLANE_ALIGNMENT - 1) / ShmFov::PLANE_ALIGNMENT * ShmFov::PLANE_ALIGNMENT;
+}
+
+ShmFovPublisher::ShmFovPublisher(std::string name, uint32_t numSlots, uint32_t maxPixels) : m_name(std::move(name))
+{
+    numSlots = std::max(numSlots, 2U);
+    const uint64_t slotBytes = alignedBytes(sizeof(ShmFov::SlotHeader)) +
+                               (ShmFov::TIMESTAMPS - ShmFov::RANGE) * alignedBytes((uint64_t)maxPixels * sizeof(uint16_t)) +
+                               alignedBytes((uint64_t)MAX_ROIS * 3 * sizeof(uint32_t)) +
+                               alignedBytes((uint64_t)maxPixels * 3 * sizeof(int32_t));
+    m_mapBytes = ShmFov::headerBytes() + numSlots * slotBytes;
+
+    // A ring left behind by a previous run may have another size
+    shm_unlink(m_name.c_str());
+    int fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+    if (fd < 0) {
+        LLogErr("ShmFovPublisher:name=" << m_name << ",errno=" << errno << ":can't create the shared memory ring");
+        exit(1);
+    }
+    if (ftruncate(fd, (off_t)m_mapBytes) != 0) {
+        LLogErr("ShmFovPublisher:name=" << m_name << ",bytes=" << m_mapBytes << ",errno=" << errno << ":can't size the shared memory ring");
+        exit(1);
+    }
+    void *map = mmap(nullptr, m_mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LLogErr("ShmFovPublisher:name=" << m_name << ",errno=" << errno << ":can't map the shared memory ring");
+        exit(1);
+    }
+
+    // The object starts out zeroed, so the slots are all empty (sequence 0)
+    m_map = static_cast<uint8_t *>(map);
+    m_ring = reinterpret_cast<ShmFov::RingHeader *>(m_map);
+    m_ring->version = ShmFov::VERSION;
+    m_ring->numSlots = numSlots;
+    m_ring->headerBytes = (uint32_t)ShmFov::headerBytes();
+    m_ring->slotBytes = slotBytes;
+    m_ring->magic.store(ShmFov::MAGIC, std::memory_order_release);
+    LLogInfo("ShmFovPublisher:name=" << m_name << ",slots=" << numSlots << ",slotBytes=" << slotBytes << ":publishing FoVs");
+}
+
+ShmFovPublisher::~ShmFovPublisher()
+{
+    munmap(m_map, m_mapBytes);
+    shm_unlink(m_name.c_str());
+}
+
+bool ShmFovPublisher::Publish(const FovSegment &fov, bool newMappingTable)
+{
+    const auto &imageSize = fov.getImageSize();
+    const uint64_t numPixels = (uint64_t)imageSize[0] * imageSize[1];
+    const auto timestampsVec = fov.getTimestampsVec();
+    const uint64_t numRois = timestampsVec ? std::min<uint64_t>(timestampsVec->size(), MAX_ROIS) : 0;
+
+    // The pixel planes, in the order of ShmFov::Plane
+    const std::array<std::shared_ptr<std::vector<uint16_t>>, ShmFov::ROI_INDEX> pixelPlanes {
+        fov.getRange(), fov.getSnr(), fov.getSignal(), fov.getBackground()
+    };
+    const auto roiIndexRows = fov.getRoiIndexRows();
+    const auto xyz = fov.getXyz();
+    uint64_t bytes = alignedBytes(sizeof(ShmFov::SlotHeader)) + alignedBytes(numRois * 3 * sizeof(uint32_t));
+    for (const auto &plane : pixelPlanes) {
+        bytes += plane ? alignedBytes(numPixels * sizeof(uint16_t)) : 0;
+    }
+    bytes += roiIndexRows ? alignedBytes((uint64_t)imageSize[0] * sizeof(uint16_t)) : 0;
+    bytes += xyz ? alignedBytes(numPixels * 3 * sizeof(int32_t)) : 0;
+    if (bytes > m_ring->slotBytes) {
+        LLogWarning("ShmFovPublisher:name=" << m_name << ",fovIdx=" << fov.getFovIdx() << ",bytes=" << bytes <<
+                    ":the FoV doesn't fit into a slot; not published");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const uint64_t fovNumber = m_ring->published.load(std::memory_order_relaxed);
+    uint8_t *slot = m_map + m_ring->headerBytes + fovNumber % m_ring->numSlots * m_ring->slotBytes;
+    auto *header = reinterpret_cast<ShmFov::SlotHeader *>(slot);
+
+    // Subscribers that are still reading the previous FoV of the slot see it change
+    header->sequence.store(2 * fovNumber + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    header->sensorHead = fov.getHeaderNum();
+    header->fovIdx = fov.getFovIdx();
+    header->sensorId = fov.getSensorId();
+    header->userTag = fov.getUserTag();
+    header->timestamp = fov.getTimestamp();
+    header->rows = imageSize[0];
+    header->columns = imageSize[1];
+    header->firstRow = fov.getFirstRow();
+    header->fovNumRows = fov.getFovNumRows();
+    header->frameCompleted = fov.getFrameCompleted() ? 1 : 0;
+    header->newMappingTable = newMappingTable ? 1 : 0;
+    header->gcf = fov.getGcf();
+    header->maxUnambiguousRange = fov.getMaxUnambiguousRange();
+    for (int idx = 0; idx < 2; idx++) {
+        header->mappingTableTopLeft[idx] = fov.getMappingTableTopLeft()[idx];
+        header->mappingTableStep[idx] = fov.getMappingTableStep()[idx];
+        header->fovTopLeft[idx] = fov.getFovTopLeft()[idx];
+        header->fovStep[idx] = fov.getFovStep()[idx];
+    }
+    header->numRois = (uint32_t)numRois;
+
+    uint64_t offset = alignedBytes(sizeof(ShmFov::SlotHeader));
+    auto copyPlane = [&](ShmFov::Plane plane, const void *data, uint64_t planeBytes) {
+        header->planes[plane] = { data != nullptr ? (uint32_t)offset : 0, data != nullptr ? (uint32_t)planeBytes : 0 };
+        if (data != nullptr) {
+            memcpy(slot + offset, data, planeBytes);
+            offset += alignedBytes(planeBytes);
+        }
+    };
+    for (uint32_t plane = ShmFov::RANGE; plane < ShmFov::ROI_INDEX; plane++) {
+        const auto &data = pixelPlanes[plane];
+        copyPlane((ShmFov::Plane)plane, data ? data->data() : nullptr, numPixels * sizeof(uint16_t));
+    }
+    copyPlane(ShmFov::ROI_INDEX, roiIndexRows ? roiIndexRows->data() : nullptr, (uint64_t)imageSize[0] * sizeof(uint16_t));
+    auto *timestamps = reinterpret_cast<uint32_t *>(slot + offset);
+    header->planes[ShmFov::TIMESTAMPS] = { numRois > 0 ? (uint32_t)offset : 0, (uint32_t)(numRois * 3 * sizeof(uint32_t)) };
+    for (uint64_t roi = 0; roi < numRois; roi++) {
+        const auto &roiTimestamp = (*timestampsVec)[roi];
+        for (uint64_t word = 0; word < 3; word++) {
+            timestamps[3 * roi + word] = word < roiTimestamp.size() ? roiTimestamp[word] : 0;
+        }
+    }
+    offset += alignedBytes(numRois * 3 * sizeof(uint32_t));
+    copyPlane(ShmFov::XYZ, xyz ? xyz->data() : nullptr, numPixels * 3 * sizeof(int32_t));
+
+    header->sequence.store(2 * fovNumber + 2, std::memory_order_release);
+    m_ring->published.store(fovNumber + 1, std::memory_order_release);
+    m_ring->futexWord.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, &m_ring->futexWord, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    return true;
+}
+
+uint64_t ShmFovPublisher::GetNumPublished() const
+{
+    return m_ring->published.load(std::memory_order_relaxed);
+}
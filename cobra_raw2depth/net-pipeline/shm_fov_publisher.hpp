@@ -0,0 +1,66 @@
+#ifndef SHM_FOV_PUBLISHER_HPP
+#define SHM_FOV_PUBLISHER_HPP
+
+/**
+ * @file shm_fov_publisher.hpp
+ * @brief This file contains the definition of the ShmFovPublisher, which
+ *        publishes the FoVs of a sensor head into a shared memory ring (see
+ *        shm_fov_ring.hpp) for the consumers on the same board. They read the
+ *        planes in place, instead of decoding a TCP stream over loopback.
+ *
+ * @copyright Copyright (C) 2024 Lumotive, Inc. All rights reserved
+ */
+
+#include "shm_fov_ring.hpp"
+#include <FovSegment.h>
+#include <RtdMetadata.h>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#define SHM_FOV_DEFAULT_SLOTS   4
+
+namespace LidarPipeline {
+
+/**
+ * @brief Creates the shared memory ring of a sensor head and copies each FoV
+ *        handed to Publish() into the next slot. The CobraNetPipelineWrappers
+ *        of the sensor head share one publisher. The ring is removed when the
+ *        publisher is destroyed.
+ */
+class ShmFovPublisher
+{
+    public:
+        /**
+         * @param name      The POSIX shared memory name, e.g. "/lumotive_fov0"
+         * @param numSlots  FoVs kept in the ring, at least 2
+         * @param maxPixels The largest FoV segment, in pixels; larger ones are not published
+         */
+        ShmFovPublisher(std::string name, uint32_t numSlots = SHM_FOV_DEFAULT_SLOTS, uint32_t maxPixels = MAX_PIXELS);
+        ShmFovPublisher(const ShmFovPublisher &) = delete;
+        ShmFovPublisher &operator=(const ShmFovPublisher &) = delete;
+        ~ShmFovPublisher();
+
+        /**
+         * @brief Copies the FoV into the ring and wakes up the subscribers.
+         *
+         * @param newMappingTable The mapping table changed since the previous FoV
+         * @return false if the FoV doesn't fit into a slot
+         */
+        bool Publish(const FovSegment &fov, bool newMappingTable);
+        uint64_t GetNumPublished() const;
+
+        static constexpr uint32_t MAX_PIXELS { IMAGE_WIDTH * MAX_IMAGE_HEIGHT };
+        static constexpr uint32_t MAX_ROIS { MAX_IMAGE_HEIGHT };
+
+    private:
+        std::string m_name;
+        uint8_t *m_map { nullptr };
+        size_t m_mapBytes { 0 };
+        ShmFov::RingHeader *m_ring { nullptr };
+        std::mutex m_mutex;  // Publish() may be called by the pipelines of several FoVs
+};
+
+}
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef SHM_FOV_RING_HPP
+#define SHM_FOV_RING_HPP
+
+/**
+ * @file shm_fov_ring.hpp
+ * @brief The layout of the shared memory ring that the frontend publishes the
+ *        FoVs of a sensor head into (see ShmFovPublisher), and
+ *        ShmFovSubscriber, the client that reads them in place. This header
+ *        only depends on the standard library and Linux, so that local
+ *        consumers can include it on its own.
+ *
+ *        The ring is a POSIX shared memory object with a RingHeader followed
+ *        by numSlots slots of slotSize bytes. FoV n (counting from 0) goes
+ *        into slot n % numSlots: a SlotHeader, then the planes it lists.
+ *        Each slot is a seqlock. The publisher never waits for the
+ *        subscribers, so a subscriber that falls numSlots FoVs behind skips
+ *        to the oldest FoV still in the ring, and a subscriber that reads a
+ *        FoV in place must check ShmFovView::isValid() once it is done with
+ *        it. Subscribers sleep on a futex that the publisher bumps for every
+ *        FoV.
+ *
+ * @copyright Copyright (C) 2024 Lumotive, Inc. All rights reserved
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace LidarPipeline {
+namespace ShmFov {
+
+constexpr uint32_t MAGIC { 0x4c465653 };  // "SVFL" in memory
+constexpr uint32_t VERSION { 2 };
+constexpr uint32_t PLANE_ALIGNMENT { 64 };
+
+/**
+ * @brief The planes of a FoV. The pixel planes are rows x columns values in
+ *        row-major order; the ROI index plane has one value per row; the XYZ
+ *        plane holds the x, then y, then z plane.
+ */
+enum Plane : uint32_t {
+    RANGE = 0,      // uint16_t, in 1/1024 m
+    SNR,            // uint16_t
+    SIGNAL,         // uint16_t
+    BACKGROUND,     // uint16_t
+    ROI_INDEX,      // uint16_t, index into TIMESTAMPS of the ROI of each row
+    TIMESTAMPS,     // uint32_t, numRois x 3
+    XYZ,            // int32_t, in 1/1024 m
+    NUM_PLANES
+};
+
+struct PlaneRef {
+    uint32_t offset;  // from the start of the slot
+    uint32_t bytes;   // 0 if the FoV doesn't have this plane
+};
+
+struct SlotHeader {
+    std::atomic<uint64_t> sequence;  // 2n+1 while FoV n is written into the slot, 2n+2 once it is complete
+    uint32_t sensorHead;
+    uint32_t fovIdx;
+    uint32_t sensorId;
+    uint32_t userTag;
+    uint64_t timestamp;
+    uint32_t rows;                   // of this segment
+    uint32_t columns;
+    uint32_t firstRow;               // of this segment, in the rows of the whole FoV
+    uint32_t fovNumRows;             // of the whole FoV
+    uint32_t frameCompleted;         // this is the last (or only) segment of the FoV
+    uint32_t newMappingTable;        // the mapping table changed since the previous FoV
+    double gcf;
+    double maxUnambiguousRange;
+    uint32_t mappingTableTopLeft[2];
+    uint32_t mappingTableStep[2];
+    uint32_t fovTopLeft[2];
+    uint32_t fovStep[2];
+    uint32_t numRois;
+    PlaneRef planes[NUM_PLANES];
+};
+
+struct RingHeader {
+    std::atomic<uint32_t> magic;     // MAGIC once the publisher has initialized the ring
+    uint32_t version;
+    uint32_t numSlots;
+    uint32_t headerBytes;            // offset of the first slot
+    uint64_t slotBytes;
+    std::atomic<uint64_t> published; // FoVs published so far; the next one is FoV published
+    std::atomic<uint32_t> futexWord; // bumped after each FoV is published
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "the ring's atomics must be lock-free to be shared between processes");
+
+inline uint64_t headerBytes() { return (sizeof(RingHeader) + PLANE_ALIGNMENT - 1) / PLANE_ALIGNMENT * PLANE_ALIGNMENT; }
+
+} // namespace ShmFov
+
+/**
+ * @brief A FoV in the ring, read in place. The pointers are valid until the
+ *        subscriber is destroyed, but the data is only consistent if
+ *        isValid() is still true after it has been read (or copied).
+ */
+class ShmFovView {
+    public:
+        const ShmFov::SlotHeader &header() const { return *m_header; }
+        uint64_t fovNumber() const { return m_fovNumber; }
+
+        // nullptr if the FoV doesn't have the plane
+        const void *plane(ShmFov::Plane plane) const {
+            const auto &ref = m_header->planes[plane];
+            return ref.bytes == 0 ? nullptr : reinterpret_cast<const uint8_t *>(m_header) + ref.offset;
+        }
+        const uint16_t *range() const { return static_cast<const uint16_t *>(plane(ShmFov::RANGE)); }
+        const uint16_t *snr() const { return static_cast<const uint16_t *>(plane(ShmFov::SNR)); }
+        const uint16_t *signal() const { return static_cast<const uint16_t *>(plane(ShmFov::SIGNAL)); }
+        const uint16_t *background() const { return static_cast<const uint16_t *>(plane(ShmFov::BACKGROUND)); }
+        const uint16_t *roiIndex() const { return static_cast<const uint16_t *>(plane(ShmFov::ROI_INDEX)); }
+        const uint32_t *timestamps() const { return static_cast<const uint32_t *>(plane(ShmFov::TIMESTAMPS)); }
+        const int32_t *xyz() const { return static_cast<const int32_t *>(plane(ShmFov::XYZ)); }
+
+        // False once the publisher has started overwriting this FoV, in which case the data read may be torn
+        bool isValid() const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return m_header->sequence.load(std::memory_order_relaxed) == 2 * m_fovNumber + 2;
+        }
+
+    private:
+        friend class ShmFovSubscriber;
+        const ShmFov::SlotHeader *m_header { nullptr };
+        uint64_t m_fovNumber { 0 };
+};
+
+/**
+ * @brief Maps the ring of a sensor head read-only and returns its FoVs in
+ *        order, starting with the next one published.
+ */
+class ShmFovSubscriber {
+    public:
+        explicit ShmFovSubscriber(const std::string &name) {
+            int fd = shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0) {
+                return;
+            }
+            struct stat st {};
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= ShmFov::headerBytes()) {
+                void *map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (map != MAP_FAILED) {
+                    m_map = static_cast<const uint8_t *>(map);
+                    m_mapBytes = (size_t)st.st_size;
+                }
+            }
+            close(fd);
+            if (m_map == nullptr || ring().magic.load(std::memory_order_acquire) != ShmFov::MAGIC ||
+                ring().version != ShmFov::VERSION ||
+                ring().headerBytes + ring().numSlots * ring().slotBytes > m_mapBytes) {
+                unmap();
+                return;
+            }
+            m_next = ring().published.load(std::memory_order_acquire);
+        }
+        ShmFovSubscriber(const ShmFovSubscriber &) = delete;
+        ShmFovSubscriber &operator=(const ShmFovSubscriber &) = delete;
+        ~ShmFovSubscriber() { unmap(); }
+
+        bool isOpen() const { return m_map != nullptr; }
+        uint64_t getNumSkipped() const { return m_numSkipped; }  // FoVs overwritten before they were read
+
+        /**
+         * @brief Waits up to timeout for the next FoV.
+         *
+         * @return false if no FoV was published in time (or the ring isn't open)
+         */
+        bool next(ShmFovView &view, std::chrono::milliseconds timeout) {
+            if (!isOpen()) {
+                return false;
+            }
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            while (true) {
+                uint32_t futexWord = ring().futexWord.load(std::memory_order_acquire);
+                uint64_t published = ring().published.load(std::memory_order_acquire);
+                if (published > m_next) {
+                    // The oldest slot may be being overwritten already
+                    if (published - m_next >= ring().numSlots) {
+                        m_numSkipped += published - m_next - (ring().numSlots - 1);
+                        m_next = published - (ring().numSlots - 1);
+                    }
+                    const auto *header = slot(m_next);
+                    uint64_t fovNumber = m_next++;
+                    if (header->sequence.load(std::memory_order_acquire) == 2 * fovNumber + 2) {
+                        view.m_header = header;
+                        view.m_fovNumber = fovNumber;
+                        return true;
+                    }
+                    m_numSkipped++;
+                    continue;
+                }
+
+                auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+                if (remaining.count() <= 0) {
+                    return false;
+                }
+                struct timespec wait {};
+                wait.tv_sec = (time_t)(remaining.count() / 1000000000);
+                wait.tv_nsec = (long)(remaining.count() % 1000000000);
+                syscall(SYS_futex, &ring().futexWord, FUTEX_WAIT, futexWord, &wait, nullptr, 0);
+            }
+        }
+
+    private:
+        const ShmFov::RingHeader &ring() const { return *reinterpret_cast<const ShmFov::RingHeader *>(m_map); }
+        const ShmFov::SlotHeader *slot(uint64_t fovNumber) const {
+            return reinterpret_cast<const ShmFov::SlotHeader *>(m_map + ring().headerBytes +
+                                                                fovNumber % ring().numSlots * ring().slotBytes);
+        }
+        void unmap() {
+            if (m_map != nullptr) {
+                munmap(const_cast<uint8_t *>(m_map), m_mapBytes);
+                m_map = nullptr;
+            }
+        }
+
+        const uint8_t *m_map { nullptr };
+        size_t m_mapBytes { 0 };
+        uint64_t m_next { 0 };
+        uint64_t m_numSkipped { 0 };
+};
+
+} // namespace LidarPipeline
+
+#endif
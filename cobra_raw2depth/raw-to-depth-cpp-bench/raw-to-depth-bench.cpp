@@ -0,0 +1,773 @@
+/**
+ * @file raw-to-depth-bench.cpp
+ * @brief Microbenchmarks for the RawToDepth kernels, using Google Benchmark.
+ *
+ * Each public kernel in RawToDepthDsp, Binning, NearestNeighbor, hdr, FloatVectorPool and RtdMetadata is
+ * timed on synthetic data the size of a 20-row ROI (640 columns), or of a full-height FOV built from such
+ * ROIs, for each of the supported binning modes. If a recorded session is given with --rois=<file>, the ROI ingest kernels
+ * are also timed on the recorded ROIs.
+ *
+ * The results are written as JSON, unless another --benchmark_format is requested, so that runs on
+ * different targets and releases can be compared with Google Benchmark's compare.py.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "Binning.h"
+#include "FloatVectorPool.h"
+#include "GPixel.h"
+#include "NearestNeighbor.h"
+#include "RawToDepthDsp.h"
+#include "RawToDepthSimd.h"
+#include "RoiContainer.h"
+#include "RtdMetadata.h"
+#include "hdr.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+constexpr uint32_t BENCH_ROI_ROWS { 20 };          ///< Rows in the synthetic ROIs
+constexpr uint32_t BENCH_FOV_ROWS { BENCH_ROI_ROWS * (MAX_IMAGE_HEIGHT / BENCH_ROI_ROWS) }; ///< The whole-frame kernels see a full-height FOV of such ROIs
+constexpr uint32_t BENCH_SEED { 777 };             ///< The synthetic data is the same on every run
+constexpr uint32_t MAX_RECORDED_ROIS { 256 };       ///< ROIs loaded from a recorded session
+constexpr uint16_t BENCH_HDR_SATURATION { 3000 };  ///< A saturationThreshold that enables HDR
+constexpr uint16_t BENCH_NEAREST_NEIGHBOR_LEVEL { 1 };
+const std::vector<int64_t> BENCH_BINNINGS { 1, 2, 4 };
+const std::vector<int64_t> BENCH_MIN_MAX_WINDOWS { 3, 5, 9, 15, 25 }; ///< Square min-max filter sizes
+
+namespace {
+
+/**
+ * @brief A FOV of raw triplets with the statistics of real data: a background level shared by the three
+ *        phases of a pixel, plus an independent signal on two of them.
+ */
+std::vector<float_t> makeRawFrame(uint32_t rows, uint32_t cols, uint32_t seed = BENCH_SEED)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float_t> background(256.0F, 384.0F);
+  std::uniform_real_distribution<float_t> signal(0.0F, 768.0F);
+  std::vector<float_t> frame(NUM_GPIXEL_PHASES * rows * cols);
+  for (std::size_t idx = 0; idx < frame.size(); idx += NUM_GPIXEL_PHASES)
+  {
+    auto base = background(rng);
+    frame[idx + 0] = base + signal(rng);
+    frame[idx + 1] = base + signal(rng);
+    frame[idx + 2] = base + signal(rng) / 8.0F;
+  }
+  return frame;
+}
+
+std::vector<float_t> makeUniform(std::size_t size, float_t low, float_t high, uint32_t seed = BENCH_SEED)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float_t> dist(low, high);
+  std::vector<float_t> vec(size);
+  std::generate(vec.begin(), vec.end(), [&]() { return dist(rng); });
+  return vec;
+}
+
+/**
+ * @brief A complete ROI as received from the sensor: the metadata row followed by the raw data for both
+ *        frequencies (and, with tap accumulation, all three permutations).
+ */
+std::vector<uint16_t> makeRoi(uint32_t roiRows, uint32_t binning, bool tapAccumulation, uint16_t saturationThreshold = SATURATION_THRESHOLD)
+{
+  const uint32_t numPermutations = tapAccumulation ? NUM_GPIXEL_PERMUTATIONS : 1;
+  std::vector<uint16_t> roi(MD_ROW_SHORTS + NUM_GPIXEL_FREQUENCIES * numPermutations * NUM_GPIXEL_PHASES * roiRows * ROI_NUM_COLUMNS);
+  std::copy(RtdMetadata::DEFAULT_METADATA.begin(), RtdMetadata::DEFAULT_METADATA.end(), roi.begin());
+
+  auto *mdat = reinterpret_cast<Metadata_t *>(roi.data()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast) overlaying the metadata row
+  auto md = [](uint32_t val) { return uint16_t(val << MD_SHIFT); };
+  mdat->roiStartRow = md(0);
+  mdat->roiNumRows = md(roiRows);
+  mdat->activeStreamBitmask = md(1);
+  mdat->startStopFlags[0] = md(START_STOP_FLAG_FIRST_ROI | START_STOP_FLAG_FRAME_COMPLETED);
+  mdat->reduceMode = md(tapAccumulation ? REDUCE_MODE_RTD : REDUCE_MODE_RTD + 1);
+  mdat->saturationThreshold = md(saturationThreshold);
+  auto &fovMdat = mdat->perFovMetadata[0];
+  fovMdat.binMode = md(binning);
+  fovMdat.fovRowStart = md(0);
+  fovMdat.fovNumRows = md(roiRows);
+  fovMdat.fovNumRois = md(1);
+  fovMdat.nearestNeighborLevel = md(BENCH_NEAREST_NEIGHBOR_LEVEL);
+
+  // 12-bit raw values in the top bits of each word, as delivered by the sensor.
+  auto raw = makeRawFrame(uint32_t(roi.size() - MD_ROW_SHORTS) / (NUM_GPIXEL_PHASES * ROI_NUM_COLUMNS), ROI_NUM_COLUMNS);
+  std::transform(raw.begin(), raw.end(), roi.begin() + MD_ROW_SHORTS, [](float_t val) { return uint16_t(uint16_t(val) << 4U); });
+  return roi;
+}
+
+/**
+ * @brief The smoothing kernels selected for each binning mode, as in RawToDepthV2_float::reset().
+ */
+std::array<uint32_t,2> getKernelIndices(uint32_t binning)
+{
+  if (binning == 4)
+  {
+    return { 1, 2 };
+  }
+  return { 2, 3 };
+}
+
+std::array<uint32_t,2> getBinnedSize(uint32_t binning) { return { BENCH_FOV_ROWS / binning, IMAGE_WIDTH / binning }; }
+
+void setPixelsProcessed(benchmark::State &state, std::size_t pixelsPerIteration)
+{
+  state.SetItemsProcessed(int64_t(state.iterations()) * int64_t(pixelsPerIteration));
+}
+
+std::vector<std::vector<uint16_t>> &getRecordedRois()
+{
+  static std::vector<std::vector<uint16_t>> recordedRois;
+  return recordedRois;
+}
+
+} // namespace
+
+// ROI ingest: conversion, tap rotation, snr voting and HDR.
+
+static void BM_sh2f(benchmark::State &state)
+{
+  auto roi = makeRoi(BENCH_ROI_ROWS, 1, false);
+  const auto numShorts = uint32_t(roi.size() - MD_ROW_SHORTS);
+  std::vector<float_t> out(numShorts);
+  for (auto _ : state)
+  {
+    RawToDepthDsp::sh2f(roi.data() + MD_ROW_SHORTS, out, numShorts, INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask());
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(numShorts * sizeof(uint16_t)));
+}
+BENCHMARK(BM_sh2f);
+
+static void BM_tapRotation(benchmark::State &state)
+{
+  const bool tapAccumulation = state.range(0) != 0;
+  const uint32_t numPermutations = tapAccumulation ? NUM_GPIXEL_PERMUTATIONS : 1;
+  auto roi = makeRawFrame(NUM_GPIXEL_FREQUENCIES * numPermutations * BENCH_ROI_ROWS, ROI_NUM_COLUMNS);
+  std::vector<float_t> frame(NUM_GPIXEL_PHASES * BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+  for (auto _ : state)
+  {
+    RawToDepthDsp::tapRotation(roi, frame, 0, {BENCH_ROI_ROWS, ROI_NUM_COLUMNS}, NUM_GPIXEL_PHASES, tapAccumulation);
+    benchmark::DoNotOptimize(frame.data());
+  }
+  setPixelsProcessed(state, BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+}
+BENCHMARK(BM_tapRotation)->ArgName("tap")->Arg(0)->Arg(1);
+
+static void BM_snrVoteV2(benchmark::State &state)
+{
+  auto roi0 = makeRawFrame(BENCH_ROI_ROWS, ROI_NUM_COLUMNS, BENCH_SEED);
+  auto roi1 = makeRawFrame(BENCH_ROI_ROWS, ROI_NUM_COLUMNS, BENCH_SEED + 1);
+  std::vector<std::vector<float_t>> rawFov(2, std::vector<float_t>(roi0.size()));
+  std::vector<float_t> snrSquaredFov(BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+  for (auto _ : state)
+  {
+    std::fill(snrSquaredFov.begin(), snrSquaredFov.end(), 0.0F); // every pixel wins the vote
+    RawToDepthDsp::snrVoteV2(roi0, roi1, rawFov, snrSquaredFov, 0);
+    benchmark::DoNotOptimize(rawFov[0].data());
+  }
+  setPixelsProcessed(state, BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+}
+BENCHMARK(BM_snrVoteV2);
+
+static void BM_ingestRoi(benchmark::State &state)
+{
+  const bool tapAccumulation = state.range(0) != 0;
+  auto roi = makeRoi(BENCH_ROI_ROWS, 1, tapAccumulation);
+  std::vector<float_t> roiVector(roi.size() - MD_ROW_SHORTS);
+  RawToDepthDsp::sh2f(roi.data() + MD_ROW_SHORTS, roiVector, uint32_t(roiVector.size()), INPUT_RAW_SHIFT);
+  std::vector<std::vector<float_t>> rawFov(2, std::vector<float_t>(NUM_GPIXEL_PHASES * BENCH_ROI_ROWS * ROI_NUM_COLUMNS));
+  std::vector<float_t> snrSquaredFov(BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+  for (auto _ : state)
+  {
+    std::fill(snrSquaredFov.begin(), snrSquaredFov.end(), 0.0F);
+    RawToDepthDsp::ingestRoi(roiVector, {BENCH_ROI_ROWS, ROI_NUM_COLUMNS}, tapAccumulation, rawFov, snrSquaredFov, 0);
+    benchmark::DoNotOptimize(rawFov[0].data());
+  }
+  setPixelsProcessed(state, BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+}
+BENCHMARK(BM_ingestRoi)->ArgName("tap")->Arg(0)->Arg(1);
+
+static void BM_ingestRoiRaw(benchmark::State &state)
+{
+  const bool tapAccumulation = state.range(0) != 0;
+  auto roi = makeRoi(BENCH_ROI_ROWS, 1, tapAccumulation);
+  std::vector<std::vector<float_t>> rawFov(2, std::vector<float_t>(NUM_GPIXEL_PHASES * BENCH_ROI_ROWS * ROI_NUM_COLUMNS));
+  std::vector<float_t> snrSquaredFov(BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+  for (auto _ : state)
+  {
+    std::fill(snrSquaredFov.begin(), snrSquaredFov.end(), 0.0F);
+    RawToDepthDsp::ingestRoi(roi.data() + MD_ROW_SHORTS, uint32_t(roi.size() - MD_ROW_SHORTS), INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask(),
+                             {BENCH_ROI_ROWS, ROI_NUM_COLUMNS}, tapAccumulation, rawFov, snrSquaredFov, 0);
+    benchmark::DoNotOptimize(rawFov[0].data());
+  }
+  setPixelsProcessed(state, BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+}
+BENCHMARK(BM_ingestRoiRaw)->ArgName("tap")->Arg(0)->Arg(1);
+
+static void BM_hdrSubmit(benchmark::State &state)
+{
+  const bool deferConversion = state.range(0) != 0;
+  const bool hdrEnabled = state.range(1) != 0;
+  const bool retake = state.range(2) != 0;
+  auto roi = makeRoi(BENCH_ROI_ROWS, 1, true, hdrEnabled ? BENCH_HDR_SATURATION : SATURATION_THRESHOLD);
+  const RtdMetadata mdat(roi.data(), MD_ROW_SHORTS * uint32_t(sizeof(uint16_t)));
+  // With retake, every other ROI is the re-acquisition of a saturated one, which is merged with it.
+  auto retakeRoi = roi;
+  reinterpret_cast<Metadata_t *>(retakeRoi.data())->sensorMode |= uint16_t(SENSOR_MODE_HDR_RETRY << MD_SHIFT); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast) overlaying the metadata row
+  const RtdMetadata retakeMdat(retakeRoi.data(), MD_ROW_SHORTS * uint32_t(sizeof(uint16_t)));
+  hdr hdrInstance;
+  hdrInstance.submit(mdat, roi.data(), uint32_t(roi.size()), 0, true, INPUT_RAW_SHIFT, deferConversion); // allocates the buffers
+  bool nextIsRetake = retake;
+  for (auto _ : state)
+  {
+    if (nextIsRetake)
+    {
+      hdrInstance.submit(retakeMdat, retakeRoi.data(), uint32_t(retakeRoi.size()), 0, false, INPUT_RAW_SHIFT, deferConversion);
+    }
+    else
+    {
+      hdrInstance.submit(mdat, roi.data(), uint32_t(roi.size()), 0, false, INPUT_RAW_SHIFT, deferConversion);
+    }
+    nextIsRetake = retake && !nextIsRetake;
+    benchmark::DoNotOptimize(hdrInstance.getRoi().data());
+    benchmark::DoNotOptimize(hdrInstance.getRawRoi());
+  }
+  setPixelsProcessed(state, BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+}
+BENCHMARK(BM_hdrSubmit)->ArgNames({"defer", "hdr", "retake"})->Args({0, 0, 0})->Args({1, 0, 0})->Args({0, 1, 0})->Args({1, 1, 0})
+  ->Args({0, 1, 1})->Args({1, 1, 1});
+
+static void BM_RtdMetadata(benchmark::State &state)
+{
+  auto roi = makeRoi(BENCH_ROI_ROWS, 2, true);
+  for (auto _ : state)
+  {
+    RtdMetadata mdat(roi.data(), MD_ROW_SHORTS * uint32_t(sizeof(uint16_t)));
+    benchmark::DoNotOptimize(mdat.getRoiNumRows());
+    benchmark::DoNotOptimize(mdat.getFovNumRows(0));
+    benchmark::DoNotOptimize(mdat.getBinningX(0));
+    benchmark::DoNotOptimize(mdat.getDoTapAccumulation());
+    benchmark::DoNotOptimize(mdat.getTimestampNs());
+  }
+}
+BENCHMARK(BM_RtdMetadata);
+
+// Stripe-mode kernels, operating on a single ROI.
+
+static void BM_computeSnrSquaredWeights(benchmark::State &state)
+{
+  auto roi0 = makeRawFrame(BENCH_ROI_ROWS, ROI_NUM_COLUMNS, BENCH_SEED);
+  auto roi1 = makeRawFrame(BENCH_ROI_ROWS, ROI_NUM_COLUMNS, BENCH_SEED + 1);
+  std::vector<float_t> weights(roi0.size());
+  float_t numberOfSums = 0;
+  for (auto _ : state)
+  {
+    RawToDepthDsp::computeSnrSquaredWeights(roi0, roi1, weights, numberOfSums, BENCH_ROI_ROWS, ROI_NUM_COLUMNS);
+    benchmark::DoNotOptimize(weights.data());
+  }
+  setPixelsProcessed(state, BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+}
+BENCHMARK(BM_computeSnrSquaredWeights);
+
+static void BM_collapseRawRoi(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  auto roi = makeRawFrame(BENCH_ROI_ROWS, ROI_NUM_COLUMNS);
+  auto weights = makeUniform(BENCH_ROI_ROWS, 0.0F, 1.0F);
+  std::vector<float_t> collapsed(NUM_GPIXEL_PHASES * ROI_NUM_COLUMNS / binning);
+  for (auto _ : state)
+  {
+    RawToDepthDsp::collapseRawRoi(roi, collapsed, weights, {1, binning}, {BENCH_ROI_ROWS, ROI_NUM_COLUMNS});
+    benchmark::DoNotOptimize(collapsed.data());
+  }
+  setPixelsProcessed(state, BENCH_ROI_ROWS * ROI_NUM_COLUMNS);
+}
+BENCHMARK(BM_collapseRawRoi)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+static void BM_bin1xN(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  auto roi = makeRawFrame(1, ROI_NUM_COLUMNS);
+  std::vector<float_t> binned(NUM_GPIXEL_PHASES * ROI_NUM_COLUMNS / binning);
+  for (auto _ : state)
+  {
+    Binning::bin1xN(roi, binned, ROI_NUM_COLUMNS, binning);
+    benchmark::DoNotOptimize(binned.data());
+  }
+  setPixelsProcessed(state, ROI_NUM_COLUMNS);
+}
+BENCHMARK(BM_bin1xN)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+static void BM_median1d(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  auto range = makeUniform(ROI_NUM_COLUMNS / binning, 0.0F, 30.0F);
+  std::vector<float_t> filtered(range.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::median1d(range, filtered, binning);
+    benchmark::DoNotOptimize(filtered.data());
+  }
+  setPixelsProcessed(state, range.size());
+}
+BENCHMARK(BM_median1d)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+// Whole-frame kernels, in the order processWholeFrame() calls them.
+
+static void BM_fillMissingRows(benchmark::State &state)
+{
+  auto frame = makeRawFrame(BENCH_FOV_ROWS, IMAGE_WIDTH);
+  std::vector<float_t> filled(frame.size());
+  std::vector<bool> activeRows(BENCH_FOV_ROWS);
+  for (uint32_t row = 0; row < BENCH_FOV_ROWS; row++)
+  {
+    activeRows[row] = (row % 4) != 2; // as left by snr voting of binned ROIs
+  }
+  for (auto _ : state)
+  {
+    RawToDepthDsp::fillMissingRows(frame, filled, {BENCH_FOV_ROWS, IMAGE_WIDTH}, activeRows);
+    benchmark::DoNotOptimize(filled.data());
+  }
+  setPixelsProcessed(state, BENCH_FOV_ROWS * IMAGE_WIDTH);
+}
+BENCHMARK(BM_fillMissingRows);
+
+static void BM_binMxN(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto binnedSize = getBinnedSize(binning);
+  auto frame = makeRawFrame(BENCH_FOV_ROWS, IMAGE_WIDTH);
+  std::vector<float_t> binned(NUM_GPIXEL_PHASES * binnedSize[0] * binnedSize[1]);
+  for (auto _ : state)
+  {
+    Binning::binMxN(frame, binned, {BENCH_FOV_ROWS, IMAGE_WIDTH}, {binning, binning});
+    benchmark::DoNotOptimize(binned.data());
+  }
+  setPixelsProcessed(state, BENCH_FOV_ROWS * IMAGE_WIDTH);
+}
+BENCHMARK(BM_binMxN)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+static void BM_calculatePhase(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto size = getBinnedSize(binning);
+  const auto pixels = size[0] * size[1];
+  auto raw = makeRawFrame(size[0], size[1]);
+  std::vector<float_t> phase(pixels);
+  std::vector<float_t> signal(pixels);
+  std::vector<float_t> snr(pixels);
+  std::vector<float_t> background(pixels);
+  for (auto _ : state)
+  {
+    RawToDepthDsp::calculatePhase(raw, phase, signal, snr, background, float_t(binning * binning));
+    benchmark::DoNotOptimize(phase.data());
+  }
+  setPixelsProcessed(state, pixels);
+}
+BENCHMARK(BM_calculatePhase)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+static void BM_smoothSummedData(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto size = getBinnedSize(binning);
+  const auto kernels = getKernelIndices(binning);
+  auto raw = makeRawFrame(size[0], size[1]);
+  std::vector<float_t> smoothed(raw.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::smoothSummedData(raw, smoothed, size, kernels[0], kernels[1]);
+    benchmark::DoNotOptimize(smoothed.data());
+  }
+  setPixelsProcessed(state, size[0] * size[1]);
+}
+BENCHMARK(BM_smoothSummedData)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+static void BM_smoothRaw(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto size = getBinnedSize(binning);
+  const auto kernels = getKernelIndices(binning);
+  auto raw = makeRawFrame(size[0], size[1]);
+  std::vector<float_t> smoothed(raw.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::smoothRaw(raw, smoothed, size, kernels[0], kernels[1]);
+    benchmark::DoNotOptimize(smoothed.data());
+  }
+  setPixelsProcessed(state, size[0] * size[1]);
+}
+BENCHMARK(BM_smoothRaw)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+static void BM_smoothRaw5x7(benchmark::State &state)
+{
+  auto raw = makeRawFrame(BENCH_FOV_ROWS, IMAGE_WIDTH);
+  std::vector<float_t> smoothed(raw.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::smoothRaw5x7(raw, smoothed, {BENCH_FOV_ROWS, IMAGE_WIDTH});
+    benchmark::DoNotOptimize(smoothed.data());
+  }
+  setPixelsProcessed(state, BENCH_FOV_ROWS * IMAGE_WIDTH);
+}
+BENCHMARK(BM_smoothRaw5x7);
+
+static void BM_smoothRaw7x15(benchmark::State &state)
+{
+  auto raw = makeRawFrame(BENCH_FOV_ROWS, IMAGE_WIDTH);
+  std::vector<float_t> smoothed(raw.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::smoothRaw7x15(raw, smoothed, {BENCH_FOV_ROWS, IMAGE_WIDTH});
+    benchmark::DoNotOptimize(smoothed.data());
+  }
+  setPixelsProcessed(state, BENCH_FOV_ROWS * IMAGE_WIDTH);
+}
+BENCHMARK(BM_smoothRaw7x15);
+
+static void BM_transposeRaw(benchmark::State &state)
+{
+  auto raw = makeRawFrame(BENCH_FOV_ROWS, IMAGE_WIDTH);
+  std::vector<float_t> transposed(raw.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::transposeRaw(raw, transposed, {BENCH_FOV_ROWS, IMAGE_WIDTH});
+    benchmark::DoNotOptimize(transposed.data());
+  }
+  setPixelsProcessed(state, BENCH_FOV_ROWS * IMAGE_WIDTH);
+}
+BENCHMARK(BM_transposeRaw);
+
+static void BM_calculatePhaseSmooth(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto size = getBinnedSize(binning);
+  const auto pixels = size[0] * size[1];
+  auto smoothed = makeRawFrame(size[0], size[1]);
+  auto phase = makeUniform(pixels, 0.0F, 1.0F);
+  std::vector<float_t> smoothedPhase(pixels);
+  std::vector<float_t> correctedPhase(pixels);
+  for (auto _ : state)
+  {
+    RawToDepthDsp::calculatePhaseSmooth(smoothed, smoothedPhase, phase, correctedPhase, 0);
+    benchmark::DoNotOptimize(correctedPhase.data());
+  }
+  setPixelsProcessed(state, pixels);
+}
+BENCHMARK(BM_calculatePhaseSmooth)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+static void BM_computeWholeFrameRange(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto size = getBinnedSize(binning);
+  const auto pixels = size[0] * size[1];
+  const uint32_t f0ModulationIndex = 8;
+  const uint32_t f1ModulationIndex = 7;
+  const std::array<float_t,2> freqs { GPixel::IDX_TO_FRQ_LUT[f0ModulationIndex], GPixel::IDX_TO_FRQ_LUT[f1ModulationIndex] };
+  const auto gcf = float_t(GPixel::getGcf(f0ModulationIndex, f1ModulationIndex));
+  const std::vector<float_t> fsInt { roundf(freqs[0] / gcf), roundf(freqs[1] / gcf) };
+  auto smoothedPhase0 = makeUniform(pixels, 0.0F, 1.0F, BENCH_SEED);
+  auto smoothedPhase1 = makeUniform(pixels, 0.0F, 1.0F, BENCH_SEED + 1);
+  auto correctedPhase0 = makeUniform(pixels, 0.0F, 1.0F, BENCH_SEED + 2);
+  auto correctedPhase1 = makeUniform(pixels, 0.0F, 1.0F, BENCH_SEED + 3);
+  std::vector<float_t> ranges(pixels);
+  std::vector<float_t> mFrame(pixels);
+  for (auto _ : state)
+  {
+    RawToDepthDsp::computeWholeFrameRange(smoothedPhase0, smoothedPhase1, correctedPhase0, correctedPhase1,
+                                          ranges, freqs, fsInt, C_MPS, mFrame);
+    benchmark::DoNotOptimize(ranges.data());
+  }
+  setPixelsProcessed(state, pixels);
+}
+BENCHMARK(BM_computeWholeFrameRange)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+static void BM_medianFilterPlus(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const bool performGhostMedian = state.range(1) != 0;
+  const auto size = getBinnedSize(binning);
+  const auto kernels = getKernelIndices(binning);
+  auto ranges = makeUniform(size[0] * size[1], 0.0F, 30.0F);
+  std::vector<float_t> filtered(ranges.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::medianFilterPlus(ranges, filtered, {kernels[0], kernels[1]}, size, performGhostMedian);
+    benchmark::DoNotOptimize(filtered.data());
+  }
+  setPixelsProcessed(state, size[0] * size[1]);
+}
+BENCHMARK(BM_medianFilterPlus)->ArgNames({"binning", "ghost"})->ArgsProduct({BENCH_BINNINGS, {0, 1}});
+
+static void BM_removeOutliers(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto filterLevel = uint16_t(state.range(1));
+  auto size = getBinnedSize(binning);
+  const auto input = makeUniform(size[0] * size[1], 0.0F, 30.0F);
+  std::vector<float_t> ranges(input.size());
+  for (auto _ : state)
+  {
+    // The filter runs in place, so each iteration starts from the same input.
+    std::copy(input.begin(), input.end(), ranges.begin());
+    NearestNeighbor::removeOutliers(ranges, filterLevel, size);
+    benchmark::DoNotOptimize(ranges.data());
+  }
+  setPixelsProcessed(state, size[0] * size[1]);
+}
+BENCHMARK(BM_removeOutliers)->ArgNames({"binning", "level"})->ArgsProduct({BENCH_BINNINGS, {1, 3, 5}});
+
+static void BM_minMaxRecursive(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto size = getBinnedSize(binning);
+  auto mFrame = makeUniform(size[0] * size[1], 0.0F, 4.0F);
+  std::transform(mFrame.begin(), mFrame.end(), mFrame.begin(), [](float_t val) { return roundf(val); });
+  std::vector<float_t> mask(mFrame.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::minMaxRecursive(mFrame, mask, {3, 3}, size, 1);
+    benchmark::DoNotOptimize(mask.data());
+  }
+  setPixelsProcessed(state, size[0] * size[1]);
+}
+BENCHMARK(BM_minMaxRecursive)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+// minMax() evaluates the whole window for each pixel, and minMaxSliding() costs the same for any window.
+// Timing both over the window sizes shows where the sliding filter overtakes the per-pixel one.
+static void BM_minMax(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto window = uint32_t(state.range(1));
+  const auto size = getBinnedSize(binning);
+  auto mFrame = makeUniform(size[0] * size[1], 0.0F, 4.0F);
+  std::transform(mFrame.begin(), mFrame.end(), mFrame.begin(), [](float_t val) { return roundf(val); });
+  std::vector<float_t> mask(mFrame.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::minMax(mFrame, mask, {window, window}, {size[0], size[1]}, 1);
+    benchmark::DoNotOptimize(mask.data());
+  }
+  setPixelsProcessed(state, size[0] * size[1]);
+}
+BENCHMARK(BM_minMax)->ArgNames({"binning", "window"})->ArgsProduct({BENCH_BINNINGS, BENCH_MIN_MAX_WINDOWS});
+
+static void BM_minMaxSliding(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto window = uint32_t(state.range(1));
+  const auto size = getBinnedSize(binning);
+  auto mFrame = makeUniform(size[0] * size[1], 0.0F, 4.0F);
+  std::transform(mFrame.begin(), mFrame.end(), mFrame.begin(), [](float_t val) { return roundf(val); });
+  std::vector<float_t> mask(mFrame.size());
+  for (auto _ : state)
+  {
+    RawToDepthDsp::minMaxSliding(mFrame, mask, {window, window}, size, 1);
+    benchmark::DoNotOptimize(mask.data());
+  }
+  setPixelsProcessed(state, size[0] * size[1]);
+}
+BENCHMARK(BM_minMaxSliding)->ArgNames({"binning", "window"})->ArgsProduct({BENCH_BINNINGS, BENCH_MIN_MAX_WINDOWS});
+
+// Buffer management.
+
+static void BM_FloatVectorPool(benchmark::State &state)
+{
+  const auto binning = uint32_t(state.range(0));
+  const auto size = getBinnedSize(binning);
+  const auto numElements = NUM_GPIXEL_PHASES * size[0] * size[1];
+  FloatVectorPool::release(FloatVectorPool::get(numElements)); // the first get() allocates
+  for (auto _ : state)
+  {
+    auto vec = FloatVectorPool::get(numElements);
+    benchmark::DoNotOptimize(vec->data());
+    FloatVectorPool::release(vec);
+  }
+}
+BENCHMARK(BM_FloatVectorPool)->ArgName("binning")->ArgsProduct({BENCH_BINNINGS});
+
+// Recorded input, registered in main() if --rois is given.
+
+static void BM_recordedRtdMetadata(benchmark::State &state)
+{
+  const auto &rois = getRecordedRois();
+  std::size_t roiIdx = 0;
+  for (auto _ : state)
+  {
+    const auto &roi = rois[roiIdx];
+    roiIdx = (roiIdx + 1) % rois.size();
+    RtdMetadata mdat(roi.data(), MD_ROW_SHORTS * uint32_t(sizeof(uint16_t)));
+    benchmark::DoNotOptimize(mdat.getRoiNumRows());
+    benchmark::DoNotOptimize(mdat.getFovNumRows(0));
+    benchmark::DoNotOptimize(mdat.getBinningX(0));
+    benchmark::DoNotOptimize(mdat.getDoTapAccumulation());
+    benchmark::DoNotOptimize(mdat.getTimestampNs());
+  }
+}
+
+static void BM_recordedHdrSubmit(benchmark::State &state)
+{
+  const bool deferConversion = state.range(0) != 0;
+  const auto &rois = getRecordedRois();
+  hdr hdrInstance;
+  std::size_t roiIdx = 0;
+  bool startup = true;
+  int64_t pixels = 0;
+  for (auto _ : state)
+  {
+    const auto &roi = rois[roiIdx];
+    roiIdx = (roiIdx + 1) % rois.size();
+    const RtdMetadata mdat(roi.data(), MD_ROW_SHORTS * uint32_t(sizeof(uint16_t)));
+    hdrInstance.submit(mdat, roi.data(), uint32_t(roi.size()), 0, startup, INPUT_RAW_SHIFT, deferConversion);
+    startup = false;
+    benchmark::DoNotOptimize(hdrInstance.getRoi().data());
+    pixels += int64_t(roi.size() - MD_ROW_SHORTS) / NUM_GPIXEL_PHASES;
+  }
+  state.SetItemsProcessed(pixels);
+}
+
+static void BM_recordedIngestRoiRaw(benchmark::State &state)
+{
+  const auto &rois = getRecordedRois();
+  uint32_t maxRows = 0;
+  for (const auto &roi : rois)
+  {
+    maxRows = std::max(maxRows, uint32_t(RtdMetadata(roi.data(), MD_ROW_SHORTS * uint32_t(sizeof(uint16_t))).getRoiNumRows()));
+  }
+  std::vector<std::vector<float_t>> rawFov(2, std::vector<float_t>(NUM_GPIXEL_PHASES * maxRows * ROI_NUM_COLUMNS));
+  std::vector<float_t> snrSquaredFov(maxRows * ROI_NUM_COLUMNS);
+  std::size_t roiIdx = 0;
+  int64_t pixels = 0;
+  for (auto _ : state)
+  {
+    const auto &roi = rois[roiIdx];
+    roiIdx = (roiIdx + 1) % rois.size();
+    RtdMetadata mdat(roi.data(), MD_ROW_SHORTS * uint32_t(sizeof(uint16_t)));
+    const std::array<uint32_t,2> roiSize { mdat.getRoiNumRows(), ROI_NUM_COLUMNS };
+    std::fill(snrSquaredFov.begin(), snrSquaredFov.end(), 0.0F);
+    RawToDepthDsp::ingestRoi(roi.data() + MD_ROW_SHORTS, uint32_t(roi.size() - MD_ROW_SHORTS), INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask(),
+                             roiSize, mdat.getDoTapAccumulation(), rawFov, snrSquaredFov, 0);
+    benchmark::DoNotOptimize(rawFov[0].data());
+    pixels += int64_t(roiSize[0] * roiSize[1]);
+  }
+  state.SetItemsProcessed(pixels);
+}
+
+/**
+ * @brief Copies the first ROIs of a recorded session into memory, skipping any that are truncated.
+ *
+ * @return The number of ROIs loaded
+ */
+static std::size_t loadRecordedRois(const std::string &path)
+{
+  RoiContainerReader reader;
+  if (!reader.open(path))
+  {
+    return 0;
+  }
+  auto &rois = getRecordedRois();
+  RoiContainerRecord record;
+  while (rois.size() < MAX_RECORDED_ROIS && reader.next(record))
+  {
+    if (record.size < MD_ROW_SHORTS * sizeof(uint16_t))
+    {
+      continue;
+    }
+    const auto *shorts = reinterpret_cast<const uint16_t *>(record.data); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast) raw ROI data
+    RtdMetadata mdat(shorts, MD_ROW_SHORTS * uint32_t(sizeof(uint16_t)));
+    const auto numElements = mdat.getRoiNumElements();
+    if (mdat.getRoiNumRows() == 0 || record.size < numElements * sizeof(uint16_t))
+    {
+      continue;
+    }
+    rois.emplace_back(shorts, shorts + numElements);
+  }
+  return rois.size();
+}
+
+static bool parseSimdLevel(const std::string &name, RawToDepthSimd::Level &level)
+{
+  for (auto candidate : {RawToDepthSimd::Level::SCALAR, RawToDepthSimd::Level::NEON, RawToDepthSimd::Level::SSE2, RawToDepthSimd::Level::AVX2})
+  {
+    if (strcasecmp(name.c_str(), RawToDepthSimd::getLevelName(candidate)) == 0)
+    {
+      level = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char **argv)
+{
+  const std::string roisOption("--rois=");
+  const std::string simdOption("--simd=");
+  const std::string formatOption("--benchmark_format");
+  std::string roisPath;
+  bool formatGiven = false;
+
+  // Pull out our own options; the rest are passed to Google Benchmark.
+  std::vector<char *> args { argv[0] };
+  for (int argIdx = 1; argIdx < argc; argIdx++)
+  {
+    std::string arg(argv[argIdx]);
+    if (arg.compare(0, roisOption.size(), roisOption) == 0)
+    {
+      roisPath = arg.substr(roisOption.size());
+      continue;
+    }
+    if (arg.compare(0, simdOption.size(), simdOption) == 0)
+    {
+      RawToDepthSimd::Level level {};
+      if (!parseSimdLevel(arg.substr(simdOption.size()), level))
+      {
+        fprintf(stderr, "Unknown SIMD level in %s\n", arg.c_str());
+        return 1;
+      }
+      RawToDepthSimd::setLevel(level);
+      continue;
+    }
+    formatGiven = formatGiven || arg.compare(0, formatOption.size(), formatOption) == 0;
+    args.push_back(argv[argIdx]);
+  }
+  std::string jsonFormat("--benchmark_format=json");
+  if (!formatGiven)
+  {
+    args.push_back(jsonFormat.data());
+  }
+
+  if (!roisPath.empty())
+  {
+    if (loadRecordedRois(roisPath) == 0)
+    {
+      fprintf(stderr, "No ROIs could be read from %s\n", roisPath.c_str());
+      return 1;
+    }
+    benchmark::RegisterBenchmark("BM_recordedRtdMetadata", BM_recordedRtdMetadata);
+    benchmark::RegisterBenchmark("BM_recordedHdrSubmit", BM_recordedHdrSubmit)->ArgName("defer")->Arg(0)->Arg(1);
+    benchmark::RegisterBenchmark("BM_recordedIngestRoiRaw", BM_recordedIngestRoiRaw);
+    benchmark::AddCustomContext("recorded_rois", roisPath);
+    benchmark::AddCustomContext("recorded_rois_loaded", std::to_string(getRecordedRois().size()));
+  }
+  benchmark::AddCustomContext("simd_level", RawToDepthSimd::getLevelName(RawToDepthSimd::getLevel()));
+  benchmark::AddCustomContext("roi_rows", std::to_string(BENCH_ROI_ROWS));
+  benchmark::AddCustomContext("roi_columns", std::to_string(ROI_NUM_COLUMNS));
+
+  int numArgs = int(args.size());
+  benchmark::Initialize(&numArgs, args.data());
+  if (benchmark::ReportUnrecognizedArguments(numArgs, args.data()))
+  {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
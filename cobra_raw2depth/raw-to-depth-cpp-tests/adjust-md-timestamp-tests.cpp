@@ -83,3 +83,34 @@ TEST(MetadataTests, adjust_metadata_time_test) {
 
     // NOLINTEND(readability-magic-numbers)
 }
+
+TEST(MetadataTests, scan_roi_matches_decoded_metadata) {
+    std::vector<uint16_t> roi(MD_ROW_SHORTS, 0);
+    auto *mtd = (struct Metadata_t *)roi.data();
+
+    // NOLINTBEGIN(readability-magic-numbers)
+    mtd->roiCounter = 0x7ff0;
+    for (uint32_t fovIdx = 0; fovIdx < MAX_ACTIVE_FOVS; fovIdx++) {
+        mtd->perFovMetadata[fovIdx].userTag = uint16_t((0x101 * (fovIdx + 1)) << MD_SHIFT);
+    }
+    mtd->timestamp0 = 0xfedc;
+    mtd->timestamp1 = 0xba98;
+    mtd->timestamp2 = 0x7654;
+    mtd->timestamp3 = 0x3210;
+    mtd->timestamp4 = 0xcdef;
+    mtd->timestamp5 = 0x89ab;
+    mtd->timestamp6 = 0xcdef;
+    std::vector<uint16_t> expected(roi);
+
+    const RoiScan scan = RtdMetadata::scanRoi((uint8_t *)roi.data(), 0x89abcdef01234ULL);
+    RtdMetadata::adjustTimestamp((uint8_t *)expected.data(), 0x89abcdef01234ULL);
+    // NOLINTEND(readability-magic-numbers)
+
+    EXPECT_EQ(roi, expected);
+    const RtdMetadata mdat(expected);
+    EXPECT_EQ(scan.roiCounter, mdat.getRoiCounter());
+    for (uint32_t fovIdx = 0; fovIdx < MAX_ACTIVE_FOVS; fovIdx++) {
+        EXPECT_EQ(scan.userTags[fovIdx], mdat.getUserTag(fovIdx));
+    }
+    EXPECT_EQ(scan.timestamp, mdat.getTimestamp());
+}
@@ -15,11 +15,25 @@
 #include "RawToDepth.h"
 #include "RawToDepthUtil.h"
 #include "RawToDepthDsp.h"
+#include "RawToDepthSimd.h"
+#include "RawToDepthV2_float.h"
+#include "RawToDepthV2_fixed.h"
+#include "RawToDepthStripe_float.h"
+#include "Binning.h"
+#include "NearestNeighbor.h"
 #include "LumoUtil.h"
 #include "RawToFovs.h"
 #include "RtdMetadata.h"
 #include "MappingTable.h"
 #include "FloatVectorPool.h"
+#include "FrameArena.h"
+#include "HugePages.h"
+#include "MemoryBudget.h"
+#include "WorkerPool.h"
+#include "FrameScheduler.h"
+#include "SpscRing.h"
+#include "RoiRecorder.h"
+#include "DspCapture.h"
 #include "LumoLogger.h"
 
 #include <climits>
@@ -28,6 +42,7 @@
 #include <sstream>
 #include <condition_variable>
 #include <filesystem>
+#include <sys/stat.h>
 
 #include "LumoTimers.h"
 #include "RawToDepthFactory.h"
@@ -180,6 +195,95 @@ std::list<std::pair<uint16_t, std::shared_ptr<FovSegment>>> processRois(RawToFov
   return data;
 }
 
+/**
+ * @brief Creates one synthetic grid-mode ROI (metadata followed by raw data) for FOV 0, so that the whole-frame
+ * pipeline can be exercised without the recorded unittest-artifacts.
+ *
+ * @param roiIdx The index of this ROI within the FOV.
+ * @param numRois The number of ROIs in the FOV.
+ * @param roiRows The number of sensor rows in each ROI.
+ * @param binning The binning mode (1, 2 or 4).
+ * @param frameIdx Used to generate a unique ROI counter and timestamp for each frame.
+ * @return The ROI, ready to be passed to RawToFovs::processRoi().
+ */
+std::vector<uint16_t> makeSyntheticGridRoi(uint32_t roiIdx, uint32_t numRois, uint32_t roiRows, uint32_t binning, uint32_t frameIdx)
+{
+  const uint32_t numPermutations = 3;
+  std::vector<uint16_t> roi(MD_ROW_SHORTS + size_t(roiRows) * IMAGE_WIDTH * NUM_GPIXEL_PHASES * 2 * numPermutations);
+  std::copy(RtdMetadata::DEFAULT_METADATA.begin(), RtdMetadata::DEFAULT_METADATA.end(), roi.begin());
+
+  auto md = [](uint32_t val) { return uint16_t(val << MD_SHIFT); };
+  auto *mdat = (Metadata_t*)roi.data();
+  mdat->roiStartRow = md(roiIdx * roiRows);
+  mdat->roiNumRows = md(roiRows);
+  mdat->f0ModulationIndex = md(8);
+  mdat->f1ModulationIndex = md(7);
+  mdat->activeStreamBitmask = md(1);
+  mdat->startStopFlags[0] = md((roiIdx == 0 ? START_STOP_FLAG_FIRST_ROI : 0U) |
+                               (roiIdx == numRois - 1 ? START_STOP_FLAG_FRAME_COMPLETED : 0U));
+  mdat->roiCounter = md((frameIdx * numRois + roiIdx) & 0xfffU);
+  mdat->timestamp0 = md(roiIdx);
+  mdat->timestamp1 = md(frameIdx);
+  mdat->reduceMode = md(REDUCE_MODE_RTD);
+  mdat->saturationThreshold = md(0xfff);
+  mdat->random_scan_table_tag = md(7);
+
+  auto &fov = mdat->perFovMetadata[0];
+  fov.binMode = md(binning);
+  fov.fovRowStart = md(0);
+  fov.fovNumRows = md(numRois * roiRows);
+  fov.fovNumRois = md(numRois);
+  fov.rtdAlgorithmCommon = md(0);
+  fov.rtdAlgorithmGrid = md(RTD_ALG_GRID_ENABLE_RANGE_MEDIAN | RTD_ALG_GRID_ENABLE_MIN_MAX);
+  fov.rtdAlgorithmStripe = md(0);
+  fov.snrThresh = md(8);
+  fov.randomFovTag = md(3);
+  fov.nearestNeighborLevel = md(1);
+  fov.userTag = md(frameIdx & 0xfffU);
+
+  // Taps A and B carry the signal, C the background.
+  for (auto idx = MD_ROW_SHORTS; idx < roi.size(); idx += NUM_GPIXEL_PHASES)
+  {
+    auto background = uint32_t(0x1000 + rand() % 0x800);
+    roi[idx + 0] = uint16_t((background + rand() % 0x3000) & 0xfff0U);
+    roi[idx + 1] = uint16_t((background + rand() % 0x3000) & 0xfff0U);
+    roi[idx + 2] = uint16_t((background + rand() % 0x600) & 0xfff0U);
+  }
+  return roi;
+}
+
+/**
+ * @brief Runs one synthetic grid-mode frame through RawToFovs and waits for the output.
+ *
+ * @param wholeFrameMs If provided, receives the time from submitting the last ROI until the output is available,
+ * which is dominated by whole-frame processing.
+ * @return The output FOV, or nullptr if none was produced within one second.
+ */
+std::shared_ptr<FovSegment> processSyntheticGridFrame(RawToFovs &rtf, const std::vector<std::vector<uint16_t>> &rois,
+                                                      double *wholeFrameMs = nullptr)
+{
+  auto lastRoiTime = std::chrono::steady_clock::now();
+  for (const auto &roi : rois)
+  {
+    lastRoiTime = std::chrono::steady_clock::now();
+    rtf.processRoi(roi.data(), roi.size()*sizeof(uint16_t));
+  }
+  const auto numWaits = 100000;
+  for (auto waitIdx = 0; waitIdx < numWaits; waitIdx++)
+  {
+    for (auto fovIdx : rtf.fovsAvailable())
+    {
+      if (wholeFrameMs != nullptr)
+      {
+        *wholeFrameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - lastRoiTime).count();
+      }
+      return rtf.getData(fovIdx);
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(10));
+  }
+  return nullptr;
+}
+
 /**
  * @brief Given the input directory, run the raw ROIs from that directory sequentially through the
  * RawToDepth algorithms and write the output results to the ../../tmp directory.
@@ -497,10 +601,10 @@ TEST_F(RawToDepthTests, test_bin_mapping_table)
 
       for (auto idx=0; idx<calX->size(); idx++)
       {
-        file.write(reinterpret_cast<char*>(&(calX->at(idx))), sizeof(int32_t));
-        file.write(reinterpret_cast<char*>(&(calY->at(idx))), sizeof(int32_t));
-        file.write(reinterpret_cast<char*>(&(calTheta->at(idx))), sizeof(int32_t));
-        file.write(reinterpret_cast<char*>(&(calPhi->at(idx))), sizeof(int32_t));
+        file.write(reinterpret_cast<const char*>(&(calX->at(idx))), sizeof(int32_t));
+        file.write(reinterpret_cast<const char*>(&(calY->at(idx))), sizeof(int32_t));
+        file.write(reinterpret_cast<const char*>(&(calTheta->at(idx))), sizeof(int32_t));
+        file.write(reinterpret_cast<const char*>(&(calPhi->at(idx))), sizeof(int32_t));
       }
       return;
     }
@@ -536,10 +640,10 @@ TEST_F(RawToDepthTests, test_csv_mapping_table)
 
       for (auto idx=0; idx<calX->size(); idx++)
       {
-        file.write(reinterpret_cast<char*>(&(calX->at(idx))), sizeof(int32_t));
-        file.write(reinterpret_cast<char*>(&(calY->at(idx))), sizeof(int32_t));
-        file.write(reinterpret_cast<char*>(&(calTheta->at(idx))), sizeof(int32_t));
-        file.write(reinterpret_cast<char*>(&(calPhi->at(idx))), sizeof(int32_t));
+        file.write(reinterpret_cast<const char*>(&(calX->at(idx))), sizeof(int32_t));
+        file.write(reinterpret_cast<const char*>(&(calY->at(idx))), sizeof(int32_t));
+        file.write(reinterpret_cast<const char*>(&(calTheta->at(idx))), sizeof(int32_t));
+        file.write(reinterpret_cast<const char*>(&(calPhi->at(idx))), sizeof(int32_t));
       }
       return;
     }
@@ -547,6 +651,67 @@ TEST_F(RawToDepthTests, test_csv_mapping_table)
   rtf.shutdown();
 }
 
+TEST_F(RawToDepthTests, test_mapped_mapping_table)
+{
+  // A legacy interleaved table, saved in the versioned format and mapped back
+  auto binfn = "../../tmp/mapping_table_synthetic.bin"s;
+  auto writeBin = [&binfn](int32_t offset)
+  {
+    std::ofstream file(binfn, std::ios::binary | std::ios::trunc); // in place, as System Control does
+    for (int32_t idx = 0; idx < MAPPING_TABLE_LENGTH; idx++)
+    {
+      std::array<int32_t, 4> entry { idx + offset, -idx, 2 * idx, -2 * idx };
+      file.write(reinterpret_cast<const char*>(entry.data()), sizeof(entry));
+    }
+    return file.good();
+  };
+  ASSERT_TRUE(writeBin(0));
+
+  auto bin = MappingTable::load(binfn);
+  ASSERT_TRUE(bin->getCalibrationTheta() != nullptr);
+  ASSERT_EQ(bin, MappingTable::load(binfn)); // one copy for every head
+  ASSERT_EQ(bin->getCalibrationPhi()->size(), MAPPING_TABLE_LENGTH);
+  ASSERT_EQ(bin->getCalibrationY()->at(1000), -1000);
+
+  auto mtbfn = "../../tmp/mapping_table_synthetic.mtb"s;
+  ASSERT_TRUE(bin->save(mtbfn));
+  auto mtb = MappingTable::load(mtbfn);
+  ASSERT_TRUE(mtb->getCalibrationTheta() != nullptr);
+  ASSERT_EQ(mtb->getWidth(), MAPPING_TABLE_DEFAULT_WIDTH);
+  ASSERT_EQ(mtb->getHeight(), MAPPING_TABLE_DEFAULT_HEIGHT);
+  for (auto idx = 0; idx < MAPPING_TABLE_LENGTH; idx++)
+  {
+    ASSERT_EQ(mtb->getCalibrationX()->at(idx), bin->getCalibrationX()->at(idx));
+    ASSERT_EQ(mtb->getCalibrationY()->at(idx), bin->getCalibrationY()->at(idx));
+    ASSERT_EQ(mtb->getCalibrationTheta()->at(idx), bin->getCalibrationTheta()->at(idx));
+    ASSERT_EQ(mtb->getCalibrationPhi()->at(idx), bin->getCalibrationPhi()->at(idx));
+  }
+
+  // Rewriting the legacy table in place leaves the loaded one as it was, and the next load gets the new one.
+  ASSERT_TRUE(writeBin(7));
+  ASSERT_EQ(bin->getCalibrationX()->at(1000), 1000);
+  auto rewrittenBin = MappingTable::load(binfn);
+  ASSERT_NE(rewrittenBin, bin);
+  ASSERT_EQ(rewrittenBin->getCalibrationX()->at(1000), 1007);
+
+  // Saving over a mapped versioned table replaces the file, which the mapped table keeps.
+  struct stat mtbStat = {};
+  ASSERT_EQ(stat(mtbfn.c_str(), &mtbStat), 0);
+  const auto mtbInode = mtbStat.st_ino;
+  ASSERT_TRUE(rewrittenBin->save(mtbfn));
+  ASSERT_EQ(stat(mtbfn.c_str(), &mtbStat), 0);
+  ASSERT_NE(mtbStat.st_ino, mtbInode);
+  ASSERT_EQ(mtb->getCalibrationX()->at(1000), 1000);
+  ASSERT_EQ(MappingTable::load(mtbfn)->getCalibrationX()->at(1000), 1007);
+
+  // Pixel (row, col) of a FOV at (10, 20) with steps (2, 4) is entry (10 + 2 * row, 20 + 4 * col)
+  auto window = MappingTableWindow(mtb, {10, 20}, {2, 4});
+  ASSERT_TRUE(window.valid());
+  int32_t entry = (10 + 2 * 3) * MAPPING_TABLE_DEFAULT_WIDTH + 20 + 4 * 5;
+  ASSERT_EQ(window.theta(3, 5), 2 * entry);
+  ASSERT_EQ(window.phi(3, 5), -2 * entry);
+}
+
 #define INPUT_FIFO_LENGTH 32
 /**
  * @brief A class to assist in a particular type of benchmarking, "with cadence."
@@ -1108,6 +1273,7 @@ TEST_F(RawToDepthTests, raw_to_depth_tests_RangeTempCorrection)
   mdPtr->perFovMetadata[0].rtdAlgorithmCommon |= uint16_t(RTD_ALG_COMMON_ENABLE_TEMP_RANGE_ADJ<< 4U);
 
   mdPtr->system_type = (SYSTEM_TYPE_M25 << 4U);
+  mdat = RtdMetadata(md_block.data(), md_block.size()*sizeof(uint16_t)); // The metadata is decoded when constructed.
   if (mdat.isM20())
   {
     REF_RESISTANCE = M20_REF_RESISTANCE;
@@ -1144,6 +1310,7 @@ TEST_F(RawToDepthTests, raw_to_depth_tests_RangeTempCorrection)
     const uint32_t twelvebits = 0x3ff;
     mdPtr->adc[LASER_THERM_ADC_IDX] = twelvebits << MD_SHIFT;
     mdPtr->adc[VLDA_ADC_IDX] = vldaMetaValue << MD_SHIFT; // half-range
+    mdat = RtdMetadata(md_block.data(), md_block.size()*sizeof(uint16_t));
     temperatureCalibration.setAdcValues(mdat, 0);
     LLogInfo(LLF(10,5) << vldaMetaValue << LLF(10,5) << temperatureCalibration.getVldaAdcVoltage() << LLF(10,5) << temperatureCalibration.getVldaVoltage() << LLF(10,5) << temperatureCalibration.getVldaRangeOffsetMm());
   }
@@ -1160,6 +1327,7 @@ TEST_F(RawToDepthTests, raw_to_depth_tests_RangeTempCorrection)
     const uint32_t halfRange = 1500;
     mdPtr->adc[LASER_THERM_ADC_IDX] = tempAdcValue << 4U;
     mdPtr->adc[VLDA_ADC_IDX] = halfRange << MD_SHIFT; // half-range
+    mdat = RtdMetadata(md_block.data(), md_block.size()*sizeof(uint16_t));
     temperatureCalibration.setAdcValues(mdat, 0);
     LLogInfo(LLF(10,5) << tempAdcValue << LLF(10,5) << temperatureCalibration.getTempAdcValue() << LLF(10,5) <<
                   temperatureCalibration.getLaserThermRes() << LLF(10,5) << temperatureCalibration.getLaserTempCelsius() << LLF(10,5) << temperatureCalibration.getLaserTempRangeOffsetMm());
@@ -1169,6 +1337,70 @@ TEST_F(RawToDepthTests, raw_to_depth_tests_RangeTempCorrection)
 }
 
 
+/**
+ * @brief Checks that the range temperature correction is only recomputed when the ADC readings change (by more than
+ * the threshold), and that the cached and remembered results are those of a fresh computation.
+ */
+TEST_F(RawToDepthTests, temperature_calibration_caches_results)
+{
+  const uint32_t laserThermAdcIdx = 2; // M25
+  const uint32_t vldaAdcIdx = 6;
+  std::vector<uint16_t> md_block(RtdMetadata::DEFAULT_METADATA);
+  auto *mdPtr = (Metadata_t*)(md_block.data());
+  mdPtr->perFovMetadata[0].rtdAlgorithmCommon |= uint16_t(RTD_ALG_COMMON_ENABLE_TEMP_RANGE_ADJ << MD_SHIFT);
+  mdPtr->system_type = uint16_t(SYSTEM_TYPE_M25 << MD_SHIFT);
+  mdPtr->startStopFlags[0] = uint16_t((START_STOP_FLAG_FIRST_ROI | START_STOP_FLAG_FRAME_COMPLETED) << MD_SHIFT);
+  mdPtr->adc_cal_gain = uint16_t(210U << MD_SHIFT); // About 15V VLDA at 1500 codes.
+  mdPtr->range_cal_mm_per_celsius_lo_0807 = uint16_t(100U << MD_SHIFT);
+  mdPtr->range_cal_mm_per_celsius_lo_0908 = uint16_t(100U << MD_SHIFT);
+
+  // Runs one single-ROI frame through calibration, and returns the range offset.
+  auto runFrame = [&md_block, mdPtr](TemperatureCalibration &calibration, uint32_t laserTherm, uint32_t vlda)
+  {
+    mdPtr->adc[laserThermAdcIdx] = uint16_t(laserTherm << MD_SHIFT);
+    mdPtr->adc[vldaAdcIdx] = uint16_t(vlda << MD_SHIFT);
+    calibration.setAdcValues(RtdMetadata(md_block.data(), md_block.size()*sizeof(uint16_t)), 0);
+    return calibration.getRangeOffsetTemperature();
+  };
+  auto fresh = [&runFrame](uint32_t laserTherm, uint32_t vlda)
+  {
+    TemperatureCalibration calibration;
+    calibration.setTechnique(TemperatureCalibration::LATEST);
+    return runFrame(calibration, laserTherm, vlda);
+  };
+
+  TemperatureCalibration calibration;
+  calibration.setTechnique(TemperatureCalibration::LATEST);
+  const auto offset = runFrame(calibration, 1000, 1500);
+  ASSERT_NE(offset, 0.0F);
+  ASSERT_EQ(calibration.getNumComputes(), 1U);
+  for (uint32_t frameIdx = 0; frameIdx < 10; frameIdx++)
+  {
+    ASSERT_EQ(runFrame(calibration, 1000, 1500), offset);
+  }
+  ASSERT_EQ(calibration.getNumComputes(), 1U);
+
+  // A new reading is recomputed, and flickering back reuses the remembered temperature.
+  ASSERT_EQ(runFrame(calibration, 1001, 1500), fresh(1001, 1500));
+  ASSERT_EQ(runFrame(calibration, 1000, 1500), offset);
+  ASSERT_EQ(runFrame(calibration, 1000, 1510), fresh(1000, 1510));
+  ASSERT_EQ(calibration.getNumComputes(), 4U);
+
+  // Changes within the threshold keep the previous result.
+  calibration.setAdcChangeThreshold(2.0F);
+  ASSERT_EQ(runFrame(calibration, 1002, 1508), fresh(1000, 1510));
+  ASSERT_EQ(calibration.getNumComputes(), 4U);
+  ASSERT_EQ(runFrame(calibration, 1003, 1510), fresh(1003, 1510));
+  ASSERT_EQ(calibration.getNumComputes(), 5U);
+
+  // The median of the FIFO is only re-evaluated when a value in it changes.
+  TemperatureCalibration medianCalibration;
+  ASSERT_EQ(runFrame(medianCalibration, 1000, 1500), offset);
+  ASSERT_EQ(runFrame(medianCalibration, 1200, 1500), offset); // One outlier doesn't move the median.
+  ASSERT_EQ(medianCalibration.getNumComputes(), 1U);
+}
+
+
 static void pr(std::vector<float_t> &invec, std::vector<uint32_t> size)
 {
   std::ostringstream msg;
@@ -1263,176 +1495,2985 @@ TEST_F(RawToDepthTests, raw_to_depth_tests_FloatVectorPoolTests)
 }
 
 /**
- * @brief test the MAKEVECTOR macros. Features: 
- * 1. Creates a vector of the given size and type.
- * 2. Creating the same vector smaller does not result in realloc, just std::vector::resize()
- * 3. Creating the same vector larger does reallocate on the heap.
- * 4. Creating the same vector the same size does nothing.
- * 
+ * @brief Tests the FloatVectorPool size classes, counters and the cross-thread release path.
  */
-TEST_F(RawToDepthTests, raw_to_depth_tests_MAKEVECTOR_tests)
+TEST_F(RawToDepthTests, raw_to_depth_tests_FloatVectorPoolStatsTests)
 {
-  bool changed = false;
-  const int testVecSize = 51;
-  std::vector<float_t> vec; 
-  MAKE_VECTOR(vec, float_t, testVecSize);
-  ASSERT_EQ(vec.size(), testVecSize);
-  ASSERT_TRUE(changed);
-  changed = false;
-
-  auto v_val = reinterpret_cast<std::uintptr_t>(vec.data());
+  for (uint32_t size : {1U, 16U, 17U, 100U, 1024U, 1025U, 640U*480U*3U})
+  {
+    auto sizeClass = FloatVectorPool::getSizeClass(size);
+    ASSERT_LT(sizeClass, FloatVectorPool::NUM_SIZE_CLASSES);
+    ASSERT_GE(FloatVectorPool::getSizeClassCapacity(sizeClass), size);
+    ASSERT_LE(FloatVectorPool::getSizeClassCapacity(sizeClass), size + size / 4 + FloatVectorPool::MIN_CLASS_SIZE);
+  }
 
-  MAKE_VECTOR(vec, float_t, testVecSize);
-  ASSERT_EQ(vec.size(), testVecSize);
-  ASSERT_FALSE(changed);
+  FloatVectorPool::clear();
+  FloatVectorPool::resetStats();
 
-  auto v_val2 = reinterpret_cast<std::uintptr_t>(vec.data());
-  ASSERT_EQ(v_val, v_val2);
+  const uint32_t vecSize = 1000;
+  {
+    SCOPED_VEC_F(a_f, vecSize);
+    ASSERT_EQ(a_f.size(), vecSize);
+  }
+  {
+    // Same size class: reuses the vector without reallocation.
+    SCOPED_VEC_F(b_f, vecSize + 10);
+    ASSERT_EQ(b_f.size(), vecSize + 10);
+    SCOPED_VEC_F(c_f, vecSize);
+  }
+  auto stats = FloatVectorPool::getStats();
+  ASSERT_EQ(stats.misses, 2);
+  ASSERT_EQ(stats.hits, 1);
+  ASSERT_EQ(stats.highWaterBusy, 2);
+  ASSERT_EQ(stats.numVectors, 2);
+  ASSERT_EQ(stats.numBusy, 0);
+  ASSERT_GE(stats.highWaterBytes, 2 * (vecSize + 10) * sizeof(float_t));
+
+  // Vectors allocated on another thread and released here are returned to that thread.
+  std::shared_ptr<std::vector<float_t>> fromWorker;
+  std::thread([&fromWorker]() { fromWorker = FloatVectorPool::get(vecSize); }).join();
+  ASSERT_TRUE(FloatVectorPool::exists(fromWorker));
+  ASSERT_EQ(FloatVectorPool::numBusy(), 1);
+  FloatVectorPool::release(fromWorker);
+  ASSERT_EQ(FloatVectorPool::numBusy(), 0);
+  ASSERT_EQ(FloatVectorPool::getStats().crossThreadReleases, 1);
+  ASSERT_FALSE(FloatVectorPool::exists(fromWorker)); // The worker has exited, so the vector is freed.
 
-  const int newTestVecSize = 52;
-  MAKE_VECTOR(vec, float_t, newTestVecSize);
-  ASSERT_EQ(vec.size(), newTestVecSize);
-  ASSERT_TRUE(changed);
-  auto v_val3 = reinterpret_cast<std::uintptr_t>(vec.data());
-  // Note: v_val3 == v_val if the array is shrunk due to the use of resize.
-  ASSERT_NE(v_val, v_val3);
+  // A vector not belonging to the pool is rejected.
+  auto notPooled = std::make_shared<std::vector<float_t>>(vecSize);
+  ASSERT_FALSE(FloatVectorPool::exists(notPooled));
+  FloatVectorPool::release(notPooled);
+  ASSERT_EQ(FloatVectorPool::numBusy(), 0);
 
+  FloatVectorPool::clear();
+  ASSERT_EQ(FloatVectorPool::size(), 0);
 }
 
 /**
- * @brief Tests the use of the MAKEVECTOR2 macro, which allocates a pair of
- * std::vectors for storing two-component data.
- * 
+ * @brief Tests that FrameArena reuses its buffers, and that whole-frame processing makes no arena or
+ * FloatVectorPool allocations once the first frame of a given geometry has been processed.
  */
-TEST_F(RawToDepthTests, raw_to_depth_tests_MAKEVECTOR2_tests)
+TEST_F(RawToDepthTests, frame_arena_steady_state_no_allocations)
 {
-  bool changed = false;
-  const int testVecSize = 97;
-  std::vector<std::vector<float_t>> vec;
-  MAKE_VECTOR2(vec, float_t, testVecSize);
+  {
+    FrameArena arena;
+    arena.reserve({100, 200});
+    ASSERT_EQ(arena.getNumHeapAllocations(), 2);
+    for (auto frameIdx = 0; frameIdx < 3; frameIdx++)
+    {
+      arena.reset();
+      auto &buf0 = arena.alloc(100);
+      auto &buf1 = arena.alloc(150);
+      ASSERT_EQ(buf0.size(), 100);
+      ASSERT_EQ(buf1.size(), 150);
+      ASSERT_NE(buf0.data(), buf1.data());
+    }
+    ASSERT_EQ(arena.getNumHeapAllocations(), 2);
+    arena.alloc(10); // A third buffer was not reserved.
+    ASSERT_EQ(arena.getNumHeapAllocations(), 3);
+    ASSERT_EQ(arena.getNumBuffers(), 3);
+  }
 
-  ASSERT_EQ(vec.size(), 2);
-  ASSERT_EQ(vec[0].size(), testVecSize);
-  ASSERT_EQ(vec[1].size(), testVecSize);
+  const uint32_t numRois = 10;
+  const uint32_t roiRows = 8;
+  const uint32_t binning = 2;
+  const uint32_t numFrames = 4;
+  std::vector<std::vector<std::vector<uint16_t>>> frames(numFrames);
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      frames[frameIdx].push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+    }
+  }
 
-  auto v_val_0 = reinterpret_cast<std::uintptr_t>(vec.data());
-  auto v_val_1 = reinterpret_cast<std::uintptr_t>(vec[0].data());
-  auto v_val_2 = reinterpret_cast<std::uintptr_t>(vec[1].data());
-  
-  MAKE_VECTOR2(vec, float_t, testVecSize);
-  ASSERT_EQ(vec.size(), 2);
-  ASSERT_EQ(vec[0].size(), testVecSize);
-  ASSERT_EQ(vec[1].size(), testVecSize);
+  RawToFovs rtf;
+  ASSERT_NE(processSyntheticGridFrame(rtf, frames[0]), nullptr);
+  const auto arenaAllocations = FrameArena::getTotalHeapAllocations();
+  const auto poolMisses = FloatVectorPool::getStats().misses;
+  ASSERT_GT(arenaAllocations, 0);
 
-  auto v_val1_0 = reinterpret_cast<std::uintptr_t>(vec.data());
-  auto v_val1_1 = reinterpret_cast<std::uintptr_t>(vec[0].data());
-  auto v_val1_2 = reinterpret_cast<std::uintptr_t>(vec[1].data());
+  for (uint32_t frameIdx = 1; frameIdx < numFrames; frameIdx++)
+  {
+    auto fov = processSyntheticGridFrame(rtf, frames[frameIdx]);
+    ASSERT_NE(fov, nullptr);
+    ASSERT_EQ(fov->getImageSize()[0], numRois * roiRows / binning);
+  }
+  ASSERT_EQ(FrameArena::getTotalHeapAllocations(), arenaAllocations);
+  ASSERT_EQ(FloatVectorPool::getStats().misses, poolMisses);
+  rtf.shutdown();
+}
 
-  // Test that reallocating the same variable name and size results in the same underlying pointer.
-  ASSERT_EQ(v_val_0, v_val1_0);
-  ASSERT_EQ(v_val_1, v_val1_1);
-  ASSERT_EQ(v_val_2, v_val1_2);
+/**
+ * @brief Tests that once an FOV has seen two geometries, switching between them, as a random-access scan table does,
+ * allocates no new frame arena buffers or pooled vectors.
+ */
+TEST_F(RawToDepthTests, geometry_switch_reuses_buffers)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t binning = 2;
+  const std::array<uint32_t,2> numRois = { 6, 10 };
+  const uint32_t numWarmupFrames = 3; // The first frame of the second geometry empties the pool, which the third refills.
+  const uint32_t numFrames = 8;
+  std::vector<std::vector<std::vector<uint16_t>>> frames(numFrames);
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois[frameIdx % 2]; roiIdx++)
+    {
+      frames[frameIdx].push_back(makeSyntheticGridRoi(roiIdx, numRois[frameIdx % 2], roiRows, binning, frameIdx));
+    }
+  }
 
-  const int newTestVecSize = testVecSize*7;
-  MAKE_VECTOR2(vec, float_t, newTestVecSize);
-  ASSERT_EQ(vec.size(), 2);
-  ASSERT_EQ(vec[0].size(), newTestVecSize);
-  ASSERT_EQ(vec[1].size(), newTestVecSize);
+  RawToFovs rtf;
+  for (uint32_t frameIdx = 0; frameIdx < numWarmupFrames; frameIdx++)
+  {
+    ASSERT_NE(processSyntheticGridFrame(rtf, frames[frameIdx]), nullptr);
+  }
+  const auto arenaAllocations = FrameArena::getTotalHeapAllocations();
+  const auto poolMisses = FloatVectorPool::getStats().misses;
 
-  auto v_val2_0 = reinterpret_cast<std::uintptr_t>(vec.data());
-  auto v_val2_1 = reinterpret_cast<std::uintptr_t>(vec[0].data());
-  auto v_val2_2 = reinterpret_cast<std::uintptr_t>(vec[1].data());
+  for (uint32_t frameIdx = numWarmupFrames; frameIdx < numFrames; frameIdx++)
+  {
+    auto fov = processSyntheticGridFrame(rtf, frames[frameIdx]);
+    ASSERT_NE(fov, nullptr);
+    ASSERT_EQ(fov->getImageSize()[0], numRois[frameIdx % 2] * roiRows / binning);
+  }
+  ASSERT_EQ(FrameArena::getTotalHeapAllocations(), arenaAllocations);
+  ASSERT_EQ(FloatVectorPool::getStats().misses, poolMisses);
+  rtf.shutdown();
+}
 
-  ASSERT_EQ(v_val_0, v_val2_0); // still 2-component data.
-  // Reallocating the variable with a larger size results in a new
-  // underlying pointer.
-  ASSERT_NE(v_val_1, v_val2_1); 
-  ASSERT_NE(v_val_2, v_val2_2);
+/**
+ * @brief Tests that restarting the frames mid-frame, as a scan configuration change without stopping the stream does,
+ * drops the rest of the interrupted frame, and that the FOV picks up again at the first ROI of the next frame.
+ */
+TEST_F(RawToDepthTests, restart_frames_drops_interrupted_frame)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t binning = 2;
+  const std::array<uint32_t,2> numRois = { 10, 6 };
+  std::array<std::vector<std::vector<uint16_t>>,2> frames;
+  for (uint32_t frameIdx = 0; frameIdx < frames.size(); frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois[frameIdx]; roiIdx++)
+    {
+      frames[frameIdx].push_back(makeSyntheticGridRoi(roiIdx, numRois[frameIdx], roiRows, binning, frameIdx));
+    }
+  }
+
+  RawToFovs rtf;
+  ASSERT_EQ(rtf.restartFrames(), 0U); // Nothing was received yet.
+  const auto half = frames[0].size() / 2;
+  for (std::size_t roiIdx = 0; roiIdx < half; roiIdx++)
+  {
+    rtf.processRoi(frames[0][roiIdx].data(), frames[0][roiIdx].size()*sizeof(uint16_t));
+  }
+  ASSERT_EQ(rtf.restartFrames(), 1U);
+  ASSERT_EQ(rtf.restartFrames(), 0U); // Already at a frame boundary.
+
+  // The rest of the interrupted frame, including the ROI that would have completed it, is ignored.
+  for (std::size_t roiIdx = half; roiIdx < frames[0].size(); roiIdx++)
+  {
+    rtf.processRoi(frames[0][roiIdx].data(), frames[0][roiIdx].size()*sizeof(uint16_t));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ASSERT_TRUE(rtf.fovsAvailable().empty());
 
+  auto fov = processSyntheticGridFrame(rtf, frames[1]);
+  ASSERT_NE(fov, nullptr);
+  ASSERT_EQ(fov->getImageSize()[0], numRois[1] * roiRows / binning);
+  rtf.shutdown();
 }
 
 /**
- * @brief This verifies that the fast and slow versions of smoothing produce
- * identical results.
- * 
- * The slow version of the code is general-purpose (for any kernel size).
- * The fast version of the code is specialized for a specific kernel size.
- * 
+ * @brief Tests that the sized pools get what they want while it fits into the memory budget, and less but at least
+ * their minimum once it doesn't, that the elastic pools only get what the sized pools leave, and that released
+ * grants give the memory back.
  */
-TEST_F(RawToDepthTests, raw_to_depth_tests_SmoothingTest)
+TEST_F(RawToDepthTests, memory_budget_shares_and_elastic)
 {
-  const static float_t dataRange = 99.0F;
-  const std::size_t width = 320;
-  const std::size_t height = 240;
-  auto inputData = std::vector<float_t>(width*height*3UL, 0.0F);
-  for (auto idx=0; idx<inputData.size(); idx++)
+  const uint64_t mib = 1U << 20U;
+  MemoryBudget::configure(0);
   {
-    float_t val = roundf(dataRange * float_t(std::rand()) / float_t(RAND_MAX));
-    inputData.at(idx) = val;
+    auto grant = MemoryBudget::request(MEMORY_POOL_V4L_BUFFERS, 2 * mib, 1024 * mib, "unlimited");
+    ASSERT_EQ(grant.bytes(), 1024 * mib);
+    ASSERT_TRUE(MemoryBudget::tryAccount(MEMORY_POOL_NET_FOVS, 1024 * mib));
+    MemoryBudget::account(MEMORY_POOL_NET_FOVS, -int64_t(1024 * mib));
   }
 
-  auto outputData_fast = std::vector<float_t>(inputData.size());
-  RawToDepthDsp::smoothSummedData(inputData, outputData_fast, {height,width}, 2, 3, true);
-
-  auto outputData_good = std::vector<float_t>(inputData.size());
-  RawToDepthDsp::smoothSummedData(inputData, outputData_good, {height,width}, 2, 3, false);
+  // What the other tests left to the sized pools fits, with 40 MiB to spare
+  uint64_t sized = 0;
+  uint64_t elastic = 0;
+  for (auto pool : { MEMORY_POOL_V4L_BUFFERS, MEMORY_POOL_RECORDERS, MEMORY_POOL_MAPPING_TABLES })
+  {
+    sized += MemoryBudget::getStats(pool).usedBytes;
+  }
+  for (auto pool : { MEMORY_POOL_FLOAT_VECTORS, MEMORY_POOL_NET_FOVS })
+  {
+    elastic += MemoryBudget::getStats(pool).usedBytes;
+  }
+  MemoryBudget::configure(sized + 40 * mib);
+  const auto refusals = MemoryBudget::getStats(MEMORY_POOL_RECORDERS).refusals;
+  {
+    auto buffers = MemoryBudget::request(MEMORY_POOL_V4L_BUFFERS, 4 * mib, 32 * mib, "fits");
+    ASSERT_EQ(buffers.bytes(), 32 * mib);
+    auto batches = MemoryBudget::request(MEMORY_POOL_RECORDERS, 4 * mib, 16 * mib, "doesn't fit");
+    ASSERT_GE(batches.bytes(), 4 * mib);
+    ASSERT_LT(batches.bytes(), 16 * mib);
+    ASSERT_EQ(MemoryBudget::getStats(MEMORY_POOL_RECORDERS).refusals, refusals + 1);
+    auto tooMuch = MemoryBudget::request(MEMORY_POOL_RECORDERS, 64 * mib, 64 * mib, "minimum");
+    ASSERT_EQ(tooMuch.bytes(), 64 * mib);
+
+    // Nothing is left for the elastic pools
+    ASSERT_FALSE(MemoryBudget::tryAccount(MEMORY_POOL_NET_FOVS, mib));
+    MemoryBudget::account(MEMORY_POOL_NET_FOVS, int64_t(mib));
+    ASSERT_TRUE(MemoryBudget::elasticOverBudget());
+    MemoryBudget::account(MEMORY_POOL_NET_FOVS, -int64_t(mib));
+
+    auto moved = std::move(tooMuch);
+    ASSERT_EQ(tooMuch.bytes(), 0);
+    ASSERT_EQ(moved.bytes(), 64 * mib);
+  }
+  MemoryBudget::configure(sized + elastic + 40 * mib);
+  ASSERT_FALSE(MemoryBudget::elasticOverBudget());
+  ASSERT_TRUE(MemoryBudget::tryAccount(MEMORY_POOL_NET_FOVS, mib));
+  MemoryBudget::account(MEMORY_POOL_NET_FOVS, -int64_t(mib));
+
+  const auto report = MemoryBudget::getReport();
+  for (const auto *field : { "memoryBudgetBytes=", "memory_pool:name=floatVectors,", "memory_pool:name=v4lBuffers,shareBytes=",
+                             ",highWaterBytes=", ",refusals=" })
+  {
+    ASSERT_NE(report.find(field), std::string::npos) << report;
+  }
+  MemoryBudget::configure(0);
+}
 
-  for (auto idx=0; idx<outputData_fast.size(); idx++)
+/**
+ * @brief Tests that HugePages hands out zeroed, writable buffers in every mode, whether or not the machine has huge
+ * pages to give, that only the 2 MiB-aligned interiors of heap buffers are advised, and that the report has all fields.
+ */
+TEST_F(RawToDepthTests, huge_pages_fallback_and_report)
+{
+  const auto before = HugePages::getStats();
+  for (auto mode : { HugePages::Mode::OFF, HugePages::Mode::TRANSPARENT, HugePages::Mode::EXPLICIT })
   {
-    if (outputData_fast.at(idx) != outputData_good.at(idx))
+    std::size_t bytes = 3 * HugePages::HUGE_PAGE_SIZE + 100;
+    auto *data = (uint8_t *)HugePages::allocate(bytes, mode, true);
+    ASSERT_NE(data, nullptr);
+    ASSERT_GE(bytes, 3 * HugePages::HUGE_PAGE_SIZE + 100);
+    if (mode != HugePages::Mode::OFF)
     {
-      LLogErr("Mismatch in smoothing at idx " << idx << " with values " <<  outputData_fast.at(idx) << outputData_good.at(idx));
+      ASSERT_EQ(bytes % HugePages::HUGE_PAGE_SIZE, 0);
+      ASSERT_EQ(std::size_t(data) % HugePages::HUGE_PAGE_SIZE, 0);
     }
+    ASSERT_EQ(data[0], 0);
+    ASSERT_EQ(data[bytes - 1], 0);
+    data[bytes - 1] = 1;
+    HugePages::release(data, bytes);
   }
-
+  const auto after = HugePages::getStats();
+  ASSERT_GT(after.explicitBytes + after.transparentBytes + after.regularBytes,
+            before.explicitBytes + before.transparentBytes + before.regularBytes);
+
+  std::vector<float_t> small(1000);
+  std::vector<float_t> large(5 * HugePages::HUGE_PAGE_SIZE / sizeof(float_t));
+  HugePages::configure(HugePages::Mode::OFF);
+  HugePages::advise(large);
+  ASSERT_EQ(HugePages::getStats().advisedBytes, after.advisedBytes);
+  HugePages::configure(HugePages::Mode::TRANSPARENT);
+  HugePages::advise(small);
+  ASSERT_EQ(HugePages::getStats().advisedBytes, after.advisedBytes);
+  HugePages::advise(large);
+  const auto advised = HugePages::getStats().advisedBytes - after.advisedBytes;
+  ASSERT_EQ(advised % HugePages::HUGE_PAGE_SIZE, 0);
+  ASSERT_LE(advised, large.size() * sizeof(float_t));
+  HugePages::configure(HugePages::Mode::OFF);
+
+  auto planes = HugePages::allocateShared(100);
+  ASSERT_NE(planes, nullptr);
+
+  const auto report = HugePages::getReport();
+  for (const auto *field : { "hugePageMode=off,", ",hugePageAdvisedBytes=", ",rssBytes=", ",anonHugeBytes=", ",dtlbMisses=" })
+  {
+    ASSERT_NE(report.find(field), std::string::npos) << report;
+  }
+  ASSERT_EQ(report.find("rssBytes=-1"), std::string::npos) << report;
+  HugePages::Mode mode = HugePages::Mode::OFF;
+  ASSERT_TRUE(HugePages::parseMode("explicit", mode));
+  ASSERT_EQ(mode, HugePages::Mode::EXPLICIT);
+  ASSERT_FALSE(HugePages::parseMode("always", mode));
 }
 
-TEST_F(RawToDepthTests, snr_weights_test)
+/**
+ * @brief Tests that a consumer polling fovsAvailable() and getData() on its own thread while the ingest thread streams
+ * frames without waiting receives the FOVs in order, ending with the last one, and that a reload of the calibration
+ * data between frames flags the first FOV delivered with the new mapping table.
+ */
+TEST_F(RawToDepthTests, fov_delivery_concurrent_with_ingest)
 {
-  const std::vector<float_t> rawRoi {1, 2, 3, 4, 5, 6, 7, 8, 9, 10,11,12,
-                                     11,12,13,14,15,16,17,18,19,20,21,22,
-                                     21,22,23,24,25,26,27,28,29,30,31,32,
-                                     31,32,33,34,35,36,37,38,39,40,41,42};
-
-  std::vector<float_t> snrWeights(rawRoi.size());
-
-  const uint32_t roiWidth {4};
-  const uint32_t roiHeight {4};
-  float_t snrWeightsNumberOfSums;
-  RawToDepthDsp::computeSnrSquaredWeights(rawRoi, rawRoi, snrWeights, snrWeightsNumberOfSums, roiHeight, roiWidth);
+  const uint32_t numRois = 10;
+  const uint32_t roiRows = 8;
+  const uint32_t binning = 2;
+  const uint32_t numFrames = 32;
+  std::vector<std::vector<std::vector<uint16_t>>> frames(numFrames);
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      frames[frameIdx].push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+    }
+  }
 
-  // Verify that the columns are normalized.
-  for (auto colIdx=0; colIdx<NUM_GPIXEL_PHASES*roiWidth; colIdx++)
+  RawToFovs rtf;
+  std::vector<uint16_t> userTags;
+  std::vector<bool> newMappingTables;
+  std::thread consumer([&]()
   {
-    float_t columnMax = 0.0F;
-    for (auto rowIdx=0; rowIdx<roiHeight; rowIdx++)
+    const auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while ((userTags.empty() || userTags.back() != numFrames - 1) && std::chrono::steady_clock::now() < timeout)
     {
-      auto val = snrWeights[colIdx + roiWidth*NUM_GPIXEL_PHASES*rowIdx];
-      if (columnMax < val) 
+      for (auto fovIdx : rtf.fovsAvailable())
       {
-        columnMax = val;
+        auto fov = rtf.getData(fovIdx);
+        if (fov != nullptr)
+        {
+          userTags.push_back(fov->getUserTag());
+          newMappingTables.push_back(fov->isNewMappingTableAvailable());
+        }
       }
+      std::this_thread::sleep_for(std::chrono::microseconds(10));
+    }
+  });
+
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    if (frameIdx == numFrames / 2)
+    {
+      rtf.reloadCalibrationData("", "");
+    }
+    for (const auto &roi : frames[frameIdx])
+    {
+      rtf.processRoi(roi.data(), roi.size()*sizeof(uint16_t));
     }
-    ASSERT_TRUE(fabs(1.0F-columnMax) < 1.0e-7);
   }
-}
+  consumer.join();
+  rtf.shutdown();
 
+  ASSERT_FALSE(userTags.empty());
+  ASSERT_EQ(userTags.back(), numFrames - 1);
+  ASSERT_TRUE(std::is_sorted(userTags.begin(), userTags.end()));
+  ASSERT_EQ(std::adjacent_find(userTags.begin(), userTags.end()), userTags.end());
+  // Frames can be overwritten before the consumer gets to them, but the first one with the new table is flagged.
+  ASSERT_EQ(std::count(newMappingTables.begin(), newMappingTables.end(), true), 1);
+  ASSERT_GE(userTags[std::find(newMappingTables.begin(), newMappingTables.end(), true) - newMappingTables.begin()], numFrames / 2);
+}
 
-TEST_F(RawToDepthTests, test_median_1d)
+/**
+ * @brief Tests that an asynchronous calibration reload keeps the stream going while the files load, and that the new
+ * pixel mask and mapping table take effect together at an FOV boundary.
+ */
+TEST_F(RawToDepthTests, async_calibration_reload_swaps_at_fov_boundary)
 {
-  const std::vector<float_t> avec {20033,20085,20153,20200,20264,20317,147,135,70,33059,107,41,21,137};
-  std::vector<float_t> bvec(avec.size());
-  RawToDepthDsp::median1d(avec, bvec, 2);
-
-  for (auto idx=0; idx<avec.size(); idx++)
+  const uint32_t numRois = 10;
+  const uint32_t roiRows = 8;
+  const uint32_t binning = 2;
+  const uint32_t maxFrames = 200;
+  std::vector<std::vector<uint16_t>> rois;
+  for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
   {
-    auto aval = avec[idx];
-    auto bval = bvec[idx];
-    LLogInfo("a " << aval << " b " << bval);
+    rois.push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, 0));
   }
-}
 
-TEST_F(RawToDepthTests, test_lumotimers)
+  // A pixel mask that disables every pixel.
+  const auto maskFilepath = (std::filesystem::temp_directory_path() / "rtd_async_reload_pixel_mask.bin").string();
+  {
+    std::vector<uint16_t> mask(IMAGE_WIDTH * MAX_IMAGE_HEIGHT, 0);
+    std::ofstream maskFile(maskFilepath, std::ios::binary);
+    maskFile.write((const char *)mask.data(), std::streamsize(mask.size() * sizeof(uint16_t)));
+  }
+  auto isMasked = [](const std::shared_ptr<FovSegment> &fov)
+  {
+    const auto &range = *fov->getRange();
+    return std::all_of(range.begin(), range.end(), [](uint16_t value) { return value == 0; });
+  };
+
+  RawToFovs rtf;
+  rtf.reloadCalibrationDataAsync("nonexistent_mapping_table.bin", "nonexistent_pixel_mask.bin"); // The first is synchronous.
+  auto fov = processSyntheticGridFrame(rtf, rois);
+  ASSERT_NE(fov, nullptr);
+  ASSERT_TRUE(fov->isNewMappingTableAvailable());
+  ASSERT_FALSE(isMasked(fov));
+
+  rtf.reloadCalibrationDataAsync("nonexistent_mapping_table.bin", maskFilepath);
+  for (uint32_t frameIdx = 0; frameIdx < maxFrames && !isMasked(fov); frameIdx++)
+  {
+    fov = processSyntheticGridFrame(rtf, rois);
+    ASSERT_NE(fov, nullptr);
+    if (!isMasked(fov))
+    {
+      ASSERT_FALSE(fov->isNewMappingTableAvailable());
+    }
+  }
+  ASSERT_TRUE(isMasked(fov));
+  ASSERT_TRUE(fov->isNewMappingTableAvailable()); // The first FOV with the new mask carries the new table.
+
+  fov = processSyntheticGridFrame(rtf, rois);
+  ASSERT_NE(fov, nullptr);
+  ASSERT_TRUE(isMasked(fov));
+  ASSERT_FALSE(fov->isNewMappingTableAvailable());
+  rtf.shutdown();
+  std::filesystem::remove(maskFilepath);
+}
+
+/**
+ * @brief Tests that the output planes of the FOV segments return to their pool when the consumer releases them,
+ * including after the pool is gone, and that whole-frame processing reuses them from frame to frame.
+ */
+TEST_F(RawToDepthTests, fov_planes_recycled)
+{
+  {
+    auto pool = std::make_unique<FovPlanesPool>();
+    auto planes = pool->get();
+    planes->range.resize(100);
+    const auto *rangeData = planes->range.data();
+    auto range = FovPlanes::plane(planes, &FovPlanes::range);
+    planes.reset();
+    ASSERT_EQ(pool->getNumFree(), 0);
+    range.reset(); // The last alias releases the block.
+    ASSERT_EQ(pool->getNumFree(), 1);
+
+    planes = pool->get();
+    ASSERT_EQ(planes->range.data(), rangeData);
+    ASSERT_EQ(pool->getNumAllocations(), 1);
+    pool.reset();
+    planes.reset(); // Freed rather than returned to the destroyed pool.
+  }
+
+  const uint32_t numRois = 10;
+  const uint32_t roiRows = 8;
+  const uint32_t binning = 2;
+  const uint32_t numFrames = 4;
+  RawToFovs rtf;
+  std::shared_ptr<FovSegment> previous;
+  uint64_t allocations = 0;
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    std::vector<std::vector<uint16_t>> rois;
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      rois.push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+    }
+    auto fov = processSyntheticGridFrame(rtf, rois);
+    ASSERT_NE(fov, nullptr);
+    ASSERT_EQ(fov->getRange()->size(), std::size_t(fov->getImageSize()[0]) * fov->getImageSize()[1]);
+    const auto &roiIndexRows = *fov->getRoiIndexRows();
+    ASSERT_EQ(roiIndexRows.size(), fov->getImageSize()[0]);
+    for (std::size_t row = 0; row < roiIndexRows.size(); row++)
+    {
+      ASSERT_EQ(roiIndexRows[row], row * binning / roiRows); // The ROIs arrive down the FOV.
+    }
+    ASSERT_EQ(fov->getTimestampsVec()->size(), numRois);
+    if (previous)
+    {
+      ASSERT_NE(fov->getRange()->data(), previous->getRange()->data()); // Still held by the consumer.
+    }
+    if (frameIdx == 1)
+    {
+      allocations = FovPlanesPool::getTotalAllocations();
+      ASSERT_GT(allocations, 0);
+    }
+    previous = fov;
+  }
+  ASSERT_EQ(FovPlanesPool::getTotalAllocations(), allocations);
+  rtf.shutdown();
+}
+
+/**
+ * @brief Tests that only the output planes selected by the transmitBitmask of the FOV's metadata are output, and that
+ * the range is always output, unchanged.
+ */
+TEST_F(RawToDepthTests, output_planes_selected_by_metadata)
+{
+  const uint32_t numRois = 10;
+  const uint32_t roiRows = 8;
+  const uint32_t binning = 2;
+  std::vector<std::vector<uint16_t>> frame;
+  for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+  {
+    frame.push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, 0));
+  }
+
+  // Processes the same frame each time.
+  auto processFrame = [&frame](uint16_t transmitBitmask)
+  {
+    auto rois = frame;
+    for (auto &roi : rois)
+    {
+      ((Metadata_t*)roi.data())->perFovMetadata[0].transmitBitmask = uint16_t(transmitBitmask << MD_SHIFT);
+    }
+    RawToFovs rtf;
+    auto fov = processSyntheticGridFrame(rtf, rois);
+    rtf.shutdown();
+    return fov;
+  };
+
+  auto all = processFrame(0);
+  ASSERT_NE(all, nullptr);
+  ASSERT_NE(all->getSnr(), nullptr);
+  ASSERT_NE(all->getSignal(), nullptr);
+  ASSERT_NE(all->getBackground(), nullptr);
+
+  auto rangeOnly = processFrame(TRANSMIT_BITMASK_RANGE);
+  ASSERT_NE(rangeOnly, nullptr);
+  ASSERT_EQ(*rangeOnly->getRange(), *all->getRange());
+  ASSERT_EQ(rangeOnly->getSnr(), nullptr);
+  ASSERT_EQ(rangeOnly->getSignal(), nullptr);
+  ASSERT_EQ(rangeOnly->getBackground(), nullptr);
+  ASSERT_NE(rangeOnly->getRoiIndexRows(), nullptr);
+
+  auto signalOnly = processFrame(TRANSMIT_BITMASK_SIGNAL); // The range is implied.
+  ASSERT_NE(signalOnly, nullptr);
+  ASSERT_EQ(*signalOnly->getRange(), *all->getRange());
+  ASSERT_EQ(*signalOnly->getSignal(), *all->getSignal());
+  ASSERT_EQ(signalOnly->getSnr(), nullptr);
+  ASSERT_EQ(signalOnly->getBackground(), nullptr);
+}
+
+/**
+ * @brief Compares banded (tiled) whole-frame processing against processing the whole frame as one band,
+ * and logs the average per-frame wall time of each at full height and 640 columns.
+ */
+TEST_F(RawToDepthTests, tiled_whole_frame_matches_untiled)
+{
+  const auto simdLevel = RawToDepthSimd::getLevel();
+  const auto tileRows = RawToDepthV2_float::getTileRows();
+  // The SIMD kernels leave a scalar remainder whose position depends on the band height.
+  RawToDepthSimd::setLevel(RawToDepthSimd::Level::SCALAR);
+
+  const uint32_t roiRows = 8;
+  const uint32_t numFrames = 6;
+  for (uint32_t binning : {1U, 2U})
+  {
+    const uint32_t numRois = MAX_IMAGE_HEIGHT / roiRows;
+    std::vector<std::vector<std::vector<uint16_t>>> frames(numFrames);
+    for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+    {
+      for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+      {
+        frames[frameIdx].push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+      }
+    }
+
+    std::vector<std::shared_ptr<FovSegment>> outputs;
+    for (uint32_t modeTileRows : {0U, RawToDepthV2_float::MIN_TILE_ROWS, RawToDepthV2_float::DEFAULT_TILE_ROWS})
+    {
+      RawToDepthV2_float::setTileRows(modeTileRows);
+      RawToFovs rtf;
+      ASSERT_NE(processSyntheticGridFrame(rtf, frames[0]), nullptr); // Sizes the buffers.
+
+      std::shared_ptr<FovSegment> fov;
+      double totalMs = 0;
+      for (uint32_t frameIdx = 1; frameIdx < numFrames; frameIdx++)
+      {
+        double wholeFrameMs = 0;
+        fov = processSyntheticGridFrame(rtf, frames[frameIdx], &wholeFrameMs);
+        ASSERT_NE(fov, nullptr);
+        totalMs += wholeFrameMs;
+      }
+      rtf.shutdown();
+      LLogInfo("binning " << binning << " tileRows " << modeTileRows << " size " << fov->getImageSize()[0] << "x" << fov->getImageSize()[1]
+               << ": whole-frame processing " << totalMs / (numFrames - 1) << " ms");
+      outputs.push_back(fov);
+    }
+
+    for (const auto &fov : outputs)
+    {
+      ASSERT_EQ(*fov->getRange(), *outputs[0]->getRange());
+      ASSERT_EQ(*fov->getSnr(), *outputs[0]->getSnr());
+      ASSERT_EQ(*fov->getSignal(), *outputs[0]->getSignal());
+      ASSERT_EQ(*fov->getBackground(), *outputs[0]->getBackground());
+    }
+  }
+
+  RawToDepthV2_float::setTileRows(tileRows);
+  RawToDepthSimd::setLevel(simdLevel);
+}
+
+/**
+ * @brief Scans one ROI in every few of a full-height FOV, and compares the output of skipping the rows that no ROI
+ * covered against processing all of them, banded and untiled. Logs the average per-frame wall time of each.
+ */
+TEST_F(RawToDepthTests, sparse_scan_skips_inactive_rows)
+{
+  const auto simdLevel = RawToDepthSimd::getLevel();
+  const auto tileRows = RawToDepthV2_float::getTileRows();
+  // The SIMD kernels leave a scalar remainder whose position depends on the band height.
+  RawToDepthSimd::setLevel(RawToDepthSimd::Level::SCALAR);
+
+  const uint32_t roiRows = 8;
+  const uint32_t roiSpacing = 10; // One ROI in every roiSpacing is scanned.
+  const uint32_t numRois = MAX_IMAGE_HEIGHT / (roiRows * roiSpacing);
+  const uint32_t numFrames = 4;
+  auto md = [](uint32_t val) { return uint16_t(val << MD_SHIFT); };
+  std::vector<std::vector<std::vector<uint16_t>>> frames(numFrames);
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      auto roi = makeSyntheticGridRoi(roiIdx, numRois, roiRows, 2, frameIdx);
+      auto *mdat = (Metadata_t*)roi.data();
+      mdat->roiStartRow = md(roiIdx * roiRows * roiSpacing);
+      mdat->perFovMetadata[0].fovNumRows = md(numRois * roiRows * roiSpacing);
+      frames[frameIdx].push_back(roi);
+    }
+  }
+
+  for (uint32_t modeTileRows : {0U, RawToDepthV2_float::DEFAULT_TILE_ROWS})
+  {
+    RawToDepthV2_float::setTileRows(modeTileRows);
+    std::vector<std::shared_ptr<FovSegment>> outputs;
+    for (bool skip : {false, true})
+    {
+      RawToDepthV2_float::setSkipInactiveRows(skip);
+      RawToFovs rtf;
+      ASSERT_NE(processSyntheticGridFrame(rtf, frames[0]), nullptr); // Sizes the buffers.
+
+      std::shared_ptr<FovSegment> fov;
+      double totalMs = 0;
+      for (uint32_t frameIdx = 1; frameIdx < numFrames; frameIdx++)
+      {
+        double wholeFrameMs = 0;
+        fov = processSyntheticGridFrame(rtf, frames[frameIdx], &wholeFrameMs);
+        ASSERT_NE(fov, nullptr);
+        totalMs += wholeFrameMs;
+      }
+      rtf.shutdown();
+      LLogInfo("tileRows " << modeTileRows << " skipInactiveRows " << skip << " size " << fov->getImageSize()[0] << "x"
+               << fov->getImageSize()[1] << ": whole-frame processing " << totalMs / (numFrames - 1) << " ms");
+      outputs.push_back(fov);
+    }
+
+    const auto &range = *outputs[0]->getRange();
+    ASSERT_EQ(outputs[0]->getImageSize()[0], numRois * roiRows * roiSpacing / 2);
+    ASSERT_TRUE(std::any_of(range.begin(), range.end(), [](auto value) { return value != 0; }));
+    ASSERT_EQ(*outputs[1]->getRange(), range);
+    ASSERT_EQ(*outputs[1]->getSnr(), *outputs[0]->getSnr());
+    ASSERT_EQ(*outputs[1]->getSignal(), *outputs[0]->getSignal());
+    ASSERT_EQ(*outputs[1]->getBackground(), *outputs[0]->getBackground());
+  }
+
+  RawToDepthV2_float::setSkipInactiveRows(true);
+  RawToDepthV2_float::setTileRows(tileRows);
+  RawToDepthSimd::setLevel(simdLevel);
+}
+
+/**
+ * @brief Verifies that processing the bands of a whole frame in parallel gives the same output as processing them
+ * serially. The band heights don't depend on the number of workers, so the output is identical. The same holds for
+ * whole frames processed on the shared scheduler (the last mode), where the bands of each frame run serially.
+ */
+TEST_F(RawToDepthTests, parallel_whole_frame_matches_serial)
+{
+  const auto numWorkers = RawToDepthV2_float::getNumWorkers();
+  const auto schedulerThreads = RawToDepthV2_float::getSchedulerThreads();
+  const uint32_t roiRows = 8;
+  const uint32_t numFrames = 6;
+  const uint32_t binning = 1;
+  const uint32_t numRois = MAX_IMAGE_HEIGHT / roiRows;
+  std::vector<std::vector<std::vector<uint16_t>>> frames(numFrames);
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      frames[frameIdx].push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+    }
+  }
+
+  std::vector<std::shared_ptr<FovSegment>> outputs;
+  for (uint32_t modeWorkers : {1U, 2U, 4U, 0U})
+  {
+    RawToDepthV2_float::setNumWorkers(std::max(modeWorkers, 1U));
+    RawToDepthV2_float::setSchedulerThreads(modeWorkers == 0 ? 2 : 0);
+    RawToFovs rtf;
+    ASSERT_NE(processSyntheticGridFrame(rtf, frames[0]), nullptr); // Sizes the buffers.
+
+    std::shared_ptr<FovSegment> fov;
+    double totalMs = 0;
+    for (uint32_t frameIdx = 1; frameIdx < numFrames; frameIdx++)
+    {
+      double wholeFrameMs = 0;
+      fov = processSyntheticGridFrame(rtf, frames[frameIdx], &wholeFrameMs);
+      ASSERT_NE(fov, nullptr);
+      totalMs += wholeFrameMs;
+    }
+    rtf.shutdown();
+    LLogInfo("workers " << modeWorkers << " size " << fov->getImageSize()[0] << "x" << fov->getImageSize()[1]
+             << ": whole-frame processing " << totalMs / (numFrames - 1) << " ms");
+    outputs.push_back(fov);
+  }
+
+  for (const auto &fov : outputs)
+  {
+    ASSERT_EQ(*fov->getRange(), *outputs[0]->getRange());
+    ASSERT_EQ(*fov->getSnr(), *outputs[0]->getSnr());
+    ASSERT_EQ(*fov->getSignal(), *outputs[0]->getSignal());
+    ASSERT_EQ(*fov->getBackground(), *outputs[0]->getBackground());
+  }
+
+  RawToDepthV2_float::setNumWorkers(numWorkers);
+  RawToDepthV2_float::setSchedulerThreads(schedulerThreads);
+}
+
+/**
+ * @brief Stalls whole-frame processing of the first frame (by blocking in the output callback) while further frames
+ * complete, and checks which frames are output under each of the frame queue policies.
+ */
+TEST_F(RawToDepthTests, frame_queue_policies)
+{
+  using Policy = FrameQueuePolicy;
+  const auto depth = RawToDepthV2_float::getFrameQueueDepth();
+  const auto policy = RawToDepthV2_float::getFrameQueuePolicy();
+
+  const uint32_t roiRows = 8;
+  const uint32_t numRois = 8;
+  const uint32_t binning = 2;
+  const uint32_t numFrames = 6;
+  std::vector<std::vector<std::vector<uint16_t>>> frames(numFrames);
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      frames[frameIdx].push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+    }
+  }
+
+  struct Expected
+  {
+    Policy policy;
+    std::vector<uint16_t> userTags;
+    uint64_t dropped;
+  };
+  for (const auto &expected : {Expected{Policy::BLOCK, {0, 1, 2, 3, 4, 5}, 0},
+                               Expected{Policy::DROP_OLDEST, {0, 5}, 4},
+                               Expected{Policy::DROP_NEWEST, {0, 1}, 4}})
+  {
+    RawToDepthV2_float::setFrameQueueDepth(3);
+    RawToDepthV2_float::setFrameQueuePolicy(expected.policy);
+    RawToDepthV2_float rtd(0, 0);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool entered = false;
+    bool released = false;
+    std::vector<uint16_t> userTags;
+    auto setFovSegment = [&](std::shared_ptr<FovSegment> fov)
+    {
+      std::unique_lock lock(mutex);
+      userTags.push_back(fov->getUserTag());
+      entered = true;
+      cv.notify_all();
+      cv.wait(lock, [&released] { return released; });
+    };
+    auto feed = [&rtd, &frames, &setFovSegment](uint32_t frameIdx)
+    {
+      for (const auto &roi : frames[frameIdx])
+      {
+        rtd.processRoi(roi.data(), uint32_t(roi.size()*sizeof(uint16_t)));
+        if (rtd.lastRoiReceived())
+        {
+          rtd.processWholeFrame(setFovSegment);
+        }
+      }
+    };
+
+    feed(0);
+    {
+      std::unique_lock lock(mutex);
+      ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&entered] { return entered; }));
+    }
+
+    // With BLOCK, the feeder stalls until the first frame is released.
+    std::thread feeder([&feed, numFrames]() { for (uint32_t frameIdx = 1; frameIdx < numFrames; frameIdx++) { feed(frameIdx); } });
+    if (expected.policy == Policy::BLOCK)
+    {
+      for (auto waitIdx = 0; waitIdx < 10000 && rtd.getFrameQueueStats().blocked == 0; waitIdx++)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+    else
+    {
+      feeder.join();
+    }
+    {
+      std::scoped_lock lock(mutex);
+      released = true;
+    }
+    cv.notify_all();
+    if (feeder.joinable())
+    {
+      feeder.join();
+    }
+
+    for (auto waitIdx = 0; waitIdx < 10000 && rtd.getFrameQueueStats().processed < expected.userTags.size(); waitIdx++)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    rtd.shutdown();
+
+    auto stats = rtd.getFrameQueueStats();
+    EXPECT_EQ(userTags, expected.userTags);
+    EXPECT_EQ(stats.processed, expected.userTags.size());
+    EXPECT_EQ(stats.dropped, expected.dropped);
+    EXPECT_LE(stats.maxDepth, 3);
+    if (expected.policy == Policy::BLOCK)
+    {
+      EXPECT_GT(stats.blocked, 0);
+      EXPECT_EQ(stats.maxDepth, 3);
+    }
+  }
+
+  RawToDepthV2_float::setFrameQueueDepth(depth);
+  RawToDepthV2_float::setFrameQueuePolicy(policy);
+}
+
+/**
+ * @brief The per-ROI state of a frame is swapped into the frame slot rather than copied. Verifies that each output
+ * carries the timestamps and user tag of its own frame, and not those of a previous frame that used the same buffers.
+ */
+TEST_F(RawToDepthTests, whole_frame_handoff_keeps_per_frame_state)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t numRois = 8;
+  const uint32_t binning = 2;
+  RawToFovs rtf;
+  for (uint32_t frameIdx = 0; frameIdx < 2 * RawToDepthV2_float::MAX_FRAME_QUEUE_DEPTH; frameIdx++)
+  {
+    std::vector<std::vector<uint16_t>> rois;
+    std::vector<uint64_t> expectedTimestamps;
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      rois.push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+      expectedTimestamps.push_back(RtdMetadata(rois.back().data(), uint32_t(rois.back().size()*sizeof(uint16_t))).getTimestamp());
+    }
+
+    auto fov = processSyntheticGridFrame(rtf, rois);
+    ASSERT_NE(fov, nullptr);
+    ASSERT_EQ(fov->getUserTag(), frameIdx);
+    ASSERT_EQ(*fov->getTimestamps(), expectedTimestamps);
+    ASSERT_EQ(fov->getTimestampsVec()->size(), numRois);
+  }
+  rtf.shutdown();
+}
+
+/**
+ * @brief With a callback set, each completed FOV is pushed to it from the whole-frame thread, without polling
+ * fovsAvailable(), and nothing is left for getData().
+ */
+TEST_F(RawToDepthTests, fov_callback_pushes_completed_fovs)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t numRois = 8;
+  const uint32_t binning = 2;
+  const uint32_t numFrames = 4;
+  std::mutex mutex;
+  std::condition_variable fovReceived;
+  std::vector<std::shared_ptr<FovSegment>> fovs;
+  RawToFovs rtf;
+  rtf.setFovCallback([&](uint32_t fovIdx, std::shared_ptr<FovSegment> fov)
+                     {
+                       ASSERT_EQ(fovIdx, 0);
+                       std::lock_guard lock(mutex);
+                       fovs.push_back(std::move(fov));
+                       fovReceived.notify_all();
+                     });
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      auto roi = makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx);
+      rtf.processRoi(roi.data(), uint32_t(roi.size()*sizeof(uint16_t)));
+    }
+    std::unique_lock lock(mutex);
+    ASSERT_TRUE(fovReceived.wait_for(lock, std::chrono::seconds(1), [&] { return fovs.size() == frameIdx + 1; }));
+    ASSERT_EQ(fovs.back()->getUserTag(), frameIdx);
+    ASSERT_TRUE(fovs.back()->getFrameCompleted());
+  }
+  ASSERT_TRUE(rtf.fovsAvailable().empty());
+  rtf.shutdown();
+}
+
+/**
+ * @brief A prewarmed FOV delivers nothing from its synthetic frame, and then processes the real frames as usual.
+ */
+TEST_F(RawToDepthTests, prewarm_discards_synthetic_frame)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t numRois = MAX_IMAGE_HEIGHT / roiRows;
+  const uint32_t binning = 2;
+  RawToFovs rtf;
+  ASSERT_TRUE(rtf.prewarm(1U << 0));
+  ASSERT_TRUE(rtf.fovsAvailable().empty());
+
+  for (uint32_t frameIdx = 0; frameIdx < 2; frameIdx++)
+  {
+    std::vector<std::vector<uint16_t>> rois;
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      rois.push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+    }
+    auto fov = processSyntheticGridFrame(rtf, rois);
+    ASSERT_NE(fov, nullptr);
+    ASSERT_EQ(fov->getUserTag(), frameIdx);
+  }
+  rtf.shutdown();
+}
+
+/**
+ * @brief Offloaded stripes are output in order, and match the stripes processed on the ingest thread, whether the
+ * processing thread takes them one at a time or in batches.
+ */
+TEST_F(RawToDepthTests, offloaded_stripes_match_synchronous)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t binning = 2;
+  const uint32_t numStripes = 24;
+  auto md = [](uint32_t val) { return uint16_t(val << MD_SHIFT); };
+  std::vector<std::vector<uint16_t>> rois;
+  for (uint32_t stripeIdx = 0; stripeIdx < numStripes; stripeIdx++)
+  {
+    rois.push_back(makeSyntheticGridRoi(0, 1, roiRows, binning, stripeIdx));
+    auto *mdat = (Metadata_t*)rois.back().data();
+    mdat->roiStartRow = md((stripeIdx * roiRows) % (MAX_IMAGE_HEIGHT - roiRows));
+    mdat->perFovMetadata[0].rtdAlgorithmCommon = md(RTD_ALG_COMMON_STRIPE_MODE);
+  }
+
+  auto processStripes = [&rois](bool offload, uint32_t batch)
+  {
+    RawToDepthStripe_float::setOffloadStripes(offload);
+    RawToDepthStripe_float::setStripeBatch(batch);
+    std::mutex mutex;
+    std::condition_variable fovReceived;
+    std::vector<std::shared_ptr<FovSegment>> fovs;
+    RawToFovs rtf;
+    rtf.setFovCallback([&](uint32_t /*fovIdx*/, std::shared_ptr<FovSegment> fov)
+                       {
+                         std::lock_guard lock(mutex);
+                         fovs.push_back(std::move(fov));
+                         fovReceived.notify_all();
+                       });
+    for (const auto &roi : rois)
+    {
+      rtf.processRoi(roi.data(), uint32_t(roi.size()*sizeof(uint16_t)));
+    }
+    {
+      std::unique_lock lock(mutex);
+      EXPECT_TRUE(fovReceived.wait_for(lock, std::chrono::seconds(5), [&] { return fovs.size() == rois.size(); }));
+    }
+    rtf.shutdown();
+    return fovs;
+  };
+
+  const auto expected = processStripes(false, 1);
+  ASSERT_EQ(expected.size(), numStripes);
+  for (auto batch : {1U, 4U})
+  {
+    const auto actual = processStripes(true, batch);
+    ASSERT_EQ(actual.size(), numStripes);
+    for (uint32_t stripeIdx = 0; stripeIdx < numStripes; stripeIdx++)
+    {
+      ASSERT_EQ(actual[stripeIdx]->getUserTag(), stripeIdx);
+      ASSERT_EQ(actual[stripeIdx]->getFovTopLeft(), expected[stripeIdx]->getFovTopLeft());
+      ASSERT_EQ(*actual[stripeIdx]->getRange(), *expected[stripeIdx]->getRange());
+      ASSERT_EQ(*actual[stripeIdx]->getSnr(), *expected[stripeIdx]->getSnr());
+      ASSERT_EQ(*actual[stripeIdx]->getSignal(), *expected[stripeIdx]->getSignal());
+    }
+  }
+  RawToDepthStripe_float::setOffloadStripes(false);
+  RawToDepthStripe_float::setStripeBatch(1);
+}
+
+/**
+ * @brief Stripes whose taps the FPGA accumulated, which are converted straight into the stripe's raw buffers, match
+ * the same data sent for tap rotation with the second and third permutations zero.
+ */
+TEST_F(RawToDepthTests, fpga_accumulated_stripes_match_tap_rotation)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t binning = 2;
+  const uint32_t numStripes = 4;
+  const std::size_t imageShorts = std::size_t(roiRows) * IMAGE_WIDTH * NUM_GPIXEL_PHASES;
+  auto md = [](uint32_t val) { return uint16_t(val << MD_SHIFT); };
+
+  auto processStripes = [](const std::vector<std::vector<uint16_t>> &rois)
+  {
+    std::vector<std::shared_ptr<FovSegment>> fovs;
+    RawToFovs rtf;
+    rtf.setFovCallback([&fovs](uint32_t /*fovIdx*/, std::shared_ptr<FovSegment> fov) { fovs.push_back(std::move(fov)); });
+    for (const auto &roi : rois)
+    {
+      rtf.processRoi(roi.data(), uint32_t(roi.size()*sizeof(uint16_t)));
+    }
+    rtf.shutdown();
+    return fovs;
+  };
+
+  std::vector<std::vector<uint16_t>> rotatedRois;
+  std::vector<std::vector<uint16_t>> accumulatedRois;
+  for (uint32_t stripeIdx = 0; stripeIdx < numStripes; stripeIdx++)
+  {
+    auto roi = makeSyntheticGridRoi(0, 1, roiRows, binning, stripeIdx);
+    auto *mdat = (Metadata_t*)roi.data();
+    mdat->roiStartRow = md(stripeIdx * roiRows);
+    mdat->perFovMetadata[0].rtdAlgorithmCommon = md(RTD_ALG_COMMON_STRIPE_MODE);
+    std::fill(roi.begin() + MD_ROW_SHORTS + 2 * imageShorts, roi.end(), 0);
+    rotatedRois.push_back(roi);
+
+    roi.resize(MD_ROW_SHORTS + 2 * imageShorts);
+    ((Metadata_t*)roi.data())->reduceMode = md(REDUCE_MODE_FGPA);
+    accumulatedRois.push_back(roi);
+  }
+
+  const auto expected = processStripes(rotatedRois);
+  const auto actual = processStripes(accumulatedRois);
+  ASSERT_EQ(expected.size(), numStripes);
+  ASSERT_EQ(actual.size(), numStripes);
+  for (uint32_t stripeIdx = 0; stripeIdx < numStripes; stripeIdx++)
+  {
+    ASSERT_EQ(*actual[stripeIdx]->getRange(), *expected[stripeIdx]->getRange());
+    ASSERT_EQ(*actual[stripeIdx]->getSnr(), *expected[stripeIdx]->getSnr());
+    ASSERT_EQ(*actual[stripeIdx]->getSignal(), *expected[stripeIdx]->getSignal());
+  }
+}
+
+/**
+ * @brief The factory creates each FOV with its configured engine if it can process the FOV's scan mode, keeps the
+ * object while the engine stays the same, and the benchmark picks one of the grid-mode engines.
+ */
+TEST_F(RawToDepthTests, dsp_engine_registry_selects_per_fov)
+{
+  ASSERT_NE(RawToDepthFactory::findEngine("stripe_float"), nullptr);
+  ASSERT_EQ(RawToDepthFactory::findEngine("grid_fixed")->engine, RtdEngine::GRID_FIXED);
+  ASSERT_NE(RawToDepthFactory::findEngine(RtdEngine::GRID_FIXED)->capabilities & RTD_ENGINE_CAP_FIXED_POINT, 0);
+  ASSERT_EQ(RawToDepthFactory::findEngine("no_such_engine"), nullptr);
+
+  auto gridRoi = makeSyntheticGridRoi(0, 1, 8, 2, 0);
+  auto stripeRoi = gridRoi;
+  ((Metadata_t*)stripeRoi.data())->perFovMetadata[0].rtdAlgorithmCommon = uint16_t(RTD_ALG_COMMON_STRIPE_MODE << MD_SHIFT);
+  const RtdMetadata gridMdat(gridRoi.data(), uint32_t(gridRoi.size()*sizeof(uint16_t)));
+  const RtdMetadata stripeMdat(stripeRoi.data(), uint32_t(stripeRoi.size()*sizeof(uint16_t)));
+
+  std::vector<std::unique_ptr<RawToDepth>> rtds(MAX_ACTIVE_FOVS);
+  RawToDepthFactory::create(rtds, gridMdat, 0);
+  ASSERT_EQ(rtds[0]->getEngine(), RtdEngine::GRID_FLOAT);
+
+  RawToDepthFactory::setFovEngine(0, RtdEngine::GRID_FIXED);
+  RawToDepthFactory::create(rtds, gridMdat, 0);
+  ASSERT_EQ(rtds[0]->getEngine(), RtdEngine::GRID_FIXED);
+  ASSERT_NE(dynamic_cast<RawToDepthV2_fixed*>(rtds[0].get()), nullptr);
+  const auto *created = rtds[0].get();
+  RawToDepthFactory::create(rtds, gridMdat, 0);
+  ASSERT_EQ(rtds[0].get(), created);
+
+  // A grid-mode engine doesn't apply to stripe mode, and vice versa.
+  RawToDepthFactory::create(rtds, stripeMdat, 0);
+  ASSERT_EQ(rtds[0]->getEngine(), RtdEngine::STRIPE_FLOAT);
+  RawToDepthFactory::setFovEngine(0, RtdEngine::STRIPE_FLOAT);
+  RawToDepthFactory::create(rtds, gridMdat, 0);
+  ASSERT_EQ(rtds[0]->getEngine(), RtdEngine::GRID_FLOAT);
+  RawToDepthFactory::setFovEngine(0, RtdEngine::NONE);
+
+  RawToDepthFactory::setDefaultGridEngine(RtdEngine::GRID_FIXED);
+  RawToDepthFactory::create(rtds, gridMdat, 0);
+  ASSERT_EQ(rtds[0]->getEngine(), RtdEngine::GRID_FIXED);
+  RawToDepthFactory::setDefaultGridEngine(RtdEngine::NONE);
+  rtds[0]->shutdown();
+
+  const auto fastest = RawToDepthFactory::benchmarkGridEngines(1);
+  ASSERT_NE(RawToDepthFactory::findEngine(fastest)->capabilities & RTD_ENGINE_CAP_GRID, 0);
+}
+
+/**
+ * @brief With XYZ output enabled, each pixel's point is its range along the direction given by the theta and phi
+ * of its mapping table entry.
+ */
+TEST_F(RawToDepthTests, xyz_output_uses_mapping_table_directions)
+{
+  auto binfn = "../../tmp/mapping_table_xyz.bin"s;
+  {
+    std::ofstream file(binfn, std::ios::binary);
+    ASSERT_TRUE(file.is_open());
+    constexpr int32_t arcsecPerDegree = 3600;
+    for (int32_t idx = 0; idx < MAPPING_TABLE_LENGTH; idx++)
+    {
+      std::array<int32_t, 4> entry { 0, 0, (20 + idx % 50) * arcsecPerDegree, (idx % 360 - 180) * arcsecPerDegree };
+      file.write(reinterpret_cast<const char*>(entry.data()), sizeof(entry));
+    }
+  }
+
+  const uint32_t roiRows = 8;
+  const uint32_t numRois = 8;
+  const uint32_t binning = 2;
+  RawToFovs rtf;
+  rtf.reloadCalibrationData(binfn, "../../tmp/no_pixel_mask.bin");
+  rtf.setXyzOutput(true);
+  for (uint32_t frameIdx = 0; frameIdx < 2; frameIdx++)
+  {
+    std::vector<std::vector<uint16_t>> rois;
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      rois.push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+    }
+    auto fov = processSyntheticGridFrame(rtf, rois);
+    ASSERT_NE(fov, nullptr);
+    ASSERT_NE(fov->getXyz(), nullptr);
+
+    const auto &ranges = *fov->getRange();
+    const auto &xyz = *fov->getXyz();
+    const auto area = ranges.size();
+    ASSERT_EQ(xyz.size(), 3 * area);
+    auto entries = MappingTableWindow(MappingTable::load(binfn), {fov->getMappingTableTopLeft()[0], fov->getMappingTableTopLeft()[1]},
+                                      {fov->getMappingTableStep()[0], fov->getMappingTableStep()[1]});
+    const auto width = fov->getImageSize()[1];
+    uint32_t numValid = 0;
+    for (std::size_t idx = 0; idx < area; idx++)
+    {
+      double theta = entries.theta(uint32_t(idx / width), uint32_t(idx % width)) * M_PI / (180.0 * 3600.0);
+      double phi = entries.phi(uint32_t(idx / width), uint32_t(idx % width)) * M_PI / (180.0 * 3600.0);
+      double range = ranges[idx];
+      ASSERT_NEAR(xyz[idx], range * sin(theta) * cos(phi), 1.0);
+      ASSERT_NEAR(xyz[area + idx], range * sin(theta) * sin(phi), 1.0);
+      ASSERT_NEAR(xyz[2 * area + idx], range * cos(theta), 1.0);
+      numValid += ranges[idx] != 0 ? 1 : 0;
+    }
+    ASSERT_GT(numValid, 0);
+  }
+  rtf.shutdown();
+}
+
+/**
+ * @brief ROIs ingested on the FOV's ingest thread, while the caller goes on to the next ROI, give the same output as ROIs
+ * ingested in processRoi(). Each ROI's buffer is only kept by its owner, which the FOV lets go of once it is ingested.
+ */
+TEST_F(RawToDepthTests, async_ingest_matches_synchronous)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t numRois = 24;
+  const uint32_t binning = 2;
+  std::vector<std::vector<std::vector<uint16_t>>> frames(2);
+  for (uint32_t frameIdx = 0; frameIdx < frames.size(); frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      frames[frameIdx].push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, frameIdx));
+    }
+  }
+
+  auto processFrames = [&](bool asyncIngest)
+  {
+    RawToDepthV2_float::setAsyncIngest(asyncIngest); // Taken at construction.
+    RawToDepthV2_float rtd(0, 0);
+    std::mutex mutex;
+    std::condition_variable fovReceived;
+    std::vector<std::shared_ptr<FovSegment>> fovs;
+    auto setFovSegment = [&](std::shared_ptr<FovSegment> fov)
+    {
+      std::lock_guard lock(mutex);
+      fovs.push_back(std::move(fov));
+      fovReceived.notify_all();
+    };
+    std::vector<std::weak_ptr<const std::vector<uint16_t>>> released;
+    for (const auto &frame : frames)
+    {
+      for (const auto &frameRoi : frame)
+      {
+        auto roi = std::make_shared<const std::vector<uint16_t>>(frameRoi); // Only kept by its owner once released.
+        const auto numBytes = uint32_t(roi->size()*sizeof(uint16_t));
+        rtd.processRoi(RtdMetadata(roi->data(), numBytes), roi->data(), numBytes);
+        if (rtd.lastRoiReceived())
+        {
+          rtd.processWholeFrame(setFovSegment);
+        }
+        released.push_back(roi);
+        rtd.releaseRoi(std::move(roi));
+      }
+    }
+    std::unique_lock lock(mutex);
+    EXPECT_TRUE(fovReceived.wait_for(lock, std::chrono::seconds(5), [&fovs] { return fovs.size() == 2; }));
+    lock.unlock();
+
+    const auto stats = rtd.getIngestStats();
+    if (asyncIngest)
+    {
+      EXPECT_GT(stats.submitted, numRois);
+      EXPECT_LE(stats.waited, stats.submitted);
+    }
+    else
+    {
+      EXPECT_EQ(stats.submitted, 0);
+    }
+    // All but the latest ROI are ingested and let go of, and the last ROI of a frame is ingested before the frame completes.
+    for (const auto &roi : released)
+    {
+      EXPECT_TRUE(roi.expired());
+    }
+    rtd.shutdown();
+    return fovs;
+  };
+
+  const auto expected = processFrames(false);
+  const auto actual = processFrames(true);
+  RawToDepthV2_float::setAsyncIngest(false);
+  ASSERT_EQ(expected.size(), 2);
+  ASSERT_EQ(actual.size(), 2);
+  for (std::size_t fovIdx = 0; fovIdx < actual.size(); fovIdx++)
+  {
+    ASSERT_EQ(actual[fovIdx]->getUserTag(), expected[fovIdx]->getUserTag());
+    ASSERT_EQ(*actual[fovIdx]->getRange(), *expected[fovIdx]->getRange());
+    ASSERT_EQ(*actual[fovIdx]->getSnr(), *expected[fovIdx]->getSnr());
+    ASSERT_EQ(*actual[fovIdx]->getSignal(), *expected[fovIdx]->getSignal());
+    ASSERT_EQ(*actual[fovIdx]->getBackground(), *expected[fovIdx]->getBackground());
+  }
+}
+
+/**
+ * @brief With streaming enabled, the rows of an FOV arrive in order in segments while its ROIs are received, the last
+ * one completing the FOV, and they match processing the whole FOV at once. Only the recursive min-max filter can
+ * differ, as it doesn't see the whole FOV. The segments are processed on the scheduler thread, so they are taken
+ * with the FOV callback.
+ */
+TEST_F(RawToDepthTests, streamed_segments_match_whole_frame)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t numRois = 24;
+  const uint32_t binning = 2;
+  const uint32_t streamRows = 16;
+  std::vector<std::vector<uint16_t>> rois;
+  for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+  {
+    rois.push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, 0));
+  }
+
+  RawToFovs wholeRtf;
+  ASSERT_NE(processSyntheticGridFrame(wholeRtf, rois), nullptr); // Sizes the buffers.
+  auto whole = processSyntheticGridFrame(wholeRtf, rois);
+  wholeRtf.shutdown();
+  ASSERT_NE(whole, nullptr);
+  const auto numRows = whole->getImageSize()[0];
+  const auto numCols = whole->getImageSize()[1];
+
+  RawToDepthV2_float::setStreamRows(streamRows); // Taken by the RawToDepth objects, created at the first ROI.
+  RawToFovs streamRtf;
+  std::mutex segmentsMutex;
+  std::condition_variable segmentsCondition;
+  std::vector<std::shared_ptr<FovSegment>> segments;
+  streamRtf.setFovCallback([&](uint32_t /*fovIdx*/, std::shared_ptr<FovSegment> segment)
+                           {
+                             std::lock_guard lock(segmentsMutex);
+                             segments.push_back(std::move(segment));
+                             segmentsCondition.notify_all();
+                           });
+  for (uint32_t frameIdx = 0; frameIdx < 2; frameIdx++)
+  {
+    for (const auto &roi : rois)
+    {
+      streamRtf.processRoi(roi.data(), uint32_t(roi.size()*sizeof(uint16_t)));
+    }
+    {
+      std::unique_lock lock(segmentsMutex);
+      ASSERT_TRUE(segmentsCondition.wait_for(lock, std::chrono::seconds(10), [&segments]
+                                             { return !segments.empty() && segments.back()->getFrameCompleted(); }));
+    }
+    ASSERT_GT(segments.size(), 2);
+
+    std::vector<uint16_t> ranges;
+    std::vector<uint16_t> roiIndexRows;
+    for (std::size_t segmentIdx = 0; segmentIdx < segments.size(); segmentIdx++)
+    {
+      const auto &segment = *segments[segmentIdx];
+      ASSERT_EQ(segment.getFrameCompleted(), segmentIdx == segments.size() - 1);
+      ASSERT_EQ(segment.getFirstRow(), ranges.size() / numCols);
+      ASSERT_EQ(segment.getFovNumRows(), numRows);
+      ASSERT_EQ(segment.getMappingTableTopLeft()[0], whole->getMappingTableTopLeft()[0] + segment.getFirstRow() * whole->getMappingTableStep()[0]);
+      if (segmentIdx < segments.size() - 1)
+      {
+        ASSERT_GE(segment.getImageSize()[0], streamRows);
+      }
+      ranges.insert(ranges.end(), segment.getRange()->begin(), segment.getRange()->end());
+      roiIndexRows.insert(roiIndexRows.end(), segment.getRoiIndexRows()->begin(), segment.getRoiIndexRows()->end());
+    }
+    ASSERT_EQ(ranges.size(), whole->getRange()->size());
+    ASSERT_EQ(roiIndexRows, *whole->getRoiIndexRows());
+
+    std::size_t numDifferent = 0;
+    for (std::size_t idx = 0; idx < ranges.size(); idx++)
+    {
+      numDifferent += ranges[idx] != (*whole->getRange())[idx] ? 1 : 0;
+    }
+    ASSERT_LT(numDifferent, ranges.size() / 100);
+    segments.clear(); // The segments of the next frame only arrive once its ROIs are processed.
+  }
+  RawToDepthV2_float::setStreamRows(0);
+  streamRtf.shutdown();
+}
+
+/**
+ * @brief Validates the fixed-point grid-mode processing (RawToDepthV2_fixed) against the float path. The fused integer
+ * fill, bin and phase kernel must give the same binned raw data, signal, snr and background as the float kernels
+ * (with missing rows to fill), up to rounding, and a phase within 2^-PHASE_FIXED_BITS cycles. The output ranges can then only differ
+ * by rounding, and by pixels on the edge of a filter's threshold.
+ */
+TEST_F(RawToDepthTests, fixed_point_matches_float)
+{
+  const auto simdLevel = RawToDepthSimd::getLevel();
+  RawToDepthSimd::setLevel(RawToDepthSimd::Level::SCALAR); // The float reference uses the scalar kernels.
+
+  const uint32_t numRows = 24;
+  const uint32_t numCols = 32;
+  for (uint32_t binning : {1U, 2U, 4U})
+  {
+    const std::array<uint32_t,2> frameSize = {numRows, numCols};
+    const auto numBinned = std::size_t(numRows / binning) * (numCols / binning);
+    auto fixedFrame = std::vector<uint16_t>(NUM_GPIXEL_PHASES * numRows * numCols);
+    auto floatFrame = std::vector<float_t>(fixedFrame.size());
+    for (std::size_t idx = 0; idx < fixedFrame.size(); idx++)
+    {
+      fixedFrame[idx] = uint16_t(std::rand() % 49150);
+      floatFrame[idx] = float_t(uint32_t(fixedFrame[idx]) << RAW_FIXED_SHIFT);
+    }
+    auto activeRows = std::vector<bool>(numRows);
+    for (uint32_t row = 0; row < numRows; row++)
+    {
+      activeRows[row] = std::rand() % 3 != 0;
+    }
+
+    auto filled = std::vector<float_t>(floatFrame.size());
+    auto refBinned = std::vector<float_t>(NUM_GPIXEL_PHASES * numBinned);
+    auto refPhase = std::vector<float_t>(numBinned);
+    auto refSignal = std::vector<float_t>(numBinned, 0.0F);
+    auto refSnr = std::vector<float_t>(numBinned, 0.0F);
+    auto refBackground = std::vector<float_t>(numBinned, 0.0F);
+    RawToDepthDsp::fillMissingRows(floatFrame, filled, frameSize, activeRows);
+    Binning::binMxN(filled, refBinned, frameSize, {binning, binning});
+    RawToDepthDsp::calculatePhase(refBinned, refPhase, refSignal, refSnr, refBackground, float_t(binning * binning));
+
+    auto binned = std::vector<float_t>(refBinned.size());
+    auto phase = std::vector<float_t>(numBinned);
+    auto signal = std::vector<float_t>(numBinned, 0.0F);
+    auto snr = std::vector<float_t>(numBinned, 0.0F);
+    auto background = std::vector<float_t>(numBinned, 0.0F);
+    RawToDepthDsp::binAndCalculatePhase(fixedFrame, activeRows, frameSize, {binning, binning}, binned, phase, signal, snr, background);
+    ASSERT_EQ(binned, refBinned);
+    ASSERT_EQ(signal, refSignal);
+    ASSERT_EQ(background, refBackground);
+    for (std::size_t idx = 0; idx < numBinned; idx++)
+    {
+      ASSERT_NEAR(snr[idx], refSnr[idx], 1e-5F * refSnr[idx]); // The release build uses -ffast-math.
+      ASSERT_NEAR(phase[idx], refPhase[idx], 1.0F / float_t(1U << PHASE_FIXED_BITS));
+    }
+  }
+  RawToDepthSimd::setLevel(simdLevel);
+
+  const uint32_t roiRows = 8;
+  const uint32_t numRois = 24;
+  for (uint32_t binning : {1U, 2U, 4U})
+  {
+    std::vector<std::vector<uint16_t>> rois;
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      rois.push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, binning, 0));
+    }
+
+    std::vector<std::shared_ptr<FovSegment>> outputs;
+    for (bool fixedPoint : {false, true})
+    {
+      RawToDepthFactory::setFixedPoint(fixedPoint); // Taken when the RawToDepth objects are created, at the first ROI.
+      RawToFovs rtf;
+      ASSERT_NE(processSyntheticGridFrame(rtf, rois), nullptr); // Sizes the buffers.
+      outputs.push_back(processSyntheticGridFrame(rtf, rois));
+      rtf.shutdown();
+      ASSERT_NE(outputs.back(), nullptr);
+    }
+    RawToDepthFactory::setFixedPoint(false);
+
+    const auto &floatRanges = *outputs[0]->getRange();
+    const auto &fixedRanges = *outputs[1]->getRange();
+    ASSERT_EQ(fixedRanges.size(), floatRanges.size());
+    ASSERT_EQ(*outputs[1]->getSignal(), *outputs[0]->getSignal());
+    ASSERT_EQ(*outputs[1]->getBackground(), *outputs[0]->getBackground());
+    std::size_t numDifferent = 0;
+    for (std::size_t idx = 0; idx < floatRanges.size(); idx++)
+    {
+      numDifferent += std::abs(int32_t(fixedRanges[idx]) - int32_t(floatRanges[idx])) > 1 ? 1 : 0;
+    }
+    LLogInfo("binning " << binning << ": " << numDifferent << " of " << floatRanges.size() << " fixed-point ranges differ from float");
+    ASSERT_LT(numDifferent, floatRanges.size() / 100);
+  }
+}
+
+/**
+ * @brief Runs parallelFor() from two threads at once on a shared pool. Every task must run exactly once,
+ * with a worker index within the bounds used to index per-worker buffers.
+ */
+TEST_F(RawToDepthTests, worker_pool_parallel_for)
+{
+  WorkerPool pool(3);
+  ASSERT_EQ(pool.getNumWorkers(), 4);
+
+  const uint32_t numTasks = 1000;
+  const uint32_t maxWorkers = 3;
+  auto run = [&pool, numTasks, maxWorkers]()
+  {
+    std::vector<std::atomic<uint32_t>> counts(numTasks);
+    std::atomic<bool> badWorkerIdx { false };
+    for (uint32_t iteration = 0; iteration < 50; iteration++)
+    {
+      pool.parallelFor(numTasks, maxWorkers, [&counts, &badWorkerIdx, maxWorkers](uint32_t taskIdx, uint32_t workerIdx)
+                       {
+                         counts[taskIdx]++;
+                         if (workerIdx >= maxWorkers)
+                         {
+                           badWorkerIdx = true;
+                         }
+                       });
+    }
+    for (auto &count : counts)
+    {
+      EXPECT_EQ(count.load(), 50);
+    }
+    EXPECT_FALSE(badWorkerIdx.load());
+  };
+
+  std::thread other(run);
+  run();
+  other.join();
+
+  uint32_t numCalls = 0;
+  pool.parallelFor(0, maxWorkers, [&numCalls](uint32_t, uint32_t) { numCalls++; });
+  pool.parallelFor(1, maxWorkers, [&numCalls](uint32_t, uint32_t workerIdx) { numCalls++; EXPECT_EQ(workerIdx, 0); });
+  ASSERT_EQ(numCalls, 1);
+}
+
+/**
+ * @brief Checks the order in which the FrameScheduler runs the items of its sources: priority first, then the group
+ * and the source served least recently. Then checks that with several threads, the items of each source still run
+ * one at a time, and that all of them run.
+ */
+TEST_F(RawToDepthTests, frame_scheduler_priority_and_fairness)
+{
+  {
+    FrameScheduler scheduler(1);
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool entered = false;
+    bool released = false;
+    std::vector<std::string> order;
+
+    // Holds the only thread until all of the items have been submitted.
+    auto gate = scheduler.addSource(9, [&]()
+                                    {
+                                      std::unique_lock lock(mutex);
+                                      entered = true;
+                                      cv.notify_all();
+                                      cv.wait(lock, [&released] { return released; });
+                                    });
+    auto addSource = [&](uint32_t group, const std::string &name)
+    {
+      return scheduler.addSource(group, [&order, name]() { order.push_back(name); });
+    };
+    auto a0 = addSource(0, "a0");
+    auto a1 = addSource(0, "a1");
+    auto b0 = addSource(1, "b0");
+    auto c0 = addSource(2, "c0");
+    scheduler.setPriority(2, 1);
+
+    scheduler.submit(gate);
+    {
+      std::unique_lock lock(mutex);
+      ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&entered] { return entered; }));
+    }
+    for (auto sourceId : {a0, a0, a1, a1, b0, b0, c0})
+    {
+      scheduler.submit(sourceId);
+    }
+    {
+      std::scoped_lock lock(mutex);
+      released = true;
+    }
+    cv.notify_all();
+
+    for (auto waitIdx = 0; waitIdx < 10000; waitIdx++)
+    {
+      {
+        std::scoped_lock lock(mutex);
+        if (order.size() == 7)
+        {
+          break;
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (auto sourceId : {gate, a0, a1, b0, c0})
+    {
+      scheduler.removeSource(sourceId);
+    }
+    EXPECT_EQ(order, (std::vector<std::string>{"c0", "a0", "b0", "a1", "b0", "a0", "a1"}));
+  }
+
+  FrameScheduler scheduler(4);
+  ASSERT_EQ(scheduler.getNumThreads(), 4);
+  const uint32_t numSources = 6;
+  const uint32_t numItems = 500;
+  std::vector<std::atomic<uint32_t>> running(numSources);
+  std::vector<std::atomic<uint32_t>> counts(numSources);
+  std::atomic<bool> overlapped { false };
+  std::vector<uint32_t> sourceIds;
+  for (uint32_t idx = 0; idx < numSources; idx++)
+  {
+    sourceIds.push_back(scheduler.addSource(idx % 3, [&, idx]()
+                                            {
+                                              if (running[idx]++ != 0)
+                                              {
+                                                overlapped = true;
+                                              }
+                                              counts[idx]++;
+                                              running[idx]--;
+                                            }));
+  }
+  for (uint32_t item = 0; item < numItems; item++)
+  {
+    for (auto sourceId : sourceIds)
+    {
+      scheduler.submit(sourceId);
+    }
+  }
+  for (auto waitIdx = 0; waitIdx < 10000; waitIdx++)
+  {
+    if (std::all_of(counts.begin(), counts.end(), [numItems](const auto &count) { return count.load() == numItems; }))
+    {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  for (auto sourceId : sourceIds)
+  {
+    scheduler.removeSource(sourceId);
+  }
+  for (auto &count : counts)
+  {
+    EXPECT_EQ(count.load(), numItems);
+  }
+  EXPECT_FALSE(overlapped.load());
+}
+
+/**
+ * @brief Test the SpscRing between two threads: every item that is not dropped arrives once and in order,
+ * the counters add up, and quit() wakes up a waiting consumer. A producer that sleeps in waitForSpace() instead of
+ * dropping loses nothing.
+ */
+TEST_F(RawToDepthTests, spsc_ring)
+{
+  SpscRing<std::vector<uint32_t>> ring(5);
+  ASSERT_EQ(ring.getStats().capacity, 8);
+
+  // Full ring: the producer never waits, it drops.
+  for (uint32_t idx = 0; idx < 8; idx++)
+  {
+    auto *slot = ring.beginPush();
+    ASSERT_NE(slot, nullptr);
+    *slot = {idx};
+    ring.commitPush();
+  }
+  ASSERT_EQ(ring.beginPush(), nullptr);
+  for (uint32_t idx = 0; idx < 8; idx++)
+  {
+    auto *item = ring.front();
+    ASSERT_NE(item, nullptr);
+    ASSERT_EQ((*item)[0], idx);
+    ring.pop();
+  }
+  ASSERT_EQ(ring.front(), nullptr);
+  ASSERT_EQ(ring.getStats().maxDepth, 8);
+
+  const uint32_t numItems = 200000;
+  std::vector<uint32_t> received;
+  std::thread consumer([&ring, &received]()
+                       {
+                         while (true)
+                         {
+                           auto *item = ring.front();
+                           if (item == nullptr)
+                           {
+                             if (!ring.waitForData())
+                             {
+                               return;
+                             }
+                             continue;
+                           }
+                           received.push_back(item->at(0));
+                           ring.pop();
+                         }
+                       });
+
+  for (uint32_t idx = 0; idx < numItems; idx++)
+  {
+    auto *slot = ring.beginPush();
+    if (slot == nullptr)
+    {
+      ring.countDrop();
+      std::this_thread::yield();
+      continue;
+    }
+    slot->assign(1, idx);
+    ring.commitPush();
+  }
+  while (ring.getStats().depth != 0)
+  {
+    std::this_thread::yield();
+  }
+  ring.quit();
+  consumer.join();
+
+  auto stats = ring.getStats();
+  ASSERT_EQ(stats.pushed, 8 + received.size());
+  ASSERT_EQ(stats.popped, stats.pushed);
+  ASSERT_EQ(stats.dropped + received.size(), numItems);
+  ASSERT_LE(stats.maxDepth, 8);
+  ASSERT_TRUE(std::is_sorted(received.begin(), received.end()));
+  ASSERT_TRUE(std::adjacent_find(received.begin(), received.end()) == received.end());
+
+  // Backpressure: the producer waits for the consumer's pops rather than dropping.
+  SpscRing<uint32_t> blockingRing(4);
+  std::vector<uint32_t> blockingReceived;
+  std::thread blockingConsumer([&blockingRing, &blockingReceived]()
+                               {
+                                 while (blockingRing.waitForData())
+                                 {
+                                   uint32_t *item = nullptr;
+                                   while ((item = blockingRing.front()) != nullptr)
+                                   {
+                                     blockingReceived.push_back(*item);
+                                     blockingRing.pop();
+                                   }
+                                 }
+                               });
+  for (uint32_t idx = 0; idx < numItems; idx++)
+  {
+    auto *slot = blockingRing.beginPush();
+    while (slot == nullptr && blockingRing.waitForSpace())
+    {
+      slot = blockingRing.beginPush();
+    }
+    ASSERT_NE(slot, nullptr);
+    *slot = idx;
+    blockingRing.commitPush();
+  }
+  while (blockingRing.getStats().depth != 0)
+  {
+    std::this_thread::yield();
+  }
+  blockingRing.quit();
+  blockingConsumer.join();
+  ASSERT_EQ(blockingReceived.size(), numItems);
+  for (uint32_t idx = 0; idx < numItems; idx++)
+  {
+    ASSERT_EQ(blockingReceived[idx], idx);
+  }
+  ASSERT_EQ(blockingRing.getStats().dropped, 0);
+  ASSERT_FALSE(blockingRing.waitForSpace()); // Returns at once after quit().
+}
+
+/**
+ * @brief Records a session with the RoiRecorder into several small segments and reads it back with the RoiContainerReader.
+ * Features:
+ * 1. The session ends by itself after maxRois; later ROIs are not recorded.
+ * 2. The ROIs are read back in order with their exact sizes and contents, across segment boundaries.
+ * 3. The segment headers carry the head, session and ROI counters.
+ */
+TEST_F(RawToDepthTests, roi_recorder)
+{
+  auto dir = std::filesystem::path(testing::TempDir()) / "roi_recorder";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto prefix = (dir / "rec").string();
+
+  const uint32_t numRois = 200;
+  const uint32_t maxRois = 150;
+  auto roiSize = [](uint32_t roiIdx) { return 100 + (roiIdx * 37) % 3000; };
+  auto roiByte = [](uint32_t roiIdx, uint32_t pos) { return uint8_t(roiIdx * 7 + pos); };
+
+  RoiRecorderConfig config;
+  config.segmentSize = 64 * 1024;
+  config.batchSize = 16 * 1024;
+  config.numBatches = 64; // more than the whole session needs, so that no ROIs can be dropped
+  {
+    RoiRecorder recorder(prefix, 1, config);
+    recorder.startSession(3, maxRois);
+    std::vector<uint8_t> roi;
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      roi.resize(roiSize(roiIdx));
+      for (uint32_t pos = 0; pos < roi.size(); pos++)
+      {
+        roi[pos] = roiByte(roiIdx, pos);
+      }
+      ASSERT_EQ(recorder.record(roi.data(), uint32_t(roi.size())), roiIdx < maxRois);
+    }
+    ASSERT_FALSE(recorder.sessionActive());
+    ASSERT_EQ(recorder.getStats().recordedRois, maxRois);
+    ASSERT_EQ(recorder.getStats().droppedRois, 0);
+  }
+
+  RoiContainerReader reader;
+  ASSERT_TRUE(reader.open(RoiRecorder::segmentPath(prefix, 1, 3, 0)));
+  ASSERT_EQ(reader.getHeader().headNum, 1);
+  ASSERT_EQ(reader.getHeader().sessionNum, 3);
+  ASSERT_EQ(reader.getHeader().firstRoiNum, 0);
+  ASSERT_NE(reader.getHeader().closed, 0);
+
+  RoiContainerRecord record;
+  uint32_t numSegments = 1;
+  uint32_t lastSegment = 0;
+  for (uint32_t roiIdx = 0; roiIdx < maxRois; roiIdx++)
+  {
+    ASSERT_TRUE(reader.next(record));
+    ASSERT_EQ(record.size, roiSize(roiIdx));
+    ASSERT_EQ(record.roiNum, roiIdx);
+    if (reader.getHeader().segmentNum != lastSegment)
+    {
+      lastSegment = reader.getHeader().segmentNum;
+      ASSERT_EQ(lastSegment, numSegments);
+      ASSERT_EQ(reader.getHeader().firstRoiNum, roiIdx);
+      numSegments++;
+    }
+    for (uint32_t pos = 0; pos < record.size; pos++)
+    {
+      ASSERT_EQ(record.data[pos], roiByte(roiIdx, pos));
+    }
+  }
+  ASSERT_FALSE(reader.next(record));
+  ASSERT_GT(numSegments, 1);
+
+  // A record keeps its segment mapped after the reader has moved on.
+  ASSERT_TRUE(reader.rewind());
+  ASSERT_TRUE(reader.next(record));
+  ASSERT_TRUE(reader.rewind());
+  ASSERT_EQ(record.size, roiSize(0));
+  ASSERT_EQ(record.data[record.size - 1], roiByte(0, record.size - 1));
+  std::filesystem::remove_all(dir);
+}
+
+/**
+ * @brief Captures one frame in every two of a synthetic grid-mode FOV with DspCapture, and replays the captures.
+ * Features:
+ * 1. The sampled frames are written out as a .rois container of their ROIs, as received, and a .dsp file.
+ * 2. The captured range is that of the frame's FovSegment, and the intermediate planes are filled.
+ * 3. Replaying the captured ROIs gives the captured range.
+ */
+TEST_F(RawToDepthTests, dsp_capture_sampled_frames)
+{
+  auto dir = std::filesystem::path(testing::TempDir()) / "dsp_capture";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto prefix = (dir / "cap").string();
+
+  const uint32_t roiRows = 8;
+  const uint32_t numRois = 24;
+  const uint32_t numFrames = 4;
+  const uint32_t interval = 2;
+  std::vector<std::vector<std::vector<uint16_t>>> frames(numFrames);
+  for (uint32_t frameIdx = 0; frameIdx < numFrames; frameIdx++)
+  {
+    for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+    {
+      frames[frameIdx].push_back(makeSyntheticGridRoi(roiIdx, numRois, roiRows, 2, frameIdx));
+    }
+  }
+
+  const auto before = DspCapture::getStats();
+  DspCapture::configure(prefix, interval);
+  std::vector<std::shared_ptr<FovSegment>> fovs;
+  {
+    RawToFovs rtf;
+    for (const auto &frame : frames)
+    {
+      fovs.push_back(processSyntheticGridFrame(rtf, frame));
+      ASSERT_NE(fovs.back(), nullptr);
+    }
+    rtf.shutdown();
+  }
+  DspCapture::configure(prefix, 0);
+  DspCapture::flush();
+  const auto after = DspCapture::getStats();
+  ASSERT_EQ(after.sampled - before.sampled, numFrames / interval);
+  ASSERT_EQ(after.skipped, before.skipped);
+  ASSERT_EQ(after.written - before.written, numFrames / interval);
+  ASSERT_EQ(after.writeErrors, before.writeErrors);
+
+  for (uint32_t captureIdx = 0; captureIdx < numFrames / interval; captureIdx++)
+  {
+    const auto frameIdx = captureIdx * interval;
+    const auto &fov = fovs[frameIdx];
+    std::stringstream base;
+    base << prefix << "_0_00_" << std::setfill('0') << std::setw(6) << before.written + before.writeErrors + captureIdx;
+
+    std::ifstream file(base.str() + DSP_CAPTURE_EXTENSION, std::ios::binary);
+    DspCaptureHeader header {};
+    file.read((char *)&header, sizeof(header));
+    ASSERT_TRUE(file.good());
+    ASSERT_EQ(memcmp(header.magic, DSP_CAPTURE_MAGIC, sizeof(header.magic)), 0);
+    ASSERT_EQ(header.frameNum, frameIdx);
+    ASSERT_EQ(header.numRois, numRois);
+    ASSERT_EQ(header.rows, fov->getImageSize()[0]);
+    ASSERT_EQ(header.columns, fov->getImageSize()[1]);
+
+    const auto numPixels = std::size_t(header.rows) * header.columns;
+    std::array<std::vector<float_t>, 4> floatPlanes; // phase0, phase1, mFrame, minMaxMask
+    for (auto &plane : floatPlanes)
+    {
+      plane.resize(numPixels);
+      file.read((char *)plane.data(), std::streamsize(numPixels * sizeof(float_t)));
+    }
+    std::vector<uint16_t> range(numPixels);
+    file.read((char *)range.data(), std::streamsize(numPixels * sizeof(uint16_t)));
+    ASSERT_TRUE(file.good());
+    ASSERT_EQ(range, *fov->getRange());
+    for (uint32_t planeIdx = 0; planeIdx < 3; planeIdx++)
+    {
+      ASSERT_TRUE(std::any_of(floatPlanes[planeIdx].begin(), floatPlanes[planeIdx].end(), [](float_t val) { return val != 0.0F; }));
+    }
+
+    RoiContainerReader reader;
+    ASSERT_TRUE(reader.open(base.str()));
+    ASSERT_EQ(reader.getHeader().numRois, numRois);
+    std::vector<std::vector<uint16_t>> rois;
+    RoiContainerRecord record;
+    while (reader.next(record))
+    {
+      rois.emplace_back((const uint16_t *)record.data, (const uint16_t *)(record.data + record.size));
+    }
+    ASSERT_EQ(rois, frames[frameIdx]);
+
+    RawToFovs replay;
+    auto replayed = processSyntheticGridFrame(replay, rois);
+    replay.shutdown();
+    ASSERT_NE(replayed, nullptr);
+    ASSERT_EQ(*replayed->getRange(), range);
+  }
+  std::filesystem::remove_all(dir);
+}
+
+#include "ImageDecode.h"
+/**
+ * @brief Decodes a synthetic ROI through the C interface of libimage_decode.so.
+ * Features:
+ * 1. The metadata fields match those of RtdMetadata.
+ * 2. The pixels match RawToDepthDsp::sh2f() of the words after the metadata row.
+ * 3. Buffers too small for the ROI are refused, and nothing is written.
+ */
+TEST_F(RawToDepthTests, image_decode_roi)
+{
+  const uint32_t roiRows = 4;
+  auto roi = makeSyntheticGridRoi(1, 2, roiRows, 2, 3);
+  const auto numBytes = uint32_t(roi.size() * sizeof(uint16_t));
+  const RtdMetadata mdat(roi.data(), numBytes);
+
+  ImageDecodeRoiInfo info {};
+  ASSERT_EQ(imageDecodeRoiInfo(roi.data(), numBytes, &info), 0);
+  ASSERT_EQ(info.numElements, mdat.getRoiNumElements());
+  ASSERT_EQ(info.numPixelElements, roi.size() - MD_ROW_SHORTS);
+  ASSERT_EQ(info.roiStartRow, roiRows);
+  ASSERT_EQ(info.roiNumRows, roiRows);
+  ASSERT_EQ(info.roiNumColumns, IMAGE_WIDTH);
+  ASSERT_EQ(info.roiCounter, mdat.getRoiCounter());
+  ASSERT_EQ(info.f0ModulationIndex, 8);
+  ASSERT_EQ(info.f1ModulationIndex, 7);
+  ASSERT_EQ(info.activeFovsBitmask, 1);
+  ASSERT_EQ(info.doTapAccumulation, 1);
+  ASSERT_EQ(info.timestampNs, mdat.getTimestampNs());
+
+  std::vector<float_t> pixels(info.numPixelElements, -1.0F);
+  ASSERT_EQ(imageDecodeRoi(roi.data(), numBytes, pixels.data(), uint32_t(pixels.size()), &info), int32_t(pixels.size()));
+  std::vector<float_t> expected(info.numPixelElements);
+  RawToDepthDsp::sh2f(roi.data() + MD_ROW_SHORTS, expected, info.numPixelElements, INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask());
+  ASSERT_EQ(pixels, expected);
+
+  std::vector<float_t> words(5);
+  ASSERT_EQ(imageDecodeWords(roi.data() + MD_ROW_SHORTS, uint32_t(words.size()), words.data(), 0, 0xffff), 5);
+  ASSERT_EQ(words[4], float_t(roi[MD_ROW_SHORTS + 4]));
+
+  std::fill(pixels.begin(), pixels.end(), -1.0F);
+  ASSERT_EQ(imageDecodeRoiInfo(roi.data(), MD_ROW_BYTES - 2, &info), IMAGE_DECODE_ERROR_SHORT_INPUT);
+  ASSERT_EQ(imageDecodeRoi(roi.data(), numBytes - 2, pixels.data(), uint32_t(pixels.size()), &info), IMAGE_DECODE_ERROR_SHORT_INPUT);
+  ASSERT_EQ(imageDecodeRoi(roi.data(), numBytes, pixels.data(), uint32_t(pixels.size()) - 1, &info), IMAGE_DECODE_ERROR_SHORT_OUTPUT);
+  ASSERT_EQ(std::count(pixels.begin(), pixels.end(), -1.0F), pixels.size());
+}
+
+/**
+ * @brief Tests the 12-bit packed raw format.
+ * Features:
+ * 1. Unpacking a packed buffer gives back the words masked with DEFAULT_RAW_MASK.
+ * 2. The SIMD pack and unpack kernels give the same bytes as the scalar code, for lengths that leave a remainder.
+ * 3. sh2f() of the packed buffer is the same as sh2f() of the unpacked one.
+ * 4. The RoiRecorder records packed ROIs when asked to, and the RoiContainerReader marks them as packed.
+ */
+TEST_F(RawToDepthTests, raw12_packing)
+{
+  const auto simdLevel = RawToDepthSimd::getLevel();
+  const uint32_t numWords = 2 * 1000 + 26;
+  auto words = std::vector<uint16_t>(numWords);
+  for (auto &val : words)
+  {
+    val = uint16_t(std::rand());
+  }
+
+  auto pack = [&](RawToDepthSimd::Level level)
+  {
+    RawToDepthSimd::setLevel(level);
+    auto packed = std::vector<uint8_t>(raw12PackedBytes(numWords));
+    RawToDepthDsp::packRaw12(words.data(), packed.data(), numWords);
+    auto unpacked = std::vector<uint16_t>(numWords);
+    RawToDepthDsp::unpackRaw12(packed.data(), unpacked.data(), numWords);
+    return std::make_pair(packed, unpacked);
+  };
+
+  const auto ref = pack(RawToDepthSimd::Level::SCALAR);
+  for (uint32_t idx = 0; idx < numWords; idx++)
+  {
+    ASSERT_EQ(ref.second[idx], words[idx] & DEFAULT_RAW_MASK) << "word " << idx;
+  }
+  for (auto level : {RawToDepthSimd::Level::NEON, RawToDepthSimd::Level::SSE2, RawToDepthSimd::Level::AVX2})
+  {
+    if (uint32_t(level) > uint32_t(simdLevel))
+    {
+      continue;
+    }
+    auto simd = pack(level);
+    ASSERT_EQ(ref.first, simd.first) << "packRaw12 mismatch at " << RawToDepthSimd::getLevelName(level);
+    ASSERT_EQ(ref.second, simd.second) << "unpackRaw12 mismatch at " << RawToDepthSimd::getLevelName(level);
+
+    auto fromPacked = std::vector<float_t>(numWords);
+    auto fromWords = std::vector<float_t>(numWords);
+    RawToDepthDsp::sh2f(simd.first.data(), fromPacked, numWords, INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask());
+    RawToDepthDsp::sh2f(ref.second.data(), fromWords, numWords, INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask());
+    ASSERT_EQ(fromPacked, fromWords) << "packed sh2f mismatch at " << RawToDepthSimd::getLevelName(level);
+  }
+  RawToDepthSimd::setLevel(simdLevel);
+
+  auto dir = std::filesystem::path(testing::TempDir()) / "raw12_packing";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto prefix = (dir / "rec").string();
+  RoiRecorderConfig config;
+  config.packRaw12 = RawToDepthDsp::packRaw12;
+  {
+    RoiRecorder recorder(prefix, 0, config);
+    recorder.startSession(0, 1);
+    ASSERT_TRUE(recorder.record(reinterpret_cast<const uint8_t *>(words.data()), uint32_t(numWords * sizeof(uint16_t))));
+  }
+  RoiContainerReader reader;
+  RoiContainerRecord record;
+  ASSERT_TRUE(reader.open(RoiRecorder::segmentPath(prefix, 0, 0, 0)));
+  ASSERT_TRUE(reader.next(record));
+  ASSERT_TRUE(record.packed12);
+  ASSERT_EQ(record.size, raw12PackedBytes(numWords));
+  ASSERT_EQ(0, memcmp(record.data, ref.first.data(), record.size));
+  std::filesystem::remove_all(dir);
+}
+
+#include "LatencyHistogram.h"
+
+/**
+ * @brief Tests the latency histograms.
+ * Features:
+ * 1. Every value falls into a bucket whose highest value is at most 1/32 above it.
+ * 2. The percentiles of a known distribution are within the bucket resolution.
+ * 3. A FrameTrace is recorded into one histogram per stage, and skipped if it has no DQBUF time.
+ */
+TEST_F(RawToDepthTests, latency_histogram)
+{
+  for (uint64_t value : {0ULL, 1ULL, 63ULL, 64ULL, 65ULL, 1000ULL, 123456789ULL, (1ULL << 36) - 1})
+  {
+    auto highest = LatencyHistogram::bucketHighestValue(LatencyHistogram::bucketIndex(value));
+    ASSERT_GE(highest, value);
+    ASSERT_LE(highest - value, value / 32);
+    ASSERT_LT(LatencyHistogram::bucketIndex(value), LATENCY_HISTOGRAM_NUM_BUCKETS);
+  }
+  ASSERT_EQ(LatencyHistogram::bucketIndex(UINT64_MAX), LATENCY_HISTOGRAM_NUM_BUCKETS - 1);
+
+  LatencyHistogram histogram;
+  ASSERT_EQ(histogram.getPercentile(0.5), 0);
+  for (uint64_t value = 1; value <= 10000; value++)
+  {
+    histogram.record(value * 1000);
+  }
+  ASSERT_EQ(histogram.getCount(), 10000);
+  ASSERT_EQ(histogram.getMax(), 10000000);
+  for (double fraction : {0.5, 0.99, 0.999})
+  {
+    auto expected = double(fraction * 10000000);
+    ASSERT_NEAR(double(histogram.getPercentile(fraction)), expected, expected / 32);
+  }
+  ASSERT_EQ(histogram.getPercentile(1.0), 10000000);
+
+  FrameLatency latency;
+  FrameTrace trace;
+  latency.record(trace);
+  ASSERT_EQ(latency.getHistogram(LATENCY_TOTAL).getCount(), 0);
+  for (uint32_t point = 0; point < NUM_FRAME_TRACE_POINTS; point++)
+  {
+    trace.stamp(FrameTracePoint(point), 1000000 + point * point * 1000);
+  }
+  latency.record(trace);
+  for (uint32_t stage = 0; stage < LATENCY_TOTAL; stage++)
+  {
+    ASSERT_EQ(latency.getHistogram(FrameLatencyStage(stage)).getMax(), ((stage + 1) * (stage + 1) - stage * stage) * 1000);
+  }
+  ASSERT_EQ(latency.getHistogram(LATENCY_TOTAL).getMax(), 36000);
+  ASSERT_NE(latency.report("fov=0,").find("fov=0,stage=whole_frame,count=1,"), std::string::npos);
+}
+
+#include "LoadShedder.h"
+
+/**
+ * @brief Tests the load shedding controller.
+ * Features:
+ * 1. A single slow frame doesn't take a step; a run of them takes one step at a time, up to maxLevel.
+ * 2. At SKIP_FRAMES, one frame in skipInterval is skipped.
+ * 3. A run of frames with headroom undoes one step at a time, back to full quality.
+ */
+TEST_F(RawToDepthTests, load_shedder)
+{
+  LoadShedder::Config config;
+  config.maxLevel = LoadShedder::SKIP_FRAMES;
+  LoadShedder shedder(0, 0, config);
+  const uint64_t periodNs = 10000000;
+
+  ASSERT_FALSE(shedder.addFrame(0, 0));
+  ASSERT_FALSE(shedder.addFrame(3 * periodNs, periodNs));
+  for (uint32_t frame = 0; frame < 2 * config.headroomFrames; frame++)
+  {
+    ASSERT_FALSE(shedder.addFrame(periodNs / 2, periodNs));
+  }
+  ASSERT_EQ(shedder.getLevel(), LoadShedder::FULL_QUALITY);
+  ASSERT_FALSE(shedder.skipFrame());
+
+  for (uint32_t level = LoadShedder::NO_NEAREST_NEIGHBOR; level <= LoadShedder::SKIP_FRAMES; level++)
+  {
+    uint32_t frames = 1;
+    while (!shedder.addFrame(2 * periodNs, periodNs))
+    {
+      frames++;
+      ASSERT_LT(frames, 4 * config.overloadFrames);
+    }
+    ASSERT_GE(frames, config.overloadFrames);
+    ASSERT_EQ(shedder.getLevel(), level);
+  }
+  for (uint32_t frame = 0; frame < 4 * config.overloadFrames; frame++)
+  {
+    ASSERT_FALSE(shedder.addFrame(2 * periodNs, periodNs));
+  }
+  ASSERT_EQ(shedder.getStats().degraded, LoadShedder::SKIP_FRAMES);
+
+  uint32_t skipped = 0;
+  for (uint32_t frame = 0; frame < 10 * config.skipInterval; frame++)
+  {
+    skipped += shedder.skipFrame() ? 1 : 0;
+  }
+  ASSERT_EQ(skipped, 10);
+  ASSERT_EQ(shedder.getStats().skippedFrames, 10);
+
+  for (uint32_t level = LoadShedder::SKIP_FRAMES; level > LoadShedder::FULL_QUALITY; level--)
+  {
+    uint32_t frames = 1;
+    while (!shedder.addFrame(periodNs / 4, periodNs))
+    {
+      frames++;
+      ASSERT_LT(frames, 2 * config.headroomFrames);
+    }
+    ASSERT_GE(frames, config.headroomFrames);
+    ASSERT_EQ(shedder.getLevel(), level - 1);
+  }
+  ASSERT_EQ(shedder.getStats().restored, LoadShedder::SKIP_FRAMES);
+  ASSERT_STREQ(LoadShedder::getLevelName(shedder.getLevel()), "full_quality");
+}
+
+#include "FastTimers.h"
+
+/**
+ * @brief Checks that FastTimers sums the counters of all threads, including the ones that have exited,
+ *        converts ticks to microseconds, and reports the timers used since the last publish().
+ */
+TEST_F(RawToDepthTests, fast_timers)
+{
+  const auto id = FAST_TIMER_SENSOR_HEAD_RTD;
+  const auto ticksPerUs = FastTimers::ticksPerMicrosecond();
+  ASSERT_GT(ticksPerUs, 0.0);
+  FastTimers::publish();
+  const auto before = FastTimers::getStats(id);
+
+  constexpr uint32_t numThreads = 4;
+  constexpr uint32_t numRecords = 1000;
+  std::vector<std::thread> threads;
+  for (uint32_t threadIdx = 0; threadIdx < numThreads; threadIdx++)
+  {
+    threads.emplace_back([id, ticksPerUs]() {
+      for (uint32_t idx = 0; idx < numRecords; idx++)
+      {
+        FastTimers::record(id, uint64_t(ticksPerUs * 10));
+      }
+    });
+  }
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+
+  const auto sleepUs = 2000.0;
+  {
+    auto localTimer = FastTimers::Scoped(id);
+    std::this_thread::sleep_for(std::chrono::microseconds(int(sleepUs)));
+  }
+
+  const auto after = FastTimers::getStats(id);
+  ASSERT_EQ(after.count - before.count, numThreads * numRecords + 1);
+  auto sleptUs = after.totalUs - before.totalUs - numThreads * numRecords * 10.0;
+  ASSERT_GT(sleptUs, sleepUs * 0.9);
+  ASSERT_LT(sleptUs, sleepUs * 20);
+  ASSERT_GE(after.maxUs, sleptUs * 0.99);
+
+  auto report = FastTimers::publish();
+  std::stringstream expected;
+  expected << "fast_timer:name=" << FastTimers::name(id) << ",count=" << numThreads * numRecords + 1 << ",";
+  ASSERT_NE(report.find(expected.str()), std::string::npos);
+  ASSERT_EQ(*FastTimers::getLastReport(), report);
+  ASSERT_EQ(FastTimers::publish().find(expected.str()), std::string::npos);
+}
+
+#include "PerfCounters.h"
+
+/**
+ * @brief Checks that PerfCounters only counts while enabled, sums the scopes of a stage per FOV, and reports them.
+ *        Where the performance counters aren't available (e.g. in a container), the scopes aren't counted.
+ */
+TEST_F(RawToDepthTests, perf_counters_per_stage)
+{
+  const auto stage = PERF_STAGE_NET_HAND_IN;
+  const uint32_t fovIdx = PERF_COUNTERS_MAX_FOVS - 1;
+  const auto before = PerfCounters::getStats(stage, fovIdx);
+  {
+    auto counters = PerfCounters::Scoped(stage, fovIdx);
+  }
+  ASSERT_EQ(PerfCounters::getStats(stage, fovIdx).count, before.count);
+  ASSERT_EQ(PerfCounters::getReport(), "perfCounters=off\n");
+
+  PerfCounters::configure(true);
+  PerfSample sample {};
+  const bool available = PerfCounters::read(sample);
+  constexpr uint32_t numScopes = 10;
+  volatile float_t sum = 0;
+  for (uint32_t scope = 0; scope < numScopes; scope++)
+  {
+    auto counters = PerfCounters::Scoped(stage, fovIdx);
+    for (uint32_t idx = 0; idx < 10000; idx++)
+    {
+      sum = sum + float_t(idx);
+    }
+  }
+  {
+    auto counters = PerfCounters::Scoped(stage, PERF_COUNTERS_MAX_FOVS); // Dropped
+  }
+  const auto after = PerfCounters::getStats(stage, fovIdx);
+  const auto report = PerfCounters::getReport();
+  PerfCounters::configure(false);
+
+  ASSERT_NE(report.find("perfCounters=on,perfCounterThreads="), std::string::npos) << report;
+  if (!available)
+  {
+    ASSERT_EQ(after.count, before.count);
+    return;
+  }
+  ASSERT_EQ(after.count - before.count, numScopes);
+  if (PerfCounters::isAvailable(PERF_EVENT_INSTRUCTIONS))
+  {
+    ASSERT_GT(after.values[PERF_EVENT_INSTRUCTIONS] - before.values[PERF_EVENT_INSTRUCTIONS], numScopes * 10000);
+  }
+  std::stringstream expected;
+  expected << "perf_counter:stage=" << PerfCounters::name(stage) << ",fovIdx=" << fovIdx << ",count=" << after.count << ",cycles=";
+  ASSERT_NE(report.find(expected.str()), std::string::npos) << report;
+}
+
+#include "PipelineTrace.h"
+#include <fstream>
+
+/**
+ * @brief Checks that PipelineTrace only records while it is started, keeps the spans of every thread, and writes
+ *        them as Chrome trace events under the thread's name and head.
+ */
+TEST_F(RawToDepthTests, pipeline_trace)
+{
+  auto path = (std::filesystem::temp_directory_path() / "pipeline_trace_test.json").string();
+  {
+    auto untraced = PipelineTrace::Span("untraced");
+  }
+  PipelineTrace::start();
+  ASSERT_TRUE(PipelineTrace::enabled());
+
+  constexpr uint32_t numSpans = PIPELINE_TRACE_EVENTS_PER_THREAD + 10;
+  std::thread thread([]() {
+    PipelineTrace::setThreadName("trace_test", 2);
+    for (uint32_t idx = 0; idx < numSpans; idx++)
+    {
+      auto span = PipelineTrace::Span("test_span");
+    }
+  });
+  thread.join();
+  {
+    auto span = PipelineTrace::Span("main_span");
+  }
+  PipelineTrace::stop();
+  {
+    auto stopped = PipelineTrace::Span("stopped");
+  }
+
+  // The thread's ring only keeps its last spans
+  ASSERT_EQ(PipelineTrace::write(path), PIPELINE_TRACE_EVENTS_PER_THREAD + 1);
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  auto trace = contents.str();
+  ASSERT_EQ(trace.rfind("{\"traceEvents\":[", 0), 0);
+  ASSERT_NE(trace.find("\"pid\":2,\"args\":{\"name\":\"head 2\"}"), std::string::npos);
+  ASSERT_NE(trace.find("\"args\":{\"name\":\"trace_test\"}"), std::string::npos);
+  ASSERT_NE(trace.find("{\"name\":\"test_span\",\"ph\":\"X\",\"pid\":2,"), std::string::npos);
+  ASSERT_NE(trace.find("\"main_span\""), std::string::npos);
+  ASSERT_EQ(trace.find("\"untraced\""), std::string::npos);
+  ASSERT_EQ(trace.find("\"stopped\""), std::string::npos);
+
+  // A new trace starts empty
+  PipelineTrace::start();
+  PipelineTrace::stop();
+  ASSERT_EQ(PipelineTrace::write(path), 0);
+  std::filesystem::remove(path);
+}
+
+/**
+ * @brief test the MAKEVECTOR macros. Features: 
+ * 1. Creates a vector of the given size and type.
+ * 2. Creating the same vector smaller does not result in realloc, just std::vector::resize()
+ * 3. Creating the same vector larger does reallocate on the heap.
+ * 4. Creating the same vector the same size does nothing.
+ * 
+ */
+TEST_F(RawToDepthTests, raw_to_depth_tests_MAKEVECTOR_tests)
+{
+  bool changed = false;
+  const int testVecSize = 51;
+  std::vector<float_t> vec; 
+  MAKE_VECTOR(vec, float_t, testVecSize);
+  ASSERT_EQ(vec.size(), testVecSize);
+  ASSERT_TRUE(changed);
+  changed = false;
+
+  auto v_val = reinterpret_cast<std::uintptr_t>(vec.data());
+
+  MAKE_VECTOR(vec, float_t, testVecSize);
+  ASSERT_EQ(vec.size(), testVecSize);
+  ASSERT_FALSE(changed);
+
+  auto v_val2 = reinterpret_cast<std::uintptr_t>(vec.data());
+  ASSERT_EQ(v_val, v_val2);
+
+  const int newTestVecSize = 52;
+  MAKE_VECTOR(vec, float_t, newTestVecSize);
+  ASSERT_EQ(vec.size(), newTestVecSize);
+  ASSERT_TRUE(changed);
+  auto v_val3 = reinterpret_cast<std::uintptr_t>(vec.data());
+  // Note: v_val3 == v_val if the array is shrunk due to the use of resize.
+  ASSERT_NE(v_val, v_val3);
+
+}
+
+/**
+ * @brief Tests the use of the MAKEVECTOR2 macro, which allocates a pair of
+ * std::vectors for storing two-component data.
+ * 
+ */
+TEST_F(RawToDepthTests, raw_to_depth_tests_MAKEVECTOR2_tests)
+{
+  bool changed = false;
+  const int testVecSize = 97;
+  std::vector<std::vector<float_t>> vec;
+  MAKE_VECTOR2(vec, float_t, testVecSize);
+
+  ASSERT_EQ(vec.size(), 2);
+  ASSERT_EQ(vec[0].size(), testVecSize);
+  ASSERT_EQ(vec[1].size(), testVecSize);
+
+  auto v_val_0 = reinterpret_cast<std::uintptr_t>(vec.data());
+  auto v_val_1 = reinterpret_cast<std::uintptr_t>(vec[0].data());
+  auto v_val_2 = reinterpret_cast<std::uintptr_t>(vec[1].data());
+  
+  MAKE_VECTOR2(vec, float_t, testVecSize);
+  ASSERT_EQ(vec.size(), 2);
+  ASSERT_EQ(vec[0].size(), testVecSize);
+  ASSERT_EQ(vec[1].size(), testVecSize);
+
+  auto v_val1_0 = reinterpret_cast<std::uintptr_t>(vec.data());
+  auto v_val1_1 = reinterpret_cast<std::uintptr_t>(vec[0].data());
+  auto v_val1_2 = reinterpret_cast<std::uintptr_t>(vec[1].data());
+
+  // Test that reallocating the same variable name and size results in the same underlying pointer.
+  ASSERT_EQ(v_val_0, v_val1_0);
+  ASSERT_EQ(v_val_1, v_val1_1);
+  ASSERT_EQ(v_val_2, v_val1_2);
+
+  const int newTestVecSize = testVecSize*7;
+  MAKE_VECTOR2(vec, float_t, newTestVecSize);
+  ASSERT_EQ(vec.size(), 2);
+  ASSERT_EQ(vec[0].size(), newTestVecSize);
+  ASSERT_EQ(vec[1].size(), newTestVecSize);
+
+  auto v_val2_0 = reinterpret_cast<std::uintptr_t>(vec.data());
+  auto v_val2_1 = reinterpret_cast<std::uintptr_t>(vec[0].data());
+  auto v_val2_2 = reinterpret_cast<std::uintptr_t>(vec[1].data());
+
+  ASSERT_EQ(v_val_0, v_val2_0); // still 2-component data.
+  // Reallocating the variable with a larger size results in a new
+  // underlying pointer.
+  ASSERT_NE(v_val_1, v_val2_1); 
+  ASSERT_NE(v_val_2, v_val2_2);
+
+}
+
+/**
+ * @brief This verifies that the fast and slow versions of smoothing produce
+ * identical results.
+ * 
+ * The slow version of the code is general-purpose (for any kernel size).
+ * The fast version of the code is specialized for a specific kernel size.
+ * 
+ */
+TEST_F(RawToDepthTests, raw_to_depth_tests_SmoothingTest)
+{
+  const static float_t dataRange = 99.0F;
+  const std::size_t width = 320;
+  const std::size_t height = 240;
+  auto inputData = std::vector<float_t>(width*height*3UL, 0.0F);
+  for (auto idx=0; idx<inputData.size(); idx++)
+  {
+    float_t val = roundf(dataRange * float_t(std::rand()) / float_t(RAND_MAX));
+    inputData.at(idx) = val;
+  }
+
+  auto outputData_fast = std::vector<float_t>(inputData.size());
+  RawToDepthDsp::smoothSummedData(inputData, outputData_fast, {height,width}, 2, 3, true);
+
+  auto outputData_good = std::vector<float_t>(inputData.size());
+  RawToDepthDsp::smoothSummedData(inputData, outputData_good, {height,width}, 2, 3, false);
+
+  for (auto idx=0; idx<outputData_fast.size(); idx++)
+  {
+    if (outputData_fast.at(idx) != outputData_good.at(idx))
+    {
+      LLogErr("Mismatch in smoothing at idx " << idx << " with values " <<  outputData_fast.at(idx) << outputData_good.at(idx));
+    }
+  }
+
+}
+
+/**
+ * @brief Verifies that the compile-time specialized separable smoothing matches the
+ * general-purpose smoothRaw() for each specialized kernel combination, including frames
+ * that are only slightly larger than the kernels.
+ * 
+ */
+TEST_F(RawToDepthTests, separable_smoothing_matches_generic)
+{
+  const float_t dataRange = 4095.0F * RAW_SCALING_FACTOR;
+  const std::vector<std::array<uint32_t,2>> kernelIndices { {1, 1}, {1, 2}, {2, 3}, {3, 6} };
+  const std::vector<std::array<uint32_t,2>> sizes { {23, 101}, {15, 7}, {240, 320} };
+
+  for (const auto &size : sizes)
+  {
+    auto inputData = std::vector<float_t>(std::size_t(NUM_GPIXEL_PHASES)*size[0]*size[1]);
+    for (auto &val : inputData)
+    {
+      val = roundf(dataRange * float_t(std::rand()) / float_t(RAND_MAX));
+    }
+
+    for (const auto &kernels : kernelIndices)
+    {
+      auto separable = std::vector<float_t>(inputData.size());
+      ASSERT_TRUE(RawToDepthDsp::smoothSeparable(inputData, separable, size, kernels[0], kernels[1]));
+
+      auto generic = std::vector<float_t>(inputData.size());
+      RawToDepthDsp::smoothRaw(inputData, generic, size, kernels[0], kernels[1]);
+
+      for (auto idx=0; idx<generic.size(); idx++)
+      {
+        ASSERT_NEAR(generic[idx], separable[idx], 1.0e-5F * std::max(1.0F, fabsf(generic[idx])))
+          << "kernels " << kernels[0] << "," << kernels[1] << " size " << size[0] << "x" << size[1] << " idx " << idx;
+      }
+    }
+  }
+
+  // Combinations without a specialization are left to smoothRaw().
+  auto unspecialized = std::vector<float_t>(std::size_t(NUM_GPIXEL_PHASES)*9*9);
+  auto unspecializedOut = std::vector<float_t>(unspecialized.size());
+  ASSERT_FALSE(RawToDepthDsp::smoothSeparable(unspecialized, unspecializedOut, {9, 9}, 4, 4));
+}
+
+/**
+ * @brief Verifies that the sliding-window min-max mask matches the per-pixel minMax() for square,
+ * rectangular and even-sized windows, and that the recursive mask only masks pixels that it flags.
+ * 
+ */
+TEST_F(RawToDepthTests, min_max_sliding_matches_min_max)
+{
+  const std::array<uint32_t,2> frameSize { 37, 53 };
+  auto frame = std::vector<float_t>(frameSize[0]*frameSize[1]);
+  for (auto &val : frame)
+  {
+    val = roundf(4.0F * float_t(std::rand()) / float_t(RAND_MAX));
+  }
+
+  const std::vector<std::vector<uint32_t>> filterSizes { {3, 3}, {5, 7}, {9, 4}, {1, 15}, {37, 3}, {3, 53} };
+  for (const auto &filterSize : filterSizes)
+  {
+    for (auto thresh : {1.0F, 2.5F, 3.5F})
+    {
+      auto reference = std::vector<float_t>(frame.size());
+      RawToDepthDsp::minMax(frame, reference, filterSize, {frameSize[0], frameSize[1]}, thresh);
+      auto sliding = std::vector<float_t>(frame.size(), -1.0F);
+      RawToDepthDsp::minMaxSliding(frame, sliding, filterSize, frameSize, thresh);
+      ASSERT_EQ(reference, sliding) << "filter " << filterSize[0] << "x" << filterSize[1] << " threshold " << thresh;
+
+      auto recursive = std::vector<float_t>(frame.size());
+      RawToDepthDsp::minMaxRecursive(frame, recursive, filterSize, frameSize, thresh);
+      for (auto idx=0; idx<frame.size(); idx++)
+      {
+        ASSERT_TRUE(recursive[idx] == 0.0F || sliding[idx] == 1.0F) << "idx " << idx;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Verifies that the plus-shaped median filter matches sorting the neighborhood
+ * of each pixel, for the kernel combinations used by the pipeline, with and without repeated values.
+ * 
+ */
+TEST_F(RawToDepthTests, median_filter_plus_matches_sort)
+{
+  const std::array<uint32_t,2> frameSize { 31, 47 };
+  const std::vector<std::vector<uint32_t>> kernelIndices { {0, 0}, {1, 2}, {2, 3}, {3, 6} };
+
+  for (auto quantization : {0.0F, 1.0F})
+  {
+    auto frame = std::vector<float_t>(frameSize[0]*frameSize[1]);
+    for (auto &val : frame)
+    {
+      val = 25.0F * float_t(std::rand()) / float_t(RAND_MAX);
+      val = quantization > 0.0F ? roundf(val / quantization) * quantization : val;
+    }
+
+    for (const auto &kernels : kernelIndices)
+    {
+      auto filtered = std::vector<float_t>(frame.size());
+      RawToDepthDsp::medianFilterPlus(frame, filtered, kernels, frameSize, true);
+
+      const auto hHalf = int(RawToDepthDsp::_fKernels[kernels[0]].size() | 1U) / 2;
+      const auto vHalf = int(RawToDepthDsp::_fKernels[kernels[1]].size() | 1U) / 2;
+      const auto offsets = RawToDepthDsp::getMedianOffsets(frameSize, kernels);
+      auto points = std::vector<float_t>(offsets.size());
+      for (int rowIdx=0; rowIdx<int(frameSize[0]); rowIdx++)
+      {
+        for (int colIdx=0; colIdx<int(frameSize[1]); colIdx++)
+        {
+          const auto idx = rowIdx*int(frameSize[1]) + colIdx;
+          auto expected = frame[idx];
+          if (rowIdx >= vHalf && rowIdx < int(frameSize[0]) - vHalf && colIdx >= hHalf && colIdx < int(frameSize[1]) - hHalf)
+          {
+            for (auto pointIdx=0; pointIdx<offsets.size(); pointIdx++)
+            {
+              points[pointIdx] = frame[idx + offsets[pointIdx]];
+            }
+            std::sort(points.begin(), points.end());
+            expected = points[points.size()/2];
+          }
+          ASSERT_EQ(expected, filtered[idx]) << "kernels " << kernels[0] << "," << kernels[1] << " row " << rowIdx << " column " << colIdx;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Verifies that the nearest-neighbor outlier filter matches counting the neighbors
+ * of each pixel one at a time, for each filter level.
+ * 
+ */
+TEST_F(RawToDepthTests, remove_outliers_matches_count)
+{
+  std::array<uint32_t,2> frameSize { 29, 43 };
+  // The window size and the minimum neighbor count of each filter level, as in NearestNeighbor.cpp.
+  const std::vector<uint32_t> windowSizes { 0, 3, 5, 6, 7, 9 };
+  const std::vector<uint32_t> minNeighborCounts { 0, 3, 5, 5, 7, 11 };
+  const float_t rangeTolFrac = 1.0F/16.0F;
+
+  auto frame = std::vector<float_t>(frameSize[0]*frameSize[1]);
+  for (auto &val : frame)
+  {
+    // Clustered ranges, so that both outcomes occur.
+    val = 10.0F + float_t(std::rand() % 4) + 0.5F * float_t(std::rand()) / float_t(RAND_MAX);
+  }
+
+  for (uint16_t filterLevel=1; filterLevel<windowSizes.size(); filterLevel++)
+  {
+    auto filtered = frame;
+    NearestNeighbor::removeOutliers(filtered, filterLevel, frameSize);
+
+    const auto winSize = int(windowSizes[filterLevel]);
+    const auto halfWin = winSize / 2;
+    for (int rowIdx=0; rowIdx<int(frameSize[0]); rowIdx++)
+    {
+      for (int colIdx=0; colIdx<int(frameSize[1]); colIdx++)
+      {
+        const auto idx = rowIdx*int(frameSize[1]) + colIdx;
+        auto expected = frame[idx];
+        if (rowIdx >= halfWin && rowIdx < int(frameSize[0]) - halfWin && colIdx >= halfWin && colIdx < int(frameSize[1]) - halfWin)
+        {
+          const float_t rangeTol = 1.0F/1024.0F + frame[idx] * rangeTolFrac;
+          uint32_t numNeighbors = 0;
+          for (int winRow=-halfWin; winRow<winSize-halfWin; winRow++)
+          {
+            for (int winCol=-halfWin; winCol<winSize-halfWin; winCol++)
+            {
+              numNeighbors += uint32_t(rangeTol >= fabsf(frame[idx + winRow*int(frameSize[1]) + winCol] - frame[idx]));
+            }
+          }
+          expected = numNeighbors < minNeighborCounts[filterLevel] ? 0.0F : frame[idx];
+        }
+        ASSERT_EQ(expected, filtered[idx]) << "level " << filterLevel << " row " << rowIdx << " column " << colIdx;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Verifies that the SIMD implementations of the DSP kernels match the scalar
+ * reference to within floating-point rounding. Buffer sizes are chosen so that they
+ * are not a multiple of the vector width, so the scalar remainder loops are exercised.
+ * 
+ */
+TEST_F(RawToDepthTests, simd_kernels_match_scalar)
+{
+  const auto simdLevel = RawToDepthSimd::detect();
+  LLogInfo("Best available SIMD level is " << RawToDepthSimd::getLevelName(simdLevel));
+
+  const float_t tolerance = 1.0e-5F;
+  auto expectNear = [tolerance](const std::vector<float_t> &ref, const std::vector<float_t> &val, const std::string &name)
+  {
+    ASSERT_EQ(ref.size(), val.size());
+    for (auto idx=0; idx<ref.size(); idx++)
+    {
+      ASSERT_NEAR(ref[idx], val[idx], tolerance * std::max(1.0F, fabsf(ref[idx]))) << name << " mismatch at idx " << idx;
+    }
+  };
+
+  const std::size_t height = 23;
+  const std::size_t width = 101;
+  const std::size_t numPixels = height*width;
+  const float_t rawRange = 4095.0F * RAW_SCALING_FACTOR;
+
+  auto rawU16 = std::vector<uint16_t>(numPixels*NUM_GPIXEL_PHASES);
+  for (auto &val : rawU16)
+  {
+    val = uint16_t(std::rand());
+  }
+
+  auto rawU16Retake = std::vector<uint16_t>(rawU16.size());
+  for (auto &val : rawU16Retake)
+  {
+    val = uint16_t(std::rand());
+  }
+
+  auto raw = std::vector<float_t>(numPixels*NUM_GPIXEL_PHASES);
+  for (auto &val : raw)
+  {
+    val = roundf(rawRange * float_t(std::rand()) / float_t(RAND_MAX));
+  }
+
+  auto phases0 = std::vector<float_t>(numPixels);
+  auto phases1 = std::vector<float_t>(numPixels);
+  for (auto idx=0; idx<numPixels; idx++)
+  {
+    phases0[idx] = float_t(std::rand()) / float_t(RAND_MAX);
+    phases1[idx] = float_t(std::rand()) / float_t(RAND_MAX);
+  }
+
+  struct Outputs
+  {
+    std::vector<float_t> sh2f, phase, signal, snr, background, smoothed5x7, smoothed7x15, ranges, mFrame,
+                         smoothedPhase, correctedPhase, planes, planarRanges, planarMFrame;
+    std::vector<uint16_t> hdrMerged;
+  };
+
+  auto runKernels = [&](RawToDepthSimd::Level level)
+  {
+    RawToDepthSimd::setLevel(level);
+    Outputs out { std::vector<float_t>(rawU16.size()), 
+                  std::vector<float_t>(numPixels), std::vector<float_t>(numPixels, 1.0F), 
+                  std::vector<float_t>(numPixels, 1.0F), std::vector<float_t>(numPixels, 1.0F), 
+                  std::vector<float_t>(raw.size()), std::vector<float_t>(raw.size()),
+                  std::vector<float_t>(numPixels), std::vector<float_t>(numPixels),
+                  std::vector<float_t>(numPixels), std::vector<float_t>(numPixels),
+                  std::vector<float_t>(2*raw.size()), std::vector<float_t>(numPixels), std::vector<float_t>(numPixels) };
+    RawToDepthDsp::sh2f(rawU16.data(), out.sh2f, uint32_t(rawU16.size()), 2);
+    out.hdrMerged.resize(rawU16.size());
+    RawToDepthDsp::hdrMerge(rawU16.data(), rawU16Retake.data(), out.hdrMerged.data(), uint32_t(rawU16.size()), 0xc000, 2);
+    RawToDepthDsp::calculatePhase(raw, out.phase, out.signal, out.snr, out.background, 4.0F);
+    RawToDepthDsp::smoothRaw5x7(raw, out.smoothed5x7, {uint32_t(height), uint32_t(width)});
+    RawToDepthDsp::smoothRaw7x15(raw, out.smoothed7x15, {uint32_t(height), uint32_t(width)});
+    RawToDepthDsp::calculatePhaseSmooth(raw, out.smoothedPhase, phases0, out.correctedPhase, 0);
+    RawToDepthDsp::computeWholeFrameRange(phases0, phases1, phases0, phases1, out.ranges, 
+                                          {98.0e6F, 91.0e6F}, {14.0F, 13.0F}, 299792458.0F, out.mFrame);
+    RawToDepthDsp::deinterleaveTaps(raw.data(), out.planes.data(), numPixels, numPixels);
+    RawToDepthDsp::deinterleaveTaps(out.smoothed5x7.data(), out.planes.data() + raw.size(), numPixels, numPixels);
+    RawToDepthDsp::computeWholeFrameRangePlanar(out.planes, phases0, phases1, out.planarRanges,
+                                                RawToDepthDsp::getPhaseUnwrap({98.0e6F, 91.0e6F}, {14.0F, 13.0F}, 299792458.0F),
+                                                out.planarMFrame);
+    return out;
+  };
+
+  auto ref = runKernels(RawToDepthSimd::Level::SCALAR);
+  for (auto level : {RawToDepthSimd::Level::NEON, RawToDepthSimd::Level::SSE2, RawToDepthSimd::Level::AVX2})
+  {
+    if (uint32_t(level) > uint32_t(simdLevel))
+    {
+      continue;
+    }
+    auto simd = runKernels(level);
+    expectNear(ref.sh2f, simd.sh2f, "sh2f");
+    ASSERT_EQ(ref.hdrMerged, simd.hdrMerged) << "hdrMerge mismatch";
+    expectNear(ref.phase, simd.phase, "calculatePhase phase");
+    expectNear(ref.signal, simd.signal, "calculatePhase signal");
+    expectNear(ref.snr, simd.snr, "calculatePhase snr"); // The SIMD snr uses a refined reciprocal square root.
+    expectNear(ref.background, simd.background, "calculatePhase background");
+    expectNear(ref.smoothed5x7, simd.smoothed5x7, "smoothRaw5x7");
+    expectNear(ref.smoothed7x15, simd.smoothed7x15, "smoothRaw7x15");
+    expectNear(ref.ranges, simd.ranges, "computeWholeFrameRange ranges");
+    expectNear(ref.mFrame, simd.mFrame, "computeWholeFrameRange mFrame");
+    expectNear(ref.smoothedPhase, simd.smoothedPhase, "calculatePhaseSmooth smoothed phase");
+    expectNear(ref.correctedPhase, simd.correctedPhase, "calculatePhaseSmooth corrected phase");
+    expectNear(ref.planes, simd.planes, "deinterleaveTaps");
+    expectNear(ref.planarRanges, simd.planarRanges, "computeWholeFrameRangePlanar ranges");
+    expectNear(ref.planarMFrame, simd.planarMFrame, "computeWholeFrameRangePlanar mFrame");
+  }
+  RawToDepthSimd::setLevel(simdLevel);
+}
+
+/**
+ * @brief Verifies that the tap-planar band stages (smoothPlanes() and computeWholeFrameRangePlanar())
+ * match smoothSummedData(), calculatePhaseSmooth() and computeWholeFrameRange() on the raw frame layout,
+ * for the specialized kernel combinations and one that falls back to smoothRaw().
+ * 
+ */
+TEST_F(RawToDepthTests, planar_band_stages_match_interleaved)
+{
+  const std::array<uint32_t,2> size { 37, 83 };
+  const auto numPixels = std::size_t(size[0]) * size[1];
+  const auto unwrap = RawToDepthDsp::getPhaseUnwrap({98.0e6F, 91.0e6F}, {14.0F, 13.0F}, C_MPS);
+
+  std::vector<std::vector<float_t>> raw(2, std::vector<float_t>(NUM_GPIXEL_PHASES * numPixels));
+  std::vector<std::vector<float_t>> phase(2, std::vector<float_t>(numPixels));
+  auto signal = std::vector<float_t>(numPixels);
+  auto snr = std::vector<float_t>(numPixels);
+  auto background = std::vector<float_t>(numPixels);
+  auto planes = std::vector<float_t>(2 * NUM_GPIXEL_PHASES * numPixels);
+  for (uint32_t freqIdx = 0; freqIdx < 2; freqIdx++)
+  {
+    for (auto &val : raw[freqIdx])
+    {
+      val = 100.0F + 4000.0F * float_t(std::rand()) / float_t(RAND_MAX);
+    }
+    RawToDepthDsp::calculatePhase(raw[freqIdx], phase[freqIdx], signal, snr, background, 4.0F);
+    RawToDepthDsp::deinterleaveTaps(raw[freqIdx].data(), planes.data() + freqIdx * NUM_GPIXEL_PHASES * numPixels,
+                                    numPixels, numPixels);
+  }
+
+  for (auto kernels : std::vector<std::array<uint32_t,2>> { {2, 3}, {1, 1}, {0, 0}, {2, 2} })
+  {
+    std::vector<std::vector<float_t>> smoothed(2, std::vector<float_t>(NUM_GPIXEL_PHASES * numPixels));
+    std::vector<std::vector<float_t>> smoothedPhase(2, std::vector<float_t>(numPixels));
+    std::vector<std::vector<float_t>> correctedPhase(2, std::vector<float_t>(numPixels));
+    for (uint32_t freqIdx = 0; freqIdx < 2; freqIdx++)
+    {
+      RawToDepthDsp::smoothSummedData(raw[freqIdx], smoothed[freqIdx], size, kernels[0], kernels[1]);
+      RawToDepthDsp::calculatePhaseSmooth(smoothed[freqIdx], smoothedPhase[freqIdx], phase[freqIdx], correctedPhase[freqIdx], freqIdx);
+    }
+    auto refRanges = std::vector<float_t>(numPixels);
+    auto refMFrame = std::vector<float_t>(numPixels);
+    RawToDepthDsp::computeWholeFrameRange(smoothedPhase[0], smoothedPhase[1], correctedPhase[0], correctedPhase[1],
+                                          refRanges, unwrap, refMFrame);
+
+    auto smoothedPlanes = std::vector<float_t>(planes.size());
+    RawToDepthDsp::smoothPlanes(planes, smoothedPlanes, size, 2 * NUM_GPIXEL_PHASES, kernels[0], kernels[1]);
+    auto ranges = std::vector<float_t>(numPixels);
+    auto mFrame = std::vector<float_t>(numPixels);
+    RawToDepthDsp::computeWholeFrameRangePlanar(smoothedPlanes, phase[0], phase[1], ranges, unwrap, mFrame);
+
+    for (std::size_t idx = 0; idx < numPixels; idx++)
+    {
+      for (uint32_t freqIdx = 0; freqIdx < 2; freqIdx++)
+      {
+        for (uint32_t tapIdx = 0; tapIdx < NUM_GPIXEL_PHASES; tapIdx++)
+        {
+          ASSERT_NEAR(smoothed[freqIdx][NUM_GPIXEL_PHASES * idx + tapIdx],
+                      smoothedPlanes[(freqIdx * NUM_GPIXEL_PHASES + tapIdx) * numPixels + idx],
+                      1.0e-5F * smoothed[freqIdx][NUM_GPIXEL_PHASES * idx + tapIdx])
+            << "smoothed tap " << tapIdx << " of frequency " << freqIdx << " at pixel " << idx
+            << " with kernels " << kernels[0] << "," << kernels[1];
+        }
+      }
+      ASSERT_EQ(refMFrame[idx], mFrame[idx]) << "pixel " << idx << " with kernels " << kernels[0] << "," << kernels[1];
+      ASSERT_NEAR(refRanges[idx], ranges[idx], 1.0e-5F * std::max(1.0F, refRanges[idx]))
+        << "pixel " << idx << " with kernels " << kernels[0] << "," << kernels[1];
+    }
+  }
+}
+
+/**
+ * @brief Verifies that the wrap counts from the precomputed phase-unwrap coefficients round the
+ * unwrap argument as roundf() does, for phases across [0, 1] including the end points.
+ * 
+ */
+TEST_F(RawToDepthTests, phase_unwrap_matches_roundf)
+{
+  const std::array<float_t, 2> freqs {98.0e6F, 91.0e6F};
+  const std::vector<float_t> fsInt {14.0F, 13.0F};
+  const auto unwrap = RawToDepthDsp::getPhaseUnwrap(freqs, fsInt, C_MPS);
+
+  const std::size_t numPixels = 4099;
+  auto phases0 = std::vector<float_t>(numPixels);
+  auto phases1 = std::vector<float_t>(numPixels);
+  for (std::size_t idx=0; idx<numPixels; idx++)
+  {
+    phases0[idx] = float_t(std::rand()) / float_t(RAND_MAX);
+    phases1[idx] = float_t(std::rand()) / float_t(RAND_MAX);
+  }
+  phases0[0] = 1.0F; phases1[0] = 0.0F;
+  phases0[1] = 0.0F; phases1[1] = 1.0F;
+  phases0[2] = 1.0F; phases1[2] = 1.0F;
+
+  auto ranges = std::vector<float_t>(numPixels);
+  auto mFrame = std::vector<float_t>(numPixels);
+  RawToDepthDsp::computeWholeFrameRange(phases0, phases1, phases0, phases1, ranges, unwrap, mFrame);
+
+  std::size_t numMismatches = 0;
+  for (std::size_t idx=0; idx<numPixels; idx++)
+  {
+    const float_t maskNegatives = phases1[idx] < phases0[idx] ? 1.0F : 0.0F;
+    const float_t mRaw = roundf(fsInt[0]*phases1[idx] - fsInt[1]*phases0[idx] + fsInt[0]*maskNegatives);
+    numMismatches += std::size_t(mFrame[idx] != mRaw + mRaw + maskNegatives);
+    ASSERT_GE(ranges[idx], 0.0F);
+  }
+  // Only arguments within a few ulps of a halfway point may round the other way.
+  EXPECT_LE(numMismatches, numPixels / 1000);
+}
+
+/**
+ * @brief Verifies that the fused ingest kernel produces the same full-frame raw and snr buffers
+ * as tapRotation() on each frequency followed by snrVoteV2(), with and without tap accumulation,
+ * and for float and raw 16-bit input.
+ * 
+ */
+TEST_F(RawToDepthTests, fused_ingest_matches_separate_kernels)
+{
+  const uint32_t roiRows = 8;
+  const uint32_t fovRows = 20;
+  const uint32_t roiStartRow = 5;
+  const uint32_t fovOffset = roiStartRow*ROI_NUM_COLUMNS;
+  const uint32_t roiImageShorts = NUM_GPIXEL_PHASES*roiRows*ROI_NUM_COLUMNS;
+  const uint32_t fovShorts = NUM_GPIXEL_PHASES*fovRows*ROI_NUM_COLUMNS;
+
+  for (auto doTapRotation : {false, true})
+  {
+    const uint32_t roiShorts = roiImageShorts * 2 * (doTapRotation ? 3 : 1);
+    auto rawU16 = std::vector<uint16_t>(roiShorts);
+    for (auto &val : rawU16)
+    {
+      val = uint16_t(std::rand());
+    }
+    auto roiVector = std::vector<float_t>(roiShorts);
+    RawToDepthDsp::sh2f(rawU16.data(), roiVector, roiShorts, INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask());
+
+    // Previously-voted data for the overlapping part of the frame.
+    auto prevSnr = std::vector<float_t>(fovRows*ROI_NUM_COLUMNS, 0.0F);
+    for (auto &val : prevSnr)
+    {
+      val = float_t(std::rand() % 1000);
+    }
+
+    auto refFov = std::vector<std::vector<float_t>>{std::vector<float_t>(fovShorts, -1.0F), std::vector<float_t>(fovShorts, -1.0F)};
+    auto refSnr = prevSnr;
+    auto roi0 = std::vector<float_t>(roiImageShorts);
+    auto roi1 = std::vector<float_t>(roiImageShorts);
+    RawToDepthDsp::tapRotation(roiVector, roi0, 0, {roiRows, ROI_NUM_COLUMNS}, NUM_GPIXEL_PHASES, doTapRotation);
+    RawToDepthDsp::tapRotation(roiVector, roi1, 1, {roiRows, ROI_NUM_COLUMNS}, NUM_GPIXEL_PHASES, doTapRotation);
+    RawToDepthDsp::snrVoteV2(roi0, roi1, refFov, refSnr, fovOffset);
+
+    auto fusedFov = std::vector<std::vector<float_t>>{std::vector<float_t>(fovShorts, -1.0F), std::vector<float_t>(fovShorts, -1.0F)};
+    auto fusedSnr = prevSnr;
+    RawToDepthDsp::ingestRoi(roiVector, {roiRows, ROI_NUM_COLUMNS}, doTapRotation, fusedFov, fusedSnr, fovOffset);
+    ASSERT_EQ(refFov, fusedFov);
+    ASSERT_EQ(refSnr, fusedSnr);
+
+    auto rawFov = std::vector<std::vector<float_t>>{std::vector<float_t>(fovShorts, -1.0F), std::vector<float_t>(fovShorts, -1.0F)};
+    auto rawSnr = prevSnr;
+    RawToDepthDsp::ingestRoi(rawU16.data(), roiShorts, INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask(), 
+                             {roiRows, ROI_NUM_COLUMNS}, doTapRotation, rawFov, rawSnr, fovOffset);
+    ASSERT_EQ(refFov, rawFov);
+    ASSERT_EQ(refSnr, rawSnr);
+  }
+}
+
+/**
+ * @brief Verifies the binning kernels specialized on the binning against a direct sum over each bin, for the whole
+ * frame and for a range of binned rows, and the specialized collapseRawRoi() against a direct weighted sum, with
+ * weights per row and per raw value.
+ */
+TEST_F(RawToDepthTests, binning_kernels_match_direct_sums)
+{
+  const uint32_t numRows = 18; // Odd-height frames clip off the bottom rows.
+  const uint32_t numCols = 40;
+  auto frame = std::vector<float_t>(NUM_GPIXEL_PHASES * numRows * numCols);
+  for (auto &val : frame)
+  {
+    val = float_t(std::rand() % 4096); // Integer values, so that the sums are exact in any order.
+  }
+  auto at = [&](uint32_t row, uint32_t col, uint32_t tap) { return frame[NUM_GPIXEL_PHASES * (row * numCols + col) + tap]; };
+
+  for (uint32_t binning : {1U, 2U, 4U})
+  {
+    ASSERT_NE(Binning::select({binning, binning}), nullptr);
+    const std::array<uint32_t,2> binnedSize = { numRows / binning, numCols / binning };
+    auto expected = std::vector<float_t>(NUM_GPIXEL_PHASES * binnedSize[0] * binnedSize[1]);
+    for (uint32_t row = 0; row < binnedSize[0]; row++)
+    {
+      for (uint32_t col = 0; col < binnedSize[1]; col++)
+      {
+        for (uint32_t tap = 0; tap < NUM_GPIXEL_PHASES; tap++)
+        {
+          float_t sum = 0.0F;
+          for (uint32_t idx = 0; idx < binning * binning; idx++)
+          {
+            sum += at(row * binning + idx / binning, col * binning + idx % binning, tap);
+          }
+          expected[NUM_GPIXEL_PHASES * (row * binnedSize[1] + col) + tap] = sum;
+        }
+      }
+    }
+    auto binned = std::vector<float_t>(expected.size(), -1.0F);
+    Binning::binMxN(frame, binned, {numRows, numCols}, {binning, binning});
+    ASSERT_EQ(binned, expected);
+
+    // Only the requested rows are written.
+    const std::array<uint32_t,2> rows = { 1, 3 };
+    auto partial = std::vector<float_t>(expected.size(), -1.0F);
+    Binning::select({binning, binning})(frame, partial, {numRows, numCols}, rows);
+    const auto binnedPitch = NUM_GPIXEL_PHASES * binnedSize[1];
+    for (std::size_t idx = 0; idx < partial.size(); idx++)
+    {
+      const bool written = idx >= rows[0] * binnedPitch && idx < rows[1] * binnedPitch;
+      ASSERT_EQ(partial[idx], written ? expected[idx] : -1.0F);
+    }
+
+    // collapseRawRoi() over the first roiRows rows, as one row binned horizontally.
+    const uint32_t roiRows = 6;
+    const uint32_t rowOffset = 1;
+    auto rowWeights = std::vector<float_t>(roiRows);
+    auto valueWeights = std::vector<float_t>(NUM_GPIXEL_PHASES * roiRows * numCols);
+    for (auto &weight : rowWeights)
+    {
+      weight = float_t(std::rand() % 4);
+    }
+    for (auto &weight : valueWeights)
+    {
+      weight = float_t(std::rand() % 4);
+    }
+    auto roi = std::vector<float_t>(frame.begin(), frame.begin() + std::ptrdiff_t(valueWeights.size()));
+    for (const auto *weights : {&rowWeights, &valueWeights})
+    {
+      auto expectedRow = std::vector<float_t>(NUM_GPIXEL_PHASES * binnedSize[1], 0.0F);
+      for (uint32_t col = 0; col < numCols / binning * binning; col++)
+      {
+        for (uint32_t tap = 0; tap < NUM_GPIXEL_PHASES; tap++)
+        {
+          for (uint32_t row = rowOffset; row < roiRows; row++)
+          {
+            const auto rawIdx = NUM_GPIXEL_PHASES * (row * numCols + col) + tap;
+            const auto weight = weights->size() == roi.size() ? (*weights)[rawIdx] : (*weights)[row];
+            expectedRow[NUM_GPIXEL_PHASES * (col / binning) + tap] += roi[rawIdx] * weight;
+          }
+        }
+      }
+      auto collapsed = std::vector<float_t>(expectedRow.size(), -1.0F);
+      RawToDepthDsp::collapseRawRoi(roi, collapsed, *weights, {1, binning}, {roiRows, numCols}, rowOffset);
+      ASSERT_EQ(collapsed, expectedRow);
+    }
+  }
+  ASSERT_EQ(Binning::select({2, 4}), nullptr);
+  ASSERT_EQ(RawToDepthDsp::selectCollapseRawRoi(3), nullptr);
+}
+
+TEST_F(RawToDepthTests, snr_weights_test)
+{
+  const std::vector<float_t> rawRoi {1, 2, 3, 4, 5, 6, 7, 8, 9, 10,11,12,
+                                     11,12,13,14,15,16,17,18,19,20,21,22,
+                                     21,22,23,24,25,26,27,28,29,30,31,32,
+                                     31,32,33,34,35,36,37,38,39,40,41,42};
+
+  std::vector<float_t> snrWeights(rawRoi.size());
+
+  const uint32_t roiWidth {4};
+  const uint32_t roiHeight {4};
+  float_t snrWeightsNumberOfSums;
+  RawToDepthDsp::computeSnrSquaredWeights(rawRoi, rawRoi, snrWeights, snrWeightsNumberOfSums, roiHeight, roiWidth);
+
+  // Verify that the columns are normalized.
+  for (auto colIdx=0; colIdx<NUM_GPIXEL_PHASES*roiWidth; colIdx++)
+  {
+    float_t columnMax = 0.0F;
+    for (auto rowIdx=0; rowIdx<roiHeight; rowIdx++)
+    {
+      auto val = snrWeights[colIdx + roiWidth*NUM_GPIXEL_PHASES*rowIdx];
+      if (columnMax < val) 
+      {
+        columnMax = val;
+      }
+    }
+    ASSERT_TRUE(fabs(1.0F-columnMax) < 1.0e-7);
+  }
+}
+
+
+TEST_F(RawToDepthTests, test_median_1d)
+{
+  const std::vector<float_t> avec {20033,20085,20153,20200,20264,20317,147,135,70,33059,107,41,21,137};
+  std::vector<float_t> bvec(avec.size());
+  RawToDepthDsp::median1d(avec, bvec, 2);
+
+  for (auto idx=0; idx<avec.size(); idx++)
+  {
+    auto aval = avec[idx];
+    auto bval = bvec[idx];
+    LLogInfo("a " << aval << " b " << bval);
+  }
+}
+
+TEST_F(RawToDepthTests, test_lumotimers)
 {
   /**
    * Measure a single event and report the elapsed time.
@@ -1595,6 +4636,52 @@ TEST_F(RawToDepthTests, raw_to_depth_tests_LogString)
   LLogSetLogLevel(LUMO_LOG_INFO);
 }
 
+/**
+ * @brief Tests the rate limit of a log call site, and that logging from several threads at once through the
+ * asynchronous backend accounts for every record.
+ */
+TEST_F(RawToDepthTests, async_logging_rate_limited)
+{
+  const uint32_t rateLimit = 5;
+  LumoLogger::setRateLimit(rateLimit);
+  LumoLogRateLimit callSite;
+  uint32_t suppressed = 0;
+  for (uint32_t idx = 0; idx < rateLimit; idx++)
+  {
+    ASSERT_TRUE(callSite.allow(suppressed));
+    ASSERT_EQ(suppressed, 0);
+  }
+  ASSERT_FALSE(callSite.allow(suppressed));
+  ASSERT_FALSE(callSite.allow(suppressed));
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  ASSERT_TRUE(callSite.allow(suppressed));
+  ASSERT_EQ(suppressed, 2);
+  LumoLogger::setRateLimit(LumoLogger::DEFAULT_RATE_LIMIT);
+
+  const uint32_t numThreads = 4;
+  const uint32_t numRecords = LumoLogger::DEFAULT_RATE_LIMIT / numThreads;
+  const auto droppedBefore = LumoLogger::getNumDropped();
+  LumoLogger::startAsync();
+  std::vector<std::thread> threads;
+  for (uint32_t threadIdx = 0; threadIdx < numThreads; threadIdx++)
+  {
+    threads.emplace_back([threadIdx]()
+    {
+      for (uint32_t recordIdx = 0; recordIdx < numRecords; recordIdx++)
+      {
+        LLogDebug("async_logging_rate_limited:thread=" << threadIdx << ",record=" << recordIdx);
+      }
+    });
+  }
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+  LumoLogger::stopAsync();
+  // Each thread's ring holds all of its records, so none are dropped even if the drain thread didn't run.
+  ASSERT_EQ(LumoLogger::getNumDropped(), droppedBefore);
+}
+
 /**
  * @brief This is the main entry point for Google Tests.
  * 
@@ -1617,3 +4704,231 @@ int main(int argc, char *argv[])
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 }
+
+#include "LumoAffinity.h"
+
+/**
+ * @brief Checks the parsing of scheduling profiles: the roles' processors and priorities, memory locking, and that a
+ *        malformed profile is rejected without replacing the loaded one.
+ */
+TEST_F(RawToDepthTests, sched_profile)
+{
+  auto path = (std::filesystem::temp_directory_path() / "sched_profile_test.conf").string();
+  auto writeProfile = [&path](const std::string &contents)
+  {
+    std::ofstream file(path);
+    file << contents;
+  };
+
+  writeProfile("# comment\n\ncapture=0:60\n whole_frame = 0 : 30\nnetwork=any\ntimesync=any:5\nmlockall=1\n");
+  ASSERT_TRUE(LumoAffinity::loadProfile(path));
+  ThreadProfile profile;
+  ASSERT_TRUE(LumoAffinity::getProfile(LumoAffinity::ROLE_CAPTURE, profile));
+  ASSERT_EQ(profile.cpus, std::vector<int>{0});
+  ASSERT_EQ(profile.fifoPriority, 60);
+  ASSERT_TRUE(LumoAffinity::getProfile(LumoAffinity::ROLE_WHOLE_FRAME, profile));
+  ASSERT_EQ(profile.cpus, std::vector<int>{0});
+  ASSERT_EQ(profile.fifoPriority, 30);
+  ASSERT_TRUE(LumoAffinity::getProfile(LumoAffinity::ROLE_NETWORK, profile));
+  ASSERT_TRUE(profile.cpus.empty());
+  ASSERT_EQ(profile.fifoPriority, 0);
+  ASSERT_TRUE(LumoAffinity::getProfile(LumoAffinity::ROLE_TIMESYNC, profile));
+  ASSERT_EQ(profile.fifoPriority, 5);
+  ASSERT_FALSE(LumoAffinity::getProfile(LumoAffinity::ROLE_RTD, profile));
+  ASSERT_TRUE(LumoAffinity::getLockMemory());
+
+  // Without a priority the role keeps the default scheduler, so this runs without privileges.
+  std::thread thread([]() { LumoAffinity::setThreadRole(LumoAffinity::ROLE_NETWORK, {LumoAffinity::A72_0}); });
+  thread.join();
+
+  for (const auto *bad : {"capture=0:100\n", "capture=-1\n", "capture=\n", "capture=0,x\n", "=0\n", "capture\n", "mlockall=yes\n"})
+  {
+    writeProfile(bad);
+    ASSERT_FALSE(LumoAffinity::loadProfile(path)) << bad;
+    ASSERT_TRUE(LumoAffinity::getProfile(LumoAffinity::ROLE_CAPTURE, profile)) << bad;
+  }
+
+  writeProfile("");
+  ASSERT_TRUE(LumoAffinity::loadProfile(path));
+  ASSERT_FALSE(LumoAffinity::getProfile(LumoAffinity::ROLE_CAPTURE, profile));
+  ASSERT_FALSE(LumoAffinity::getLockMemory());
+  ASSERT_FALSE(LumoAffinity::loadProfile(path + ".missing"));
+  std::filesystem::remove(path);
+}
+
+/**
+ * @brief Checks that RtdMetadata decodes the metadata row once when constructed: the getters return the 12-bit
+ *        values of the row, and don't follow later changes to the input buffer.
+ */
+TEST_F(RawToDepthTests, rtd_metadata_decoded_once)
+{
+  std::vector<uint16_t> row(MD_ROW_SHORTS, 0);
+  std::copy(RtdMetadata::DEFAULT_METADATA.begin(), RtdMetadata::DEFAULT_METADATA.end(), row.begin());
+  auto *mdPtr = (Metadata_t*)row.data();
+  const uint16_t roiNumRows = 20;
+  const uint16_t fovNumRows = 480;
+  const uint16_t userTag = 0xabc;
+  mdPtr->roiNumRows = uint16_t((roiNumRows << MD_SHIFT) | 0xfU); // The low bits aren't part of the value.
+  mdPtr->activeStreamBitmask = uint16_t(0x25U << MD_SHIFT);
+  mdPtr->perFovMetadata[5].fovNumRows = uint16_t(fovNumRows << MD_SHIFT);
+  mdPtr->perFovMetadata[5].userTag = uint16_t(userTag << MD_SHIFT);
+  mdPtr->adc[3] = uint16_t(0xfffU << MD_SHIFT);
+
+  const RtdMetadata mdat(row.data(), uint32_t(row.size()*sizeof(uint16_t)));
+  ASSERT_EQ(mdat.getRoiNumRows(), roiNumRows);
+  ASSERT_EQ(mdat.getFovNumRows(5), fovNumRows);
+  ASSERT_EQ(mdat.getUserTag(5), userTag);
+  ASSERT_EQ(mdat.getAdc(3), 0xfffU);
+  ASSERT_EQ(mdat.getTimestampNs(), RtdMetadata(std::vector<uint16_t>(row)).getTimestampNs());
+
+  auto activeFovs = mdat.getActiveFovs();
+  ASSERT_EQ(std::vector<uint16_t>(activeFovs.begin(), activeFovs.end()), (std::vector<uint16_t>{0, 2, 5}));
+
+  // The decoded copy doesn't depend on the input buffer.
+  std::fill(row.begin(), row.end(), 0);
+  ASSERT_EQ(mdat.getRoiNumRows(), roiNumRows);
+  ASSERT_EQ(mdat.getActiveFovs().size(), 3U);
+  auto copy = mdat;
+  ASSERT_EQ(copy.getFovNumRows(5), fovNumRows);
+}
+
+#include "RawToDepthCommon.h"
+/**
+ * @brief Checks that the spans of the packed pixel mask select the same pixels as indexing the 16-bit mask per output
+ *        pixel, including a fully masked row and pixels beyond the end of the mask, and that getRange() zeroes the
+ *        masked pixels only.
+ */
+TEST_F(RawToDepthTests, pixel_mask_spans_match_per_pixel_lookup)
+{
+  const uint16_t stride = IMAGE_WIDTH;
+  auto mask = std::vector<uint16_t>(std::size_t(stride) * MAX_IMAGE_HEIGHT);
+  for (auto &val : mask)
+  {
+    val = (std::rand() % 4) == 0 ? 0 : 0xffff;
+  }
+  const std::array<uint16_t,2> fovStart = {3, 1};
+  const std::array<uint16_t,2> fovStep = {2, 2};
+  std::fill(mask.begin() + std::ptrdiff_t(stride * (fovStart[0] + 5 * fovStep[0])),
+            mask.begin() + std::ptrdiff_t(stride * (fovStart[0] + 5 * fovStep[0] + 1)), 0); // Output row 5.
+  const std::array<uint32_t,2> size = {MAX_IMAGE_HEIGHT/2, IMAGE_WIDTH/2}; // The last row is beyond the end of the mask.
+
+  auto pixelMask = std::make_shared<const PixelMask>(mask);
+  const PixelMaskSpans spans(pixelMask, fovStart, fovStep, stride, size);
+  ASSERT_TRUE(spans.matches(pixelMask, fovStart, fovStep, stride, size));
+  ASSERT_FALSE(spans.matches(std::make_shared<const PixelMask>(mask), fovStart, fovStep, stride, size));
+  ASSERT_EQ(spans.rowBegin(5), spans.rowEnd(5));
+
+  const std::size_t numPixels = std::size_t(size[0]) * size[1];
+  auto fRanges = std::vector<float_t>(numPixels, 1.0F);
+  auto fMinMaxMask = std::vector<float_t>(numPixels, 0.0F);
+  auto fSnr = std::vector<float_t>(numPixels, 100.0F);
+  auto ranges = RawToDepthCommon::getRange(fRanges, fMinMaxMask, spans, 0, fSnr, size, false, 1.0F, 0.0F, 10.0F, 20.0F);
+
+  for (uint32_t row = 0; row < size[0]; row++)
+  {
+    std::vector<bool> inSpans(size[1], false);
+    for (auto span = spans.rowBegin(row); span != spans.rowEnd(row); span++)
+    {
+      ASSERT_LT((*span)[0], (*span)[1]);
+      std::fill(inSpans.begin() + (*span)[0], inSpans.begin() + (*span)[1], true);
+    }
+    for (uint32_t col = 0; col < size[1]; col++)
+    {
+      const auto maskIdx = std::size_t(fovStart[1] + col * fovStep[1]) + std::size_t(stride) * (fovStart[0] + row * fovStep[0]);
+      const bool enabled = maskIdx >= mask.size() || mask[maskIdx] != 0;
+      ASSERT_EQ(enabled, inSpans[col]) << "row " << row << " col " << col;
+      ASSERT_EQ(enabled, pixelMask->isEnabled(maskIdx));
+      ASSERT_EQ((*ranges)[std::size_t(row) * size[1] + col], enabled ? uint16_t(roundf(RANGE_NETWORK_SCALE)) : 0);
+    }
+  }
+
+  // Disabling the range masking passes all of the ranges.
+  ranges = RawToDepthCommon::getRange(fRanges, fMinMaxMask, spans, 0, fSnr, size, true, 1.0F, 0.0F, 10.0F, 20.0F);
+  ASSERT_EQ(std::count(ranges->begin(), ranges->end(), 0), 0);
+}
+
+/**
+ * @brief The fused output stage (RawToDepthCommon::getOutputPlanes()) matches the temperature correction followed by the
+ * separate conversions of each plane, exactly, with and without SIMD, halfway values and clipping included. Planes that
+ * aren't selected are left alone, and the planes of a recycled block are overwritten.
+ */
+TEST_F(RawToDepthTests, fused_output_planes_match_separate_conversions)
+{
+  const uint16_t stride = IMAGE_WIDTH;
+  auto mask = std::vector<uint16_t>(std::size_t(stride) * MAX_IMAGE_HEIGHT);
+  for (auto &val : mask)
+  {
+    val = (std::rand() % 8) == 0 ? 0 : 0xffff;
+  }
+  const std::array<uint32_t,2> size = {37, 101}; // Rows that aren't a multiple of the vector width.
+  const PixelMaskSpans spans(std::make_shared<const PixelMask>(mask), {2, 1}, {2, 2}, stride, size);
+  const uint32_t pixelMaskRow = 3;
+
+  const std::size_t numPixels = std::size_t(size[0]) * size[1];
+  const float_t rangeOffset = 0.3F;
+  const float_t rangeLimit = 15.0F;
+  const float_t maxRange = 20.0F;
+  const float_t snrThresh = 4.0F;
+  auto random = [](float_t max) { return max * float_t(std::rand()) / float_t(RAND_MAX); };
+  std::vector<float_t> fRanges(numPixels);
+  std::vector<float_t> fMinMaxMask(numPixels);
+  std::vector<float_t> fSnr(numPixels);
+  std::vector<float_t> fSignals(numPixels);
+  std::vector<float_t> fBackground(numPixels);
+  for (std::size_t idx = 0; idx < numPixels; idx++)
+  {
+    fRanges[idx] = random(2 * maxRange + rangeOffset) - 1.0F; // Below 0 and beyond the maximum range once corrected.
+    fMinMaxMask[idx] = (std::rand() % 16) == 0 ? 1.0F : 0.0F;
+    fSnr[idx] = idx % 5 == 0 ? float_t(2 * (std::rand() % 1000) + 1) : random(100.0F); // Halves are halfway values.
+    fSignals[idx] = idx % 3 == 0 ? float_t(2 * (std::rand() % 70000) + 1) : random(140000.0F); // Up to twice the clip.
+    fBackground[idx] = idx % 4 == 0 ? float_t(std::rand() % 70000) + 0.5F : random(70000.0F);
+  }
+
+  // The separate passes, as whole-frame processing did them.
+  std::vector<float_t> correctedRanges(fRanges);
+  for (auto &range : correctedRanges)
+  {
+    range = fmod(std::max(range - rangeOffset, 0.0F), maxRange);
+  }
+  for (const bool disableRangeMasking : {false, true})
+  {
+    FovPlanes expected;
+    RawToDepthCommon::getRange(expected.range, correctedRanges, fMinMaxMask, spans, pixelMaskRow, fSnr, size,
+                               disableRangeMasking, snrThresh, rangeOffset, rangeLimit, maxRange);
+    RawToDepthCommon::getSnr(expected.snr, fSnr);
+    RawToDepthCommon::getSignal(expected.signal, fSignals);
+    RawToDepthCommon::getBackground(expected.background, fBackground);
+    ASSERT_GT(std::count(expected.range.begin(), expected.range.end(), 0), 0);
+    ASSERT_GT(std::count(expected.signal.begin(), expected.signal.end(), 65535), 0);
+
+    const auto simdLevel = RawToDepthSimd::getLevel();
+    for (const auto level : {RawToDepthSimd::Level::SCALAR, RawToDepthSimd::detect()})
+    {
+      RawToDepthSimd::setLevel(level);
+      FovPlanes planes;
+      planes.range.assign(numPixels, 1); // A recycled block holds a previous frame.
+      planes.snr.assign(numPixels, 1);
+      planes.signal.assign(numPixels, 1);
+      planes.background.assign(numPixels, 1);
+      RawToDepthCommon::getOutputPlanes(planes, TRANSMIT_BITMASK_ALL_PLANES, fRanges, fMinMaxMask, spans, pixelMaskRow,
+                                        fSnr, fSignals, fBackground, size, disableRangeMasking, snrThresh,
+                                        rangeOffset, rangeLimit, maxRange);
+      const auto *levelName = RawToDepthSimd::getLevelName(level);
+      EXPECT_EQ(planes.range, expected.range) << levelName;
+      EXPECT_EQ(planes.snr, expected.snr) << levelName;
+      EXPECT_EQ(planes.signal, expected.signal) << levelName;
+      EXPECT_EQ(planes.background, expected.background) << levelName;
+
+      // Only the range and the selected planes are written.
+      FovPlanes rangeAndSnr;
+      RawToDepthCommon::getOutputPlanes(rangeAndSnr, TRANSMIT_BITMASK_RANGE | TRANSMIT_BITMASK_SNR, fRanges, fMinMaxMask,
+                                        spans, pixelMaskRow, fSnr, {}, {}, size, disableRangeMasking, snrThresh,
+                                        rangeOffset, rangeLimit, maxRange);
+      EXPECT_EQ(rangeAndSnr.range, expected.range) << levelName;
+      EXPECT_EQ(rangeAndSnr.snr, expected.snr) << levelName;
+      EXPECT_TRUE(rangeAndSnr.signal.empty());
+      EXPECT_TRUE(rangeAndSnr.background.empty());
+    }
+    RawToDepthSimd::setLevel(simdLevel);
+  }
+}
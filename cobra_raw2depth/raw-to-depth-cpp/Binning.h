@@ -18,23 +18,30 @@
 
 class Binning {
  public:
-  // The output buffer binnedFrame contains an exact copy of the input data.
-  static void bin1x1(const RtdVec &frame, RtdVec &binnedFrame, std::array<uint32_t,2> roiSize);
-  // The output buffer binnedFrame has been binned 2x2, with the height of the buffer div of the original height and the binning.
-  static void bin2x2(const RtdVec &frame, RtdVec &binnedFrame, std::array<uint32_t,2> roiSize, int32_t shift=0);
-  // The output buffer binnedFrame has been binned 4x4 by calling the 2x2 binning routine twice.
-  static void bin4x4(const RtdVec &frame, RtdVec &binnedFrame, std::array<uint32_t,2> roiSize);
-
-  // The common input that calls 1x1, 2x2, or 4x4 binning respectively. Only these binning rates are supported.
-  static void binMxN(const RtdVec &frame, RtdVec &binnedFrame, std::array<uint32_t,2> roiSize, std::array<uint32_t,2> binning);
-  
-  // The common input that calls th 1x1, 1x2, or 1x4 binning routines as needed. Only these binning rates are supported.
+  // The 2D routines only write the binned rows [rows[0], rows[1]), and leave the others of binnedFrame untouched.
+
+  // The 2D kernels, specialized on the binning factors. Selected once per FOV geometry with select(), so that
+  // the per-frame calls don't dispatch on the binning.
+  using Kernel = void (*)(const RtdVec &frame, RtdVec &binnedFrame, std::array<uint32_t,2> roiSize, std::array<uint32_t,2> rows);
+  // Returns the kernel for binning (rows, columns), or nullptr if it is not one of 1x1, 2x2 or 4x4.
+  static Kernel select(std::array<uint32_t,2> binning);
+
+  // Bins BIN_Y x BIN_X in a single pass: the BIN_Y rows of each binned row are summed pairwise, which vectorizes over
+  // the contiguous taps, then each BIN_X pixels of the sum. The height of binnedFrame is the integer division of
+  // roiSize[0] by BIN_Y, so odd-height ROIs clip off the bottom rows. 1x1 copies the rows.
+  template <uint32_t BIN_Y, uint32_t BIN_X>
+  static void binFrame(const RtdVec &frame, RtdVec &binnedFrame, std::array<uint32_t,2> roiSize,
+                       std::array<uint32_t,2> rows={0, UINT32_MAX});
+
+  // The common input that selects the 1x1, 2x2, or 4x4 kernel. Only these binning rates are supported.
+  static void binMxN(const RtdVec &frame, RtdVec &binnedFrame, std::array<uint32_t,2> roiSize, std::array<uint32_t,2> binning,
+                     std::array<uint32_t,2> rows={0, UINT32_MAX});
+
+  // Bins one row of roiWidth raw triplets by BIN_X, summing each BIN_X pixels pairwise. 1 copies the row.
+  template <uint32_t BIN_X>
+  static void binRow(const float_t *rawRow, float_t *binnedRow, uint32_t roiWidth);
+
+  // The common input that calls the 1x1, 1x2, or 1x4 row binning as needed. Only these binning rates are supported.
   static void bin1xN(const RtdVec &rawRoi, RtdVec &binnedRawRoi, uint32_t roiWidth, uint32_t binX);
-  // The output buffer binnedRawRoi is identical to the input rawRoi buffer.
-  static void bin1x1(const RtdVec &rawRoi, RtdVec &binnedRawRoi, uint32_t roiWidth);
-  // The output buffer has been binned by 2, with the size of the buffer being the integer division of the input buffer width and 2.
-  static void bin1x2(const RtdVec &rawRoi, RtdVec &binnedRawRoi, uint32_t roiWidth);
-  // The output buffer binnedRawRoi has been binned by 4, with the width of the buffer being the integer division of the input buffer size and 4.
-  static void bin1x4(const RtdVec &rawRoi, RtdVec &binnedRawRoi, uint32_t roiWidth);
 
 };
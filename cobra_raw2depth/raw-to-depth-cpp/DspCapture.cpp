@@ -0,0 +1,312 @@
+/**
+ * @file DspCapture.cpp
+ * @brief Sampled capture of the DSP intermediates of grid-mode frames, written out on a background thread.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "DspCapture.h"
+#include "RoiContainer.h"
+#include "LumoLogger.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+std::atomic<uint32_t> DspCapture::_interval { 0 };
+
+namespace
+{
+constexpr std::size_t alignUp(std::size_t size, std::size_t alignment) { return (size + alignment - 1) / alignment * alignment; }
+
+uint64_t nanoseconds(std::chrono::nanoseconds duration) { return uint64_t(duration.count()); }
+
+std::atomic<uint64_t> sampledFrames { 0 };
+std::atomic<uint64_t> skippedFrames { 0 };
+std::atomic<uint64_t> writtenCaptures { 0 };
+std::atomic<uint64_t> writeErrors { 0 };
+
+/**
+ * @brief The thread that writes out the captures of all FOVs, in the order they were queued.
+ */
+class Writer
+{
+public:
+  Writer() = default;
+  Writer(Writer &other) = delete;
+  Writer(Writer &&other) = delete;
+  Writer &operator=(Writer &rhs) = delete;
+  Writer &operator=(Writer &&rhs) = delete;
+
+  ~Writer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _quit = true;
+    }
+    _conditionVariable.notify_all();
+    if (_thread.joinable())
+    {
+      _thread.join();
+    }
+  }
+
+  void setPrefix(const std::string &prefix)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _prefix = prefix;
+    if (!_thread.joinable())
+    {
+      _thread = std::thread(&Writer::run, this);
+    }
+  }
+
+  void push(std::shared_ptr<DspSnapshot> snapshot)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _queue.push_back(std::move(snapshot));
+    }
+    _conditionVariable.notify_all();
+  }
+
+  void flush()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _conditionVariable.wait(lock, [this] { return (_queue.empty() && !_busy) || !_thread.joinable(); });
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+      _conditionVariable.wait(lock, [this] { return _quit || !_queue.empty(); });
+      if (_queue.empty())
+      {
+        return; // _quit, and everything queued has been written.
+      }
+      auto snapshot = std::move(_queue.front());
+      _queue.pop_front();
+      _busy = true;
+      auto base = getBase(*snapshot);
+      lock.unlock();
+
+      auto &counter = writeCapture(base, *snapshot) ? writtenCaptures : writeErrors;
+      counter.fetch_add(1, std::memory_order_relaxed);
+      snapshot = nullptr; // Frees the snapshot for its FOV.
+
+      lock.lock();
+      _busy = false;
+      _conditionVariable.notify_all();
+    }
+  }
+
+  std::string getBase(const DspSnapshot &snapshot)
+  {
+    std::stringstream base;
+    base << _prefix << '_' << snapshot.headNum << '_' << std::setfill('0') << std::setw(2) << snapshot.fovIdx << '_'
+         << std::setw(6) << _captureNum++;
+    return base.str();
+  }
+
+  static bool writeCapture(const std::string &base, const DspSnapshot &snapshot)
+  {
+    if (!writeRois(RoiContainerReader::segmentPath(base, 0), snapshot))
+    {
+      return false;
+    }
+
+    auto name = base + DSP_CAPTURE_EXTENSION;
+    std::ofstream file(name, std::ios::out | std::ios::binary | std::ios::trunc);
+    DspCaptureHeader header {};
+    memcpy(header.magic, DSP_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = DSP_CAPTURE_VERSION;
+    header.headNum = snapshot.headNum;
+    header.fovIdx = snapshot.fovIdx;
+    header.rows = snapshot.size[0];
+    header.columns = snapshot.size[1];
+    header.numRois = uint32_t(snapshot.roiSizes.size());
+    header.frameNum = snapshot.frameNum;
+    header.captureNs = snapshot.captureNs;
+    file.write((const char *)&header, sizeof(header));
+    for (const auto *plane : {&snapshot.phase0, &snapshot.phase1, &snapshot.mFrame, &snapshot.minMaxMask})
+    {
+      file.write((const char *)plane->data(), std::streamsize(plane->size() * sizeof(float_t)));
+    }
+    file.write((const char *)snapshot.range.data(), std::streamsize(snapshot.range.size() * sizeof(uint16_t)));
+    file.close();
+    if (!file)
+    {
+      LLogErr("dsp_capture_write:name=" << name << ":can't write capture file");
+      return false;
+    }
+    return true;
+  }
+
+  // The ROIs as one closed segment: the header, the records and the index, with the same layout the RoiRecorder writes.
+  static bool writeRois(const std::string &name, const DspSnapshot &snapshot)
+  {
+    std::ofstream file(name, std::ios::out | std::ios::binary | std::ios::trunc);
+    RoiContainerHeader header {};
+    memcpy(header.magic, ROI_CONTAINER_MAGIC, sizeof(header.magic));
+    header.version = ROI_CONTAINER_VERSION;
+    header.headerSize = ROI_CONTAINER_ALIGNMENT;
+    header.headNum = snapshot.headNum;
+    header.numRois = snapshot.roiSizes.size();
+    header.sessionStartNs = snapshot.captureNs;
+    header.closed = 1;
+
+    std::vector<RoiIndexEntry> index;
+    index.reserve(snapshot.roiSizes.size());
+    uint64_t offset = header.headerSize;
+    for (std::size_t roiIdx = 0; roiIdx < snapshot.roiSizes.size(); roiIdx++)
+    {
+      index.push_back({ offset + sizeof(RoiRecordHeader), snapshot.roiSizes[roiIdx], 0, roiIdx });
+      offset += alignUp(sizeof(RoiRecordHeader) + snapshot.roiSizes[roiIdx], ROI_RECORD_ALIGNMENT);
+    }
+    header.dataEnd = offset;
+    header.indexOffset = offset;
+
+    std::vector<char> headerBlock(header.headerSize);
+    memcpy(headerBlock.data(), &header, sizeof(header));
+    file.write(headerBlock.data(), std::streamsize(headerBlock.size()));
+
+    const std::array<char, ROI_RECORD_ALIGNMENT> padding {};
+    const auto *roi = snapshot.rois.data();
+    for (std::size_t roiIdx = 0; roiIdx < snapshot.roiSizes.size(); roiIdx++)
+    {
+      const auto size = snapshot.roiSizes[roiIdx];
+      const RoiRecordHeader record { ROI_RECORD_ROI, size, roiIdx, snapshot.roiNs[roiIdx] };
+      file.write((const char *)&record, sizeof(record));
+      file.write((const char *)roi, size);
+      file.write(padding.data(), std::streamsize(alignUp(sizeof(record) + size, ROI_RECORD_ALIGNMENT) - sizeof(record) - size));
+      roi += size;
+    }
+    file.write((const char *)index.data(), std::streamsize(index.size() * sizeof(RoiIndexEntry)));
+    file.close();
+    if (!file)
+    {
+      LLogErr("dsp_capture_write:name=" << name << ":can't write ROI container");
+      return false;
+    }
+    return true;
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _conditionVariable;
+  std::deque<std::shared_ptr<DspSnapshot>> _queue;
+  std::string _prefix;
+  uint64_t _captureNum = 0;
+  bool _busy = false;
+  bool _quit = false;
+  std::thread _thread;
+};
+
+Writer writer;
+} // namespace
+
+void DspSnapshot::addRoi(const uint16_t *roi, uint32_t numBytes)
+{
+  rois.insert(rois.end(), (const uint8_t *)roi, (const uint8_t *)roi + numBytes);
+  roiSizes.push_back(numBytes);
+  roiNs.push_back(nanoseconds(std::chrono::steady_clock::now().time_since_epoch()));
+}
+
+void DspSnapshot::setSize(std::array<uint32_t,2> planeSize)
+{
+  size = planeSize;
+  const auto numPixels = std::size_t(size[0]) * size[1];
+  for (auto *plane : {&phase0, &phase1, &mFrame, &minMaxMask})
+  {
+    plane->assign(numPixels, 0.0F);
+  }
+  range.assign(numPixels, 0);
+}
+
+void DspCapture::configure(const std::string &prefix, uint32_t interval)
+{
+  if (interval > 0)
+  {
+    writer.setPrefix(prefix);
+  }
+  _interval.store(interval, std::memory_order_relaxed);
+}
+
+void DspCapture::flush()
+{
+  writer.flush();
+}
+
+DspCapture::Stats DspCapture::getStats()
+{
+  Stats stats = {};
+  stats.sampled = sampledFrames.load(std::memory_order_relaxed);
+  stats.skipped = skippedFrames.load(std::memory_order_relaxed);
+  stats.written = writtenCaptures.load(std::memory_order_relaxed);
+  stats.writeErrors = writeErrors.load(std::memory_order_relaxed);
+  return stats;
+}
+
+std::string DspCapture::getReport()
+{
+  const auto stats = getStats();
+  std::ostringstream report;
+  report << "dspCaptureInterval=" << getInterval() <<
+            ",dspCaptureSampled=" << stats.sampled <<
+            ",dspCaptureSkipped=" << stats.skipped <<
+            ",dspCaptureWritten=" << stats.written <<
+            ",dspCaptureWriteErrors=" << stats.writeErrors << "\n";
+  return report.str();
+}
+
+std::shared_ptr<DspSnapshot> DspCapture::startFrame()
+{
+  const auto interval = getInterval();
+  const auto frameNum = _frameNum++;
+  if (interval == 0 || frameNum % interval != 0)
+  {
+    return nullptr;
+  }
+
+  // The second snapshot is only allocated once the first is found busy.
+  for (auto &snapshot : _snapshots)
+  {
+    if (snapshot == nullptr)
+    {
+      snapshot = std::make_shared<DspSnapshot>();
+    }
+    bool inUse = false;
+    if (!snapshot->inUse.compare_exchange_strong(inUse, true, std::memory_order_acquire))
+    {
+      continue;
+    }
+    snapshot->headNum = _headNum;
+    snapshot->fovIdx = _fovIdx;
+    snapshot->frameNum = frameNum;
+    snapshot->captureNs = nanoseconds(std::chrono::system_clock::now().time_since_epoch());
+    snapshot->rois.clear();
+    snapshot->roiSizes.clear();
+    snapshot->roiNs.clear();
+    snapshot->size = {0, 0};
+    sampledFrames.fetch_add(1, std::memory_order_relaxed);
+    // The handle holds on to the snapshot, and marks it free when it's released.
+    return std::shared_ptr<DspSnapshot>(snapshot.get(), [owner = snapshot](DspSnapshot *ptr) {
+      ptr->inUse.store(false, std::memory_order_release);
+    });
+  }
+  skippedFrames.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+void DspCapture::write(std::shared_ptr<DspSnapshot> snapshot)
+{
+  writer.push(std::move(snapshot));
+}
@@ -0,0 +1,127 @@
+/**
+ * @file DspCapture.h
+ * @brief Sampled capture of the DSP intermediates of grid-mode frames, for debugging in the field.
+ *
+ * One frame in every N of each FOV is snapshotted: the raw ROIs as they were received, the smoothed phases of both
+ * frequencies, the M values, the min-max mask and the output range. Each FOV has two snapshots, so that one can be
+ * filled while the other is being written out. A frame is only sampled if one of them is free; otherwise it is
+ * skipped rather than waited for, so the processing threads never wait on the disk. They only copy into the snapshot,
+ * and a single background thread writes out each capture as:
+ *   1. '<prefix>_h_ff_nnnnnn_000.rois': the raw ROIs, as a closed, single-segment RoiContainer, which the
+ *      benchmark (--rois) and mock replay read as they are.
+ *   2. '<prefix>_h_ff_nnnnnn.dsp': a DspCaptureHeader, followed by the phase0, phase1, mFrame and minMaxMask planes
+ *      (float) and the range plane (uint16_t), each of rows x columns in the binned geometry of the FOV.
+ * where h is the head number, ff the FOV index and nnnnnn the capture number, counted from 0 across all FOVs.
+ *
+ * The snapshots of an FOV are allocated at its first sampled frame and keep their capacity afterwards, so that
+ * sampling doesn't allocate once the FOV geometry has been seen. Streamed segments aren't captured whole.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+constexpr char DSP_CAPTURE_MAGIC[8]        { 'L', 'U', 'M', 'O', 'D', 'S', 'P', 'C' };
+constexpr uint32_t DSP_CAPTURE_VERSION     { 1 };
+constexpr const char *DSP_CAPTURE_EXTENSION { ".dsp" };
+
+struct DspCaptureHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t headNum;
+  uint32_t fovIdx;
+  uint32_t rows;            ///< The size of each plane, in the binned geometry of the FOV
+  uint32_t columns;
+  uint32_t numRois;         ///< The ROIs in the companion .rois file
+  uint64_t frameNum;        ///< The FOV's frame counter at the captured frame, counted from 0
+  uint64_t captureNs;       ///< CLOCK_REALTIME when the first ROI of the frame was received
+};
+
+/**
+ * @brief The intermediates of one sampled frame. Filled by the ingest and whole-frame processing threads of its FOV,
+ *        one after the other, then read by the writer thread.
+ */
+struct DspSnapshot
+{
+  uint32_t headNum = 0;
+  uint32_t fovIdx = 0;
+  uint64_t frameNum = 0;
+  uint64_t captureNs = 0;
+  std::vector<uint8_t> rois;      ///< The raw ROIs of the frame, back to back
+  std::vector<uint32_t> roiSizes;
+  std::vector<uint64_t> roiNs;    ///< CLOCK_MONOTONIC when each ROI was received
+  std::array<uint32_t,2> size {};
+  std::vector<float_t> phase0;    ///< The smoothed phases
+  std::vector<float_t> phase1;
+  std::vector<float_t> mFrame;
+  std::vector<float_t> minMaxMask;
+  std::vector<uint16_t> range;    ///< The range plane of the output FovSegment
+  std::atomic<bool> inUse { false };
+
+  void addRoi(const uint16_t *roi, uint32_t numBytes);
+  void setSize(std::array<uint32_t,2> size); ///< Sizes the planes, and zeroes them.
+};
+
+/**
+ * @brief Samples the frames of one FOV. Used from the ROI ingest thread of the FOV.
+ */
+class DspCapture
+{
+public:
+  /**
+   * @brief The captures since startup, over all FOVs.
+   */
+  struct Stats
+  {
+    uint64_t sampled;     ///< Frames that were snapshotted.
+    uint64_t skipped;     ///< Frames due for sampling while both snapshots of their FOV were busy.
+    uint64_t written;     ///< Captures written out.
+    uint64_t writeErrors; ///< Captures that couldn't be written.
+  };
+
+  /**
+   * @brief Samples one frame in every interval of each FOV from now on, and writes the captures to files starting
+   * with prefix. An interval of 0 disables the capture. Starts the writer thread the first time it is enabled.
+   */
+  static void configure(const std::string &prefix, uint32_t interval);
+  static uint32_t getInterval() { return _interval.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Waits until all of the captures queued so far have been written.
+   */
+  static void flush();
+  static Stats getStats();
+  static std::string getReport(); ///< One line with the counters of getStats().
+
+  DspCapture(uint32_t headNum, uint32_t fovIdx) : _headNum(headNum), _fovIdx(fovIdx) {}
+
+  /**
+   * @brief Called at the first ROI of each frame.
+   *
+   * @return A cleared snapshot to fill if the frame is sampled, or nullptr. The snapshot is free for reuse once
+   *         the last reference to it is released, whether or not it was written out.
+   */
+  std::shared_ptr<DspSnapshot> startFrame();
+
+  /**
+   * @brief Queues a filled snapshot for the writer thread.
+   */
+  static void write(std::shared_ptr<DspSnapshot> snapshot);
+
+private:
+  static std::atomic<uint32_t> _interval;
+
+  const uint32_t _headNum;
+  const uint32_t _fovIdx;
+  uint64_t _frameNum = 0;
+  std::array<std::shared_ptr<DspSnapshot>,2> _snapshots;
+};
@@ -0,0 +1,52 @@
+/**
+ * @file FovPlanes.cpp
+ * @brief The output planes of an FOV segment, allocated together and recycled through a per-FOV pool.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "FovPlanes.h"
+
+std::atomic<uint64_t> FovPlanesPool::_totalAllocations { 0 };
+
+std::shared_ptr<FovPlanes> FovPlanesPool::get()
+{
+  std::unique_ptr<FovPlanes> planes;
+  {
+    std::lock_guard lock(_state->mutex);
+    if (!_state->free.empty())
+    {
+      planes = std::move(_state->free.back());
+      _state->free.pop_back();
+    }
+  }
+  if (!planes)
+  {
+    planes = std::make_unique<FovPlanes>();
+    _state->numAllocations.fetch_add(1, std::memory_order_relaxed);
+    _totalAllocations.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::weak_ptr<State> weakState = _state;
+  return std::shared_ptr<FovPlanes>(planes.release(), [weakState](FovPlanes *released)
+  {
+    std::unique_ptr<FovPlanes> owned(released);
+    auto state = weakState.lock();
+    if (!state)
+    {
+      return;
+    }
+    std::lock_guard lock(state->mutex);
+    if (state->free.size() < MAX_FREE)
+    {
+      state->free.push_back(std::move(owned));
+    }
+  });
+}
+
+std::size_t FovPlanesPool::getNumFree() const
+{
+  std::lock_guard lock(_state->mutex);
+  return _state->free.size();
+}
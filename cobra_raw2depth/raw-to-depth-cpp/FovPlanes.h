@@ -0,0 +1,75 @@
+/**
+ * @file FovPlanes.h
+ * @brief The output planes of an FOV segment, allocated together and recycled through a per-FOV pool.
+ *
+ * Whole-frame processing writes the range, SNR, signal and background planes and the per-row ROI indices of each FOV segment into one
+ * FovPlanes block drawn from the FOV's pool. The FovSegment hands out the planes as aliases of the block, so the block
+ * returns to the pool when the consumer (e.g. the network streamer) releases the last of them. In steady state the
+ * planes keep their capacity from frame to frame, and producing an FOV segment doesn't touch the heap.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief The per-pixel output planes and per-ROI timestamps of one FOV segment.
+ */
+struct FovPlanes
+{
+  std::vector<uint16_t> range;
+  std::vector<uint16_t> snr;
+  std::vector<uint16_t> signal;
+  std::vector<uint16_t> background;
+  std::vector<uint16_t> roiIndexRows; ///< One per row
+  std::vector<uint64_t> timestamps;
+  std::vector<std::vector<uint32_t>> timestampsVec;
+
+  // An alias of one of the planes that keeps the whole block alive, e.g. plane(planes, &FovPlanes::range).
+  template <typename T>
+  static std::shared_ptr<T> plane(const std::shared_ptr<FovPlanes> &planes, T FovPlanes::*member)
+  {
+    return std::shared_ptr<T>(planes, &((*planes).*member));
+  }
+};
+
+class FovPlanesPool {
+public:
+  static constexpr std::size_t MAX_FREE { 8 }; ///< Further releases free the block.
+
+  FovPlanesPool() = default;
+  FovPlanesPool(FovPlanesPool &other) = delete;
+  FovPlanesPool(FovPlanesPool &&other) = delete;
+  FovPlanesPool &operator=(FovPlanesPool &rhs) = delete;
+  FovPlanesPool &operator=(FovPlanesPool &&rhs) = delete;
+  ~FovPlanesPool() = default; ///< Blocks still in use are freed when they are released.
+
+  /**
+   * @brief Returns a free block, or a new one if there are none. The planes hold the values of a previous frame.
+   * The block returns to the pool when the last reference to it (or to one of its planes) is released, from any thread.
+   */
+  std::shared_ptr<FovPlanes> get();
+
+  std::size_t getNumFree() const;
+  uint64_t getNumAllocations() const { return _state->numAllocations.load(std::memory_order_relaxed); } ///< Blocks created by get().
+
+  static uint64_t getTotalAllocations() { return _totalAllocations.load(std::memory_order_relaxed); } ///< Summed over all pools.
+
+private:
+  // Shared with the deleters of the blocks in use, which may outlive the pool.
+  struct State
+  {
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<FovPlanes>> free; ///< Guarded by mutex.
+    std::atomic<uint64_t> numAllocations { 0 };
+  };
+
+  std::shared_ptr<State> _state { std::make_shared<State>() };
+  static std::atomic<uint64_t> _totalAllocations;
+};
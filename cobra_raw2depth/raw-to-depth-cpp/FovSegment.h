@@ -9,9 +9,14 @@
 
 #pragma once
 #include "MappingTable.h"
+#include "LatencyHistogram.h"
 
+#include <array>
 #include <cstdint>
 #include <cassert>
+#include <memory>
+#include <string>
+#include <vector>
 
 class FovSegment {
 private:
@@ -23,6 +28,7 @@ private:
 
   std::shared_ptr<MappingTable> _mappingTable = nullptr; ///< Holds the mapping table if a new one has been provided
   bool _newMappingTableAvailable = false; ///< Indicates whether the mapping table has been updated since the last time it was read by the consumer.
+  FrameTrace _frameTrace; ///< The latency trace points of this FOV, stamped as it moves through the pipeline.
 
   const bool _frameCompleted; ///< True indicates whether whether this is the only, or the last in a series of, FovSegments for this FOV.
   const double _gcf;          ///< The greatest common frequency for this acquisition.
@@ -39,10 +45,10 @@ private:
   const std::shared_ptr<std::vector<uint16_t>> _signal;  ///< The signal component for this output FOV
   const std::shared_ptr<std::vector<uint16_t>> _background; ///< The background component for this output FOV
 
-  ///< An image the same size as other output components for this FOV. This buffer contains indices that indicate
-  ///< which ROI was used to acquire each data point. This index can be used to index into the _timestamps or 
-  ///< _timestampsVec vectors to get timestamps for each individual pixel.
-  const std::shared_ptr<std::vector<uint16_t>> _roiIndexFov;
+  ///< One entry per output row, the index of the ROI that acquired the row. Since the ROIs cover whole rows of the
+  ///< sensor, this is the provenance of every pixel in the row. It indexes into the _timestamps or _timestampsVec
+  ///< vectors to get the timestamp of each row.
+  const std::shared_ptr<std::vector<uint16_t>> _roiIndexRows;
 
   ///< 64-bit timestamp, that is the lower 60 bits of the 7 12-bit metadata values.
   const std::shared_ptr<std::vector<uint64_t>> _timestamps;
@@ -50,6 +56,10 @@ private:
   const std::shared_ptr<std::vector<std::vector<uint32_t>>> _timestampsVec;
   ///< A string containing a report of timing during this acquisition.
   const std::string _timerReport;
+  ///< The x, then y, then z plane of the points of this FOV in 1/RANGE_NETWORK_SCALE meters, if XYZ output is enabled.
+  std::shared_ptr<std::vector<int32_t>> _xyz = nullptr;
+  uint32_t _firstRow = 0;    ///< The row of the whole FOV that the first row of this segment is, if the FOV is streamed in segments.
+  uint32_t _fovNumRows = 0;  ///< The number of rows in the whole FOV, or 0 if this segment is the whole FOV.
   
 public:
   FovSegment(uint32_t fovIdx,
@@ -69,7 +79,7 @@ public:
       std::shared_ptr<std::vector<uint16_t>> snr = nullptr,
       std::shared_ptr<std::vector<uint16_t>> signal = nullptr,
       std::shared_ptr<std::vector<uint16_t>> background = nullptr,
-      std::shared_ptr<std::vector<uint16_t>> roiIndices = nullptr,
+      std::shared_ptr<std::vector<uint16_t>> roiIndexRows = nullptr,
       std::shared_ptr<std::vector<uint64_t>> timestamps = nullptr,
       std::shared_ptr<std::vector<std::vector<uint32_t>>> timestampsVec = nullptr,
       std::string timerReport = ""
@@ -91,7 +101,7 @@ public:
     _snr(snr),
     _signal(signal),
     _background(background),
-    _roiIndexFov(roiIndices),
+    _roiIndexRows(roiIndexRows),
     _timestamps(timestamps),
     _timestampsVec{timestampsVec},
     _timerReport(timerReport)
@@ -113,14 +123,18 @@ public:
     { 
       assert(background->size() == imageArea); 
     }
-    if (roiIndices) 
+    if (roiIndexRows) 
     { 
-      assert(roiIndices->size() == imageArea); 
+      assert(roiIndexRows->size() == _imageSize[0]); 
     }
   }
 
   void setMappingTable(std::shared_ptr<MappingTable> table) { _mappingTable = table; }
   void setNewMappingTable(bool newTableAvailable) { _newMappingTableAvailable = newTableAvailable; }
+  void setFrameTrace(const FrameTrace &trace) { _frameTrace = trace; }
+  void setXyz(std::shared_ptr<std::vector<int32_t>> xyz) { assert(!xyz || xyz->size() == 3 * _ranges->size()); _xyz = std::move(xyz); }
+  void setSegmentRows(uint32_t firstRow, uint32_t fovNumRows) { _firstRow = firstRow; _fovNumRows = fovNumRows; }
+  const FrameTrace &getFrameTrace() const { return _frameTrace; }
   
   const std::vector<uint32_t>    &getImageSize() const { return _imageSize; }
   const std::vector<uint32_t>    &getMappingTableTopLeft() const { return _mappingTableTopLeft; }
@@ -134,22 +148,32 @@ public:
   uint16_t getSensorId()  const { return _sensorId; }
   uint16_t getUserTag()   const{ return _userTag; }
   bool getFrameCompleted() const { return _frameCompleted; }
+  uint32_t getFirstRow() const { return _firstRow; } ///< Of this segment, in the rows of the whole FOV.
+  uint32_t getFovNumRows() const { return _fovNumRows != 0 ? _fovNumRows : _imageSize[0]; } ///< Of the whole FOV.
   double getGcf() const { return _gcf; }
   double getMaxUnambiguousRange() const { return _maxUnambiguousRange; }
 
+  // The SNR, signal and background are nullptr if the FOV's metadata didn't select them (see RtdMetadata::getOutputPlanes()).
   std::shared_ptr<std::vector<uint16_t>> getRange() const { return _ranges; }
   std::shared_ptr<std::vector<uint16_t>> getSnrSquared() const { return _snr; }
   std::shared_ptr<std::vector<uint16_t>> getSnr() const { return _snr; }
   std::shared_ptr<std::vector<uint16_t>> getBackground() const { return _background; }
   std::shared_ptr<std::vector<uint16_t>> getSignal() const { return _signal; }
-  std::shared_ptr<std::vector<uint16_t>> getRoiIndexFov() const { return _roiIndexFov; }
+  std::shared_ptr<std::vector<uint16_t>> getRoiIndexRows() const { return _roiIndexRows; } ///< One ROI index per output row.
   std::shared_ptr<std::vector<uint64_t>> getTimestamps() const { return _timestamps; }
   std::shared_ptr<std::vector<std::vector<uint32_t>>> getTimestampsVec() const { return _timestampsVec; }
+  std::shared_ptr<std::vector<int32_t>> getXyz() const { return _xyz; }
 
-  std::shared_ptr<std::vector<int32_t>> getCalibrationX()     const { return _mappingTable ? _mappingTable->getCalibrationX() : nullptr; }
-  std::shared_ptr<std::vector<int32_t>> getCalibrationY()     const { return _mappingTable ? _mappingTable->getCalibrationY() : nullptr; }
-  std::shared_ptr<std::vector<int32_t>> getCalibrationTheta() const { return _mappingTable ? _mappingTable->getCalibrationTheta() : nullptr;}
-  std::shared_ptr<std::vector<int32_t>> getCalibrationPhi()   const { return _mappingTable ? _mappingTable->getCalibrationPhi() : nullptr; }
+  std::shared_ptr<const CalibrationPlane> getCalibrationX()     const { return _mappingTable ? _mappingTable->getCalibrationX() : nullptr; }
+  std::shared_ptr<const CalibrationPlane> getCalibrationY()     const { return _mappingTable ? _mappingTable->getCalibrationY() : nullptr; }
+  std::shared_ptr<const CalibrationPlane> getCalibrationTheta() const { return _mappingTable ? _mappingTable->getCalibrationTheta() : nullptr;}
+  std::shared_ptr<const CalibrationPlane> getCalibrationPhi()   const { return _mappingTable ? _mappingTable->getCalibrationPhi() : nullptr; }
+
+  ///< The mapping table entries of the pixels of this FOV, looked up on demand
+  MappingTableWindow getMappingTableWindow() const {
+    return MappingTableWindow(_mappingTable, {_mappingTableTopLeft[0], _mappingTableTopLeft[1]},
+                              {_mappingTableStep[0], _mappingTableStep[1]});
+  }
 
   bool isNewMappingTableAvailable() const { return _newMappingTableAvailable; }
 
@@ -0,0 +1,95 @@
+/**
+ * @file LoadShedder.cpp
+ * @brief Degrades the whole-frame processing of an FOV in defined steps while it can't keep up with the frame rate.
+ *
+ * @copyright Copyright (C) 2024 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "LoadShedder.h"
+#include "LumoLogger.h"
+#include <algorithm>
+
+LoadShedder::LoadShedder(uint32_t headerNum, uint32_t fovIdx, Config config) :
+  _headerNum(headerNum),
+  _fovIdx(fovIdx),
+  _config(config)
+{
+}
+
+bool LoadShedder::addFrame(uint64_t latencyNs, uint64_t framePeriodNs)
+{
+  if (framePeriodNs == 0)
+  {
+    return false;
+  }
+
+  // Exponential smoothing over about four frames, so that a single slow frame doesn't count as overload.
+  const auto frameLoad = float(double(latencyNs) / double(framePeriodNs));
+  auto load = _load.load(std::memory_order_relaxed);
+  load += (frameLoad - load) * 0.25F;
+  _load.store(load, std::memory_order_relaxed);
+
+  const auto level = _level.load(std::memory_order_relaxed);
+  _overloadedRun = load > _config.overloadLoad ? _overloadedRun + 1 : 0;
+  _headroomRun = load < _config.headroomLoad ? _headroomRun + 1 : 0;
+
+  auto newLevel = level;
+  if (_overloadedRun >= _config.overloadFrames && level < std::min(_config.maxLevel, uint32_t(NUM_LEVELS) - 1))
+  {
+    newLevel = level + 1;
+    _degraded.fetch_add(1, std::memory_order_relaxed);
+  }
+  else if (_headroomRun >= _config.headroomFrames && level > FULL_QUALITY)
+  {
+    newLevel = level - 1;
+    _restored.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (newLevel == level)
+  {
+    return false;
+  }
+
+  // The frames already queued were configured at the previous level, so each step waits for a full run of its own.
+  _overloadedRun = 0;
+  _headroomRun = 0;
+  _level.store(newLevel, std::memory_order_relaxed);
+  LLogInfo("load_shedding:head=" << _headerNum << ",fov=" << _fovIdx << ",level=" << getLevelName(newLevel) <<
+           ",previous=" << getLevelName(level) << ",load=" << load);
+  return true;
+}
+
+bool LoadShedder::skipFrame()
+{
+  _completedFrames++;
+  if (getLevel() < SKIP_FRAMES || _config.skipInterval == 0 || _completedFrames % _config.skipInterval != 0)
+  {
+    return false;
+  }
+  _skippedFrames.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+LoadShedder::Stats LoadShedder::getStats() const
+{
+  Stats stats;
+  stats.level = _level.load(std::memory_order_relaxed);
+  stats.load = _load.load(std::memory_order_relaxed);
+  stats.degraded = _degraded.load(std::memory_order_relaxed);
+  stats.restored = _restored.load(std::memory_order_relaxed);
+  stats.skippedFrames = _skippedFrames.load(std::memory_order_relaxed);
+  return stats;
+}
+
+const char *LoadShedder::getLevelName(uint32_t level)
+{
+  switch (level)
+  {
+    case FULL_QUALITY: return "full_quality";
+    case NO_NEAREST_NEIGHBOR: return "no_nearest_neighbor";
+    case NO_GHOST_MEDIAN: return "no_ghost_median";
+    case CHEAP_SMOOTHING: return "cheap_smoothing";
+    case SKIP_FRAMES: return "skip_frames";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,96 @@
+/**
+ * @file LoadShedder.h
+ * @brief Degrades the whole-frame processing of an FOV in defined steps while it can't keep up with the frame rate,
+ *        and restores full quality once there is headroom again.
+ *
+ * The load of a frame is the time from its last ROI to the end of its whole-frame processing, including the wait for
+ * the processing thread, divided by the time since the previous frame of the FOV completed. A load above 1 means that
+ * frames pile up in the frame queue, where they would eventually be dropped (or stall the ingest) at random. The
+ * loads are smoothed, and a step is only taken after a run of frames above overloadLoad, and undone after a longer
+ * run below headroomLoad, so that the quality doesn't flap.
+ *
+ * @copyright Copyright (C) 2024 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+class LoadShedder
+{
+public:
+  /**
+   * @brief The steps of degradation, in the order they are taken. Each one includes the ones before it.
+   */
+  enum Level : uint32_t
+  {
+    FULL_QUALITY = 0,    ///< Nothing is degraded.
+    NO_NEAREST_NEIGHBOR, ///< The nearest-neighbor outlier filter is off.
+    NO_GHOST_MEDIAN,     ///< The ghost median filter is off.
+    CHEAP_SMOOTHING,     ///< The smoothing kernels are at most CHEAP_KERNEL_IDX.
+    SKIP_FRAMES,         ///< Every skipInterval-th frame is skipped. Only for the FOVs whose maxLevel allows it.
+    NUM_LEVELS
+  };
+  static constexpr uint32_t CHEAP_KERNEL_IDX { 1 }; ///< The 3-tap smoothing kernel.
+
+  struct Config
+  {
+    float overloadLoad = 0.9F;           ///< A smoothed load above this counts towards the next step.
+    float headroomLoad = 0.6F;           ///< A smoothed load below this counts towards undoing the last step.
+    uint32_t overloadFrames = 8;         ///< Consecutive overloaded frames before the next step is taken.
+    uint32_t headroomFrames = 64;        ///< Consecutive frames with headroom before the last step is undone.
+    uint32_t maxLevel = CHEAP_SMOOTHING; ///< The last step that may be taken.
+    uint32_t skipInterval = 2;           ///< At SKIP_FRAMES, one frame in skipInterval is skipped.
+  };
+
+  struct Stats
+  {
+    uint32_t level = FULL_QUALITY;
+    float load = 0;             ///< The smoothed load.
+    uint64_t degraded = 0;      ///< Steps taken.
+    uint64_t restored = 0;      ///< Steps undone.
+    uint64_t skippedFrames = 0; ///< Frames skipped at SKIP_FRAMES.
+  };
+
+  /**
+   * @param headerNum The sensor head, for the log.
+   * @param fovIdx The FOV, for the log.
+   */
+  LoadShedder(uint32_t headerNum, uint32_t fovIdx, Config config);
+  LoadShedder(LoadShedder &other) = delete;
+  LoadShedder &operator=(LoadShedder &rhs) = delete;
+
+  /**
+   * @brief Accounts a processed frame, and takes or undoes a step if needed. Called by the processing thread of the FOV.
+   *
+   * @param latencyNs The time from the frame's last ROI to the end of its whole-frame processing.
+   * @param framePeriodNs The time between the frame's last ROI and the previous frame's. 0 if unknown.
+   * @return true if the level changed.
+   */
+  bool addFrame(uint64_t latencyNs, uint64_t framePeriodNs);
+
+  /**
+   * @brief Called by the ingest thread once per completed frame. At SKIP_FRAMES, returns true for one frame in
+   * skipInterval, which is then not processed.
+   */
+  bool skipFrame();
+
+  Level getLevel() const { return Level(_level.load(std::memory_order_relaxed)); } ///< From any thread.
+  Stats getStats() const; ///< From any thread.
+  const Config &getConfig() const { return _config; }
+  static const char *getLevelName(uint32_t level);
+
+private:
+  const uint32_t _headerNum;
+  const uint32_t _fovIdx;
+  const Config _config;
+  std::atomic<uint32_t> _level { FULL_QUALITY };
+  std::atomic<float> _load { 0 };
+  std::atomic<uint64_t> _degraded { 0 };
+  std::atomic<uint64_t> _restored { 0 };
+  std::atomic<uint64_t> _skippedFrames { 0 };
+  uint32_t _overloadedRun { 0 };  ///< Processing thread only.
+  uint32_t _headroomRun { 0 };    ///< Processing thread only.
+  uint64_t _completedFrames { 0 }; ///< Ingest thread only.
+};
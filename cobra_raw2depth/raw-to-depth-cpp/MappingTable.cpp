@@ -1,121 +1,315 @@
 /**
  * @file MappingTable.cpp
  * @brief A utility for loading the angle-to-angle calibration mapping table.
- * 
+ *
+ * Versioned tables are mapped read-only rather than parsed, so they load in no time and their
+ * pages are shared by every head and process that uses the same file. That is only safe because
+ * they are published with save(), which renames the new file over the old one: a file rewritten
+ * in place would tear, or SIGBUS, the tables that still map it. The legacy interleaved .bin
+ * tables are rewritten in place by System Control, so they are read into memory of their own,
+ * as the CSV tables are parsed into, which is allocated with HugePages::allocateShared().
+ *
  * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
- * 
+ *
  */
 
 #include "MappingTable.h"
 #include "LumoLogger.h"
+#include "HugePages.h"
+#include "MemoryBudget.h"
 #include <fstream>
 #include <sstream>
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <iterator>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "mapping table files are little-endian");
 
 #define chk(a) if ((a).empty()) { fail = true; break; }
 
+// Legacy binary tables: MAPPING_TABLE_LENGTH entries of interleaved X, Y, theta and phi
+constexpr std::size_t BIN_TABLE_COLUMNS { 4 };
+
 MappingTable::MappingTable(std::string mappingTableFilename) {
 
   LLogDebug("Attempting to load " << mappingTableFilename << " into the mapping table.");
-  std::ifstream file(mappingTableFilename);
-  
-  if (!file.is_open()) 
+  int fd = ::open(mappingTableFilename.c_str(), O_RDONLY); // NOLINT(hicpp-vararg) calling LINUX vararg API
+  struct stat statBuf = {};
+  if (fd < 0 || fstat(fd, &statBuf) != 0)
   {
-
+    if (fd >= 0)
+    {
+      close(fd);
+    }
     LLogErr("Unable to open input file " << mappingTableFilename << ". Mapping table undefined.");
-    _calibrationX = nullptr;
-    _calibrationY = nullptr;
-    _calibrationTheta = nullptr;
-    _calibrationPhi = nullptr;
     return;
   }
+  auto fileSize = std::size_t(statBuf.st_size);
 
-  _calibrationX     = std::make_shared<std::vector<int32_t>>(MAPPING_TABLE_LENGTH);
-  _calibrationY     = std::make_shared<std::vector<int32_t>>(MAPPING_TABLE_LENGTH);
-  _calibrationTheta = std::make_shared<std::vector<int32_t>>(MAPPING_TABLE_LENGTH);
-  _calibrationPhi   = std::make_shared<std::vector<int32_t>>(MAPPING_TABLE_LENGTH);
-
+  MappingTableFileHeader header = {};
+  if (fileSize >= sizeof(header) && pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+      memcmp(header.magic, MAPPING_TABLE_MAGIC, sizeof(MAPPING_TABLE_MAGIC)) == 0)
+  {
+    mapVersionedTable(fd, fileSize);
+    close(fd);
+    return;
+  }
 
   if ( std::equal(mappingTableFilename.end()-4, mappingTableFilename.end(), ".bin") )
   {
-    loadBinTable(file);
+    readBinTable(fd, fileSize);
+    close(fd);
     return;
   }
+  close(fd);
+
+  std::ifstream file(mappingTableFilename);
   loadCsvTable(file);
 }
 
-void MappingTable::loadBinTable(std::ifstream &file)
+std::shared_ptr<MappingTable> MappingTable::load(const std::string &mappingTableFilename)
 {
-  int idx=0;
-  while (file.peek() != EOF &&
-         idx < MAPPING_TABLE_LENGTH)
+  // The same file, unless it was replaced or rewritten since
+  using FileKey = std::tuple<dev_t, ino_t, off_t, int64_t, int64_t>;
+  static std::mutex loadedMut;
+  static std::map<FileKey, std::weak_ptr<MappingTable>> loaded;
+
+  struct stat statBuf = {};
+  if (stat(mappingTableFilename.c_str(), &statBuf) != 0)
   {
-    assert(idx < MAPPING_TABLE_LENGTH);
-    int32_t aval; 
-    int32_t bval;
-    int32_t cval; 
-    int32_t dval;
-    file.read(reinterpret_cast<char*>(&aval), sizeof(aval));
-    _calibrationX->at(idx) = aval;
+    return std::make_shared<MappingTable>(mappingTableFilename);
+  }
+  FileKey key { statBuf.st_dev, statBuf.st_ino, statBuf.st_size, statBuf.st_mtim.tv_sec, statBuf.st_mtim.tv_nsec };
 
-    file.read(reinterpret_cast<char*>(&bval), sizeof(bval));
-    _calibrationY->at(idx) = bval;
+  std::lock_guard<std::mutex> lock(loadedMut);
+  for (auto it = loaded.begin(); it != loaded.end();)
+  {
+    it = it->second.expired() ? loaded.erase(it) : std::next(it);
+  }
+  auto table = loaded[key].lock();
+  if (!table)
+  {
+    table = std::make_shared<MappingTable>(mappingTableFilename);
+    loaded[key] = table;
+    // All of it, whatever the budget: the table is needed as is, and the heads share it
+    const std::size_t tableBytes = table->_calibrationX ? BIN_TABLE_COLUMNS * std::size_t(table->_width) * table->_height * sizeof(int32_t) : 0;
+    table->_budgetGrant = MemoryBudget::request(MEMORY_POOL_MAPPING_TABLES, tableBytes, tableBytes, "mapping table " + mappingTableFilename);
+  }
+  return table;
+}
 
-    file.read(reinterpret_cast<char*>(&cval), sizeof(cval));
-    _calibrationTheta->at(idx) = cval;
+// Maps the whole file, which the planes then keep mapped. Only for files that are replaced by rename(), never rewritten.
+static std::shared_ptr<const uint8_t> mapFile(int fd, std::size_t fileSize)
+{
+  void *mapping = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED)
+  {
+    LLogErr("mapping_table_map:errno=" << errno << ":can't map the mapping table");
+    return nullptr;
+  }
+  return std::shared_ptr<const uint8_t>((const uint8_t *)mapping, [fileSize](const uint8_t *ptr) { munmap((void *)ptr, fileSize); });
+}
 
-    file.read(reinterpret_cast<char*>(&dval), sizeof(dval));
-    _calibrationPhi->at(idx) = dval;
-    idx++;
+bool MappingTable::mapVersionedTable(int fd, std::size_t fileSize)
+{
+  MappingTableFileHeader header = {};
+  if (pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)))
+  {
+    return false;
+  }
+  auto numEntries = std::size_t(header.width) * header.height;
+  if (header.version != MAPPING_TABLE_VERSION || numEntries == 0 ||
+      fileSize != sizeof(header) + BIN_TABLE_COLUMNS * numEntries * sizeof(int32_t))
+  {
+    LLogErr("Mapping table version " << header.version << " (" << header.width << "x" << header.height <<
+            ") is not supported or the file is truncated. Mapping table undefined.");
+    return false;
+  }
+
+  auto mapping = mapFile(fd, fileSize);
+  if (!mapping)
+  {
+    return false;
   }
+  const auto *planes = (const int32_t *)(mapping.get() + sizeof(header));
+  _width = header.width;
+  _height = header.height;
+  _calibrationX     = std::make_shared<const CalibrationPlane>(mapping, planes, numEntries);
+  _calibrationY     = std::make_shared<const CalibrationPlane>(mapping, planes + numEntries, numEntries);
+  _calibrationTheta = std::make_shared<const CalibrationPlane>(mapping, planes + 2 * numEntries, numEntries);
+  _calibrationPhi   = std::make_shared<const CalibrationPlane>(mapping, planes + 3 * numEntries, numEntries);
+  LLogDebug("MappingTable mapping succeeded.");
+  return true;
+}
+
+bool MappingTable::readBinTable(int fd, std::size_t fileSize)
+{
+  if (fileSize != BIN_TABLE_COLUMNS * MAPPING_TABLE_LENGTH * sizeof(int32_t))
+  {
+    LLogErr("Binary mapping table is " << fileSize << " bytes instead of " <<
+            BIN_TABLE_COLUMNS * MAPPING_TABLE_LENGTH * sizeof(int32_t) << ". Mapping table undefined.");
+    return false;
+  }
+
+  // Copied rather than mapped, since System Control rewrites the file in place
+  auto entriesBuffer = HugePages::allocateShared(fileSize);
+  if (!entriesBuffer)
+  {
+    LLogErr("Unable to allocate the mapping table. Mapping table undefined.");
+    return false;
+  }
+  auto *bytes = (uint8_t *)entriesBuffer.get();
+  std::size_t numRead = 0;
+  while (numRead < fileSize)
+  {
+    auto ret = pread(fd, bytes + numRead, fileSize - numRead, off_t(numRead));
+    if (ret < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (ret <= 0)
+    {
+      LLogErr("mapping_table_read:errno=" << errno << ",bytes=" << numRead << ":can't read the mapping table");
+      return false;
+    }
+    numRead += std::size_t(ret);
+  }
+
+  const auto *entries = (const int32_t *)bytes;
+  _calibrationX     = std::make_shared<const CalibrationPlane>(entriesBuffer, entries, MAPPING_TABLE_LENGTH, BIN_TABLE_COLUMNS);
+  _calibrationY     = std::make_shared<const CalibrationPlane>(entriesBuffer, entries + 1, MAPPING_TABLE_LENGTH, BIN_TABLE_COLUMNS);
+  _calibrationTheta = std::make_shared<const CalibrationPlane>(entriesBuffer, entries + 2, MAPPING_TABLE_LENGTH, BIN_TABLE_COLUMNS);
+  _calibrationPhi   = std::make_shared<const CalibrationPlane>(entriesBuffer, entries + 3, MAPPING_TABLE_LENGTH, BIN_TABLE_COLUMNS);
+  LLogDebug("MappingTable loading succeeded.");
+  return true;
 }
 
 void MappingTable::loadCsvTable(std::ifstream &file)
 {
+  if (!file.is_open())
+  {
+    LLogErr("Unable to open input file. Mapping table undefined.");
+    return;
+  }
+
+  // All four planes in one zeroed buffer of their own, on huge pages if enabled
+  auto planes = HugePages::allocateShared(BIN_TABLE_COLUMNS * MAPPING_TABLE_LENGTH * sizeof(int32_t));
+  if (!planes)
+  {
+    LLogErr("Unable to allocate the mapping table. Mapping table undefined.");
+    return;
+  }
+  auto *calibrationX = (int32_t *)planes.get();
+  int32_t *calibrationY = calibrationX + MAPPING_TABLE_LENGTH;
+  int32_t *calibrationTheta = calibrationY + MAPPING_TABLE_LENGTH;
+  int32_t *calibrationPhi = calibrationTheta + MAPPING_TABLE_LENGTH;
 
   bool fail = false;
   std::string line;
   uint32_t idx=0;
-  
+
   while (std::getline(file, line)) {
     std::stringstream lineStream(line);
     std::string       cell;
-    
+
     assert(idx < MAPPING_TABLE_LENGTH);
-    
+
     std::getline(lineStream, cell, ',');
     chk(cell);
-    _calibrationX->at(idx) = std::stoi(cell);
-    
+    calibrationX[idx] = std::stoi(cell);
+
     std::getline(lineStream, cell, ',');
     chk(cell);
-    _calibrationY->at(idx) = std::stoi(cell);
-    
+    calibrationY[idx] = std::stoi(cell);
+
     std::getline(lineStream, cell, ',');
     chk(cell);
-    _calibrationTheta->at(idx) = std::stoi(cell);
-    
+    calibrationTheta[idx] = std::stoi(cell);
+
     std::getline(lineStream, cell, ',');
     chk(cell);
-    _calibrationPhi->at(idx) = std::stoi(cell);
+    calibrationPhi[idx] = std::stoi(cell);
     idx++;
-    
+
   }
-    
+
   file.close();
   assert(idx == MAPPING_TABLE_LENGTH);
-  
+
   if (fail) {
-    _calibrationX = nullptr;
-    _calibrationY = nullptr;
-    _calibrationTheta = nullptr;
-    _calibrationPhi = nullptr;
+    clear();
     LLogErr("Invalid input file format when creating MappingTable.");
     return;
   }
-  
+
+  _calibrationX     = std::make_shared<const CalibrationPlane>(planes, calibrationX, MAPPING_TABLE_LENGTH);
+  _calibrationY     = std::make_shared<const CalibrationPlane>(planes, calibrationY, MAPPING_TABLE_LENGTH);
+  _calibrationTheta = std::make_shared<const CalibrationPlane>(planes, calibrationTheta, MAPPING_TABLE_LENGTH);
+  _calibrationPhi   = std::make_shared<const CalibrationPlane>(planes, calibrationPhi, MAPPING_TABLE_LENGTH);
 
   LLogDebug("MappingTable loading succeeded.");
-  
+
 }
 
+bool MappingTable::save(const std::string &mappingTableFilename) const
+{
+  if (!(_calibrationX && _calibrationY && _calibrationTheta && _calibrationPhi))
+  {
+    LLogErr("No mapping table to save to " << mappingTableFilename);
+    return false;
+  }
+
+  // Never rewrite the file in place: other tables may still map it
+  const auto tempFilename = mappingTableFilename + ".tmp" + std::to_string(getpid());
+  std::ofstream file(tempFilename, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+  {
+    LLogErr("Unable to open output file " << tempFilename);
+    return false;
+  }
+
+  MappingTableFileHeader header = {};
+  memcpy(header.magic, MAPPING_TABLE_MAGIC, sizeof(MAPPING_TABLE_MAGIC));
+  header.version = MAPPING_TABLE_VERSION;
+  header.width = _width;
+  header.height = _height;
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  std::vector<int32_t> row(_width);
+  for (const auto *plane : {_calibrationX.get(), _calibrationY.get(), _calibrationTheta.get(), _calibrationPhi.get()})
+  {
+    for (std::size_t rowStart = 0; rowStart < plane->size(); rowStart += _width)
+    {
+      for (std::size_t col = 0; col < _width; col++)
+      {
+        row[col] = (*plane)[rowStart + col];
+      }
+      file.write(reinterpret_cast<const char *>(row.data()), std::streamsize(_width * sizeof(int32_t)));
+    }
+  }
+  file.close();
+  if (!file.good() || rename(tempFilename.c_str(), mappingTableFilename.c_str()) != 0)
+  {
+    LLogErr("mapping_table_save:file=" << mappingTableFilename << ",errno=" << errno << ":can't write the mapping table");
+    unlink(tempFilename.c_str());
+    return false;
+  }
+  return true;
+}
+
+void MappingTable::clear()
+{
+  _calibrationX = nullptr;
+  _calibrationY = nullptr;
+  _calibrationTheta = nullptr;
+  _calibrationPhi = nullptr;
+}
@@ -2,37 +2,142 @@
  * @file MappingTable.h
  * @brief A utility class for loading and accessing the calibration
  * angle-to-angle mapping table.
- * 
+ *
  * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
- * 
+ *
  */
 
 #pragma once
 
+#include <array>
+#include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 #include <string>
 #include <memory>
+#include "MemoryBudget.h"
 
 #define MAPPING_TABLE_LENGTH 1226561
+#define MAPPING_TABLE_DEFAULT_WIDTH 1279U  ///< (U) Of the tables that don't say, 2 * IMAGE_WIDTH - 1
+#define MAPPING_TABLE_DEFAULT_HEIGHT 959U  ///< (V) Of the tables that don't say, 2 * MAX_IMAGE_HEIGHT - 1
+
+#define MAPPING_TABLE_MAGIC "LUMOMTB"
+#define MAPPING_TABLE_VERSION 1U
+
+/**
+ * @brief The header of a versioned mapping table file. It is followed by the X, Y, theta and
+ * phi planes, each one width * height little-endian int32_t in row (V) major order, so that
+ * the file can be mapped and used as it is.
+ */
+struct MappingTableFileHeader {
+  char magic[8];     // NOLINT(hicpp-avoid-c-arrays) MAPPING_TABLE_MAGIC
+  uint32_t version;  ///< MAPPING_TABLE_VERSION
+  uint32_t width;    ///< Entries per row (U)
+  uint32_t height;   ///< Rows (V)
+  uint32_t reserved;
+};
+static_assert(sizeof(MappingTableFileHeader) == 24, "the planes start 4-byte aligned");
+
+/**
+ * @brief One read-only column of the mapping table (e.g. theta), with one value per entry.
+ * The values may be interleaved with those of the other columns (stride > 1). Holds on to
+ * the memory it points into, which may be a mapping of the table file.
+ */
+class CalibrationPlane {
+ private:
+  std::shared_ptr<const void> _storage;
+  const int32_t *_data;
+  std::size_t _size;
+  std::size_t _stride;
+
+ public:
+  CalibrationPlane(std::shared_ptr<const void> storage, const int32_t *data, std::size_t size, std::size_t stride = 1) :
+    _storage(std::move(storage)), _data(data), _size(size), _stride(stride) {}
+
+  std::size_t size() const { return _size; }
+  const int32_t &operator[](std::size_t idx) const { return _data[idx * _stride]; }
+  const int32_t &at(std::size_t idx) const { assert(idx < _size); return _data[idx * _stride]; }
+};
 
 class MappingTable {
  private:
-  std::shared_ptr<std::vector<int32_t>> _calibrationX = nullptr;
-  std::shared_ptr<std::vector<int32_t>> _calibrationY = nullptr;
-  std::shared_ptr<std::vector<int32_t>> _calibrationTheta = nullptr;
-  std::shared_ptr<std::vector<int32_t>> _calibrationPhi = nullptr;
+  std::shared_ptr<const CalibrationPlane> _calibrationX = nullptr;
+  std::shared_ptr<const CalibrationPlane> _calibrationY = nullptr;
+  std::shared_ptr<const CalibrationPlane> _calibrationTheta = nullptr;
+  std::shared_ptr<const CalibrationPlane> _calibrationPhi = nullptr;
+  uint32_t _width = MAPPING_TABLE_DEFAULT_WIDTH;
+  uint32_t _height = MAPPING_TABLE_DEFAULT_HEIGHT;
+  MemoryBudget::Grant _budgetGrant; ///< Of the tables shared by load()
 
  public:
   MappingTable() = default;
   explicit MappingTable(std::string mappingTableFilename);
 
-  std::shared_ptr<std::vector<int32_t>> getCalibrationX()     { return _calibrationX; }
-  std::shared_ptr<std::vector<int32_t>> getCalibrationY()     { return _calibrationY; }
-  std::shared_ptr<std::vector<int32_t>> getCalibrationTheta() { return _calibrationTheta; }
-  std::shared_ptr<std::vector<int32_t>> getCalibrationPhi()   { return _calibrationPhi; }
+  /**
+   * @brief Loads a mapping table, or returns the one already loaded from the same unchanged file,
+   * so that the heads share it.
+   */
+  static std::shared_ptr<MappingTable> load(const std::string &mappingTableFilename);
+
+  /**
+   * @brief Writes the table as a versioned mapping table file, which loads without parsing. The file is written
+   * under a temporary name and renamed over mappingTableFilename, so that the mappings of the file it replaces
+   * stay valid.
+   */
+  bool save(const std::string &mappingTableFilename) const;
+
+  std::shared_ptr<const CalibrationPlane> getCalibrationX()     const { return _calibrationX; }
+  std::shared_ptr<const CalibrationPlane> getCalibrationY()     const { return _calibrationY; }
+  std::shared_ptr<const CalibrationPlane> getCalibrationTheta() const { return _calibrationTheta; }
+  std::shared_ptr<const CalibrationPlane> getCalibrationPhi()   const { return _calibrationPhi; }
+  uint32_t getWidth() const { return _width; }
+  uint32_t getHeight() const { return _height; }
 
 private:
+  bool mapVersionedTable(int fd, std::size_t fileSize);
+  bool readBinTable(int fd, std::size_t fileSize);
   void loadCsvTable(std::ifstream &file);
-  void loadBinTable(std::ifstream &file);
+  void clear();
+};
+
+/**
+ * @brief The entries of the mapping table that the pixels of a FOV map to: pixel (row, col)
+ * is entry (topLeft[0] + row * step[0], topLeft[1] + col * step[1]). Nothing is copied, the
+ * entries are looked up when asked for.
+ */
+class MappingTableWindow {
+ private:
+  std::shared_ptr<const MappingTable> _table;
+  const CalibrationPlane *_x = nullptr;
+  const CalibrationPlane *_y = nullptr;
+  const CalibrationPlane *_theta = nullptr;
+  const CalibrationPlane *_phi = nullptr;
+  std::array<uint32_t, 2> _topLeft {};
+  std::array<uint32_t, 2> _step {};
+
+  std::size_t index(uint32_t row, uint32_t col) const {
+    return (std::size_t(_topLeft[0]) + std::size_t(row) * _step[0]) * _table->getWidth() +
+           _topLeft[1] + std::size_t(col) * _step[1];
+  }
+
+ public:
+  MappingTableWindow() = default;
+  MappingTableWindow(std::shared_ptr<const MappingTable> table, std::array<uint32_t, 2> topLeft, std::array<uint32_t, 2> step) :
+    _table(std::move(table)), _topLeft(topLeft), _step(step)
+  {
+    if (_table && _table->getCalibrationTheta())
+    {
+      _x = _table->getCalibrationX().get();
+      _y = _table->getCalibrationY().get();
+      _theta = _table->getCalibrationTheta().get();
+      _phi = _table->getCalibrationPhi().get();
+    }
+  }
+
+  bool valid() const { return _theta != nullptr; }
+  int32_t x(uint32_t row, uint32_t col) const     { return _x->at(index(row, col)); }
+  int32_t y(uint32_t row, uint32_t col) const     { return _y->at(index(row, col)); }
+  int32_t theta(uint32_t row, uint32_t col) const { return _theta->at(index(row, col)); }
+  int32_t phi(uint32_t row, uint32_t col) const   { return _phi->at(index(row, col)); }
 };
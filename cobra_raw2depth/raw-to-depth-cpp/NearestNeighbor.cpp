@@ -25,25 +25,13 @@ const std::vector<uint16_t> NearestNeighbor::_lutNeighborCountTolerance { 0,
 const std::vector<uint16_t> NearestNeighbor::_lutWindowSize             { 0,      3,      5,      6,      7,      9};
 const std::vector<float_t>  NearestNeighbor::_flutRangeToleranceFrac    { 0,  1.0F/16.0F, 1.0F/16.0F, 1.0F/16.0F, 1.0F/16.0F, 1.0F/16.0F}; //Fixed-point multiplier fraction. Q0.16. 0x0fff is 1/16 (>>4 bits).
 
-inline float_t countNeighbors(float_t val, float_t rangeTol, uint32_t minNeighborCount, std::vector<float_t> &ranges, uint32_t startIdx, uint32_t winSize, uint32_t stride) {
-  uint32_t winStart = startIdx;
-  uint32_t numNeighbors = 0;
-
-  for (uint32_t rowIdx=0; rowIdx<winSize; rowIdx++) {
-    uint32_t winEnd = winStart + winSize;
-    
-    for (uint32_t winIdx=winStart; winIdx<winEnd; winIdx++) {
-      assert(winIdx < ranges.size());
-      auto winVal = ranges[winIdx];
-      // No branches.
-      numNeighbors += uint32_t(rangeTol >= fabs(winVal - val));
-    }
-    winStart += stride;
+uint32_t NearestNeighbor::getHalo(uint16_t filterLevel)
+{
+  if (filterLevel > MAX_NEAREST_NEIGHBOR_IDX)
+  {
+    filterLevel = MAX_NEAREST_NEIGHBOR_IDX;
   }
-
-  float_t outputValue = (numNeighbors < minNeighborCount) ? 0.0F : val; // still a branch, once per pixel.
-
-  return outputValue;
+  return _lutWindowSize[filterLevel] / 2U;
 }
 
 void NearestNeighbor::removeOutliers(std::vector<float_t> &ffilteredRanges, uint16_t filterLevel, std::array<uint32_t,2> &size) 
@@ -83,18 +71,35 @@ void NearestNeighbor::removeOutliers(std::vector<float_t> &ffilteredRanges, uint
   uint32_t stride = size[1];
   uint32_t colStart = halfWin + stride*halfWin;
   uint32_t winStart = 0;
-  
+
+  // The pixels of a row are counted together: each position in the window is compared with the whole row
+  // at once, so the inner loops run over contiguous pixels with no branches, and vectorize.
+  SCOPED_VEC_F(rangeTols, imw);
+  SCOPED_VEC_F(numNeighbors, imw); // Whole numbers, exact in float.
+
   for (auto yIdx=0; yIdx<imh; yIdx++) {
-    auto pixIdx = colStart; // Index to the first pixel in the current row of the input buffer.
-    auto winIdx = winStart; // Index to topleft pixel in the window
-    
+    assert(colStart + imw <= franges.size());
+    const auto *vals = &franges[colStart]; // The first pixel in the current row of the input buffer.
+    for (auto xIdx=0; xIdx<imw; xIdx++) {
+      rangeTols[xIdx] = 1.0F/1024.0F + vals[xIdx] * rangeTolFrac;
+      numNeighbors[xIdx] = 0.0F;
+    }
+
+    for (uint32_t rowIdx=0; rowIdx<winSize; rowIdx++) {
+      for (uint32_t colIdx=0; colIdx<winSize; colIdx++) {
+        // The window position (rowIdx, colIdx) of every pixel in the row.
+        const auto *winVals = &franges[winStart + rowIdx*stride + colIdx];
+        assert(winStart + rowIdx*stride + colIdx + imw <= franges.size());
+        for (auto xIdx=0; xIdx<imw; xIdx++) {
+          numNeighbors[xIdx] += float_t(rangeTols[xIdx] >= std::fabs(winVals[xIdx] - vals[xIdx]));
+        }
+      }
+    }
+
     for (auto xIdx=0; xIdx<imw; xIdx++) {
-      assert(pixIdx < franges.size());
-      auto val = franges[pixIdx];
-      const float_t rangeTol = 1.0F/1024.0F + val * rangeTolFrac;
-      ffilteredRanges[pixIdx++] = countNeighbors(val, rangeTol, minNeighborCount, franges, winIdx++, winSize, stride);
+      ffilteredRanges[colStart + xIdx] = (numNeighbors[xIdx] < float_t(minNeighborCount)) ? 0.0F : vals[xIdx];
     }
-    
+
     // Move to the next row.
     winStart += stride;
     colStart += stride;
@@ -23,6 +23,7 @@ class NearestNeighbor {
   
  public:
   static void removeOutliers(std::vector<float_t> &ffilteredRanges, uint16_t filterLevel, std::array<uint32_t,2> &size);
+  static uint32_t getHalo(uint16_t filterLevel); ///< The number of rows (or columns) of context the filter reads on each side of a pixel.
   
 private:
 
@@ -0,0 +1,72 @@
+/**
+ * @file PixelMask.cpp
+ * @brief The calibrated region of the sensor that is illuminated by the laser, and its
+ * per-row spans in the output geometry of an FOV.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "PixelMask.h"
+#include "RtdMetadata.h"
+#include <LumoLogger.h>
+#include <fstream>
+
+constexpr uint16_t PIXEL_MASK_OFF {0xffff};
+
+PixelMask::PixelMask(const std::vector<uint16_t> &mask) :
+  _bits((mask.size() + BITS_PER_WORD - 1) / BITS_PER_WORD, 0),
+  _numPixels(mask.size())
+{
+  for (std::size_t idx = 0; idx < mask.size(); idx++)
+  {
+    _bits[idx / BITS_PER_WORD] |= uint64_t(mask[idx] != 0) << (idx % BITS_PER_WORD);
+  }
+}
+
+std::shared_ptr<const PixelMask> PixelMask::load(const std::string &pixelMaskFilepath)
+{
+  LLogDebug("Reading pixel mask from " << pixelMaskFilepath);
+  auto inf = std::ifstream(pixelMaskFilepath, std::ios::in | std::ios::binary);
+  if (!inf.is_open())
+  {
+    LLogDebug("Unable to open input file " << pixelMaskFilepath << " for pixel mask. Default to passthrough.");
+    return std::make_shared<const PixelMask>();
+  }
+
+  auto mask = std::vector<uint16_t>(IMAGE_WIDTH * MAX_IMAGE_HEIGHT, PIXEL_MASK_OFF);
+  inf.read((char *)(mask.data()), sizeof(uint16_t) * IMAGE_WIDTH * MAX_IMAGE_HEIGHT);
+  inf.close();
+  return std::make_shared<const PixelMask>(mask);
+}
+
+PixelMaskSpans::PixelMaskSpans(std::shared_ptr<const PixelMask> mask, std::array<uint16_t,2> fovStart, std::array<uint16_t,2> fovStep,
+                               uint16_t stride, std::array<uint32_t,2> size) :
+  _mask(std::move(mask)),
+  _fovStart(fovStart),
+  _fovStep(fovStep),
+  _stride(stride),
+  _size(size)
+{
+  _rowOffsets.reserve(size[0] + 1);
+  for (uint32_t row = 0; row < size[0]; row++)
+  {
+    _rowOffsets.push_back(uint32_t(_spans.size()));
+    const auto rowIdx = std::size_t(stride) * (fovStart[0] + std::size_t(row) * fovStep[0]);
+    bool inSpan = false;
+    for (uint32_t col = 0; col < size[1]; col++)
+    {
+      const bool enabled = _mask == nullptr || _mask->isEnabled(rowIdx + fovStart[1] + std::size_t(col) * fovStep[1]);
+      if (enabled && !inSpan)
+      {
+        _spans.push_back({col, size[1]});
+      }
+      else if (!enabled && inSpan)
+      {
+        _spans.back()[1] = col;
+      }
+      inSpan = enabled;
+    }
+  }
+  _rowOffsets.push_back(uint32_t(_spans.size()));
+}
@@ -0,0 +1,85 @@
+/**
+ * @file PixelMask.h
+ * @brief The calibrated region of the sensor that is illuminated by the laser, and its
+ * per-row spans in the output geometry of an FOV.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class PixelMask;
+
+/**
+ * @brief The pixels of an output FOV that the pixel mask leaves enabled, as a list of [begin,end) column spans per
+ *        output row. A row without spans is fully masked. Immutable, so it is shared with the frames in flight.
+ */
+class PixelMaskSpans
+{
+public:
+  using Span = std::array<uint32_t,2>;
+
+  /**
+   * @brief Samples the mask at the pixels of an output FOV.
+   *
+   * @param mask The pixel mask to sample, or nullptr to enable all pixels.
+   * @param fovStart The pre-binned sensor {row, column} of the first output pixel.
+   * @param fovStep The pre-binned sensor step between output pixels (e.g. binning).
+   * @param stride The width of the mask.
+   * @param size The output FOV size {rows, columns}.
+   */
+  PixelMaskSpans(std::shared_ptr<const PixelMask> mask, std::array<uint16_t,2> fovStart, std::array<uint16_t,2> fovStep,
+                 uint16_t stride, std::array<uint32_t,2> size);
+
+  // The spans of the given output row. Rows below the FOV are fully masked.
+  const Span *rowBegin(uint32_t row) const { return _spans.data() + _rowOffsets[std::min(row, _size[0])]; }
+  const Span *rowEnd(uint32_t row) const { return _spans.data() + _rowOffsets[std::min(row + 1, _size[0])]; }
+
+  // True if these spans were built from mask for the given geometry, so they can be reused.
+  bool matches(const std::shared_ptr<const PixelMask> &mask, std::array<uint16_t,2> fovStart, std::array<uint16_t,2> fovStep,
+               uint16_t stride, std::array<uint32_t,2> size) const
+  {
+    return mask == _mask && fovStart == _fovStart && fovStep == _fovStep && stride == _stride && size == _size;
+  }
+
+private:
+  std::shared_ptr<const PixelMask> _mask;
+  std::array<uint16_t,2> _fovStart;
+  std::array<uint16_t,2> _fovStep;
+  uint16_t _stride;
+  std::array<uint32_t,2> _size;
+  std::vector<uint32_t> _rowOffsets; ///< Index of the first span of each row in _spans, plus one past the last row.
+  std::vector<Span> _spans;
+};
+
+/**
+ * @brief The pixel mask loaded from the calibration file, packed one bit per sensor pixel (set when enabled).
+ *        The file holds one 16-bit value per pixel in row-major order, and zero masks the pixel.
+ */
+class PixelMask
+{
+public:
+  PixelMask() = default; ///< Passthrough: all pixels enabled.
+  explicit PixelMask(const std::vector<uint16_t> &mask);
+
+  // Reads a full-sensor mask file. Returns a passthrough mask if the file can't be opened.
+  static std::shared_ptr<const PixelMask> load(const std::string &pixelMaskFilepath);
+
+  // Index into the mask at x + stride*y in sensor coordinates. Pixels outside of the mask are enabled.
+  bool isEnabled(std::size_t idx) const
+  {
+    return idx >= _numPixels || (_bits[idx / BITS_PER_WORD] >> (idx % BITS_PER_WORD) & 1U) != 0;
+  }
+
+private:
+  static constexpr std::size_t BITS_PER_WORD { 64 };
+  std::vector<uint64_t> _bits;
+  std::size_t _numPixels { 0 };
+};
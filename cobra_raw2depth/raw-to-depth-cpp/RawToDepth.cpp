@@ -24,7 +24,6 @@
 
 using std::operator ""s;
 
-constexpr uint16_t PIXEL_MASK_OFF {0xffff};
 constexpr uint32_t DEFAULT_FOV_HEIGHT {240};
 constexpr uint32_t DEFAULT_FOV_WIDTH {320};
 constexpr uint32_t DEFAULT_BINNING {2};
@@ -37,8 +36,7 @@ constexpr uint32_t defaultF1Idx { 8 };
 
 RawToDepth::RawToDepth(uint32_t fovIdx, uint32_t headerNum)
     : _fovIdx(fovIdx),
-      _pixelMask(std::make_shared<std::vector<uint16_t>>(IMAGE_WIDTH * MAX_IMAGE_HEIGHT, PIXEL_MASK_OFF)),
-      _timers(std::make_shared<LumoTimers>("RawToDepth")),
+      _pixelMask(std::make_shared<const PixelMask>()),
       _binning({DEFAULT_BINNING,DEFAULT_BINNING}),
       _size({DEFAULT_FOV_HEIGHT,DEFAULT_FOV_WIDTH}),
       _mappingTableStart(DEFAULT_MAPPING_TABLE_START),
@@ -51,8 +49,7 @@ RawToDepth::RawToDepth(uint32_t fovIdx, uint32_t headerNum)
       _fsInt({roundf(_fs[0] / _gcf), roundf(_fs[1] / _gcf)}),
       _headerNum(headerNum)
 {
-  realloc((uint16_t *)RtdMetadata::DEFAULT_METADATA.data(),
-          RtdMetadata::DEFAULT_METADATA.size() * sizeof(uint16_t));
+  realloc(RtdMetadata(RtdMetadata::DEFAULT_METADATA));
 }
 
 RawToDepth::~RawToDepth()
@@ -60,16 +57,129 @@ RawToDepth::~RawToDepth()
   LLogDebug("RawToDepth dtor");
 }
 
+void RawToDepth::processRoi(const uint16_t *roi, uint32_t numBytes)
+{
+  if (nullptr == roi || numBytes == 0)
+  {
+    return;
+  }
+  processRoi(RtdMetadata(roi, numBytes), roi, numBytes);
+  releaseRoi(nullptr);
+}
+
 /// Initialization and verification methods.
-void RawToDepth::reset(const uint16_t *mdPtr, uint32_t mdBytes)
+void RawToDepth::reset(const RtdMetadata &mdat)
 {
-  _timers->stop("RawToDepth_Frame_Loop");
-  _timers->report();
-  _timers->start("RawToDepth_Frame_Loop", TIMERS_UPDATE_EVERY);
+  auto now = FastTimers::ticks();
+  if (_frameLoopStartTicks != 0)
+  {
+    FastTimers::record(FAST_TIMER_RTD_FRAME_LOOP, now - _frameLoopStartTicks);
+  }
+  _frameLoopStartTicks = now;
 
   _prevRoiWasLast = false;
 
-  realloc(mdPtr, mdBytes);
+  realloc(mdat);
+  selectGeometry();
+  updateDirections();
+}
+
+void RawToDepth::selectGeometry()
+{
+  auto cached = std::find_if(_geometries.begin(), _geometries.end(), [this](const CachedGeometry &geometry)
+                             {
+                               return geometry.size == _size && geometry.mappingTableStart == _mappingTableStart &&
+                                      geometry.mappingTableStep == _mappingTableStep;
+                             });
+  _newGeometry = cached == _geometries.end();
+  if (!_newGeometry)
+  {
+    std::rotate(_geometries.begin(), cached, cached + 1);
+    return;
+  }
+
+  if (_geometries.size() >= MAX_CACHED_GEOMETRIES)
+  {
+    _geometries.pop_back();
+  }
+  CachedGeometry geometry;
+  geometry.size = _size;
+  geometry.mappingTableStart = _mappingTableStart;
+  geometry.mappingTableStep = _mappingTableStep;
+  _geometries.insert(_geometries.begin(), std::move(geometry));
+}
+
+std::shared_ptr<const std::vector<int>> RawToDepth::getMedianOffsets(uint32_t rowKernelIdx, uint32_t columnKernelIdx)
+{
+  if (_geometries.empty())
+  {
+    return nullptr;
+  }
+  auto &geometry = _geometries.front();
+  const std::array<uint32_t,2> kernelIdx { rowKernelIdx, columnKernelIdx };
+  if (!geometry.medianOffsets || geometry.medianKernelIdx != kernelIdx)
+  {
+    geometry.medianOffsets = std::make_shared<const std::vector<int>>(RawToDepthDsp::getMedianOffsets(_size, {rowKernelIdx, columnKernelIdx}));
+    geometry.medianKernelIdx = kernelIdx;
+  }
+  return geometry.medianOffsets;
+}
+
+/**
+ * @brief Builds the unit direction of each pixel of the FOV from the theta and phi (arcseconds) of its
+ * mapping table entry, x = sin(theta)cos(phi), y = sin(theta)sin(phi), z = cos(theta), so that the
+ * whole frame processing turns ranges into points with one multiply per coordinate.
+ * The directions are kept with the geometry, so this normally only runs once per geometry and mapping table.
+ */
+void RawToDepth::updateDirections()
+{
+  if (!_xyzMappingTable || !_xyzMappingTable->getCalibrationTheta() || _geometries.empty())
+  {
+    _directions = nullptr;
+    return;
+  }
+  auto &geometry = _geometries.front();
+  if (geometry.directions && geometry.directionsTable == _xyzMappingTable)
+  {
+    _directions = geometry.directions;
+    return;
+  }
+
+  const auto &theta = *_xyzMappingTable->getCalibrationTheta();
+  const auto &phi = *_xyzMappingTable->getCalibrationPhi();
+  const std::size_t tableWidth = _xyzMappingTable->getWidth();
+  const std::size_t area = std::size_t(_size[0]) * _size[1];
+  constexpr double radiansPerArcsec { M_PI / (180.0 * 3600.0) };
+
+  // Pixels outside of the table get no direction, so their points are at the origin.
+  auto directions = std::make_shared<std::vector<float_t>>(3 * area, 0.0F);
+  float_t *dx = directions->data();
+  float_t *dy = dx + area;
+  float_t *dz = dy + area;
+  for (uint32_t row = 0; row < _size[0]; row++)
+  {
+    std::size_t tableRow = _mappingTableStart[0] + std::size_t(row) * _mappingTableStep[0];
+    for (uint32_t col = 0; col < _size[1]; col++)
+    {
+      std::size_t tableCol = _mappingTableStart[1] + std::size_t(col) * _mappingTableStep[1];
+      std::size_t entry = tableRow * tableWidth + tableCol;
+      if (tableCol >= tableWidth || entry >= theta.size())
+      {
+        continue;
+      }
+      double thetaRad = double(theta[entry]) * radiansPerArcsec;
+      double phiRad = double(phi[entry]) * radiansPerArcsec;
+      std::size_t idx = std::size_t(row) * _size[1] + col;
+      dx[idx] = float_t(std::sin(thetaRad) * std::cos(phiRad));
+      dy[idx] = float_t(std::sin(thetaRad) * std::sin(phiRad));
+      dz[idx] = float_t(std::cos(thetaRad));
+    }
+  }
+
+  _directions = directions;
+  geometry.directions = directions;
+  geometry.directionsTable = _xyzMappingTable;
+  LLogDebug("fov" << _fovIdx << ": built the XYZ directions of " << _size[0] << "x" << _size[1] << " pixels");
 }
 
 /**
@@ -114,7 +224,7 @@ void RawToDepth::reset(const uint16_t *mdPtr, uint32_t mdBytes)
  * @return false If this ROI is to be skipped.
  * @return true If this ROI is to be processed. 
  */
-bool RawToDepth::saveTimestamp(RtdMetadata &mdat)
+bool RawToDepth::saveTimestamp(const RtdMetadata &mdat)
 {
   assert(!mdat.wasPreviousRoiSaturated());
   _temperatureCalibration.setAdcValues(mdat, _fovIdx);
@@ -148,7 +258,7 @@ bool RawToDepth::saveTimestamp(RtdMetadata &mdat)
  * @return true if mdat indicates that some buffer sizes have changed
  * @return false if mdat does not indicate a change in buffer sizes.
  */
-bool RawToDepth::bufferSizesChanged(RtdMetadata &mdat)
+bool RawToDepth::bufferSizesChanged(const RtdMetadata &mdat)
 {
   auto imsize = mdat.getFullImageHeight(_fovIdx) * mdat.getFullImageWidth(_fovIdx);
   return 
@@ -170,15 +280,12 @@ bool RawToDepth::bufferSizesChanged(RtdMetadata &mdat)
 /**
  * @brief Called whenever a new FOV is begun (RtdMetadata::getFirstRoi() == true)
  * 
- * @param mdPtr The metadata for this ROI
- * @param mdBytes The number of bytes in the metadata buffer
+ * @param mdat The metadata for this ROI
  */
-void RawToDepth::realloc(const uint16_t *mdPtr, uint32_t mdBytes)
+void RawToDepth::realloc(const RtdMetadata &mdat)
 {
   bool changed = false; // Set by the MAKE_VECTOR macros if the buffer sizes have changed since the last FOV.
 
-  chkBufMetadata(mdBytes);
-  auto mdat = RtdMetadata(mdPtr, mdBytes); // Can't do constructor initialization list because of this local variable.
   auto roiBytes = sizeof(uint16_t) * mdat.getRoiNumRows() *
                   ROI_NUM_COLUMNS * mdat.getNumModulationFrequencies() *
                   NUM_GPIXEL_PHASES * mdat.getNumPermutations();
@@ -227,10 +334,12 @@ void RawToDepth::realloc(const uint16_t *mdPtr, uint32_t mdBytes)
   }
   _fsInt[0] =roundf(_fs[0] / _gcf);
   _fsInt[1] =roundf(_fs[1] / _gcf);
+  _phaseUnwrap = RawToDepthDsp::getPhaseUnwrap(_fs, _fsInt, _c_mps);
   
   _snrThresh = mdat.getSnrThresh(_fovIdx);
   _disableStreaming = mdat.getDisableStreaming();
   _disableRangeMasking = mdat.getDisableRangeMasking(_fovIdx);
+  _outputPlanes = mdat.getOutputPlanes(_fovIdx);
 
   _nearestNeighborFilterLevel = mdat.getNearestNeighborFilterLevel(_fovIdx);
   _performSumRotations = mdat.getDoTapAccumulation();
@@ -288,7 +397,7 @@ std::shared_ptr<std::vector<std::vector<uint32_t>>> RawToDepth::getTimestampsVec
  * @brief Utility function. Dumps the given raw ROI to a specific file path.
  * 
  */
-void RawToDepth::dumpetyDump(const uint16_t *roi, uint32_t numBytes, RtdMetadata &mdat, uint32_t fovIdx)
+void RawToDepth::dumpetyDump(const uint16_t *roi, uint32_t numBytes, const RtdMetadata &mdat, uint32_t fovIdx)
 {
   if (!mdat.getDumpRawRoi(fovIdx))
   {
@@ -304,7 +413,7 @@ void RawToDepth::dumpetyDump(const uint16_t *roi, uint32_t numBytes, RtdMetadata
 
 /**
  * @brief Loads the pixel mask from its location in the file system.
- *        Stores the data into the _pixelMask field of this class.
+ *        Stores the data, packed one bit per pixel, into the _pixelMask field of this class.
  * 
  * @param pixelMaskFilepath A fully-qualified path to the pixel mask file.
  */
@@ -315,18 +424,27 @@ void RawToDepth::loadPixelMask(std::string pixelMaskFilepath)
   {
     return;
   }
+  setPixelMask(PixelMask::load(pixelMaskFilepath));
+}
 
-  LLogDebug("Reading pixel mask from " << pixelMaskFilepath);
-  auto inf = std::ifstream(pixelMaskFilepath, std::ios::in | std::ios::binary);
-  if (!inf.is_open())
+const std::shared_ptr<const PixelMaskSpans> &RawToDepth::getPixelMaskSpans(std::array<uint16_t,2> fovStart, std::array<uint16_t,2> fovStep,
+                                                                           uint16_t stride, std::array<uint32_t,2> size)
+{
+  auto cached = std::find_if(_pixelMaskSpans.begin(), _pixelMaskSpans.end(),
+                             [&](const auto &spans) { return spans->matches(_pixelMask, fovStart, fovStep, stride, size); });
+  if (cached == _pixelMaskSpans.end())
   {
-    LLogDebug("Unable to open input file " << pixelMaskFilepath << " for pixel mask. Default to passthrough.");
-    _pixelMask = std::make_shared<std::vector<uint16_t>>(IMAGE_WIDTH * MAX_IMAGE_HEIGHT, PIXEL_MASK_OFF); // Default to passthrough.
-    return;
+    if (_pixelMaskSpans.size() >= MAX_CACHED_GEOMETRIES)
+    {
+      _pixelMaskSpans.pop_back();
+    }
+    _pixelMaskSpans.insert(_pixelMaskSpans.begin(), std::make_shared<const PixelMaskSpans>(_pixelMask, fovStart, fovStep, stride, size));
   }
-
-  inf.read((char *)(_pixelMask->data()), sizeof(uint16_t) * IMAGE_WIDTH * MAX_IMAGE_HEIGHT);
-  inf.close();
+  else
+  {
+    std::rotate(_pixelMaskSpans.begin(), cached, cached + 1);
+  }
+  return _pixelMaskSpans.front();
 }
 
 /**
@@ -338,7 +456,7 @@ void RawToDepth::loadPixelMask(std::string pixelMaskFilepath)
  * @return true If the buffer is big enough to hold the metadata and the raw ROI.
  * @return false otherwise.
  */
-bool RawToDepth::chkBufDataWithHeader(RtdMetadata &mdat, uint32_t numBytesImagesAndHeader)
+bool RawToDepth::chkBufDataWithHeader(const RtdMetadata &mdat, uint32_t numBytesImagesAndHeader)
 {
 
   uint32_t expectedBytes = sizeof(uint16_t) * ROI_NUM_COLUMNS * mdat.getNumPermutations() + // data line for header.
@@ -381,7 +499,7 @@ bool RawToDepth::chkBufMetadata(uint32_t numBytes)
  * @return true if the buffer size is large enough to hold the raw ROI data.
  * @return false otherwise.
  */
-bool RawToDepth::chkBufDataOnly(RtdMetadata &mdat, uint32_t numBytesImagesOnly)
+bool RawToDepth::chkBufDataOnly(const RtdMetadata &mdat, uint32_t numBytesImagesOnly)
 { // Check to see if the input buffer is large enough to hold the ROI
 
   uint32_t expectedBytes =
@@ -402,12 +520,13 @@ bool RawToDepth::chkBufDataOnly(RtdMetadata &mdat, uint32_t numBytesImagesOnly)
 /**
  * @brief Performs error checking on the metadata internals.
  * 
+ * @param mdat The decoded metadata of the ROI.
  * @param roi The raw ROI data.
  * @param numBytes The size of the buffer containing the metadata and the raw ROI
  * @return true If the metadata is internally consistent.
  * @return false otherwise
  */
-bool RawToDepth::validateMetadata(const uint16_t *roi, uint32_t numBytes) const
+bool RawToDepth::validateMetadata(const RtdMetadata &mdat, const uint16_t *roi, uint32_t numBytes) const
 {
   if (!chkBufMetadata(numBytes))
   {
@@ -416,7 +535,6 @@ bool RawToDepth::validateMetadata(const uint16_t *roi, uint32_t numBytes) const
 
   auto rowShorts = ROI_NUM_COLUMNS * NUM_GPIXEL_PHASES;
   uint32_t roiBytes = numBytes - rowShorts * sizeof(uint16_t);
-  auto mdat = RtdMetadata(roi, numBytes);
   // Run-time check that buffer sizes are allocated correctly.
   chkBufDataWithHeader(mdat, numBytes);
 
@@ -461,7 +579,7 @@ bool RawToDepth::validateMetadata(const uint16_t *roi, uint32_t numBytes) const
     return false;                          \
   }
 
-bool RawToDepth::validateMetadataValues(RtdMetadata &mdat)
+bool RawToDepth::validateMetadataValues(const RtdMetadata &mdat)
 {
   val_ck(mdat.getSensorMode() == SENSOR_MODE_DMFD, "Only DMFD is supported");
   val_ck(mdat.getNumModulationFrequencies() == 2, "The number of modulation frequencies must be 2.");
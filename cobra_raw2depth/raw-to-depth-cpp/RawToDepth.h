@@ -14,21 +14,21 @@
 #include "TemperatureCalibration.h"
 #include "FovSegment.h"
 #include "GPixel.h"
+#include "PixelMask.h"
+#include "LoadShedder.h"
+#include "RawToDepthDsp.h"
 #include <cstdio>
 #include <cstdint>
 #include <cmath>
 #include <vector>
 #include <iostream>
 #include <LumoUtil.h>
-#include <LumoTimers.h>
+#include <FastTimers.h>
 #include <tuple>
 #include <functional>
 #include <limits>
 
 
-#define TIMERS_UPDATE_EVERY 100 ///< Output timer updates every 100 frames. About once every 10 seconds at full frame rate.
-#define STRIPE_TIMERS_UPDATE_EVERY 1000
-
 // The mapping table converts from sensor indices to angle-angle
 #define MAPPING_TABLE_FILE_ROOT "/home/root/cobra/mapping_table_" //<ABCD>.bin
 // The pixel mask defines the region over which the sensor is illuminated.
@@ -55,6 +55,17 @@ using std::operator ""s;
   } }
 
 
+/**
+ * @brief The DSP engines that RawToDepthFactory can create for an FOV (see RawToDepthFactory::getEngines()).
+ */
+enum class RtdEngine : uint32_t
+{
+  NONE = 0,     ///< No engine: the default one is selected.
+  STRIPE_FLOAT, ///< RawToDepthStripe_float
+  GRID_FLOAT,   ///< RawToDepthV2_float
+  GRID_FIXED,   ///< RawToDepthV2_fixed
+};
+
 /**
  * @brief The parent class for RawToDepth processing
  *        One RawToDepth object is created for each output FOV.
@@ -67,8 +78,8 @@ public :
 protected:
   uint32_t _fovIdx; ///< Which output FOV does this RTD object belong to.
 
-  std::shared_ptr<
-    std::vector<uint16_t>> _pixelMask;
+  std::shared_ptr<const PixelMask> _pixelMask; ///< Immutable, so that the frames in flight can share it.
+  std::vector<std::shared_ptr<const PixelMaskSpans>> _pixelMaskSpans; ///< The spans returned by getPixelMaskSpans(), most recent first.
   std::vector<uint32_t> _minMaxFilterSize; ///< Either 1: a 2D vector containing {v,h} filter size, or 2: empty, indicating that the min-max filter is disabled.
   std::vector<uint64_t> _timestamps; ///< Holds one timestamp for each ROI (original 64-bit format)
   std::vector<
@@ -79,7 +90,7 @@ protected:
   hdr _hdr; ///< High dynamic range processing
   bool _disableRtd = false; ///< Causes RawToDepth to ignore input data.
   
-  std::shared_ptr<LumoTimers> _timers;
+  uint64_t _frameLoopStartTicks { 0 }; ///< FastTimers ticks at the last reset(), to time the frame loop.
   TemperatureCalibration _temperatureCalibration;
   
   std::array<uint32_t,2> _binning;
@@ -98,6 +109,7 @@ protected:
   std::array<float_t, 2>  _fs;  ///< The two modulation frequencies, in Hz
 
   std::vector<float_t> _fsInt; ///< Integers describing the ratio of modulation frequency to the GCF
+  RawToDepthDsp::PhaseUnwrap _phaseUnwrap; ///< The unwrap coefficients of _fs, updated by reset().
   static constexpr float_t _c_mps {299792498.0F};
   static constexpr float_t _halfc {0.5F*299792498.0F};
   float_t _rangeLimit {std::numeric_limits<float_t>::max()};
@@ -111,13 +123,37 @@ protected:
   uint32_t _userTag {0};                ///< (from metadata)
   bool     _disableStreaming {false};   ///< (from metadata)
   bool     _disableRangeMasking {false};///< (from metadata)
+  uint16_t _outputPlanes {TRANSMIT_BITMASK_ALL_PLANES}; ///< (from metadata) The TRANSMIT_BITMASK_* planes output in the FovSegment.
   bool     _veryFirstRoiReceived {false};   ///< (from metadata) True if the very first ROI has already been received following startup.
   int32_t  _currentRoiIdx {0};          ///< locally indexed counter that increments for each ROI that is received.
   uint64_t _timestamp {0};              ///< (from metadata) The original 64-bit format of the most recent timestamp that was received.
   bool     _incompleteFov {false};      ///< Set during ROI processing if any of the input ROIs were skipped.
+  FrameTrace _frameTrace;               ///< The latency trace of the FOV whose last ROI was just received; handed to its FovSegment.
 
   const uint32_t _headerNum;            ///< Indicates which scanhead the last ROI came from (Jetson) or zero otherwise (NCB)
   uint16_t _nearestNeighborFilterLevel {0}; ///< (from metadata) The nearest neighbor filter index.
+
+  std::shared_ptr<const MappingTable> _xyzMappingTable; ///< Set to output XYZ points, nullptr otherwise.
+  std::shared_ptr<LoadShedder> _loadShedder; ///< Degrades the whole-frame processing under overload, or nullptr.
+  std::shared_ptr<const std::vector<float_t>> _directions; ///< The x, y and z planes of each pixel's unit direction, or nullptr.
+
+  /**
+   * @brief The state derived from an FOV geometry. The last MAX_CACHED_GEOMETRIES geometries are kept, most recently
+   * used first, so that a scan table that switches between a few geometries doesn't rebuild it at every switch.
+   */
+  struct CachedGeometry
+  {
+    std::array<uint32_t,2> size {};              ///< The FOV size ...
+    std::array<uint32_t,2> mappingTableStart {}; ///< ... and mapping table window, which also gives the binning.
+    std::array<uint32_t,2> mappingTableStep {};
+    std::shared_ptr<const MappingTable> directionsTable; ///< The table that directions was built from.
+    std::shared_ptr<const std::vector<float_t>> directions;
+    std::array<uint32_t,2> medianKernelIdx {}; ///< The smoothing kernels that medianOffsets was built for.
+    std::shared_ptr<const std::vector<int>> medianOffsets;
+  };
+  static constexpr std::size_t MAX_CACHED_GEOMETRIES { 8 };
+  std::vector<CachedGeometry> _geometries; ///< The geometry of the current FOV first.
+  bool _newGeometry { true }; ///< True if the geometry of the current FOV wasn't cached, so its state was built anew.
   
  public:
   explicit RawToDepth(uint32_t fovIdx, uint32_t headerNum);
@@ -129,13 +165,44 @@ protected:
   virtual ~RawToDepth();
   virtual void shutdown() {}
 
-  virtual void processRoi(const uint16_t* roi, uint32_t numBytes)=0;
+  /**
+   * @brief Processes one ROI into this FOV.
+   *
+   * @param mdat The metadata of the ROI, decoded once by the caller and shared by all of the FOVs the ROI is processed into.
+   * @param roi The raw ROI, with the metadata as its first row.
+   * @param numBytes The size of the buffer containing the ROI.
+   */
+  virtual void processRoi(const RtdMetadata &mdat, const uint16_t* roi, uint32_t numBytes)=0;
+  void processRoi(const uint16_t* roi, uint32_t numBytes); ///< Decodes the metadata of the ROI, then processes it.
+  /**
+   * @brief Called once the caller is done with the ROIs passed to processRoi() so far. An object that is still reading
+   * the latest of them keeps owner, which keeps its buffer valid, until it is done; with a null owner, it is done before
+   * returning.
+   */
+  virtual void releaseRoi(std::shared_ptr<const void> /*owner*/) {}
   virtual void processWholeFrame(std::function<void (std::shared_ptr<FovSegment>)> setFovSegment)=0;
+  ///< Called after each ROI that doesn't complete the FOV, to output the rows that are ready early (if supported and enabled).
+  virtual void processReadyRows(std::function<void (std::shared_ptr<FovSegment>)> /*setFovSegment*/) {}
+  ///< Discards the frame in progress, if any: as at startup, the ROIs are ignored until the first ROI of a frame.
+  ///< Called between ROIs, e.g. when the scan configuration changed without the stream stopping.
+  virtual void restartFrame() { _veryFirstRoiReceived = false; _prevRoiWasLast = false; }
 
   bool lastRoiReceived() const { return _prevRoiWasLast; }
+  RtdEngine getEngine() const { return _engine; } ///< The engine this object was created as by RawToDepthFactory.
   uint64_t getTimestamp() const { return _timestamp; }
+  void setFrameTrace(const FrameTrace &trace) { _frameTrace = trace; } ///< Called by RawToFovs before processWholeFrame()
+
+  /**
+   * @brief Sets the mapping table that XYZ points are computed with, or nullptr to only output ranges.
+   * Takes effect at the next FOV.
+   */
+  void setXyzMappingTable(const std::shared_ptr<const MappingTable> &table) { _xyzMappingTable = table; }
+  ///< Sets the FOV's load shedder (see RawToFovs::setLoadShedding()), or nullptr for full quality. Takes effect at the next FOV.
+  void setLoadShedder(std::shared_ptr<LoadShedder> loadShedder) { _loadShedder = std::move(loadShedder); }
 
   virtual void loadPixelMask(std::string pixelMaskFilepath = "");
+  ///< Sets a pixel mask loaded with PixelMask::load(). Call between FOVs, so that all the rows of an FOV use the same mask.
+  void setPixelMask(std::shared_ptr<const PixelMask> pixelMask) { _pixelMask = std::move(pixelMask); }
 
   uint32_t getHeaderNum() const { return _headerNum; }
   uint16_t &getSensorID() { return _sensorID; }
@@ -150,24 +217,34 @@ protected:
 
   std::shared_ptr<std::vector<uint64_t>> getTimestamps();
   std::shared_ptr<std::vector<std::vector<uint32_t>>> getTimestampsVec();
-  std::string getLastTimerReport() { return _timers->getLastReport(); }
+  std::shared_ptr<const std::string> getLastTimerReport() { return FastTimers::getLastReport(); }
 
 protected:
   
-  virtual void reset(const uint16_t *mdPtr, uint32_t mdBytes); ///< Called at the first ROI of an FOV, to initialize internal buffers.
+  virtual void reset(const RtdMetadata &mdat); ///< Called at the first ROI of an FOV, to initialize internal buffers.
   // Returns true if the buffer sizes indicated by the given metadata are different from the current state of the object
-  virtual bool bufferSizesChanged(RtdMetadata &mdat);    
-  virtual bool saveTimestamp(RtdMetadata &mdat);
-
-  static bool validateMetadataValues(RtdMetadata &mdat);
-  bool validateMetadata(const uint16_t *roi, uint32_t numBytes) const;
-  static bool chkBufDataWithHeader(RtdMetadata &mdat, uint32_t numBytesImagesAndHeader);
+  virtual bool bufferSizesChanged(const RtdMetadata &mdat);    
+  virtual bool saveTimestamp(const RtdMetadata &mdat);
+  void selectGeometry(); ///< Moves the current geometry to the front of _geometries, adding it if needed.
+  void updateDirections(); ///< Sets _directions for the current geometry, building them if the XYZ mapping table changed.
+  // The point offsets of the ghost median filter for the current geometry (see RawToDepthDsp::getMedianOffsets()).
+  std::shared_ptr<const std::vector<int>> getMedianOffsets(uint32_t rowKernelIdx, uint32_t columnKernelIdx);
+  // Returns the spans of the pixel mask in the given output geometry (see PixelMaskSpans). Rebuilt only if the mask or the geometry changed.
+  const std::shared_ptr<const PixelMaskSpans> &getPixelMaskSpans(std::array<uint16_t,2> fovStart, std::array<uint16_t,2> fovStep,
+                                                                 uint16_t stride, std::array<uint32_t,2> size);
+
+  static bool validateMetadataValues(const RtdMetadata &mdat);
+  bool validateMetadata(const RtdMetadata &mdat, const uint16_t *roi, uint32_t numBytes) const;
+  static bool chkBufDataWithHeader(const RtdMetadata &mdat, uint32_t numBytesImagesAndHeader);
   static bool chkBufMetadata(uint32_t numBytes);  ///< Check to see if the input buffer is large enough to hold metadata
-  static bool chkBufDataOnly(RtdMetadata &mdat, uint32_t numBytesImagesOnly); ///< Check to see if the input buffer is large enough to hold the ROI
-  static void dumpetyDump(const uint16_t *roi, uint32_t numBytes, RtdMetadata &mdat, uint32_t fovIdx);
+  static bool chkBufDataOnly(const RtdMetadata &mdat, uint32_t numBytesImagesOnly); ///< Check to see if the input buffer is large enough to hold the ROI
+  static void dumpetyDump(const uint16_t *roi, uint32_t numBytes, const RtdMetadata &mdat, uint32_t fovIdx);
 
 private:
-  void realloc(const uint16_t *mdPtr, uint32_t mdBytes);
+  void realloc(const RtdMetadata &mdat);
+
+  friend class RawToDepthFactory;
+  RtdEngine _engine { RtdEngine::NONE }; ///< Set by RawToDepthFactory::create()
 
 };
 
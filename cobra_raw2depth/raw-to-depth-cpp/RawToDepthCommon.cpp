@@ -1,13 +1,60 @@
 #include "RawToDepthCommon.h"
 #include "RtdMetadata.h"
+#include "RawToDepthSimd.h"
+#include <algorithm>
 #include <cassert>
 
+namespace
+{
+/**
+ * @brief The scalar reference of RawToDepthSimd::quantizeOutputs(), for the pixels [start, numElements) of the run.
+ * The ranges are corrected for temperature as whole-frame processing did before, then each plane is converted as by
+ * RawToDepthCommon::getRange(), getSnr(), getSignal() and getBackground().
+ */
+void quantizeOutputs(const RawToDepthSimd::OutputRun &run, uint32_t start, uint32_t numElements)
+{
+  const float_t clip = 65535.0F;
+  for (uint32_t idx = start; idx < numElements; idx++)
+  {
+    if (run.rangeOut != nullptr)
+    {
+      auto iRange = run.ranges[idx] - run.rangeOffset;
+      if (iRange < 0.0F)
+      {
+        iRange = 0.0F;
+      }
+      iRange = fmod(iRange, run.maxRange);
+      if (run.minMaxMask != nullptr &&
+          (run.minMaxMask[idx] > RawToDepthSimd::MIN_MAX_THRESHOLD || run.snr[idx] < run.snrThresh || iRange > run.rangeLimit))
+      {
+        iRange = 0;
+      }
+      run.rangeOut[idx] = (uint16_t) roundf(run.rangeScale*iRange);
+    }
+    if (run.snrOut != nullptr)
+    {
+      run.snrOut[idx] = (uint16_t) roundf(0.5F*run.snr[idx]);
+    }
+    if (run.signalOut != nullptr)
+    {
+      const auto avgSignal = roundf(0.5F*run.signal[idx]);
+      run.signalOut[idx] = avgSignal > clip ? uint16_t(clip) : uint16_t(avgSignal);
+    }
+    if (run.backgroundOut != nullptr)
+    {
+      const auto avgBg = run.background[idx];
+      run.backgroundOut[idx] = avgBg > clip ? uint16_t(clip) : uint16_t(roundf(avgBg));
+    }
+  }
+}
+} // namespace
+
 /**
  * @brief Converts the input range values into 16-bit 1024.0 meters/step
  * for transmission on the network.
  * 
  * The routine also performs masking operations. A pixel is marked as invalid (precisely 0m range) if :
- * 1. It falls outside of the _pixelMask.
+ * 1. It falls outside of the pixel mask, per _pixelMaskSpans.
  * 2. It is masked by the min-max filter via _fMinMaxMask
  * 3. The pixel has an SNR that falls below the value in _snrThresh as acquired from metadata.
  * 4. The range is farther than the range limit as defined by RANGE_LIMIT_FRACTION as defined in
@@ -19,12 +66,10 @@
  * 
  * @param _fRanges The FOV buffer containing the ranges as computed in processWholeFrame()
  * @param _fMinMaxMask The mask created by RawToDepthDsp::minMaxRecursive() during processWholeFrame()
- * @param _pixelMask The data structure created at calibration time defining the valid region of the sensor
- * that is illuminate by the laser.
+ * @param _pixelMaskSpans The pixels left enabled by the pixel mask, created at calibration time to define the valid
+ * region of the sensor that is illuminated by the laser, as spans of each output row (see PixelMaskSpans).
+ * @param pixelMaskRow The row of _pixelMaskSpans that corresponds to the first row of _fRanges.
  * @param _fSnr The FOV buffer containing the sum of the SNR from both frequencies as computed in processWholeFrame()
- * @param _sensorFovStart The coordinates with which to index the _pixelMask
- * @param _sensorFovStep 
- * @param pixelMaskStride 
  * @param _size The size of the FOV buffers in two dimensions
  * @param _disableRangeMasking Turns off all masking in this routine
  * @param _snrThresh Any pixel with a computed SNR below this value is marked as invalid.
@@ -34,11 +79,9 @@
  */
 std::shared_ptr<std::vector<uint16_t>> RawToDepthCommon::getRange(const std::vector<float_t> &_fRanges,
                                                                     const std::vector<float_t> &_fMinMaxMask,
-                                                                    std::shared_ptr<std::vector<uint16_t>> _pixelMask,
+                                                                    const PixelMaskSpans &_pixelMaskSpans,
+                                                                    uint32_t pixelMaskRow,
                                                                     const std::vector<float> &_fSnr,
-                                                                    std::array<uint16_t,2> _sensorFovStart,
-                                                                    std::array<uint16_t,2> _sensorFovStep,
-                                                                    uint16_t pixelMaskStride,
                                                                     std::array<uint32_t,2> _size,
                                                                     bool _disableRangeMasking,
                                                                     float _snrThresh,
@@ -46,56 +89,168 @@ std::shared_ptr<std::vector<uint16_t>> RawToDepthCommon::getRange(const std::vec
                                                                     float_t rangeLimit,
                                                                     float_t maxUnambiguousRange)
 {
-  auto ranges = std::make_shared<std::vector<uint16_t>>(_fRanges.size());
-  float_t iSnrThresh = _snrThresh;
+  auto ranges = std::make_shared<std::vector<uint16_t>>();
+  getRange(*ranges, _fRanges, _fMinMaxMask, _pixelMaskSpans, pixelMaskRow, _fSnr, _size, _disableRangeMasking, _snrThresh,
+           rangeOffsetTemperature, rangeLimit, maxUnambiguousRange);
+  return ranges;
+}
 
-  uint16_t pixelMaskStartY = _sensorFovStart[0];
-  uint16_t pixelMaskStartX = _sensorFovStart[1];
-  uint16_t pixelMaskStepY  = _sensorFovStep[0];
-  uint16_t pixelMaskStepX  = _sensorFovStep[1];
+void RawToDepthCommon::getRange(std::vector<uint16_t> &ranges,
+                                const std::vector<float_t> &_fRanges,
+                                const std::vector<float_t> &_fMinMaxMask,
+                                const PixelMaskSpans &_pixelMaskSpans,
+                                uint32_t pixelMaskRow,
+                                const std::vector<float> &_fSnr,
+                                std::array<uint32_t,2> _size,
+                                bool _disableRangeMasking,
+                                float _snrThresh,
+                                float_t rangeOffsetTemperature,
+                                float_t rangeLimit,
+                                float_t maxUnambiguousRange)
+{
+  assert(_fRanges.size() == std::size_t(_size[0]) * _size[1]);
+  assert(_fMinMaxMask.size() >= _fRanges.size());
+  assert(_fSnr.size() >= _fRanges.size());
+  const float_t minMaxThresh = 0.5F;
 
-  for (uint32_t idx = 0; idx < _fRanges.size(); idx++)
+  if (_disableRangeMasking)
   {
-    uint32_t rangeX = idx%_size[1];
-    uint32_t rangeY = idx/_size[1];
-    uint32_t pixelMaskX = pixelMaskStartX + rangeX*pixelMaskStepX;
-    uint32_t pixelMaskY = pixelMaskStartY + rangeY*pixelMaskStepY;
-    uint32_t pixelMaskIdx = pixelMaskX + pixelMaskStride*pixelMaskY;
-
-    assert(idx < _fMinMaxMask.size());
-    const float_t minMaxThresh = 0.5F;
-    bool minMaxMask = _fMinMaxMask[idx] > minMaxThresh;
-
-    bool pixelMask = false;
-    if (pixelMaskIdx < _pixelMask->size())
+    ranges.resize(_fRanges.size());
+    for (std::size_t idx = 0; idx < _fRanges.size(); idx++)
     {
-      pixelMask = _pixelMask->at(pixelMaskIdx) == 0;
+      ranges[idx] = (uint16_t) roundf(RANGE_NETWORK_SCALE*_fRanges[idx]);
     }
-    
-    assert(idx < _fSnr.size());
-    float_t snr = (_fSnr[idx]);
-
-    assert(idx < _fRanges.size());
-    auto iRange = _fRanges[idx];
-        
-    if (!_disableRangeMasking) {
-      if (minMaxMask ||
-	        snr < 2*iSnrThresh ||
-	        pixelMask || 
-          iRange > rangeLimit
-	        ) 
+    return;
+  }
+
+  // The buffer may hold a previous frame, and the masked pixels must read 0.
+  ranges.assign(_fRanges.size(), 0);
+
+  // Pixels outside of the spans are masked, and keep their 0 range. Fully masked rows are skipped.
+  for (uint32_t row = 0; row < _size[0]; row++)
+  {
+    const auto rowStart = std::size_t(row) * _size[1];
+    for (auto span = _pixelMaskSpans.rowBegin(pixelMaskRow + row); span != _pixelMaskSpans.rowEnd(pixelMaskRow + row); span++)
+    {
+      const auto end = rowStart + std::min((*span)[1], _size[1]);
+      for (auto idx = rowStart + (*span)[0]; idx < end; idx++)
       {
-	      iRange = 0;
+        auto iRange = _fRanges[idx];
+        if (_fMinMaxMask[idx] > minMaxThresh ||
+            _fSnr[idx] < 2*_snrThresh ||
+            iRange > rangeLimit)
+        {
+          iRange = 0;
+        }
+        ranges[idx] = (uint16_t) roundf(RANGE_NETWORK_SCALE*iRange);
       }
     }
+  }
+}
 
-    assert(idx < ranges->size());
-    (*ranges)[idx] = (uint16_t) roundf(RANGE_NETWORK_SCALE*iRange);
+
+/**
+ * @brief Converts all of the output planes of an FOV for the network in one pass: the ranges, corrected by
+ * rangeOffsetTemperature (clipped at 0 and modulo maxUnambiguousRange) and masked as by getRange(), and the planes
+ * selected by outputPlanes, as by getSnr(), getSignal() and getBackground(). Each row is split into the
+ * runs inside and outside of the pixel mask spans, and each run is converted by the SIMD kernel, followed by the scalar
+ * code for the pixels left over. The planes keep their capacity from frame to frame.
+ */
+void RawToDepthCommon::getOutputPlanes(FovPlanes &planes,
+                                       uint32_t outputPlanes,
+                                       const std::vector<float_t> &_fRanges,
+                                       const std::vector<float_t> &_fMinMaxMask,
+                                       const PixelMaskSpans &_pixelMaskSpans,
+                                       uint32_t pixelMaskRow,
+                                       const std::vector<float_t> &_fSnr,
+                                       const std::vector<float_t> &_fSignals,
+                                       const std::vector<float_t> &_fBackground,
+                                       std::array<uint32_t,2> _size,
+                                       bool _disableRangeMasking,
+                                       float_t _snrThresh,
+                                       float_t rangeOffsetTemperature,
+                                       float_t rangeLimit,
+                                       float_t maxUnambiguousRange)
+{
+  const auto numPixels = std::size_t(_size[0]) * _size[1];
+  const bool outputSnr = (outputPlanes & TRANSMIT_BITMASK_SNR) != 0;
+  const bool outputSignal = (outputPlanes & TRANSMIT_BITMASK_SIGNAL) != 0;
+  const bool outputBackground = (outputPlanes & TRANSMIT_BITMASK_BACKGROUND) != 0;
+  assert(_fRanges.size() == numPixels);
+  assert(_fMinMaxMask.size() >= numPixels || _disableRangeMasking);
+  assert(_fSnr.size() >= numPixels);
+  assert(!outputSignal || _fSignals.size() >= numPixels);
+  assert(!outputBackground || _fBackground.size() >= numPixels);
+
+  planes.range.resize(numPixels);
+  if (outputSnr)
+  {
+    planes.snr.resize(numPixels);
+  }
+  if (outputSignal)
+  {
+    planes.signal.resize(numPixels);
+  }
+  if (outputBackground)
+  {
+    planes.background.resize(numPixels);
   }
 
-  return ranges;
-}
+  RawToDepthSimd::OutputRun run;
+  run.snrThresh = 2*_snrThresh; // The snr is summed over both frequencies.
+  run.rangeOffset = rangeOffsetTemperature;
+  run.maxRange = maxUnambiguousRange;
+  run.rangeLimit = rangeLimit;
+  run.rangeScale = RANGE_NETWORK_SCALE;
 
+  // inSpan: the range is masked; otherwise it is 0 with range masking, and passed through without.
+  auto convert = [&](std::size_t start, std::size_t end, bool inSpan)
+  {
+    if (start >= end)
+    {
+      return;
+    }
+    const bool zeroRange = !inSpan && !_disableRangeMasking;
+    run.ranges = _fRanges.data() + start;
+    run.minMaxMask = inSpan ? _fMinMaxMask.data() + start : nullptr;
+    run.snr = _fSnr.data() + start;
+    run.signal = outputSignal ? _fSignals.data() + start : nullptr;
+    run.background = outputBackground ? _fBackground.data() + start : nullptr;
+    run.rangeOut = zeroRange ? nullptr : planes.range.data() + start;
+    run.snrOut = outputSnr ? planes.snr.data() + start : nullptr;
+    run.signalOut = outputSignal ? planes.signal.data() + start : nullptr;
+    run.backgroundOut = outputBackground ? planes.background.data() + start : nullptr;
+    const auto numElements = uint32_t(end - start);
+    if (run.rangeOut != nullptr || outputSnr || outputSignal || outputBackground)
+    {
+      quantizeOutputs(run, RawToDepthSimd::quantizeOutputs(run, numElements), numElements);
+    }
+    if (zeroRange)
+    {
+      std::fill(planes.range.begin() + std::ptrdiff_t(start), planes.range.begin() + std::ptrdiff_t(end), 0);
+    }
+  };
+
+  if (_disableRangeMasking)
+  {
+    convert(0, numPixels, false);
+    return;
+  }
+  for (uint32_t row = 0; row < _size[0]; row++)
+  {
+    const auto rowStart = std::size_t(row) * _size[1];
+    uint32_t column = 0;
+    for (auto span = _pixelMaskSpans.rowBegin(pixelMaskRow + row); span != _pixelMaskSpans.rowEnd(pixelMaskRow + row); span++)
+    {
+      const auto spanStart = std::max(column, std::min((*span)[0], _size[1]));
+      const auto spanEnd = std::max(spanStart, std::min((*span)[1], _size[1]));
+      convert(rowStart + column, rowStart + spanStart, false);
+      convert(rowStart + spanStart, rowStart + spanEnd, true);
+      column = spanEnd;
+    }
+    convert(rowStart + column, rowStart + _size[1], false);
+  }
+}
 
 /**
  * @brief Returns a 16-bit FOV buffer containing the average signal from both frequencies.
@@ -106,16 +261,22 @@ std::shared_ptr<std::vector<uint16_t>> RawToDepthCommon::getRange(const std::vec
  */
 std::shared_ptr<std::vector<uint16_t>> RawToDepthCommon::getSignal(const std::vector<float_t> &_fSignals)
 {
-  auto signal = std::make_shared<std::vector<uint16_t>>(_fSignals.size());
+  auto signal = std::make_shared<std::vector<uint16_t>>();
+  getSignal(*signal, _fSignals);
+  return signal;
+}
+
+void RawToDepthCommon::getSignal(std::vector<uint16_t> &signal, const std::vector<float_t> &_fSignals)
+{
+  signal.resize(_fSignals.size());
   for (unsigned int idx = 0; idx < _fSignals.size(); idx++)
   {
     const auto avgSignal = roundf(0.5F*_fSignals[idx]); // _fSignals contains the sum of both frequencies.
 
-    assert(idx < (*signal).size());
+    assert(idx < signal.size());
     const float_t sigClip = 65535.0F;
-    (*signal)[idx] = avgSignal > sigClip ? uint16_t(sigClip) : uint16_t(avgSignal);
+    signal[idx] = avgSignal > sigClip ? uint16_t(sigClip) : uint16_t(avgSignal);
   }
-  return signal;
 }
 
 /**
@@ -127,19 +288,24 @@ std::shared_ptr<std::vector<uint16_t>> RawToDepthCommon::getSignal(const std::ve
  * @return std::shared_ptr<std::vector<uint16_t>> An FOV buffer containing 16-bit values of background
  */
 std::shared_ptr<std::vector<uint16_t>> RawToDepthCommon::getBackground(const std::vector<float_t> &_fBackground)
+{
+  auto background = std::make_shared<std::vector<uint16_t>>();
+  getBackground(*background, _fBackground);
+  return background;
+}
+
+void RawToDepthCommon::getBackground(std::vector<uint16_t> &background, const std::vector<float_t> &_fBackground)
 {
   assert(!_fBackground.empty());
-  auto background = std::make_shared<std::vector<uint16_t>>(_fBackground.size());
+  background.resize(_fBackground.size());
   for (unsigned int idx = 0; idx < _fBackground.size(); idx++)
   {
     auto avgBg = _fBackground[idx]; // 2C has been excluded from the computation. _fBackground contains sum of two frequencies.
 
-    assert(idx < (*background).size());
+    assert(idx < background.size());
     const float_t bgClip = 65535.0F;
-    (*background)[idx] = avgBg > bgClip ? uint16_t(bgClip) : uint16_t(roundf(avgBg));
+    background[idx] = avgBg > bgClip ? uint16_t(bgClip) : uint16_t(roundf(avgBg));
   }
-
-  return background;
 }
 
 /**
@@ -149,15 +315,44 @@ std::shared_ptr<std::vector<uint16_t>> RawToDepthCommon::getBackground(const std
  * @return std::shared_ptr<std::vector<uint16_t>> The FOV buffer containing the average SNR in 16-bit format.
  */
 std::shared_ptr<std::vector<uint16_t>> RawToDepthCommon::getSnr(const std::vector<float_t> &_fSnr)
+{
+  auto snrs = std::make_shared<std::vector<uint16_t>>();
+  getSnr(*snrs, _fSnr);
+  return snrs;
+}
+
+void RawToDepthCommon::getSnr(std::vector<uint16_t> &snrs, const std::vector<float_t> &_fSnr)
 {
 
   uint32_t numSnrs = _fSnr.size();
   
-  auto snrs = std::make_shared<std::vector<uint16_t>>(numSnrs);
+  snrs.resize(numSnrs);
   for (uint32_t idx = 0; idx < numSnrs; idx++) 
   {
     constexpr float_t factor {0.5F};
-    (*snrs)[idx] = (uint16_t)roundf(factor * _fSnr[idx]); // Note: snr is summed in the algorithm.
+    snrs[idx] = (uint16_t)roundf(factor * _fSnr[idx]); // Note: snr is summed in the algorithm.
   }
-  return snrs;
+}
+
+/**
+ * @brief Scales each pixel's unit direction by its range. directions holds the x, then y, then z plane,
+ * and so does the output, in the same 1/RANGE_NETWORK_SCALE meter units as the ranges.
+ * Invalidated (zero) ranges give points at the origin.
+ */
+std::shared_ptr<std::vector<int32_t>> RawToDepthCommon::getXyz(const std::vector<uint16_t> &ranges, const std::vector<float_t> &directions)
+{
+  const std::size_t area = ranges.size();
+  assert(directions.size() == 3 * area);
+
+  auto xyz = std::make_shared<std::vector<int32_t>>(3 * area);
+  for (std::size_t plane = 0; plane < 3; plane++)
+  {
+    const float_t *dir = directions.data() + plane * area;
+    int32_t *out = xyz->data() + plane * area;
+    for (std::size_t idx = 0; idx < area; idx++)
+    {
+      out[idx] = int32_t(lrintf(float_t(ranges[idx]) * dir[idx]));
+    }
+  }
+  return xyz;
 }
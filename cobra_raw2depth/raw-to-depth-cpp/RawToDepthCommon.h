@@ -1,5 +1,7 @@
 #pragma once
 
+#include "PixelMask.h"
+#include "FovPlanes.h"
 #include <memory>
 #include <cstdint>
 #include <math.h>
@@ -9,11 +11,9 @@ class RawToDepthCommon {
 public:
   static std::shared_ptr<std::vector<uint16_t>> getRange(const std::vector<float_t> &_fRanges,
                                                           const std::vector<float_t> &_fMinMaxMask,
-                                                          std::shared_ptr<std::vector<uint16_t>> _pixelMask,
+                                                          const PixelMaskSpans &_pixelMaskSpans,
+                                                          uint32_t pixelMaskRow,
                                                           const std::vector<float> &_fSnr,
-                                                          std::array<uint16_t,2> _sensorFovStart,
-                                                          std::array<uint16_t,2> _sensorFovStep,
-                                                          uint16_t pixelMaskStride,
                                                           std::array<uint32_t,2> _size,
                                                           bool _disableRangeMasking,
                                                           float_t _snrThresh,
@@ -25,4 +25,44 @@ public:
   static std::shared_ptr<std::vector<uint16_t>> getBackground(const std::vector<float_t> &_fBackground);
   static std::shared_ptr<std::vector<uint16_t>> getSignal(const std::vector<float_t> &_fSignals);
 
+  // The same conversions into a caller-provided (e.g. recycled, see FovPlanes) buffer, which is resized to fit.
+  static void getRange(std::vector<uint16_t> &ranges,
+                       const std::vector<float_t> &_fRanges,
+                       const std::vector<float_t> &_fMinMaxMask,
+                       const PixelMaskSpans &_pixelMaskSpans,
+                       uint32_t pixelMaskRow,
+                       const std::vector<float> &_fSnr,
+                       std::array<uint32_t,2> _size,
+                       bool _disableRangeMasking,
+                       float_t _snrThresh,
+                       float_t rangeOffsetTemperature,
+                       float_t rangeLimit,
+                       float_t maxUnambiguousRange);
+  static void getSnr(std::vector<uint16_t> &snrs, const std::vector<float_t> &_fSnr);
+  static void getBackground(std::vector<uint16_t> &background, const std::vector<float_t> &_fBackground);
+  static void getSignal(std::vector<uint16_t> &signal, const std::vector<float_t> &_fSignals);
+
+  /**
+   * @brief The temperature correction of the ranges and the conversions of getRange(), getSnr(), getSignal() and
+   * getBackground() in one vectorized pass, into the recycled planes. Besides the range, only the planes selected by
+   * outputPlanes (TRANSMIT_BITMASK_SNR, _SIGNAL and _BACKGROUND) are written; _fSignals and _fBackground may be empty
+   * if they aren't.
+   */
+  static void getOutputPlanes(FovPlanes &planes,
+                              uint32_t outputPlanes,
+                              const std::vector<float_t> &_fRanges,
+                              const std::vector<float_t> &_fMinMaxMask,
+                              const PixelMaskSpans &_pixelMaskSpans,
+                              uint32_t pixelMaskRow,
+                              const std::vector<float_t> &_fSnr,
+                              const std::vector<float_t> &_fSignals,
+                              const std::vector<float_t> &_fBackground,
+                              std::array<uint32_t,2> _size,
+                              bool _disableRangeMasking,
+                              float_t _snrThresh,
+                              float_t rangeOffsetTemperature,
+                              float_t rangeLimit,
+                              float_t maxUnambiguousRange);
+  static std::shared_ptr<std::vector<int32_t>> getXyz(const std::vector<uint16_t> &ranges, const std::vector<float_t> &directions);
+
 };
\ No newline at end of file
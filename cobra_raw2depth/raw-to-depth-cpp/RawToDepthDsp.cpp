@@ -9,6 +9,7 @@
 
 
 #include "RawToDepthDsp.h"
+#include "RawToDepthSimd.h"
 #include "LumoLogger.h"
 #include "LumoUtil.h"
 #include "FloatVectorPool.h"
@@ -23,13 +24,13 @@
 
 const std::vector<std::vector<float_t>> RawToDepthDsp::_fKernels =
 {
-  { 0.0000000e+00, 1.0000000e+00, 0.0000000e+00, },
-  { 1.9684139e-01, 6.0631722e-01, 1.9684139e-01, },
-  { 6.646033000e-03, 1.942255544e-01, 5.982568252e-01, 1.942255544e-01, 6.646033000e-03 },
-  { 4.433048175e-03, 5.400558262e-02, 2.420362294e-01, 3.990502797e-01, 2.420362294e-01, 5.400558262e-02, 4.433048175e-03 },
-  { 3.325727091e-03, 2.381792204e-02, 9.719199228e-02, 2.259781525e-01, 2.993724122e-01, 2.259781525e-01, 9.719199228e-02, 2.381792204e-02, 3.325727091e-03 },
-  { 2.661264666e-03, 1.344761071e-02, 4.740849576e-02, 1.166060837e-01, 2.000968398e-01, 2.395594109e-01, 2.000968398e-01, 1.166060837e-01, 4.740849576e-02, 1.344761071e-02, 2.661264666e-03 },
-  { 1.901645579e-03, 6.275148539e-03, 1.723257069e-02, 3.938290545e-02, 7.490262923e-02, 1.185544877e-01, 1.561602730e-01, 1.711806797e-01, 1.561602730e-01, 1.185544877e-01, 7.490262923e-02, 3.938290545e-02, 1.723257069e-02, 6.275148539e-03, 1.901645579e-03 },
+  { SMOOTHING_KERNEL_0.begin(), SMOOTHING_KERNEL_0.end() },
+  { SMOOTHING_KERNEL_1.begin(), SMOOTHING_KERNEL_1.end() },
+  { SMOOTHING_KERNEL_2.begin(), SMOOTHING_KERNEL_2.end() },
+  { SMOOTHING_KERNEL_3.begin(), SMOOTHING_KERNEL_3.end() },
+  { SMOOTHING_KERNEL_4.begin(), SMOOTHING_KERNEL_4.end() },
+  { SMOOTHING_KERNEL_5.begin(), SMOOTHING_KERNEL_5.end() },
+  { SMOOTHING_KERNEL_6.begin(), SMOOTHING_KERNEL_6.end() },
 };
 
 const std::vector<std::vector<float_t>> RawToDepthDsp::_fKernelsNoCenter =
@@ -96,36 +97,89 @@ void RawToDepthDsp::median1d(const std::vector<float_t> &range, std::vector<floa
 void RawToDepthDsp::collapseRawRoi(const std::vector<float_t> & rawRoi, std::vector<float_t> &collapsedRoi, const std::vector<float_t> &weights, 
                                    const std::array<uint32_t,2> &binning, std::array<uint32_t, 2> roiSize, uint32_t rowOffset)
 {
-  auto roiWidth = roiSize[1];
-  auto roiHeight = roiSize[0];
-  auto binX = binning[1];
-  assert(collapsedRoi.size() == size_t(NUM_GPIXEL_PHASES * (roiWidth/binX)));
-  assert(rawRoi.size() >= size_t(roiHeight * NUM_GPIXEL_PHASES*roiWidth));
-
-  SCOPED_VEC_F(vCollapsedRoi, NUM_GPIXEL_PHASES*roiWidth);
-  std::fill(vCollapsedRoi.begin(), vCollapsedRoi.end(), 0.0F);
+  auto kernel = selectCollapseRawRoi(binning[1]);
+  if (kernel == nullptr)
+  {
+    LLogErr("Only binning of 1,2, or 4 are allowed.");
+    assert(false);
+    return;
+  }
+  kernel(rawRoi, collapsedRoi, weights, roiSize, rowOffset);
+}
 
+namespace
+{
+// Sums the weighted rows [rowOffset, roiHeight) of rawRoi into sums. The weights are either one per row, or one per
+// raw value of the whole ROI, which is decided once rather than for each value.
+void sumWeightedRows(const std::vector<float_t> &rawRoi, const std::vector<float_t> &weights, float_t *sums,
+                     std::size_t rowPitch, uint32_t rowOffset, uint32_t roiHeight)
+{
+  std::fill(sums, sums + rowPitch, 0.0F);
+  const bool rawValueWeights = weights.size() == rawRoi.size(); // for snr-weighted sum; else for Rect and Gaussian
   for (auto rowIdx=rowOffset; rowIdx<roiHeight; rowIdx++)
   {
-    for (auto colIdx=0; colIdx<NUM_GPIXEL_PHASES*roiWidth; colIdx++)
-    { 
-      auto rawRoiIdx = colIdx + NUM_GPIXEL_PHASES*roiWidth*rowIdx;
-      assert(rawRoiIdx < rawRoi.size());
-
-      uint32_t weightsIdx = rowIdx; // for Rect and Gaussian
-      if (weights.size() == rawRoi.size()) // for snr-weighted sum
+    const auto *row = rawRoi.data() + rowPitch*rowIdx;
+    if (rawValueWeights)
+    {
+      const auto *rowWeights = weights.data() + rowPitch*rowIdx;
+      for (std::size_t colIdx=0; colIdx<rowPitch; colIdx++)
       {
-        weightsIdx = rawRoiIdx;
+        sums[colIdx] += row[colIdx] * rowWeights[colIdx];
       }
-
-      assert(colIdx < vCollapsedRoi.size());
+    }
+    else
+    {
       assert(rowIdx < weights.size());
-      vCollapsedRoi[colIdx] += rawRoi[rawRoiIdx] * weights[weightsIdx];
+      const auto rowWeight = weights[rowIdx];
+      for (std::size_t colIdx=0; colIdx<rowPitch; colIdx++)
+      {
+        sums[colIdx] += row[colIdx] * rowWeight;
+      }
     }
   }
+}
+} // namespace
+
+/**
+ * @brief collapseRawRoi() with the horizontal binning BIN_X known at compile time. Without binning, the rows are
+ * summed straight into collapsedRoi.
+ */
+template <uint32_t BIN_X>
+void RawToDepthDsp::collapseRawRoi(const std::vector<float_t> &rawRoi, std::vector<float_t> &collapsedRoi, const std::vector<float_t> &weights,
+                                   std::array<uint32_t, 2> roiSize, uint32_t rowOffset)
+{
+  const auto roiWidth = roiSize[1];
+  const auto rowPitch = std::size_t(NUM_GPIXEL_PHASES)*roiWidth;
+  assert(collapsedRoi.size() == size_t(NUM_GPIXEL_PHASES * (roiWidth/BIN_X)));
+  assert(rawRoi.size() >= size_t(roiSize[0]) * rowPitch);
 
-  Binning::bin1xN(vCollapsedRoi, collapsedRoi, roiWidth, binX);
+  if constexpr (BIN_X == 1)
+  {
+    sumWeightedRows(rawRoi, weights, collapsedRoi.data(), rowPitch, rowOffset, roiSize[0]);
+  }
+  else
+  {
+    SCOPED_VEC_F(vCollapsedRoi, rowPitch);
+    sumWeightedRows(rawRoi, weights, vCollapsedRoi.data(), rowPitch, rowOffset, roiSize[0]);
+    Binning::binRow<BIN_X>(vCollapsedRoi.data(), collapsedRoi.data(), roiWidth);
+  }
+}
 
+RawToDepthDsp::CollapseKernel RawToDepthDsp::selectCollapseRawRoi(uint32_t binX)
+{
+  if (binX <= 1)
+  {
+    return &collapseRawRoi<1>;
+  }
+  if (binX == 2)
+  {
+    return &collapseRawRoi<2>;
+  }
+  if (binX == 4)
+  {
+    return &collapseRawRoi<4>;
+  }
+  return nullptr;
 }
 
 void RawToDepthDsp::minMax1d(const std::vector<float_t> &rawRoi0, const std::vector<float_t> &rawRoi1, std::vector<float_t> &mask,
@@ -134,7 +188,8 @@ void RawToDepthDsp::minMax1d(const std::vector<float_t> &rawRoi0, const std::vec
 
 }
 
-void RawToDepthDsp::fillMissingRows(const std::vector<float_t> &inFrame, std::vector<float_t> &outFrame, std::array<uint32_t,2> frameSize, std::vector<bool> &activeRows)
+void RawToDepthDsp::fillMissingRows(const std::vector<float_t> &inFrame, std::vector<float_t> &outFrame, std::array<uint32_t,2> frameSize, const std::vector<bool> &activeRows,
+                                    std::array<uint32_t,2> rows)
 {
 
   if (frameSize[0] < 3)
@@ -146,14 +201,21 @@ void RawToDepthDsp::fillMissingRows(const std::vector<float_t> &inFrame, std::ve
   assert(std::size_t(NUM_GPIXEL_PHASES*frameSize[0]*frameSize[1]) <= outFrame.size());
   assert(inFrame.size() >= std::size_t(frameSize[0]*frameSize[1]*NUM_GPIXEL_PHASES)); // > can happen if inFrame size % binning != 0
   
+  const auto endRow = std::min(rows[1], frameSize[0]);
   int idxBottomRow = int((frameSize[0]-1) * frameSize[1] * NUM_GPIXEL_PHASES);
   for (auto col=0; col<frameSize[1]*NUM_GPIXEL_PHASES; col++)
   {
-    outFrame[col] = inFrame[col]; // top row
-    outFrame[idxBottomRow + col] = inFrame[idxBottomRow + col];
+    if (rows[0] == 0)
+    {
+      outFrame[col] = inFrame[col]; // top row
+    }
+    if (endRow == frameSize[0])
+    {
+      outFrame[idxBottomRow + col] = inFrame[idxBottomRow + col];
+    }
   }
 
-  for (auto row=1; row<frameSize[0]-1; row++)
+  for (auto row=std::max(rows[0], 1U); row<std::min(endRow, frameSize[0]-1); row++)
   {
     bool thisRowActive = activeRows[row];
     bool upRowActive = activeRows[row-1];
@@ -246,31 +308,8 @@ inline float RawToDepthDsp::computeSnrSquared(const std::vector<float_t> &rawRoi
 {
     auto aIdx = idx*NUM_GPIXEL_PHASES;
     assert(aIdx+2 < rawRoi.size());
-    auto rawA = rawRoi[aIdx];
-    auto rawB = rawRoi[aIdx + 1];
-    auto rawC = rawRoi[aIdx + 2];
-
-    if (rawA <= rawB && rawA <= rawC)
-    {
-      auto tmp = rawC;
-      rawC = rawA;
-      rawA = rawB;
-      rawB = tmp;
-    }
-
-    else if (rawB <= rawC && rawB < rawA)
-    {
-      auto tmp = rawA;
-      rawA = rawC;
-      rawC = rawB;
-      rawB = tmp;
-    }
-    
     //float_t snr = (a + b - 2*c) / sqrtf(2.0F * c);
-    const float_t num = rawA + rawB - 2*rawC;
-    const float snr_squared = num*num / (2.0F * rawC);
-    return snr_squared;
-
+    return computeSnrSquared(rawRoi[aIdx], rawRoi[aIdx + 1], rawRoi[aIdx + 2]);
 }
 void RawToDepthDsp::snrVoteV2(const std::vector<float_t> &roi0, const std::vector<float_t> &roi1, std::vector<std::vector<float_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset)
 {
@@ -402,13 +441,18 @@ void RawToDepthDsp::minMaxIntra(const std::vector<float_t> &frame, std::vector<f
   auto numRows = frameSize[0] - vFilterSize + 1;
   auto numColumns = frameSize[1] - hFilterSize + 1;
 
+  // Excluding the masked pixels can only shrink the range of a window, so only the pixels whose
+  // whole window is out of range can be masked. Those are found first, at a cost independent of the filter size.
+  SCOPED_VEC_F(candidates, frame.size());
+  minMaxSliding(frame, candidates, filterSize, frameSize, minMaxThresh);
+
   uint32_t idxStart = rowStart * rowPitch + colStart;
   for (auto rowIdx = 0; rowIdx < numRows; rowIdx++)
   {
     auto idx = idxStart;
     for (auto colIdx = 0; colIdx < numColumns; colIdx++)
     {
-      if (outOfRangeIntra(frame, minMaxMask, idx, offsets, minMaxThresh))
+      if (0.0F != candidates[idx] && outOfRangeIntra(frame, minMaxMask, idx, offsets, minMaxThresh))
       {
         minMaxMask[idx] = 1.0F;
       }
@@ -474,12 +518,82 @@ uint16_t int_sqrt16(uint16_t squaredValue) // could return a byte.
 void RawToDepthDsp::sh2f(const uint16_t *src, std::vector<float_t> &dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask)
 {
   assert(dst.size() == numElements);
-  for (auto idx = 0; idx < numElements; idx++)
+  sh2f(src, dst.data(), numElements, shiftr, rawMask);
+}
+
+void RawToDepthDsp::sh2f(const uint16_t *src, float_t *dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask)
+{
+  auto idx = RawToDepthSimd::sh2f(src, dst, numElements, shiftr, rawMask);
+  for (; idx < numElements; idx++)
   {
     dst[idx] = float_t(uint32_t(src[idx] & rawMask) >> shiftr);
   }
 }
 
+void RawToDepthDsp::packRaw12(const uint16_t *src, uint8_t *dst, uint32_t numElements)
+{
+  assert(numElements % 2 == 0);
+  auto idx = RawToDepthSimd::packRaw12(src, dst, numElements);
+  for (; idx + 1 < numElements; idx += 2)
+  {
+    auto *out = dst + raw12PackedBytes(idx);
+    out[0] = uint8_t(src[idx] >> 8U);
+    out[1] = uint8_t(src[idx + 1] >> 8U);
+    out[2] = uint8_t(((src[idx] >> 4U) & 0xfU) | (src[idx + 1] & 0xf0U));
+  }
+}
+
+void RawToDepthDsp::unpackRaw12(const uint8_t *src, uint16_t *dst, uint32_t numElements)
+{
+  assert(numElements % 2 == 0);
+  auto idx = RawToDepthSimd::unpackRaw12(src, dst, numElements);
+  for (; idx + 1 < numElements; idx += 2)
+  {
+    const auto *in = src + raw12PackedBytes(idx);
+    dst[idx] = uint16_t((uint32_t(in[0]) << 8U) | ((uint32_t(in[2]) & 0xfU) << 4U));
+    dst[idx + 1] = uint16_t((uint32_t(in[1]) << 8U) | (uint32_t(in[2]) & 0xf0U));
+  }
+}
+
+void RawToDepthDsp::sh2f(const uint8_t *packedSrc, std::vector<float_t> &dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask)
+{
+  assert(dst.size() == numElements);
+  // Small enough for the unpacked block to stay in L1 between the two passes.
+  constexpr uint32_t blockElements { 1024 };
+  std::array<uint16_t, blockElements> block;
+  for (uint32_t start = 0; start < numElements; start += blockElements)
+  {
+    const auto count = std::min(blockElements, numElements - start);
+    unpackRaw12(packedSrc + raw12PackedBytes(start), block.data(), count);
+    auto idx = RawToDepthSimd::sh2f(block.data(), dst.data() + start, count, shiftr, rawMask);
+    for (; idx < count; idx++)
+    {
+      dst[start + idx] = float_t(uint32_t(block[idx] & rawMask) >> shiftr);
+    }
+  }
+}
+
+void RawToDepthDsp::hdrMerge(const uint16_t *previousRoi, const uint16_t *roi, uint16_t *mergedRoi, uint32_t roiShorts,
+                             uint16_t saturationLevel, uint32_t shiftr, uint16_t rawMask)
+{
+  // (x >> shiftr) >= (saturationLevel >> shiftr) is the same as x >= threshold, which avoids widening the taps.
+  const auto threshold = uint16_t((saturationLevel >> shiftr) << shiftr);
+  auto idx = RawToDepthSimd::hdrMerge(previousRoi, roi, mergedRoi, roiShorts, threshold, rawMask);
+  for (; idx + 2 < roiShorts; idx += 3)
+  {
+    // The pixel is saturated if its largest tap is.
+    const bool saturated = uint16_t(previousRoi[idx + 0] & rawMask) >= threshold ||
+                           uint16_t(previousRoi[idx + 1] & rawMask) >= threshold ||
+                           uint16_t(previousRoi[idx + 2] & rawMask) >= threshold;
+
+    // All ones selects the re-acquired taps.
+    const auto select = uint16_t(-uint16_t(saturated));
+    mergedRoi[idx + 0] = uint16_t((roi[idx + 0] & select) | (previousRoi[idx + 0] & ~select));
+    mergedRoi[idx + 1] = uint16_t((roi[idx + 1] & select) | (previousRoi[idx + 1] & ~select));
+    mergedRoi[idx + 2] = uint16_t((roi[idx + 2] & select) | (previousRoi[idx + 2] & ~select));
+  }
+}
+
 void RawToDepthDsp::tapRotation(const std::vector<float_t> &roiVector, std::vector<float_t> &frame, uint32_t freqIdx, std::vector<uint32_t> roiSize, uint32_t numGpixelPhases, bool doTapRotation)
 {
   auto roiHeight = roiSize[0];
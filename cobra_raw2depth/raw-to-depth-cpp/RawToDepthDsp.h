@@ -10,6 +10,7 @@
 #pragma once
 #include "FloatVectorPool.h"
 #include "RtdVec.h"
+#include <array>
 #include <cstdint>
 #include <vector>
 #include <cmath>
@@ -19,6 +20,23 @@
 #define SNR_SCALING_FACTOR float_t(8.0F)
 #define RAW_SCALING_FACTOR (8.0F) // shift all input data to fill 15 bits of dynamic range.
 const uint16_t DEFAULT_RAW_MASK = 0xfff0;
+// The bytes of numElements raw words packed into 12 bits each by RawToDepthDsp::packRaw12().
+constexpr uint32_t raw12PackedBytes(uint32_t numElements) { return numElements / 2 * 3; }
+// The fixed-point raw values (RawToDepthV2_fixed) are the float raw values shifted right by this much. The low bit
+// of the float values is always zero (RAW_PIXEL_MASK, INPUT_RAW_SHIFT), so the shift is lossless, and the sum
+// of the three tap permutations fits in 16 bits.
+constexpr uint32_t RAW_FIXED_SHIFT { 1 };
+constexpr uint32_t PHASE_FIXED_BITS { 16 }; ///< The fractional bits of the fixed-point phase, in cycles.
+
+// The Gaussian raw-data smoothing kernels, selected by _rowKernelIdx and _columnKernelIdx.
+// RawToDepthDsp::_fKernels holds the same coefficients, in this order.
+constexpr std::array<float_t,3> SMOOTHING_KERNEL_0 { 0.0000000e+00, 1.0000000e+00, 0.0000000e+00 };
+constexpr std::array<float_t,3> SMOOTHING_KERNEL_1 { 1.9684139e-01, 6.0631722e-01, 1.9684139e-01 };
+constexpr std::array<float_t,5> SMOOTHING_KERNEL_2 { 6.646033000e-03, 1.942255544e-01, 5.982568252e-01, 1.942255544e-01, 6.646033000e-03 };
+constexpr std::array<float_t,7> SMOOTHING_KERNEL_3 { 4.433048175e-03, 5.400558262e-02, 2.420362294e-01, 3.990502797e-01, 2.420362294e-01, 5.400558262e-02, 4.433048175e-03 };
+constexpr std::array<float_t,9> SMOOTHING_KERNEL_4 { 3.325727091e-03, 2.381792204e-02, 9.719199228e-02, 2.259781525e-01, 2.993724122e-01, 2.259781525e-01, 9.719199228e-02, 2.381792204e-02, 3.325727091e-03 };
+constexpr std::array<float_t,11> SMOOTHING_KERNEL_5 { 2.661264666e-03, 1.344761071e-02, 4.740849576e-02, 1.166060837e-01, 2.000968398e-01, 2.395594109e-01, 2.000968398e-01, 1.166060837e-01, 4.740849576e-02, 1.344761071e-02, 2.661264666e-03 };
+constexpr std::array<float_t,15> SMOOTHING_KERNEL_6 { 1.901645579e-03, 6.275148539e-03, 1.723257069e-02, 3.938290545e-02, 7.490262923e-02, 1.185544877e-01, 1.561602730e-01, 1.711806797e-01, 1.561602730e-01, 1.185544877e-01, 7.490262923e-02, 3.938290545e-02, 1.723257069e-02, 6.275148539e-03, 1.901645579e-03 };
 
 class RawToDepthDsp
 {
@@ -38,12 +56,31 @@ public:
 	static const std::vector<float_t> _rect8;
 	static const float_t              _rect8NumberOfSums;
 
+	// The phase-unwrap coefficients of one pair of modulation frequencies, computed once per pair
+	// by getPhaseUnwrap() so that computeWholeFrameRange() only does the per-pixel arithmetic.
+	struct PhaseUnwrap
+	{
+		float_t fInt0 = 0; ///< The modulation frequencies as integer multiples of the GCF.
+		float_t fInt1 = 0;
+		float_t a = 0;     ///< Meters per cycle of the second frequency, and
+		float_t c = 0;     ///< ... of the first.
+		float_t bias = 0;  ///< Whole cycles added before truncating, so that rounding the wrap count is one truncation.
+	};
+	static PhaseUnwrap getPhaseUnwrap(std::array<float_t, 2> freqs, const std::vector<float_t> &fsInt, float_t cMps);
+
+	static void computeWholeFrameRange(RtdVec &fSmoothedPhases0,
+																		 RtdVec &fSmoothedPhases1,
+																		 RtdVec &fCorrectedPhases0,
+																		 RtdVec &fCorrectedPhases1,
+																		 RtdVec &fRanges,
+																		 const PhaseUnwrap &unwrap,
+																		 RtdVec &mFrame);
 	static void computeWholeFrameRange(RtdVec &fSmoothedPhases0,
 																		 RtdVec &fSmoothedPhases1,
 																		 RtdVec &fCorrectedPhases0,
 																		 RtdVec &fCorrectedPhases1,
 																		 RtdVec &fRanges,
-																		 std::array<float_t, 2> freqs, std::vector<float_t> fsInt,
+																		 std::array<float_t, 2> freqs, const std::vector<float_t> &fsInt,
 																		 float_t cMps,
 																		 RtdVec &mFrame); 
 
@@ -52,11 +89,103 @@ public:
 									 RtdVec &phaseFrame,
 									 RtdVec &correctedPhaseFrame,
 									 uint32_t frqIdx);
+	// The smoothed phase of one pixel's smoothed taps, and its phase unwrapped to within maxPhaseError of the
+	// smoothed phase. The per-pixel step of calculatePhaseSmooth().
+	static inline void smoothPhase(float_t rawA, float_t rawB, float_t rawC, float_t phase, float_t maxPhaseError,
+								   float_t &phaseSmoothed, float_t &correctedPhase)
+	{
+		const float_t oneThird =1.0F/3.0F;
+		const float_t twoThirds=2.0F/3.0F;
+
+		float_t frac = 0.0F;
+		if (rawA <= rawB && rawA <= rawC)
+		{
+			auto tmp = rawC;
+			rawC = rawA;
+			rawA = rawB;
+			rawB = tmp;
+			frac = oneThird;
+		}
+		else if (rawB <= rawC && rawB < rawA)
+		{
+			auto tmp = rawA;
+			rawA = rawC;
+			rawC = rawB;
+			rawB = tmp;
+			frac = twoThirds;
+		}
+
+		phaseSmoothed = 0;
+		float_t iPhase = 0;
+		auto signal = rawA + rawB - 2 * rawC;
+		if (signal > 0)
+		{
+			float_t part1 = rawB-rawC;
+			phaseSmoothed = oneThird*(part1 / signal) + frac;
+			iPhase = phase;
+		}
+
+		// This last step is for phase correction
+		correctedPhase = iPhase;
+		float_t phaseErr = iPhase - phaseSmoothed;
+		if (phaseErr > maxPhaseError)
+		{
+			correctedPhase -= 1.0F;
+		}
+		if (phaseErr < -maxPhaseError)
+		{
+			correctedPhase += 1.0F;
+		}
+	}
+
+	// The range and M value of one pixel from its smoothed and corrected phases. The per-pixel step of
+	// computeWholeFrameRange().
+	static inline void unwrapRange(const PhaseUnwrap &unwrap, float_t phaseSmoothed0, float_t phaseSmoothed1,
+								   float_t phase0, float_t phase1, float_t &range, float_t &mValue)
+	{
+		float_t maskNegatives = phaseSmoothed1 < phaseSmoothed0 ? 1.0F : 0.0F;
+		float_t mRaw1 = unwrap.fInt0 * phaseSmoothed1;
+		float_t mRaw2 = unwrap.fInt1 * phaseSmoothed0;
+		float_t mRaw3 = unwrap.fInt0 * maskNegatives;
+		float_t mRaw_tmp = mRaw1 - mRaw2 + mRaw3;
+		float_t mRaw_float = truncf(mRaw_tmp + (unwrap.bias + 0.5F)) - unwrap.bias; // roundf(mRaw_tmp), see getPhaseUnwrap().
+
+		mValue = mRaw_float + mRaw_float + maskNegatives;
+
+		float_t b_float = mRaw_float + phase1 + maskNegatives;
+		float_t d_float = mRaw_float + phase0;
+		range = unwrap.a*b_float + unwrap.c*d_float;
+		if (range < 0)
+		{
+			range = 0;
+		}
+	}
+
+	// The tap-planar working layout of whole-frame processing: planes[k*planeStride + idx] = taps[3*idx + k].
+	static void deinterleaveTaps(const float_t *taps, float_t *planes, std::size_t numPixels, std::size_t planeStride);
+	static void interleaveTaps(const float_t *planes, float_t *taps, std::size_t numPixels, std::size_t planeStride);
+	// smoothSummedData() on numPlanes tap planes of size[0]*size[1] elements each, as written by deinterleaveTaps().
+	// Each plane is filtered as an image of its own, with unit-stride row taps.
+	static void smoothPlanes(const RtdVec &planes, RtdVec &smoothedPlanes, std::array<uint32_t,2> size, uint32_t numPlanes,
+							 uint32_t rowKernelIdx, uint32_t columnKernelIdx);
+	// calculatePhaseSmooth() on both frequencies followed by computeWholeFrameRange(), in a single pass that doesn't
+	// write out the smoothed and corrected phases. smoothedPlanes holds the three smoothed tap planes of the first
+	// frequency followed by those of the second (see smoothPlanes()), each of phase0.size() elements.
+	static void computeWholeFrameRangePlanar(const RtdVec &smoothedPlanes, const RtdVec &phase0, const RtdVec &phase1,
+											 RtdVec &fRanges, const PhaseUnwrap &unwrap, RtdVec &mFrame);
+	// The smoothed phases of both frequencies that computeWholeFrameRangePlanar() doesn't write out, for the pixels
+	// [pixels[0], pixels[1]) of the planes. Written to phaseSmoothed0 and phaseSmoothed1, which point at pixels[0].
+	static void smoothPhasePlanar(const RtdVec &smoothedPlanes, const RtdVec &phase0, const RtdVec &phase1,
+								  std::array<std::size_t,2> pixels, float_t *phaseSmoothed0, float_t *phaseSmoothed1);
 
 	static void smoothSummedData(const RtdVec &roiSummed, RtdVec &roiSmoothed, std::array<uint32_t,2> size,
 								 uint32_t _rowKernelIdx, uint32_t _columnKernelIdx, bool doAcceleratedVersion=true);
 	static void smoothRaw(const std::vector<float_t> &roiSummed, std::vector<float_t> &roiSmoothed, std::array<uint32_t,2> size,
                    uint32_t _rowKernelIdx, uint32_t _columnKernelIdx);
+	// Separable smoothing, specialized at compile time for the kernel combinations used by RawToDepthV2_float.
+	// Returns false, without writing roiSmoothed, if there is no specialization for the kernel indices.
+	static bool smoothSeparable(const RtdVec &roiSummed, RtdVec &roiSmoothed, std::array<uint32_t,2> size,
+								uint32_t _rowKernelIdx, uint32_t _columnKernelIdx);
 	static void smoothRaw3x5(const RtdVec &roi, RtdVec &smoothedRoi, std::array<uint32_t,2> size);
 	static void smoothRaw5x7(const RtdVec &roi, RtdVec &smoothedRoi, std::array<uint32_t,2> size);
 	static void smoothRaw7x15(const RtdVec &roi, RtdVec &smoothedRoi, std::array<uint32_t,2> size);
@@ -67,18 +196,81 @@ public:
 														 RtdVec &snrRoi,
 														 RtdVec &backgroundRoi,
 														 float_t numberOfSummedValues); //num Binning
+	// As above, on the pixels [pixels[0], pixels[1]) only.
+	static void calculatePhase(const RtdVec &rawRoi,
+														 RtdVec &phaseRoi,
+														 RtdVec &signalRoi,
+														 RtdVec &snrRoi,
+														 RtdVec &backgroundRoi,
+														 float_t numberOfSummedValues,
+														 std::array<std::size_t,2> pixels);
 	
 	static void computeSnrSquaredWeights(const std::vector<float_t> &rawRoi0, const std::vector<float_t> &rawRoi1, 
 	                                           std::vector<float_t> &snrWeights, float_t &snrWeightsNumberOfSums, 
 																						 uint32_t roiHeight, uint32_t roiWidth, uint32_t rowOffset=0);
 	static inline float computeSnrSquared(const std::vector<float_t> &rawRoi, uint32_t idx);
+	static inline float computeSnrSquared(float_t rawA, float_t rawB, float_t rawC)
+	{
+		if (rawA <= rawB && rawA <= rawC)
+		{
+			auto tmp = rawC;
+			rawC = rawA;
+			rawA = rawB;
+			rawB = tmp;
+		}
+		else if (rawB <= rawC && rawB < rawA)
+		{
+			auto tmp = rawA;
+			rawA = rawC;
+			rawC = rawB;
+			rawB = tmp;
+		}
+
+		const float_t num = rawA + rawB - 2*rawC;
+		return num*num / (2.0F * rawC);
+	}
 	static void snrVoteV2(const std::vector<float_t> &roi0, const std::vector<float_t> &roi1, std::vector<std::vector<float_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset);
 	static void transposeRaw(const std::vector<float_t> &roi, std::vector<float_t> &roi_t, std::array<uint32_t,2> size);
 	static void sh2f(const uint16_t *src, std::vector<float_t> &dst, uint32_t numElements, uint32_t shiftr = 0, uint16_t rawMask = DEFAULT_RAW_MASK);
+	// As above, into a buffer of at least numElements owned by the caller.
+	static void sh2f(const uint16_t *src, float_t *dst, uint32_t numElements, uint32_t shiftr = 0, uint16_t rawMask = DEFAULT_RAW_MASK);
+	// Merges a saturated ROI with its retake: each pixel whose largest tap in previousRoi is at or above saturationLevel
+	// (after the raw mask and the right shift by shiftr) is taken from roi, the others from previousRoi.
+	static void hdrMerge(const uint16_t *previousRoi, const uint16_t *roi, uint16_t *mergedRoi, uint32_t roiShorts,
+	                     uint16_t saturationLevel, uint32_t shiftr, uint16_t rawMask = DEFAULT_RAW_MASK);
+	// Packs raw words into the 12 bits of DEFAULT_RAW_MASK, in the MIPI RAW12 layout: 3 bytes for each pair of words,
+	// the high bytes of both, then their next nibbles. The bits below DEFAULT_RAW_MASK are dropped. numElements is even.
+	static void packRaw12(const uint16_t *src, uint8_t *dst, uint32_t numElements);
+	// The inverse of packRaw12(). The bits below DEFAULT_RAW_MASK are zero.
+	static void unpackRaw12(const uint8_t *src, uint16_t *dst, uint32_t numElements);
+	// sh2f() of packRaw12() data. The words are unpacked a block at a time, so the 16-bit ROI never goes to memory.
+	static void sh2f(const uint8_t *packedSrc, std::vector<float_t> &dst, uint32_t numElements, uint32_t shiftr = 0, uint16_t rawMask = DEFAULT_RAW_MASK);
+	// Fused tapRotation() for both frequencies and snrVoteV2(). Writes the snr-voted raw triplets directly into rawFov.
+	static void ingestRoi(const std::vector<float_t> &roiVector, std::array<uint32_t,2> roiSize, bool doTapRotation,
+	                      std::vector<std::vector<float_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset);
+	// As above, but also performs the sh2f() conversion while reading the raw 16-bit input.
+	static void ingestRoi(const uint16_t *roi, uint32_t roiShorts, uint32_t shiftr, uint16_t rawMask,
+	                      std::array<uint32_t,2> roiSize, bool doTapRotation,
+	                      std::vector<std::vector<float_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset);
+	// As above, but writes 16-bit fixed-point raw triplets (see RAW_FIXED_SHIFT) for RawToDepthV2_fixed.
+	static void ingestRoi(const std::vector<float_t> &roiVector, std::array<uint32_t,2> roiSize, bool doTapRotation,
+	                      std::vector<std::vector<uint16_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset);
+	static void ingestRoi(const uint16_t *roi, uint32_t roiShorts, uint32_t shiftr, uint16_t rawMask,
+	                      std::array<uint32_t,2> roiSize, bool doTapRotation,
+	                      std::vector<std::vector<uint16_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset);
+	// fillMissingRows(), Binning::binMxN() and calculatePhase() on the 16-bit fixed-point raw frame, in a single pass
+	// with integer sums and phase. binnedFrame receives the binned raw data in the float scale, for smoothing.
+	// Only the binned rows [binnedRows[0], binnedRows[1]) of the outputs are written.
+	static void binAndCalculatePhase(const std::vector<uint16_t> &frame, const std::vector<bool> &activeRows,
+	                                 std::array<uint32_t,2> frameSize, std::array<uint32_t,2> binning,
+	                                 RtdVec &binnedFrame, RtdVec &phaseRoi, RtdVec &signalRoi,
+	                                 RtdVec &snrRoi, RtdVec &backgroundRoi, std::array<uint32_t,2> binnedRows={0, UINT32_MAX});
 	static void tapRotation(const std::vector<float_t> &roiVector, std::vector<float_t> &frame, uint32_t freqIdx, std::vector<uint32_t> roiSize, uint32_t numGpixelPhases, bool doTapRotation);
 
 	static std::vector<int> getMedianOffsets(std::array<uint32_t,2> frameSize, std::vector<uint32_t> kernelIndices);
-	static void medianFilterPlus(RtdVec &inFrame, RtdVec &outFrame, std::vector<uint32_t> kernelIndices, std::array<uint32_t,2> frameSize, bool performGhostMedian);
+	// pointOffsets: the result of getMedianOffsets() for frameSize[1] and kernelIndices, or nullptr to compute it.
+	static void medianFilterPlus(RtdVec &inFrame, RtdVec &outFrame, std::vector<uint32_t> kernelIndices, std::array<uint32_t,2> frameSize, bool performGhostMedian,
+	                             const std::vector<int> *pointOffsets = nullptr);
 	static void median1d(const RtdVec &range, RtdVec &medianFilteredRange, uint32_t binning);
 	static inline float_t binMedian(std::vector<float_t> &points);
 	static inline bool outOfRangeIntra(const std::vector<float_t> &frame, const std::vector<float_t> &minMaxMask, uint32_t idx, const std::vector<int32_t> &offsets, float_t thresh);
@@ -86,11 +278,23 @@ public:
 
 	static void minMaxRecursive(const std::vector<float_t> &frame, std::vector<float_t> &minMaxMask, std::vector<uint32_t> filterSize, std::array<uint32_t,2> frameSize, float_t minMaxThresh);
 	static void minMax(const RtdVec &mFrame, RtdVec &minMaxMask, std::vector<uint32_t> filterSize, std::vector<uint32_t> frameSize, float_t minMaxThresh);
-	static void fillMissingRows(const std::vector<float_t> &frame, std::vector<float_t> &outFrame, std::array<uint32_t,2> frameSize, std::vector<bool> &activeRows);
+	// The same mask as minMax(), computed with separable sliding-window filters at a cost per pixel independent of filterSize.
+	static void minMaxSliding(const RtdVec &frame, RtdVec &minMaxMask, std::vector<uint32_t> filterSize, std::array<uint32_t,2> frameSize, float_t minMaxThresh);
+	// Only the rows [rows[0], rows[1]) of outFrame are written.
+	static void fillMissingRows(const std::vector<float_t> &frame, std::vector<float_t> &outFrame, std::array<uint32_t,2> frameSize, const std::vector<bool> &activeRows,
+	                            std::array<uint32_t,2> rows={0, UINT32_MAX});
 	
 	// Reduce the height of the ROI to 1 row by summing along the columns. 
 	static void collapseRawRoi(const std::vector<float_t> & rawRoi, std::vector<float_t> &collapsedRoi, const std::vector<float_t> &weights, 
 	            const std::array<uint32_t,2> &binning, std::array<uint32_t, 2> roiSize, uint32_t rowOffset=0);
+	// collapseRawRoi() specialized on the horizontal binning, selected once per FOV with selectCollapseRawRoi().
+	using CollapseKernel = void (*)(const std::vector<float_t> &rawRoi, std::vector<float_t> &collapsedRoi, const std::vector<float_t> &weights,
+	                                std::array<uint32_t, 2> roiSize, uint32_t rowOffset);
+	template <uint32_t BIN_X>
+	static void collapseRawRoi(const std::vector<float_t> &rawRoi, std::vector<float_t> &collapsedRoi, const std::vector<float_t> &weights,
+	                           std::array<uint32_t, 2> roiSize, uint32_t rowOffset);
+	// Returns the kernel for the horizontal binning binX, or nullptr if it is not 1, 2 or 4.
+	static CollapseKernel selectCollapseRawRoi(uint32_t binX);
 	static void minMax1d(const std::vector<float_t> &rawRoi0, const std::vector<float_t> &rawRoi1, std::vector<float_t> &mask,
 	                     std::array<uint32_t, 2> rawRoiSize, uint32_t binning);
 };
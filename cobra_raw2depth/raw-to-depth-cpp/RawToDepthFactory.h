@@ -3,6 +3,10 @@
  * @brief A factory class to create specializations for RawToDepth for
  * different processing scenarios.
  * 
+ * The specializations are registered as DSP engines (see RtdEngine), each with the scan modes it can process and
+ * other capabilities. The engine of each FOV is selected from the FOV's scan mode, the engine configured for the
+ * FOV (setFovEngine()), and the default grid-mode engine. 
+ *
  * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
  * 
  */
@@ -10,11 +14,79 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <memory>
+#include <string>
 #include "RawToDepth.h"
 
+constexpr uint32_t RTD_ENGINE_CAP_GRID { 1U << 0 };        ///< Processes grid-mode FOVs.
+constexpr uint32_t RTD_ENGINE_CAP_STRIPE { 1U << 1 };      ///< Processes stripe-mode FOVs.
+constexpr uint32_t RTD_ENGINE_CAP_FIXED_POINT { 1U << 2 }; ///< Uses 16-bit fixed-point raw frames. Not bit-exact with the float engines.
+
+/**
+ * @brief One of the DSP engines built into this binary.
+ */
+struct RtdEngineInfo
+{
+  RtdEngine engine;
+  const char *name;      ///< For configuration and logging, e.g. "grid_fixed".
+  uint32_t capabilities; ///< RTD_ENGINE_CAP_*
+  std::unique_ptr<RawToDepth> (*create)(uint32_t fovIdx, uint32_t headerNum);
+};
+
 class RawToDepthFactory 
 {
 public:
-  static void create(std::vector<std::unique_ptr<RawToDepth>> &rtds, RtdMetadata &mdat, uint32_t fovIdx=0, uint32_t headerNum=0);
+  /**
+   * @brief Creates the RawToDepth object of the FOV, or replaces it if the FOV now needs a different engine.
+   * Called for every ROI, so once the FOV has its engine this is a comparison of the engine ids.
+   */
+  static void create(std::vector<std::unique_ptr<RawToDepth>> &rtds, const RtdMetadata &mdat, uint32_t fovIdx=0, uint32_t headerNum=0);
+
+  static const std::vector<RtdEngineInfo> &getEngines(); ///< The engines built into this binary.
+  static const RtdEngineInfo *findEngine(RtdEngine engine); ///< nullptr if the engine isn't built.
+  static const RtdEngineInfo *findEngine(const std::string &name); ///< nullptr if there is no engine of that name.
+
+  /**
+   * @brief Selects the engine of an FOV, for the FOVs created or changed after this call. An engine that can't process
+   * the FOV's scan mode is ignored for it, and RtdEngine::NONE (the default) restores the default engines.
+   */
+  static void setFovEngine(uint32_t fovIdx, RtdEngine engine);
+  static RtdEngine getFovEngine(uint32_t fovIdx);
+
+  /**
+   * @brief Selects the grid-mode engine of the FOVs without an engine of their own (see setFovEngine()).
+   * RtdEngine::NONE (the default) selects it with setFixedPoint().
+   */
+  static void setDefaultGridEngine(RtdEngine engine);
+  // The engine an FOV in the given scan mode is created with.
+  static RtdEngine selectEngine(uint32_t fovIdx, bool stripeMode);
+
+  /**
+   * @brief Selects the fixed-point grid-mode processing (RawToDepthV2_fixed) instead of RawToDepthV2_float for the FOVs
+   * created or changed to grid mode after this call.
+   */
+  static void setFixedPoint(bool enable) { _fixedPoint.store(enable, std::memory_order_relaxed); }
+  static bool getFixedPoint() { return _fixedPoint.load(std::memory_order_relaxed); }
+
+  static constexpr uint32_t DEFAULT_BENCHMARK_FRAMES { 8 };
+  /**
+   * @brief Times each grid-mode engine on a synthetic FOV of the largest size, processed numFrames times after one
+   * warmup frame, and returns the fastest. Takes a few seconds, so it's meant to be run once at startup, before any
+   * sensor head. The SIMD level, tiling and worker threads in effect are used by all of the engines alike.
+   */
+  static RtdEngine benchmarkGridEngines(uint32_t numFrames = DEFAULT_BENCHMARK_FRAMES);
+
+  /**
+   * @brief The ROIs of a synthetic grid-mode FOV of fovIdx, numRois of roiRows rows each, binned by binning, with
+   * pseudo-random raw data that is the same on every call. Used to benchmark the engines and to prewarm the FOVs.
+   */
+  static std::vector<std::vector<uint16_t>> makeSyntheticGridFov(uint32_t fovIdx, uint32_t numRois, uint32_t roiRows,
+                                                                 uint32_t binning);
+
+private:
+  static std::atomic<bool> _fixedPoint;
+  static std::atomic<RtdEngine> _defaultGridEngine;
+  static std::array<std::atomic<RtdEngine>, MAX_ACTIVE_FOVS> _fovEngines;
 };
@@ -8,28 +8,237 @@
  */
 #include "RawToDepthFactory.h"
 #include "RawToDepthV2_float.h"
+#include "RawToDepthV2_fixed.h"
 #include "RawToDepthStripe_float.h"
+#include "LumoLogger.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <random>
 
-void RawToDepthFactory::create(std::vector<std::unique_ptr<RawToDepth>> &rtds, RtdMetadata &mdat, uint32_t fovIdx, uint32_t headerNum) 
+std::atomic<bool> RawToDepthFactory::_fixedPoint { false };
+std::atomic<RtdEngine> RawToDepthFactory::_defaultGridEngine { RtdEngine::NONE };
+std::array<std::atomic<RtdEngine>, MAX_ACTIVE_FOVS> RawToDepthFactory::_fovEngines {};
+
+namespace
+{
+template <typename T>
+std::unique_ptr<RawToDepth> createEngine(uint32_t fovIdx, uint32_t headerNum)
+{
+   return std::make_unique<T>(fovIdx, headerNum);
+}
+} // namespace
+
+const std::vector<RtdEngineInfo> &RawToDepthFactory::getEngines()
+{
+   static const std::vector<RtdEngineInfo> engines {
+      { RtdEngine::STRIPE_FLOAT, "stripe_float", RTD_ENGINE_CAP_STRIPE, createEngine<RawToDepthStripe_float> },
+      { RtdEngine::GRID_FLOAT, "grid_float", RTD_ENGINE_CAP_GRID, createEngine<RawToDepthV2_float> },
+      { RtdEngine::GRID_FIXED, "grid_fixed", RTD_ENGINE_CAP_GRID | RTD_ENGINE_CAP_FIXED_POINT, createEngine<RawToDepthV2_fixed> },
+   };
+   return engines;
+}
+
+const RtdEngineInfo *RawToDepthFactory::findEngine(RtdEngine engine)
+{
+   const auto &engines = getEngines();
+   auto item = std::find_if(engines.begin(), engines.end(), [engine](const RtdEngineInfo &info) { return info.engine == engine; });
+   return item == engines.end() ? nullptr : &*item;
+}
+
+const RtdEngineInfo *RawToDepthFactory::findEngine(const std::string &name)
+{
+   const auto &engines = getEngines();
+   auto item = std::find_if(engines.begin(), engines.end(), [&name](const RtdEngineInfo &info) { return name == info.name; });
+   return item == engines.end() ? nullptr : &*item;
+}
+
+void RawToDepthFactory::setFovEngine(uint32_t fovIdx, RtdEngine engine)
+{
+   if (fovIdx >= MAX_ACTIVE_FOVS)
+   {
+      LLogErr("Can't select the engine of FOV " << fovIdx << ". There are " << MAX_ACTIVE_FOVS << " FOVs.");
+      return;
+   }
+   if (engine != RtdEngine::NONE && nullptr == findEngine(engine))
+   {
+      LLogErr("Engine " << uint32_t(engine) << " isn't built. FOV " << fovIdx << " keeps the default engines.");
+      return;
+   }
+   _fovEngines[fovIdx].store(engine, std::memory_order_relaxed);
+}
+
+RtdEngine RawToDepthFactory::getFovEngine(uint32_t fovIdx)
+{
+   return fovIdx < MAX_ACTIVE_FOVS ? _fovEngines[fovIdx].load(std::memory_order_relaxed) : RtdEngine::NONE;
+}
+
+void RawToDepthFactory::setDefaultGridEngine(RtdEngine engine)
+{
+   const auto *info = findEngine(engine);
+   if (engine != RtdEngine::NONE && (nullptr == info || (info->capabilities & RTD_ENGINE_CAP_GRID) == 0))
+   {
+      LLogErr("Engine " << uint32_t(engine) << " can't be the default grid-mode engine.");
+      return;
+   }
+   _defaultGridEngine.store(engine, std::memory_order_relaxed);
+}
+
+RtdEngine RawToDepthFactory::selectEngine(uint32_t fovIdx, bool stripeMode)
+{
+   const auto capability = stripeMode ? RTD_ENGINE_CAP_STRIPE : RTD_ENGINE_CAP_GRID;
+   const auto *fovEngine = findEngine(getFovEngine(fovIdx));
+   if (nullptr != fovEngine && (fovEngine->capabilities & capability) != 0)
+   {
+      return fovEngine->engine;
+   }
+   if (stripeMode)
+   {
+      return RtdEngine::STRIPE_FLOAT;
+   }
+
+   const auto defaultEngine = _defaultGridEngine.load(std::memory_order_relaxed);
+   if (defaultEngine != RtdEngine::NONE)
+   {
+      return defaultEngine;
+   }
+   return getFixedPoint() ? RtdEngine::GRID_FIXED : RtdEngine::GRID_FLOAT;
+}
+
+void RawToDepthFactory::create(std::vector<std::unique_ptr<RawToDepth>> &rtds, const RtdMetadata &mdat, uint32_t fovIdx, uint32_t headerNum) 
 {
    assert(fovIdx < rtds.size());
 
-   if (mdat.getStripeModeEnabled(fovIdx))
+   const bool stripeMode = mdat.getStripeModeEnabled(fovIdx);
+   if (!stripeMode && !mdat.getGridModeEnabled(fovIdx))
+   {
+      return;
+   }
+
+   const auto engine = selectEngine(fovIdx, stripeMode);
+   auto &rtd = rtds[fovIdx];
+   if (nullptr != rtd && rtd->getEngine() == engine)
+   {
+      return;
+   }
+
+   if (nullptr != rtd)
+   {
+      rtd->shutdown();
+   }
+   rtd = findEngine(engine)->create(fovIdx, headerNum);
+   rtd->_engine = engine;
+}
+
+/**
+ * @brief The ROIs of a synthetic grid-mode FOV, with the signal on taps A and B and the background on tap C.
+ */
+std::vector<std::vector<uint16_t>> RawToDepthFactory::makeSyntheticGridFov(uint32_t fovIdx, uint32_t numRois, uint32_t roiRows,
+                                                                           uint32_t binning)
+{
+   constexpr uint32_t numPermutations { 3 };
+   auto md = [](uint32_t val) { return uint16_t(val << MD_SHIFT); };
+   std::mt19937 random(1); // The same frame on every run
+   std::vector<std::vector<uint16_t>> rois;
+   for (uint32_t roiIdx = 0; roiIdx < numRois; roiIdx++)
+   {
+      auto &roi = rois.emplace_back(MD_ROW_SHORTS + size_t(roiRows) * IMAGE_WIDTH * NUM_GPIXEL_PHASES * 2 * numPermutations);
+      std::copy(RtdMetadata::DEFAULT_METADATA.begin(), RtdMetadata::DEFAULT_METADATA.end(), roi.begin());
+
+      auto *mdat = (Metadata_t*)roi.data();
+      mdat->roiStartRow = md(roiIdx * roiRows);
+      mdat->roiNumRows = md(roiRows);
+      mdat->f0ModulationIndex = md(8);
+      mdat->f1ModulationIndex = md(7);
+      mdat->activeStreamBitmask = md(1U << fovIdx);
+      mdat->startStopFlags[0] = md((roiIdx == 0 ? START_STOP_FLAG_FIRST_ROI : 0U) |
+                                   (roiIdx == numRois - 1 ? START_STOP_FLAG_FRAME_COMPLETED : 0U));
+      mdat->roiCounter = md(roiIdx & 0xfffU);
+      mdat->timestamp0 = md(roiIdx);
+      mdat->reduceMode = md(REDUCE_MODE_RTD);
+      mdat->saturationThreshold = md(0xfff);
+
+      auto &fov = mdat->perFovMetadata[fovIdx];
+      fov.binMode = md(binning);
+      fov.fovRowStart = md(0);
+      fov.fovNumRows = md(numRois * roiRows);
+      fov.fovNumRois = md(numRois);
+      fov.rtdAlgorithmCommon = md(0);
+      fov.rtdAlgorithmGrid = md(RTD_ALG_GRID_ENABLE_RANGE_MEDIAN | RTD_ALG_GRID_ENABLE_MIN_MAX);
+      fov.rtdAlgorithmStripe = md(0);
+      fov.snrThresh = md(8);
+      fov.nearestNeighborLevel = md(1);
+
+      for (auto idx = MD_ROW_SHORTS; idx < roi.size(); idx += NUM_GPIXEL_PHASES)
+      {
+         auto background = uint32_t(0x1000 + random() % 0x800);
+         roi[idx + 0] = uint16_t((background + random() % 0x3000) & 0xfff0U);
+         roi[idx + 1] = uint16_t((background + random() % 0x3000) & 0xfff0U);
+         roi[idx + 2] = uint16_t((background + random() % 0x600) & 0xfff0U);
+      }
+   }
+   return rois;
+}
+
+RtdEngine RawToDepthFactory::benchmarkGridEngines(uint32_t numFrames)
+{
+   constexpr uint32_t roiRows { 8 };
+   constexpr uint32_t binning { 2 };
+   const auto rois = makeSyntheticGridFov(0, MAX_IMAGE_HEIGHT / roiRows, roiRows, binning);
+
+   auto fastest = RtdEngine::GRID_FLOAT;
+   auto fastestMs = std::numeric_limits<double>::max();
+   for (const auto &info : getEngines())
    {
-      if (nullptr == rtds[fovIdx] || dynamic_cast<RawToDepthStripe_float*>((rtds.at(fovIdx)).get()) == nullptr)
+      if ((info.capabilities & RTD_ENGINE_CAP_GRID) == 0)
+      {
+         continue;
+      }
+
+      auto rtd = info.create(0, 0);
+      std::mutex mutex;
+      std::condition_variable fovReceived;
+      uint32_t numFovs = 0;
+      bool timedOut = false;
+      std::chrono::duration<double, std::milli> elapsed {0};
+      for (uint32_t frameIdx = 0; frameIdx <= numFrames && !timedOut; frameIdx++)
       {
-         if (nullptr != rtds[fovIdx])
+         const auto start = std::chrono::steady_clock::now();
+         for (const auto &roi : rois)
          {
-            rtds[fovIdx]->shutdown();
+            const auto numBytes = uint32_t(roi.size() * sizeof(uint16_t));
+            rtd->processRoi(RtdMetadata(roi.data(), numBytes), roi.data(), numBytes);
+         }
+         rtd->processWholeFrame([&](std::shared_ptr<FovSegment> /*fovSegment*/)
+                                {
+                                   std::lock_guard lock(mutex);
+                                   numFovs++;
+                                   fovReceived.notify_all();
+                                });
+         std::unique_lock lock(mutex);
+         timedOut = !fovReceived.wait_for(lock, std::chrono::seconds(1), [&] { return numFovs == frameIdx + 1; });
+         if (frameIdx > 0) // The first frame warms up the buffers.
+         {
+            elapsed += std::chrono::steady_clock::now() - start;
          }
-         rtds[fovIdx] = std::make_unique<RawToDepthStripe_float>(fovIdx, headerNum);
       }
-   }
-   else if (mdat.getGridModeEnabled(fovIdx))
-   {
-      if (nullptr == rtds[fovIdx] || dynamic_cast<RawToDepthV2_float*>((rtds.at(fovIdx)).get()) == nullptr)
+      rtd->shutdown();
+
+      if (timedOut)
+      {
+         LLogErr("Benchmark: " << info.name << " didn't output the synthetic FOV. Skipping it.");
+         continue;
+      }
+      const auto frameMs = elapsed.count() / double(std::max(numFrames, 1U));
+      LLogInfo("Benchmark: " << info.name << " processes a " << MAX_IMAGE_HEIGHT << "-row FOV in " << frameMs << " ms");
+      if (frameMs < fastestMs)
       {
-         rtds[fovIdx] = std::make_unique<RawToDepthV2_float>(fovIdx, headerNum);
+         fastestMs = frameMs;
+         fastest = info.engine;
       }
    }
+   LLogInfo("Benchmark: the fastest grid-mode engine is " << findEngine(fastest)->name);
+   return fastest;
 }
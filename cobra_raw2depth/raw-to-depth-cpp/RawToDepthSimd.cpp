@@ -0,0 +1,239 @@
+/**
+ * @file RawToDepthSimd.cpp
+ * @brief Runtime selection of the SIMD implementation used by the RawToDepthDsp kernels.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "RawToDepthSimd.h"
+
+std::atomic<RawToDepthSimd::Level> RawToDepthSimd::_level { RawToDepthSimd::detect() };
+
+RawToDepthSimd::Level RawToDepthSimd::detect()
+{
+#if defined(__aarch64__) && defined(__ARM_NEON)
+  return Level::NEON;
+#elif defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return Level::AVX2;
+  }
+  return Level::SSE2;
+#else
+  return Level::SCALAR;
+#endif
+}
+
+void RawToDepthSimd::setLevel(Level level)
+{
+  auto best = detect();
+  if (uint32_t(level) > uint32_t(best))
+  {
+    level = best;
+  }
+  if (level == Level::NEON && best != Level::NEON)
+  {
+    level = best == Level::SCALAR ? Level::SCALAR : Level::SSE2; // NEON requested on an x86 machine.
+  }
+  _level.store(level, std::memory_order_relaxed);
+}
+
+const char *RawToDepthSimd::getLevelName(Level level)
+{
+  switch (level)
+  {
+  case Level::NEON:
+    return "NEON";
+  case Level::SSE2:
+    return "SSE2";
+  case Level::AVX2:
+    return "AVX2";
+  case Level::SCALAR:
+  default:
+    return "scalar";
+  }
+}
+
+uint32_t RawToDepthSimd::sh2f(const uint16_t *src, float_t *dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask)
+{
+  switch (getLevel())
+  {
+  case Level::AVX2:
+    return sh2f256(src, dst, numElements, shiftr, rawMask);
+  case Level::NEON:
+  case Level::SSE2:
+    return sh2f128(src, dst, numElements, shiftr, rawMask);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::hdrMerge(const uint16_t *previousRoi, const uint16_t *roi, uint16_t *mergedRoi,
+                                  uint32_t numElements, uint16_t threshold, uint16_t rawMask)
+{
+  // The merge is bound by memory bandwidth, so the 128-bit version is also used at the AVX2 level.
+  switch (getLevel())
+  {
+  case Level::AVX2:
+  case Level::NEON:
+  case Level::SSE2:
+    return hdrMerge128(previousRoi, roi, mergedRoi, numElements, threshold, rawMask);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::packRaw12(const uint16_t *src, uint8_t *dst, uint32_t numElements)
+{
+  // Like hdrMerge(), packing is bound by memory bandwidth.
+  switch (getLevel())
+  {
+  case Level::AVX2:
+  case Level::NEON:
+  case Level::SSE2:
+    return packRaw12_128(src, dst, numElements);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::unpackRaw12(const uint8_t *src, uint16_t *dst, uint32_t numElements)
+{
+  switch (getLevel())
+  {
+  case Level::AVX2:
+  case Level::NEON:
+  case Level::SSE2:
+    return unpackRaw12_128(src, dst, numElements);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::calculatePhase(const float_t *rawRoi, float_t *phaseRoi, float_t *signalRoi,
+                                        float_t *snrRoi, float_t *backgroundRoi,
+                                        uint32_t numElements, float_t numberOfSummedValues)
+{
+  switch (getLevel())
+  {
+  case Level::AVX2:
+    return calculatePhase256(rawRoi, phaseRoi, signalRoi, snrRoi, backgroundRoi, numElements, numberOfSummedValues);
+  case Level::NEON:
+  case Level::SSE2:
+    return calculatePhase128(rawRoi, phaseRoi, signalRoi, snrRoi, backgroundRoi, numElements, numberOfSummedValues);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::calculatePhaseSmooth(const float_t *frameSmoothed, float_t *phaseSmoothedFrame,
+                                              const float_t *phaseFrame, float_t *correctedPhaseFrame,
+                                              uint32_t numElements, float_t maxPhaseError)
+{
+  switch (getLevel())
+  {
+  case Level::AVX2:
+    return calculatePhaseSmooth256(frameSmoothed, phaseSmoothedFrame, phaseFrame, correctedPhaseFrame,
+                                   numElements, maxPhaseError);
+  case Level::NEON:
+  case Level::SSE2:
+    return calculatePhaseSmooth128(frameSmoothed, phaseSmoothedFrame, phaseFrame, correctedPhaseFrame,
+                                   numElements, maxPhaseError);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::convolveStride3(const float_t *kernel, uint32_t kernelSize,
+                                         const float_t *in, float_t *out, uint32_t numElements)
+{
+  switch (getLevel())
+  {
+  case Level::AVX2:
+    return convolveStride3_256(kernel, kernelSize, in, out, numElements);
+  case Level::NEON:
+  case Level::SSE2:
+    return convolveStride3_128(kernel, kernelSize, in, out, numElements);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::computeWholeFrameRange(const float_t *smoothedPhases0, const float_t *smoothedPhases1,
+                                                const float_t *correctedPhases0, const float_t *correctedPhases1,
+                                                float_t *ranges, float_t *mFrame, uint32_t numElements,
+                                                float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias)
+{
+  switch (getLevel())
+  {
+  case Level::AVX2:
+    return computeWholeFrameRange256(smoothedPhases0, smoothedPhases1, correctedPhases0, correctedPhases1,
+                                     ranges, mFrame, numElements, fInt0, fInt1, aFloat, cFloat, bias);
+  case Level::NEON:
+  case Level::SSE2:
+    return computeWholeFrameRange128(smoothedPhases0, smoothedPhases1, correctedPhases0, correctedPhases1,
+                                     ranges, mFrame, numElements, fInt0, fInt1, aFloat, cFloat, bias);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::deinterleaveTaps(const float_t *taps, float_t *planes, uint32_t numElements, std::size_t planeStride)
+{
+  switch (getLevel())
+  {
+  case Level::AVX2:
+    return deinterleaveTaps256(taps, planes, numElements, planeStride);
+  case Level::NEON:
+  case Level::SSE2:
+    return deinterleaveTaps128(taps, planes, numElements, planeStride);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::computeWholeFrameRangePlanar(const float_t *smoothedPlanes, std::size_t planeStride,
+                                                      const float_t *phases0, const float_t *phases1,
+                                                      float_t *ranges, float_t *mFrame, uint32_t numElements, float_t maxPhaseError,
+                                                      float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias)
+{
+  switch (getLevel())
+  {
+  case Level::AVX2:
+    return computeWholeFrameRangePlanar256(smoothedPlanes, planeStride, phases0, phases1, ranges, mFrame, numElements,
+                                           maxPhaseError, fInt0, fInt1, aFloat, cFloat, bias);
+  case Level::NEON:
+  case Level::SSE2:
+    return computeWholeFrameRangePlanar128(smoothedPlanes, planeStride, phases0, phases1, ranges, mFrame, numElements,
+                                           maxPhaseError, fInt0, fInt1, aFloat, cFloat, bias);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
+
+uint32_t RawToDepthSimd::quantizeOutputs(const OutputRun &run, uint32_t numElements)
+{
+  switch (getLevel())
+  {
+  case Level::AVX2:
+    return quantizeOutputs256(run, numElements);
+  case Level::NEON:
+  case Level::SSE2:
+    return quantizeOutputs128(run, numElements);
+  case Level::SCALAR:
+  default:
+    return 0;
+  }
+}
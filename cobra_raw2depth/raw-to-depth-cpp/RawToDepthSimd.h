@@ -0,0 +1,158 @@
+/**
+ * @file RawToDepthSimd.h
+ * @brief Runtime-dispatched SIMD implementations of the RawToDepthDsp hot-path kernels.
+ *
+ * Each kernel processes the largest prefix of its input that is a multiple of the
+ * vector width and returns the number of elements it handled. The caller runs the
+ * original scalar loop over the remainder, so the scalar code in RawToDepthDsp remains
+ * both the fallback and the reference implementation.
+ *
+ * NEON is used on aarch64 (A72). SSE2 and AVX2 are used on x86_64 replay machines,
+ * with AVX2 selected only if the CPU reports support for it at runtime.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+class RawToDepthSimd
+{
+public:
+  enum class Level : uint32_t
+  {
+    SCALAR = 0,
+    NEON,
+    SSE2,
+    AVX2
+  };
+
+  ///< The longest smoothing kernel supported by convolveStride3()
+  static constexpr uint32_t MAX_KERNEL_SIZE { 15 };
+
+  /**
+   * @brief One run of pixels of the float output planes, and where quantizeOutputs() writes them as 16-bit values.
+   * The pointers point at the first pixel of the run.
+   */
+  struct OutputRun
+  {
+    const float_t *ranges = nullptr;
+    const float_t *minMaxMask = nullptr; ///< nullptr to pass the ranges through unmasked
+    const float_t *snr = nullptr;        ///< The summed snr of both frequencies
+    const float_t *signal = nullptr;     ///< The summed signal of both frequencies
+    const float_t *background = nullptr;
+    uint16_t *rangeOut = nullptr;        ///< nullptr to leave the ranges alone (e.g. outside of the pixel mask)
+    uint16_t *snrOut = nullptr;          ///< nullptr if the plane isn't output, and so on
+    uint16_t *signalOut = nullptr;
+    uint16_t *backgroundOut = nullptr;
+    float_t rangeOffset = 0.0F;          ///< Subtracted from the ranges (the temperature correction), which are then clipped at 0
+    float_t maxRange = 1.0F;             ///< The maximum unambiguous range, modulo which the corrected ranges are taken
+    float_t snrThresh = 0.0F;            ///< Ranges whose summed snr is below are masked
+    float_t rangeLimit = 0.0F;           ///< Ranges above are masked
+    float_t rangeScale = 1.0F;           ///< Output range steps per meter
+  };
+  ///< Ranges whose min-max mask is above are masked
+  static constexpr float_t MIN_MAX_THRESHOLD { 0.5F };
+
+  // Returns the best level supported by the CPU this process is running on.
+  static Level detect();
+  // Returns the level currently used by the kernels.
+  static Level getLevel() { return _level.load(std::memory_order_relaxed); }
+  // Selects the level used by the kernels. Requests above detect() are clamped to detect().
+  static void setLevel(Level level);
+  static const char *getLevelName(Level level);
+
+  static uint32_t sh2f(const uint16_t *src, float_t *dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask);
+
+  // Processes whole pixels (triplets of taps). threshold is compared with the masked, unshifted taps.
+  static uint32_t hdrMerge(const uint16_t *previousRoi, const uint16_t *roi, uint16_t *mergedRoi,
+                           uint32_t numElements, uint16_t threshold, uint16_t rawMask);
+
+  // Process whole pairs of words, 3 packed bytes each. See RawToDepthDsp::packRaw12().
+  static uint32_t packRaw12(const uint16_t *src, uint8_t *dst, uint32_t numElements);
+  static uint32_t unpackRaw12(const uint8_t *src, uint16_t *dst, uint32_t numElements);
+
+  static uint32_t calculatePhase(const float_t *rawRoi, float_t *phaseRoi, float_t *signalRoi,
+                                 float_t *snrRoi, float_t *backgroundRoi,
+                                 uint32_t numElements, float_t numberOfSummedValues);
+
+  static uint32_t calculatePhaseSmooth(const float_t *frameSmoothed, float_t *phaseSmoothedFrame,
+                                       const float_t *phaseFrame, float_t *correctedPhaseFrame,
+                                       uint32_t numElements, float_t maxPhaseError);
+
+  // out[idx] = sum_j in[idx + 3*(j - kernelSize/2)] * kernel[j]. Called with in and out offset
+  // such that all of the taps for the first and last elements are within the buffers.
+  static uint32_t convolveStride3(const float_t *kernel, uint32_t kernelSize,
+                                  const float_t *in, float_t *out, uint32_t numElements);
+
+  static uint32_t computeWholeFrameRange(const float_t *smoothedPhases0, const float_t *smoothedPhases1,
+                                         const float_t *correctedPhases0, const float_t *correctedPhases1,
+                                         float_t *ranges, float_t *mFrame, uint32_t numElements,
+                                         float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias);
+
+  // planes[k*planeStride + idx] = taps[3*idx + k]. See RawToDepthDsp::deinterleaveTaps().
+  static uint32_t deinterleaveTaps(const float_t *taps, float_t *planes, uint32_t numElements, std::size_t planeStride);
+
+  // calculatePhaseSmooth() on both frequencies and computeWholeFrameRange() in one pass over tap-planar smoothed
+  // data. See RawToDepthDsp::computeWholeFrameRangePlanar().
+  static uint32_t computeWholeFrameRangePlanar(const float_t *smoothedPlanes, std::size_t planeStride,
+                                               const float_t *phases0, const float_t *phases1,
+                                               float_t *ranges, float_t *mFrame, uint32_t numElements, float_t maxPhaseError,
+                                               float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias);
+
+  // See RawToDepthCommon::getOutputPlanes(), which runs the scalar reference over the remainder.
+  static uint32_t quantizeOutputs(const OutputRun &run, uint32_t numElements);
+
+private:
+  static std::atomic<Level> _level;
+
+  // 128-bit implementations (NEON or SSE2). Defined in simd128_float.cpp.
+  static uint32_t sh2f128(const uint16_t *src, float_t *dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask);
+  static uint32_t hdrMerge128(const uint16_t *previousRoi, const uint16_t *roi, uint16_t *mergedRoi,
+                              uint32_t numElements, uint16_t threshold, uint16_t rawMask);
+  static uint32_t packRaw12_128(const uint16_t *src, uint8_t *dst, uint32_t numElements);
+  static uint32_t unpackRaw12_128(const uint8_t *src, uint16_t *dst, uint32_t numElements);
+  static uint32_t calculatePhase128(const float_t *rawRoi, float_t *phaseRoi, float_t *signalRoi,
+                                    float_t *snrRoi, float_t *backgroundRoi,
+                                    uint32_t numElements, float_t numberOfSummedValues);
+  static uint32_t calculatePhaseSmooth128(const float_t *frameSmoothed, float_t *phaseSmoothedFrame,
+                                          const float_t *phaseFrame, float_t *correctedPhaseFrame,
+                                          uint32_t numElements, float_t maxPhaseError);
+  static uint32_t convolveStride3_128(const float_t *kernel, uint32_t kernelSize,
+                                      const float_t *in, float_t *out, uint32_t numElements);
+  static uint32_t computeWholeFrameRange128(const float_t *smoothedPhases0, const float_t *smoothedPhases1,
+                                            const float_t *correctedPhases0, const float_t *correctedPhases1,
+                                            float_t *ranges, float_t *mFrame, uint32_t numElements,
+                                            float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias);
+  static uint32_t deinterleaveTaps128(const float_t *taps, float_t *planes, uint32_t numElements, std::size_t planeStride);
+  static uint32_t quantizeOutputs128(const OutputRun &run, uint32_t numElements);
+  static uint32_t computeWholeFrameRangePlanar128(const float_t *smoothedPlanes, std::size_t planeStride,
+                                                  const float_t *phases0, const float_t *phases1,
+                                                  float_t *ranges, float_t *mFrame, uint32_t numElements, float_t maxPhaseError,
+                                                  float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias);
+
+  // 256-bit implementations (AVX2). Defined in simd256_float.cpp, which is built with -mavx2.
+  static uint32_t sh2f256(const uint16_t *src, float_t *dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask);
+  static uint32_t calculatePhase256(const float_t *rawRoi, float_t *phaseRoi, float_t *signalRoi,
+                                    float_t *snrRoi, float_t *backgroundRoi,
+                                    uint32_t numElements, float_t numberOfSummedValues);
+  static uint32_t calculatePhaseSmooth256(const float_t *frameSmoothed, float_t *phaseSmoothedFrame,
+                                          const float_t *phaseFrame, float_t *correctedPhaseFrame,
+                                          uint32_t numElements, float_t maxPhaseError);
+  static uint32_t convolveStride3_256(const float_t *kernel, uint32_t kernelSize,
+                                      const float_t *in, float_t *out, uint32_t numElements);
+  static uint32_t computeWholeFrameRange256(const float_t *smoothedPhases0, const float_t *smoothedPhases1,
+                                            const float_t *correctedPhases0, const float_t *correctedPhases1,
+                                            float_t *ranges, float_t *mFrame, uint32_t numElements,
+                                            float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias);
+  static uint32_t deinterleaveTaps256(const float_t *taps, float_t *planes, uint32_t numElements, std::size_t planeStride);
+  static uint32_t quantizeOutputs256(const OutputRun &run, uint32_t numElements);
+  static uint32_t computeWholeFrameRangePlanar256(const float_t *smoothedPlanes, std::size_t planeStride,
+                                                  const float_t *phases0, const float_t *phases1,
+                                                  float_t *ranges, float_t *mFrame, uint32_t numElements, float_t maxPhaseError,
+                                                  float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias);
+};
@@ -0,0 +1,343 @@
+/**
+ * @file RawToDepthSimdKernels.h
+ * @brief Width-independent SIMD kernels used by the RawToDepthSimd implementations.
+ *
+ * The kernels are templated on a traits class (T) that wraps the intrinsics for a single
+ * instruction set. Only include this file from the simd*_float.cpp translation units, and
+ * define the traits class in an anonymous namespace there, so that instantiations built
+ * with different instruction-set flags can never be merged by the linker.
+ *
+ * The order of operations follows the scalar code in RawToDepthDsp so that results match
+ * the scalar reference to within floating-point rounding.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include "RawToDepthSimd.h"
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+
+template <typename T>
+struct RawToDepthSimdKernels
+{
+  using V = typename T::V;
+  using M = typename T::M;
+
+  static V selectOne(M mask) { return T::select(mask, T::set1(1.0F), T::set1(0.0F)); }
+
+  // roundf(): halfway values round away from zero, where the SIMD conversions would round them to even.
+  static V round(V val)
+  {
+    const V zero = T::set1(0.0F);
+    const V magnitude = T::max(val, T::sub(zero, val));
+    V rounded = T::trunc(magnitude);
+    rounded = T::add(rounded, selectOne(T::cmpge(T::sub(magnitude, rounded), T::set1(0.5F))));
+    return T::select(T::cmplt(val, zero), T::sub(zero, rounded), rounded);
+  }
+
+  // Rotates the taps so that tapC holds the minimum, as in the scalar if/else-if, and returns the
+  // phase offset of the rotation (0, 1/3 or 2/3 of a cycle) in frac. Ties resolve as in the scalar code.
+  static void rotateTaps(V rawA, V rawB, V rawC, V &tapA, V &tapB, V &tapC, V &frac)
+  {
+    M rotA = T::andM(T::cmple(rawA, rawB), T::cmple(rawA, rawC));
+    M rotB = T::andNotM(rotA, T::andM(T::cmple(rawB, rawC), T::cmplt(rawB, rawA)));
+
+    tapA = T::select(rotA, rawB, T::select(rotB, rawC, rawA));
+    tapB = T::select(rotA, rawC, T::select(rotB, rawA, rawB));
+    tapC = T::select(rotA, rawA, T::select(rotB, rawB, rawC));
+    frac = T::select(rotA, T::set1(1.0F / 3.0F), T::select(rotB, T::set1(2.0F / 3.0F), T::set1(0.0F)));
+  }
+
+  static uint32_t sh2f(const uint16_t *src, float_t *dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask)
+  {
+    uint32_t idx = 0;
+    for (; idx + T::WIDTH <= numElements; idx += T::WIDTH)
+    {
+      T::store(dst + idx, T::loadU16(src + idx, rawMask, shiftr));
+    }
+    return idx;
+  }
+
+  static uint32_t calculatePhase(const float_t *rawRoi, float_t *phaseRoi, float_t *signalRoi,
+                                 float_t *snrRoi, float_t *backgroundRoi,
+                                 uint32_t numElements, float_t numberOfSummedValues)
+  {
+    const V zero = T::set1(0.0F);
+    const V two = T::set1(2.0F);
+    const V oneThird = T::set1(1.0F / 3.0F);
+    const V clip = T::set1(1.0F / 65535.0F);
+    const V numSums = T::set1(numberOfSummedValues);
+
+    uint32_t idx = 0;
+    for (; idx + T::WIDTH <= numElements; idx += T::WIDTH)
+    {
+      V rawA;
+      V rawB;
+      V rawC;
+      T::load3(rawRoi + 3 * idx, rawA, rawB, rawC);
+
+      V tapA;
+      V tapB;
+      V tapC;
+      V frac;
+      rotateTaps(rawA, rawB, rawC, tapA, tapB, tapC, frac);
+
+      V signal = T::sub(T::add(tapA, tapB), T::mul(two, tapC));
+      M valid = T::cmpgt(signal, zero);
+
+      V phase = T::add(T::mul(oneThird, T::div(T::sub(tapB, tapC), signal)), frac);
+      tapC = T::max(tapC, clip); // overflow prevention.
+      // The reciprocal square root is refined to within a few ulp of 1/sqrtf(), see the traits classes.
+      V snr = T::mul(signal, T::rsqrt(T::mul(two, tapC)));
+
+      signal = T::select(valid, signal, zero);
+      phase = T::select(valid, phase, zero);
+      snr = T::select(valid, snr, zero);
+      tapC = T::select(valid, tapC, zero);
+
+      T::store(phaseRoi + idx, phase);
+      T::store(signalRoi + idx, T::add(T::load(signalRoi + idx), T::div(signal, numSums)));
+      T::store(snrRoi + idx, T::add(T::load(snrRoi + idx), snr));
+      T::store(backgroundRoi + idx, T::add(T::load(backgroundRoi + idx), T::div(tapC, numSums)));
+    }
+    return idx;
+  }
+
+  // The smoothed phase of the taps, and phase unwrapped to within maxErr of it. As in calculatePhaseSmooth().
+  static void smoothPhase(V rawA, V rawB, V rawC, V phase, V maxErr, V &phaseSmoothed, V &corrected)
+  {
+    const V zero = T::set1(0.0F);
+    const V one = T::set1(1.0F);
+
+    V tapA;
+    V tapB;
+    V tapC;
+    V frac;
+    rotateTaps(rawA, rawB, rawC, tapA, tapB, tapC, frac);
+
+    V signal = T::sub(T::add(tapA, tapB), T::mul(T::set1(2.0F), tapC));
+    M valid = T::cmpgt(signal, zero);
+
+    phaseSmoothed = T::add(T::mul(T::set1(1.0F / 3.0F), T::div(T::sub(tapB, tapC), signal)), frac);
+    phaseSmoothed = T::select(valid, phaseSmoothed, zero);
+    phase = T::select(valid, phase, zero);
+
+    // Unwrap the unsmoothed phase to within half a cycle of the smoothed phase.
+    V phaseErr = T::sub(phase, phaseSmoothed);
+    corrected = T::sub(phase, T::select(T::cmpgt(phaseErr, maxErr), one, zero));
+    corrected = T::add(corrected, T::select(T::cmplt(phaseErr, T::sub(zero, maxErr)), one, zero));
+  }
+
+  static uint32_t calculatePhaseSmooth(const float_t *frameSmoothed, float_t *phaseSmoothedFrame,
+                                       const float_t *phaseFrame, float_t *correctedPhaseFrame,
+                                       uint32_t numElements, float_t maxPhaseError)
+  {
+    const V maxErr = T::set1(maxPhaseError);
+
+    uint32_t idx = 0;
+    for (; idx + T::WIDTH <= numElements; idx += T::WIDTH)
+    {
+      V rawA;
+      V rawB;
+      V rawC;
+      T::load3(frameSmoothed + 3 * idx, rawA, rawB, rawC);
+
+      V phaseSmoothed;
+      V corrected;
+      smoothPhase(rawA, rawB, rawC, T::load(phaseFrame + idx), maxErr, phaseSmoothed, corrected);
+
+      T::store(phaseSmoothedFrame + idx, phaseSmoothed);
+      T::store(correctedPhaseFrame + idx, corrected);
+    }
+    return idx;
+  }
+
+  // planes[k*planeStride + idx] = taps[3*idx + k]
+  static uint32_t deinterleaveTaps(const float_t *taps, float_t *planes, uint32_t numElements, std::size_t planeStride)
+  {
+    uint32_t idx = 0;
+    for (; idx + T::WIDTH <= numElements; idx += T::WIDTH)
+    {
+      V tapA;
+      V tapB;
+      V tapC;
+      T::load3(taps + 3 * idx, tapA, tapB, tapC);
+      T::store(planes + idx, tapA);
+      T::store(planes + planeStride + idx, tapB);
+      T::store(planes + 2 * planeStride + idx, tapC);
+    }
+    return idx;
+  }
+
+  static uint32_t convolveStride3(const float_t *kernel, uint32_t kernelSize,
+                                  const float_t *in, float_t *out, uint32_t numElements)
+  {
+    if (kernelSize == 0 || kernelSize > RawToDepthSimd::MAX_KERNEL_SIZE)
+    {
+      return 0;
+    }
+
+    V taps[RawToDepthSimd::MAX_KERNEL_SIZE]; //NOLINT(hicpp-avoid-c-arrays)
+    for (uint32_t tapIdx = 0; tapIdx < kernelSize; tapIdx++)
+    {
+      taps[tapIdx] = T::set1(kernel[tapIdx]);
+    }
+
+    const int32_t firstTapOffset = -3 * int32_t(kernelSize / 2);
+    uint32_t idx = 0;
+    for (; idx + T::WIDTH <= numElements; idx += T::WIDTH)
+    {
+      const float_t *src = in + int32_t(idx) + firstTapOffset;
+      V sum = T::mul(T::load(src), taps[0]);
+      for (uint32_t tapIdx = 1; tapIdx < kernelSize; tapIdx++)
+      {
+        sum = T::add(sum, T::mul(T::load(src + 3 * tapIdx), taps[tapIdx]));
+      }
+      T::store(out + idx, sum);
+    }
+    return idx;
+  }
+
+  // The range and M value of the smoothed and corrected phases. As in computeWholeFrameRange().
+  struct Unwrap
+  {
+    V fInt0;
+    V fInt1;
+    V a;
+    V c;
+    V bias;
+    V roundBias;
+
+    Unwrap(float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias)
+      : fInt0(T::set1(fInt0)), fInt1(T::set1(fInt1)), a(T::set1(aFloat)), c(T::set1(cFloat)),
+        bias(T::set1(bias)), roundBias(T::set1(bias + 0.5F)) {}
+  };
+
+  static void unwrapRange(const Unwrap &unwrap, V phaseSmoothed0, V phaseSmoothed1, V phase0, V phase1,
+                          V &range, V &mValue)
+  {
+    V maskNegatives = selectOne(T::cmplt(phaseSmoothed1, phaseSmoothed0));
+    V mRaw1 = T::mul(unwrap.fInt0, phaseSmoothed1);
+    V mRaw2 = T::mul(unwrap.fInt1, phaseSmoothed0);
+    V mRaw3 = T::mul(unwrap.fInt0, maskNegatives);
+    // The biased argument is positive (RawToDepthDsp::getPhaseUnwrap()), so truncating rounds it.
+    V mRaw = T::sub(T::trunc(T::add(T::add(T::sub(mRaw1, mRaw2), mRaw3), unwrap.roundBias)), unwrap.bias);
+
+    mValue = T::add(T::add(mRaw, mRaw), maskNegatives);
+
+    V bFloat = T::add(T::add(mRaw, phase1), maskNegatives);
+    V dFloat = T::add(mRaw, phase0);
+    range = T::max(T::add(T::mul(unwrap.a, bFloat), T::mul(unwrap.c, dFloat)), T::set1(0.0F));
+  }
+
+  static uint32_t computeWholeFrameRange(const float_t *smoothedPhases0, const float_t *smoothedPhases1,
+                                         const float_t *correctedPhases0, const float_t *correctedPhases1,
+                                         float_t *ranges, float_t *mFrame, uint32_t numElements,
+                                         float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias)
+  {
+    const Unwrap unwrap(fInt0, fInt1, aFloat, cFloat, bias);
+
+    uint32_t idx = 0;
+    for (; idx + T::WIDTH <= numElements; idx += T::WIDTH)
+    {
+      V range;
+      V mValue;
+      unwrapRange(unwrap, T::load(smoothedPhases0 + idx), T::load(smoothedPhases1 + idx),
+                  T::load(correctedPhases0 + idx), T::load(correctedPhases1 + idx), range, mValue);
+      T::store(mFrame + idx, mValue);
+      T::store(ranges + idx, range);
+    }
+    return idx;
+  }
+
+  // The taps of both frequencies are in six planes of planeStride elements each: the three taps of the first
+  // frequency, then those of the second.
+  static uint32_t computeWholeFrameRangePlanar(const float_t *smoothedPlanes, std::size_t planeStride,
+                                               const float_t *phases0, const float_t *phases1,
+                                               float_t *ranges, float_t *mFrame, uint32_t numElements, float_t maxPhaseError,
+                                               float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias)
+  {
+    const V maxErr = T::set1(maxPhaseError);
+    const Unwrap unwrap(fInt0, fInt1, aFloat, cFloat, bias);
+    const float_t *planes0 = smoothedPlanes;
+    const float_t *planes1 = smoothedPlanes + 3 * planeStride;
+
+    uint32_t idx = 0;
+    for (; idx + T::WIDTH <= numElements; idx += T::WIDTH)
+    {
+      V phaseSmoothed0;
+      V corrected0;
+      smoothPhase(T::load(planes0 + idx), T::load(planes0 + planeStride + idx), T::load(planes0 + 2 * planeStride + idx),
+                  T::load(phases0 + idx), maxErr, phaseSmoothed0, corrected0);
+      V phaseSmoothed1;
+      V corrected1;
+      smoothPhase(T::load(planes1 + idx), T::load(planes1 + planeStride + idx), T::load(planes1 + 2 * planeStride + idx),
+                  T::load(phases1 + idx), maxErr, phaseSmoothed1, corrected1);
+
+      V range;
+      V mValue;
+      unwrapRange(unwrap, phaseSmoothed0, phaseSmoothed1, corrected0, corrected1, range, mValue);
+      T::store(mFrame + idx, mValue);
+      T::store(ranges + idx, range);
+    }
+    return idx;
+  }
+
+  // fmod() of non-negative values. Below twice the modulus, which covers the unwrapped ranges, one subtraction is exact
+  // as fmod() is; beyond, the truncated quotient may differ from fmod() by rounding.
+  static V mod(V val, V modulus)
+  {
+    val = T::select(T::cmpge(val, modulus), T::sub(val, modulus), val);
+    return T::select(T::cmpge(val, modulus), T::sub(val, T::mul(T::trunc(T::div(val, modulus)), modulus)), val);
+  }
+
+  // All of the output planes of the run in one pass. The planes that aren't output are tested once per vector, which
+  // the branch predictor gets right every time.
+  static uint32_t quantizeOutputs(const RawToDepthSimd::OutputRun &run, uint32_t numElements)
+  {
+    const V zero = T::set1(0.0F);
+    const V half = T::set1(0.5F);
+    const V clip = T::set1(65535.0F);
+    const V minMaxThresh = T::set1(RawToDepthSimd::MIN_MAX_THRESHOLD);
+    const V snrThresh = T::set1(run.snrThresh);
+    const V rangeLimit = T::set1(run.rangeLimit);
+    const V rangeOffset = T::set1(run.rangeOffset);
+    const V maxRange = T::set1(run.maxRange);
+    const V rangeScale = T::set1(run.rangeScale);
+
+    uint32_t idx = 0;
+    for (; idx + T::WIDTH <= numElements; idx += T::WIDTH)
+    {
+      const V snr = T::load(run.snr + idx);
+      if (run.rangeOut != nullptr)
+      {
+        V range = mod(T::max(T::sub(T::load(run.ranges + idx), rangeOffset), zero), maxRange);
+        if (run.minMaxMask != nullptr)
+        {
+          const M valid = T::andM(T::andM(T::cmple(T::load(run.minMaxMask + idx), minMaxThresh), T::cmpge(snr, snrThresh)),
+                                  T::cmple(range, rangeLimit));
+          range = T::select(valid, range, zero);
+        }
+        T::storeU16(run.rangeOut + idx, round(T::mul(rangeScale, range)));
+      }
+      if (run.snrOut != nullptr)
+      {
+        T::storeU16(run.snrOut + idx, round(T::mul(half, snr)));
+      }
+      if (run.signalOut != nullptr)
+      {
+        const V signal = round(T::mul(half, T::load(run.signal + idx)));
+        T::storeU16(run.signalOut + idx, T::select(T::cmpgt(signal, clip), clip, signal));
+      }
+      if (run.backgroundOut != nullptr)
+      {
+        const V background = T::load(run.background + idx);
+        T::storeU16(run.backgroundOut + idx, T::select(T::cmpgt(background, clip), clip, round(background)));
+      }
+    }
+    return idx;
+  }
+};
@@ -10,33 +10,85 @@
 #include "RawToDepthStripe_float.h"
 #include "RawToDepthCommon.h"
 #include "LumoUtil.h"
+#include "LumoAffinity.h"
+#include "RawToDepthV2_float.h"
+#include <algorithm>
+
+std::atomic<bool> RawToDepthStripe_float::_offloadStripes { false };
+std::atomic<uint32_t> RawToDepthStripe_float::_stripeBatch { 1 };
+
+void RawToDepthStripe_float::setStripeBatch(uint32_t numStripes)
+{
+  _stripeBatch.store(std::clamp(numStripes, 1U, MAX_STRIPE_BATCH), std::memory_order_relaxed);
+}
 
 RawToDepthStripe_float::RawToDepthStripe_float(uint32_t fovIdx, uint32_t headerNum) : 
-  RawToDepth(fovIdx, headerNum)
+  RawToDepth(fovIdx, headerNum),
+  _info(std::make_shared<StripeInfo>())
 {
+  if (getOffloadStripes())
+  {
+    _stripeQueue = std::make_shared<StripeQueue>();
+    _scheduler = std::make_shared<FrameScheduler>(1, RawToDepthV2_float::getDspCpus(), "stripe fov " + std::to_string(fovIdx),
+                                                  int(headerNum), LumoAffinity::ROLE_WHOLE_FRAME);
+    _schedulerSourceId = _scheduler->addSource(headerNum, [queue = _stripeQueue]() { processScheduledStripes(*queue); });
+  }
+}
+
+RawToDepthStripe_float::~RawToDepthStripe_float()
+{
+  RawToDepthStripe_float::shutdown();
+}
+
+void RawToDepthStripe_float::shutdown()
+{
+  if (!_scheduler)
+  {
+    return;
+  }
+  {
+    std::unique_lock mutexLock(_stripeQueue->mutex);
+    _stripeQueue->quitNow = true;
+  }
+  _stripeQueue->conditionVariable.notify_all();
+  _scheduler->removeSource(_schedulerSourceId); // Waits for the stripes being processed.
+  _scheduler = nullptr;
+}
+
+uint64_t RawToDepthStripe_float::getNumStripeBatches() const
+{
+  if (!_stripeQueue)
+  {
+    return 0;
+  }
+  std::lock_guard lock(_stripeQueue->mutex);
+  return _stripeQueue->numBatches;
 }
 
-void RawToDepthStripe_float::reset(const uint16_t *mdPtr, uint32_t mdBytes)
+void RawToDepthStripe_float::reset(const RtdMetadata &mdat)
 {
-  RawToDepth::reset(mdPtr, mdBytes);
-  auto mdat = RtdMetadata(mdPtr, mdBytes);
+  RawToDepth::reset(mdat);
 
-  realloc(mdPtr, mdBytes);
+  realloc(mdat);
+  _tapsAccumulated = !mdat.getDoTapAccumulation();
+  _collapse = RawToDepthDsp::selectCollapseRawRoi(_binning[1]);
 }
 
-void RawToDepthStripe_float::realloc(const uint16_t *mdPtr, uint32_t mdBytes)
+void RawToDepthStripe_float::realloc(const RtdMetadata &mdat)
 {
   bool changed=false;
-  RtdMetadata mdat(mdPtr, mdBytes);
-  MAKE_VECTOR(_signal, float32_t, mdat.getRoiNumColumns() / _binning[1]); //binned size
-  MAKE_VECTOR(_snr, float32_t, mdat.getRoiNumColumns() / _binning[1]);
-  MAKE_VECTOR(_background, float32_t, mdat.getRoiNumColumns() / _binning[1]);
-  MAKE_VECTOR(_ranges, float32_t, mdat.getRoiNumColumns() / _binning[1]);
-  MAKE_VECTOR(_oneDMinMaxMask, float32_t, mdat.getRoiNumColumns() / _binning[1]);
-  MAKE_VECTOR(_snrWeights, float32_t, NUM_GPIXEL_PHASES*mdat.getRoiNumRows()*RtdMetadata::getRoiNumColumns());
+  auto &info = *_info;
+  MAKE_VECTOR(info.rawRoi0Rotated, float32_t, NUM_GPIXEL_PHASES*mdat.getRoiNumRows()*RtdMetadata::getRoiNumColumns());
+  MAKE_VECTOR(info.rawRoi1Rotated, float32_t, NUM_GPIXEL_PHASES*mdat.getRoiNumRows()*RtdMetadata::getRoiNumColumns());
+  MAKE_VECTOR(info.signal, float32_t, mdat.getRoiNumColumns() / _binning[1]); //binned size
+  MAKE_VECTOR(info.snr, float32_t, mdat.getRoiNumColumns() / _binning[1]);
+  MAKE_VECTOR(info.background, float32_t, mdat.getRoiNumColumns() / _binning[1]);
+  MAKE_VECTOR(info.ranges, float32_t, mdat.getRoiNumColumns() / _binning[1]);
+  MAKE_VECTOR(info.oneDMinMaxMask, float32_t, mdat.getRoiNumColumns() / _binning[1]);
+  MAKE_VECTOR(info.snrWeights, float32_t, NUM_GPIXEL_PHASES*mdat.getRoiNumRows()*RtdMetadata::getRoiNumColumns());
 }
 
-bool RawToDepthStripe_float::saveTimestamp(RtdMetadata &mdat)
+bool RawToDepthStripe_float::saveTimestamp(const RtdMetadata &mdat)
 {
   if (!RawToDepth::saveTimestamp(mdat))
   {
@@ -46,51 +98,55 @@ bool RawToDepthStripe_float::saveTimestamp(RtdMetadata &mdat)
   return true;
 }
 
-std::pair<const std::vector<float_t>&, float_t> RawToDepthStripe_float::windowFactory(RtdMetadata &mdat, 
-                                                                                      const std::vector<float_t> &rawRoi0, 
-                                                                                      const std::vector<float_t> &rawRoi1, 
-                                                                                      uint32_t rowOffset)
+std::pair<const std::vector<float_t>&, float_t> RawToDepthStripe_float::windowFactory(StripeInfo &info, uint32_t rowOffset)
 {
-  if (mdat.getStripeModeRectSum(_fovIdx) && (RawToDepthDsp::_rect6.size() == (size_t)mdat.getRoiNumRows()) )
+  if (info.rectSum && (RawToDepthDsp::_rect6.size() == (size_t)info.roiNumRows) )
   {
     return std::make_pair(ref(RawToDepthDsp::_rect6), RawToDepthDsp::_rect6NumberOfSums);
   }
-  if (mdat.getStripeModeRectSum(_fovIdx) && (RawToDepthDsp::_rect8.size() == (size_t)mdat.getRoiNumRows()))
+  if (info.rectSum && (RawToDepthDsp::_rect8.size() == (size_t)info.roiNumRows))
   {
     return std::make_pair(ref(RawToDepthDsp::_rect8), RawToDepthDsp::_rect8NumberOfSums);
   }
-  if (mdat.getStripeModeSnrWeightedSum(_fovIdx))
+  if (info.snrWeightedSum)
   {
-    uint32_t roiHeight = mdat.getRoiNumRows();
-    uint32_t roiWidth = RtdMetadata::getRoiNumColumns();
-    RawToDepthDsp::computeSnrSquaredWeights( rawRoi0,  rawRoi1, _snrWeights, _snrWeightsNumberOfSums,
-                                             roiHeight, roiWidth, rowOffset);
-    return std::make_pair(ref(_snrWeights), _snrWeightsNumberOfSums);
+    float_t numberOfSums { SNR_WEIGHTED_WINDOW_DEFAULT_NUMBER_OF_SUMS };
+    RawToDepthDsp::computeSnrSquaredWeights( info.rawRoi0Rotated,  info.rawRoi1Rotated, info.snrWeights, numberOfSums,
+                                             info.roiNumRows, RtdMetadata::getRoiNumColumns(), rowOffset);
+    return std::make_pair(ref(info.snrWeights), numberOfSums);
   }
-  if (RawToDepthDsp::_gaussian6.size() == (size_t)mdat.getRoiNumRows())
+  if (RawToDepthDsp::_gaussian6.size() == (size_t)info.roiNumRows)
   {
     return std::make_pair(ref(RawToDepthDsp::_gaussian6), RawToDepthDsp::_gaussian6NumberOfSums);
   }
-  assert(RawToDepthDsp::_gaussian8.size() == (size_t)mdat.getRoiNumRows());
+  assert(RawToDepthDsp::_gaussian8.size() == (size_t)info.roiNumRows);
   return std::make_pair(ref(RawToDepthDsp::_gaussian8), RawToDepthDsp::_gaussian8NumberOfSums);
 }
 
-void RawToDepthStripe_float::processRoi(const uint16_t *roi, uint32_t numBytes)
+/**
+ * @brief Ingests one stripe: validates the ROI, passes it through HDR, and tap rotates it into the stripe's raw buffers,
+ * or, if the FPGA accumulated the taps, converts it straight into them.
+ * Unless the stripes are offloaded (see setOffloadStripes()), the DSP of the stripe follows on this thread.
+ */
+void RawToDepthStripe_float::processRoi(const RtdMetadata &roiMdat, const uint16_t *roi, uint32_t numBytes)
 {
-  auto localTimer = LumoTimers::ScopedTimer(*_timers, "RawToDepthStripe_float::processRoi()", STRIPE_TIMERS_UPDATE_EVERY);
+  auto localTimer = FastTimers::Scoped(FAST_TIMER_STRIPE_PROCESS_ROI);
   if (nullptr == roi || numBytes == 0)
   {
       return;
   }  
 
-  if (!validateMetadata(roi, numBytes))
+  if (!validateMetadata(roiMdat, roi, numBytes))
   {
       return;
   }  
 
-  _hdr.submit(roi, numBytes/sizeof(uint16_t), _fovIdx, !_veryFirstRoiReceived, INPUT_RAW_SHIFT);
-  auto mdat = _hdr.getMetadata();
-  auto rawRoi = _hdr.getRoi();
+  // Call unconditionally. In stripe mode, every ROI is the first (and last) roi in an FOV.
+  // Called before HDR, so that the ROI is left unconverted when it will be ingested straight from the raw input.
+  reset(roiMdat);
+
+  _hdr.submit(roiMdat, roi, numBytes/sizeof(uint16_t), _fovIdx, !_veryFirstRoiReceived, INPUT_RAW_SHIFT, _tapsAccumulated);
+  const auto &mdat = _hdr.getMetadata();
 
   if (!_veryFirstRoiReceived && !_hdr.skip() && _fovIdx == 0)
   {
@@ -98,8 +154,6 @@ void RawToDepthStripe_float::processRoi(const uint16_t *roi, uint32_t numBytes)
   }
   _veryFirstRoiReceived = true;  
 
-  // Call unconditionally. In stripe mode, every ROI is the first (and last) roi in an FOV.
-  reset(roi, numBytes);  
   if (_hdr.skip())
   {
     return; // Skip this ROI because HDR needs to hold it to see if there's a retake on the next ROI.
@@ -109,50 +163,96 @@ void RawToDepthStripe_float::processRoi(const uint16_t *roi, uint32_t numBytes)
     return;
   }
 
-  auto binX = _binning[1];
-  _roiStartRow = mdat.getRoiStartRow();
-  _binnedRoiWidth = RtdMetadata::getRoiNumColumns() / binX;
-
-  uint32_t numRawRoiElements = NUM_GPIXEL_PHASES*mdat.getNumModulationFrequencies()*mdat.getRoiNumRows()*RtdMetadata::getRoiNumColumns()*mdat.getNumPermutations();
-
-  SCOPED_VEC_F(rawRoi0Rotated, NUM_GPIXEL_PHASES*mdat.getRoiNumRows()*RtdMetadata::getRoiNumColumns());
-  SCOPED_VEC_F(rawRoi1Rotated, NUM_GPIXEL_PHASES*mdat.getRoiNumRows()*RtdMetadata::getRoiNumColumns());
+  auto &info = *_info;
+  info.roiNumRows = mdat.getRoiNumRows();
+  info.roiStartRow = mdat.getRoiStartRow();
+  info.binning = _binning;
+  info.collapse = _collapse;
+  info.binnedRoiWidth = RtdMetadata::getRoiNumColumns() / _binning[1];
+  info.rectSum = mdat.getStripeModeRectSum(_fovIdx);
+  info.snrWeightedSum = mdat.getStripeModeSnrWeightedSum(_fovIdx);
+  info.fs = _fs;
+  info.phaseUnwrap = _phaseUnwrap;
+  info.rangeOffsetTemperature = _temperatureCalibration.getRangeOffsetTemperature();
+  info.maxUnambiguousRange = getMaxUnambiguousRange();
+
+  if (_tapsAccumulated && _hdr.isRawPassthrough())
+  {
+    // The FPGA summed the taps, so the image of each frequency is a run of the raw ROI that only needs converting.
+    const auto imageShorts = uint32_t(info.rawRoi0Rotated.size());
+    if (_hdr.getRawRoiShorts() < 2 * imageShorts)
+    {
+      // The buffers still hold the previous stripe, so drop this one rather than output it again.
+      LLogErr("Input buffer too small for a tap-accumulated stripe. Expected " << 2 * imageShorts << " shorts, received " <<
+              _hdr.getRawRoiShorts() << ". Dropping ROI.");
+      _incompleteFov = true;
+      return;
+    }
+    RawToDepthDsp::sh2f(_hdr.getRawRoi(), info.rawRoi0Rotated, imageShorts, INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask());
+    RawToDepthDsp::sh2f(_hdr.getRawRoi() + imageShorts, info.rawRoi1Rotated, imageShorts, INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask());
+  }
+  else
+  {
+    const auto &rawRoi = _hdr.getRoi();
+    RawToDepthDsp::tapRotation(rawRoi, info.rawRoi0Rotated, 0, {mdat.getRoiNumRows(), RtdMetadata::getRoiNumColumns()}, NUM_GPIXEL_PHASES, mdat.getDoTapAccumulation());
+    RawToDepthDsp::tapRotation(rawRoi, info.rawRoi1Rotated, 1, {mdat.getRoiNumRows(), RtdMetadata::getRoiNumColumns()}, NUM_GPIXEL_PHASES, mdat.getDoTapAccumulation());
+  }
 
-  RawToDepthDsp::tapRotation(rawRoi, rawRoi0Rotated, 0, {mdat.getRoiNumRows(), RtdMetadata::getRoiNumColumns()}, NUM_GPIXEL_PHASES, mdat.getDoTapAccumulation());
-  RawToDepthDsp::tapRotation(rawRoi, rawRoi1Rotated, 1, {mdat.getRoiNumRows(), RtdMetadata::getRoiNumColumns()}, NUM_GPIXEL_PHASES, mdat.getDoTapAccumulation());
+  if (!_scheduler)
+  {
+    processStripe(info);
+  }
+}
 
-  uint32_t numRawRoiColumns = RtdMetadata::getRoiNumColumns() * NUM_GPIXEL_PHASES;
-  uint32_t numBinnedRawRoiColumns = NUM_GPIXEL_PHASES * (RtdMetadata::getRoiNumColumns() / binX);
+/**
+ * @brief The DSP of one ingested stripe: collapses the tap-rotated raw rows into one row through the stripe window,
+ * and computes the phase, signal, snr, background, min-max mask and range of each column.
+ */
+void RawToDepthStripe_float::processStripe(StripeInfo &info)
+{
+  auto localTimer = FastTimers::Scoped(FAST_TIMER_STRIPE_DSP);
+  const auto binX = info.binning[1];
+  const std::array<uint32_t,2> rawRoiSize = {info.roiNumRows, RtdMetadata::getRoiNumColumns()};
+  const uint32_t numBinnedRawRoiColumns = NUM_GPIXEL_PHASES * (RtdMetadata::getRoiNumColumns() / binX);
   SCOPED_VEC_F(roi0Collapsed, numBinnedRawRoiColumns);
   SCOPED_VEC_F(roi1Collapsed, numBinnedRawRoiColumns);
 
   constexpr uint32_t rowOffset {0};
-  auto [window, windowNumberOfSums] = windowFactory(mdat, rawRoi0Rotated, rawRoi1Rotated, rowOffset); // Note: "structured binding"
+  auto [window, windowNumberOfSums] = windowFactory(info, rowOffset); // Note: "structured binding"
 
-  RawToDepthDsp::collapseRawRoi(rawRoi0Rotated, roi0Collapsed, window, _binning, {mdat.getRoiNumRows(), RtdMetadata::getRoiNumColumns()}, rowOffset);
-  RawToDepthDsp::collapseRawRoi(rawRoi1Rotated, roi1Collapsed, window, _binning, {mdat.getRoiNumRows(), RtdMetadata::getRoiNumColumns()}, rowOffset);
+  if (info.collapse != nullptr)
+  {
+    info.collapse(info.rawRoi0Rotated, roi0Collapsed, window, rawRoiSize, rowOffset);
+    info.collapse(info.rawRoi1Rotated, roi1Collapsed, window, rawRoiSize, rowOffset);
+  }
+  else
+  {
+    LLogErr("Only binning of 1,2, or 4 are allowed.");
+    std::fill(roi0Collapsed.begin(), roi0Collapsed.end(), 0.0F);
+    std::fill(roi1Collapsed.begin(), roi1Collapsed.end(), 0.0F);
+  }
 
-  SCOPED_VEC_F(phaseRoi0, _binnedRoiWidth);
-  SCOPED_VEC_F(phaseRoi1, _binnedRoiWidth);
+  SCOPED_VEC_F(phaseRoi0, info.binnedRoiWidth);
+  SCOPED_VEC_F(phaseRoi1, info.binnedRoiWidth);
 
   // Initialize these to zero, since both frequencies are summed in the calculatePhase routine.
-  std::fill(_signal.begin(), _signal.end(), 0.0F);
-  std::fill(_snr.begin(), _snr.end(), 0.0F);
-  std::fill(_background.begin(), _background.end(), 0.0F);
-  RawToDepthDsp::calculatePhase(roi0Collapsed, phaseRoi0, _signal, _snr, _background, windowNumberOfSums*(float_t)_binning[1]);
-  RawToDepthDsp::calculatePhase(roi1Collapsed, phaseRoi1, _signal, _snr, _background, windowNumberOfSums*(float_t)_binning[1]);
-
-  SCOPED_VEC_F(mFrame, _binnedRoiWidth);
-  SCOPED_VEC_F(rangeStripe, _binnedRoiWidth);
-  RawToDepthDsp::computeWholeFrameRange(phaseRoi0, phaseRoi1, phaseRoi0, phaseRoi1, rangeStripe, _fs, _fsInt, C_MPS, mFrame);
+  std::fill(info.signal.begin(), info.signal.end(), 0.0F);
+  std::fill(info.snr.begin(), info.snr.end(), 0.0F);
+  std::fill(info.background.begin(), info.background.end(), 0.0F);
+  RawToDepthDsp::calculatePhase(roi0Collapsed, phaseRoi0, info.signal, info.snr, info.background, windowNumberOfSums*(float_t)binX);
+  RawToDepthDsp::calculatePhase(roi1Collapsed, phaseRoi1, info.signal, info.snr, info.background, windowNumberOfSums*(float_t)binX);
+
+  SCOPED_VEC_F(mFrame, info.binnedRoiWidth);
+  SCOPED_VEC_F(rangeStripe, info.binnedRoiWidth);
+  RawToDepthDsp::computeWholeFrameRange(phaseRoi0, phaseRoi1, phaseRoi0, phaseRoi1, rangeStripe, info.phaseUnwrap, mFrame);
   
-  RawToDepthDsp::minMax1d(rawRoi0Rotated, rawRoi1Rotated, _oneDMinMaxMask, 
-                          {mdat.getRoiNumRows(), NUM_GPIXEL_PHASES*RtdMetadata::getRoiNumColumns()}, _binning[1]);
+  RawToDepthDsp::minMax1d(info.rawRoi0Rotated, info.rawRoi1Rotated, info.oneDMinMaxMask, 
+                          {info.roiNumRows, NUM_GPIXEL_PHASES*RtdMetadata::getRoiNumColumns()}, binX);
 
 
   // Apply temperature correction, clip and modulo the range values.
-  const auto maxUnambiguousRange = (float_t)getMaxUnambiguousRange();
-  const auto rangeOffsetTemperature = _temperatureCalibration.getRangeOffsetTemperature();
+  const auto maxUnambiguousRange = (float_t)info.maxUnambiguousRange;
+  const auto rangeOffsetTemperature = info.rangeOffsetTemperature;
   std::for_each(rangeStripe.begin(), rangeStripe.end(),
     [maxUnambiguousRange, rangeOffsetTemperature] (float_t &range)
     {
@@ -162,15 +262,19 @@ void RawToDepthStripe_float::processRoi(const uint16_t *roi, uint32_t numBytes)
     });
 
 #if 0 // Check input metadata bit definitions to enable/disable
-  RawToDepthDsp::median1d(rangeStripe, _ranges, _binning[1]);
+  RawToDepthDsp::median1d(rangeStripe, info.ranges, binX);
 #else
-  std::copy(rangeStripe.begin(), rangeStripe.end(), _ranges.begin());
+  std::copy(rangeStripe.begin(), rangeStripe.end(), info.ranges.begin());
 #endif
 }
 
+/**
+ * @brief Completes the stripe with the parameters of its FOV, and either outputs it here or queues it for the
+ * scheduler thread (see setOffloadStripes()). Stripes are output in the order they were received either way.
+ */
 void RawToDepthStripe_float::processWholeFrame(std::function<void(std::shared_ptr<FovSegment>)> setFovSegment)
 {
-  auto localTimer = LumoTimers::ScopedTimer(*_timers, "RawToDepthStripe_float::processWholeFrame()", STRIPE_TIMERS_UPDATE_EVERY);
+  auto localTimer = FastTimers::Scoped(FAST_TIMER_STRIPE_WHOLE_FRAME);
 
   if (_disableRtd) 
   {
@@ -191,58 +295,160 @@ void RawToDepthStripe_float::processWholeFrame(std::function<void(std::shared_pt
     return;
   }
 
-  auto roiIndices = std::make_shared<std::vector<uint16_t>>(_binnedRoiWidth, 0); // All samples in an ROI have the same timestamp.
-
-  SCOPED_VEC_F(fMinMaxMask, _binnedRoiWidth);
-  std::fill(fMinMaxMask.begin(), fMinMaxMask.end(), 0.0F);
+  _frameTrace.stamp(TRACE_WHOLE_FRAME_START);
 
+  auto &info = *_info;
   // Index into the pixel mask
-  std::array<uint16_t,2> maskStartIdx = {_roiStartRow, RtdMetadata::getRoiStartColumn()};
+  std::array<uint16_t,2> maskStartIdx = {info.roiStartRow, RtdMetadata::getRoiStartColumn()};
   std::array<uint16_t,2> maskStep = {(uint16_t)_binning[0], (uint16_t)_binning[1]};
   uint16_t pixelMaskStride = RtdMetadata::getRoiNumColumns(); // Width of the pixel mask
-  std::array<uint32_t,2> roiSize {1, _binnedRoiWidth};
-  auto rangeRoi = RawToDepthCommon::getRange(_ranges, 
-                    fMinMaxMask, _pixelMask, _snr,
-                    maskStartIdx, // pre-binned sensor location
-                    maskStep, // stepping across the mask table.
-                    pixelMaskStride, 
-                    roiSize, // The size of the output FOV, 1x640/binning
-                    _disableRangeMasking, _snrThresh,
-                    _temperatureCalibration.getRangeOffsetTemperature(), 
-                    _rangeLimit,
-                    (float_t)getMaxUnambiguousRange());
+  info.pixelMaskSpans = getPixelMaskSpans(maskStartIdx, // pre-binned sensor location
+                                          maskStep, // stepping across the mask table.
+                                          pixelMaskStride,
+                                          {1, info.binnedRoiWidth}); // The size of the output FOV, 1x640/binning
+  info.fovIdx = _fovIdx;
+  info.headerNum = _headerNum;
+  info.timestamp = _timestamp;
+  info.sensorID = _sensorID;
+  info.userTag = _userTag;
+  info.lastRoiReceived = lastRoiReceived();
+  info.gcf = getGCF();
+  info.disableRangeMasking = _disableRangeMasking;
+  info.snrThresh = _snrThresh;
+  info.rangeLimit = _rangeLimit;
+  info.outputPlanes = _outputPlanes;
+  info.timestamps = getTimestamps();
+  info.timestampsVec = getTimestampsVec();
+  info.lastTimerReport = getLastTimerReport();
+  info.frameTrace = _frameTrace;
+  info.setFovSegment = std::move(setFovSegment);
+
+  if (!_scheduler)
+  {
+    // Stripe mode processes the whole frame synchronously, on the per-ROI thread
+    outputStripe(info);
+    return;
+  }
+
+  // Hand the stripe to the scheduler thread, and ingest the next one into a processed stripe's buffers.
+  {
+    std::unique_lock mutexLock(_stripeQueue->mutex);
+    auto &queue = *_stripeQueue;
+    queue.conditionVariable.wait(mutexLock, [&queue]
+                                 { return queue.pending.size() + queue.numProcessing < MAX_STRIPE_QUEUE_DEPTH || queue.quitNow; });
+    if (queue.quitNow)
+    {
+      return;
+    }
+    queue.pending.push_back(_info);
+    if (queue.free.empty())
+    {
+      _info = std::make_shared<StripeInfo>();
+    }
+    else
+    {
+      _info = queue.free.back();
+      queue.free.pop_back();
+    }
+  }
+  _scheduler->submit(_schedulerSourceId);
+}
+
+/**
+ * @brief Runs on the FrameScheduler once for each stripe that processWholeFrame() queued, and processes up to
+ * getStripeBatch() of the oldest pending stripes, in order. Later items find the stripes already processed, and
+ * return immediately.
+ *
+ * @param queue The stripes waiting to be processed, and the processed ones for reuse.
+ */
+void RawToDepthStripe_float::processScheduledStripes(StripeQueue &queue)
+{
+  std::vector<std::shared_ptr<StripeInfo>> batch;
+  {
+    std::unique_lock mutexLock(queue.mutex);
+    const auto batchSize = std::min(std::size_t(getStripeBatch()), queue.pending.size());
+    if (queue.quitNow || batchSize == 0)
+    {
+      return;
+    }
+    batch.assign(queue.pending.begin(), queue.pending.begin() + std::ptrdiff_t(batchSize));
+    queue.pending.erase(queue.pending.begin(), queue.pending.begin() + std::ptrdiff_t(batchSize));
+    queue.numProcessing = uint32_t(batchSize);
+    queue.numBatches++;
+  }
+
+  for (auto &info : batch)
+  {
+    processStripe(*info);
+    outputStripe(*info);
+    info->setFovSegment = nullptr; // Releases the consumer's callback state.
+  }
+
+  {
+    std::unique_lock mutexLock(queue.mutex);
+    queue.numProcessing = 0;
+    queue.free.insert(queue.free.end(), batch.begin(), batch.end());
+  }
+  queue.conditionVariable.notify_all();
+}
+
+/**
+ * @brief Converts the stripe's range, snr, signal and background into an FovSegment and passes it to setFovSegment().
+ */
+void RawToDepthStripe_float::outputStripe(StripeInfo &info)
+{
+  auto roiIndexRows = std::make_shared<std::vector<uint16_t>>(1, 0); // The stripe is one row, from one ROI.
+
+  SCOPED_VEC_F(fMinMaxMask, info.binnedRoiWidth);
+  std::fill(fMinMaxMask.begin(), fMinMaxMask.end(), 0.0F);
+
+  std::array<uint32_t,2> roiSize {1, info.binnedRoiWidth};
+  // The ranges were corrected for temperature by processStripe(), ahead of the (optional) median filter.
+  auto planes = std::make_shared<FovPlanes>();
+  RawToDepthCommon::getOutputPlanes(*planes, info.outputPlanes,
+                                    info.ranges, fMinMaxMask, *info.pixelMaskSpans, 0,
+                                    info.snr, info.signal, info.background,
+                                    roiSize, // The size of the output FOV, 1x640/binning
+                                    info.disableRangeMasking, info.snrThresh,
+                                    0.0F,
+                                    info.rangeLimit,
+                                    (float_t)info.maxUnambiguousRange);
 
 
   // For stripe mode: recompute the position of this ROI in the mapping table.
-  // "(2*_roiNumRows)/2". The first "2" is for the mapping table step. The second is an offset to half the vertical size of the ROI,
-  const std::array<uint32_t,2> mappingTableStart = {uint32_t(2 * _roiStartRow + (2*_roiNumRows)/2 - 1),
-                                                  uint32_t(2 * RtdMetadata::getRoiStartColumn() + _binning[1] - 1)};
-  std::array<uint32_t,2> mappingTableStep = {uint32_t(2 * _binning[0]),
-                                            uint32_t(2 * _binning[1])};
-  const std::array<uint32_t,2> fovStart = { (_roiStartRow + _roiNumRows/2)/_binning[0], RtdMetadata::getRoiStartColumn()/_binning[1] };
-  const std::array<uint32_t,2> fovStep = _binning;
-
-  setFovSegment(std::make_shared<FovSegment>(
-    _fovIdx,
-    _headerNum,
-    _timestamp,
-    _sensorID,
-    _userTag,
-    lastRoiReceived(),
-    getGCF(),
-    getMaxUnambiguousRange(),
+  // "(2*roiNumRows)/2". The first "2" is for the mapping table step. The second is an offset to half the vertical size of the ROI,
+  const auto &binning = info.binning;
+  const std::array<uint32_t,2> mappingTableStart = {uint32_t(2 * info.roiStartRow + (2*info.roiNumRows)/2 - 1),
+                                                  uint32_t(2 * RtdMetadata::getRoiStartColumn() + binning[1] - 1)};
+  std::array<uint32_t,2> mappingTableStep = {uint32_t(2 * binning[0]),
+                                            uint32_t(2 * binning[1])};
+  const std::array<uint32_t,2> fovStart = { (info.roiStartRow + info.roiNumRows/2)/binning[0], RtdMetadata::getRoiStartColumn()/binning[1] };
+  const std::array<uint32_t,2> fovStep = binning;
+
+  auto fovSegment = std::make_shared<FovSegment>(
+    info.fovIdx,
+    info.headerNum,
+    info.timestamp,
+    info.sensorID,
+    info.userTag,
+    info.lastRoiReceived,
+    info.gcf,
+    info.maxUnambiguousRange,
     roiSize,
-    rangeRoi,
+    FovPlanes::plane(planes, &FovPlanes::range),
     mappingTableStart,
     mappingTableStep,
     fovStart,
     fovStep,
-    RawToDepthCommon::getSnr(_snr),
-    RawToDepthCommon::getSignal(_signal),
-    RawToDepthCommon::getBackground(_background),
-    roiIndices,
-    getTimestamps(),
-    getTimestampsVec(),
-    getLastTimerReport()
-  ));
+    (info.outputPlanes & TRANSMIT_BITMASK_SNR) != 0 ? FovPlanes::plane(planes, &FovPlanes::snr) : nullptr,
+    (info.outputPlanes & TRANSMIT_BITMASK_SIGNAL) != 0 ? FovPlanes::plane(planes, &FovPlanes::signal) : nullptr,
+    (info.outputPlanes & TRANSMIT_BITMASK_BACKGROUND) != 0 ? FovPlanes::plane(planes, &FovPlanes::background) : nullptr,
+    roiIndexRows,
+    info.timestamps,
+    info.timestampsVec,
+    *info.lastTimerReport
+  );
+  info.frameTrace.stamp(TRACE_WHOLE_FRAME_END);
+  fovSegment->setFrameTrace(info.frameTrace);
+  info.setFovSegment(fovSegment);
 }
@@ -6,41 +6,138 @@
  * @copyright Copyright 2023 (C) Lumotive, Inc. All rights reserved.
  * 
  */
+#pragma once
+
 #include "RawToDepth.h"
+#include "FrameScheduler.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 
 constexpr float_t SNR_WEIGHTED_WINDOW_DEFAULT_NUMBER_OF_SUMS { 4.0F };
 
+/**
+ * @brief Everything needed to process one stripe after its ROI has been ingested: the tap-rotated raw data, the
+ *        parameters captured from the RawToDepthStripe_float object, and the per-stripe outputs.
+ *        Recycled from stripe to stripe, so that the buffers keep their capacity.
+ */
+struct StripeInfo
+{
+    // Inputs, written by processRoi() and processWholeFrame() on the ingest thread.
+    std::vector<float_t> rawRoi0Rotated;
+    std::vector<float_t> rawRoi1Rotated;
+    uint32_t roiNumRows = 0;
+    uint16_t roiStartRow = 0;
+    uint32_t binnedRoiWidth = IMAGE_WIDTH;
+    std::array<uint32_t,2> binning = {1,1};
+    RawToDepthDsp::CollapseKernel collapse = nullptr; ///< RawToDepthDsp::selectCollapseRawRoi(binning[1])
+    bool rectSum = false;
+    bool snrWeightedSum = false;
+    std::array<float_t,2> fs = {0,0};
+    RawToDepthDsp::PhaseUnwrap phaseUnwrap;
+    float_t rangeOffsetTemperature = 0.0F;
+    double maxUnambiguousRange = 0.0;
+
+    uint32_t fovIdx = 0;
+    uint32_t headerNum = 0;
+    uint64_t timestamp = 0;
+    uint16_t sensorID = 0;
+    uint32_t userTag = 0;
+    bool lastRoiReceived = false;
+    double gcf = 0.0;
+    bool disableRangeMasking = false;
+    float_t snrThresh = 0.0F;
+    float_t rangeLimit = 0.0F;
+    uint32_t outputPlanes = 0;
+    std::shared_ptr<const PixelMaskSpans> pixelMaskSpans;
+    std::shared_ptr<std::vector<uint64_t>> timestamps;
+    std::shared_ptr<std::vector<std::vector<uint32_t>>> timestampsVec;
+    std::shared_ptr<const std::string> lastTimerReport;
+    FrameTrace frameTrace;
+    std::function<void (std::shared_ptr<FovSegment>)> setFovSegment;
+
+    // Outputs of processStripe(), and its scratch buffer for the snr-weighted window.
+    std::vector<float_t> signal;
+    std::vector<float_t> background;
+    std::vector<float_t> snr;
+    std::vector<float_t> ranges;
+    std::vector<float_t> oneDMinMaxMask;
+    std::vector<float_t> snrWeights;
+};
+
+/**
+ * @brief The stripes waiting for processing on the FrameScheduler, shared between the ingest thread and the
+ *        scheduler thread (see processScheduledStripes()).
+ */
+struct StripeQueue
+{
+    std::mutex mutex;
+    std::condition_variable conditionVariable;
+    std::deque<std::shared_ptr<StripeInfo>> pending; ///< Oldest first. Guarded by mutex.
+    std::vector<std::shared_ptr<StripeInfo>> free;   ///< Processed stripes, for reuse. Guarded by mutex.
+    uint32_t numProcessing = 0;                      ///< Stripes taken from pending and not yet processed. Guarded by mutex.
+    bool quitNow = false;                            ///< Guarded by mutex.
+    uint64_t numBatches = 0;                         ///< Scheduler items that processed at least one stripe. Guarded by mutex.
+};
+
 class RawToDepthStripe_float : public RawToDepth
 {
 private:
-    std::vector<float_t> _signal;
-    std::vector<float_t> _background;
-    std::vector<float_t> _snr;
-    std::vector<float_t> _ranges;
-    std::vector<float_t> _oneDMinMaxMask;
-
-	std::vector<float_t> _snrWeights;
-	float_t              _snrWeightsNumberOfSums { SNR_WEIGHTED_WINDOW_DEFAULT_NUMBER_OF_SUMS };
+    std::shared_ptr<StripeInfo> _info; ///< The stripe being ingested.
 
-    uint16_t _roiStartRow=0;
-    uint32_t _binnedRoiWidth=IMAGE_WIDTH;
+    std::shared_ptr<StripeQueue> _stripeQueue;
+    std::shared_ptr<FrameScheduler> _scheduler; ///< Processes the stripes when they are offloaded. Created on first use.
+    uint32_t _schedulerSourceId = 0;
+    bool _tapsAccumulated = false; ///< Selected at reset(): the FPGA summed the tap permutations (REDUCE_MODE_FGPA).
+    RawToDepthDsp::CollapseKernel _collapse = nullptr; ///< Selected at reset() for the horizontal binning.
     
 protected:
-    bool saveTimestamp(RtdMetadata &mdat) override;
+    bool saveTimestamp(const RtdMetadata &mdat) override;
 
 public:
     RawToDepthStripe_float(uint32_t fovIdx, uint32_t headerNum);
+    RawToDepthStripe_float(RawToDepthStripe_float &other) = delete;
+    RawToDepthStripe_float(RawToDepthStripe_float &&other) = delete;
+    RawToDepthStripe_float *operator=(RawToDepthStripe_float &rhs) = delete;
+    RawToDepthStripe_float *operator=(RawToDepthStripe_float &&rhs) = delete;
+    ~RawToDepthStripe_float() override;
+    void shutdown() override;
 
-    // Performs DSP on the input data to generate the point cloud.
-    void processRoi(const uint16_t* roi, uint32_t numBytes) override;
-    // Simply formats the data for transmission, since per-roi and whole frame processing are the same in Stripe Mode.
+    // Ingests the ROI, and performs the DSP on it to generate the point cloud unless the stripes are offloaded.
+    using RawToDepth::processRoi;
+    void processRoi(const RtdMetadata &roiMdat, const uint16_t* roi, uint32_t numBytes) override;
+    // Formats the data for transmission, since per-roi and whole frame processing are the same in Stripe Mode.
+    // When the stripes are offloaded, queues the stripe instead and returns immediately.
     void processWholeFrame(std::function<void (std::shared_ptr<FovSegment>)> setFovSegment) override;
     // Called once per ROI to resize buffers if necessary.
-    void reset(const uint16_t *mdPtr, uint32_t mdBytes) override;
+    void reset(const RtdMetadata &mdat) override;
+
+    static constexpr uint32_t MAX_STRIPE_QUEUE_DEPTH { 64 }; ///< Stripes waiting for or undergoing processing before ingest blocks.
+    static constexpr uint32_t MAX_STRIPE_BATCH { 16 };
+    /**
+     * @brief Moves the DSP of the stripes off the ingest thread, for RawToDepthStripe_float objects constructed
+     * after this call. processRoi() then only tap-rotates the ROI, and each FOV's stripes are processed in order by a
+     * thread of its own on the DSP processors (see RawToDepthV2_float::getDspCpus()). Disabled by default.
+     */
+    static void setOffloadStripes(bool offload) { _offloadStripes.store(offload, std::memory_order_relaxed); }
+    static bool getOffloadStripes() { return _offloadStripes.load(std::memory_order_relaxed); }
+    /**
+     * @brief Sets the largest number of queued stripes that the processing thread takes at once, so that a burst of
+     * stripes costs one wakeup and one queue lock. Clamped to [1, MAX_STRIPE_BATCH]. Takes effect on the next stripe.
+     */
+    static void setStripeBatch(uint32_t numStripes);
+    static uint32_t getStripeBatch() { return _stripeBatch.load(std::memory_order_relaxed); }
+    uint64_t getNumStripeBatches() const; ///< The number of batches the offloaded stripes were processed in.
 
 private:
     // Called once per ROI to resize buffers if necessary.
-    void realloc(const uint16_t *mdPtr, uint32_t mdBytes);
-    std::pair<const std::vector<float_t>&, float_t> windowFactory(RtdMetadata &mdat, const std::vector<float_t> &rawRoi0, const std::vector<float_t> &rawRoi1, uint32_t rowOffset=0);
+    void realloc(const RtdMetadata &mdat);
+    static std::pair<const std::vector<float_t>&, float_t> windowFactory(StripeInfo &info, uint32_t rowOffset=0);
+    static void processStripe(StripeInfo &info);
+    static void outputStripe(StripeInfo &info);
+    static void processScheduledStripes(StripeQueue &queue);
 
-};
\ No newline at end of file
+    static std::atomic<bool> _offloadStripes;
+    static std::atomic<uint32_t> _stripeBatch;
+};
@@ -0,0 +1,79 @@
+/**
+ * @file RawToDepthV2_fixed.cpp
+ * @brief Specialization of the grid-mode RawToDepth class that keeps the full-resolution raw data
+ *        in 16-bit fixed point.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "RawToDepthV2_fixed.h"
+#include "RawToDepthDsp.h"
+#include "RtdMetadata.h"
+#include "HugePages.h"
+#include <algorithm>
+
+RawToDepthV2_fixed::RawToDepthV2_fixed(uint32_t fovIdx, uint32_t headerNum) :
+  RawToDepthV2_float(fovIdx, headerNum)
+{
+  // The base constructor sized the float raw frames, since it can't call the overrides. They're never used here.
+  _qRawFrames.resize(_activeRows.size());
+  for (auto &rawFrames : _fRawFrames)
+  {
+    rawFrames.clear();
+  }
+  realloc(RtdMetadata(RtdMetadata::DEFAULT_METADATA));
+}
+
+bool RawToDepthV2_fixed::resizeRawFrames(uint32_t slot, std::size_t numRawValues)
+{
+  bool changed = false;
+  MAKE_VECTOR2(_qRawFrames[slot], uint16_t, numRawValues);
+  for (auto &rawFrame : _qRawFrames[slot])
+  {
+    if (rawFrame.capacity() < MAX_RAW_FRAME_VALUES)
+    {
+      rawFrame.reserve(MAX_RAW_FRAME_VALUES);
+      HugePages::advise(rawFrame);
+    }
+  }
+  return changed;
+}
+
+void RawToDepthV2_fixed::clearRawFrames(uint32_t slot)
+{
+  std::fill(_qRawFrames[slot][0].begin(), _qRawFrames[slot][0].end(), 0);
+  std::fill(_qRawFrames[slot][1].begin(), _qRawFrames[slot][1].end(), 0);
+}
+
+void RawToDepthV2_fixed::ingestRawRoi(uint32_t slot, bool doTapRotation, std::array<uint32_t,2> roiSize, uint32_t fovOffset)
+{
+  if (_hdr.isRawPassthrough())
+  {
+    RawToDepthDsp::ingestRoi(_hdr.getRawRoi(), _hdr.getRawRoiShorts(), INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask(),
+                             roiSize, doTapRotation, _qRawFrames[slot], _fovSnrV2, fovOffset);
+  }
+  else
+  {
+    RawToDepthDsp::ingestRoi(_hdr.getRoi(), roiSize, doTapRotation, _qRawFrames[slot], _fovSnrV2, fovOffset);
+  }
+}
+
+void RawToDepthV2_fixed::setRawFrames(LocalProcessFrameInfo &info, uint32_t slot)
+{
+  info.fixedRawFrame0 = &_qRawFrames[slot][0];
+  info.fixedRawFrame1 = &_qRawFrames[slot][1];
+}
+
+void RawToDepthV2_fixed::copyRawFrames(LocalProcessFrameInfo &info, uint32_t slot, std::array<std::size_t,2> rawRows)
+{
+  const auto rawRowSize = _qRawFrames[slot][0].size() / _activeRows[slot].size();
+  for (uint32_t freqIdx = 0; freqIdx < 2; freqIdx++)
+  {
+    const auto &rawFrame = _qRawFrames[slot][freqIdx];
+    info.streamFixedRawFrames[freqIdx].assign(rawFrame.begin() + std::ptrdiff_t(rawRows[0] * rawRowSize),
+                                              rawFrame.begin() + std::ptrdiff_t(rawRows[1] * rawRowSize));
+  }
+  info.fixedRawFrame0 = &info.streamFixedRawFrames[0];
+  info.fixedRawFrame1 = &info.streamFixedRawFrames[1];
+}
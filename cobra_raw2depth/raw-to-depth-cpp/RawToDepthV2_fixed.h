@@ -0,0 +1,46 @@
+/**
+ * @file RawToDepthV2_fixed.h
+ * @brief Specialization of the grid-mode RawToDepth class that keeps the full-resolution raw data
+ *        in 16-bit fixed point.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "RawToDepthV2_float.h"
+
+/**
+ * @brief Grid-mode processing with the full-resolution stages in integer arithmetic.
+ *
+ * The snr-voted raw frames of the frame slots are stored as 16-bit fixed-point values (see RAW_FIXED_SHIFT)
+ * instead of floats, which halves the memory traffic of ingesting the ROIs and of reading the frames back.
+ * Whole-frame processing fills the missing rows, bins and computes the phase from them in one pass with
+ * integer sums and phase (RawToDepthDsp::binAndCalculatePhase()), without the filled full-frame intermediates.
+ * The binned stages (smoothing, range, and the filters) are those of RawToDepthV2_float.
+ *
+ * Selected by RawToDepthFactory::setFixedPoint().
+ */
+class RawToDepthV2_fixed : public RawToDepthV2_float
+{
+public:
+  explicit RawToDepthV2_fixed(uint32_t fovIdx, uint32_t headerNum);
+  RawToDepthV2_fixed() = delete;
+  RawToDepthV2_fixed(RawToDepthV2_fixed &other) = delete;
+  RawToDepthV2_fixed(RawToDepthV2_fixed &&other) = delete;
+  RawToDepthV2_fixed *operator=(RawToDepthV2_fixed &rhs) = delete;
+  RawToDepthV2_fixed *operator=(RawToDepthV2_fixed &&rhs) = delete;
+  ~RawToDepthV2_fixed() override = default;
+
+protected:
+  bool resizeRawFrames(uint32_t slot, std::size_t numRawValues) override;
+  void clearRawFrames(uint32_t slot) override;
+  void ingestRawRoi(uint32_t slot, bool doTapRotation, std::array<uint32_t,2> roiSize, uint32_t fovOffset) override;
+  void setRawFrames(LocalProcessFrameInfo &info, uint32_t slot) override;
+  void copyRawFrames(LocalProcessFrameInfo &info, uint32_t slot, std::array<std::size_t,2> rawRows) override;
+  std::size_t getFilledRawFrameSize() const override { return 0; }
+
+private:
+  std::vector<std::vector<std::vector<uint16_t>>> _qRawFrames; ///< The fixed-point raw frames. slot, frequency, pixels
+};
@@ -14,23 +14,198 @@
 #include "RtdMetadata.h"
 #include "LumoUtil.h"
 #include "FloatVectorPool.h"
+#include "HugePages.h"
+#include <algorithm>
 #include <cmath>
 #include <LumoLogger.h>
-#include <LumoTimers.h>
+#include <FastTimers.h>
 #include <cassert>
 #include <NearestNeighbor.h>
+#include "LumoAffinity.h"
 #include <iostream>
 #include <fstream>
 
+std::atomic<uint32_t> RawToDepthV2_float::_tileRows { RawToDepthV2_float::DEFAULT_TILE_ROWS };
+
+void RawToDepthV2_float::setTileRows(uint32_t tileRows)
+{
+  if (tileRows != 0 && tileRows < MIN_TILE_ROWS)
+  {
+    tileRows = MIN_TILE_ROWS;
+  }
+  _tileRows.store(tileRows, std::memory_order_relaxed);
+}
+
+std::atomic<bool> RawToDepthV2_float::_skipInactiveRows { true };
+
+std::atomic<uint32_t> RawToDepthV2_float::_frameQueueDepth { RawToDepthV2_float::DEFAULT_FRAME_QUEUE_DEPTH };
+std::atomic<FrameQueuePolicy> RawToDepthV2_float::_frameQueuePolicy { FrameQueuePolicy::BLOCK };
+std::atomic<uint32_t> RawToDepthV2_float::_streamRowsDefault { 0 };
+std::atomic<bool> RawToDepthV2_float::_asyncIngest { false };
+
+void RawToDepthV2_float::setFrameQueueDepth(uint32_t depth)
+{
+  _frameQueueDepth.store(std::clamp(depth, MIN_FRAME_QUEUE_DEPTH, MAX_FRAME_QUEUE_DEPTH), std::memory_order_relaxed);
+}
+
+FrameQueueStats RawToDepthV2_float::getFrameQueueStats() const
+{
+  std::lock_guard lock(_frameQueue->mutex);
+  return _frameQueue->stats;
+}
+
+IngestStats RawToDepthV2_float::getIngestStats() const
+{
+  if (!_ingestQueue)
+  {
+    return {};
+  }
+  std::lock_guard lock(_ingestQueue->mutex);
+  return _ingestQueue->stats;
+}
+
+std::mutex RawToDepthV2_float::_workerPoolMutex;
+uint32_t RawToDepthV2_float::_numWorkers { RawToDepthV2_float::DEFAULT_NUM_WORKERS };
+std::shared_ptr<WorkerPool> RawToDepthV2_float::_workerPool { nullptr };
+
+void RawToDepthV2_float::setNumWorkers(uint32_t numWorkers)
+{
+  numWorkers = std::clamp(numWorkers, 1U, MAX_NUM_WORKERS);
+  std::lock_guard lock(_workerPoolMutex);
+  if (numWorkers != _numWorkers)
+  {
+    _numWorkers = numWorkers;
+    _workerPool = nullptr; // Frames in progress keep their reference to the old pool.
+  }
+}
+
+uint32_t RawToDepthV2_float::getNumWorkers()
+{
+  std::lock_guard lock(_workerPoolMutex);
+  return _numWorkers;
+}
+
+/**
+ * @brief Returns the pool shared by all FOVs for processing the bands of a frame, or nullptr if there is one worker.
+ * The helper threads run on the DSP processors, like the whole-frame threads.
+ */
+std::shared_ptr<WorkerPool> RawToDepthV2_float::getWorkerPool()
+{
+  std::lock_guard lock(_workerPoolMutex);
+  if (_numWorkers > 1 && !_workerPool)
+  {
+    _workerPool = std::make_shared<WorkerPool>(_numWorkers - 1, _dspCpus, LumoAffinity::ROLE_WHOLE_FRAME);
+  }
+  return _workerPool;
+}
+
+uint32_t RawToDepthV2_float::_schedulerThreads { 0 };
+std::vector<int> RawToDepthV2_float::_dspCpus { LumoAffinity::A72_0, LumoAffinity::A72_1 };
+std::shared_ptr<FrameScheduler> RawToDepthV2_float::_sharedScheduler { nullptr };
+std::map<uint32_t, int32_t> RawToDepthV2_float::_headPriorities;
+
+void RawToDepthV2_float::setSchedulerThreads(uint32_t numThreads)
+{
+  numThreads = std::min(numThreads, MAX_SCHEDULER_THREADS);
+  std::lock_guard lock(_workerPoolMutex);
+  if (numThreads != _schedulerThreads)
+  {
+    _schedulerThreads = numThreads;
+    _sharedScheduler = nullptr; // Existing objects keep their reference to the old scheduler.
+  }
+}
+
+uint32_t RawToDepthV2_float::getSchedulerThreads()
+{
+  std::lock_guard lock(_workerPoolMutex);
+  return _schedulerThreads;
+}
+
+void RawToDepthV2_float::setDspCpus(std::vector<int> cpus)
+{
+  std::lock_guard lock(_workerPoolMutex);
+  if (cpus != _dspCpus)
+  {
+    _dspCpus = std::move(cpus);
+    _workerPool = nullptr; // Restarted with the new processors on next use.
+    _sharedScheduler = nullptr;
+  }
+}
+
+std::vector<int> RawToDepthV2_float::getDspCpus()
+{
+  std::lock_guard lock(_workerPoolMutex);
+  return _dspCpus;
+}
+
+void RawToDepthV2_float::setHeadPriority(uint32_t headNum, int32_t priority)
+{
+  std::lock_guard lock(_workerPoolMutex);
+  _headPriorities[headNum] = priority;
+  if (_sharedScheduler)
+  {
+    _sharedScheduler->setPriority(headNum, priority);
+  }
+}
+
+/**
+ * @brief Returns the scheduler shared by all FOVs of all sensor heads for whole-frame processing, or nullptr if each
+ * FOV has its own.
+ */
+std::shared_ptr<FrameScheduler> RawToDepthV2_float::getScheduler()
+{
+  std::lock_guard lock(_workerPoolMutex);
+  if (_schedulerThreads > 0 && !_sharedScheduler)
+  {
+    _sharedScheduler = std::make_shared<FrameScheduler>(_schedulerThreads, _dspCpus, "whole_frame", PIPELINE_TRACE_SHARED_HEAD,
+                                                        LumoAffinity::ROLE_WHOLE_FRAME);
+    for (const auto &[headNum, priority] : _headPriorities)
+    {
+      _sharedScheduler->setPriority(headNum, priority);
+    }
+  }
+  return _sharedScheduler;
+}
+
 RawToDepthV2_float::RawToDepthV2_float(uint32_t fovIdx, uint32_t headerNum) :
   RawToDepth(fovIdx, headerNum) , 
-  _wholeFrameRunning(false),
-  _wholeFrameRunningMutex(std::make_shared<std::mutex>()),
-  _wholeFrameRunningConditionVariable(std::make_shared<std::condition_variable>()),
-  _wholeFrameRunningData(std::make_shared<LocalProcessFrameInfo>())
+  _frameQueue(std::make_shared<FrameQueue>()),
+  _scheduler(getScheduler()),
+  _schedulerShared(_scheduler != nullptr),
+  _streamRows(getStreamRows())
 {
-  realloc((uint16_t*)RtdMetadata::DEFAULT_METADATA.data(), uint32_t(RtdMetadata::DEFAULT_METADATA.size()*sizeof(uint16_t)));
-  _wholeFrameRunningData->dataProcessed = true; // Initial condition for the threading.
+  const auto depth = getFrameQueueDepth();
+  _fRawFrames.resize(depth);
+  _activeRows.resize(depth);
+  _roiIndexRows.resize(depth);
+  auto frameArena = std::make_shared<FrameArena>();
+  for (uint32_t slot = 0; slot < depth; slot++)
+  {
+    _frameQueue->frames.push_back(std::make_shared<LocalProcessFrameInfo>());
+    _frameQueue->frames.back()->frameArena = frameArena;
+  }
+  if (!_scheduler)
+  {
+    _scheduler = std::make_shared<FrameScheduler>(1, getDspCpus(), "whole_frame fov " + std::to_string(fovIdx), int(headerNum),
+                                                  LumoAffinity::ROLE_WHOLE_FRAME);
+  }
+  // The sensor heads are the scheduler's groups, so that they share a shared scheduler fairly.
+  _schedulerSourceId = _scheduler->addSource(headerNum, [queue = _frameQueue]() { processScheduledFrame(*queue); });
+  if (_streamRows > 0)
+  {
+    _streamQueue = std::make_shared<StreamQueue>();
+    _streamQueue->frameArena = std::make_shared<FrameArena>();
+    _streamSourceId = _scheduler->addSource(headerNum, [queue = _streamQueue]() { processScheduledSegment(*queue); });
+  }
+  if (getAsyncIngest())
+  {
+    _ingestQueue = std::make_shared<IngestQueue>();
+    _ingestScheduler = std::make_shared<FrameScheduler>(1, getDspCpus(), "ingest fov " + std::to_string(fovIdx), int(headerNum),
+                                                        LumoAffinity::ROLE_WHOLE_FRAME);
+    // The object outlives the source: shutdown() and the destructor remove it before the buffers go.
+    _ingestSourceId = _ingestScheduler->addSource(headerNum, [this, queue = _ingestQueue]() { ingestScheduledRoi(this, *queue); });
+  }
+  realloc(RtdMetadata(RtdMetadata::DEFAULT_METADATA));
 
   std::ostringstream logId; logId << std::setw(4) << std::setfill('0') << "RawToDepthV2_float_" << _headerNum;
   LumoLogger::setId(logId.str());
@@ -38,69 +213,106 @@ RawToDepthV2_float::RawToDepthV2_float(uint32_t fovIdx, uint32_t headerNum) :
 
 RawToDepthV2_float::~RawToDepthV2_float()
 {
-  _wholeFrameRunningData->quitNow = true;
+  if (_ingestScheduler)
+  {
+    finishIngest();
+    _ingestScheduler->removeSource(_ingestSourceId);
+  }
+  {
+    std::unique_lock mutexLock(_frameQueue->mutex);
+    _frameQueue->quitNow = true;
+  }
+  _frameQueue->conditionVariable.notify_all();
+  _scheduler->removeSource(_schedulerSourceId);
+  removeStreamSource();
   LLogDebug("RawToDepthV2_float dtor");
 }
 
 void RawToDepthV2_float::shutdown()
 {
-  if (!_wholeFrameRunningFuture.valid())
+  if (_ingestScheduler)
+  {
+    finishIngest();
+    _ingestScheduler->removeSource(_ingestSourceId);
+    _ingestScheduler = nullptr;
+  }
+  {
+    std::unique_lock mutexLock(_frameQueue->mutex);
+    _frameQueue->quitNow = true;
+  }
+  _frameQueue->conditionVariable.notify_all();
+  _scheduler->removeSource(_schedulerSourceId); // Waits for the frame being processed.
+  removeStreamSource();
+}
+
+void RawToDepthV2_float::removeStreamSource()
+{
+  if (!_streamQueue)
   {
     return;
   }
-  
   {
-    std::unique_lock mutexLock(*_wholeFrameRunningMutex);
-    _wholeFrameRunningData->dataReady = true;
-    _wholeFrameRunningData->quitNow = true;
+    std::lock_guard lock(_streamQueue->mutex);
+    _streamQueue->quitNow = true;
   }
-  _wholeFrameRunningConditionVariable->notify_one();
-  _wholeFrameRunningFuture.wait();
+  _scheduler->removeSource(_streamSourceId); // Waits for the segment being processed.
+  _streamQueue = nullptr;
 }
 
-void RawToDepthV2_float::reset(const uint16_t *mdPtr, uint32_t mdBytes) {
-  RawToDepth::reset(mdPtr, mdBytes);
-  auto mdat = RtdMetadata(mdPtr, mdBytes);
+void RawToDepthV2_float::reset(const RtdMetadata &mdat) {
+  RawToDepth::reset(mdat);
 
   _performGhostMedian = mdat.getPerformGhostMedianFilter(_fovIdx);
   _performGhostMinMax = mdat.getPerformGhostMinMaxFilter(_fovIdx);
 
-  realloc(mdPtr, mdBytes);
+  realloc(mdat);
+
+  _streamedRows = 0;
+  _streamRoiRow = 0;
+  _streamInOrder = true;
+}
+
+void RawToDepthV2_float::restartFrame() {
+  finishIngest();
+  RawToDepth::restartFrame();
+  _capture = nullptr;      // The frame will never be completed, and neither will its capture.
+  _streamInOrder = false;  // No more rows of it are streamed; reset() re-enables streaming at the next frame.
 }
 
-bool RawToDepthV2_float::bufferSizesChanged(RtdMetadata &mdat) {
+bool RawToDepthV2_float::bufferSizesChanged(const RtdMetadata &mdat) {
   if (RawToDepth::bufferSizesChanged(mdat)) 
   {
     return true;
   }
 
-  if (_activeRows[0].size() != mdat.getFovNumRows(_fovIdx) ||
-      _activeRows[1].size() != mdat.getFovNumRows(_fovIdx) ||
-      _roiIndexFrames[0].size() != size_t(MAX_IMAGE_HEIGHT) * size_t(IMAGE_WIDTH) ||
-      _roiIndexFrames[1].size() != size_t(MAX_IMAGE_HEIGHT) * size_t(IMAGE_WIDTH) ||
-      _fovSnrV2.size() != size_t(RtdMetadata::getFovNumColumns(_fovIdx)) * size_t(mdat.getFovNumRows(_fovIdx))
-  )
+  for (uint32_t slot = 0; slot < _activeRows.size(); slot++)
   {
-    return true;
+    if (_activeRows[slot].size() != mdat.getFovNumRows(_fovIdx) ||
+        _roiIndexRows[slot].size() != size_t(MAX_IMAGE_HEIGHT))
+    {
+      return true;
+    }
   }
-  return false;
+  return _fovSnrV2.size() != size_t(RtdMetadata::getFovNumColumns(_fovIdx)) * size_t(mdat.getFovNumRows(_fovIdx));
 }
 
-void RawToDepthV2_float::realloc(const uint16_t *mdPtr, uint32_t mdBytes)
+void RawToDepthV2_float::realloc(const RtdMetadata &mdat)
 {
   auto imsize = _size[0] * _size[1];
-  auto mdat = RtdMetadata(mdPtr, mdBytes);
 
   bool changed = false;
 
-  MAKE_VECTOR2(_fRawFrames[0], float_t, NUM_GPIXEL_PHASES*mdat.getFovNumColumns(_fovIdx)*mdat.getFovNumRows(_fovIdx)); 
-  MAKE_VECTOR2(_fRawFrames[1], float_t, NUM_GPIXEL_PHASES*mdat.getFovNumColumns(_fovIdx)*mdat.getFovNumRows(_fovIdx)); 
-  MAKE_VECTOR(_activeRows[0], bool, mdat.getFovNumRows(_fovIdx));
-  MAKE_VECTOR(_activeRows[1], bool, mdat.getFovNumRows(_fovIdx));
-  MAKE_VECTOR(_roiIndexFrames[0], int32_t, MAX_IMAGE_HEIGHT * IMAGE_WIDTH);
-  MAKE_VECTOR(_roiIndexFrames[1], int32_t, MAX_IMAGE_HEIGHT * IMAGE_WIDTH);
+  // The per-FOV buffers have the capacity of the largest geometry, so a geometry change only resizes them in place.
+  for (uint32_t slot = 0; slot < _activeRows.size(); slot++)
+  {
+    changed = resizeRawFrames(slot, NUM_GPIXEL_PHASES*mdat.getFovNumColumns(_fovIdx)*mdat.getFovNumRows(_fovIdx)) || changed;
+    _activeRows[slot].reserve(MAX_IMAGE_HEIGHT);
+    MAKE_VECTOR(_activeRows[slot], bool, mdat.getFovNumRows(_fovIdx));
+    MAKE_VECTOR(_roiIndexRows[slot], int32_t, MAX_IMAGE_HEIGHT);
+  }
   
   // unbinned snr the size of the fov.
+  _fovSnrV2.reserve(std::size_t(MAX_IMAGE_HEIGHT) * IMAGE_WIDTH);
   MAKE_VECTOR(_fovSnrV2, float_t, mdat.getFovNumColumns(_fovIdx) * mdat.getFovNumRows(_fovIdx)); // prebinned.
   std::fill(_fovSnrV2.begin(), _fovSnrV2.end(), 0.0F);
   
@@ -131,6 +343,25 @@ void RawToDepthV2_float::realloc(const uint16_t *mdPtr, uint32_t mdBytes)
     _columnKernelIdx=0;
   }
 
+  // Under sustained overload, the filters of this FOV are degraded in steps (see LoadShedder).
+  if (_loadShedder)
+  {
+    const auto level = _loadShedder->getLevel();
+    if (level >= LoadShedder::NO_NEAREST_NEIGHBOR)
+    {
+      _nearestNeighborFilterLevel = 0;
+    }
+    if (level >= LoadShedder::NO_GHOST_MEDIAN)
+    {
+      _performGhostMedian = false;
+    }
+    if (level >= LoadShedder::CHEAP_SMOOTHING)
+    {
+      _rowKernelIdx = std::min(_rowKernelIdx, LoadShedder::CHEAP_KERNEL_IDX);
+      _columnKernelIdx = std::min(_columnKernelIdx, LoadShedder::CHEAP_KERNEL_IDX);
+    }
+  }
+
   _minMaxFilterSize = {};
   if (mdat.getPerformGhostMinMaxFilter(_fovIdx)) 
   {
@@ -148,20 +379,195 @@ void RawToDepthV2_float::realloc(const uint16_t *mdPtr, uint32_t mdBytes)
     _minMaxFilterSize = {vMinMaxSize, hMinMaxSize};
   }
 
-  if (changed || bufferSizesChanged(mdat)) 
+  // Frames that are still queued keep a reference to the config of their own FOV.
+  auto config = std::make_shared<WholeFrameConfig>();
+  config->fovIdx = _fovIdx;
+  config->binning = _binning;
+  config->binKernel = Binning::select(_binning);
+  config->size = _size;
+  config->rowKernelIdx = _rowKernelIdx;
+  config->columnKernelIdx = _columnKernelIdx;
+  config->fs = _fs;
+  config->fsInt = _fsInt;
+  config->c = _c_mps;
+  config->phaseUnwrap = _phaseUnwrap;
+  config->minMaxFilterSize = _minMaxFilterSize;
+  config->performGhostMedian = _performGhostMedian;
+  config->nearestNeighborFilterLevel = _nearestNeighborFilterLevel;
+  config->headerNum = getHeaderNum();
+  config->timestamp = getTimestamp();
+  config->sensorId = getSensorID();
+  config->userTag = getUserTag();
+  config->GCF = getGCF();
+  config->maxUnambiguousRange = getMaxUnambiguousRange();
+  config->imageStart = getImageStart();
+  config->imageStep = getImageStep();
+  config->fovStart = _sensorFovStart;
+  config->fovStep = _sensorFovStep;
+  config->fovSize = _sensorFovSize;
+  config->fovNumRois = _expectedNumRois;
+  config->disableRangeMasking = _disableRangeMasking;
+  config->outputPlanes = _outputPlanes;
+  config->snrThresh = _snrThresh;
+  config->disableRtd = _disableRtd;
+  config->rangeLimit = _rangeLimit;
+  config->tileRows = getTileRows();
+  config->skipInactiveRows = getSkipInactiveRows();
+  // With the shared scheduler, whole frames run in parallel, so each frame's bands run on the thread that processes it.
+  config->workerPool = _schedulerShared ? nullptr : getWorkerPool();
+  config->directions = _directions;
+  config->outputPool = _outputPool;
+  config->loadShedder = _loadShedder;
+  config->medianOffsets = _performGhostMedian ? getMedianOffsets(_rowKernelIdx, _columnKernelIdx) : nullptr;
+  config->frameArenaSizes = getFrameArenaSizes(_size, getFilledRawFrameSize(), config->tileRows,
+                                               getBandHalos(_columnKernelIdx, _performGhostMedian, _nearestNeighborFilterLevel),
+                                               getNumBandBuffers(getNumBands(_size[0], config->tileRows), config->workerPool));
+  _wholeFrameConfig = config;
+
+  // The pooled vectors of a geometry seen recently are kept for when the scan table switches back to it.
+  if ((changed || bufferSizesChanged(mdat)) && _newGeometry)
   {
     FloatVectorPool::clear();
   }
 
 }
 
+bool RawToDepthV2_float::resizeRawFrames(uint32_t slot, std::size_t numRawValues)
+{
+  bool changed = false;
+  MAKE_VECTOR2(_fRawFrames[slot], float_t, numRawValues);
+  for (auto &rawFrame : _fRawFrames[slot])
+  {
+    if (rawFrame.capacity() < MAX_RAW_FRAME_VALUES)
+    {
+      rawFrame.reserve(MAX_RAW_FRAME_VALUES);
+      HugePages::advise(rawFrame);
+    }
+  }
+  return changed;
+}
+
+void RawToDepthV2_float::clearRawFrames(uint32_t slot)
+{
+  std::fill(_fRawFrames[slot][0].begin(), _fRawFrames[slot][0].end(), 0.0F);
+  std::fill(_fRawFrames[slot][1].begin(), _fRawFrames[slot][1].end(), 0.0F);
+}
+
+/**
+ * @brief Runs on the ingest thread (see setAsyncIngest()): ingests the submitted ROI, if any.
+ */
+void RawToDepthV2_float::ingestScheduledRoi(RawToDepthV2_float *inst, IngestQueue &queue)
+{
+  std::unique_lock lock(queue.mutex);
+  if (!queue.busy)
+  {
+    return;
+  }
+  const auto slot = queue.slot;
+  const auto doTapRotation = queue.doTapRotation;
+  const auto roiSize = queue.roiSize;
+  const auto fovOffset = queue.fovOffset;
+  lock.unlock();
+
+  inst->ingestRawRoi(slot, doTapRotation, roiSize, fovOffset);
+
+  lock.lock();
+  queue.busy = false;
+  lock.unlock();
+  queue.conditionVariable.notify_all();
+}
+
+void RawToDepthV2_float::submitIngest(uint32_t slot, bool doTapRotation, std::array<uint32_t,2> roiSize, uint32_t fovOffset)
+{
+  if (!_ingestScheduler)
+  {
+    ingestRawRoi(slot, doTapRotation, roiSize, fovOffset);
+    return;
+  }
+  {
+    std::lock_guard lock(_ingestQueue->mutex);
+    _ingestQueue->slot = slot;
+    _ingestQueue->doTapRotation = doTapRotation;
+    _ingestQueue->roiSize = roiSize;
+    _ingestQueue->fovOffset = fovOffset;
+    _ingestQueue->busy = true;
+    _ingestQueue->stats.submitted++;
+  }
+  _ingestPending = true;
+  _ingestScheduler->submit(_ingestSourceId);
+}
+
+void RawToDepthV2_float::finishIngest()
+{
+  if (!_ingestPending)
+  {
+    return;
+  }
+  {
+    std::unique_lock lock(_ingestQueue->mutex);
+    if (_ingestQueue->busy)
+    {
+      _ingestQueue->stats.waited++;
+      _ingestQueue->conditionVariable.wait(lock, [this] { return !_ingestQueue->busy; });
+    }
+  }
+  _ingestPending = false;
+  _ingestRoiOwner = nullptr;
+}
+
+void RawToDepthV2_float::releaseRoi(std::shared_ptr<const void> owner)
+{
+  if (owner == nullptr)
+  {
+    finishIngest();
+    return;
+  }
+  if (_ingestPending)
+  {
+    _ingestRoiOwner = std::move(owner);
+  }
+}
+
+void RawToDepthV2_float::ingestRawRoi(uint32_t slot, bool doTapRotation, std::array<uint32_t,2> roiSize, uint32_t fovOffset)
+{
+  // If HDR passed the raw input through, the conversion to float is performed in the same pass.
+  if (_hdr.isRawPassthrough())
+  {
+    RawToDepthDsp::ingestRoi(_hdr.getRawRoi(), _hdr.getRawRoiShorts(), INPUT_RAW_SHIFT, RtdMetadata::getRawPixelMask(),
+                             roiSize, doTapRotation, _fRawFrames[slot], _fovSnrV2, fovOffset);
+  }
+  else
+  {
+    RawToDepthDsp::ingestRoi(_hdr.getRoi(), roiSize, doTapRotation, _fRawFrames[slot], _fovSnrV2, fovOffset);
+  }
+}
+
+void RawToDepthV2_float::setRawFrames(LocalProcessFrameInfo &info, uint32_t slot)
+{
+  info.rawFrame0 = &_fRawFrames[slot][0];
+  info.rawFrame1 = &_fRawFrames[slot][1];
+}
+
+void RawToDepthV2_float::copyRawFrames(LocalProcessFrameInfo &info, uint32_t slot, std::array<std::size_t,2> rawRows)
+{
+  const auto rawRowSize = _fRawFrames[slot][0].size() / _activeRows[slot].size();
+  for (uint32_t freqIdx = 0; freqIdx < 2; freqIdx++)
+  {
+    const auto &rawFrame = _fRawFrames[slot][freqIdx];
+    info.streamRawFrames[freqIdx].assign(rawFrame.begin() + std::ptrdiff_t(rawRows[0] * rawRowSize),
+                                         rawFrame.begin() + std::ptrdiff_t(rawRows[1] * rawRowSize));
+  }
+  info.rawFrame0 = &info.streamRawFrames[0];
+  info.rawFrame1 = &info.streamRawFrames[1];
+}
+
 static bool contains(const std::vector<int32_t> &roiStartRows, const uint32_t row)
 {
   return std::find(roiStartRows.begin(), roiStartRows.end(), row) != roiStartRows.end();
 }
 
 
-bool RawToDepthV2_float::saveTimestamp(RtdMetadata &mdat)
+bool RawToDepthV2_float::saveTimestamp(const RtdMetadata &mdat)
 {
   if (!RawToDepth::saveTimestamp(mdat))
   {
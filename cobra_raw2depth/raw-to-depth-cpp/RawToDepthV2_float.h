@@ -10,65 +10,186 @@
 #pragma once
 
 #include "RawToDepth.h"
-#include <future>
+#include "Binning.h"
+#include "FrameArena.h"
+#include "FovPlanes.h"
+#include "WorkerPool.h"
+#include "FrameScheduler.h"
+#include "DspCapture.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
 
   /**
-   * @brief Private struct used to peel away data that's used in the processWholeFrame thread.
-   *        The data in this struct is a copy of the needed data so that the state of the 
-   *        container (RawToDepthV2_float) doesn't need to stay static during the execution of the
-   *        separate thread.
-   * 
+   * @brief The parameters of whole-frame processing that are fixed for the duration of an FOV.
+   *        Built by RawToDepthV2_float::realloc() when the first ROI of an FOV is received, and then shared
+   *        read-only with the processWholeFrame thread, so that handing over a frame doesn't copy them.
    */
-  typedef struct LocalProcessFrameInfo
+  struct WholeFrameConfig
   {
-    bool quitNow = false;
-    bool dataReady = false;
-    bool dataProcessed = true;
-    std::shared_ptr<std::condition_variable> conditionVariable;
-    std::shared_ptr<std::mutex> mutex = nullptr;
-    std::function<void (std::shared_ptr<FovSegment>)> setFovSegment = [](std::shared_ptr<FovSegment>){} ;
     uint32_t fovIdx = 0;
     std::array<uint32_t, 2> binning = {2,2};
+    Binning::Kernel binKernel = nullptr; ///< Binning::select(binning), or nullptr if the binning isn't supported.
     std::array<uint32_t, 2> size = {MAX_IMAGE_HEIGHT,IMAGE_WIDTH};
     uint32_t rowKernelIdx = 0;
     uint32_t columnKernelIdx = 0;
     std::array<float_t, 2> fs = {0,0};
     std::vector<float_t> fsInt = {0,0};
     float_t c = C_MPS;
+    RawToDepthDsp::PhaseUnwrap phaseUnwrap; ///< As computed by RawToDepthDsp::getPhaseUnwrap() from fs, fsInt and c.
     std::vector<uint32_t> minMaxFilterSize;
     bool performGhostMedian = false;
     uint16_t nearestNeighborFilterLevel = 0;
     uint32_t headerNum = 0;
-    uint64_t timestamp = 0;
+    uint64_t timestamp = 0; ///< The timestamp of the first ROI.
     uint16_t sensorId = 0;
     uint32_t userTag = 0;
-    bool lastRoiReceived = false; ///< Indicates whether the final ROI in the FOV was received.
-    bool incompleteFov = false;
     double GCF = 0;
     double maxUnambiguousRange = 0;
     std::array<uint32_t,2> imageStart = {0,0};
     std::array<uint32_t,2> imageStep = {2,2};
-    std::vector<int32_t>  roiIndexFrame = {};
-    std::vector<uint64_t> timestamps = {}; ///< 64-bit timestamp, that is the lower 60 bits of the 7 12-bit metadata values.
-    std::vector<std::vector<uint32_t>> timestampsVec = {}; ///< Newer timestamp format, in which all 94 bits are split between 3 32-bit unsigned ints.
-    std::string lastTimerReport;
-    std::shared_ptr<std::vector<uint16_t>> pixelMask = nullptr;
     std::array<uint16_t,2> fovStart = {0,0};
     std::array<uint16_t,2> fovStep = {0,0};
     std::array<uint16_t,2> fovSize = {0,0}; ///< pre-binned
     uint16_t fovNumRois = 0;
-    int32_t lastRoiIdx = 0; ///< The last value of _currentRoiIdx, which should equal the number of expected ROIs in this FOV.
     bool disableRangeMasking = false;
+    uint16_t outputPlanes = TRANSMIT_BITMASK_ALL_PLANES; ///< The TRANSMIT_BITMASK_* planes to convert for the FovSegment. The others are nullptr.
     float_t snrThresh = 0;
-    float_t rangeOffsetTemperature = 0;
     bool disableRtd = false;
-    std::vector<bool> activeRows = {};
-    std::shared_ptr<LumoTimers> timers = nullptr;
     float_t rangeLimit = 0.0F;
+    std::vector<std::size_t> frameArenaSizes = {}; ///< Buffer sizes for the FrameArena, in allocation order.
+    uint32_t tileRows = 0; ///< Minimum output rows per band for the banded stages. 0 processes the whole frame as one band.
+    bool skipInactiveRows = false; ///< Skip the whole-frame stages on the output rows that can't hold data (see setSkipInactiveRows()).
+    std::shared_ptr<WorkerPool> workerPool = nullptr; ///< Runs the bands in parallel. nullptr to process them on the calling thread.
+    std::shared_ptr<const std::vector<float_t>> directions = nullptr; ///< The pixels' unit directions (x, y and z planes) to output XYZ points, or nullptr.
+    std::shared_ptr<FovPlanesPool> outputPool = nullptr; ///< The FOV's recycled output planes. nullptr to allocate them every frame.
+    std::shared_ptr<LoadShedder> loadShedder = nullptr; ///< Told the latency of each processed frame, or nullptr.
+    std::shared_ptr<const std::vector<int>> medianOffsets = nullptr; ///< The ghost median filter's point offsets, kept with the geometry.
+  };
+
+  /**
+   * @brief Private struct used to peel away data that's used in the processWholeFrame thread.
+   *        There is one of these per frame slot. The per-ROI state is handed over in processWholeFrame() by
+   *        swapping or pointing into the slot's buffers, so that the state of the container (RawToDepthV2_float)
+   *        doesn't need to stay static during the execution of the separate thread, without copying it.
+   * 
+   */
+  typedef struct LocalProcessFrameInfo
+  {
+    std::function<void (std::shared_ptr<FovSegment>)> setFovSegment = [](std::shared_ptr<FovSegment>){} ;
+    std::shared_ptr<const WholeFrameConfig> config = std::make_shared<WholeFrameConfig>();
+    bool lastRoiReceived = false; ///< Indicates whether the final ROI in the FOV was received.
+    bool incompleteFov = false;
+    FrameTrace frameTrace; ///< The latency trace of the frame, stamped at the start and end of whole-frame processing.
+    const std::vector<int32_t> *roiIndexRows = nullptr; ///< The frame slot's roi index of each sensor row.
+    std::vector<uint64_t> timestamps = {}; ///< 64-bit timestamp, that is the lower 60 bits of the 7 12-bit metadata values. Swapped in.
+    std::vector<std::vector<uint32_t>> timestampsVec = {}; ///< Newer timestamp format, in which all 94 bits are split between 3 32-bit unsigned ints. Swapped in.
+    std::shared_ptr<const std::string> lastTimerReport = nullptr;
+    std::shared_ptr<const PixelMaskSpans> pixelMaskSpans = nullptr; ///< The pixel mask in the geometry of the whole FOV.
+    int32_t lastRoiIdx = 0; ///< The last value of _currentRoiIdx, which should equal the number of expected ROIs in this FOV.
+    float_t rangeOffsetTemperature = 0;
+    const std::vector<bool> *activeRows = nullptr; ///< The frame slot's active rows.
     std::vector<float_t> *rawFrame0 = nullptr;
     std::vector<float_t> *rawFrame1 = nullptr;
+    const std::vector<uint16_t> *fixedRawFrame0 = nullptr; ///< RawToDepthV2_fixed only: the 16-bit raw frames, used instead of rawFrame0/1.
+    const std::vector<uint16_t> *fixedRawFrame1 = nullptr;
+    std::shared_ptr<FrameArena> frameArena = nullptr; ///< Owned by the processWholeFrame thread and shared by all frame slots. Reset every frame.
+    ///< Streamed segments only (see RawToDepthV2_float::setStreamRows()): the rows of the FOV to output. The config's size
+    ///< and starts then describe a window of the FOV around them, starting at windowRow. {0,0} outputs the whole FOV.
+    std::array<uint32_t,2> outputRows = {0,0};
+    uint32_t windowRow = 0;
+    uint32_t fovRows = 0; ///< Streamed segments only: the number of output rows in the whole FOV.
+    // Streamed segments only: the segment's own copies of the window's rows, since the FOV is still being ingested into.
+    std::vector<std::vector<float_t>> streamRawFrames = {{}, {}};
+    std::vector<std::vector<uint16_t>> streamFixedRawFrames = {{}, {}};
+    std::vector<bool> streamActiveRows;
+    std::vector<int32_t> streamRoiIndexRows;
+    uint64_t completedNs = 0;   ///< When processWholeFrame() queued the frame.
+    uint64_t framePeriodNs = 0; ///< The time since the FOV's previous frame was completed, or 0 for its first frame.
+    std::shared_ptr<DspSnapshot> capture = nullptr; ///< The snapshot of a sampled frame (see DspCapture), or nullptr.
   } LocalProcessFrameInfo;
 
+  /**
+   * @brief What processWholeFrame() does when a frame completes and every other frame slot is still waiting for,
+   *        or undergoing, whole-frame processing.
+   */
+  enum class FrameQueuePolicy
+  {
+    BLOCK,       ///< Wait for the oldest frame to finish processing. ROI ingest stalls in the meantime.
+    DROP_OLDEST, ///< Discard the oldest frame that hasn't started processing, and ingest into its slot.
+    DROP_NEWEST, ///< Discard the frame that just completed, and ingest the next frame into the same slot.
+  };
+
+  /**
+   * @brief Counters describing the backpressure on whole-frame processing for one FOV.
+   */
+  struct FrameQueueStats
+  {
+    uint64_t queued = 0;    ///< Frames handed to whole-frame processing.
+    uint64_t processed = 0; ///< Frames for which whole-frame processing has completed.
+    uint64_t dropped = 0;   ///< Frames discarded because all of the slots were in use.
+    uint64_t blocked = 0;   ///< Number of times processWholeFrame() waited for a free slot (FrameQueuePolicy::BLOCK).
+    uint32_t maxDepth = 0;  ///< The largest number of frames waiting for or undergoing processing at once.
+  };
+
+  /**
+   * @brief The frames waiting for whole-frame processing, shared between processWholeFrame() and
+   *        the FrameScheduler thread that processes them (see processScheduledFrame()).
+   *
+   * Each frame slot owns one set of full-frame raw buffers in RawToDepthV2_float and one LocalProcessFrameInfo here.
+   * A slot is either being ingested into by processRoi(), pending, being processed, or free.
+   */
+  struct FrameQueue
+  {
+    std::mutex mutex;
+    std::condition_variable conditionVariable;
+    std::vector<std::shared_ptr<LocalProcessFrameInfo>> frames; ///< One per slot.
+    std::deque<uint32_t> pending;  ///< Slots waiting for whole-frame processing, oldest first. Guarded by mutex.
+    int32_t processingSlot = -1;   ///< The slot being processed, or -1. Guarded by mutex.
+    bool quitNow = false;          ///< Guarded by mutex.
+    FrameQueueStats stats;         ///< Guarded by mutex.
+  };
+
+  /**
+   * @brief Counters of the asynchronous ROI ingest of one FOV (see RawToDepthV2_float::setAsyncIngest()).
+   */
+  struct IngestStats
+  {
+    uint64_t submitted = 0; ///< ROIs handed to the ingest thread.
+    uint64_t waited = 0;    ///< Times the ROI thread had to wait for the ingest of the previous ROI to finish.
+  };
+
+  /**
+   * @brief The ROI being ingested, shared between processRoi() and the FrameScheduler thread that ingests it.
+   *        At most one ROI is in flight: it is finished before the next ROI of the FOV is submitted to HDR.
+   */
+  struct IngestQueue
+  {
+    std::mutex mutex;
+    std::condition_variable conditionVariable;
+    uint32_t slot = 0;                     ///< The arguments of ingestRawRoi(). Guarded by mutex.
+    bool doTapRotation = false;
+    std::array<uint32_t,2> roiSize {0, 0};
+    uint32_t fovOffset = 0;
+    bool busy = false;                     ///< Submitted and not yet ingested. Guarded by mutex.
+    IngestStats stats;                     ///< Guarded by mutex.
+  };
+
+  /**
+   * @brief The streamed segments of an FOV waiting for processing, shared between processStreamRows() and the
+   *        FrameScheduler thread that processes them in order (see processScheduledSegment()).
+   */
+  struct StreamQueue
+  {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<LocalProcessFrameInfo>> pending; ///< Oldest first. Guarded by mutex.
+    std::vector<std::shared_ptr<LocalProcessFrameInfo>> free;   ///< Processed segments, for reuse. Guarded by mutex.
+    bool quitNow = false;                                       ///< Guarded by mutex.
+    std::shared_ptr<FrameArena> frameArena;                     ///< Shared by the segments, which are processed one at a time.
+  };
+
 
 /**
  * @brief Specialization of the RawToDepth class that implements the float-point
@@ -79,33 +200,66 @@ class RawToDepthV2_float : public RawToDepth
 {
  protected:
 
-  // Ping-pong buffers are used for processWholeFrame multithreading.
-  std::array<
+  // A ring of frame slots is used for processWholeFrame multithreading. ROIs are ingested into one slot while
+  // the frames in the other slots wait for, or undergo, whole-frame processing.
+  std::vector<
     std::vector<
-      std::vector<float_t>>, 2>  _fRawFrames; ///< DSP intermediate value: output of pre-binning snr voting. pingPong, frequency, pixels 
+      std::vector<float_t>>>   _fRawFrames; ///< DSP intermediate value: output of pre-binning snr voting. slot, frequency, pixels 
   // Since the data is snr-voted into the raw buffer directly from the input ROI, it's possible that there can be
   // gaps between the ROIs during acquisition. Therefore, this variable keeps track of the rows of the prebinned buffer than 
   // contain valid data so that they can be filled via interpolation.
-  std::array<
-    std::vector<bool>,2>       _activeRows; ///< DSP intermediate value: One entry per pre-binned row. True if input rois had data in the row.
-  std::array<
-    std::vector<int32_t>,2>    _roiIndexFrames; ///< ping-pong. Each output pixel is assigned the index of the input roi in arrival order.
+  std::vector<
+    std::vector<bool>>         _activeRows; ///< DSP intermediate value: One entry per pre-binned row. True if input rois had data in the row.
+  std::vector<
+    std::vector<int32_t>>      _roiIndexRows; ///< per slot. Each sensor row is assigned the index of the input roi in arrival order.
   std::vector<float_t>         _fovSnrV2; ///< internal snr used for pre-binning snr-voting
-  uint32_t _rawPingOrPong=0;
+  std::shared_ptr<const WholeFrameConfig> _wholeFrameConfig; ///< The whole-frame parameters of the current FOV. Rebuilt by realloc().
+  uint32_t _ingestSlot=0; ///< The frame slot that processRoi() writes into.
+  uint64_t _lastFrameCompletedNs=0; ///< When processWholeFrame() was last called, for the frame period.
+  std::shared_ptr<FovPlanesPool> _outputPool { std::make_shared<FovPlanesPool>() }; ///< Passed on in the WholeFrameConfig.
+
 
+  std::shared_ptr<FrameQueue> _frameQueue;
+  std::shared_ptr<FrameScheduler> _scheduler; ///< Processes the whole frames: the shared scheduler, or one of this FOV's own with one thread.
+  bool _schedulerShared = false;
+  uint32_t _schedulerSourceId = 0;            ///< The frame queue's source in _scheduler.
 
-  bool _wholeFrameRunning;
-  std::future<void> _wholeFrameRunningFuture; ///< Holds the future for the thread that runs the whole-frame processing.
-  std::shared_ptr<std::mutex> _wholeFrameRunningMutex;
-  std::shared_ptr<std::condition_variable> _wholeFrameRunningConditionVariable;
-  std::shared_ptr<LocalProcessFrameInfo>   _wholeFrameRunningData;
+  // Asynchronous ROI ingest (see setAsyncIngest()): a thread of this FOV's own runs ingestRawRoi().
+  std::shared_ptr<IngestQueue> _ingestQueue;      ///< nullptr when the ROIs are ingested on the ROI thread.
+  std::shared_ptr<FrameScheduler> _ingestScheduler;
+  uint32_t _ingestSourceId = 0;
+  bool _ingestPending = false;                    ///< An ROI was submitted since the last finishIngest().
+  std::shared_ptr<const void> _ingestRoiOwner;    ///< Keeps the input buffer of the ROI being ingested (see releaseRoi()).
+  // Runs ingestRawRoi() on the ingest thread if there is one, otherwise on the calling thread.
+  void submitIngest(uint32_t slot, bool doTapRotation, std::array<uint32_t,2> roiSize, uint32_t fovOffset);
+  // Waits for the ROI being ingested, if any, and lets go of its input buffer.
+  void finishIngest();
 
   bool     _performGhostMedian {false}; ///< (from metadata) Enable a 2D median filter on the output range values
   bool     _performGhostMinMax {false}; ///< (from metadata) Enable the min-max filter on the intermediate value "M"
 
   uint32_t _rowKernelIdx = 1; ///< Processing parameters: raw data smoothing filter kernel indices
   uint32_t _columnKernelIdx = 1;
-  bool saveTimestamp(RtdMetadata &mdat) override;
+  bool saveTimestamp(const RtdMetadata &mdat) override;
+  void realloc(const RtdMetadata &mdat);
+
+  // The storage of the raw frames of the frame slots, which RawToDepthV2_fixed replaces with 16-bit frames.
+  static constexpr std::size_t MAX_RAW_FRAME_VALUES { std::size_t(NUM_GPIXEL_PHASES) * MAX_IMAGE_HEIGHT * IMAGE_WIDTH };
+  // Resizes both frequencies of the slot's raw frames to numRawValues, within a capacity of MAX_RAW_FRAME_VALUES.
+  // Returns true if they were resized.
+  virtual bool resizeRawFrames(uint32_t slot, std::size_t numRawValues);
+  virtual void clearRawFrames(uint32_t slot);
+  // Tap rotates and snr-votes the ROI held by _hdr into the slot's raw frames.
+  virtual void ingestRawRoi(uint32_t slot, bool doTapRotation, std::array<uint32_t,2> roiSize, uint32_t fovOffset);
+  // Points info at the slot's raw frames.
+  virtual void setRawFrames(LocalProcessFrameInfo &info, uint32_t slot);
+  /**
+   * @brief Copies the raw rows [rawRows[0], rawRows[1]) of the slot's raw frames into the streamed segment's own buffers,
+   * and points info at them, so that the FOV can still be ingested into while the segment is processed.
+   */
+  virtual void copyRawFrames(LocalProcessFrameInfo &info, uint32_t slot, std::array<std::size_t,2> rawRows);
+  // The size of the FrameArena buffers that receive the raw frames with the missing rows filled, or 0 if there are none.
+  virtual std::size_t getFilledRawFrameSize() const { return _fRawFrames[0][0].size(); }
 
 public:
   explicit RawToDepthV2_float(uint32_t fovIdx, uint32_t headerNum);
@@ -118,28 +272,210 @@ public:
   void shutdown() override;
   
   // Called once per received ROI.
-  void processRoi(const uint16_t* roi, uint32_t numBytes) override;
+  using RawToDepth::processRoi;
+  void processRoi(const RtdMetadata &mdat, const uint16_t* roi, uint32_t numBytes) override;
   // Called once when (RtdMetadata::frameCompleted() == true) to do whole-FOV processing.
   // This call is asynchronous and returns immediately.
   void processWholeFrame(std::function<void (std::shared_ptr<FovSegment>)> setFovSegment) override;
 
   // These overridden routines need to be implemented for the data buffers in the subclass.
-  void reset(const uint16_t *mdPtr, uint32_t mdBytes) override; ///< called when first-roi-in-frame is received.
-  bool bufferSizesChanged(RtdMetadata &mdat) override;
+  void reset(const RtdMetadata &mdat) override; ///< called when first-roi-in-frame is received.
+  bool bufferSizesChanged(const RtdMetadata &mdat) override;
+
+  static constexpr uint32_t MIN_TILE_ROWS { 16 }; ///< Enough rows for the largest smoothing, median and nearest-neighbor windows.
+  static constexpr uint32_t DEFAULT_TILE_ROWS { 64 };
+  /**
+   * @brief Sets the minimum number of output rows per band for the banded whole-frame stages. 0 disables banding.
+   * Values below MIN_TILE_ROWS are raised to MIN_TILE_ROWS. Takes effect on the next frame.
+   */
+  static void setTileRows(uint32_t tileRows);
+  static uint32_t getTileRows() { return _tileRows.load(std::memory_order_relaxed); }
+  /**
+   * @brief Enables skipping the whole-frame stages on the output rows that no ROI of the frame covered, and that are
+   * farther than the filter halos from any that did. Their outputs are zero either way, so sparse scan patterns get
+   * cheaper without changing the output. Enabled by default. Takes effect on the next frame.
+   */
+  static void setSkipInactiveRows(bool skip) { _skipInactiveRows.store(skip, std::memory_order_relaxed); }
+  static bool getSkipInactiveRows() { return _skipInactiveRows.load(std::memory_order_relaxed); }
+
+  static constexpr uint32_t MAX_NUM_WORKERS { 8 };
+  static constexpr uint32_t DEFAULT_NUM_WORKERS { 2 }; ///< One per A72 core on the NCB.
+  /**
+   * @brief Sets the number of threads that process the bands of a whole frame, including the whole-frame thread itself.
+   * 1 processes the bands serially. The pool of helper threads is shared by all FOVs. Takes effect on the next frame.
+   */
+  static void setNumWorkers(uint32_t numWorkers);
+  static uint32_t getNumWorkers();
+
+  static constexpr uint32_t MAX_SCHEDULER_THREADS { 64 };
+  /**
+   * @brief Sets the number of threads of the FrameScheduler that processes the whole frames of all of the FOVs of all of
+   * the sensor heads, for RawToDepthV2_float objects constructed after this call. 0 (the default) gives each FOV a
+   * scheduler of its own with one thread. With the shared scheduler, frames run in parallel instead of their bands
+   * (see setNumWorkers()), so the number of threads is usually the number of processors in getDspCpus().
+   */
+  static void setSchedulerThreads(uint32_t numThreads);
+  static uint32_t getSchedulerThreads();
+  /**
+   * @brief Sets the priority of the whole frames of a sensor head on the shared scheduler (see FrameScheduler::setPriority()).
+   * The frames of the highest priority head that has any waiting run first; heads of equal priority take turns. The default is 0.
+   */
+  static void setHeadPriority(uint32_t headNum, int32_t priority);
+  /**
+   * @brief Sets the processors (see LumoAffinity) that the whole-frame threads, the shared scheduler and the band
+   * helpers run on, for the threads started after this call. Empty for no restriction. The default is both A72s.
+   */
+  static void setDspCpus(std::vector<int> cpus);
+  static std::vector<int> getDspCpus();
+
+  static constexpr uint32_t MIN_FRAME_QUEUE_DEPTH { 2 }; ///< One slot being ingested, one being processed.
+  static constexpr uint32_t MAX_FRAME_QUEUE_DEPTH { 8 };
+  static constexpr uint32_t DEFAULT_FRAME_QUEUE_DEPTH { 3 };
+  /**
+   * @brief Sets the number of frame slots (including the one being ingested) for RawToDepthV2_float objects
+   * constructed after this call. Clamped to [MIN_FRAME_QUEUE_DEPTH, MAX_FRAME_QUEUE_DEPTH].
+   */
+  static void setFrameQueueDepth(uint32_t depth);
+  static uint32_t getFrameQueueDepth() { return _frameQueueDepth.load(std::memory_order_relaxed); }
+  /**
+   * @brief Sets what happens when a frame completes while all of the frame slots are in use. Takes effect on the next frame.
+   */
+  static void setFrameQueuePolicy(FrameQueuePolicy policy) { _frameQueuePolicy.store(policy, std::memory_order_relaxed); }
+  static FrameQueuePolicy getFrameQueuePolicy() { return _frameQueuePolicy.load(std::memory_order_relaxed); }
+  FrameQueueStats getFrameQueueStats() const;
+
+  /**
+   * @brief Sets the minimum number of output rows per streamed segment for RawToDepthV2_float objects constructed
+   * after this call, or 0 (the default) to output each FOV once it is complete.
+   *
+   * When streaming, the output rows of an FOV are sent in segments (FovSegment::getFrameCompleted() == false) as soon
+   * as the ROIs received so far have settled them and the rows needed by the filters around them, and the last ROI
+   * completes the FOV with the remaining rows. processRoi() and processWholeFrame() only copy the raw rows of the
+   * window around each segment (timed as FAST_TIMER_RTD_FRAME_HANDOFF) and queue it, without waiting, for processing
+   * in order on the FOV's FrameScheduler. Since the segments of an FOV can then complete faster than they are fetched
+   * with RawToFovs::getData(), consumers should take them with RawToFovs::setFovCallback(). The frame queue isn't used,
+   * so its policy doesn't apply, and the segments queue up if their processing can't keep up with the ROIs.
+   * FOVs whose ROIs don't move down the FOV are sent whole when they complete.
+   */
+  static void setStreamRows(uint32_t streamRows) { _streamRowsDefault.store(streamRows, std::memory_order_relaxed); }
+  static uint32_t getStreamRows() { return _streamRowsDefault.load(std::memory_order_relaxed); }
+  void processReadyRows(std::function<void (std::shared_ptr<FovSegment>)> setFovSegment) override;
+  void restartFrame() override;
+
+  /**
+   * @brief Moves the tap rotation and snr-voting of the ROIs onto a thread of each FOV's own on the DSP processors
+   * (see getDspCpus()), for RawToDepthV2_float objects constructed after this call. Disabled by default.
+   *
+   * processRoi() then returns once the ROI is submitted to HDR, so that the ROI thread goes on to the other FOVs of the
+   * ROI, and to dequeueing and decoding the next ROI, while the ROI is ingested. The ingest is finished before the next
+   * ROI of the FOV, and before the frame is completed or streamed, so streamed FOVs (see setStreamRows()) gain little.
+   * The ROI's input buffer must stay valid until releaseRoi().
+   */
+  static void setAsyncIngest(bool asyncIngest) { _asyncIngest.store(asyncIngest, std::memory_order_relaxed); }
+  static bool getAsyncIngest() { return _asyncIngest.load(std::memory_order_relaxed); }
+  void releaseRoi(std::shared_ptr<const void> owner) override;
+  IngestStats getIngestStats() const;
 
 private:
-  void realloc(const uint16_t *mdPtr, uint32_t mdBytes);
-  static void processOneRoi(RawToDepthV2_float *inst, const uint16_t *roi, uint32_t numBytes);
-  std::future<void> _localProcessRoiFuture;
-  // RoiIndices is an FOV-sized buffer containing indices indicating which ROI was used to generate
-  // each pixel. These indices can be used to lookup the timestamp for each individual pixel.
-  static std::shared_ptr<std::vector<uint16_t>> getRoiIndices(std::vector<int32_t> &roiIndices, 
-                                                              std::array<uint16_t,2> fovStart, 
-                                                              std::array<uint16_t,2> fovStep, 
-                                                              std::array<uint16_t,2> fovSize, 
-                                                              std::array<uint32_t,2> size);
+  static void processOneRoi(RawToDepthV2_float *inst, const RtdMetadata &roiMdat, const uint16_t *roi, uint32_t numBytes);
+  // RoiIndexRows is a sensor-height buffer containing indices indicating which ROI was used to generate
+  // each row. These indices can be used to lookup the timestamp for each individual row.
+  static void getRoiIndexRows(std::vector<uint16_t> &roiIndexRowsFov,
+                              const std::vector<int32_t> &roiIndexRows,
+                              uint16_t fovStartRow,
+                              uint16_t fovStepRow,
+                              uint32_t numRows);
 
   static void localProcessFrame(std::shared_ptr<LocalProcessFrameInfo> info);
-  static void processWholeFrameEventLoop(std::shared_ptr<LocalProcessFrameInfo> infoPtr);
+
+  // Streaming of the output rows in segments, as the ROIs of the FOV arrive (see setStreamRows()).
+  const uint32_t _streamRows; ///< getStreamRows() at construction.
+  uint32_t _streamedRows = 0; ///< The output rows of the current FOV that have been sent so far.
+  uint32_t _streamRoiRow = 0; ///< The start row of the latest ROI, relative to the (pre-binned) FOV.
+  bool _streamInOrder = true; ///< False once an ROI of the current FOV started above the one before it.
+  std::shared_ptr<StreamQueue> _streamQueue; ///< nullptr when the FOVs aren't streamed.
+  uint32_t _streamSourceId = 0;              ///< The stream queue's source in _scheduler.
+  void removeStreamSource(); ///< Discards the segments that haven't started, and waits for the one being processed.
+
+  // Sampled capture of the DSP intermediates (see DspCapture). With HDR, the ROIs of the next frame start arriving
+  // before the frame is complete, so the snapshot whose ROIs are complete waits in _captureComplete.
+  std::unique_ptr<DspCapture> _dspCapture; ///< Created at the first frame that starts while the capture is enabled.
+  std::shared_ptr<DspSnapshot> _capture; ///< The snapshot that the received ROIs are added to, or nullptr.
+  std::shared_ptr<DspSnapshot> _captureComplete; ///< The snapshot of the frame being completed, or nullptr.
+  static uint32_t getStreamHalo(const WholeFrameConfig &config);
+  void processStreamRows(std::function<void (std::shared_ptr<FovSegment>)> setFovSegment, std::array<uint32_t,2> rows, bool lastRoiReceived);
+
+  /**
+   * @brief The rows of context that each banded whole-frame stage needs on either side of its output rows.
+   */
+  struct BandHalos
+  {
+    uint32_t smoothing = 0;
+    uint32_t median = 0;
+    uint32_t nearestNeighbor = 0;
+  };
+
+  /**
+   * @brief The full-frame inputs to the banded stages of whole-frame processing.
+   */
+  struct BandInput
+  {
+    const std::vector<float_t> *raw0;
+    const std::vector<float_t> *raw1;
+    const std::vector<float_t> *phase0;
+    const std::vector<float_t> *phase1;
+    DspSnapshot *capture; ///< Receives the smoothed phases of the output rows, or nullptr.
+  };
+
+  /**
+   * @brief The intermediate buffers for one band. All are allocated from the FrameArena.
+   *        The raw data of a band is held tap-planar: the three tap planes of the first frequency, then those
+   *        of the second (see RawToDepthDsp::deinterleaveTaps()), so that both frequencies are smoothed in one
+   *        pass and the phase and range stages use unit-stride vector loads.
+   */
+  struct BandBuffers
+  {
+    std::vector<float_t> *rawPlanes;
+    std::vector<float_t> *smoothedPlanes;
+    std::vector<float_t> *phase0;
+    std::vector<float_t> *phase1;
+    std::vector<float_t> *mFrame;
+    std::vector<float_t> *ranges;
+    std::vector<float_t> *medianRanges;
+    std::vector<float_t> *filteredRanges;
+  };
+
+  static BandHalos getBandHalos(uint32_t columnKernelIdx, bool performGhostMedian, uint16_t nearestNeighborFilterLevel);
+  static uint32_t getNumBands(uint32_t numRows, uint32_t tileRows);
+  static std::size_t getBandSize(std::array<uint32_t,2> size, uint32_t tileRows, BandHalos halos);
+  static uint32_t getNumBandBuffers(uint32_t numBands, const std::shared_ptr<WorkerPool> &workerPool);
+  static std::vector<std::size_t> getFrameArenaSizes(std::array<uint32_t,2> size, std::size_t rawFrameSize,
+                                                     uint32_t tileRows, BandHalos halos, uint32_t numBandBuffers);
+  static void processBand(const WholeFrameConfig &config, const BandInput &input, BandBuffers &band,
+                          std::array<uint32_t,2> outputRows, std::vector<float_t> &mFrame, std::vector<float_t> &fRanges);
+  static std::vector<std::array<uint32_t,2>> getLiveRows(const std::vector<bool> &activeRows, uint32_t prebinnedRows,
+                                                          uint32_t binningRows);
+  static std::vector<std::array<uint32_t,2>> expandRows(const std::vector<std::array<uint32_t,2>> &rows, uint32_t halo,
+                                                         uint32_t numRows);
+
+  static std::atomic<uint32_t> _tileRows;
+  static std::atomic<bool> _skipInactiveRows;
+  static std::atomic<uint32_t> _frameQueueDepth;
+  static std::atomic<uint32_t> _streamRowsDefault;
+  static std::atomic<bool> _asyncIngest;
+  static void ingestScheduledRoi(RawToDepthV2_float *inst, IngestQueue &queue);
+  static std::atomic<FrameQueuePolicy> _frameQueuePolicy;
+  static uint32_t enqueueFrame(FrameQueue &queue, uint32_t slot, FrameQueuePolicy policy, std::unique_lock<std::mutex> &lock);
+  static std::shared_ptr<WorkerPool> getWorkerPool();
+  static std::mutex _workerPoolMutex;
+  static uint32_t _numWorkers; ///< Guarded by _workerPoolMutex.
+  static std::shared_ptr<WorkerPool> _workerPool; ///< Created on first use. Guarded by _workerPoolMutex.
+  static std::shared_ptr<FrameScheduler> getScheduler();
+  static uint32_t _schedulerThreads; ///< Guarded by _workerPoolMutex.
+  static std::shared_ptr<FrameScheduler> _sharedScheduler; ///< Created on first use. Guarded by _workerPoolMutex.
+  static std::map<uint32_t, int32_t> _headPriorities; ///< Guarded by _workerPoolMutex.
+  static std::vector<int> _dspCpus; ///< Guarded by _workerPoolMutex.
+  static void processScheduledFrame(FrameQueue &queue);
+  static void processScheduledSegment(StreamQueue &queue);
 
 };
@@ -15,16 +15,58 @@
 #include "RawToDepthFactory.h"
 #include "RtdMetadata.h"
 #include "FovSegment.h"
+#include "LumoLogger.h"
+#include <algorithm>
+#include <chrono>
+
+std::mutex RawToFovs::_loadSheddingMutex;
+RawToFovs::LoadShedding RawToFovs::_loadShedding;
 
 RawToFovs::RawToFovs(uint32_t headerNum) : _headerNum(headerNum),
-                                           _newMappingTableAvailable(std::vector<bool>(MAX_ACTIVE_FOVS, false)),
-                                           _newMappingTableAvailableForRawStream(false),
-                                           _newPixelMaskAvailable(std::vector<bool>(MAX_ACTIVE_FOVS, false))
+                                           _newMappingTableAvailableForRawStream(false)
 {
   for (auto idx = 0; idx < MAX_ACTIVE_FOVS; idx++)
   {
     _rtds.push_back(nullptr);
-    _fovAvailable[idx] = false;
+  }
+  _fovAtBoundary.fill(true);
+
+  std::lock_guard lock(_loadSheddingMutex);
+  if (_loadShedding.enabled)
+  {
+    for (uint32_t idx = 0; idx < MAX_ACTIVE_FOVS; idx++)
+    {
+      auto config = _loadShedding.config;
+      const auto maxLevel = (_loadShedding.lowPriorityFovs & (1U << idx)) != 0 ? LoadShedder::SKIP_FRAMES : LoadShedder::CHEAP_SMOOTHING;
+      config.maxLevel = std::min(config.maxLevel, uint32_t(maxLevel));
+      _loadShedders[idx] = std::make_shared<LoadShedder>(headerNum, idx, config);
+    }
+  }
+}
+
+void RawToFovs::setLoadShedding(bool enable, const LoadShedder::Config &config, uint32_t lowPriorityFovs)
+{
+  std::lock_guard lock(_loadSheddingMutex);
+  _loadShedding.enabled = enable;
+  _loadShedding.config = config;
+  _loadShedding.lowPriorityFovs = lowPriorityFovs;
+}
+
+LoadShedder::Stats RawToFovs::getLoadSheddingStats(uint32_t fovIdx) const
+{
+  if (fovIdx >= MAX_ACTIVE_FOVS || !_loadShedders[fovIdx])
+  {
+    return {};
+  }
+  return _loadShedders[fovIdx]->getStats();
+}
+
+RawToFovs::~RawToFovs()
+{
+  stopCalibrationLoader();
+  for (auto &slot : _availableData)
+  {
+    delete slot.exchange(nullptr);
   }
 }
 
@@ -37,26 +79,42 @@ RawToFovs::RawToFovs(uint32_t headerNum) : _headerNum(headerNum),
  */
 std::shared_ptr<FovSegment> RawToFovs::getData(uint32_t fovIdx)
 {
-  if (!_fovAvailable[fovIdx])
+  std::unique_ptr<AvailableFov> available(_availableData[fovIdx].exchange(nullptr, std::memory_order_acquire));
+  if (nullptr == available)
   {
     return nullptr;
   }
 
-  bool newMappingTable = _newMappingTableAvailable[fovIdx];
-  _newMappingTableAvailable[fovIdx] = false;
-  
-  std::scoped_lock mutexLock(_mutex);
-  if (nullptr == _rtds[fovIdx]) 
+  available->fovSegment->setNewMappingTable(isNewMappingTable(fovIdx, available->mappingTableGeneration));
+  return std::move(available->fovSegment);
+}
+
+bool RawToFovs::isNewMappingTable(uint32_t fovIdx, uint32_t mappingTableGeneration)
+{
+  return _deliveredMappingTableGeneration[fovIdx].exchange(mappingTableGeneration, std::memory_order_relaxed) != mappingTableGeneration;
+}
+
+/**
+ * @brief The callback through which the RawToDepth objects hand in each completed FovSegment. Pushes it to the
+ * callback set with setFovCallback(), if any, or else holds it for getData(), replacing the FovSegment of the
+ * FOV that hasn't been retrieved yet.
+ * Called from the whole-frame processing threads, or from processRoi(), one at a time for each FOV.
+ *
+ * @param mappingTable The mapping table when the FOV was handed to whole-frame processing, and its generation.
+ */
+void RawToFovs::setFovSegment(uint32_t fovIdx, std::shared_ptr<FovSegment> fovSegment,
+                              const std::shared_ptr<MappingTable> &mappingTable, uint32_t mappingTableGeneration)
+{
+  fovSegment->setMappingTable(mappingTable);
+  if (!_fovCallback)
   {
-    return nullptr;
+    auto *available = new AvailableFov { std::move(fovSegment), mappingTableGeneration };
+    delete _availableData[fovIdx].exchange(available, std::memory_order_acq_rel);
+    return;
   }
 
-  auto pointCloudData = _availableData[fovIdx];
-  pointCloudData->setMappingTable(_mappingTable);
-  pointCloudData->setNewMappingTable(newMappingTable);
-  _fovAvailable[fovIdx] = false;
-  _availableData[fovIdx] = nullptr;
-  return pointCloudData;
+  fovSegment->setNewMappingTable(isNewMappingTable(fovIdx, mappingTableGeneration));
+  _fovCallback(fovIdx, std::move(fovSegment));
 }
 
 /**
@@ -70,13 +128,9 @@ std::vector<uint32_t> RawToFovs::fovsAvailable()
   std::vector<uint32_t> availableFovs;
   for (uint32_t idx = 0; idx < MAX_ACTIVE_FOVS; idx++)
   {
-    std::scoped_lock mutexLock(_mutex);
-    if (nullptr != _rtds[idx])
+    if (nullptr != _availableData[idx].load(std::memory_order_relaxed))
     {
-      if (_fovAvailable[idx])
-      {
-        availableFovs.push_back(idx);
-      }
+      availableFovs.push_back(idx);
     }
   }
   return availableFovs;
@@ -92,36 +146,255 @@ std::vector<uint32_t> RawToFovs::fovsAvailable()
  * @param roi The raw data as received from the sensor, containing a row of metadata followed
  * by raw sensor data.
  * @param numBytes The size of the buffer containing the data.
+ * @param captureNs The CLOCK_MONOTONIC time at which the ROI was captured, or 0 to not trace the latency
+ * of the FOVs it completes.
+ * @param timestamp The metadata timestamp of the ROI as decoded by RtdMetadata::scanRoi() on the capture thread, or 0 to
+ * decode it from the metadata.
+ * @param roiOwner Keeps roi valid until the FOVs are done ingesting it (see RawToDepthV2_float::setAsyncIngest()), or
+ * nullptr to be done with roi when the call returns.
  */
-void RawToFovs::processRoi(const uint16_t *roi, uint32_t numBytes)
+void RawToFovs::processRoi(const uint16_t *roi, uint32_t numBytes, uint64_t captureNs, uint64_t timestamp,
+                           std::shared_ptr<const void> roiOwner)
 {
 
   RtdMetadata mdat(roi, numBytes);
+  mdat.setTimestamp(timestamp);
+
+  if (_loader.loadedAvailable.load(std::memory_order_acquire))
+  {
+    std::shared_ptr<Calibration> loaded;
+    {
+      std::scoped_lock lock(_loader.mutex);
+      loaded = std::move(_loader.loaded);
+      _loader.loadedAvailable = false;
+    }
+    if (loaded != nullptr)
+    {
+      adoptCalibration(std::move(loaded));
+    }
+  }
 
   for (auto idx : mdat.getActiveFovs())
   {
+    createRtd(idx, mdat);
+
+    if (_fovAtBoundary[idx] && _fovCalibration[idx] != _calibration)
     {
-      std::scoped_lock mutexLock(_mutex);
-      RawToDepthFactory::create(_rtds, mdat, idx, _headerNum);
+      _fovCalibration[idx] = _calibration;
+      _rtds[idx]->setPixelMask(_calibration->pixelMask);
     }
+    _fovAtBoundary[idx] = false;
+    auto calibration = _fovCalibration[idx];
 
-    if (_newPixelMaskAvailable[idx])
+    if (_xyzOutput)
     {
-      _newPixelMaskAvailable[idx] = false;
-      std::scoped_lock mutexLock(_mutex);
-      _rtds[idx]->loadPixelMask(_pixelMaskFilepath);
+      _rtds[idx]->setXyzMappingTable(calibration->mappingTable);
     }
 
-    _rtds[idx]->processRoi(roi, numBytes);
+    _rtds[idx]->processRoi(mdat, roi, numBytes);
 
     if (_rtds[idx]->lastRoiReceived())
     {
-      _rtds[idx]->processWholeFrame([this, idx](std::shared_ptr<FovSegment> pointCloudData) 
-                                                { std::scoped_lock mutexLock(this->_mutex);
-                                                  this->_fovAvailable[idx] = true; 
-                                                  this->_availableData[idx] = pointCloudData; 
-                                                }); // returns immediately, async call
+      _fovAtBoundary[idx] = true;
+      FrameTrace trace;
+      if (captureNs != 0)
+      {
+        trace.stamp(TRACE_DQBUF, captureNs);
+        trace.stamp(TRACE_RTD_INGEST_DONE);
       }
+      _rtds[idx]->setFrameTrace(trace);
+      _rtds[idx]->processWholeFrame([this, idx, calibration](std::shared_ptr<FovSegment> pointCloudData)
+                                    { this->setFovSegment(idx, std::move(pointCloudData), calibration->mappingTable,
+                                                          calibration->generation);
+                                    }); // returns immediately, async call
+    }
+    else
+    {
+      // Streams the rows that are ready early, if enabled (see RawToDepthV2_float::setStreamRows()).
+      _rtds[idx]->processReadyRows([this, idx, calibration](std::shared_ptr<FovSegment> pointCloudData)
+                                   { this->setFovSegment(idx, std::move(pointCloudData), calibration->mappingTable,
+                                                         calibration->generation); });
+    }
+  }
+
+  // After all of the FOVs, so that they are ingested alongside each other even if the ROI's buffer isn't kept.
+  for (auto idx : mdat.getActiveFovs())
+  {
+    _rtds[idx]->releaseRoi(roiOwner);
+  }
+}
+
+void RawToFovs::createRtd(uint32_t fovIdx, const RtdMetadata &mdat)
+{
+  const auto *previousRtd = _rtds[fovIdx].get();
+  RawToDepthFactory::create(_rtds, mdat, fovIdx, _headerNum);
+  if (_rtds[fovIdx].get() != previousRtd)
+  {
+    _fovCalibration[fovIdx] = nullptr; // A new object starts out with the passthrough pixel mask.
+    _fovAtBoundary[fovIdx] = true;
+    _rtds[fovIdx]->setLoadShedder(_loadShedders[fovIdx]);
+  }
+}
+
+uint32_t RawToFovs::restartFrames()
+{
+  uint32_t restarted = 0;
+  for (uint32_t idx = 0; idx < MAX_ACTIVE_FOVS; idx++)
+  {
+    if (_rtds[idx] == nullptr || _fovAtBoundary[idx])
+    {
+      continue;
+    }
+    _rtds[idx]->restartFrame();
+    _fovAtBoundary[idx] = true;
+    restarted |= 1U << idx;
+  }
+  return restarted;
+}
+
+bool RawToFovs::prewarm(uint32_t fovMask)
+{
+  constexpr uint32_t roiRows { 8 };
+  constexpr uint32_t binning { 2 };
+  // Shared with the callbacks, which may still run if the wait times out.
+  struct Done
+  {
+    std::mutex mutex;
+    std::condition_variable conditionVariable;
+    uint32_t numFovs { 0 };
+  };
+  auto done = std::make_shared<Done>();
+
+  uint32_t numFovs = 0;
+  for (uint32_t idx = 0; idx < MAX_ACTIVE_FOVS; idx++)
+  {
+    if ((fovMask & (1U << idx)) == 0)
+    {
+      continue;
+    }
+    for (const auto &roi : RawToDepthFactory::makeSyntheticGridFov(idx, MAX_IMAGE_HEIGHT / roiRows, roiRows, binning))
+    {
+      const auto numBytes = uint32_t(roi.size() * sizeof(uint16_t));
+      RtdMetadata mdat(roi.data(), numBytes);
+      createRtd(idx, mdat);
+      _rtds[idx]->processRoi(mdat, roi.data(), numBytes);
+      _rtds[idx]->releaseRoi(nullptr);
+    }
+    _rtds[idx]->processWholeFrame([done](std::shared_ptr<FovSegment> /*fovSegment*/)
+                                  {
+                                    std::lock_guard lock(done->mutex);
+                                    done->numFovs++;
+                                    done->conditionVariable.notify_all();
+                                  });
+    numFovs++;
+  }
+
+  std::unique_lock lock(done->mutex);
+  if (!done->conditionVariable.wait_for(lock, std::chrono::milliseconds(PREWARM_TIMEOUT_MS),
+                                        [&done, numFovs] { return done->numFovs >= numFovs; }))
+  {
+    LLogErr("prewarm:head=" << _headerNum << ",fovs=" << numFovs << ",done=" << done->numFovs);
+    return false;
+  }
+  return true;
+}
+
+void RawToFovs::reloadCalibrationData(const std::string &mappingTableFilename, const std::string &pixelMaskFilename)
+{
+  adoptCalibration(loadCalibration(calibrationFilepaths(mappingTableFilename, pixelMaskFilename)));
+}
+
+void RawToFovs::reloadCalibrationDataAsync(const std::string &mappingTableFilename, const std::string &pixelMaskFilename)
+{
+  auto filepaths = calibrationFilepaths(mappingTableFilename, pixelMaskFilename);
+  if (_calibration->generation == 0)
+  {
+    adoptCalibration(loadCalibration(filepaths));
+    return;
+  }
+
+  {
+    std::scoped_lock lock(_loader.mutex);
+    if (!_loader.thread.joinable())
+    {
+      _loader.thread = std::thread(&RawToFovs::calibrationLoaderLoop, this);
+    }
+    _loader.request = std::move(filepaths);
+  }
+  _loader.conditionVariable.notify_one();
+}
+
+std::vector<std::string> RawToFovs::calibrationFilepaths(const std::string &mappingTableFilename,
+                                                         const std::string &pixelMaskFilename) const
+{
+  const static auto ABCD = std::string("ABCD");
+  auto mappingTableFilepath = mappingTableFilename;
+  if (mappingTableFilepath.empty())
+  {
+    mappingTableFilepath = std::string(MAPPING_TABLE_FILE_ROOT) + ABCD[_headerNum] + ".bin";
+  }
+
+  auto pixelMaskFilepath = pixelMaskFilename;
+  if (pixelMaskFilepath.empty())
+  {
+    pixelMaskFilepath = std::string(PIXEL_MASK_FILE_ROOT) + ABCD[_headerNum] + ".bin";
+  }
+  return { mappingTableFilepath, pixelMaskFilepath };
+}
+
+std::shared_ptr<RawToFovs::Calibration> RawToFovs::loadCalibration(const std::vector<std::string> &filepaths)
+{
+  auto calibration = std::make_shared<Calibration>();
+  calibration->mappingTable = MappingTable::load(filepaths[0]);
+  calibration->pixelMask = PixelMask::load(filepaths[1]);
+  return calibration;
+}
+
+void RawToFovs::adoptCalibration(std::shared_ptr<Calibration> calibration)
+{
+  // FOVs already handed to whole-frame processing keep the calibration data they were handed over with.
+  calibration->generation = _calibration->generation + 1;
+  _mappingTable = calibration->mappingTable;
+  _newMappingTableAvailableForRawStream = true;
+  _calibration = std::move(calibration);
+}
+
+/**
+ * @brief The loader thread of reloadCalibrationDataAsync(). Loads the latest requested calibration data and leaves it
+ * for processRoi() to adopt, until stopCalibrationLoader().
+ */
+void RawToFovs::calibrationLoaderLoop()
+{
+  std::unique_lock lock(_loader.mutex);
+  while (true)
+  {
+    _loader.conditionVariable.wait(lock, [this]() { return _loader.quitNow || !_loader.request.empty(); });
+    if (_loader.quitNow)
+    {
+      return;
+    }
+    auto filepaths = std::move(_loader.request);
+    _loader.request.clear();
+
+    lock.unlock();
+    auto calibration = loadCalibration(filepaths);
+    lock.lock();
+
+    _loader.loaded = std::move(calibration);
+    _loader.loadedAvailable.store(true, std::memory_order_release);
+  }
+}
+
+void RawToFovs::stopCalibrationLoader()
+{
+  {
+    std::scoped_lock lock(_loader.mutex);
+    _loader.quitNow = true;
+  }
+  _loader.conditionVariable.notify_one();
+  if (_loader.thread.joinable())
+  {
+    _loader.thread.join();
   }
 }
 
@@ -134,6 +407,7 @@ void RawToFovs::processRoi(const uint16_t *roi, uint32_t numBytes)
  */
 void RawToFovs::shutdown()
 {
+  stopCalibrationLoader();
   for (auto idx = 0; idx<_rtds.size(); idx++)
   {
     if (_rtds[idx] != nullptr)
@@ -13,31 +13,104 @@
 #include "FovSegment.h"
 #include "MappingTable.h"
 #include "RawToDepth.h"
+#include <array>
 #include <atomic>
 #include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
+/**
+ * @brief Routes the ROIs of one sensor head to the RawToDepth object of each of their FOVs, and hands the completed
+ *        FovSegments to the consumer.
+ *
+ * The RawToDepth objects and the calibration data belong to the thread that calls processRoi() and
+ * reloadCalibrationData(), so the ingest path takes no locks. Each FOV switches to new calibration data at its next
+ * FOV boundary, and the mapping table of an FOV travels with it to setFovSegment(). Completed FovSegments are delivered
+ * through a lock-free slot per FOV, which setFovSegment() fills from any thread and getData() empties from the consumer's.
+ *
+ * reloadCalibrationDataAsync() reads the calibration files on a loader thread instead, so that the ingest thread doesn't
+ * stall (and the driver doesn't drop ROIs) while they load.
+ */
 class RawToFovs
 {
  private:
   uint32_t _headerNum; ///< Which sensor is this object receiving data from
-  std::vector<std::unique_ptr<RawToDepth>> _rtds; ///< The RawToDepth objects, one per output FOV
-  std::shared_ptr<MappingTable> _mappingTable;    ///< The calibration mapping table, loaded with a call to reloadCalibrationTable()
-  std::vector<bool> _newMappingTableAvailable;    ///< Indicates that a new mapping table for the given fovIdx needs to get transmitted over the network.
+  std::vector<std::unique_ptr<RawToDepth>> _rtds; ///< The RawToDepth objects, one per output FOV. Ingest thread only.
+  ///< The mapping table and the pixel mask loaded together, shared by the FOVs (and the frames in flight) that use them.
+  struct Calibration
+  {
+    std::shared_ptr<MappingTable> mappingTable;
+    std::shared_ptr<const PixelMask> pixelMask { std::make_shared<const PixelMask>() };
+    uint32_t generation { 0 }; ///< Incremented by each reload.
+  };
+  std::shared_ptr<const Calibration> _calibration { std::make_shared<const Calibration>() }; ///< The latest. Ingest thread only.
+  std::shared_ptr<MappingTable> _mappingTable;    ///< The calibration mapping table, loaded with a call to reloadCalibrationTable(). Ingest thread only.
+  ///< The calibration data each FOV uses, switched to _calibration at its FOV boundaries. Ingest thread only.
+  std::array<std::shared_ptr<const Calibration>, MAX_ACTIVE_FOVS> _fovCalibration;
+  std::array<bool, MAX_ACTIVE_FOVS> _fovAtBoundary {}; ///< The last ROI of the FOV completed it (or none was received). Ingest thread only.
+  ///< The generation of the mapping table of the last FovSegment delivered for each fovIdx. A FovSegment with a later
+  ///< one indicates that its new mapping table needs to get transmitted over the network.
+  std::array<std::atomic<uint32_t>, MAX_ACTIVE_FOVS> _deliveredMappingTableGeneration {};
   bool _newMappingTableAvailableForRawStream;     ///< Indicates that a new mapping table needs to get transmitted for the raw data output
-  std::vector<bool> _newPixelMaskAvailable;       ///< Indicates that a new pixel mask is available for the given fovIdx
-  std::string _pixelMaskFilepath;                 ///< Indicates to each RawToDepth object where to load the pixel mask from.
-  ///< Each output FOV provides data for the downstream consumer, and it is stored here until overwritten by the next completed FOV
-  std::vector<std::shared_ptr<FovSegment>> _availableData = std::vector<std::shared_ptr<FovSegment>>(MAX_ACTIVE_FOVS, nullptr);
-  ///< Each entry indicates whether that fovIdx has output data (FovSegment) that has not yet been retrieved.
-  ///< Once the FovSegment has been retrieved by the consumer, then its indicator is set to false.
-  std::array<std::atomic_bool, MAX_ACTIVE_FOVS> _fovAvailable { false };
-  ///< Used to lock access to local variables from multiple threads.
-  std::mutex _mutex;
+
+  ///< The loader thread of reloadCalibrationDataAsync(), started with the first asynchronous reload.
+  struct CalibrationLoader
+  {
+    std::mutex mutex;
+    std::condition_variable conditionVariable;
+    std::vector<std::string> request;             ///< {mapping table path, pixel mask path}, or empty. Guarded by mutex.
+    std::shared_ptr<Calibration> loaded;         ///< Loaded but not yet adopted by processRoi(). Guarded by mutex.
+    std::atomic_bool loadedAvailable { false };   ///< loaded is set, so processRoi() only locks once per reload.
+    bool quitNow { false };                       ///< Guarded by mutex.
+    std::thread thread;
+  };
+  CalibrationLoader _loader;
+  bool _xyzOutput { false };                      ///< The FovSegments also carry XYZ points, computed with the mapping table.
+  struct AvailableFov
+  {
+    std::shared_ptr<FovSegment> fovSegment;
+    uint32_t mappingTableGeneration;
+  };
+  ///< Each output FOV provides data for the downstream consumer, and it is stored here until overwritten by the next
+  ///< completed FOV. A slot owns the FovSegment that hasn't been retrieved yet, or is nullptr.
+  std::array<std::atomic<AvailableFov*>, MAX_ACTIVE_FOVS> _availableData {};
+  ///< If set, receives each FovSegment as soon as it is complete, instead of holding it for getData().
+  std::function<void (uint32_t, std::shared_ptr<FovSegment>)> _fovCallback;
+  ///< The load shedder of each FOV, or nullptrs if load shedding is disabled. They outlive the RawToDepth objects, so
+  ///< that an FOV keeps its level when its object is recreated. Set in the constructor.
+  std::array<std::shared_ptr<LoadShedder>, MAX_ACTIVE_FOVS> _loadShedders;
+
+  struct LoadShedding
+  {
+    bool enabled { false };
+    LoadShedder::Config config;
+    uint32_t lowPriorityFovs { 0 };
+  };
+  static std::mutex _loadSheddingMutex;
+  static LoadShedding _loadShedding; ///< Guarded by _loadSheddingMutex.
+
+  void setFovSegment(uint32_t fovIdx, std::shared_ptr<FovSegment> fovSegment, const std::shared_ptr<MappingTable> &mappingTable,
+                     uint32_t mappingTableGeneration);
+  // Creates the RawToDepth object of the FOV for the metadata's scan mode, unless the current one fits. Ingest thread only.
+  void createRtd(uint32_t fovIdx, const RtdMetadata &mdat);
+  // Returns true for the first FovSegment of fovIdx delivered with the given mapping table. Called in delivery order.
+  bool isNewMappingTable(uint32_t fovIdx, uint32_t mappingTableGeneration);
+
+  std::vector<std::string> calibrationFilepaths(const std::string &mappingTableFilename, const std::string &pixelMaskFilename) const;
+  // Reads the calibration files. Called on the ingest thread by reloadCalibrationData(), or on the loader thread.
+  static std::shared_ptr<Calibration> loadCalibration(const std::vector<std::string> &filepaths);
+  // Makes the loaded calibration data the latest. The FOVs switch to it at their next FOV boundary.
+  void adoptCalibration(std::shared_ptr<Calibration> calibration);
+  void calibrationLoaderLoop();
+  void stopCalibrationLoader();
   
  public:
   explicit RawToFovs(uint32_t headerNum=0);
-  virtual ~RawToFovs()=default;
+  virtual ~RawToFovs();
 
   RawToFovs(RawToFovs &other) = delete;
   RawToFovs(RawToFovs &&other) = delete;
@@ -47,38 +120,78 @@ class RawToFovs
 
   ///< This call is (sometimes) asynchronous. The last ROI in a grid-mode frame starts a separate thread to perform whole-frame processing.
   ///< If this function is called, then RawToFovs::wait() must be called before destruction.
-  void processRoi(const uint16_t *roi, uint32_t numBytes);
+  ///< captureNs is the CLOCK_MONOTONIC time the ROI was captured; if non-zero, the FovSegments completed by this ROI carry a latency trace.
+  ///< timestamp is the metadata timestamp of the ROI if the caller already decoded it (see RtdMetadata::scanRoi()), or 0.
+  ///< roiOwner keeps the ROI's buffer valid while it is still being ingested (see RawToDepthV2_float::setAsyncIngest());
+  ///< if it is null, the ROI is done with when the call returns.
+  void processRoi(const uint16_t *roi, uint32_t numBytes, uint64_t captureNs = 0, uint64_t timestamp = 0,
+                  std::shared_ptr<const void> roiOwner = nullptr);
   std::vector<uint32_t> fovsAvailable();
   std::shared_ptr<FovSegment> getData(uint32_t fovIdx);
   virtual void shutdown();
 
-  std::shared_ptr<std::vector<int32_t>> getCalibrationX()     { return _mappingTable ? _mappingTable->getCalibrationX() : nullptr; }
-  std::shared_ptr<std::vector<int32_t>> getCalibrationY()     { return _mappingTable ? _mappingTable->getCalibrationY() : nullptr; }
-  std::shared_ptr<std::vector<int32_t>> getCalibrationTheta() { return _mappingTable ? _mappingTable->getCalibrationTheta() : nullptr; }
-  std::shared_ptr<std::vector<int32_t>> getCalibrationPhi()   { return _mappingTable ? _mappingTable->getCalibrationPhi() : nullptr; }
+  /**
+   * @brief Pushes each FovSegment to callback(fovIdx, fovSegment) as soon as it is complete, rather than holding it
+   * until fovsAvailable() and getData() are polled after the next ROI. The callback runs on the thread that completed
+   * the FovSegment (a whole-frame processing thread, or the caller of processRoi()), so it may be called from several
+   * threads at once and should only hand the data on. Call before the first ROI.
+   */
+  void setFovCallback(std::function<void (uint32_t fovIdx, std::shared_ptr<FovSegment> fovSegment)> callback) { _fovCallback = std::move(callback); }
+
+  ///< Enables the XYZ points of the FovSegments (FovSegment::getXyz()). Call before the first ROI.
+  void setXyzOutput(bool enable) { _xyzOutput = enable; }
+
+  static constexpr uint32_t PREWARM_TIMEOUT_MS { 5000 };
+  /**
+   * @brief Processes a synthetic grid-mode FOV of the largest size through each FOV whose bit is set in fovMask, and
+   * discards the output, so that their RawToDepth objects, frame buffers, output pools and whole-frame threads are
+   * allocated and paged in before the first ROI, rather than while the first FOVs are streaming. Called on the thread
+   * that calls processRoi(), before the first ROI.
+   *
+   * @return false if an FOV didn't finish its frame within PREWARM_TIMEOUT_MS.
+   */
+  bool prewarm(uint32_t fovMask);
+
+  /**
+   * @brief Discards the frames that FOVs are partway through, e.g. because the scan configuration changed while the
+   * sensor kept streaming, so that each of them starts over at the first ROI of its next frame rather than mixing the
+   * ROIs of both configurations. The FOVs at a frame boundary are left alone. Called on the thread that calls
+   * processRoi(), between ROIs.
+   *
+   * @return A bit per FOV that was restarted.
+   */
+  uint32_t restartFrames();
+
+  std::shared_ptr<const CalibrationPlane> getCalibrationX()     { return _mappingTable ? _mappingTable->getCalibrationX() : nullptr; }
+  std::shared_ptr<const CalibrationPlane> getCalibrationY()     { return _mappingTable ? _mappingTable->getCalibrationY() : nullptr; }
+  std::shared_ptr<const CalibrationPlane> getCalibrationTheta() { return _mappingTable ? _mappingTable->getCalibrationTheta() : nullptr; }
+  std::shared_ptr<const CalibrationPlane> getCalibrationPhi()   { return _mappingTable ? _mappingTable->getCalibrationPhi() : nullptr; }
 
   /**
-   * @brief Called by the user to indicate that the System Control software has provided a new mapping table
+   * @brief Called by the user to indicate that the System Control software has provided a new mapping table.
+   * Called on the thread that calls processRoi(), between ROIs. Reads the files before returning; see
+   * reloadCalibrationDataAsync() to keep streaming while they load.
    * 
    * @param mappingTableFilename Path on the local file system to the new mapping table
    * @param pixelMaskFilename Path on the local file system to the new pixel mask.
    */
-  void reloadCalibrationData(std::string mappingTableFilename = "", std::string pixelMaskFilename = "") {
-    const static auto ABCD = std::string("ABCD");
-    std::string mappingTableFilepath = mappingTableFilename;
-    
-    if (mappingTableFilepath.empty()) {
-      mappingTableFilepath = std::string(MAPPING_TABLE_FILE_ROOT) + ABCD[_headerNum] + ".bin";
-    }
-
-    _mappingTable = std::make_shared<MappingTable>(mappingTableFilepath);
-    _newMappingTableAvailable = std::vector<bool>(MAX_ACTIVE_FOVS, true);
-    _newMappingTableAvailableForRawStream = true;
-
-    _pixelMaskFilepath = pixelMaskFilename;
-    if (_pixelMaskFilepath.empty()) {
-      _pixelMaskFilepath = std::string(PIXEL_MASK_FILE_ROOT) + ABCD[_headerNum] + ".bin";
-    }
-    _newPixelMaskAvailable = std::vector<bool>(MAX_ACTIVE_FOVS, true);
-  }
+  void reloadCalibrationData(const std::string &mappingTableFilename = "", const std::string &pixelMaskFilename = "");
+
+  /**
+   * @brief Like reloadCalibrationData(), but reads the files on a background thread and returns immediately.
+   * processRoi() picks up the new calibration data once it is loaded, and each FOV switches to it at its next FOV
+   * boundary. A reload requested while another one is loading replaces it if it hasn't started yet.
+   * The first reload is synchronous, so that no FOV is output without calibration data.
+   */
+  void reloadCalibrationDataAsync(const std::string &mappingTableFilename = "", const std::string &pixelMaskFilename = "");
+
+  /**
+   * @brief Enables load shedding for the RawToFovs objects constructed after this call: while the whole-frame
+   * processing of a grid-mode FOV can't keep up with its frame rate, its filters are degraded in steps, and restored
+   * once there is headroom again (see LoadShedder). The last step, skipping frames, is only taken for the FOVs
+   * whose bit is set in lowPriorityFovs. Disabled by default.
+   */
+  static void setLoadShedding(bool enable, const LoadShedder::Config &config = {}, uint32_t lowPriorityFovs = 0);
+  ///< The load shedding state of an FOV, from any thread. All zeros if load shedding is disabled.
+  LoadShedder::Stats getLoadSheddingStats(uint32_t fovIdx) const;
 };
@@ -8,31 +8,49 @@
 
 #include "RtdMetadata.h"
 #include "GPixel.h"
+#include <algorithm>
 #include <iostream>
 #include <cassert>
 
 /**
- * @brief This constructor takes the pointer (caller still owns the pointer).
+ * @brief Decodes the metadata from the input buffer (the caller still owns the buffer).
  * 
  * @param rawData Actual pointer from the driver
  * @param numBytes Number of bytes in the input buffer
  */
-RtdMetadata::RtdMetadata(const uint16_t* rawData, uint32_t numBytes) :
-  _metadataPtr(rawData)
+RtdMetadata::RtdMetadata(const uint16_t* rawData, uint32_t numBytes)
 {
   assert(numBytes >= sizeof(Metadata_t));
+  decode(rawData, numBytes);
 }
 
 /**
- * @brief This constructor takes a copy of the input data.
+ * @brief Decodes the metadata from the input data.
  * 
  * @param rawData Contains at least the first row of the raw input ROI.
  */
-RtdMetadata::RtdMetadata(const std::vector<uint16_t> &rawData) :
-  _metadataBlock(rawData.data(), rawData.data()+sizeof(Metadata_t)) // Takes a copy
+RtdMetadata::RtdMetadata(const std::vector<uint16_t> &rawData)
 {
   assert(rawData.size()*sizeof(uint16_t) >= sizeof(Metadata_t)); 
-  _metadataPtr = _metadataBlock.data();
+  decode(rawData.data(), uint32_t(rawData.size()*sizeof(uint16_t)));
+}
+
+/**
+ * @brief Shifts each metadata word down to its 12-bit value. The loop has no dependencies between words,
+ * so the compiler vectorizes it. Words beyond the end of a short input buffer are left at zero.
+ */
+void RtdMetadata::decode(const uint16_t *rawData, uint32_t numBytes)
+{
+  if (nullptr == rawData)
+  {
+    return;
+  }
+  const auto numWords = std::min(uint32_t(sizeof(Metadata_t)), numBytes) / uint32_t(sizeof(uint16_t));
+  auto *decoded = reinterpret_cast<uint16_t*>(&_md);
+  for (uint32_t idx=0; idx<numWords; idx++)
+  {
+    decoded[idx] = uint16_t(rawData[idx] >> MD_SHIFT);
+  }
 }
 
 // 
@@ -51,10 +69,9 @@ int16_t RtdMetadata::s16(uint16_t valA, uint16_t valB)
   return retVal; 
 }
 
-std::vector<uint16_t> RtdMetadata::getActiveFovs()
+ActiveFovs RtdMetadata::getActiveFovs() const
 {
-  auto activeFovs = std::vector<uint16_t>();
-  activeFovs.reserve(MAX_ACTIVE_FOVS);
+  ActiveFovs activeFovs;
   for (auto fovIdx=0; fovIdx<MAX_ACTIVE_FOVS; fovIdx++)
   {
     if (getIsFovActive(fovIdx))
@@ -70,7 +87,7 @@ std::vector<uint16_t> RtdMetadata::getActiveFovs()
  * 
  * @return std::vector<uint32_t> A 3-element timestamp.
  */
-std::vector<uint32_t> RtdMetadata::getTimestamps() 
+std::vector<uint32_t> RtdMetadata::getTimestamps() const
 {
   const uint32_t val0 = uint32_t(getmd(timestamp0)) | uint32_t(getmd(timestamp1) << 12U) | uint32_t( (getmd(timestamp2) & 0xffU) << 24U );
   const uint32_t val1 = uint32_t(getmd(timestamp2) >> 8U) | uint32_t(getmd(timestamp3) << 4U) | uint32_t(getmd(timestamp4) << 16U) | uint32_t((getmd(timestamp5) & 0xfU) << 28U);
@@ -79,7 +96,7 @@ std::vector<uint32_t> RtdMetadata::getTimestamps()
 }
 
 
-float_t RtdMetadata::getSnrThresh(uint32_t fovIdx) 
+float_t RtdMetadata::getSnrThresh(uint32_t fovIdx) const
 { 
   const float_t snrThresh = float(getsmd(snrThresh, fovIdx)) / 8.0F; 
   return snrThresh;
@@ -91,7 +108,7 @@ float_t RtdMetadata::getSnrThresh(uint32_t fovIdx)
  * @brief Computes the number of 16-bit elements in an input ROI
  * 
  */
-uint32_t RtdMetadata::getRoiNumElements() 
+uint32_t RtdMetadata::getRoiNumElements() const
 { 
   return  MD_ROW_SHORTS + getRoiNumRows() * getRoiNumColumns() * NUM_GPIXEL_PHASES * NUM_GPIXEL_FREQUENCIES * (getDoTapAccumulation() ? NUM_GPIXEL_PERMUTATIONS : 1) ;
 }
@@ -102,7 +119,7 @@ uint32_t RtdMetadata::getRoiNumElements()
  * @param fovIdx The virtual sensor (output FOV) to apply this filter to
  * @return uint16_t The nearest neighbor filter level indicated by the metadata.
  */
-uint16_t RtdMetadata::getNearestNeighborFilterLevel(uint32_t fovIdx) 
+uint16_t RtdMetadata::getNearestNeighborFilterLevel(uint32_t fovIdx) const
 { 
   auto val = getDisableRangeMasking(fovIdx) ? 0 : getsmd(nearestNeighborLevel, fovIdx); 
   if (val > MAX_NEAREST_NEIGHBOR_IDX)
@@ -112,7 +129,7 @@ uint16_t RtdMetadata::getNearestNeighborFilterLevel(uint32_t fovIdx)
   return val;
 }
 
-float_t RtdMetadata::getMaxUnambiguousRange() 
+float_t RtdMetadata::getMaxUnambiguousRange() const
 { 
   const float_t mur = 0.5F * C_MPS/(float_t)GPixel::getGcf(getF0ModulationIndex(), getF1ModulationIndex()); 
   return mur; 
@@ -126,7 +143,7 @@ float_t RtdMetadata::getMaxUnambiguousRange()
  *        The input is an unsigned 12-bit value with a scale of 2^-19
  * @return float_t The gain required to calculate the ADC values from calibration.
  */
-float_t RtdMetadata::getAdcCalGain()
+float_t RtdMetadata::getAdcCalGain() const
 {
   const float_t adcCalGain = float_t(getmd(adc_cal_gain)) * pow(2.0F, -19.0F);
   return adcCalGain;
@@ -138,7 +155,7 @@ float_t RtdMetadata::getAdcCalGain()
  * 
  * @return float_t The offset required to calculate the ADC values from calibration.
  */
-float_t RtdMetadata::getAdcCalOffset()
+float_t RtdMetadata::getAdcCalOffset() const
 {
   uint16_t adcCalOffset = getmd(adc_cal_offset) << 4U; // move sign bit into msb of uint16_t
   int16_t adcCalOffset_signed = *(reinterpret_cast<int16_t*>(&adcCalOffset));
@@ -152,7 +169,7 @@ float_t RtdMetadata::getAdcCalOffset()
  * @param modIdx The higher frequency modulation index
  * @return float_t The offset in mm determined during range calibration.
  */
-float_t RtdMetadata::getRangeCalOffsetMm(int modIdx)
+float_t RtdMetadata::getRangeCalOffsetMm(int modIdx) const
 {
   uint16_t offsetLo;
   uint16_t offsetHi;
@@ -182,7 +199,7 @@ float_t RtdMetadata::getRangeCalOffsetMm(int modIdx)
  * @param modIdx The higher frequency modulation index
  * @return float_t The scale of the range cal in mm per volt
  */
-float_t RtdMetadata::getRangeCalMmPerVolt(int modIdx)
+float_t RtdMetadata::getRangeCalMmPerVolt(int modIdx) const
 {
   const float_t mmPerVScale = pow(2.0F, -12.0F);
   uint16_t mmPerVLo;
@@ -207,7 +224,7 @@ float_t RtdMetadata::getRangeCalMmPerVolt(int modIdx)
  * @param modIdx The higher frequency modulation index
  * @return float_t The scale of the range cal in mm per degree C
  */
-float_t RtdMetadata::getRangeCalMmPerCelsius(int modIdx)
+float_t RtdMetadata::getRangeCalMmPerCelsius(int modIdx) const
 {
   uint16_t mmPerCLo;
   uint16_t mmPerCHi;
@@ -338,7 +355,7 @@ uint16_t RtdMetadata::getSaturationThreshold() const {
 
 #define OUTPUT_LINE(message) std::cout << message << std::endl; /* NOLINT(bugprone-macro-parentheses) can't enclose a stream expression in parens */
 
-void RtdMetadata::printMetadata()
+void RtdMetadata::printMetadata() const
 {
 OUTPUT_METADATA
 }
@@ -346,7 +363,7 @@ OUTPUT_METADATA
 #undef OUTPUT_LINE
 #define OUTPUT_LINE(message) LLogInfo(message) 
 
-void RtdMetadata::logMetadata()
+void RtdMetadata::logMetadata() const
 {
 OUTPUT_METADATA
 }
@@ -398,3 +415,31 @@ void RtdMetadata::adjustTimestamp(uint8_t *ptr, uint64_t offset) {
     }
 }
 
+/**
+ * @brief Adjust the metadata time as adjustTimestamp() does, and read the ROI counter, the user tags and
+ * the adjusted timestamp in the same pass. Only these few words of the metadata row are touched, so the
+ * capture thread can check every ROI without constructing an RtdMetadata for it.
+ *
+ * param ptr Pointer to metadata
+ * param offset Time offset in seconds to convert FPGA time to UTC
+ *
+ * @return The fields read; the timestamp matches getTimestamp() of the adjusted metadata
+ */
+RoiScan RtdMetadata::scanRoi(uint8_t *ptr, uint64_t offset) {
+    const auto *mdp = (const struct Metadata_t *)ptr;
+    RoiScan scan;
+
+    scan.roiCounter = uint16_t(mdp->roiCounter >> MD_SHIFT);
+    for (uint32_t fovIdx = 0; fovIdx < MAX_ACTIVE_FOVS; fovIdx++) {
+        scan.userTags[fovIdx] = uint16_t(mdp->perFovMetadata[fovIdx].userTag >> MD_SHIFT);
+    }
+
+    adjustTimestamp(ptr, offset);
+    scan.timestamp = uint64_t(mdp->timestamp0 >> MD_SHIFT) +
+                     (uint64_t(mdp->timestamp1 >> MD_SHIFT) << MD_BITS) +
+                     (uint64_t(mdp->timestamp2 >> MD_SHIFT) << 2U*MD_BITS) +
+                     (uint64_t(mdp->timestamp3 >> MD_SHIFT) << 3U*MD_BITS) +
+                     (uint64_t(mdp->timestamp4 >> MD_SHIFT) << 4U*MD_BITS);
+    return scan;
+}
+
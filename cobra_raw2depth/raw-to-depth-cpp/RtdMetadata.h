@@ -68,6 +68,8 @@ constexpr uint16_t TRANSMIT_BITMASK_PHASE01    { 0x040U };
 constexpr uint16_t TRANSMIT_BITMASK_RAW_IMAGE  { 0x080U };
 constexpr uint16_t TRANSMIT_BITMASK_RAW_ROI    { 0x100U };
 constexpr uint16_t TRANSMIT_BITMASK_STATUS     { 0x200U };
+// The planes that RawToDepth outputs for an FOV when its transmitBitmask is 0. The range (and so its validity) is always output.
+constexpr uint16_t TRANSMIT_BITMASK_ALL_PLANES { TRANSMIT_BITMASK_RANGE | TRANSMIT_BITMASK_SNR | TRANSMIT_BITMASK_BACKGROUND | TRANSMIT_BITMASK_SIGNAL };
 
 
 // Bit definitions common to Grid and Stripe Modes
@@ -136,7 +138,7 @@ struct PerFovMetadata_t {
   uint16_t fovNumRois; ///< The number of ROIs used to generate the current FOV
   uint16_t rtdAlgorithmCommon; ///< Controls various processing options
   uint16_t snrThresh; ///< The SNR below which output range values are invalidated
-  uint16_t unused_08; 
+  uint16_t transmitBitmask; ///< The TRANSMIT_BITMASK_* planes to compute and send for this FOV, or 0 for all of them.
   uint16_t unused_09;
   uint16_t randomFovTag; ///< This tag is unique for each new FOV that arrives.
   uint16_t rtdAlgorithmGrid;
@@ -251,23 +253,59 @@ struct Metadata_t
   PerFovMetadata_t perFovMetadata[MAX_ACTIVE_FOVS]; /*!< The array of metadata applicable to each FOV */ //NOLINT(hicpp-avoid-c-arrays)
 };
 
-#define getmd(a) uint16_t((reinterpret_cast<const Metadata_t*>(_metadataPtr))->a>>MD_SHIFT)
-#define getsmd(a, idx) uint16_t((reinterpret_cast<const Metadata_t*>(_metadataPtr))->perFovMetadata[idx].a>>MD_SHIFT)
-#define getmda(a, idx) uint16_t((reinterpret_cast<const Metadata_t*>(_metadataPtr))->a[idx]>>MD_SHIFT)
+// The metadata words are decoded (shifted down to their 12-bit values) once, when the RtdMetadata is constructed.
+#define getmd(a) uint16_t(_md.a)
+#define getsmd(a, idx) uint16_t(_md.perFovMetadata[idx].a)
+#define getmda(a, idx) uint16_t(_md.a[idx])
+#include <array>
 #include <sstream>
 #include <string>
 #include <iomanip>
 #include <iostream>
 
+/**
+ * @brief The FOV IDs of the active FOVs of an ROI, in increasing order. A fixed-capacity collection,
+ * so that iterating over the active FOVs of each ROI doesn't allocate.
+ */
+class ActiveFovs {
+public:
+  void push_back(uint16_t fovIdx) { _fovs[_size++] = fovIdx; }
+  const uint16_t *begin() const { return _fovs.data(); }
+  const uint16_t *end() const { return _fovs.data() + _size; }
+  uint32_t size() const { return _size; }
+  bool empty() const { return 0 == _size; }
+  uint16_t operator[](uint32_t idx) const { return _fovs[idx]; }
+
+private:
+  std::array<uint16_t, MAX_ACTIVE_FOVS> _fovs {};
+  uint32_t _size = 0;
+};
+
+/**
+ * @brief The fields of an ROI's metadata that the capture thread checks for every ROI, read straight from
+ * the raw words by RtdMetadata::scanRoi() without decoding the rest of the metadata row.
+ */
+struct RoiScan
+{
+  uint16_t roiCounter { 0 };                          ///< See RtdMetadata::getRoiCounter()
+  std::array<uint16_t, MAX_ACTIVE_FOVS> userTags {};  ///< See RtdMetadata::getUserTag()
+  uint64_t timestamp { 0 };                           ///< See RtdMetadata::getTimestamp(), after the time offset is applied
+};
+
 /**
  * @brief RtdMetadata class contains the routines necessary for the computation of relevant parameters as 
  * well as getters for the metadata values.
  * 
+ * The metadata row is decoded into a copy held by the object when it is constructed, so the getters
+ * don't read the input buffer, and the object may outlive it. Construct one RtdMetadata per ROI and
+ * pass it by reference.
  */
 class RtdMetadata {
 private:
-  const uint16_t              *_metadataPtr;
-  const std::vector<uint16_t> _metadataBlock;
+  Metadata_t _md {}; ///< The metadata words, each shifted down by MD_SHIFT.
+  uint64_t _timestamp { 0 }; ///< The timestamp from scanRoi() if set by setTimestamp(), or 0 to decode it from _md.
+
+  void decode(const uint16_t *rawData, uint32_t numBytes);
   
 public:
   RtdMetadata(const uint16_t *rawData, uint32_t numBytes);
@@ -282,16 +320,16 @@ public:
   bool getStripeModeEnabled(uint32_t fovIdx) const { return 0 != (getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_STRIPE_MODE); }
   bool getGridModeEnabled(uint32_t fovIdx) const { return 0 == (getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_STRIPE_MODE); }
 
-  float_t getRangeCalOffsetMm(int modIdx);
-  float_t getRangeCalMmPerVolt(int modIdx);
-  float_t getRangeCalMmPerCelsius(int modIdx);
+  float_t getRangeCalOffsetMm(int modIdx) const;
+  float_t getRangeCalMmPerVolt(int modIdx) const;
+  float_t getRangeCalMmPerCelsius(int modIdx) const;
   
-  float_t getAdcCalGain();
-  float_t getAdcCalOffset();
+  float_t getAdcCalGain() const;
+  float_t getAdcCalOffset() const;
 
-  bool isM20() { return getmd(system_type) == SYSTEM_TYPE_M20 || getmd(system_type) == SYSTEM_TYPE_UNSPECIFIED; }
-  bool isM25() { return getmd(system_type) == SYSTEM_TYPE_M25; }
-  bool isM30() { return getmd(system_type) == SYSTEM_TYPE_M30; }
+  bool isM20() const { return getmd(system_type) == SYSTEM_TYPE_M20 || getmd(system_type) == SYSTEM_TYPE_UNSPECIFIED; }
+  bool isM25() const { return getmd(system_type) == SYSTEM_TYPE_M25; }
+  bool isM30() const { return getmd(system_type) == SYSTEM_TYPE_M30; }
   
   // Returns true if this is the last ROI in an FOV. Returns true unconditionally for stripe mode.
   bool getFrameCompleted(uint32_t fovIdx) const { return getStripeModeEnabled(fovIdx) || (getmda(startStopFlags, fovIdx) & START_STOP_FLAG_FRAME_COMPLETED) != 0; }
@@ -299,64 +337,80 @@ public:
   bool getFirstRoi(uint32_t fovIdx) const { return getStripeModeEnabled(fovIdx) || (getmda(startStopFlags, fovIdx) & START_STOP_FLAG_FIRST_ROI) != 0; }
   // Returns true if the CPU is to perform tap accumulation
   bool getDoTapAccumulation() const { return REDUCE_MODE_RTD == getmd(reduceMode); }
-  bool getDumpRawRoi(uint32_t fovIdx) { return getmda(startStopFlags, fovIdx) & START_STOP_FLAG_DUMP_RAW_ROI; }
+  bool getDumpRawRoi(uint32_t fovIdx) const { return getmda(startStopFlags, fovIdx) & START_STOP_FLAG_DUMP_RAW_ROI; }
   
-  bool getDisableStreaming() { return 0 != (getmd(disableStreaming) & DISABLE_STREAMING_MASK); }
-  uint16_t getNearestNeighborFilterLevel(uint32_t fovIdx);
-  uint16_t getNumPermutations() { return  getmd(reduceMode)==0 ? 3 : 1; } // Tap Accumulations occur on the FPGA.
+  bool getDisableStreaming() const { return 0 != (getmd(disableStreaming) & DISABLE_STREAMING_MASK); }
+  uint16_t getNearestNeighborFilterLevel(uint32_t fovIdx) const;
+  uint16_t getNumPermutations() const { return  getmd(reduceMode)==0 ? 3 : 1; } // Tap Accumulations occur on the FPGA.
   
-  uint16_t getSensorId() { return getmd(sensorId); }
-  uint16_t getSensorMode() { return getmd(sensorMode) & SENSOR_MODE_MASK; }
+  uint16_t getSensorId() const { return getmd(sensorId); }
+  uint16_t getSensorMode() const { return getmd(sensorMode) & SENSOR_MODE_MASK; }
   uint16_t getReduceMode() const { return getmd(reduceMode); }
   
    // Three uint format for timestamps in which all 94 bits are split between 3 32-bit unsigned ints.
-  std::vector<uint32_t> getTimestamps();
+  std::vector<uint32_t> getTimestamps() const;
   
   // 64-bit timestamp, that is the lower 60 bits of the 7 12-bit metadata values.
-  uint64_t getTimestamp() {
+  uint64_t getTimestamp() const {
+    if (_timestamp != 0)
+    {
+      return _timestamp;
+    }
     return uint64_t(getmd(timestamp0)) +
       (uint64_t(getmd(timestamp1))<<MD_BITS) +
       (uint64_t(getmd(timestamp2))<<2U*MD_BITS) +
       (uint64_t(getmd(timestamp3))<<3U*MD_BITS) +
       (uint64_t(getmd(timestamp4))<<4U*MD_BITS);
   }
+
+  // Supplies the timestamp already decoded by scanRoi() when the ROI was captured, so getTimestamp() doesn't decode it again.
+  void setTimestamp(uint64_t timestamp) { _timestamp = timestamp; }
+
+  // The timestamp in nanoseconds: bits 0-31 of the 94 bits are the nanoseconds and bits 32-93 the seconds (see getTimestamps()).
+  uint64_t getTimestampNs() const {
+    constexpr uint64_t NANOSECONDS_PER_SECOND { 1000000000ULL };
+    const uint64_t nsecs = uint64_t(getmd(timestamp0)) | (uint64_t(getmd(timestamp1)) << MD_BITS) | (uint64_t(getmd(timestamp2) & 0xffU) << 2U*MD_BITS);
+    const uint64_t secs = (uint64_t(getmd(timestamp2)) >> 8U) | (uint64_t(getmd(timestamp3)) << 4U) | (uint64_t(getmd(timestamp4)) << 16U) |
+                          (uint64_t(getmd(timestamp5)) << 28U) | (uint64_t(getmd(timestamp6)) << 40U);
+    return secs * NANOSECONDS_PER_SECOND + nsecs;
+  }
   
   // Returns the row on the sensor that matches the top row of the ROI
-  uint16_t getRoiStartRow() { return getmd(roiStartRow); }
+  uint16_t getRoiStartRow() const { return getmd(roiStartRow); }
   // Returns the column on the sensor that matches the left column of the ROI.
   static uint16_t getRoiStartColumn() { return ROI_START_COLUMN; }
   // Returns the number of rows in this ROI
-  uint16_t getRoiNumRows() { return getmd(roiNumRows); }
+  uint16_t getRoiNumRows() const { return getmd(roiNumRows); }
   // Returns the number of columns in this ROI
   static uint16_t getRoiNumColumns() { return IMAGE_WIDTH; }
   // Returns the number of 16-bit elements in this ROI
-  uint32_t getRoiNumElements();
+  uint32_t getRoiNumElements() const;
   
   // Returns the modulation index for the lower modulation frequency
-  uint16_t getF0ModulationIndex() { return getmd(f0ModulationIndex); }
+  uint16_t getF0ModulationIndex() const { return getmd(f0ModulationIndex); }
   // Returns the modulation index for the higher modulation frequency
-  uint16_t getF1ModulationIndex() { return getmd(f1ModulationIndex); }
-  uint16_t getNPulseF0() { return getmd(nPulseF0); }
-  uint16_t getNPulseF1() { return getmd(nPulseF1); }
-  uint16_t getInteBurstLenF0() { return getmd(inteBurstLenF0); }
-  uint16_t getInteBurstLenF1() { return getmd(inteBurstLenF1); }
-  uint16_t getRoiCounter() { return getmd(roiCounter); }
-  uint16_t getRoiId() { return getmd(roiId); }
+  uint16_t getF1ModulationIndex() const { return getmd(f1ModulationIndex); }
+  uint16_t getNPulseF0() const { return getmd(nPulseF0); }
+  uint16_t getNPulseF1() const { return getmd(nPulseF1); }
+  uint16_t getInteBurstLenF0() const { return getmd(inteBurstLenF0); }
+  uint16_t getInteBurstLenF1() const { return getmd(inteBurstLenF1); }
+  uint16_t getRoiCounter() const { return getmd(roiCounter); }
+  uint16_t getRoiId() const { return getmd(roiId); }
   // Returns the ADC value for one of the ADC on the sensor
-  uint16_t getAdc(uint32_t idx) { return getmda(adc, idx); }
-  float_t getMaxUnambiguousRange();
+  uint16_t getAdc(uint32_t idx) const { return getmda(adc, idx); }
+  float_t getMaxUnambiguousRange() const;
 
   // Returns the width of the output FOV after binning.
-  uint16_t getFullImageWidth(uint32_t fovIdx) { return IMAGE_WIDTH/getBinningX(fovIdx); } 
+  uint16_t getFullImageWidth(uint32_t fovIdx) const { return IMAGE_WIDTH/getBinningX(fovIdx); } 
   // Returns the height of the output FOV after binning.
-  uint16_t getFullImageHeight(uint32_t fovIdx) { return getsmd(fovNumRows, fovIdx)/getBinningY(fovIdx); }
+  uint16_t getFullImageHeight(uint32_t fovIdx) const { return getsmd(fovNumRows, fovIdx)/getBinningY(fovIdx); }
   // Returns the width of the full FOV before binning (the range of pixels read from the sensor)
   static uint16_t getInputImageWidth(uint32_t fovIdx) { return IMAGE_WIDTH; }
   // Returns the height of the full FOV before binning.
-  uint16_t getInputImageHeight(uint32_t fovIdx) { return getsmd(fovNumRows, fovIdx); }
+  uint16_t getInputImageHeight(uint32_t fovIdx) const { return getsmd(fovNumRows, fovIdx); }
   
   // Returns the number of modulation frequencies (only two modulation frequencies is supported)
-  uint16_t getNumModulationFrequencies() {
+  uint16_t getNumModulationFrequencies() const {
     switch(getSensorMode()) {
       case SENSOR_MODE_IMAGE:  return 0; // image
       case SENSOR_MODE_SMFD :  return 1; // smfd
@@ -365,72 +419,78 @@ public:
     }
   }
   // Returns the SNR threshold below which any output range value is set to invalid.
-  float_t getSnrThresh(uint32_t fovIdx);
+  float_t getSnrThresh(uint32_t fovIdx) const;
 
   // Per-stream metadata values
 
   // Returns the bitmask defining all of the FOVs this ROI will be processed into
-  uint16_t getActiveFovsBitmask() { return getmd(activeStreamBitmask); }
+  uint16_t getActiveFovsBitmask() const { return getmd(activeStreamBitmask); }
   // Given an fovIdx, returns true if this FOV will be processed into it.
-  bool getIsFovActive(uint32_t fovIdx) { return 0U != (uint32_t(getmd(activeStreamBitmask) >> fovIdx) & 0x01U); }
+  bool getIsFovActive(uint32_t fovIdx) const { return 0U != (uint32_t(getmd(activeStreamBitmask) >> fovIdx) & 0x01U); }
   // Return a collection containing all of the FOV IDs for active FOVs.
-  std::vector<uint16_t> getActiveFovs();
+  ActiveFovs getActiveFovs() const;
   // Returns the custom-defined user tag
-  uint16_t getUserTag(uint32_t fovIdx) { return getsmd(userTag, fovIdx); }
+  uint16_t getUserTag(uint32_t fovIdx) const { return getsmd(userTag, fovIdx); }
   // returns the metadata value that specifies binning (Only one binning dimension is binning is specified by the metadata)
-  uint16_t getBinModeX(uint32_t fovIdx) { return getsmd(binMode, fovIdx); }
+  uint16_t getBinModeX(uint32_t fovIdx) const { return getsmd(binMode, fovIdx); }
   // returns the metadata value that specifies binning (Only one binning dimension is binning is specified by the metadata)
-  uint16_t getBinModeY(uint32_t fovIdx) { return getsmd(binMode, fovIdx); } // Only binModX is specified in the metadata
+  uint16_t getBinModeY(uint32_t fovIdx) const { return getsmd(binMode, fovIdx); } // Only binModX is specified in the metadata
   // Returns the value expected for binning. Returns 1, 2, or 4. X and Y binning are identical.
-  uint16_t getBinningX(uint32_t fovIdx) { return getBinModeX(fovIdx)==0 ? 1 : getBinModeX(fovIdx); }
+  uint16_t getBinningX(uint32_t fovIdx) const { return getBinModeX(fovIdx)==0 ? 1 : getBinModeX(fovIdx); }
   // Returns the value expected for binning. Returns 1, 2, or 4. X and Y binning are identical
-  uint16_t getBinningY(uint32_t fovIdx) { return getBinModeX(fovIdx)==0 ? 1 : getBinModeX(fovIdx); }
+  uint16_t getBinningY(uint32_t fovIdx) const { return getBinModeX(fovIdx)==0 ? 1 : getBinModeX(fovIdx); }
   
   // Returns the starting row where the given input FOV starts on the sensor.
-  uint16_t getFovStartRow(uint32_t fovIdx) { return getsmd(fovRowStart, fovIdx); }
+  uint16_t getFovStartRow(uint32_t fovIdx) const { return getsmd(fovRowStart, fovIdx); }
   // Returns the starting column where the given input FOV starts on the sensor (FOV width is fixed, this is always zero.)
   static uint16_t getFovStartColumn(uint32_t fovIdx) { return ROI_START_COLUMN; }
   // Returns the number of rows in the given input FOV
-  uint16_t getFovNumRows(uint32_t fovIdx) { return getsmd(fovNumRows, fovIdx); }
+  uint16_t getFovNumRows(uint32_t fovIdx) const { return getsmd(fovNumRows, fovIdx); }
   // Returns the number of columns in the given input FOV (FOV width is fixed at 640)
   static uint16_t getFovNumColumns(uint32_t fovIdx) { return ROI_NUM_COLUMNS; }
   // Returns the number of ROIs that make up the given FOV
-  uint16_t getFovNumRois(uint32_t fovIdx) { return getStripeModeEnabled(fovIdx) ? 1 : getsmd(fovNumRois, fovIdx); }
+  uint16_t getFovNumRois(uint32_t fovIdx) const { return getStripeModeEnabled(fovIdx) ? 1 : getsmd(fovNumRois, fovIdx); }
   
   // Returns the start_stop_flags metadata word.
-  uint16_t getStartStopFlags(uint32_t fovIdx) { return getmda(startStopFlags, fovIdx); }
+  uint16_t getStartStopFlags(uint32_t fovIdx) const { return getmda(startStopFlags, fovIdx); }
   
   // Returns the algorithm enable/disable flags applicable to Grid and Stripe mode.
-  uint16_t getRtdAlgorithmCommon(uint32_t fovIdx) { return getsmd(rtdAlgorithmCommon, fovIdx); }
+  uint16_t getRtdAlgorithmCommon(uint32_t fovIdx) const { return getsmd(rtdAlgorithmCommon, fovIdx); }
   // Returns the algorithm enable/disable flags applicable to Grid mode.
-  uint16_t getRtdAlgorithmGrid(uint32_t fovIdx) { return getsmd(rtdAlgorithmGrid, fovIdx); }
+  uint16_t getRtdAlgorithmGrid(uint32_t fovIdx) const { return getsmd(rtdAlgorithmGrid, fovIdx); }
   // Returns the algorithm enable/disable flags applicable to Stripe mode.
-  uint16_t getRtdAlgorithmStripe(uint32_t fovIdx) { return getsmd(rtdAlgorithmStripe, fovIdx); }
+  uint16_t getRtdAlgorithmStripe(uint32_t fovIdx) const { return getsmd(rtdAlgorithmStripe, fovIdx); }
   // Returns true if phase smoothing is to be disabled.
-  bool getDisablePhaseSmoothing(uint32_t fovIdx) { return getsmd(rtdAlgorithmGrid, fovIdx) & RTD_ALG_GRID_DISABLE_CONVOLUTION; }
+  bool getDisablePhaseSmoothing(uint32_t fovIdx) const { return getsmd(rtdAlgorithmGrid, fovIdx) & RTD_ALG_GRID_DISABLE_CONVOLUTION; }
   // Return true if the median filter, as applied to the output range data, is to be enabled.
-  bool getPerformGhostMedianFilter(uint32_t fovIdx) { return getsmd(rtdAlgorithmGrid, fovIdx) & RTD_ALG_GRID_ENABLE_RANGE_MEDIAN; }
+  bool getPerformGhostMedianFilter(uint32_t fovIdx) const { return getsmd(rtdAlgorithmGrid, fovIdx) & RTD_ALG_GRID_ENABLE_RANGE_MEDIAN; }
   // Return true if the min-max filter (as applied to the intermediate value "M") is to be enabled.
-  bool getPerformGhostMinMaxFilter(uint32_t fovIdx) { return getsmd(rtdAlgorithmGrid, fovIdx) & RTD_ALG_GRID_ENABLE_MIN_MAX; }
+  bool getPerformGhostMinMaxFilter(uint32_t fovIdx) const { return getsmd(rtdAlgorithmGrid, fovIdx) & RTD_ALG_GRID_ENABLE_MIN_MAX; }
   // Return true if the range masking is to be disabled. This includes things like snrThresh, minMaxMask, pixelMask, etc.
-  bool getDisableRangeMasking(uint32_t fovIdx) { return getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_DISABLE_RANGE_MASKING; }
+  bool getDisableRangeMasking(uint32_t fovIdx) const { return getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_DISABLE_RANGE_MASKING; }
   // Return true if the output range values are to be adjusted due to the temperature of the sensor.
-  bool getEnableRangeTempRangeAdjustment(uint32_t fovIdx) { return getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_ENABLE_TEMP_RANGE_ADJ; }
+  bool getEnableRangeTempRangeAdjustment(uint32_t fovIdx) const { return getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_ENABLE_TEMP_RANGE_ADJ; }
   // Return true of RawToDepth algorithms should ignore the input data.
-  bool getDisableRtd(uint32_t fovIdx) { return getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_DISABLE_RTD; }
+  bool getDisableRtd(uint32_t fovIdx) const { return getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_DISABLE_RTD; }
   // Return true if the range should be limited to a fraction (RANGE_LIMIT_FRACTION) of the maximum unambiguous range.
-  bool getEnableMaxRangeLimit(uint32_t fovIdx) { return getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_ENABLE_MAX_RANGE_LIMIT; }
+  bool getEnableMaxRangeLimit(uint32_t fovIdx) const { return getsmd(rtdAlgorithmCommon, fovIdx) & RTD_ALG_COMMON_ENABLE_MAX_RANGE_LIMIT; }
+  // Returns the TRANSMIT_BITMASK_* planes to output for the FOV: those in transmitBitmask plus the range, or all of them if it is 0.
+  uint16_t getOutputPlanes(uint32_t fovIdx) const
+  {
+    const uint16_t planes = getsmd(transmitBitmask, fovIdx) & TRANSMIT_BITMASK_ALL_PLANES;
+    return planes == 0 ? TRANSMIT_BITMASK_ALL_PLANES : uint16_t(planes | TRANSMIT_BITMASK_RANGE);
+  }
 
   // Stripe mode. When collapsing the ROI into a single stripe, sum each column weighted by its SNR.
-  bool getStripeModeSnrWeightedSum(uint32_t fovIdx) { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_SNR_WEIGHTED_SUM) != 0; }
+  bool getStripeModeSnrWeightedSum(uint32_t fovIdx) const { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_SNR_WEIGHTED_SUM) != 0; }
   // Stripe mode. When collapsing the ROI into a single stripe, take the average value of each column
-  bool getStripeModeRectSum(uint32_t fovIdx) { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_RECT_SUM) != 0; }
+  bool getStripeModeRectSum(uint32_t fovIdx) const { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_RECT_SUM) != 0; }
   // Stripe mode. When collapsing the ROI into a single stripe, weight each columh by a Gaussian window.
-  bool getStripeModeGaussianSum(uint32_t fovIdx) { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_GAUSSIAN_SUM) != 0; }
+  bool getStripeModeGaussianSum(uint32_t fovIdx) const { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_GAUSSIAN_SUM) != 0; }
   // Stripe mode. Turn on a 1D median filter on the output range values.
-  bool getStripeModeEnableRangeMedian(uint32_t fovIdx) { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_ENABLE_MIN_MAX) != 0; }
+  bool getStripeModeEnableRangeMedian(uint32_t fovIdx) const { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_ENABLE_MIN_MAX) != 0; }
   // Stripe mode. Turn on the stripe mode version of the min-max filter.
-  bool getStripeModeEnabledMinMax(uint32_t fovIdx) { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_ENABLE_MIN_MAX) != 0; }
+  bool getStripeModeEnabledMinMax(uint32_t fovIdx) const { return (getRtdAlgorithmStripe(fovIdx) & RTD_ALG_STRIPE_ENABLE_MIN_MAX) != 0; }
   
   
   // For HDR: return true if this ROI indicates that it has been retaken due to the previous ROI being saturated.
@@ -440,23 +500,25 @@ public:
   // For HDR: Returns the saturation threshold used when determining whether an ROI has been saturated.
   uint16_t getSaturationThreshold() const;
 
-  uint16_t getSystemType() { return getmd(system_type); }
-  uint16_t getRxPcbType()  { return getmd(rx_pcb_type); }
-  uint16_t getTxPcbType()  { return getmd(tx_pcb_type); }
-  uint16_t getLcmType()    { return getmd(lcm_type); }
-  uint16_t getScanTableTag() { return getmd(random_scan_table_tag); }
-  uint16_t getRandomFovTag(uint32_t fovIdx) { return getsmd(randomFovTag, fovIdx); }
+  uint16_t getSystemType() const { return getmd(system_type); }
+  uint16_t getRxPcbType() const { return getmd(rx_pcb_type); }
+  uint16_t getTxPcbType() const { return getmd(tx_pcb_type); }
+  uint16_t getLcmType() const { return getmd(lcm_type); }
+  uint16_t getScanTableTag() const { return getmd(random_scan_table_tag); }
+  uint16_t getRandomFovTag(uint32_t fovIdx) const { return getsmd(randomFovTag, fovIdx); }
 
   static uint16_t getRawPixelMask() { return RAW_PIXEL_MASK; }
   
   // Prints the metadata for this ROI to stdout
-  void printMetadata();
+  void printMetadata() const;
   // Prints the metadata for this ROI to the log
-  void logMetadata();
+  void logMetadata() const;
   static const std::vector<uint16_t> DEFAULT_METADATA;  
 
   // adds the offset (seconds) to the timestamp (mutates the metadata)
   static void adjustTimestamp(uint8_t *ptr, uint64_t offset);
+  // adds the offset (seconds) to the timestamp (mutates the metadata) and reads the fields the capture thread checks
+  static RoiScan scanRoi(uint8_t *ptr, uint64_t offset);
 };
 
 
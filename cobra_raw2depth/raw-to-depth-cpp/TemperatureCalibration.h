@@ -14,12 +14,16 @@
 #include <cstdint>
 #include <RtdMetadata.h>
 #include <algorithm>
+#include <array>
+#include <tuple>
+#include <vector>
 
 constexpr float_t MIN_VLDA_VOLTAGE { 10.0F };
 constexpr float_t MAX_VLDA_VOLTAGE { 25.0F };
 constexpr float_t TEMP_CELSIUS_DEFAULT { 25.0F };
 constexpr float_t M_PER_MM { 1.0e-3F };
 constexpr uint32_t DEFAULT_FIFO_LENGTH { 100 };
+constexpr uint32_t TEMP_LUT_SIZE { 16 }; // Thermistor readings whose temperature is remembered. Power of two.
 
 // Steinhart-Hart coefficients
 static const std::array<float_t, 4> coeffs {7.74757206e-04F, 2.88511686e-04F, -4.01680505e-06F, 3.36325480e-07F};
@@ -28,7 +32,10 @@ class TemperatureCalibration
 {
 public:
   enum TECHNIQUE {LATEST, MEAN, MEDIAN};
-  void setTechnique(TECHNIQUE technique) { _technique = technique; }
+  void setTechnique(TECHNIQUE technique) { _technique = technique; _dirty = true; }
+  // The range offset is only recomputed once the laser thermistor or VLDA reading (after the technique is applied) has
+  // moved by more than this many ADC codes since it was last computed. 0, the default, recomputes on any change.
+  void setAdcChangeThreshold(float_t codes) { _adcChangeThreshold = codes; }
 private:
 
   bool _disable = false; // set to true if M20, or any input metadata is inconsistent across the FOV.
@@ -82,20 +89,59 @@ private:
   std::vector<float_t> _laserThermMetadataValues;
   std::vector<float_t> _vldaMetadataValues;
 
+  // Temperature moves on a scale of seconds, so the readings rarely change between frames. compute() is skipped while
+  // the FIFOs are unchanged, and the conversion of the readings while they stay within _adcChangeThreshold.
+  bool _dirty = true;            // The FIFOs or the technique changed since the last compute().
+  bool _computed = false;        // _computedRangeOffsetMeters is that of _adcLaserThermMetadata and _vldaMetadataValue.
+  float_t _computedRangeOffsetMeters = 0.0F;
+  float_t _adcChangeThreshold = 0.0F;
+  uint32_t _numComputes = 0;
+
+  // The temperatures of the last few thermistor readings, indexed by the reading (a whole ADC code, unless averaged),
+  // so that a reading that flickers between neighbouring codes doesn't repeat the Steinhart-Hart evaluation.
+  struct TempLutEntry
+  {
+    float_t adcValue = NAN;      // NAN never matches, so the entry starts out empty.
+    float_t tempCelsius = 0.0F;
+  };
+  std::array<TempLutEntry, TEMP_LUT_SIZE> _tempLut {};
 
   static float_t steinhart_eq(float_t res)
   {
     const float_t squared = 2.0F;
     const float_t cubed = 3.0F;
     const float_t kToC = -273.15F;
+    const float_t logRes = log(res);
     float_t temp_k = 1.0F / (coeffs[0] +
-                   coeffs[1] * log(res) +
-                   coeffs[2] * pow(log(res), squared) +
-                   coeffs[3] * pow(log(res), cubed));
+                   coeffs[1] * logRes +
+                   coeffs[2] * pow(logRes, squared) +
+                   coeffs[3] * pow(logRes, cubed));
     float_t temp_c = temp_k + kToC;
     return temp_c;
   }
 
+  // steinhart_eq() of the thermistor resistance, through the LUT. Also sets _laserThermAdcVoltage and _laserThermRes.
+  float_t laserThermTemp(float_t adcValue)
+  {
+    _laserThermAdcVoltage = _adcCalGain * adcValue + _adcCalOffset;
+    _laserThermRes = (REF_RESISTANCE * _laserThermAdcVoltage) / (EXTERNAL_VREF - _laserThermAdcVoltage);
+    auto &entry = _tempLut[uint32_t(adcValue) % TEMP_LUT_SIZE];
+    if (entry.adcValue != adcValue)
+    {
+      entry.adcValue = adcValue;
+      entry.tempCelsius = steinhart_eq(_laserThermRes);
+    }
+    return entry.tempCelsius;
+  }
+
+  // Forgets the cached results, for when the calibration constants change.
+  void invalidate()
+  {
+    _dirty = true;
+    _computed = false;
+    _tempLut.fill(TempLutEntry());
+  }
+
   float_t getLaserThermAdcMetadataValue()
   {
     if (_technique == LATEST)
@@ -111,10 +157,10 @@ private:
       }
       return sum / float_t(_laserThermMetadataValues.size());
     }
-    auto laserThermValuesSorted = std::vector<float_t>(_laserThermMetadataValues.size());
-    std::copy(_laserThermMetadataValues.begin(), _laserThermMetadataValues.end(), laserThermValuesSorted.begin());
-    std::sort(laserThermValuesSorted.begin(), laserThermValuesSorted.end());
-    return laserThermValuesSorted[laserThermValuesSorted.size() / 2 ];
+    auto laserThermValuesSorted = _laserThermMetadataValues;
+    auto median = laserThermValuesSorted.begin() + std::ptrdiff_t(laserThermValuesSorted.size() / 2);
+    std::nth_element(laserThermValuesSorted.begin(), median, laserThermValuesSorted.end());
+    return *median;
 
   }
 
@@ -135,10 +181,10 @@ public:
       return sum / float_t(_vldaMetadataValues.size());
     }
 
-    auto vldaValuesSorted = std::vector<float_t>(_vldaMetadataValues.size());
-    std::copy(_vldaMetadataValues.begin(), _vldaMetadataValues.end(), vldaValuesSorted.begin());
-    std::sort(vldaValuesSorted.begin(), vldaValuesSorted.end());
-    return vldaValuesSorted[vldaValuesSorted.size() / 2 ];
+    auto vldaValuesSorted = _vldaMetadataValues;
+    auto median = vldaValuesSorted.begin() + std::ptrdiff_t(vldaValuesSorted.size() / 2);
+    std::nth_element(vldaValuesSorted.begin(), median, vldaValuesSorted.end());
+    return *median;
   }
 
 private:
@@ -152,18 +198,35 @@ private:
       return;
     }
 
-    _adcLaserThermMetadata = getLaserThermAdcMetadataValue(); //md.getAdc(LASER_THERM_ADC_IDX);
-    _vldaMetadataValue = getVldaMetadataValue(); //md.getAdc(VLDA_ADC_IDX) ;
+    if (_dirty)
+    {
+      _dirty = false;
+      const auto adcLaserThermMetadata = getLaserThermAdcMetadataValue(); //md.getAdc(LASER_THERM_ADC_IDX);
+      const auto vldaMetadataValue = getVldaMetadataValue(); //md.getAdc(VLDA_ADC_IDX) ;
+      if (!_computed ||
+          std::abs(adcLaserThermMetadata - _adcLaserThermMetadata) > _adcChangeThreshold ||
+          std::abs(vldaMetadataValue - _vldaMetadataValue) > _adcChangeThreshold)
+      {
+        _adcLaserThermMetadata = adcLaserThermMetadata;
+        _vldaMetadataValue = vldaMetadataValue;
+        _computedRangeOffsetMeters = computeRangeOffset();
+        _computed = true;
+        _numComputes++;
+      }
+    }
+    // Otherwise the inputs are unchanged, and so is the result, errors included.
+    _rangeOffsetTemperatureMeters = _computedRangeOffsetMeters;
+  }
 
-    _laserThermAdcVoltage = _adcCalGain * _adcLaserThermMetadata + _adcCalOffset;
-    _laserThermRes = (REF_RESISTANCE * _laserThermAdcVoltage) / (EXTERNAL_VREF - _laserThermAdcVoltage);
-    _tempCelsius = steinhart_eq(_laserThermRes);
+  // The range offset in meters for _adcLaserThermMetadata and _vldaMetadataValue, or 0 if they are out of range.
+  float_t computeRangeOffset()
+  {
+    _tempCelsius = laserThermTemp(_adcLaserThermMetadata);
 
     if (isnan(_tempCelsius))
     {
-      _rangeOffsetTemperatureMeters = 0.0F;
       LLogErr("Measured temperature resulted in an invalid result. Error on measured thermistor value. Temperature compensation is disabled.");
-      return;
+      return 0.0F;
     }
 
     _vldaAdcVoltage = _adcCalGain * _vldaMetadataValue + _adcCalOffset;
@@ -171,21 +234,19 @@ private:
 
     if (_vldaVoltage < MIN_VLDA_VOLTAGE || _vldaVoltage > MAX_VLDA_VOLTAGE)
     {
-      _rangeOffsetTemperatureMeters = 0.0F;
       LLogErr("Measured VLDA voltage for temperature compensation is " << _vldaVoltage << 
               ". This is outside accepted range of (" << MIN_VLDA_VOLTAGE << "," << MAX_VLDA_VOLTAGE << "). Temperature compensation is disabled.");
-      return;
+      return 0.0F;
     }
 
     _vldaRangeOffsetMm = _mmPerVolt*_vldaVoltage;
     _tempRangeOffsetMm = _mmPerCelsius*_tempCelsius;
     float_t rangeOffsetTemperatureMm = _fixedOffsetMm + _tempRangeOffsetMm - _vldaRangeOffsetMm;
-    _rangeOffsetTemperatureMeters = M_PER_MM * rangeOffsetTemperatureMm;
+    return M_PER_MM * rangeOffsetTemperatureMm;
   }
 
-
 public:
-  void setAdcValues(RtdMetadata &mdat, uint32_t fovIdx)
+  void setAdcValues(const RtdMetadata &mdat, uint32_t fovIdx)
   {    
     if (!mdat.getEnableRangeTempRangeAdjustment(fovIdx))
     {
@@ -195,6 +256,8 @@ public:
 
     if (mdat.getFirstRoi(fovIdx))
     {
+      const auto calibration = std::make_tuple(_adcCalGain, _adcCalOffset, _mmPerCelsius, _mmPerVolt, _fixedOffsetMm,
+                                               REF_RESISTANCE, EXTERNAL_VREF, VLDA_SCALE);
       if (mdat.isM20())
       {
         REF_RESISTANCE = M20_REF_RESISTANCE;
@@ -231,6 +294,12 @@ public:
         VLDA_ADC_IDX = M30_VLDA_ADC_IDX;
         LASER_THERM_ADC_IDX = M30_LASER_THERM_ADC_IDX;
       }
+
+      if (calibration != std::make_tuple(_adcCalGain, _adcCalOffset, _mmPerCelsius, _mmPerVolt, _fixedOffsetMm,
+                                         REF_RESISTANCE, EXTERNAL_VREF, VLDA_SCALE))
+      {
+        invalidate();
+      }
     }
     
     if (_disable) 
@@ -262,11 +331,20 @@ public:
     { // Initialize the ADC value buffers with the initial value on first call.
       _laserThermMetadataValues = std::vector<float_t>(_fifoLength, laserThermMetadataVal);
       _vldaMetadataValues = std::vector<float_t>(_fifoLength, vldaMetadataVal);
+      _dirty = true;
     }
     
     _fifoIndex++;
     _fifoIndex = _fifoIndex % _fifoLength;
 
+    // The selected reading can change whenever a value is replaced by a different one (the LATEST technique also
+    // moves to a new index, so any replacement counts there).
+    if (_technique == LATEST ||
+        _laserThermMetadataValues[_fifoIndex] != laserThermMetadataVal ||
+        _vldaMetadataValues[_fifoIndex] != vldaMetadataVal)
+    {
+      _dirty = true;
+    }
     _laserThermMetadataValues[_fifoIndex] = laserThermMetadataVal;
     _vldaMetadataValues[_fifoIndex] = vldaMetadataVal;
 
@@ -289,6 +367,7 @@ public:
   float_t getTempAdcValue() const { return _laserThermAdcVoltage; }
   uint16_t getTempMetadataValue() const { return uint16_t(roundf(_adcLaserThermMetadata)); }
   float_t getLaserThermRes() const { return _laserThermRes; }
+  uint32_t getNumComputes() const { return _numComputes; } ///< The number of times the range offset was recomputed.
   float_t getLaserTempCelsius() const { return _tempCelsius; }
 
   float_t getAdcCalGain() const { return _adcCalGain; }
@@ -9,198 +9,159 @@
  * 
  */
 #include "Binning.h"
-#include "FloatVectorPool.h"
 #include "GPixel.h"
 #include "RtdMetadata.h"
 #include "RawToDepthDsp.h"
+#include <algorithm>
 #include <cassert>
 
+namespace
+{
 /**
- * @brief The common routine called for 1-dimensional binning
- * 
- * @param rawRoi Raw data NUM_GPIXEL_PHASES (3) elements of length roiWidth
- * @param binnedRawRoi Raw data reduced by binning of size NUM_GPIXEL_PHASES * roiWidth/binX
- * @param roiWidth The width of the rawRoi input buffer in raw triplets.
- * @param binX The binning rate, either 1, 2, or 4
+ * @brief Sums n values pairwise: ((v0 + v1) + (v2 + v3)), so that the adds of independent values can be issued together.
+ *
+ * @param values The first value
+ * @param stride The distance between the values
  */
-void Binning::bin1xN(const std::vector<float_t> &rawRoi, std::vector<float_t> &binnedRawRoi, uint32_t roiWidth, uint32_t binX)
+template <uint32_t N>
+inline float_t pairwiseSum(const float_t *values, std::size_t stride)
 {
-  if (binX <= 1)
+  if constexpr (N == 1)
   {
-    bin1x1(rawRoi, binnedRawRoi, roiWidth);
-    return;
+    return values[0];
   }
-  if (binX == 2)
+  else
   {
-    bin1x2(rawRoi, binnedRawRoi, roiWidth);
-    return;
+    return pairwiseSum<N/2>(values, stride) + pairwiseSum<N/2>(values + N/2*stride, stride);
   }
-  if (binX == 4)
-  {
-    bin1x4(rawRoi, binnedRawRoi, roiWidth);
-    return;
-  }
-  LLogErr("Only binning of 1,2, or 4 are allowed.")
-  assert(false);
 }
+} // namespace
 
 /**
- * @brief Returns an identical copy of the input buffer.
- * 
- * @param rawRoi A NUM_GPIXEL_PHASES*roiWidth buffer of floats containing 3-element raw data.
- * @param binnedRawRoi An exact copy of the input. Must be the same size as the input. 
- * @param roiWidth The length of the input buffer in 3-word elements.
+ * @brief Bins one row of raw triplets, each binned triplet being the sum of BIN_X neighboring triplets.
+ *
+ * @param rawRow NUM_GPIXEL_PHASES*roiWidth floats containing 3-element raw data.
+ * @param binnedRow NUM_GPIXEL_PHASES*(roiWidth/BIN_X) floats for the binned data.
+ * @param roiWidth The width of rawRow in raw triplets.
  */
-void Binning::bin1x1(const std::vector<float_t> &rawRoi, std::vector<float_t> &binnedRawRoi, uint32_t roiWidth)
+template <uint32_t BIN_X>
+void Binning::binRow(const float_t *rawRow, float_t *binnedRow, uint32_t roiWidth)
 {
-  assert(rawRoi.size() == binnedRawRoi.size());
-  assert(rawRoi.size() == size_t(NUM_GPIXEL_PHASES*roiWidth));
-  std::copy(rawRoi.begin(), rawRoi.end(), binnedRawRoi.begin());
-}
-
-/**
- * @brief Bins the 1D input data by reducing it in size by 2.
- * Computes the average of neighboring pixels.
- * 
- * @param rawRoi A NUM_GPIXEL_PHASES*roiWidth buffer of floats containing 3-element raw data.
- * @param binnedRawRoi A NUM_GPIXEL_PHASES * roiWidth/2 buffer of floats containing the binned data.
- * @param roiWidth The length of rawRoi in raw triplets.
- */
-void Binning::bin1x2(const std::vector<float_t> &rawRoi, std::vector<float_t> &binnedRawRoi, uint32_t roiWidth)
-{
-  constexpr uint32_t binning=2;
-  constexpr float_t scale = 1.0F;
-  uint32_t binnedWidth = roiWidth / binning;
-
-  assert(rawRoi.size() == size_t(NUM_GPIXEL_PHASES*roiWidth));
-  assert(binnedRawRoi.size() == size_t(NUM_GPIXEL_PHASES * (roiWidth / binning)));
-
-  std::fill(binnedRawRoi.begin(), binnedRawRoi.end(), 0.0F);
-  for (uint32_t idx=0; idx<binnedWidth*NUM_GPIXEL_PHASES; idx+=NUM_GPIXEL_PHASES)
+  const auto binnedWidth = roiWidth / BIN_X;
+  if constexpr (BIN_X == 1)
   {
-    uint32_t binnedAIdx = idx;
-    uint32_t unbinnedAIdx = binning*idx;
-
-    assert(binnedAIdx+2U < binnedRawRoi.size());
-    assert(unbinnedAIdx+NUM_GPIXEL_PHASES+2U < rawRoi.size());
-    binnedRawRoi[binnedAIdx+0U] = (rawRoi[unbinnedAIdx+0U] + rawRoi[unbinnedAIdx+NUM_GPIXEL_PHASES+0U]) / scale;
-    binnedRawRoi[binnedAIdx+1U] = (rawRoi[unbinnedAIdx+1U] + rawRoi[unbinnedAIdx+NUM_GPIXEL_PHASES+1U]) / scale;
-    binnedRawRoi[binnedAIdx+2U] = (rawRoi[unbinnedAIdx+2U] + rawRoi[unbinnedAIdx+NUM_GPIXEL_PHASES+2U]) / scale;
+    std::copy(rawRow, rawRow + std::size_t(NUM_GPIXEL_PHASES)*binnedWidth, binnedRow);
+    return;
+  }
+  for (uint32_t col=0; col<binnedWidth; col++)
+  {
+    const auto *pixels = rawRow + std::size_t(NUM_GPIXEL_PHASES)*BIN_X*col;
+    binnedRow[NUM_GPIXEL_PHASES*col + 0] = pairwiseSum<BIN_X>(pixels + 0, NUM_GPIXEL_PHASES);
+    binnedRow[NUM_GPIXEL_PHASES*col + 1] = pairwiseSum<BIN_X>(pixels + 1, NUM_GPIXEL_PHASES);
+    binnedRow[NUM_GPIXEL_PHASES*col + 2] = pairwiseSum<BIN_X>(pixels + 2, NUM_GPIXEL_PHASES);
   }
 }
 
 /**
- * @brief Bins the 1D input data by 4.
- * Computes the average of the neighboring 4 pixels.
- * 
- * @param rawRoi A NUM_GPIXEL_PHASES*roiWidth buffer of floats containing 3-element raw data.
- * @param binnedRawRoi A buffer "div-4" smaller than the input buffer with each pixel being the average of four in rawRoi.
- * @param roiWidth The number of raw triplets in the rawRoi buffer.
+ * @brief Bins the 2D frame BIN_Y x BIN_X in a single pass, without an intermediate frame.
+ *
+ * @param frame A roiSize[0] x roiSize[1] frame of raw triplets.
+ * @param binnedFrame The binned frame, roiSize[0]/BIN_Y x roiSize[1]/BIN_X raw triplets.
+ * @param roiSize The height and width (in raw triplets) of the frame.
+ * @param rows The binned rows to write.
  */
-void Binning::bin1x4(const std::vector<float_t> &rawRoi, std::vector<float_t> &binnedRawRoi, uint32_t roiWidth)
+template <uint32_t BIN_Y, uint32_t BIN_X>
+void Binning::binFrame(const std::vector<float_t> &frame, std::vector<float_t> &binnedFrame, std::array<uint32_t,2> roiSize,
+                       std::array<uint32_t,2> rows)
 {
-  constexpr uint32_t binning=4;
-  constexpr float_t scale = 1.0F;
-  uint32_t binnedWidth = roiWidth/binning;
-
-  assert(rawRoi.size() == size_t(NUM_GPIXEL_PHASES*roiWidth));
-  assert(binnedRawRoi.size() == size_t(NUM_GPIXEL_PHASES * (roiWidth / binning)));
-
-  std::fill(binnedRawRoi.begin(), binnedRawRoi.end(), 0.0F);
-  for (uint32_t idx=0; idx<binnedWidth*NUM_GPIXEL_PHASES; idx+=NUM_GPIXEL_PHASES)
+  const std::array<uint32_t,2> binnedSize = { roiSize[0]/BIN_Y, roiSize[1]/BIN_X };
+  const auto rowPitch = std::size_t(NUM_GPIXEL_PHASES)*roiSize[1];
+  const auto binnedPitch = std::size_t(NUM_GPIXEL_PHASES)*binnedSize[1];
+  assert(frame.size() >= rowPitch*binnedSize[0]*BIN_Y); // odd-height ROIs might have extra rows.
+  assert(binnedFrame.size() >= binnedPitch*binnedSize[0]);
+  assert(roiSize[1] <= IMAGE_WIDTH);
+
+  // The sum of the BIN_Y rows of one binned row.
+  std::array<float_t, NUM_GPIXEL_PHASES*IMAGE_WIDTH> rowSum; // NOLINT(cppcoreguidelines-pro-type-member-init) written before it's read
+  for (uint32_t row=rows[0]; row<std::min(rows[1], binnedSize[0]); row++)
   {
-
-    uint32_t binnedAIdx = idx;
-    uint32_t unbinnedAIdx = binning*idx;
-    assert(binnedAIdx+2U < binnedRawRoi.size());
-    assert(unbinnedAIdx+3U*NUM_GPIXEL_PHASES+2U < rawRoi.size());
-    binnedRawRoi[binnedAIdx+0U] = (rawRoi[unbinnedAIdx+0U*NUM_GPIXEL_PHASES+0U] + 
-                                   rawRoi[unbinnedAIdx+1U*NUM_GPIXEL_PHASES+0U] + 
-                                   rawRoi[unbinnedAIdx+2U*NUM_GPIXEL_PHASES+0U] + 
-                                   rawRoi[unbinnedAIdx+3U*NUM_GPIXEL_PHASES+0U]) / scale;
-    binnedRawRoi[binnedAIdx+1U] = (rawRoi[unbinnedAIdx+0U*NUM_GPIXEL_PHASES+1U] + 
-                                   rawRoi[unbinnedAIdx+1U*NUM_GPIXEL_PHASES+1U] + 
-                                   rawRoi[unbinnedAIdx+2U*NUM_GPIXEL_PHASES+1U] + 
-                                   rawRoi[unbinnedAIdx+3U*NUM_GPIXEL_PHASES+1U]) / scale;
-    binnedRawRoi[binnedAIdx+2U] = (rawRoi[unbinnedAIdx+0U*NUM_GPIXEL_PHASES+2U] + 
-                                   rawRoi[unbinnedAIdx+1U*NUM_GPIXEL_PHASES+2U] + 
-                                   rawRoi[unbinnedAIdx+2U*NUM_GPIXEL_PHASES+2U] + 
-                                   rawRoi[unbinnedAIdx+3U*NUM_GPIXEL_PHASES+2U]) / scale;
-  }
-
-}
-
-// shift defaults to "1" allowing for 2bits of numerical growth plus one extra bit.
-void Binning::bin2x2(const std::vector<float_t> &frame, std::vector<float_t> &binnedFrame, std::array<uint32_t,2> roiSize, int32_t shift) { 
-  
-  auto binning=2;
-  const float_t factor = powf(2.0F, float_t(shift));
-  
-  std::vector<uint32_t> binnedSize { roiSize[0]/binning, roiSize[1]/binning }; // odd-height ROIs clip off the bottom row.
-  assert((uint32_t)frame.size() >= 3U*binnedSize[0]*binnedSize[1]*2U*2U); // odd-height ROIs might have an extra row.
-  assert((uint32_t)binnedFrame.size() == 3U * binnedSize[0]*binnedSize[1]);
-  for (uint32_t row=0; row<binnedSize[0]; row++) {
-    for (uint32_t col=0; col<binnedSize[1]; col++) {
-      float_t
-	    aSum  = frame[3*binning*col + 0*3 + 0 + (row*binning + 0)*3*roiSize[1]];
-      aSum += frame[3*binning*col + 1*3 + 0 + (row*binning + 0)*3*roiSize[1]];
-      aSum += frame[3*binning*col + 0*3 + 0 + (row*binning + 1)*3*roiSize[1]];
-      aSum += frame[3*binning*col + 1*3 + 0 + (row*binning + 1)*3*roiSize[1]];
-      
-      float_t
-	    bSum  = frame[3*binning*col + 0*3 + 1 + (row*binning + 0)*3*roiSize[1]];
-      bSum += frame[3*binning*col + 1*3 + 1 + (row*binning + 0)*3*roiSize[1]];
-      bSum += frame[3*binning*col + 0*3 + 1 + (row*binning + 1)*3*roiSize[1]];
-      bSum += frame[3*binning*col + 1*3 + 1 + (row*binning + 1)*3*roiSize[1]];
-      
-      float_t
-	    cSum  = frame[3*binning*col + 0*3 + 2 + (row*binning + 0)*3*roiSize[1]];
-      cSum += frame[3*binning*col + 1*3 + 2 + (row*binning + 0)*3*roiSize[1]];
-      cSum += frame[3*binning*col + 0*3 + 2 + (row*binning + 1)*3*roiSize[1]];
-      cSum += frame[3*binning*col + 1*3 + 2 + (row*binning + 1)*3*roiSize[1]];
-
-      aSum *= factor;
-      bSum *= factor;
-      cSum *= factor;
-      
-      binnedFrame[3*col + 0 + 3*binnedSize[1]*row] = float_t(aSum); 
-      binnedFrame[3*col + 1 + 3*binnedSize[1]*row] = float_t(bSum);
-      binnedFrame[3*col + 2 + 3*binnedSize[1]*row] = float_t(cSum);
+    const auto *rawRows = frame.data() + rowPitch*BIN_Y*row;
+    const float_t *summed = rawRows;
+    if constexpr (BIN_Y > 1)
+    {
+      for (std::size_t idx=0; idx<rowPitch; idx++)
+      {
+        rowSum[idx] = pairwiseSum<BIN_Y>(rawRows + idx, rowPitch);
+      }
+      summed = rowSum.data();
     }
+    binRow<BIN_X>(summed, binnedFrame.data() + binnedPitch*row, roiSize[1]);
   }
 }
 
-void Binning::bin4x4(const std::vector<float_t> &frame, std::vector<float_t> &binnedFrame, std::array<uint32_t,2> roiSize) {
-  SCOPED_VEC_F(binned2x2, NUM_GPIXEL_PHASES*roiSize[0]*roiSize[1]/4);
-  bin2x2(frame, binned2x2, roiSize, 0);
+template void Binning::binFrame<1,1>(const RtdVec &, RtdVec &, std::array<uint32_t,2>, std::array<uint32_t,2>);
+template void Binning::binFrame<2,2>(const RtdVec &, RtdVec &, std::array<uint32_t,2>, std::array<uint32_t,2>);
+template void Binning::binFrame<4,4>(const RtdVec &, RtdVec &, std::array<uint32_t,2>, std::array<uint32_t,2>);
+template void Binning::binRow<1>(const float_t *, float_t *, uint32_t);
+template void Binning::binRow<2>(const float_t *, float_t *, uint32_t);
+template void Binning::binRow<4>(const float_t *, float_t *, uint32_t);
 
-  bin2x2(binned2x2, binnedFrame, { roiSize[0]/2, roiSize[1]/2 }, 0); 
-  
+Binning::Kernel Binning::select(std::array<uint32_t,2> binning)
+{
+  if (binning[0] == 1 && binning[1] == 1)
+  {
+    return &binFrame<1,1>;
+  }
+  if (binning[0] == 2 && binning[1] == 2)
+  {
+    return &binFrame<2,2>;
+  }
+  if (binning[0] == 4 && binning[1] == 4)
+  {
+    return &binFrame<4,4>;
+  }
+  return nullptr;
 }
 
-void Binning::bin1x1(const std::vector<float_t> &frame, std::vector<float_t> &binnedFrame, std::array<uint32_t,2> roiSize) {
-  assert((uint32_t)frame.size() == 3*roiSize[0]*roiSize[1]);
-  assert(frame.size() == binnedFrame.size());
-  
-  for (uint32_t idx=0; idx<frame.size(); idx++) {
-    binnedFrame[idx] = frame[idx];
+void Binning::binMxN(const std::vector<float> &frame, std::vector<float> &binnedFrame, std::array<uint32_t,2> roiSize, std::array<uint32_t,2> binning,
+                     std::array<uint32_t,2> rows)
+{
+  auto kernel = select(binning);
+  if (kernel == nullptr)
+  {
+    LLogErr("MxN binning is not supported. Binning is set to " << binning[0] << "x" << binning[1]);
+    return;
   }
+  kernel(frame, binnedFrame, roiSize, rows);
 }
 
-void Binning::binMxN(const std::vector<float> &frame, std::vector<float> &binnedFrame, std::array<uint32_t,2> roiSize, std::array<uint32_t,2> binning) {
-  if (binning[0] == 1 && binning[1] == 1) {
-    bin1x1(frame, binnedFrame, roiSize);
+/**
+ * @brief The common routine called for 1-dimensional binning
+ * 
+ * @param rawRoi Raw data NUM_GPIXEL_PHASES (3) elements of length roiWidth
+ * @param binnedRawRoi Raw data reduced by binning of size NUM_GPIXEL_PHASES * roiWidth/binX
+ * @param roiWidth The width of the rawRoi input buffer in raw triplets.
+ * @param binX The binning rate, either 1, 2, or 4
+ */
+void Binning::bin1xN(const std::vector<float_t> &rawRoi, std::vector<float_t> &binnedRawRoi, uint32_t roiWidth, uint32_t binX)
+{
+  assert(rawRoi.size() >= size_t(NUM_GPIXEL_PHASES*roiWidth));
+  assert(binnedRawRoi.size() == size_t(NUM_GPIXEL_PHASES*(roiWidth/std::max(binX, 1U))));
+  if (binX <= 1)
+  {
+    binRow<1>(rawRoi.data(), binnedRawRoi.data(), roiWidth);
     return;
   }
-  if (binning[0] == 2 && binning[1] == 2) {
-    bin2x2(frame, binnedFrame, roiSize);
+  if (binX == 2)
+  {
+    binRow<2>(rawRoi.data(), binnedRawRoi.data(), roiWidth);
     return;
   }
-  if (binning[0] == 4 && binning[1] == 4) {
-    bin4x4(frame, binnedFrame, roiSize);
+  if (binX == 4)
+  {
+    binRow<4>(rawRoi.data(), binnedRawRoi.data(), roiWidth);
     return;
   }
-    
-  LLogErr("MxN binning is not supported. Binning is set to " << binning[0] << "x" << binning[1]);
+  LLogErr("Only binning of 1,2, or 4 are allowed.")
+  assert(false);
 }
-
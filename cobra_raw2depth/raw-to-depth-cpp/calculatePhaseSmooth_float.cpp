@@ -1,12 +1,15 @@
 /**
  * @file calculatePhaseSmooth_float.cpp
  * @brief Computes phase from smoothed raw data and performs phase correction using
- * 32-bit floating point operations on the CPU.
+ * 32-bit floating point operations on the CPU. computeWholeFrameRangePlanar() also
+ * unwraps the range of both frequencies in the same pass.
  * 
  * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
  * 
  */
 #include "RawToDepthDsp.h"
+#include "RawToDepthSimd.h"
+#include "RtdMetadata.h"
 #include <cassert>
 
 #define MAX_PHASE_ERROR 0.5F
@@ -20,62 +23,65 @@ void RawToDepthDsp::calculatePhaseSmooth(std::vector<float_t> &frameSmoothed,
   assert(3*phaseFrame.size() == frameSmoothed.size());
   assert(3*correctedPhaseFrame.size() == frameSmoothed.size());
 
-  for (uint32_t idx = 0; idx < phaseSmoothedFrame.size(); idx++) {
-    int aIdx = int(3 * idx);
-
+  // The SIMD kernel handles a multiple of the vector width. The remainder is processed here.
+  uint32_t idx = RawToDepthSimd::calculatePhaseSmooth(frameSmoothed.data(), phaseSmoothedFrame.data(), phaseFrame.data(),
+                                                      correctedPhaseFrame.data(), uint32_t(phaseSmoothedFrame.size()),
+                                                      MAX_PHASE_ERROR);
+  for (; idx < phaseSmoothedFrame.size(); idx++) {
+    auto aIdx = std::size_t(3 * idx);
     assert(aIdx+2 < frameSmoothed.size());
-    auto rawA = frameSmoothed[aIdx];
-    auto rawB = frameSmoothed[aIdx + 1];
-    auto rawC = frameSmoothed[aIdx + 2];
-    
-    const float_t oneThird =1.0F/3.0F;
-    const float_t twoThirds=2.0F/3.0F;;
-    
-    float_t frac = 0.0F;
-
-    if (rawA <= rawB && rawA <= rawC)
-    {
-      auto tmp = rawC;
-      rawC = rawA;
-      rawA = rawB;
-      rawB = tmp;
-      frac = oneThird;
-    }
+    smoothPhase(frameSmoothed[aIdx], frameSmoothed[aIdx + 1], frameSmoothed[aIdx + 2], phaseFrame[idx], MAX_PHASE_ERROR,
+                phaseSmoothedFrame[idx], correctedPhaseFrame[idx]);
+  }
+}
 
-    else if (rawB <= rawC && rawB < rawA)
-    {
-      auto tmp = rawA;
-      rawA = rawC;
-      rawC = rawB;
-      rawB = tmp;
-      frac = twoThirds;
-    }
+void RawToDepthDsp::computeWholeFrameRangePlanar(const std::vector<float_t> &smoothedPlanes,
+                                                 const std::vector<float_t> &phase0, const std::vector<float_t> &phase1,
+                                                 std::vector<float_t> &fRanges, const PhaseUnwrap &unwrap,
+                                                 std::vector<float_t> &mFrame)
+{
+  const auto numPixels = phase0.size();
+  assert(phase1.size() == numPixels);
+  assert(smoothedPlanes.size() >= 2 * NUM_GPIXEL_PHASES * numPixels);
+  assert(fRanges.size() >= numPixels);
+  assert(mFrame.size() >= numPixels);
 
-    float_t iPhaseSmoothed = 0;
-    float_t iPhase = 0;
-    auto signal = rawA + rawB - 2 * rawC;
-    if (signal > 0 )
-    {
-      float_t part1 = rawB-rawC; 
-      iPhaseSmoothed = oneThird*(part1 / signal) + frac;
-      iPhase = phaseFrame[idx];
-    }
+  const float_t *planes0 = smoothedPlanes.data();
+  const float_t *planes1 = smoothedPlanes.data() + NUM_GPIXEL_PHASES * numPixels;
+  std::size_t idx = RawToDepthSimd::computeWholeFrameRangePlanar(smoothedPlanes.data(), numPixels, phase0.data(), phase1.data(),
+                                                                 fRanges.data(), mFrame.data(), uint32_t(numPixels),
+                                                                 MAX_PHASE_ERROR, unwrap.fInt0, unwrap.fInt1,
+                                                                 unwrap.a, unwrap.c, unwrap.bias);
+  for (; idx < numPixels; idx++)
+  {
+    float_t phaseSmoothed0 = 0;
+    float_t correctedPhase0 = 0;
+    smoothPhase(planes0[idx], planes0[numPixels + idx], planes0[2 * numPixels + idx], phase0[idx], MAX_PHASE_ERROR,
+                phaseSmoothed0, correctedPhase0);
+    float_t phaseSmoothed1 = 0;
+    float_t correctedPhase1 = 0;
+    smoothPhase(planes1[idx], planes1[numPixels + idx], planes1[2 * numPixels + idx], phase1[idx], MAX_PHASE_ERROR,
+                phaseSmoothed1, correctedPhase1);
+    unwrapRange(unwrap, phaseSmoothed0, phaseSmoothed1, correctedPhase0, correctedPhase1, fRanges[idx], mFrame[idx]);
+  }
+}
 
-    assert(idx < phaseSmoothedFrame.size());
-    phaseSmoothedFrame[idx] = iPhaseSmoothed;
-      
-    // This last step is for phase correction
-    correctedPhaseFrame[idx] = iPhase;
+void RawToDepthDsp::smoothPhasePlanar(const std::vector<float_t> &smoothedPlanes,
+                                      const std::vector<float_t> &phase0, const std::vector<float_t> &phase1,
+                                      std::array<std::size_t,2> pixels, float_t *phaseSmoothed0, float_t *phaseSmoothed1)
+{
+  const auto numPixels = phase0.size();
+  assert(pixels[1] <= numPixels);
+  assert(smoothedPlanes.size() >= 2 * NUM_GPIXEL_PHASES * numPixels);
 
-    float_t phaseErr = iPhase - iPhaseSmoothed;
-    if (phaseErr > MAX_PHASE_ERROR) 
-    {
-      correctedPhaseFrame[idx] -= 1.0F;
-    }
-    if (phaseErr < -MAX_PHASE_ERROR) 
-    {
-      correctedPhaseFrame[idx] += 1.0F;
-    }
+  const float_t *planes0 = smoothedPlanes.data();
+  const float_t *planes1 = smoothedPlanes.data() + NUM_GPIXEL_PHASES * numPixels;
+  for (auto idx = pixels[0]; idx < pixels[1]; idx++)
+  {
+    float_t correctedPhase = 0;
+    smoothPhase(planes0[idx], planes0[numPixels + idx], planes0[2 * numPixels + idx], phase0[idx], MAX_PHASE_ERROR,
+                phaseSmoothed0[idx - pixels[0]], correctedPhase);
+    smoothPhase(planes1[idx], planes1[numPixels + idx], planes1[2 * numPixels + idx], phase1[idx], MAX_PHASE_ERROR,
+                phaseSmoothed1[idx - pixels[0]], correctedPhase);
   }
 }
-
@@ -0,0 +1,152 @@
+/**
+ * @file calculatePhase_fixed.cpp
+ * @brief Fills missing rows, bins and computes the phase of the 16-bit fixed-point raw frames of
+ * RawToDepthV2_fixed in a single pass, using integer sums and phase.
+ *
+ * This produces the outputs of RawToDepthDsp::fillMissingRows(), Binning::binMxN() and RawToDepthDsp::calculatePhase()
+ * on the equivalent float raw frame, without the filled full-frame intermediate. The binned raw data, signal, snr and
+ * background are identical to the float path, and the phase differs by less than 2^-PHASE_FIXED_BITS cycles.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+#include "RawToDepthDsp.h"
+#include "RtdMetadata.h"
+#include "LumoLogger.h"
+#include <algorithm>
+#include <cassert>
+
+/**
+ * @param frame The full-frame fixed-point raw data (see RAW_FIXED_SHIFT). Can be a few rows longer than frameSize.
+ * @param activeRows One entry per row of frame. True if an input ROI had data in the row.
+ * @param frameSize The pre-binned size (rows, columns) to process.
+ * @param binning The binning rate, 1x1, 2x2 or 4x4.
+ * @param binnedFrame Output: the binned raw triplets, on the scale of the float path.
+ * @param phaseRoi Output: the phase of each binned pixel, in cycles.
+ * @param signalRoi Summed into: the signal of each binned pixel, divided by the number of binned pixels.
+ * @param snrRoi Summed into: the snr of each binned pixel.
+ * @param backgroundRoi Summed into: the background of each binned pixel, divided by the number of binned pixels.
+ * @param binnedRows The binned rows to process. The other rows of the outputs are left untouched.
+ */
+void RawToDepthDsp::binAndCalculatePhase(const std::vector<uint16_t> &frame, const std::vector<bool> &activeRows,
+                                         std::array<uint32_t,2> frameSize, std::array<uint32_t,2> binning,
+                                         std::vector<float_t> &binnedFrame, std::vector<float_t> &phaseRoi,
+                                         std::vector<float_t> &signalRoi, std::vector<float_t> &snrRoi,
+                                         std::vector<float_t> &backgroundRoi, std::array<uint32_t,2> binnedRows)
+{
+  if (binning[0] != binning[1] || (binning[0] != 1 && binning[0] != 2 && binning[0] != 4))
+  {
+    LLogErr("MxN binning is not supported. Binning is set to " << binning[0] << "x" << binning[1]);
+    return;
+  }
+
+  const auto numRows = frameSize[0];
+  const auto numCols = frameSize[1];
+  const auto numBinnedRows = numRows / binning[0];
+  const auto binnedCols = numCols / binning[1];
+  const auto rowStride = std::size_t(NUM_GPIXEL_PHASES) * numCols;
+  assert(frame.size() >= std::size_t(numRows) * rowStride);
+  assert(activeRows.size() >= numRows);
+  assert(binnedFrame.size() == std::size_t(NUM_GPIXEL_PHASES) * numBinnedRows * binnedCols);
+  assert(phaseRoi.size() == std::size_t(numBinnedRows) * binnedCols);
+
+  // Each filled row is the average of two input rows (the same row twice, unless it's interpolated), so the sums
+  // are of twice the fixed-point values. In the float scale, that's a factor of 2^(RAW_FIXED_SHIFT-1).
+  const auto scale = float_t(1U << RAW_FIXED_SHIFT) / 2.0F;
+  const auto numberOfSummedValues = float_t(binning[0] * binning[1]);
+
+  // The rows that fillMissingRows() averages into row. The top and bottom rows are never filled.
+  auto sourceRows = [numRows, &activeRows](uint32_t row) -> std::array<uint32_t,2>
+  {
+    if (numRows < 3 || row == 0 || row == numRows - 1 || activeRows[row])
+    {
+      return {row, row};
+    }
+    const bool upRowActive = activeRows[row - 1];
+    const bool downRowActive = activeRows[row + 1];
+    if (upRowActive && downRowActive)
+    {
+      return {row - 1, row + 1};
+    }
+    if (upRowActive)
+    {
+      return {row - 1, row - 1};
+    }
+    if (downRowActive)
+    {
+      return {row + 1, row + 1};
+    }
+    return {row, row};
+  };
+
+  std::array<const uint16_t *, 2 * 4> rows {};
+  for (uint32_t binnedRow = binnedRows[0]; binnedRow < std::min(binnedRows[1], numBinnedRows); binnedRow++)
+  {
+    for (uint32_t rowIdx = 0; rowIdx < binning[0]; rowIdx++)
+    {
+      const auto sources = sourceRows(binnedRow * binning[0] + rowIdx);
+      rows[2 * rowIdx] = frame.data() + sources[0] * rowStride;
+      rows[2 * rowIdx + 1] = frame.data() + sources[1] * rowStride;
+    }
+
+    for (uint32_t binnedCol = 0; binnedCol < binnedCols; binnedCol++)
+    {
+      const auto colOffset = std::size_t(NUM_GPIXEL_PHASES) * binnedCol * binning[1];
+      int32_t rawA = 0;
+      int32_t rawB = 0;
+      int32_t rawC = 0;
+      for (uint32_t rowIdx = 0; rowIdx < 2 * binning[0]; rowIdx++)
+      {
+        const auto *src = rows[rowIdx] + colOffset;
+        for (uint32_t colIdx = 0; colIdx < NUM_GPIXEL_PHASES * binning[1]; colIdx += NUM_GPIXEL_PHASES)
+        {
+          rawA += src[colIdx + 0];
+          rawB += src[colIdx + 1];
+          rawC += src[colIdx + 2];
+        }
+      }
+
+      const auto idx = std::size_t(binnedRow) * binnedCols + binnedCol;
+      binnedFrame[NUM_GPIXEL_PHASES * idx + 0] = scale * float_t(rawA);
+      binnedFrame[NUM_GPIXEL_PHASES * idx + 1] = scale * float_t(rawB);
+      binnedFrame[NUM_GPIXEL_PHASES * idx + 2] = scale * float_t(rawC);
+
+      // See calculatePhase(). The phase is (B - C + k * signal) / (3 * signal) after sorting, for k thirds of a cycle.
+      int64_t thirds = 0;
+      if (rawA <= rawB && rawA <= rawC)
+      {
+        auto tmp = rawC;
+        rawC = rawA;
+        rawA = rawB;
+        rawB = tmp;
+        thirds = 1;
+      }
+      else if (rawB <= rawC && rawB < rawA)
+      {
+        auto tmp = rawA;
+        rawA = rawC;
+        rawC = rawB;
+        rawB = tmp;
+        thirds = 2;
+      }
+
+      const int64_t signal = int64_t(rawA) + rawB - 2 * int64_t(rawC);
+      if (signal <= 0)
+      {
+        phaseRoi[idx] = 0;
+        continue;
+      }
+
+      const auto denominator = 3 * signal;
+      const auto phase = (((int64_t(rawB - rawC) + thirds * signal) << PHASE_FIXED_BITS) + denominator / 2) / denominator;
+      phaseRoi[idx] = float_t(phase) * (1.0F / float_t(1U << PHASE_FIXED_BITS));
+
+      const auto fSignal = scale * float_t(signal);
+      const auto fRawC = scale * float_t(rawC);
+      const float_t clip = 1.0F/65535.0F;
+      signalRoi[idx] += fSignal / numberOfSummedValues;
+      snrRoi[idx] += fSignal / sqrtf(2.0F * (fRawC < clip ? clip : fRawC));
+      backgroundRoi[idx] += fRawC / numberOfSummedValues;
+    }
+  }
+}
@@ -7,6 +7,7 @@
  * 
  */
 #include "RawToDepthDsp.h"
+#include "RawToDepthSimd.h"
 
 // Assumes signal, snr, background are initialize to zero on first call.
 void RawToDepthDsp::calculatePhase(const std::vector<float_t> &rawRoi,
@@ -16,7 +17,25 @@ void RawToDepthDsp::calculatePhase(const std::vector<float_t> &rawRoi,
 				   std::vector<float_t> &backgroundRoi,
 				   float_t numberOfSummedValues) 
 {
-  for (uint32_t idx = 0; idx < phaseRoi.size(); idx++)
+  calculatePhase(rawRoi, phaseRoi, signalRoi, snrRoi, backgroundRoi, numberOfSummedValues, {0, phaseRoi.size()});
+}
+
+// Only the pixels [pixels[0], pixels[1]) are computed; the rest of the outputs are left untouched.
+void RawToDepthDsp::calculatePhase(const std::vector<float_t> &rawRoi,
+				   std::vector<float_t> &phaseRoi,
+				   std::vector<float_t> &signalRoi,
+				   std::vector<float_t> &snrRoi,
+				   std::vector<float_t> &backgroundRoi,
+				   float_t numberOfSummedValues,
+				   std::array<std::size_t,2> pixels) 
+{
+  assert(pixels[0] <= pixels[1] && pixels[1] <= phaseRoi.size());
+  // The SIMD kernel handles a multiple of the vector width. The remainder is processed here.
+  auto idx = pixels[0] + RawToDepthSimd::calculatePhase(rawRoi.data() + 3 * pixels[0], phaseRoi.data() + pixels[0],
+                                                        signalRoi.data() + pixels[0], snrRoi.data() + pixels[0],
+                                                        backgroundRoi.data() + pixels[0], uint32_t(pixels[1] - pixels[0]),
+                                                        numberOfSummedValues);
+  for (; idx < pixels[1]; idx++)
   {
     int aIdx = int(3 * idx);
     
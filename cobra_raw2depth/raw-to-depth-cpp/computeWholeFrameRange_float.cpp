@@ -9,6 +9,7 @@
  */
 
 #include "RawToDepthDsp.h"
+#include "RawToDepthSimd.h"
 #include <limits>
 inline bool RawToDepthDsp::outOfRange(const std::vector<float_t> &frame, uint32_t idx, const std::vector<int32_t> &offsets, float_t thresh) {
 
@@ -84,59 +85,57 @@ void RawToDepthDsp::minMax(const RtdVec &frame, RtdVec &minMaxMask, std::vector<
 }
 
 
+RawToDepthDsp::PhaseUnwrap RawToDepthDsp::getPhaseUnwrap(std::array<float_t, 2> freqs, const std::vector<float_t> &fsInt,
+                                                         float_t cMps)
+{
+  PhaseUnwrap unwrap;
+  unwrap.fInt0 = float_t(fsInt[0]);
+  unwrap.fInt1 = float_t(fsInt[1]);
+  unwrap.a = 0.5F * cMps / (2.0F * freqs[1]); // f is 100e6, _c is 300e6
+  unwrap.c = 0.5F * cMps / (2.0F * freqs[0]); // c a local algorithmic constant
+
+  // The smoothed phases are in [0, 1], so the unrounded wrap count is at least -fInt1. Adding
+  // fInt1+1 cycles keeps it positive, where truncating x+0.5 rounds x as roundf() does.
+  unwrap.bias = unwrap.fInt1 + 1.0F;
+  return unwrap;
+}
+
 void RawToDepthDsp::computeWholeFrameRange(std::vector<float_t> &fSmoothedPhases0,
 					   std::vector<float_t> &fSmoothedPhases1,
 					   std::vector<float_t> &fCorrectedPhases0,
 					   std::vector<float_t> &fCorrectedPhases1,
 					   std::vector<float_t> &fRanges,
-					   std::array<float_t, 2> freqs, std::vector<float_t> fsInt,
+					   std::array<float_t, 2> freqs, const std::vector<float_t> &fsInt,
 					   float_t cMps,
 					   std::vector<float_t> &mFrame
 					   ) { // _c is the speed of light.
+  computeWholeFrameRange(fSmoothedPhases0, fSmoothedPhases1, fCorrectedPhases0, fCorrectedPhases1, fRanges,
+                         getPhaseUnwrap(freqs, fsInt, cMps), mFrame);
+}
+
+void RawToDepthDsp::computeWholeFrameRange(std::vector<float_t> &fSmoothedPhases0,
+					   std::vector<float_t> &fSmoothedPhases1,
+					   std::vector<float_t> &fCorrectedPhases0,
+					   std::vector<float_t> &fCorrectedPhases1,
+					   std::vector<float_t> &fRanges,
+					   const PhaseUnwrap &unwrap,
+					   std::vector<float_t> &mFrame
+					   ) {
 
   auto &phase0Frame = fCorrectedPhases0;
   auto &phase1Frame = fCorrectedPhases1;
 
-  auto freq0 = float(freqs[0]);
-  auto freq1 = float(freqs[1]);
-  auto iFInt0 = float_t(fsInt[0]);
-  auto iFInt1 = float_t(fsInt[1]);
-
-  const float a_float = 0.5F * cMps / (2.0F * freq1); // f is 100e6, _c is 300e6
-  const float c_float = 0.5F * cMps / (2.0F * freq0); // c a local algorithmic constant
-  
   assert(phase0Frame.size() == phase1Frame.size());
-  for (uint32_t idx = 0; idx < phase0Frame.size(); idx++)
+  assert(fRanges.size() >= phase0Frame.size());
+  assert(mFrame.size() >= phase0Frame.size());
+  uint32_t idx = RawToDepthSimd::computeWholeFrameRange(fSmoothedPhases0.data(), fSmoothedPhases1.data(),
+                                                        phase0Frame.data(), phase1Frame.data(),
+                                                        fRanges.data(), mFrame.data(), uint32_t(phase0Frame.size()),
+                                                        unwrap.fInt0, unwrap.fInt1, unwrap.a, unwrap.c, unwrap.bias);
+  for (; idx < phase0Frame.size(); idx++)
   {
-    auto phaseSmoothed0 = fSmoothedPhases0[idx];
-    auto phaseSmoothed1 = fSmoothedPhases1[idx];
-
-    float_t maskNegatives = phaseSmoothed1 < phaseSmoothed0 ? 1.0F : 0.0F;
-    float_t mRaw1 = iFInt0 * phaseSmoothed1;
-    float_t mRaw2 = iFInt1 * phaseSmoothed0;
-    float_t mRaw3 = iFInt0 * maskNegatives;
-    float_t mRaw_tmp = mRaw1 - mRaw2 + mRaw3;
-    float_t mRaw_float = roundf(mRaw_tmp); 
-    auto mRaw = int32_t(mRaw_float);
-
-    mFrame[idx] = mRaw_float + mRaw_float + maskNegatives;
-
-    float_t phase0 = phase0Frame[idx]; 
-    float_t phase1 = phase1Frame[idx]; 
-    float_t b_float = mRaw_float + phase1 + maskNegatives;
-    float_t d_float = mRaw_float + phase0;
-
-    float_t range = a_float*b_float + c_float*d_float; 
-    if (range < 0) 
-    {
-      range = 0;
-    }
-
     assert(idx < fRanges.size());
-
-    fRanges[idx] = range; 
-
+    unwrapRange(unwrap, fSmoothedPhases0[idx], fSmoothedPhases1[idx], phase0Frame[idx], phase1Frame[idx],
+                fRanges[idx], mFrame[idx]);
   }
-  
 }
-
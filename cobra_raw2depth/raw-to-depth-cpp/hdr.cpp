@@ -9,11 +9,11 @@
 #include "hdr.h"
 #include "RtdVec.h"
 #include <LumoUtil.h>
+#include <algorithm>
 #include <cassert>
 
 void hdr::realloc(uint32_t roiShorts) {
   bool changed = reallocBuffers(roiShorts);
-  MAKE_VECTOR2(_md, uint16_t, ROI_NUM_COLUMNS*NUM_GPIXEL_PHASES);
   if (!changed) 
   {
     return;
@@ -24,7 +24,7 @@ void hdr::realloc(uint32_t roiShorts) {
 }
 
 
-void hdr::submit(const uint16_t *roiWithHeader, uint32_t roiShortsWithHeader, uint32_t fovIdx, bool startup, uint32_t shiftr) {
+void hdr::submit(const RtdMetadata &mdat, const uint16_t *roiWithHeader, uint32_t roiShortsWithHeader, uint32_t fovIdx, bool startup, uint32_t shiftr, bool deferConversion) {
   // roi is the raw input with the header attached.
   // skipThis notifies the caller that the ROI they are receiving is ready to be used for a point cloud.
 
@@ -33,51 +33,45 @@ void hdr::submit(const uint16_t *roiWithHeader, uint32_t roiShortsWithHeader, ui
 
   realloc(roiShorts);
 
-  assert(_md[0].size() == rowShorts);
-  assert(_md[1].size() == rowShorts);
-
-  RtdMetadata mdat(roiWithHeader, rowShorts*sizeof(uint16_t));
-  auto mask = RtdMetadata::getRawPixelMask();
-
   const auto *roi = roiWithHeader + rowShorts;
 
-  assert(roiShorts == _rois[0].size());
-  assert(roiShorts == _rois[1].size());
+  assert(roiShorts == _rawRois[0].size());
+  assert(roiShorts == _rawRois[1].size());
   assert(roiShorts%3 == 0);
   _skipThis = false;
+  _rawRoi = nullptr;
+  _rawRoiShorts = 0;
 
 
   // Note: if md.isHdrDisabled() on one ROI, then the next one is marked as "previousRoiSaturated(),"
   // Then unknown data will come out.
-  // straight pass through, no pipeline delay. Put this ROI into _rois[_nextRoiIdx], ready to be read out.
+  // straight pass through, no pipeline delay. The input is the output.
   if (mdat.isHdrDisabled()) {
     _skipThis = false;
     _previousRoiWasCorrected = false;
-
-    copyBuffer(roi, _rois[_nextRoiIdx], roiShorts, shiftr, mask);
-    hdr_copy(roiWithHeader, rowShorts, _md[_nextRoiIdx]);
+    _md[_nextRoiIdx] = mdat;
+    output(roi, roiShorts, shiftr, deferConversion);
     return;
   }
 
 
   // First ROI ever, or,
   // First ROI following a re-acquired one, so store this one into the previous buffer and add an roi of latency.
+  // Nothing is output, but the caller reads the metadata.
   if (startup ||
       _previousRoiWasCorrected) 
   {
     assert(!mdat.wasPreviousRoiSaturated());
     _skipThis = true;
     _previousRoiWasCorrected = false;
-    copyBuffer(roi, _rois[_previousRoiIdx], roiShorts, shiftr, mask);
-    hdr_copy(roiWithHeader, rowShorts, _md[_previousRoiIdx]);
-    
-    copyBuffer(roi, _rois[_nextRoiIdx], roiShorts, shiftr, mask);
-    hdr_copy(roiWithHeader, rowShorts, _md[_nextRoiIdx]);
+    std::copy(roi, roi + roiShorts, _rawRois[_previousRoiIdx].begin());
+    _md[_previousRoiIdx] = mdat;
+    _md[_nextRoiIdx] = mdat;
 
     return;
   }
 
-  // By the time we reach this line, we know that there is one good ROI in _rois[_previousRoiIdx].
+  // By the time we reach this line, we know that there is one good ROI in _rawRois[_previousRoiIdx].
 
   // The current ROI is new (not re-acquired). Store it into the history buffer.
   // Send along the previous ROI since it has not been re-acquired.
@@ -89,21 +83,40 @@ void hdr::submit(const uint16_t *roiWithHeader, uint32_t roiShortsWithHeader, ui
     _previousRoiIdx = _previousRoiIdx == 0 ? 1 : 0;
     _nextRoiIdx = _nextRoiIdx == 0 ? 1 : 0;
     
-    // Now that previous ROI is ready to be read from _rois[_nextRoiIdx],
+    // Now that previous ROI is ready to be read from _rawRois[_nextRoiIdx],
     // Put this current ROI into the previous buffer to add an roi of delay.
-    copyBuffer(roi, _rois[_previousRoiIdx], roiShorts, shiftr, mask);
-    hdr_copy(roiWithHeader, rowShorts, _md[_previousRoiIdx]);
+    std::copy(roi, roi + roiShorts, _rawRois[_previousRoiIdx].begin());
+    _md[_previousRoiIdx] = mdat;
+    output(_rawRois[_nextRoiIdx].data(), roiShorts, shiftr, deferConversion);
 
     return;
   }
 
-  hdrSum(mdat.getSaturationThreshold(), roi, roiShorts, shiftr, mask);
+  // Merge the saturated pixels of the previous ROI with the re-acquired ones in a single pass.
+  RawToDepthDsp::hdrMerge(_rawRois[_previousRoiIdx].data(), roi, _rawRois[_nextRoiIdx].data(), roiShorts,
+                          mdat.getSaturationThreshold(), shiftr, RtdMetadata::getRawPixelMask());
   // If two ROIs have been merged together, pass out the metadata from the prior acquisition.
-  hdr_copy(_md[_previousRoiIdx].data(), rowShorts, _md[_nextRoiIdx]);
+  _md[_nextRoiIdx] = _md[_previousRoiIdx];
+  output(_rawRois[_nextRoiIdx].data(), roiShorts, shiftr, deferConversion);
 
   _skipThis = false;
   _previousRoiWasCorrected = true;
 
-  // By the time we reach this code, there is no valid data in _rois[_previousRoiIdx] (the history buffer).
-  // And _rois[_nextRoiIdx] contains the roi combined between the last two acquisitions.
+  // By the time we reach this code, there is no valid data in _rawRois[_previousRoiIdx] (the history buffer).
+  // And _rawRois[_nextRoiIdx] contains the roi combined between the last two acquisitions.
+}
+
+/**
+ * @brief Makes the given raw ROI the output. If the conversion is deferred, the caller converts it while ingesting it.
+ */
+void hdr::output(const uint16_t *roi, uint32_t roiShorts, uint32_t shiftr, bool deferConversion)
+{
+  if (deferConversion)
+  {
+    _rawRoi = roi;
+    _rawRoiShorts = roiShorts;
+    return;
+  }
+  _roi.resize(roiShorts);
+  copyBuffer(roi, _roi, roiShorts, shiftr, RtdMetadata::getRawPixelMask());
 }
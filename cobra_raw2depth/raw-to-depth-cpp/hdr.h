@@ -11,36 +11,43 @@
 #pragma once
 #include "RtdMetadata.h"
 #include "RawToDepthDsp.h"
+#include <array>
 #include <cstdint>
 #include <vector>
 
-#define hdr_copy(src, len, dst) std::copy((src), (src)+(len), (dst).begin())
-
 class hdr {
  private:
 
-  // These ROIs are stored without the header attached.
+  // A ring of two raw ROIs, stored without the header attached. HDR holds each ROI for one ROI-time, to see whether
+  // the next one is a retake. The ROIs are swapped by index, and only the incoming ROI is copied, as raw data.
   int _previousRoiIdx = 0;
   int _nextRoiIdx = 1;
-  std::vector<std::vector<float_t>> _rois;
-  std::vector<
-    std::vector<uint16_t>> _md;
+  std::vector<std::vector<uint16_t>> _rawRois;
+  std::vector<float_t>     _roi; ///< The output ROI converted to float, when the conversion isn't deferred.
+  std::array<RtdMetadata, 2> _md {RtdMetadata(RtdMetadata::DEFAULT_METADATA), RtdMetadata(RtdMetadata::DEFAULT_METADATA)}; ///< Decoded, delayed along with _rawRois.
   bool                     _previousRoiWasCorrected = false;
   bool                     _skipThis = false;
+  const uint16_t          *_rawRoi = nullptr;  ///< The output ROI, when the conversion to float is deferred to the caller.
+  uint32_t                 _rawRoiShorts = 0;
 
  public:
 
-  void submit(const uint16_t *roi, uint32_t roiShorts, uint32_t fovIdx, bool startup, uint32_t shiftr);
+  // If deferConversion is true, then the output ROI is not converted to float. The caller reads it through
+  // getRawRoi() and converts it while ingesting it. If HDR is disabled for this ROI, that is the input buffer itself,
+  // which is only valid until the input buffer is released; otherwise it is in the ring, valid until the next submit().
+  void submit(const RtdMetadata &mdat, const uint16_t *roi, uint32_t roiShorts, uint32_t fovIdx, bool startup, uint32_t shiftr, bool deferConversion = false);
   bool skip() const { return _skipThis; }
-  std::vector<float_t> &getRoi() { return _rois[_nextRoiIdx]; }
+  bool isRawPassthrough() const { return nullptr != _rawRoi; }
+  const uint16_t *getRawRoi() const { return _rawRoi; }
+  uint32_t getRawRoiShorts() const { return _rawRoiShorts; }
+  std::vector<float_t> &getRoi() { return _roi; }
   std::vector<float_t> readoutRoi(); // Used for testing.
-  RtdMetadata getMetadata() { return RtdMetadata(_md[_nextRoiIdx]); } //elision, metadata copied into new object.
-  std::vector<uint16_t> &getMetadataVector() { return _md[_nextRoiIdx]; }
+  const RtdMetadata &getMetadata() const { return _md[_nextRoiIdx]; } ///< The metadata of the ROI returned by getRoi().
 
 private:
   void realloc(uint32_t roiShorts); // number of shorts in an roi with the header.
   bool reallocBuffers(uint32_t roiShorts);
-  void hdrSum(uint16_t saturationLevel, const uint16_t *roi, uint32_t roiShorts, uint32_t shiftr, uint16_t mask);
+  void output(const uint16_t *roi, uint32_t roiShorts, uint32_t shiftr, bool deferConversion);
   static void copyBuffer(const uint16_t *src, std::vector<float_t> &dst, uint32_t numElements, uint32_t shiftr, uint16_t mask);
   
 };
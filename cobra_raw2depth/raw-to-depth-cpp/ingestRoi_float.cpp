@@ -0,0 +1,144 @@
+/**
+ * @file ingestRoi_float.cpp
+ * @brief Fused per-ROI ingest for grid mode: tap rotation for both modulation frequencies
+ * followed by snr-voting into the full-frame raw buffers, in a single pass over the ROI.
+ *
+ * This produces the same output as RawToDepthDsp::tapRotation() for each frequency followed by
+ * RawToDepthDsp::snrVoteV2(), without the two intermediate ROI-sized buffers. When the raw 16-bit input
+ * is provided directly, the conversion to float (RawToDepthDsp::sh2f()) is also folded in, so that each raw
+ * sample is read from memory once. The same pass also writes the 16-bit fixed-point raw frames of RawToDepthV2_fixed.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "RawToDepthDsp.h"
+#include "RtdMetadata.h"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <type_traits>
+
+/**
+ * @brief The fused kernel, templated on how a raw input sample is read and on the type of the raw frames.
+ *
+ * @param load A callable returning the value of raw sample idx: float_t for float raw frames, or the fixed-point
+ *             value (see RAW_FIXED_SHIFT) as uint32_t for 16-bit raw frames.
+ * @param numSamples The number of raw samples available through load.
+ * @param roiSize The size of the ROI (rows, columns).
+ * @param doTapRotation True if the three tap permutations are to be summed (RtdMetadata::getDoTapAccumulation())
+ * @param rawFov The full-frame raw buffers, one for each frequency.
+ * @param snrSquaredFov The full-frame buffer of the current best snr-squared value for each pixel.
+ * @param fovOffset The index of the first pixel of this ROI within the full frame.
+ */
+template <typename Raw, typename Loader>
+static void ingestRoiImpl(Loader load, std::size_t numSamples, std::array<uint32_t,2> roiSize, bool doTapRotation,
+                          std::vector<std::vector<Raw>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset)
+{
+  using Sample = decltype(load(0));
+  // Saturates the fixed-point tap sums, which can only overflow if the input wasn't masked.
+  auto toRaw = [](Sample value) -> Raw
+  {
+    if constexpr (std::is_integral_v<Raw>)
+    {
+      return Raw(std::min<Sample>(value, std::numeric_limits<Raw>::max()));
+    }
+    else
+    {
+      return value;
+    }
+  };
+
+  assert(rawFov.size() == 2);
+  auto &fov0 = rawFov[0];
+  auto &fov1 = rawFov[1];
+
+  const std::size_t numPixels = std::size_t(roiSize[0]) * std::size_t(roiSize[1]);
+  const std::size_t imageStride = NUM_GPIXEL_PHASES * numPixels;
+  const std::size_t numPermutations = doTapRotation ? 3 : 1;
+
+  // Each permutation holds one image for each frequency.
+  if (numSamples < 2 * numPermutations * imageStride)
+  {
+    return; // buffer mis-sized.
+  }
+  assert(fovOffset + numPixels <= snrSquaredFov.size());
+  assert(NUM_GPIXEL_PHASES * (fovOffset + numPixels) <= fov0.size());
+  assert(NUM_GPIXEL_PHASES * (fovOffset + numPixels) <= fov1.size());
+
+  std::array<Sample, NUM_GPIXEL_PHASES> abc0 {};
+  std::array<Sample, NUM_GPIXEL_PHASES> abc1 {};
+  for (std::size_t idx = 0; idx < numPixels; idx++)
+  {
+    const std::size_t aIdx = NUM_GPIXEL_PHASES * idx;
+    if (doTapRotation)
+    {
+      // The taps of permutation n are rotated by n positions. Image order is [perm][freq].
+      abc0[0] = load(aIdx + 0) + load(2 * imageStride + aIdx + 1) + load(4 * imageStride + aIdx + 2);
+      abc0[1] = load(aIdx + 1) + load(2 * imageStride + aIdx + 2) + load(4 * imageStride + aIdx + 0);
+      abc0[2] = load(aIdx + 2) + load(2 * imageStride + aIdx + 0) + load(4 * imageStride + aIdx + 1);
+
+      abc1[0] = load(imageStride + aIdx + 0) + load(3 * imageStride + aIdx + 1) + load(5 * imageStride + aIdx + 2);
+      abc1[1] = load(imageStride + aIdx + 1) + load(3 * imageStride + aIdx + 2) + load(5 * imageStride + aIdx + 0);
+      abc1[2] = load(imageStride + aIdx + 2) + load(3 * imageStride + aIdx + 0) + load(5 * imageStride + aIdx + 1);
+    }
+    else
+    {
+      abc0 = {load(aIdx + 0), load(aIdx + 1), load(aIdx + 2)};
+      abc1 = {load(imageStride + aIdx + 0), load(imageStride + aIdx + 1), load(imageStride + aIdx + 2)};
+    }
+
+    // The fixed-point values are a constant factor from the float ones, so they vote the same way.
+    auto snr = RawToDepthDsp::computeSnrSquared(float_t(abc0[0]), float_t(abc0[1]), float_t(abc0[2])) +
+               RawToDepthDsp::computeSnrSquared(float_t(abc1[0]), float_t(abc1[1]), float_t(abc1[2]));
+
+    if (snr > snrSquaredFov[idx + fovOffset])
+    {
+      auto fovIdx = NUM_GPIXEL_PHASES * (idx + fovOffset);
+      fov0[fovIdx + 0] = toRaw(abc0[0]);
+      fov0[fovIdx + 1] = toRaw(abc0[1]);
+      fov0[fovIdx + 2] = toRaw(abc0[2]);
+
+      fov1[fovIdx + 0] = toRaw(abc1[0]);
+      fov1[fovIdx + 1] = toRaw(abc1[1]);
+      fov1[fovIdx + 2] = toRaw(abc1[2]);
+
+      snrSquaredFov[idx + fovOffset] = snr;
+    }
+  }
+}
+
+void RawToDepthDsp::ingestRoi(const std::vector<float_t> &roiVector, std::array<uint32_t,2> roiSize, bool doTapRotation,
+                              std::vector<std::vector<float_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset)
+{
+  const auto *src = roiVector.data();
+  ingestRoiImpl([src](std::size_t idx) { return src[idx]; },
+                roiVector.size(), roiSize, doTapRotation, rawFov, snrSquaredFov, fovOffset);
+}
+
+void RawToDepthDsp::ingestRoi(const uint16_t *roi, uint32_t roiShorts, uint32_t shiftr, uint16_t rawMask,
+                              std::array<uint32_t,2> roiSize, bool doTapRotation,
+                              std::vector<std::vector<float_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset)
+{
+  ingestRoiImpl([roi, shiftr, rawMask](std::size_t idx) { return float_t(uint32_t(roi[idx] & rawMask) >> shiftr); },
+                roiShorts, roiSize, doTapRotation, rawFov, snrSquaredFov, fovOffset);
+}
+
+void RawToDepthDsp::ingestRoi(const std::vector<float_t> &roiVector, std::array<uint32_t,2> roiSize, bool doTapRotation,
+                              std::vector<std::vector<uint16_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset)
+{
+  // Only HDR provides float input, which can have fractions and exceed the range of the raw data.
+  const auto *src = roiVector.data();
+  constexpr auto scale = 1.0F / float_t(1U << RAW_FIXED_SHIFT);
+  ingestRoiImpl([src, scale](std::size_t idx) { return uint32_t(std::clamp(src[idx] * scale + 0.5F, 0.0F, 65535.0F)); },
+                roiVector.size(), roiSize, doTapRotation, rawFov, snrSquaredFov, fovOffset);
+}
+
+void RawToDepthDsp::ingestRoi(const uint16_t *roi, uint32_t roiShorts, uint32_t shiftr, uint16_t rawMask,
+                              std::array<uint32_t,2> roiSize, bool doTapRotation,
+                              std::vector<std::vector<uint16_t>> &rawFov, std::vector<float_t> &snrSquaredFov, uint32_t fovOffset)
+{
+  const auto shift = shiftr + RAW_FIXED_SHIFT;
+  ingestRoiImpl([roi, shift, rawMask](std::size_t idx) { return uint32_t(roi[idx] & rawMask) >> shift; },
+                roiShorts, roiSize, doTapRotation, rawFov, snrSquaredFov, fovOffset);
+}
@@ -68,9 +68,19 @@ inline float_t RawToDepthDsp::binMedian(std::vector<float_t> &points)
   return min + float_t(maxIdx) * (max-min);
 }
 
+/**
+ * @brief Replaces each pixel away from the edges with the median of a plus-shaped neighborhood: hFilterSize
+ * pixels of its row and vFilterSize pixels of its column (see getMedianOffsets()).
+ *
+ * The pixels of a row are filtered together. Each point of the plus is gathered for the whole row, which
+ * is a contiguous copy, and the points are sorted by an odd-even transposition network of min/max operations
+ * on those rows of values. That has no data-dependent branches, and its inner loops run over contiguous
+ * columns, so they vectorize. The median is the middle row after sorting.
+ */
 void RawToDepthDsp::medianFilterPlus(std::vector<float_t> &inFrame, std::vector<float_t> &outFrame,
                                      std::vector<uint32_t> kernelIndices,
-                                     std::array<uint32_t,2> frameSize, bool performGhostMedian) {
+                                     std::array<uint32_t,2> frameSize, bool performGhostMedian,
+                                     const std::vector<int> *pointOffsets) {
   assert(frameSize[0] * frameSize[1] == (uint32_t)outFrame.size());
 
   std::copy(inFrame.begin(), inFrame.end(), outFrame.begin());
@@ -82,14 +92,17 @@ void RawToDepthDsp::medianFilterPlus(std::vector<float_t> &inFrame, std::vector<
   int hFilterSize = int(_fKernels[kernelIndices[0]].size() | 1U); // guarantee filter size is odd.
   int vFilterSize = int(_fKernels[kernelIndices[1]].size() | 1U);
 
-  auto pointOffsets = getMedianOffsets(frameSize, kernelIndices);
+  std::vector<int> computedOffsets;
+  if (pointOffsets == nullptr)
+  {
+    computedOffsets = getMedianOffsets(frameSize, kernelIndices);
+    pointOffsets = &computedOffsets;
+  }
 
   int rowStart = vFilterSize / 2;
   int colStart = hFilterSize / 2;
   auto rowPitch = (int)frameSize[1];
 
-  SCOPED_VEC_F(points, vFilterSize + hFilterSize - 1);
-
   // "int" guarantees that the output is signed for the following check.
   int numRows = (int)frameSize[0] - (int)vFilterSize + 1;
   int numColumns = (int)frameSize[1] - (int)hFilterSize + 1;
@@ -99,28 +112,35 @@ void RawToDepthDsp::medianFilterPlus(std::vector<float_t> &inFrame, std::vector<
     return; // image unmodified.
   }
 
-  auto idxStart = rowStart * rowPitch + colStart; // center of the x-shaped median kernel
+  const auto numPoints = pointOffsets->size();
+  const auto rowSize = std::size_t(numColumns);
+  SCOPED_VEC_F(points, numPoints * rowSize); // One row of values per point of the plus.
+
+  auto idxStart = rowStart * rowPitch + colStart; // center of the plus-shaped median kernel
 
   for (auto rowIdx = 0; rowIdx < numRows; rowIdx++) {
-    auto idx = idxStart;
-    for (auto colIdx = 0; colIdx < numColumns; colIdx++) {
-
-      for (auto pointIdx = 0; pointIdx < pointOffsets.size(); pointIdx++) {
-        assert(pointIdx >= 0);
-        assert(pointIdx < points.size());
-        assert(idx + pointOffsets[pointIdx] >= 0);
-        assert(idx + pointOffsets[pointIdx] < inFrame.size());
-        points[pointIdx] = inFrame[idx + pointOffsets[pointIdx]];
-      }
+    for (auto pointIdx = 0; pointIdx < numPoints; pointIdx++) {
+      assert(idxStart + (*pointOffsets)[pointIdx] >= 0);
+      assert(idxStart + (*pointOffsets)[pointIdx] + numColumns <= inFrame.size());
+      std::copy_n(&inFrame[idxStart + (*pointOffsets)[pointIdx]], rowSize, &points[pointIdx * rowSize]);
+    }
 
-      assert(idx < outFrame.size());
-      assert(idx >= 0);
-      auto val = median(points);
-      outFrame[idx] = val; // points is sorted after this call.
-      idx++;
+    // numPoints rounds of the transposition network sort numPoints values.
+    for (auto round = 0; round < numPoints; round++) {
+      for (auto pointIdx = std::size_t(round & 1); pointIdx + 1 < numPoints; pointIdx += 2) {
+        auto *lower = &points[pointIdx * rowSize];
+        auto *upper = lower + rowSize;
+        for (auto colIdx = 0; colIdx < rowSize; colIdx++) {
+          const auto low = std::min(lower[colIdx], upper[colIdx]);
+          const auto high = std::max(lower[colIdx], upper[colIdx]);
+          lower[colIdx] = low;
+          upper[colIdx] = high;
+        }
+      }
     }
+
+    assert(idxStart + numColumns <= outFrame.size());
+    std::copy_n(&points[(numPoints / 2) * rowSize], rowSize, &outFrame[idxStart]);
     idxStart += rowPitch;
   }
-
 }
-
@@ -0,0 +1,155 @@
+/**
+ * @file minMaxSliding_float.cpp
+ * @brief Computes the min-max mask with sliding-window minimum and maximum filters
+ * using 32-bit floating point operations on the CPU.
+ *
+ * The 2D window minimum and maximum are separable, so they are computed as a horizontal
+ * pass followed by a vertical pass. Each pass uses the van Herk/Gil-Werman algorithm:
+ * the input is split into blocks the size of the window, and the extremum over any window
+ * is the combination of a suffix of one block and a prefix of the next. That takes three
+ * comparisons per pixel for each of the minimum and the maximum, whatever the window size.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "RawToDepthDsp.h"
+#include "FloatVectorPool.h"
+#include <algorithm>
+#include <cassert>
+
+namespace
+{
+/**
+ * @brief The minimum and maximum over each window of window consecutive elements of in.
+ *
+ * @param in The input row, numElements long.
+ * @param outMin Output: numElements - window + 1 window minimums. outMin[idx] covers in[idx] to in[idx + window - 1].
+ * @param outMax Output: the window maximums.
+ * @param prefixMin, prefixMax, suffixMin, suffixMax Scratch space, numElements long each.
+ */
+void slidingMinMax1d(const float_t *in, std::size_t numElements, std::size_t window, float_t *outMin, float_t *outMax,
+                     float_t *prefixMin, float_t *prefixMax, float_t *suffixMin, float_t *suffixMax)
+{
+  for (std::size_t idx = 0; idx < numElements; idx++)
+  {
+    const bool blockStart = idx % window == 0;
+    prefixMin[idx] = blockStart ? in[idx] : std::min(prefixMin[idx - 1], in[idx]);
+    prefixMax[idx] = blockStart ? in[idx] : std::max(prefixMax[idx - 1], in[idx]);
+  }
+  for (std::size_t idx = numElements; idx-- > 0;)
+  {
+    const bool blockEnd = idx % window == window - 1 || idx == numElements - 1;
+    suffixMin[idx] = blockEnd ? in[idx] : std::min(suffixMin[idx + 1], in[idx]);
+    suffixMax[idx] = blockEnd ? in[idx] : std::max(suffixMax[idx + 1], in[idx]);
+  }
+  for (std::size_t idx = 0; idx + window <= numElements; idx++)
+  {
+    outMin[idx] = std::min(suffixMin[idx], prefixMin[idx + window - 1]);
+    outMax[idx] = std::max(suffixMax[idx], prefixMax[idx + window - 1]);
+  }
+}
+} // namespace
+
+/**
+ * @brief Produces the same mask as minMax(): 1.0 where the range of the values in the window centered on
+ * the pixel exceeds minMaxThresh, and 0.0 elsewhere, including the borders where the window doesn't fit.
+ * The cost per pixel is independent of the filter size.
+ *
+ * @param frame The input data, one value per pixel.
+ * @param minMaxMask Output: the mask, the size of frame.
+ * @param filterSize The {vertical, horizontal} window size. Even sizes are rounded up to odd. If empty, the mask is all zero.
+ * @param frameSize The {rows, columns} size of frame.
+ * @param minMaxThresh The largest range of values in a window that is not masked.
+ */
+void RawToDepthDsp::minMaxSliding(const std::vector<float_t> &frame, std::vector<float_t> &minMaxMask, std::vector<uint32_t> filterSize,
+                                  std::array<uint32_t,2> frameSize, float_t minMaxThresh)
+{
+  std::fill(minMaxMask.begin(), minMaxMask.end(), 0.0F);
+  if (2 != filterSize.size())
+  {
+    return;
+  }
+
+  const std::size_t vFilterSize = filterSize[0] | 1U; // guarantee filter size is odd.
+  const std::size_t hFilterSize = filterSize[1] | 1U;
+  const std::size_t numRows = frameSize[0];
+  const std::size_t rowPitch = frameSize[1];
+  if (numRows < vFilterSize || rowPitch < hFilterSize)
+  {
+    return;
+  }
+  assert(frame.size() == numRows * rowPitch);
+  assert(minMaxMask.size() == frame.size());
+
+  const std::size_t numColumns = rowPitch - hFilterSize + 1; // The windows that fit in a row.
+  const std::size_t scratchSize = std::max(rowPitch, numRows * numColumns);
+  SCOPED_VEC_F(rowMin, numRows * numColumns);
+  SCOPED_VEC_F(rowMax, numRows * numColumns);
+  SCOPED_VEC_F(prefixMin, scratchSize);
+  SCOPED_VEC_F(prefixMax, scratchSize);
+  SCOPED_VEC_F(suffixMin, scratchSize);
+  SCOPED_VEC_F(suffixMax, scratchSize);
+
+  // Horizontal pass: the extrema of each row over hFilterSize columns.
+  for (std::size_t rowIdx = 0; rowIdx < numRows; rowIdx++)
+  {
+    slidingMinMax1d(&frame[rowIdx * rowPitch], rowPitch, hFilterSize, &rowMin[rowIdx * numColumns], &rowMax[rowIdx * numColumns],
+                    prefixMin.data(), prefixMax.data(), suffixMin.data(), suffixMax.data());
+  }
+
+  // Vertical pass over vFilterSize rows of the horizontal extrema. The block prefixes and suffixes
+  // are run a row at a time, so that the inner loops are over contiguous columns.
+  for (std::size_t rowIdx = 0; rowIdx < numRows; rowIdx++)
+  {
+    const auto *inMin = &rowMin[rowIdx * numColumns];
+    const auto *inMax = &rowMax[rowIdx * numColumns];
+    auto *outMin = &prefixMin[rowIdx * numColumns];
+    auto *outMax = &prefixMax[rowIdx * numColumns];
+    if (rowIdx % vFilterSize == 0)
+    {
+      std::copy(inMin, inMin + numColumns, outMin);
+      std::copy(inMax, inMax + numColumns, outMax);
+      continue;
+    }
+    for (std::size_t colIdx = 0; colIdx < numColumns; colIdx++)
+    {
+      outMin[colIdx] = std::min(outMin[colIdx - numColumns], inMin[colIdx]);
+      outMax[colIdx] = std::max(outMax[colIdx - numColumns], inMax[colIdx]);
+    }
+  }
+  for (std::size_t rowIdx = numRows; rowIdx-- > 0;)
+  {
+    const auto *inMin = &rowMin[rowIdx * numColumns];
+    const auto *inMax = &rowMax[rowIdx * numColumns];
+    auto *outMin = &suffixMin[rowIdx * numColumns];
+    auto *outMax = &suffixMax[rowIdx * numColumns];
+    if (rowIdx % vFilterSize == vFilterSize - 1 || rowIdx == numRows - 1)
+    {
+      std::copy(inMin, inMin + numColumns, outMin);
+      std::copy(inMax, inMax + numColumns, outMax);
+      continue;
+    }
+    for (std::size_t colIdx = 0; colIdx < numColumns; colIdx++)
+    {
+      outMin[colIdx] = std::min(outMin[colIdx + numColumns], inMin[colIdx]);
+      outMax[colIdx] = std::max(outMax[colIdx + numColumns], inMax[colIdx]);
+    }
+  }
+
+  // The window starting at (rowIdx, colIdx) is centered on (rowIdx + vFilterSize/2, colIdx + hFilterSize/2).
+  for (std::size_t rowIdx = 0; rowIdx + vFilterSize <= numRows; rowIdx++)
+  {
+    const auto *topMin = &suffixMin[rowIdx * numColumns];
+    const auto *topMax = &suffixMax[rowIdx * numColumns];
+    const auto *bottomMin = &prefixMin[(rowIdx + vFilterSize - 1) * numColumns];
+    const auto *bottomMax = &prefixMax[(rowIdx + vFilterSize - 1) * numColumns];
+    auto *mask = &minMaxMask[(rowIdx + vFilterSize / 2) * rowPitch + hFilterSize / 2];
+    for (std::size_t colIdx = 0; colIdx < numColumns; colIdx++)
+    {
+      const auto minVal = std::min(topMin[colIdx], bottomMin[colIdx]);
+      const auto maxVal = std::max(topMax[colIdx], bottomMax[colIdx]);
+      mask[colIdx] = maxVal - minVal > minMaxThresh ? 1.0F : 0.0F;
+    }
+  }
+}
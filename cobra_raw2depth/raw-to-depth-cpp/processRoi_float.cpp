@@ -17,7 +17,9 @@
 #include "FloatVectorPool.h"
 #include <cmath>
 #include <LumoLogger.h>
-#include <LumoTimers.h>
+#include <FastTimers.h>
+#include <PipelineTrace.h>
+#include <PerfCounters.h>
 #include <cassert>
 #include <NearestNeighbor.h>
 #include <iostream>
@@ -27,13 +29,15 @@
  * @brief A wrapper function so that we can do threading and input buffer 
  *        management at another time.
  * 
+ * @param mdat The decoded metadata of the ROI.
  * @param roi The raw input ROI buffer received from the frontend.
  * @param numBytes The size of the buffer.
  */
-void RawToDepthV2_float::processRoi(const uint16_t *roi, uint32_t numBytes)
+void RawToDepthV2_float::processRoi(const RtdMetadata &mdat, const uint16_t *roi, uint32_t numBytes)
 {
-  auto localTimer = LumoTimers::ScopedTimer(*_timers, "RawToDepthV2_float::processRoi()", TIMERS_UPDATE_EVERY);
-  processOneRoi(this, roi, numBytes);
+  auto localTimer = FastTimers::Scoped(FAST_TIMER_RTD_PROCESS_ROI);
+  auto localCounters = PerfCounters::Scoped(PERF_STAGE_RTD_PROCESS_ROI, _fovIdx);
+  processOneRoi(this, mdat, roi, numBytes);
 }
 
 /**
@@ -80,10 +84,10 @@ void RawToDepthV2_float::processRoi(const uint16_t *roi, uint32_t numBytes)
  *    RtdMetadata::getDoTapAccumulation() is false, indicating that tap rotation was performed prior
  *    to this software receiving the data. For some other scenarios, this routine is required to perform
  *    the operation 
- * 7. The variables _fRawFrames, _activeRows, and _roiIndexFrames all contain data that is passed to 
- *    processWholeFrame(), which is running in a separate thread. That means that the buffers need to be ping-ponged
- *    so that processOneRoi() can place its outputs into one set of buffers while processWholeFrame() reads from
- *    the other set 
+ * 7. The variables _fRawFrames, _activeRows, and _roiIndexRows all contain data that is passed to 
+ *    processWholeFrame(), which is running in a separate thread. That means that there is a ring of frame slots,
+ *    each with its own set of buffers, so that processOneRoi() can place its outputs into one slot while
+ *    processWholeFrame() reads from the others 
  * 8. The strip of data from this ROI gets written into the raw output buffers (_fRawFrames, one for each frequency). There
  *    can be overlap between neighboring ROI strips from the input sensor. Therefore the SNR is computed for each 
  *    pixel, and the and higher snr from the new pixel and the previously acquired pixel is written to the output 
@@ -92,32 +96,52 @@ void RawToDepthV2_float::processRoi(const uint16_t *roi, uint32_t numBytes)
  *    filled with input data. This is necessary because there may be gaps in the output buffer due to some input
  *    input ROIs not overlapping. processWholeFrame() uses _activeRows to perform row-filling for some of 
  *    the missing rows.
- *  10. _roiIndexFrame  contains an index value for each pixel. The index is simply an integer that increments
- *    with each input ROI. This allows the output software to assign a timestamp to each pixel in the image 
- *    independently 
+ *  10. _roiIndexRows contains an index value for each sensor row. The index is simply an integer that increments
+ *    with each input ROI. Since each ROI covers whole rows, this allows the output software to assign a timestamp
+ *    to each row in the image, and so to each of its pixels, independently 
  *          
  * 
  * @param inst The RawToDepthV2_float instance
+ * @param roiMdat The decoded metadata of this ROI (before the HDR delay).
  * @param roi  The buffer containing the raw roi with metadata as the first row.
  * @param numBytes The size of the input buffer for error checking.
  */
-void RawToDepthV2_float::processOneRoi(RawToDepthV2_float *inst, const uint16_t *roi, uint32_t numBytes)
+void RawToDepthV2_float::processOneRoi(RawToDepthV2_float *inst, const RtdMetadata &roiMdat, const uint16_t *roi, uint32_t numBytes)
 {
-  auto md_ = RtdMetadata(roi, numBytes);
+  auto traceSpan = PipelineTrace::Span("processOneRoi");
   
   if (nullptr == roi || numBytes == 0) 
   {
     return;
   }
   
-  if (!inst->validateMetadata(roi, numBytes)) 
+  if (!inst->validateMetadata(roiMdat, roi, numBytes)) 
   {
     return;
   }
 
-  inst->_hdr.submit(roi, numBytes/sizeof(uint16_t), inst->_fovIdx, !inst->_veryFirstRoiReceived, INPUT_RAW_SHIFT);
-  auto mdat = inst->_hdr.getMetadata();  // metadata needs to be time-delayed to match the roiVector.
-  auto roiVector_f = inst->_hdr.getRoi();
+  // A sampled frame's ROIs are captured as they were received, so that the capture can be replayed (see DspCapture).
+  if (roiMdat.getFirstRoi(inst->_fovIdx) && inst->_streamRows == 0)
+  {
+    if (inst->_dspCapture == nullptr && DspCapture::getInterval() > 0)
+    {
+      inst->_dspCapture = std::make_unique<DspCapture>(inst->_headerNum, inst->_fovIdx);
+    }
+    inst->_capture = inst->_dspCapture != nullptr ? inst->_dspCapture->startFrame() : nullptr;
+  }
+  if (inst->_capture != nullptr)
+  {
+    inst->_capture->addRoi(roi, numBytes);
+    if (roiMdat.getFrameCompleted(inst->_fovIdx))
+    {
+      inst->_captureComplete = std::move(inst->_capture);
+    }
+  }
+
+  // The previous ROI may still be being ingested from what HDR holds.
+  inst->finishIngest();
+  inst->_hdr.submit(roiMdat, roi, numBytes/sizeof(uint16_t), inst->_fovIdx, !inst->_veryFirstRoiReceived, INPUT_RAW_SHIFT, true);
+  const auto &mdat = inst->_hdr.getMetadata();  // metadata needs to be time-delayed to match the roiVector.
 
   if (!inst->_veryFirstRoiReceived && !inst->_hdr.skip() && inst->_fovIdx ==0) 
   {
@@ -127,8 +151,10 @@ void RawToDepthV2_float::processOneRoi(RawToDepthV2_float *inst, const uint16_t
 
   if (mdat.getFirstRoi(inst->_fovIdx)) 
   {
+    // The previous frame was never completed, so neither is its capture.
+    inst->_captureComplete = nullptr;
     // If necessary resizes the buffers containing intermediate data.
-    inst->reset(inst->_hdr.getMetadataVector().data(), ROI_NUM_COLUMNS * NUM_GPIXEL_PHASES * uint32_t(sizeof(uint16_t)));
+    inst->reset(mdat);
   }
   if (inst->_hdr.skip()) 
   {
@@ -139,44 +165,35 @@ void RawToDepthV2_float::processOneRoi(RawToDepthV2_float *inst, const uint16_t
     return;
   }
   
-  // auto localTimer0 = LumoTimers::ScopedTimer(inst->_timers, "RawToDepthV2_float::processRoi() - 0", TIMERS_UPDATE_EVERY);
-  SCOPED_VEC_F(roi0, NUM_GPIXEL_PHASES*mdat.getRoiNumRows()*ROI_NUM_COLUMNS);
-  int freqIdx=0;
-
-  RawToDepthDsp::tapRotation(roiVector_f, roi0, freqIdx, {mdat.getRoiNumRows(), ROI_NUM_COLUMNS}, NUM_GPIXEL_PHASES, mdat.getDoTapAccumulation());
-
-  // auto localTimer1 = LumoTimers::ScopedTimer(inst->_timers, "RawToDepthV2_float::processRoi() - 1", TIMERS_UPDATE_EVERY);
-  SCOPED_VEC_F(roi1, NUM_GPIXEL_PHASES*mdat.getRoiNumRows()*ROI_NUM_COLUMNS);
-  freqIdx=1;
-  RawToDepthDsp::tapRotation(roiVector_f, roi1, freqIdx, {mdat.getRoiNumRows(), ROI_NUM_COLUMNS}, NUM_GPIXEL_PHASES, mdat.getDoTapAccumulation());
-
-  bool changed = false;
-  MAKE_VECTOR2(inst->_fRawFrames[inst->_rawPingOrPong], float_t, NUM_GPIXEL_PHASES*mdat.getFovNumRows(inst->_fovIdx)*mdat.getFovNumColumns(inst->_fovIdx));
-  MAKE_VECTOR(inst->_activeRows[inst->_rawPingOrPong], bool, mdat.getFovNumRows(inst->_fovIdx));
+  bool changed = inst->resizeRawFrames(inst->_ingestSlot, NUM_GPIXEL_PHASES*mdat.getFovNumRows(inst->_fovIdx)*mdat.getFovNumColumns(inst->_fovIdx));
+  MAKE_VECTOR(inst->_activeRows[inst->_ingestSlot], bool, mdat.getFovNumRows(inst->_fovIdx));
   if (changed || mdat.getFirstRoi(inst->_fovIdx))
   {
-    // The dimensions of _fRawFrames is [ping_or_pong][frequency][raw pixels]. These two fills zero-out the buffers for both frequencies of this 
-    // ping-pong state. The transition of the inst->_rawPingOrPong variable happens in this thread just prior to the execution of
+    // The dimensions of _fRawFrames is [slot][frequency][raw pixels]. This zeroes out the buffers for both frequencies of this 
+    // frame slot. The transition of the inst->_ingestSlot variable happens in this thread at the end of
     // processWholeFrame().
-    std::fill(inst->_fRawFrames[inst->_rawPingOrPong][0].begin(), inst->_fRawFrames[inst->_rawPingOrPong][0].end(), 0.0F);
-    std::fill(inst->_fRawFrames[inst->_rawPingOrPong][1].begin(), inst->_fRawFrames[inst->_rawPingOrPong][1].end(), 0.0F);
-    std::fill(inst->_activeRows[inst->_rawPingOrPong].begin(), inst->_activeRows[inst->_rawPingOrPong].end(), false);
-    // roiIndexFrames is pre-initialized to -1 as a flag to indicate uninitialized pixels. Due to the nature of
+    inst->clearRawFrames(inst->_ingestSlot);
+    std::fill(inst->_activeRows[inst->_ingestSlot].begin(), inst->_activeRows[inst->_ingestSlot].end(), false);
+    // roiIndexRows is pre-initialized to -1 as a flag to indicate uninitialized rows. Due to the nature of
     // snr-voting and binning, some rows in the prebinned image might be unassigned.
-    std::fill(inst->_roiIndexFrames[inst->_rawPingOrPong].begin(), inst->_roiIndexFrames[inst->_rawPingOrPong].end(), -1);
+    std::fill(inst->_roiIndexRows[inst->_ingestSlot].begin(), inst->_roiIndexRows[inst->_ingestSlot].end(), -1);
   }
 
-  auto &rawFrames = inst->_fRawFrames[inst->_rawPingOrPong];
-  RawToDepthDsp::snrVoteV2(roi0, roi1, rawFrames, inst->_fovSnrV2, (mdat.getRoiStartRow()-mdat.getFovStartRow(inst->_fovIdx))*ROI_NUM_COLUMNS);
+  // Tap rotation and snr-voting are fused into a single pass that writes directly into the full-frame buffers.
+  auto fovOffset = (mdat.getRoiStartRow()-mdat.getFovStartRow(inst->_fovIdx))*ROI_NUM_COLUMNS;
+  std::array<uint32_t,2> roiSize {mdat.getRoiNumRows(), ROI_NUM_COLUMNS};
+  // Asynchronous if enabled (see setAsyncIngest()): only the bookkeeping below runs alongside it.
+  inst->submitIngest(inst->_ingestSlot, mdat.getDoTapAccumulation(), roiSize, fovOffset);
+
+  // Streaming relies on the ROIs moving down the FOV: the rows above the latest ROI are then final.
+  const auto roiRow = uint32_t(mdat.getRoiStartRow() - mdat.getFovStartRow(inst->_fovIdx));
+  inst->_streamInOrder = inst->_streamInOrder && roiRow >= inst->_streamRoiRow;
+  inst->_streamRoiRow = roiRow;
 
   for (auto rowIdx=0; rowIdx<mdat.getRoiNumRows(); rowIdx++)
   {
-    inst->_activeRows[inst->_rawPingOrPong][mdat.getRoiStartRow() - mdat.getFovStartRow(inst->_fovIdx) + rowIdx] = true;
-    for (auto colIdx=0; colIdx<RtdMetadata::getRoiNumColumns(); colIdx++)
-    {
-      inst->_roiIndexFrames[inst->_rawPingOrPong][(mdat.getRoiStartRow() + rowIdx)*IMAGE_WIDTH + 
-                                                   RtdMetadata::getFovStartColumn(inst->_fovIdx) + colIdx] = inst->_currentRoiIdx;
-    }
+    inst->_activeRows[inst->_ingestSlot][mdat.getRoiStartRow() - mdat.getFovStartRow(inst->_fovIdx) + rowIdx] = true;
+    inst->_roiIndexRows[inst->_ingestSlot][mdat.getRoiStartRow() + rowIdx] = inst->_currentRoiIdx;
   }
 }
 
@@ -17,14 +17,15 @@
 #include "FloatVectorPool.h"
 #include "FovSegment.h"
 #include "RawToDepthCommon.h"
+#include <algorithm>
 #include <cmath>
-#include <LumoTimers.h>
+#include <FastTimers.h>
+#include <PipelineTrace.h>
+#include <PerfCounters.h>
 #include <cassert>
 #include <NearestNeighbor.h>
 #include <iostream>
 #include <fstream>
-#include <future>
-#include "LumoAffinity.h"
 
 // #define DISABLE_ASYNC_PROCESS_WHOLE_FRAME
 
@@ -32,134 +33,565 @@
  * @brief processWholeFrame is called following the reception of the last ROI in an fov, as
  * indicated by the RtdMetadata::getFrameCompleted() == true.
  *
- * On the first call of processWholeFrame(), a separate thread is started. The separate thread waits
- * for whole-frame data to be available, then performs the operations and passes the result to the consumer
- * via the setFovSegment() function.
+ * The whole frame is processed on a thread of the object's FrameScheduler, which performs the operations
+ * and passes the result to the consumer via the setFovSegment() function.
  *
- * All of the parameters necessary for performing whole-FOV processing are captured by (copied into)
- * the localProcessFrameInfo struct and passed to the static routine for processing in a separate
- * thread.
+ * The parameters necessary for performing whole-FOV processing are handed to the localProcessFrameInfo struct
+ * of the frame slot that was just ingested without copying any buffers: the FOV-constant parameters are shared
+ * through the immutable WholeFrameConfig built by realloc(), the per-ROI timestamps are swapped in, and the
+ * slot's own raw frames, active rows and roi indices are referenced by pointer. The slot is then queued for
+ * processing on the scheduler. By default, each FOV has a scheduler of its own with one thread; with the shared
+ * scheduler (see setSchedulerThreads()), the threads process the frames of all FOVs and sensor heads.
  *
  * The setFovSegment function is used as a callback to send the final results back to RawToFovs to present
  * to the consumer.
  *
- * This routine is called sequentially (in the same thread as) processRoi(). Therefore, the management of the
- * ping-pong variable (_rawPingOrPong) is handled here.
+ * This routine is called sequentially (in the same thread as) processRoi(). Therefore, the selection of the
+ * next frame slot to ingest into (_ingestSlot) is handled here.
  *
- * It is assumed that the separate thread localProcessWholeFrame() method has completed execution of the previous
- * FOV prior to the entry to this routine -- otherwise there will be frame drops on the input. This routine calls wait()
- * on the condition variable to wait for the completion of the previous thread as the first step to
- * guarantee that condition.
+ * There are getFrameQueueDepth() slots, so up to getFrameQueueDepth()-1 frames can wait for or undergo
+ * whole-frame processing while the next frame is ingested. When all of them are in use, the frame is
+ * handled according to getFrameQueuePolicy() (see enqueueFrame()).
  *
  * @param setFovSegment The callback function passed in from the caller to allow the localProcessWholeFrame() method to
  * pass out the FovSegment object once computation is complete.
  */
 void RawToDepthV2_float::processWholeFrame(std::function<void(std::shared_ptr<FovSegment>)> setFovSegment)
 {
-  auto *rawFrame0 = _fRawFrames.at(_rawPingOrPong).data();
-  auto *rawFrame1 = &_fRawFrames.at(_rawPingOrPong)[1];
-  auto &activeRows = _activeRows[_rawPingOrPong];
-  auto &roiIndexFrame = _roiIndexFrames[_rawPingOrPong];
-  _rawPingOrPong = (0x01U ^ _rawPingOrPong); // Prep the next first call to processRoi(), which happens immediately following this thread start.
+  // The last ROI of the frame may still be being ingested (see setAsyncIngest()).
+  finishIngest();
 
-  auto localTimer = LumoTimers::ScopedTimer(*_timers, "RawToDepthV2_float:: construct localProcessFrameInfo data.", TIMERS_UPDATE_EVERY);
+  if (_streamRows > 0)
+  {
+    // The rows that haven't been streamed yet complete the FOV, processed here so that they follow the earlier segments.
+    processStreamRows(std::move(setFovSegment), {_streamInOrder ? _streamedRows : 0U, _wholeFrameConfig->size[0]}, lastRoiReceived());
+    return;
+  }
+
+  auto localTimer = FastTimers::Scoped(FAST_TIMER_RTD_FRAME_HANDOFF);
 
-#ifndef DEBUG
-  // https://stackoverflow.com/questions/18359864/passing-arguments-to-stdasync-by-reference-fails
-  //  std::ref because of perfect forwarding.
+  // The capture of a sampled frame goes along with it, and is released if the frame is skipped.
+  auto capture = std::move(_captureComplete);
+  const auto completedNs = FrameTrace::now();
+  const auto framePeriodNs = _lastFrameCompletedNs != 0 ? completedNs - _lastFrameCompletedNs : 0;
+  _lastFrameCompletedNs = completedNs;
+  // At the last step of load shedding, skipping frames deterministically keeps the frame queue from dropping them at random.
+  // The next frame is ingested into the same slot.
+  if (_wholeFrameConfig->loadShedder && _wholeFrameConfig->loadShedder->skipFrame())
   {
-    std::unique_lock mutexLock(*_wholeFrameRunningMutex);
+    return;
+  }
 
-    _wholeFrameRunningConditionVariable->wait(mutexLock, [this]
-                                              { return this->_wholeFrameRunningData->dataProcessed; });
-#endif
-    _wholeFrameRunningData->quitNow = false;       // quitNow
-    _wholeFrameRunningData->dataReady = true;      // dataReady
-    _wholeFrameRunningData->dataProcessed = false; // dataProcessed
-    _wholeFrameRunningData->conditionVariable = _wholeFrameRunningConditionVariable;
-    _wholeFrameRunningData->mutex = _wholeFrameRunningMutex;
-    _wholeFrameRunningData->setFovSegment = setFovSegment;
-    _wholeFrameRunningData->fovIdx = _fovIdx;
-    _wholeFrameRunningData->binning = _binning;
-    _wholeFrameRunningData->size = _size;
-    _wholeFrameRunningData->rowKernelIdx = _rowKernelIdx;
-    _wholeFrameRunningData->columnKernelIdx = _columnKernelIdx;
-    _wholeFrameRunningData->fs = _fs;
-    _wholeFrameRunningData->fsInt = _fsInt;
-    _wholeFrameRunningData->c = _c_mps;
-    _wholeFrameRunningData->minMaxFilterSize = _minMaxFilterSize;
-    _wholeFrameRunningData->performGhostMedian = _performGhostMedian;
-    _wholeFrameRunningData->nearestNeighborFilterLevel = _nearestNeighborFilterLevel;
-    _wholeFrameRunningData->headerNum = getHeaderNum();
-    _wholeFrameRunningData->timestamp = getTimestamp();
-    _wholeFrameRunningData->sensorId = getSensorID();
-    _wholeFrameRunningData->userTag = getUserTag();
-    _wholeFrameRunningData->lastRoiReceived = lastRoiReceived();
-    _wholeFrameRunningData->incompleteFov = _incompleteFov;
-    _wholeFrameRunningData->GCF = getGCF();
-    _wholeFrameRunningData->maxUnambiguousRange = getMaxUnambiguousRange();
-    _wholeFrameRunningData->imageStart = getImageStart();
-    _wholeFrameRunningData->imageStep = getImageStep();
-    _wholeFrameRunningData->roiIndexFrame = roiIndexFrame;
-    _wholeFrameRunningData->timestamps = *getTimestamps(); // take a copy
-    _wholeFrameRunningData->timestampsVec = *getTimestampsVec();
-    _wholeFrameRunningData->lastTimerReport = getLastTimerReport();
-    _wholeFrameRunningData->pixelMask = _pixelMask;
-    _wholeFrameRunningData->fovStart = _sensorFovStart;
-    _wholeFrameRunningData->fovStep = _sensorFovStep;
-    _wholeFrameRunningData->fovSize = _sensorFovSize;
-    _wholeFrameRunningData->fovNumRois = _expectedNumRois;
-    _wholeFrameRunningData->lastRoiIdx = _currentRoiIdx;
-    _wholeFrameRunningData->disableRangeMasking = _disableRangeMasking;
-    _wholeFrameRunningData->snrThresh = _snrThresh;
-    _wholeFrameRunningData->rangeOffsetTemperature = _temperatureCalibration.getRangeOffsetTemperature();
-    _wholeFrameRunningData->disableRtd = _disableRtd;
-    _wholeFrameRunningData->activeRows = activeRows;
-    _wholeFrameRunningData->timers = _timers;
-    _wholeFrameRunningData->rangeLimit = _rangeLimit;
-    _wholeFrameRunningData->rawFrame0 = rawFrame0;
-    _wholeFrameRunningData->rawFrame1 = rawFrame1;
+  // The ingest slot is neither pending nor being processed, so its info can be written without the lock.
+  // The per-ROI buffers are swapped with the slot's buffers from its previous frame, which realloc() resizes at the next first ROI.
+  const auto slot = _ingestSlot;
+  auto &info = *_frameQueue->frames[slot];
+  info.setFovSegment = std::move(setFovSegment);
+  info.config = _wholeFrameConfig;
+  info.lastRoiReceived = lastRoiReceived();
+  info.incompleteFov = _incompleteFov;
+  info.frameTrace = _frameTrace;
+  info.roiIndexRows = &_roiIndexRows[slot];
+  info.timestamps.swap(_timestamps);
+  info.timestampsVec.swap(_timestampsVec);
+  info.lastTimerReport = getLastTimerReport();
+  info.pixelMaskSpans = getPixelMaskSpans(info.config->fovStart, info.config->fovStep, info.config->fovSize[1], info.config->size);
+  info.lastRoiIdx = _currentRoiIdx;
+  info.rangeOffsetTemperature = _temperatureCalibration.getRangeOffsetTemperature();
+  info.activeRows = &_activeRows[slot];
+  info.completedNs = completedNs;
+  info.framePeriodNs = framePeriodNs;
+  info.capture = std::move(capture);
+  setRawFrames(info, slot);
 
 #ifdef DEBUG
-  localProcessFrame(_wholeFrameRunningData);
+  localProcessFrame(_frameQueue->frames[slot]);
 #else
-    if (!_wholeFrameRunning)
+  {
+    std::unique_lock mutexLock(_frameQueue->mutex);
+    _ingestSlot = enqueueFrame(*_frameQueue, slot, getFrameQueuePolicy(), mutexLock); // Prep the next first call to processRoi().
+  }
+  _scheduler->submit(_schedulerSourceId);
+#endif
+}
+
+/**
+ * @brief The number of output rows around a streamed segment that its window includes, so that the filters see the
+ * same neighborhood as when processing the whole FOV: the halos of the banded filters and of the min-max filter,
+ * plus the row next to the window edge that fillMissingRows() can't interpolate.
+ */
+uint32_t RawToDepthV2_float::getStreamHalo(const WholeFrameConfig &config)
+{
+  const auto halos = getBandHalos(config.columnKernelIdx, config.performGhostMedian, config.nearestNeighborFilterLevel);
+  const auto minMaxHalo = config.minMaxFilterSize.size() == 2 ? (config.minMaxFilterSize[0] | 1U) / 2 : 0U;
+  return halos.smoothing + halos.median + halos.nearestNeighbor + minMaxHalo + 1;
+}
+
+/**
+ * @brief Called after each ROI that doesn't complete the FOV. If streaming is enabled (see setStreamRows()), outputs
+ * the next segment of rows once at least getStreamRows() of them are ready.
+ *
+ * An ROI can still be snr-voted into the rows below the start of the latest ROI, and fillMissingRows() looks one row
+ * further up, so the pre-binned rows above the row before it are final. An output row is ready once the rows its
+ * filters look at (getStreamHalo()) are final.
+ */
+void RawToDepthV2_float::processReadyRows(std::function<void(std::shared_ptr<FovSegment>)> setFovSegment)
+{
+  if (_streamRows == 0 || !_streamInOrder || _incompleteFov || lastRoiReceived())
+  {
+    return;
+  }
+
+  const auto &config = *_wholeFrameConfig;
+  const auto finalRows = (_streamRoiRow > 0 ? _streamRoiRow - 1 : 0U) / config.binning[0];
+  const auto halo = getStreamHalo(config);
+  if (finalRows < halo + _streamedRows + _streamRows)
+  {
+    return;
+  }
+
+  const auto readyRows = finalRows - halo;
+  finishIngest();
+  processStreamRows(std::move(setFovSegment), {_streamedRows, readyRows}, false);
+  _streamedRows = readyRows;
+}
+
+/**
+ * @brief Copies a window of the FOV being ingested around the output rows, and queues it for processing on the
+ * FrameScheduler, after the earlier segments, without waiting. The segment is then passed to setFovSegment() from
+ * the scheduler thread (see processScheduledSegment()). The window is the whole FOV if the rows and their halo cover it.
+ *
+ * @param rows The first and one-past-the-last output rows of the segment.
+ * @param lastRoiReceived True for the segment that completes the FOV.
+ */
+void RawToDepthV2_float::processStreamRows(std::function<void(std::shared_ptr<FovSegment>)> setFovSegment,
+                                           std::array<uint32_t,2> rows, bool lastRoiReceived)
+{
+  auto localTimer = FastTimers::Scoped(FAST_TIMER_RTD_FRAME_HANDOFF);
+  const auto &config = *_wholeFrameConfig;
+  const auto halo = getStreamHalo(config);
+  const std::array<uint32_t,2> window = { rows[0] > halo ? rows[0] - halo : 0U, std::min(config.size[0], rows[1] + halo) };
+  const auto slot = _ingestSlot;
+
+  // The buffers of a processed segment are reused, so that they keep their capacity.
+  std::shared_ptr<LocalProcessFrameInfo> infoPtr;
+  {
+    std::lock_guard lock(_streamQueue->mutex);
+    if (!_streamQueue->free.empty())
     {
-      _wholeFrameRunningFuture = std::async(std::launch::async, &processWholeFrameEventLoop, _wholeFrameRunningData);
-      _wholeFrameRunning = true;
+      infoPtr = std::move(_streamQueue->free.back());
+      _streamQueue->free.pop_back();
     }
   }
-  _wholeFrameRunningConditionVariable->notify_one();
+  if (!infoPtr)
+  {
+    infoPtr = std::make_shared<LocalProcessFrameInfo>();
+    infoPtr->frameArena = _streamQueue->frameArena;
+  }
+
+  auto &info = *infoPtr;
+  info.setFovSegment = std::move(setFovSegment);
+  info.lastRoiReceived = lastRoiReceived;
+  info.incompleteFov = _incompleteFov;
+  info.frameTrace = lastRoiReceived ? _frameTrace : FrameTrace();
+  info.streamRoiIndexRows = _roiIndexRows[slot]; // Copied, like the rows below, since the FOV may still be in progress.
+  info.roiIndexRows = &info.streamRoiIndexRows;
+  info.timestamps = _timestamps;
+  info.timestampsVec = _timestampsVec;
+  info.lastTimerReport = getLastTimerReport();
+  info.pixelMaskSpans = getPixelMaskSpans(config.fovStart, config.fovStep, config.fovSize[1], config.size);
+  info.lastRoiIdx = _currentRoiIdx;
+  info.rangeOffsetTemperature = _temperatureCalibration.getRangeOffsetTemperature();
+  info.outputRows = rows;
+  info.windowRow = window[0];
+  info.fovRows = config.size[0];
+
+  if (window[0] == 0 && window[1] == config.size[0])
+  {
+    info.config = _wholeFrameConfig;
+  }
+  else
+  {
+    auto windowConfig = std::make_shared<WholeFrameConfig>(config);
+    windowConfig->size[0] = window[1] - window[0];
+    windowConfig->fovStart[0] = uint16_t(config.fovStart[0] + window[0] * config.fovStep[0]);
+    windowConfig->imageStart[0] = config.imageStart[0] + window[0] * config.imageStep[0];
+    info.config = windowConfig;
+  }
+
+  // The raw frames can have a few rows more than size[0] * binning, which belong to the bottom window.
+  const auto &activeRows = _activeRows[slot];
+  const auto firstRawRow = std::size_t(window[0]) * config.binning[0];
+  const auto endRawRow = window[1] == config.size[0] ? activeRows.size() : std::size_t(window[1]) * config.binning[0];
+  info.streamActiveRows.assign(activeRows.begin() + std::ptrdiff_t(firstRawRow), activeRows.begin() + std::ptrdiff_t(endRawRow));
+  info.activeRows = &info.streamActiveRows;
+  copyRawFrames(info, slot, {firstRawRow, endRawRow});
+
+  {
+    std::lock_guard lock(_streamQueue->mutex);
+    _streamQueue->pending.push_back(std::move(infoPtr));
+  }
+#ifdef DEBUG
+  processScheduledSegment(*_streamQueue);
+#else
+  _scheduler->submit(_streamSourceId);
 #endif
 }
 
 /**
- * @brief The method that is the thread that processes whole frames as they become available.
- * 
- * @param infoPtr Contains a copy of the data necessary to perform whole-frame processing.
+ * @brief Runs on the FrameScheduler once for each segment that processStreamRows() queued, and processes the oldest.
+ * The scheduler runs one item of the source at a time, so the segments of the FOV are passed on in order.
  */
-void RawToDepthV2_float::processWholeFrameEventLoop(std::shared_ptr<LocalProcessFrameInfo> infoPtr)
+void RawToDepthV2_float::processScheduledSegment(StreamQueue &queue)
 {
-  LLogInfo("processWholeFrameEventLoop starts.");
-  while (true)
+  std::unique_lock mutexLock(queue.mutex);
+  if (queue.quitNow || queue.pending.empty())
   {
-    {
-      std::unique_lock mutexLock(*infoPtr->mutex);
-      infoPtr->conditionVariable->wait(mutexLock, [infoPtr]
-                                       { return infoPtr->dataReady || infoPtr->quitNow; });
+    return;
+  }
+  auto infoPtr = std::move(queue.pending.front());
+  queue.pending.pop_front();
+  mutexLock.unlock();
+
+  localProcessFrame(infoPtr);
+  infoPtr->setFovSegment = nullptr; // Releases the consumer's callback state.
 
-      if (infoPtr->quitNow)
+  mutexLock.lock();
+  queue.free.push_back(std::move(infoPtr));
+}
+
+/**
+ * @brief Queues the frame in slot for whole-frame processing and returns the slot to ingest the next frame into.
+ * Called with the queue mutex held by lock.
+ *
+ * If no slot is free, the policy decides: BLOCK waits for the processing thread to finish a frame, DROP_OLDEST
+ * discards the oldest frame that hasn't started processing, and DROP_NEWEST discards this frame. With the
+ * minimum depth of two slots, the only frame that hasn't started processing is this one, so DROP_OLDEST
+ * behaves like DROP_NEWEST.
+ */
+uint32_t RawToDepthV2_float::enqueueFrame(FrameQueue &queue, uint32_t slot, FrameQueuePolicy policy, std::unique_lock<std::mutex> &lock)
+{
+  auto findFreeSlot = [&queue, slot]() -> int32_t
+  {
+    for (uint32_t idx = 0; idx < queue.frames.size(); idx++)
+    {
+      if (idx != slot && int32_t(idx) != queue.processingSlot &&
+          std::find(queue.pending.begin(), queue.pending.end(), idx) == queue.pending.end())
       {
-        LLogInfo("processWholeFrameEventLoop quitting now.");
-        return;
+        return int32_t(idx);
       }
+    }
+    return -1;
+  };
+
+  auto freeSlot = findFreeSlot();
+  if (freeSlot < 0 && policy == FrameQueuePolicy::DROP_NEWEST)
+  {
+    queue.stats.dropped++;
+    LLogWarning("Dropping FOV: whole-frame processing is behind. dropped=" << queue.stats.dropped);
+    return slot;
+  }
+
+  queue.pending.push_back(slot);
+  queue.stats.queued++;
+  queue.stats.maxDepth = std::max(queue.stats.maxDepth, uint32_t(queue.pending.size()) + (queue.processingSlot >= 0 ? 1U : 0U));
+  if (freeSlot >= 0)
+  {
+    return uint32_t(freeSlot);
+  }
+
+  if (policy == FrameQueuePolicy::DROP_OLDEST)
+  {
+    auto oldest = queue.pending.front();
+    queue.pending.pop_front();
+    queue.stats.dropped++;
+    LLogWarning("Dropping FOV: whole-frame processing is behind. dropped=" << queue.stats.dropped);
+    return oldest;
+  }
+
+  queue.stats.blocked++;
+  queue.conditionVariable.wait(lock, [&queue, &freeSlot, &findFreeSlot]
+                               { freeSlot = findFreeSlot(); return freeSlot >= 0 || queue.quitNow; });
+  return freeSlot >= 0 ? uint32_t(freeSlot) : slot;
+}
+
+/**
+ * @brief The number of rows above and below an output band that each of the banded filters needs.
+ * The filters are applied in the order smoothing, median, nearest neighbor; each one needs its own halo
+ * of valid input rows on top of the halos of the filters that follow it.
+ */
+RawToDepthV2_float::BandHalos RawToDepthV2_float::getBandHalos(uint32_t columnKernelIdx, bool performGhostMedian,
+                                                               uint16_t nearestNeighborFilterLevel)
+{
+  BandHalos halos;
+  halos.smoothing = uint32_t(RawToDepthDsp::_fKernels[columnKernelIdx].size() / 2); // vertical smoothing kernel
+  // medianFilterPlus() uses kernelIndices = {rowKernelIdx, columnKernelIdx}; the vertical extent comes from the second.
+  halos.median = performGhostMedian ? uint32_t((RawToDepthDsp::_fKernels[columnKernelIdx].size() | 1U) / 2) : 0;
+  halos.nearestNeighbor = NearestNeighbor::getHalo(nearestNeighborFilterLevel);
+  return halos;
+}
+
+/**
+ * @brief Splits the image rows into bands of at least tileRows rows each.
+ *
+ * @return The number of bands. 1 (untiled) if tiling is disabled or the image is too short to split.
+ */
+uint32_t RawToDepthV2_float::getNumBands(uint32_t numRows, uint32_t tileRows)
+{
+  if (tileRows == 0 || numRows < 2 * tileRows)
+  {
+    return 1;
+  }
+  return numRows / tileRows;
+}
+
+/**
+ * @brief Returns the number of pixels in the largest band, including its halos.
+ */
+std::size_t RawToDepthV2_float::getBandSize(std::array<uint32_t,2> size, uint32_t tileRows, BandHalos halos)
+{
+  const auto numBands = getNumBands(size[0], tileRows);
+  if (numBands == 1)
+  {
+    return std::size_t(size[0]) * std::size_t(size[1]);
+  }
+  auto bandRows = (size[0] + numBands - 1) / numBands + 2 * (halos.smoothing + halos.median + halos.nearestNeighbor);
+  return std::size_t(std::min(bandRows, size[0])) * std::size_t(size[1]);
+}
+
+/**
+ * @brief Returns the output rows that can hold data, as sorted, disjoint [first, end) intervals.
+ *
+ * The raw frame rows that no ROI covered are zero. After RawToDepthDsp::fillMissingRows(), a pre-binned row holds
+ * data if it is active, or if it is an interior row next to an active one; an output row holds data if any of its
+ * pre-binned rows does. All of the other output rows are zero through binning and phase calculation.
+ *
+ * @param activeRows One entry per pre-binned row (at least prebinnedRows). True if an ROI had data in the row.
+ * @param prebinnedRows The number of pre-binned rows that are binned into output rows.
+ * @param binningRows The number of pre-binned rows per output row.
+ */
+std::vector<std::array<uint32_t,2>> RawToDepthV2_float::getLiveRows(const std::vector<bool> &activeRows, uint32_t prebinnedRows,
+                                                                    uint32_t binningRows)
+{
+  std::vector<std::array<uint32_t,2>> rows;
+  auto isActive = [&activeRows](uint32_t row) { return row < activeRows.size() && activeRows[row]; };
+  for (uint32_t outputRow = 0; outputRow < prebinnedRows / binningRows; outputRow++)
+  {
+    bool live = false;
+    for (auto row = outputRow * binningRows; row < (outputRow + 1) * binningRows && !live; row++)
+    {
+      const bool interior = prebinnedRows >= 3 && row > 0 && row + 1 < prebinnedRows;
+      live = isActive(row) || (interior && (isActive(row - 1) || isActive(row + 1)));
+    }
+    if (!live)
+    {
+      continue;
+    }
+    if (!rows.empty() && rows.back()[1] == outputRow)
+    {
+      rows.back()[1]++;
+    }
+    else
+    {
+      rows.push_back({outputRow, outputRow + 1});
+    }
+  }
+  return rows;
+}
 
-      infoPtr->dataReady = false;
-      localProcessFrame(infoPtr);
+/**
+ * @brief Expands each of the sorted, disjoint row intervals by halo rows on both sides, clamped to numRows,
+ * and merges the ones that overlap.
+ */
+std::vector<std::array<uint32_t,2>> RawToDepthV2_float::expandRows(const std::vector<std::array<uint32_t,2>> &rows, uint32_t halo,
+                                                                   uint32_t numRows)
+{
+  std::vector<std::array<uint32_t,2>> expanded;
+  for (const auto &interval : rows)
+  {
+    const std::array<uint32_t,2> grown = { interval[0] > halo ? interval[0] - halo : 0U, std::min(numRows, interval[1] + halo) };
+    if (!expanded.empty() && expanded.back()[1] >= grown[0])
+    {
+      expanded.back()[1] = std::max(expanded.back()[1], grown[1]);
     }
-    infoPtr->dataProcessed = true;
-    infoPtr->conditionVariable->notify_one();
+    else
+    {
+      expanded.push_back(grown);
+    }
+  }
+  return expanded;
+}
+
+/**
+ * @brief Returns the number of sets of band buffers needed to process numBands bands: one for each worker that
+ * can be working on a band at the same time.
+ */
+uint32_t RawToDepthV2_float::getNumBandBuffers(uint32_t numBands, const std::shared_ptr<WorkerPool> &workerPool)
+{
+  const auto numWorkers = workerPool ? workerPool->getNumWorkers() : 1U;
+  return std::min({numBands, numWorkers, MAX_NUM_WORKERS});
+}
+
+/**
+ * @brief Returns the sizes of the FrameArena buffers that localProcessFrame() allocates, in allocation order,
+ * so that the arena can be sized once when the frame geometry changes.
+ *
+ * @param size The binned output size (rows, columns).
+ * @param rawFrameSize The number of elements in each of the full-frame raw buffers (_fRawFrames), or 0 if the raw
+ *                     frames are binned without filling their missing rows first (RawToDepthV2_fixed).
+ * @param tileRows The minimum number of output rows per band, or 0 for untiled processing.
+ * @param halos The halos required by the banded filters.
+ * @param numBandBuffers The number of sets of band buffers (see getNumBandBuffers()).
+ */
+std::vector<std::size_t> RawToDepthV2_float::getFrameArenaSizes(std::array<uint32_t,2> size, std::size_t rawFrameSize,
+                                                                uint32_t tileRows, BandHalos halos, uint32_t numBandBuffers)
+{
+  const auto imsize = std::size_t(size[0]) * std::size_t(size[1]);
+  const auto rawSize = NUM_GPIXEL_PHASES * imsize;
+  std::vector<std::size_t> sizes { rawSize, rawSize }; // f0/f1RawFovBinned
+  if (rawFrameSize > 0)
+  {
+    sizes.insert(sizes.end(), { rawFrameSize, rawFrameSize }); // f0/f1RawFilled
+  }
+  sizes.insert(sizes.end(), {
+    imsize, imsize, imsize, imsize, imsize,          // f0/f1PhaseFov, fSignals, fSnr, fBackground
+    imsize, imsize, imsize,                          // mFrame, fRanges, fMinMaxMask
+  });
+
+  const auto bandSize = getBandSize(size, tileRows, halos);
+  const auto planesBandSize = 2 * NUM_GPIXEL_PHASES * bandSize;
+  for (uint32_t bufferIdx = 0; bufferIdx < numBandBuffers; bufferIdx++)
+  {
+    sizes.insert(sizes.end(), {
+      planesBandSize, planesBandSize,                // band rawPlanes, smoothedPlanes
+      bandSize, bandSize, bandSize, bandSize,        // band phase0/1, mFrame, ranges
+      bandSize, bandSize,                            // band medianRanges, filteredRanges
+    });
+  }
+  return sizes;
+}
+
+/**
+ * @brief Runs the neighborhood stages of whole-frame processing (smoothing, phase correction, range,
+ * median and nearest-neighbor filtering) on one band of output rows.
+ *
+ * Each stage is run on the output rows plus the halo of rows needed by the stages that follow it, so
+ * the output rows are identical to those of processing the whole frame at once, while the intermediate
+ * buffers are small enough to stay cache resident.
+ *
+ * @param config The frame parameters.
+ * @param input The full-frame binned raw data and phases.
+ * @param band The per-band intermediate buffers. Resized here; their capacity must fit the largest band.
+ * @param outputRows The first and one-past-the-last output rows of this band.
+ * @param mFrame Output: receives the outputRows of the full-frame M values (see computeWholeFrameRange()).
+ * @param fRanges Output: receives the outputRows of the full-frame filtered ranges.
+ */
+void RawToDepthV2_float::processBand(const WholeFrameConfig &config, const BandInput &input, BandBuffers &band,
+                                     std::array<uint32_t,2> outputRows, RtdVec &mFrame, RtdVec &fRanges)
+{
+  auto traceSpan = PipelineTrace::Span("processBand");
+  const auto numRows = config.size[0];
+  const auto numCols = std::size_t(config.size[1]);
+  const auto halos = getBandHalos(config.columnKernelIdx, config.performGhostMedian, config.nearestNeighborFilterLevel);
+
+  auto expand = [numRows](std::array<uint32_t,2> rows, uint32_t halo) -> std::array<uint32_t,2> {
+    return { rows[0] > halo ? rows[0] - halo : 0U, std::min(numRows, rows[1] + halo) };
+  };
+  const auto nnRows = expand(outputRows, halos.nearestNeighbor);
+  const auto medianRows = expand(nnRows, halos.median);
+  const auto smoothRows = expand(medianRows, halos.smoothing);
+
+  const std::array<uint32_t,2> smoothSize = { smoothRows[1] - smoothRows[0], config.size[1] };
+  const auto smoothPixels = std::size_t(smoothSize[0]) * numCols;
+  const auto smoothOffset = std::size_t(smoothRows[0]) * numCols;
+
+  constexpr uint32_t numPlanes { 2 * NUM_GPIXEL_PHASES };
+  for (auto *vec : {band.rawPlanes, band.smoothedPlanes})
+  {
+    vec->resize(numPlanes * smoothPixels);
+  }
+  for (auto *vec : {band.phase0, band.phase1, band.mFrame, band.ranges})
+  {
+    vec->resize(smoothPixels);
+  }
+
+  // The band's rows are copied into the tap-planar layout.
+  RawToDepthDsp::deinterleaveTaps(input.raw0->data() + NUM_GPIXEL_PHASES * smoothOffset, band.rawPlanes->data(),
+                                  smoothPixels, smoothPixels);
+  RawToDepthDsp::deinterleaveTaps(input.raw1->data() + NUM_GPIXEL_PHASES * smoothOffset,
+                                  band.rawPlanes->data() + NUM_GPIXEL_PHASES * smoothPixels, smoothPixels, smoothPixels);
+  std::copy_n(input.phase0->begin() + std::ptrdiff_t(smoothOffset), smoothPixels, band.phase0->begin());
+  std::copy_n(input.phase1->begin() + std::ptrdiff_t(smoothOffset), smoothPixels, band.phase1->begin());
+
+  RawToDepthDsp::smoothPlanes(*band.rawPlanes, *band.smoothedPlanes, smoothSize, numPlanes, config.rowKernelIdx, config.columnKernelIdx);
+  RawToDepthDsp::computeWholeFrameRangePlanar(*band.smoothedPlanes, *band.phase0, *band.phase1, *band.ranges,
+                                              config.phaseUnwrap, *band.mFrame);
+
+  const auto outputPixels = std::size_t(outputRows[1] - outputRows[0]) * numCols;
+  if (input.capture != nullptr)
+  {
+    const auto outputOffset = std::size_t(outputRows[0]) * numCols;
+    const auto first = outputOffset - smoothOffset;
+    RawToDepthDsp::smoothPhasePlanar(*band.smoothedPlanes, *band.phase0, *band.phase1, {first, first + outputPixels},
+                                     input.capture->phase0.data() + outputOffset, input.capture->phase1.data() + outputOffset);
+  }
+  std::copy_n(band.mFrame->begin() + std::ptrdiff_t(std::size_t(outputRows[0] - smoothRows[0]) * numCols), outputPixels,
+              mFrame.begin() + std::ptrdiff_t(std::size_t(outputRows[0]) * numCols));
+
+  // The median filter only needs to run on the rows used by the nearest-neighbor filter.
+  const std::array<uint32_t,2> medianSize = { medianRows[1] - medianRows[0], config.size[1] };
+  const auto medianPixels = std::size_t(medianSize[0]) * numCols;
+  band.medianRanges->resize(medianPixels);
+  band.filteredRanges->resize(medianPixels);
+  std::copy_n(band.ranges->begin() + std::ptrdiff_t(std::size_t(medianRows[0] - smoothRows[0]) * numCols), medianPixels,
+              band.medianRanges->begin());
+  RawToDepthDsp::medianFilterPlus(*band.medianRanges, *band.filteredRanges, {config.rowKernelIdx, config.columnKernelIdx},
+                                  medianSize, config.performGhostMedian, config.medianOffsets.get());
+
+  // Reuse medianRanges as the input to the nearest-neighbor filter, which runs in place.
+  std::array<uint32_t,2> nnSize = { nnRows[1] - nnRows[0], config.size[1] };
+  const auto nnPixels = std::size_t(nnSize[0]) * numCols;
+  band.medianRanges->resize(nnPixels);
+  std::copy_n(band.filteredRanges->begin() + std::ptrdiff_t(std::size_t(nnRows[0] - medianRows[0]) * numCols), nnPixels,
+              band.medianRanges->begin());
+  NearestNeighbor::removeOutliers(*band.medianRanges, config.nearestNeighborFilterLevel, nnSize);
+
+  std::copy_n(band.medianRanges->begin() + std::ptrdiff_t(std::size_t(outputRows[0] - nnRows[0]) * numCols), outputPixels,
+              fRanges.begin() + std::ptrdiff_t(std::size_t(outputRows[0]) * numCols));
+}
+
+/**
+ * @brief Runs on the FrameScheduler once for each frame that processWholeFrame() queued, and processes the oldest
+ * pending frame. The frame may have been dropped from the queue since (FrameQueuePolicy::DROP_OLDEST), in which case
+ * there may be nothing left to process. The queue lock is released while the frame is processed, so that
+ * processWholeFrame() can queue further frames in the meantime.
+ *
+ * @param queue The frame slots and the queue of slots waiting to be processed.
+ */
+void RawToDepthV2_float::processScheduledFrame(FrameQueue &queue)
+{
+  std::unique_lock mutexLock(queue.mutex);
+  if (queue.quitNow || queue.pending.empty())
+  {
+    return;
+  }
+
+  const auto slot = queue.pending.front();
+  queue.pending.pop_front();
+  queue.processingSlot = int32_t(slot);
+  auto infoPtr = queue.frames[slot];
+
+  mutexLock.unlock();
+  localProcessFrame(infoPtr);
+  if (infoPtr->config->loadShedder)
+  {
+    infoPtr->config->loadShedder->addFrame(FrameTrace::now() - infoPtr->completedNs, infoPtr->framePeriodNs);
   }
+  mutexLock.lock();
+
+  queue.processingSlot = -1;
+  queue.stats.processed++;
+  queue.conditionVariable.notify_all();
 }
 
 /**
@@ -189,19 +621,21 @@ void RawToDepthV2_float::processWholeFrameEventLoop(std::shared_ptr<LocalProcess
  *     b) The sum of signal from each frequency: fSignals
  *     c) The sum of SNR from each frequency: fSnr
  *     d) The average of background from each frequency: fBackground
+ *     For the 16-bit raw frames of RawToDepthV2_fixed, steps 2 to 4 are performed in a single pass with integer sums
+ *     and phase by binAndCalculatePhase().
  *  5. (Ghost Mitigation: smoothed raw) Raw data smoothing.
- *     The binned raw data (f0/f1RawFovbinned) buffers are independently smoothed using smoothSummedData() and
- *     written to fF0/fF1SummedSmoothed.
+ *     Each band of the binned raw data (f0/f1RawFovbinned) is copied into six tap planes, three per frequency, which
+ *     are smoothed together by smoothPlanes().
  *
- *     The smoothed data is then used to recompute the phase and perform a phase correction by calling calculatePhaseSmooth()
- *     and putting the results into fSmoothedPhases0/1 and fCorrectedPhases0/1.
+ *     The smoothed data is then used to recompute the phase of both frequencies and perform a phase correction, as in
+ *     calculatePhaseSmooth(), in the same pass as the range (computeWholeFrameRangePlanar()).
  *
  *     This phase correction will adjust the phase by 0 or +/-1 (full phase rotations) based on the phase of the
  *     neighborhood computed from the smoothed raw data.
  *
  *     This correction helps to remove ghosting at sharp edges and reduces the frequency of errors at phase transition boundaries.
- *  6. The smoothed and corrected phases for each frequency (fSmoothedPhases0/1 and fCorrectedPhases0/1) are then used to compute
- *     range values for each output pixel in the binned image.
+ *  6. The smoothed and corrected phases for each frequency are then used to compute range values for each output pixel
+ *     in the binned image.
  *  7. (Phase error reduction: min-max). The values in mFrame are an intermediate value computed during the range processing. It represents
  *     the integer number of phase transitions for one of the frequencies. A min-max filter is run against this data and an output
  *     mask (fMinMaxMask) is generated.
@@ -216,15 +650,18 @@ void RawToDepthV2_float::processWholeFrameEventLoop(std::shared_ptr<LocalProcess
  * 10. Output.
  *    A data structure of type FovSegment is created to pass to the downstream network consumer.
  *    Static getter methods (getRange(), getSnr(), getBackground(), getSignal()) are called to convert the local float-point variables into
- *    the 16-bit formats required by the network stream.
+ *    the 16-bit formats required by the network stream. They write into a FovPlanes block drawn from the FOV's pool.
  *    Other values needed by the FovSegment are pulled from the localProcessFrameInfo struct that contains copies of the variables from the
  *    RawToDepthV2_float class.
  */
 void RawToDepthV2_float::localProcessFrame(std::shared_ptr<LocalProcessFrameInfo> infoPtr)
 {
   LocalProcessFrameInfo &info = *infoPtr;
+  const WholeFrameConfig &config = *info.config;
+  info.frameTrace.stamp(TRACE_WHOLE_FRAME_START);
+  auto capture = std::move(info.capture); // Released on any early return, so that the snapshot can be reused.
 
-  if (info.disableRtd)
+  if (config.disableRtd)
   {
     return;
   }
@@ -235,138 +672,337 @@ void RawToDepthV2_float::localProcessFrame(std::shared_ptr<LocalProcessFrameInfo
     return;
   }
 
-  if (info.fovNumRois != info.lastRoiIdx + 1 ||
-      !info.lastRoiReceived)
+  // Streamed segments of an FOV that is still being received are processed before its last ROI.
+  const bool streamedSegment = info.outputRows[1] > info.outputRows[0];
+  if (!(streamedSegment && !info.lastRoiReceived) &&
+      (config.fovNumRois != info.lastRoiIdx + 1 || !info.lastRoiReceived))
   {
     return;
   }
 
-  auto localTimer = LumoTimers::ScopedTimer(*info.timers, "RawToDepthV2_float::processWholeFrame()", TIMERS_UPDATE_EVERY);
+  auto localTimer = FastTimers::Scoped(FAST_TIMER_RTD_WHOLE_FRAME);
+  auto localCounters = PerfCounters::Scoped(PERF_STAGE_RTD_WHOLE_FRAME, config.fovIdx);
+  auto traceSpan = PipelineTrace::Span("localProcessFrame");
 
   // Note: Sometimes image height % binning != 0, so rawFrame0/1 can be a few rows longer than prebinnedSize
-  // Run this thread on the first A72
-  LumoAffinity::setAffinity(LumoAffinity::A72_0);
-
-  auto size = info.size[0] * info.size[1];
-  std::array<uint32_t, 2> prebinnedSize = {info.size[0] * info.binning[0], info.size[1] * info.binning[1]}; // lose a few rows at the bottom if rawFrame0.size() % binning != 0
-
-  SCOPED_VEC_F(f0RawFovBinned, NUM_GPIXEL_PHASES * size);
-  SCOPED_VEC_F(f1RawFovBinned, NUM_GPIXEL_PHASES * size);
 
+  auto size = config.size[0] * config.size[1];
+  if (capture != nullptr)
+  {
+    capture->setSize(config.size);
+  }
+  std::array<uint32_t, 2> prebinnedSize = {config.size[0] * config.binning[0], config.size[1] * config.binning[1]}; // lose a few rows at the bottom if rawFrame0.size() % binning != 0
+
+  // All of the frame-sized intermediates come from the arena, which is reset here and reused every frame.
+  // The allocation order must match getFrameArenaSizes().
+  auto &arena = *info.frameArena;
+  arena.reserve(config.frameArenaSizes);
+  arena.reset();
+
+  auto &f0RawFovBinned = arena.alloc(NUM_GPIXEL_PHASES * size);
+  auto &f1RawFovBinned = arena.alloc(NUM_GPIXEL_PHASES * size);
+
+  // The output rows that can hold data. The others are zero through filling, binning and phase calculation, so they
+  // are zero-filled rather than computed, and so are the rows of the bands farther than their halos from any live row.
+  const auto numCols = std::size_t(config.size[1]);
+  const auto liveRows = config.skipInactiveRows ?
+    getLiveRows(*info.activeRows, prebinnedSize[0], config.binning[0]) :
+    std::vector<std::array<uint32_t,2>>{{0, config.size[0]}};
+  auto zeroDeadRows = [&liveRows, numCols](std::vector<float_t> &vec, std::size_t pixelSize)
+  {
+    const auto rowSize = std::ptrdiff_t(numCols * pixelSize);
+    auto next = vec.begin();
+    for (const auto &rows : liveRows)
+    {
+      std::fill(next, vec.begin() + rows[0] * rowSize, 0.0F);
+      next = vec.begin() + rows[1] * rowSize;
+    }
+    std::fill(next, vec.end(), 0.0F);
+  };
+  zeroDeadRows(f0RawFovBinned, NUM_GPIXEL_PHASES);
+  zeroDeadRows(f1RawFovBinned, NUM_GPIXEL_PHASES);
+
+  // The fixed-point raw frames (RawToDepthV2_fixed) are filled and binned along with the phase calculation below.
+  const bool fixedPoint = info.fixedRawFrame0 != nullptr;
+  if (!fixedPoint)
   {
-    // auto fillAndBinTimer = LumoTimers::ScopedTimer(info.timers, "RawToDepthV2_float::processWholeFrame() -- fill and bin", TIMERS_UPDATE_EVERY);
-    SCOPED_VEC_F(f0RawFilled, info.rawFrame0->size());
-    SCOPED_VEC_F(f1RawFilled, info.rawFrame1->size());
+    auto fillAndBinTimer = FastTimers::Scoped(FAST_TIMER_RTD_FILL_AND_BIN);
+    auto fillAndBinCounters = PerfCounters::Scoped(PERF_STAGE_RTD_FILL_AND_BIN, config.fovIdx);
+    auto fillAndBinSpan = PipelineTrace::Span("fill_and_bin");
+    auto &f0RawFilled = arena.alloc(info.rawFrame0->size());
+    auto &f1RawFilled = arena.alloc(info.rawFrame1->size());
 
-    RawToDepthDsp::fillMissingRows(*info.rawFrame0, f0RawFilled, prebinnedSize, info.activeRows);
-    RawToDepthDsp::fillMissingRows(*info.rawFrame1, f1RawFilled, prebinnedSize, info.activeRows);
+    for (const auto &rows : liveRows)
+    {
+      const std::array<uint32_t,2> prebinnedRows = { rows[0] * config.binning[0], rows[1] * config.binning[0] };
+      RawToDepthDsp::fillMissingRows(*info.rawFrame0, f0RawFilled, prebinnedSize, *info.activeRows, prebinnedRows);
+      RawToDepthDsp::fillMissingRows(*info.rawFrame1, f1RawFilled, prebinnedSize, *info.activeRows, prebinnedRows);
 
-    Binning::binMxN(f0RawFilled, f0RawFovBinned, prebinnedSize, info.binning);
-    Binning::binMxN(f1RawFilled, f1RawFovBinned, prebinnedSize, info.binning);
+      if (config.binKernel != nullptr)
+      {
+        config.binKernel(f0RawFilled, f0RawFovBinned, prebinnedSize, rows);
+        config.binKernel(f1RawFilled, f1RawFovBinned, prebinnedSize, rows);
+      }
+      else
+      {
+        LLogErr("MxN binning is not supported. Binning is set to " << config.binning[0] << "x" << config.binning[1]);
+      }
+    }
   }
 
-  SCOPED_VEC_F(f0PhaseFov, size);
-  SCOPED_VEC_F(f1PhaseFov, size);
-  SCOPED_VEC_F(fSignals, size);
-  SCOPED_VEC_F(fSnr, size);
-  SCOPED_VEC_F(fBackground, size);
+  auto &f0PhaseFov = arena.alloc(size);
+  auto &f1PhaseFov = arena.alloc(size);
+  auto &fSignals = arena.alloc(size);
+  auto &fSnr = arena.alloc(size);
+  auto &fBackground = arena.alloc(size);
   {
-    // auto calcPhaseTimer = LumoTimers::ScopedTimer(info.timers, "RawToDepthV2_float::processWholeFrame() -- calc phase", TIMERS_UPDATE_EVERY);
+    auto calcPhaseTimer = FastTimers::Scoped(FAST_TIMER_RTD_CALC_PHASE);
+    auto calcPhaseCounters = PerfCounters::Scoped(PERF_STAGE_RTD_CALC_PHASE, config.fovIdx);
+    auto calcPhaseSpan = PipelineTrace::Span("calc_phase");
     // prefill signals, snr, background with zeros. calculatePhase now sums into the buffers.
     // _fSignals, _fSnr, _fBackground are only accessed in this method.
     std::fill(fSignals.begin(), fSignals.end(), 0.0F);
     std::fill(fSnr.begin(), fSnr.end(), 0.0F);
     std::fill(fBackground.begin(), fBackground.end(), 0.0F);
 
-    RawToDepthDsp::calculatePhase(f0RawFovBinned, f0PhaseFov, fSignals, fSnr, fBackground, float_t(info.binning[0] * info.binning[1]));
-    RawToDepthDsp::calculatePhase(f1RawFovBinned, f1PhaseFov, fSignals, fSnr, fBackground, float_t(info.binning[0] * info.binning[1]));
+    zeroDeadRows(f0PhaseFov, 1);
+    zeroDeadRows(f1PhaseFov, 1);
+    for (const auto &rows : liveRows)
+    {
+      if (fixedPoint)
+      {
+        RawToDepthDsp::binAndCalculatePhase(*info.fixedRawFrame0, *info.activeRows, prebinnedSize, config.binning,
+                                            f0RawFovBinned, f0PhaseFov, fSignals, fSnr, fBackground, rows);
+        RawToDepthDsp::binAndCalculatePhase(*info.fixedRawFrame1, *info.activeRows, prebinnedSize, config.binning,
+                                            f1RawFovBinned, f1PhaseFov, fSignals, fSnr, fBackground, rows);
+      }
+      else
+      {
+        const std::array<std::size_t,2> pixels = { rows[0] * numCols, rows[1] * numCols };
+        RawToDepthDsp::calculatePhase(f0RawFovBinned, f0PhaseFov, fSignals, fSnr, fBackground, float_t(config.binning[0] * config.binning[1]), pixels);
+        RawToDepthDsp::calculatePhase(f1RawFovBinned, f1PhaseFov, fSignals, fSnr, fBackground, float_t(config.binning[0] * config.binning[1]), pixels);
+      }
+    }
   }
 
-  SCOPED_VEC_F(fF0SummedSmoothed, f0RawFovBinned.size()); // Allocates a std::vector<float_t>
-  SCOPED_VEC_F(fF1SummedSmoothed, f1RawFovBinned.size());
-  {
-    // auto smoothingTimer = LumoTimers::ScopedTimer(info.timers, "RawToDepthV2_float::processWholeFrame() -- smooth", TIMERS_UPDATE_EVERY);
-    RawToDepthDsp::smoothSummedData(f0RawFovBinned, fF0SummedSmoothed, info.size, info.rowKernelIdx, info.columnKernelIdx);
-    RawToDepthDsp::smoothSummedData(f1RawFovBinned, fF1SummedSmoothed, info.size, info.rowKernelIdx, info.columnKernelIdx);
-  }
+  auto &mFrame = arena.alloc(size);
+  auto &fRanges = arena.alloc(size);
+  auto &fMinMaxMask = arena.alloc(size);
 
-  SCOPED_VEC_F(fSmoothedPhases0, size);
-  SCOPED_VEC_F(fSmoothedPhases1, size);
-  SCOPED_VEC_F(fCorrectedPhases0, size);
-  SCOPED_VEC_F(fCorrectedPhases1, size);
-  SCOPED_VEC_F(mFrame, size);
-  SCOPED_VEC_F(ranges, size);
-  SCOPED_VEC_F(fRanges, size);
-  SCOPED_VEC_F(fMinMaxMask, size);
+  // The output rows within the band halos of a live row. mFrame and fRanges are zero in all of the others.
+  const auto halos = getBandHalos(config.columnKernelIdx, config.performGhostMedian, config.nearestNeighborFilterLevel);
+  const auto bandRows = expandRows(liveRows, halos.smoothing + halos.median + halos.nearestNeighbor, config.size[0]);
 
   {
-    // auto phaseSmoothRangeTimer = LumoTimers::ScopedTimer(info.timers, "RawToDepthV2_float::processWholeFrame() -- calc phase smooth, range", TIMERS_UPDATE_EVERY);
-    RawToDepthDsp::calculatePhaseSmooth(fF0SummedSmoothed, fSmoothedPhases0, f0PhaseFov, fCorrectedPhases0, 0);
-    RawToDepthDsp::calculatePhaseSmooth(fF1SummedSmoothed, fSmoothedPhases1, f1PhaseFov, fCorrectedPhases1, 1);
-    RawToDepthDsp::computeWholeFrameRange(fSmoothedPhases0, fSmoothedPhases1, fCorrectedPhases0, fCorrectedPhases1, ranges, info.fs, info.fsInt, info.c, mFrame);
+    auto bandsTimer = FastTimers::Scoped(FAST_TIMER_RTD_BANDS);
+    auto bandsCounters = PerfCounters::Scoped(PERF_STAGE_RTD_BANDS, config.fovIdx);
+    auto bandsSpan = PipelineTrace::Span("bands");
+    // The band buffers are sized for the largest band; processBand() resizes them within that capacity.
+    const auto numBands = getNumBands(config.size[0], config.tileRows);
+    const auto bandSize = getBandSize(config.size, config.tileRows, halos);
+    const auto planesBandSize = 2 * NUM_GPIXEL_PHASES * bandSize;
+
+    // Each worker gets its own set of band buffers. They are allocated here, on this thread, since the arena isn't thread safe.
+    const auto numBandBuffers = getNumBandBuffers(numBands, config.workerPool);
+    std::array<BandBuffers, MAX_NUM_WORKERS> bands {};
+    for (uint32_t bufferIdx = 0; bufferIdx < numBandBuffers; bufferIdx++)
+    {
+      auto &band = bands[bufferIdx];
+      band.rawPlanes = &arena.alloc(planesBandSize);
+      band.smoothedPlanes = &arena.alloc(planesBandSize);
+      band.phase0 = &arena.alloc(bandSize);
+      band.phase1 = &arena.alloc(bandSize);
+      band.mFrame = &arena.alloc(bandSize);
+      band.ranges = &arena.alloc(bandSize);
+      band.medianRanges = &arena.alloc(bandSize);
+      band.filteredRanges = &arena.alloc(bandSize);
+    }
+
+    // The bands write disjoint rows of mFrame and fRanges, so they can be processed in any order.
+    const BandInput input { &f0RawFovBinned, &f1RawFovBinned, &f0PhaseFov, &f1PhaseFov, capture.get() };
+    auto runBand = [&config, &input, &bands, &mFrame, &fRanges, &bandRows, numBands, numCols](uint32_t bandIdx, uint32_t workerIdx)
+    {
+      const std::array<uint32_t,2> outputRows = { bandIdx * config.size[0] / numBands, (bandIdx + 1) * config.size[0] / numBands };
+      auto zeroRows = [&mFrame, &fRanges, numCols](uint32_t first, uint32_t end)
+      {
+        for (auto *vec : {&mFrame, &fRanges})
+        {
+          std::fill(vec->begin() + std::ptrdiff_t(first * numCols), vec->begin() + std::ptrdiff_t(end * numCols), 0.0F);
+        }
+      };
+
+      // The filters pass through frames smaller than their windows, so short runs of rows are processed with at least
+      // MIN_TILE_ROWS rows (or the whole band, if it is shorter) to give the same output as the whole band.
+      const auto minRows = std::min(MIN_TILE_ROWS, outputRows[1] - outputRows[0]);
+      auto next = outputRows[0]; // The first row not written yet.
+      for (const auto &rows : bandRows)
+      {
+        auto first = std::max(rows[0], next);
+        auto end = std::min(rows[1], outputRows[1]);
+        if (first >= end)
+        {
+          continue;
+        }
+        if (end - first < minRows)
+        {
+          end = std::min(outputRows[1], first + minRows);
+          first = end - minRows;
+        }
+        if (first > next)
+        {
+          zeroRows(next, first);
+        }
+        processBand(config, input, bands[workerIdx], {first, end}, mFrame, fRanges);
+        next = end;
+      }
+      if (next < outputRows[1])
+      {
+        zeroRows(next, outputRows[1]);
+      }
+    };
+
+    if (numBandBuffers > 1)
+    {
+      config.workerPool->parallelFor(numBands, numBandBuffers, runBand);
+    }
+    else
+    {
+      for (uint32_t bandIdx = 0; bandIdx < numBands; bandIdx++)
+      {
+        runBand(bandIdx, 0);
+      }
+    }
   }
 
   {
-    // auto minmaxTimer = LumoTimers::ScopedTimer(info.timers, "RawToDepthV2_float::processWholeFrame() -- minmax", TIMERS_UPDATE_EVERY);
-    RawToDepthDsp::minMaxRecursive(mFrame, fMinMaxMask, info.minMaxFilterSize, info.size, 1);
+    auto minmaxTimer = FastTimers::Scoped(FAST_TIMER_RTD_MINMAX);
+    auto minmaxCounters = PerfCounters::Scoped(PERF_STAGE_RTD_MINMAX, config.fovIdx);
+    auto minmaxSpan = PipelineTrace::Span("minmax");
+    // The min-max filter is recursive, so it can't be split into bands. But it only masks the pixels whose window is
+    // out of range, which a window of zeros never is, and the pixels that aren't masked don't depend on the others. So
+    // the runs of rows that are more than two window halos apart from each other in mFrame's nonzero rows are
+    // independent, and each is filtered on its own; the pixels a window halo from the edge of a run can't be masked.
+    const auto minMaxHalo = config.minMaxFilterSize.size() == 2 ? (config.minMaxFilterSize[0] | 1U) / 2 : 0U;
+    const auto minMaxRows = expandRows(bandRows, 2 * minMaxHalo, config.size[0]);
+    if (minMaxRows.size() == 1 && minMaxRows[0][0] == 0 && minMaxRows[0][1] == config.size[0])
+    {
+      RawToDepthDsp::minMaxRecursive(mFrame, fMinMaxMask, config.minMaxFilterSize, config.size, 1);
+    }
+    else
+    {
+      std::fill(fMinMaxMask.begin(), fMinMaxMask.end(), 0.0F);
+      for (const auto &rows : minMaxRows)
+      {
+        const auto first = std::ptrdiff_t(rows[0] * numCols);
+        const auto numPixels = std::size_t(rows[1] - rows[0]) * numCols;
+        SCOPED_VEC_F(runFrame, numPixels);
+        SCOPED_VEC_F(runMask, numPixels);
+        std::copy_n(mFrame.begin() + first, numPixels, runFrame.begin());
+        RawToDepthDsp::minMaxRecursive(runFrame, runMask, config.minMaxFilterSize, {rows[1] - rows[0], config.size[1]}, 1);
+        std::copy_n(runMask.begin(), numPixels, fMinMaxMask.begin() + first);
+      }
+    }
   }
 
+  if (capture != nullptr)
   {
-    // auto medianTimer = LumoTimers::ScopedTimer(info.timers, "RawToDepthV2_float::processWholeFrame() - median filter", TIMERS_UPDATE_EVERY);
-    RawToDepthDsp::medianFilterPlus(ranges, fRanges, {info.rowKernelIdx, info.columnKernelIdx}, info.size, info.performGhostMedian);
+    std::copy(mFrame.begin(), mFrame.end(), capture->mFrame.begin());
+    std::copy(fMinMaxMask.begin(), fMinMaxMask.end(), capture->minMaxMask.begin());
   }
 
+  // A streamed segment outputs only its own rows of the window.
+  const std::array<uint32_t,2> outputRows = streamedSegment ?
+    std::array<uint32_t,2>{info.outputRows[0] - info.windowRow, info.outputRows[1] - info.windowRow} :
+    std::array<uint32_t,2>{0, config.size[0]};
+  const std::array<uint32_t,2> outputSize = {outputRows[1] - outputRows[0], config.size[1]};
+
+  // Only the planes selected in the FOV's metadata are converted and passed on. The SNR is always needed to mask the range.
+  const bool outputSnr = (config.outputPlanes & TRANSMIT_BITMASK_SNR) != 0;
+  const bool outputSignal = (config.outputPlanes & TRANSMIT_BITMASK_SIGNAL) != 0;
+  const bool outputBackground = (config.outputPlanes & TRANSMIT_BITMASK_BACKGROUND) != 0;
+  if (streamedSegment)
   {
-    // auto nnTimer = LumoTimers::ScopedTimer(info.timers, "RawToDepthV2_float::processWholeFrame() - nearest neighbor", TIMERS_UPDATE_EVERY);
-    NearestNeighbor::removeOutliers(fRanges, info.nearestNeighborFilterLevel, info.size);
+    for (auto *vec : {&fRanges, &fMinMaxMask, &fSnr, outputSignal ? &fSignals : nullptr, outputBackground ? &fBackground : nullptr})
+    {
+      if (vec == nullptr)
+      {
+        continue;
+      }
+      vec->resize(outputRows[1] * numCols);
+      vec->erase(vec->begin(), vec->begin() + std::ptrdiff_t(outputRows[0] * numCols));
+    }
   }
-
-  const auto maxUnambiguousRange = (float_t)info.maxUnambiguousRange;
-  const auto rangeOffsetTemperature = info.rangeOffsetTemperature;
-  std::for_each(fRanges.begin(), fRanges.end(),
-                [maxUnambiguousRange, rangeOffsetTemperature](float_t &range)
-                {
-                  range -= rangeOffsetTemperature;
-                  if (range < 0.0F)
-                  {
-                    range = 0.0F;
-                  }
-                  range = fmod(range, maxUnambiguousRange);
-                });
-
-  auto rangeFov = RawToDepthCommon::getRange(fRanges,
-                                             fMinMaxMask, info.pixelMask, fSnr,
-                                             info.fovStart, info.fovStep, info.fovSize[1], info.size,
-                                             info.disableRangeMasking, info.snrThresh,
-                                             info.rangeOffsetTemperature,
-                                             info.rangeLimit,
-                                             (float_t)info.maxUnambiguousRange);
-
-  auto roiIndicesFov = getRoiIndices(info.roiIndexFrame, info.fovStart, info.fovStep, info.fovSize, info.size);
-
-  const std::array<uint32_t, 2> fovStart = {info.fovStart[0] / info.binning[0], info.fovStart[1] / info.binning[1]};
-  const std::array<uint32_t, 2> fovStep = {info.binning[0], info.binning[1]};
-
-  info.setFovSegment(
-      std::make_shared<FovSegment>(info.fovIdx,
-                                   info.headerNum,
-                                   info.timestamp, // timestamp
-                                   info.sensorId,
-                                   info.userTag,
-                                   info.lastRoiReceived,
-                                   info.GCF,
-                                   info.maxUnambiguousRange,
-                                   info.size,
-                                   rangeFov,
-                                   info.imageStart,
-                                   info.imageStep,
-                                   fovStart,
-                                   fovStep,
-                                   RawToDepthCommon::getSnr(fSnr),
-                                   RawToDepthCommon::getSignal(fSignals),
-                                   RawToDepthCommon::getBackground(fBackground),
-                                   roiIndicesFov,
-                                   std::make_shared<std::vector<uint64_t>>(info.timestamps),
-                                   std::make_shared<std::vector<std::vector<uint32_t>>>(info.timestampsVec),
-                                   info.lastTimerReport));
+  const std::array<uint16_t,2> sensorFovStart = {uint16_t(config.fovStart[0] + outputRows[0] * config.fovStep[0]), config.fovStart[1]};
+  const std::array<uint32_t,2> imageStart = {config.imageStart[0] + outputRows[0] * config.imageStep[0], config.imageStart[1]};
+
+  // The output planes are recycled through the FOV's pool, and return to it when the consumer releases the segment.
+  auto planes = config.outputPool ? config.outputPool->get() : std::make_shared<FovPlanes>();
+  // The ranges are corrected for temperature, and all of the planes masked and quantized, in one pass over the output rows.
+  RawToDepthCommon::getOutputPlanes(*planes, config.outputPlanes,
+                                    fRanges, fMinMaxMask, *info.pixelMaskSpans, info.windowRow + outputRows[0],
+                                    fSnr, fSignals, fBackground,
+                                    outputSize,
+                                    config.disableRangeMasking, config.snrThresh,
+                                    info.rangeOffsetTemperature,
+                                    config.rangeLimit,
+                                    (float_t)config.maxUnambiguousRange);
+  getRoiIndexRows(planes->roiIndexRows, *info.roiIndexRows, sensorFovStart[0], config.fovStep[0], outputSize[0]);
+  if (capture != nullptr)
+  {
+    std::copy(planes->range.begin(), planes->range.end(), capture->range.begin());
+    DspCapture::write(std::move(capture));
+  }
+  planes->timestamps = info.timestamps;
+  planes->timestampsVec = info.timestampsVec;
+  const auto &rangeFov = planes->range;
+
+  const std::array<uint32_t, 2> fovStart = {sensorFovStart[0] / config.binning[0], sensorFovStart[1] / config.binning[1]};
+  const std::array<uint32_t, 2> fovStep = {config.binning[0], config.binning[1]};
+
+  auto fovSegment = std::make_shared<FovSegment>(config.fovIdx,
+                                                 config.headerNum,
+                                                 config.timestamp, // timestamp
+                                                 config.sensorId,
+                                                 config.userTag,
+                                                 info.lastRoiReceived,
+                                                 config.GCF,
+                                                 config.maxUnambiguousRange,
+                                                 outputSize,
+                                                 FovPlanes::plane(planes, &FovPlanes::range),
+                                                 imageStart,
+                                                 config.imageStep,
+                                                 fovStart,
+                                                 fovStep,
+                                                 outputSnr ? FovPlanes::plane(planes, &FovPlanes::snr) : nullptr,
+                                                 outputSignal ? FovPlanes::plane(planes, &FovPlanes::signal) : nullptr,
+                                                 outputBackground ? FovPlanes::plane(planes, &FovPlanes::background) : nullptr,
+                                                 FovPlanes::plane(planes, &FovPlanes::roiIndexRows),
+                                                 FovPlanes::plane(planes, &FovPlanes::timestamps),
+                                                 FovPlanes::plane(planes, &FovPlanes::timestampsVec),
+                                                 *info.lastTimerReport);
+  if (streamedSegment)
+  {
+    fovSegment->setSegmentRows(info.outputRows[0], info.fovRows);
+  }
+  if (config.directions && streamedSegment)
+  {
+    // The directions are those of the whole FOV.
+    const auto planeSize = std::size_t(info.fovRows) * config.size[1];
+    const auto first = std::size_t(info.outputRows[0]) * config.size[1];
+    auto directions = std::vector<float_t>();
+    directions.reserve(3 * rangeFov.size());
+    for (std::size_t plane = 0; plane < 3; plane++)
+    {
+      const auto planeStart = config.directions->begin() + std::ptrdiff_t(plane * planeSize + first);
+      directions.insert(directions.end(), planeStart, planeStart + std::ptrdiff_t(rangeFov.size()));
+    }
+    fovSegment->setXyz(RawToDepthCommon::getXyz(rangeFov, directions));
+  }
+  else if (config.directions)
+  {
+    fovSegment->setXyz(RawToDepthCommon::getXyz(rangeFov, *config.directions));
+  }
+  info.frameTrace.stamp(TRACE_WHOLE_FRAME_END);
+  fovSegment->setFrameTrace(info.frameTrace);
+  info.setFovSegment(fovSegment);
 }
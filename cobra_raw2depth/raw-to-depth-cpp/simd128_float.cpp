@@ -0,0 +1,388 @@
+/**
+ * @file simd128_float.cpp
+ * @brief 128-bit SIMD implementations of the RawToDepthDsp hot-path kernels.
+ * NEON on aarch64, SSE2 on x86_64. On other targets the kernels process no
+ * elements and the caller falls back to the scalar code.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "RawToDepthSimd.h"
+#include "RawToDepthSimdKernels.h"
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RTD_SIMD128_AVAILABLE
+
+namespace
+{
+struct Traits128
+{
+  using V = float32x4_t;
+  using M = uint32x4_t;
+  static constexpr uint32_t WIDTH { 4 };
+
+  static V load(const float_t *src) { return vld1q_f32(src); }
+  static void store(float_t *dst, V val) { vst1q_f32(dst, val); }
+  static V set1(float_t val) { return vdupq_n_f32(val); }
+  static V add(V a, V b) { return vaddq_f32(a, b); }
+  static V sub(V a, V b) { return vsubq_f32(a, b); }
+  static V mul(V a, V b) { return vmulq_f32(a, b); }
+  static V div(V a, V b) { return vdivq_f32(a, b); }
+  static V sqrt(V a) { return vsqrtq_f32(a); }
+  // The 8-bit estimate takes two Newton-Raphson steps to reach full precision.
+  static V rsqrt(V a)
+  {
+    V est = vrsqrteq_f32(a);
+    est = vmulq_f32(est, vrsqrtsq_f32(vmulq_f32(a, est), est));
+    return vmulq_f32(est, vrsqrtsq_f32(vmulq_f32(a, est), est));
+  }
+  static V max(V a, V b) { return vmaxq_f32(a, b); }
+  static V trunc(V a) { return vrndq_f32(a); }
+  static M cmple(V a, V b) { return vcleq_f32(a, b); }
+  static M cmplt(V a, V b) { return vcltq_f32(a, b); }
+  static M cmpgt(V a, V b) { return vcgtq_f32(a, b); }
+  static M cmpge(V a, V b) { return vcgeq_f32(a, b); }
+  static M andM(M a, M b) { return vandq_u32(a, b); }
+  static M andNotM(M a, M b) { return vbicq_u32(b, a); } // ~a & b
+  static V select(M mask, V a, V b) { return vbslq_f32(mask, a, b); }
+
+  static void load3(const float_t *src, V &a, V &b, V &c)
+  {
+    float32x4x3_t taps = vld3q_f32(src);
+    a = taps.val[0];
+    b = taps.val[1];
+    c = taps.val[2];
+  }
+
+  static V loadU16(const uint16_t *src, uint16_t rawMask, uint32_t shiftr)
+  {
+    uint16x4_t raw = vand_u16(vld1_u16(src), vdup_n_u16(rawMask));
+    uint32x4_t wide = vshlq_u32(vmovl_u16(raw), vdupq_n_s32(-int32_t(shiftr)));
+    return vcvtq_f32_u32(wide);
+  }
+
+  // Converts integral values to 16 bits as a scalar (uint16_t) cast does here: through a saturating uint32.
+  static void storeU16(uint16_t *dst, V val) { vst1_u16(dst, vmovn_u32(vcvtq_u32_f32(val))); }
+};
+
+// Merges 8 pixels at a time. vld3q_u16 de-interleaves the taps, so the largest tap of each pixel is one vmaxq_u16.
+uint32_t hdrMergeImpl(const uint16_t *previousRoi, const uint16_t *roi, uint16_t *mergedRoi,
+                      uint32_t numElements, uint16_t threshold, uint16_t rawMask)
+{
+  const uint16x8_t thresholdV = vdupq_n_u16(threshold);
+  const uint16x8_t maskV = vdupq_n_u16(rawMask);
+  uint32_t idx = 0;
+  for (; idx + 24 <= numElements; idx += 24)
+  {
+    const uint16x8x3_t prev = vld3q_u16(previousRoi + idx);
+    const uint16x8x3_t cur = vld3q_u16(roi + idx);
+    const uint16x8_t maxTap = vmaxq_u16(vmaxq_u16(vandq_u16(prev.val[0], maskV), vandq_u16(prev.val[1], maskV)),
+                                        vandq_u16(prev.val[2], maskV));
+    const uint16x8_t saturated = vcgeq_u16(maxTap, thresholdV);
+    uint16x8x3_t merged;
+    merged.val[0] = vbslq_u16(saturated, cur.val[0], prev.val[0]);
+    merged.val[1] = vbslq_u16(saturated, cur.val[1], prev.val[1]);
+    merged.val[2] = vbslq_u16(saturated, cur.val[2], prev.val[2]);
+    vst3q_u16(mergedRoi + idx, merged);
+  }
+  return idx;
+}
+
+// Packs 16 words at a time. vld2q_u16 separates the first and second word of each pair, and vst3_u8 interleaves
+// the three bytes of the pairs again.
+uint32_t packRaw12Impl(const uint16_t *src, uint8_t *dst, uint32_t numElements)
+{
+  const uint8x8_t lowNibble = vdup_n_u8(0x0f);
+  const uint8x8_t highNibble = vdup_n_u8(0xf0);
+  uint32_t idx = 0;
+  for (; idx + 16 <= numElements; idx += 16)
+  {
+    const uint16x8x2_t words = vld2q_u16(src + idx);
+    uint8x8x3_t packed;
+    packed.val[0] = vshrn_n_u16(words.val[0], 8);
+    packed.val[1] = vshrn_n_u16(words.val[1], 8);
+    packed.val[2] = vorr_u8(vand_u8(vshrn_n_u16(words.val[0], 4), lowNibble), vand_u8(vmovn_u16(words.val[1]), highNibble));
+    vst3_u8(dst + idx / 2 * 3, packed);
+  }
+  return idx;
+}
+
+uint32_t unpackRaw12Impl(const uint8_t *src, uint16_t *dst, uint32_t numElements)
+{
+  const uint8x8_t lowNibble = vdup_n_u8(0x0f);
+  const uint8x8_t highNibble = vdup_n_u8(0xf0);
+  uint32_t idx = 0;
+  for (; idx + 16 <= numElements; idx += 16)
+  {
+    const uint8x8x3_t packed = vld3_u8(src + idx / 2 * 3);
+    uint16x8x2_t words;
+    words.val[0] = vorrq_u16(vshll_n_u8(packed.val[0], 8), vshll_n_u8(vand_u8(packed.val[2], lowNibble), 4));
+    words.val[1] = vorrq_u16(vshll_n_u8(packed.val[1], 8), vmovl_u8(vand_u8(packed.val[2], highNibble)));
+    vst2q_u16(dst + idx, words);
+  }
+  return idx;
+}
+} // namespace
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RTD_SIMD128_AVAILABLE
+
+namespace
+{
+struct Traits128
+{
+  using V = __m128;
+  using M = __m128;
+  static constexpr uint32_t WIDTH { 4 };
+
+  static V load(const float_t *src) { return _mm_loadu_ps(src); }
+  static void store(float_t *dst, V val) { _mm_storeu_ps(dst, val); }
+  static V set1(float_t val) { return _mm_set1_ps(val); }
+  static V add(V a, V b) { return _mm_add_ps(a, b); }
+  static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+  static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+  static V div(V a, V b) { return _mm_div_ps(a, b); }
+  static V sqrt(V a) { return _mm_sqrt_ps(a); }
+  // The 12-bit estimate takes one Newton-Raphson step to reach full precision.
+  static V rsqrt(V a)
+  {
+    V est = _mm_rsqrt_ps(a);
+    V halfAEst2 = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5F), a), _mm_mul_ps(est, est));
+    return _mm_mul_ps(est, _mm_sub_ps(_mm_set1_ps(1.5F), halfAEst2));
+  }
+  static V max(V a, V b) { return _mm_max_ps(a, b); }
+  // SSE2 has no float truncate; all inputs are well within the int32 range.
+  static V trunc(V a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a)); }
+  static M cmple(V a, V b) { return _mm_cmple_ps(a, b); }
+  static M cmplt(V a, V b) { return _mm_cmplt_ps(a, b); }
+  static M cmpgt(V a, V b) { return _mm_cmpgt_ps(a, b); }
+  static M cmpge(V a, V b) { return _mm_cmpge_ps(a, b); }
+  static M andM(M a, M b) { return _mm_and_ps(a, b); }
+  static M andNotM(M a, M b) { return _mm_andnot_ps(a, b); } // ~a & b
+  static V select(M mask, V a, V b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+
+  // De-interleave four (A,B,C) pixels into one register per tap.
+  static void load3(const float_t *src, V &a, V &b, V &c)
+  {
+    V in0 = _mm_loadu_ps(src);     // A0 B0 C0 A1
+    V in1 = _mm_loadu_ps(src + 4); // B1 C1 A2 B2
+    V in2 = _mm_loadu_ps(src + 8); // C2 A3 B3 C3
+
+    V a23 = _mm_shuffle_ps(in1, in2, _MM_SHUFFLE(1, 1, 2, 2));
+    a = _mm_shuffle_ps(in0, a23, _MM_SHUFFLE(2, 0, 3, 0));
+
+    V b01 = _mm_shuffle_ps(in0, in1, _MM_SHUFFLE(0, 0, 1, 1));
+    V b23 = _mm_shuffle_ps(in1, in2, _MM_SHUFFLE(2, 2, 3, 3));
+    b = _mm_shuffle_ps(b01, b23, _MM_SHUFFLE(2, 0, 2, 0));
+
+    V c01 = _mm_shuffle_ps(in0, in1, _MM_SHUFFLE(1, 1, 2, 2));
+    V c23 = _mm_shuffle_ps(in2, in2, _MM_SHUFFLE(3, 3, 0, 0));
+    c = _mm_shuffle_ps(c01, c23, _MM_SHUFFLE(2, 0, 2, 0));
+  }
+
+  static V loadU16(const uint16_t *src, uint16_t rawMask, uint32_t shiftr)
+  {
+    __m128i raw = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src));
+    raw = _mm_and_si128(raw, _mm_set1_epi16(int16_t(rawMask)));
+    raw = _mm_srl_epi16(raw, _mm_cvtsi32_si128(int32_t(shiftr)));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, _mm_setzero_si128()));
+  }
+
+  // Converts integral values to 16 bits as a scalar (uint16_t) cast does here: the low bits of an int32. SSE2 only packs
+  // with saturation, so the low bits are sign-extended first, which the pack then keeps.
+  static void storeU16(uint16_t *dst, V val)
+  {
+    const __m128i words = _mm_srai_epi32(_mm_slli_epi32(_mm_cvttps_epi32(val), 16), 16);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm_packs_epi32(words, words));
+  }
+};
+
+// Merges 8 pixels (3 registers) at a time. SSE2 has no de-interleaving load, so the saturated taps are gathered into
+// a bit mask, OR-ed over the 3 taps of each pixel with shifts, and expanded back into a lane mask per register.
+uint32_t hdrMergeImpl(const uint16_t *previousRoi, const uint16_t *roi, uint16_t *mergedRoi,
+                      uint32_t numElements, uint16_t threshold, uint16_t rawMask)
+{
+  const __m128i thresholdV = _mm_set1_epi16(int16_t(threshold));
+  const __m128i maskV = _mm_set1_epi16(int16_t(rawMask));
+  const __m128i laneBits = _mm_set_epi16(128, 64, 32, 16, 8, 4, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  constexpr uint32_t FIRST_TAPS { 0x249249 }; // Bit 3*j for each of the 8 pixels.
+  uint32_t idx = 0;
+  for (; idx + 24 <= numElements; idx += 24)
+  {
+    __m128i prev[3]; // NOLINT(hicpp-avoid-c-arrays) std::array drops the vector type's alignment attribute
+    uint32_t saturatedTaps = 0;
+    for (uint32_t reg = 0; reg < 3; reg++)
+    {
+      prev[reg] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(previousRoi + idx + 8 * reg));
+      // Unsigned x >= threshold is the same as the saturating threshold - x being 0.
+      const __m128i tapSaturated = _mm_cmpeq_epi16(_mm_subs_epu16(thresholdV, _mm_and_si128(prev[reg], maskV)), zero);
+      saturatedTaps |= uint32_t(_mm_movemask_epi8(_mm_packs_epi16(tapSaturated, zero))) << (8 * reg);
+    }
+    const uint32_t saturatedPixels = (saturatedTaps | (saturatedTaps >> 1) | (saturatedTaps >> 2)) & FIRST_TAPS;
+    const uint32_t select = saturatedPixels * 7; // Sets all 3 tap bits of each saturated pixel.
+    for (uint32_t reg = 0; reg < 3; reg++)
+    {
+      const __m128i regBits = _mm_set1_epi16(int16_t((select >> (8 * reg)) & 0xFF));
+      const __m128i regSelect = _mm_cmpeq_epi16(_mm_and_si128(regBits, laneBits), laneBits);
+      const __m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i *>(roi + idx + 8 * reg));
+      const __m128i merged = _mm_or_si128(_mm_and_si128(regSelect, cur), _mm_andnot_si128(regSelect, prev[reg]));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(mergedRoi + idx + 8 * reg), merged);
+    }
+  }
+  return idx;
+}
+
+// Packs 8 words at a time. Each 32-bit lane holds a pair of words, which is turned into its 3 bytes in place. SSE2
+// has no byte shuffle, so the pairs are then compacted with 64-bit shifts and written with two overlapping 8-byte
+// stores, the second of which writes 2 bytes past the 12 of this iteration. The loop stops early enough for those
+// to still be within dst; the next iteration or the caller's scalar loop overwrites them.
+uint32_t packRaw12Impl(const uint16_t *src, uint8_t *dst, uint32_t numElements)
+{
+  const __m128i byte1 = _mm_set1_epi32(0xff);
+  const __m128i byte2 = _mm_set1_epi32(0xff00);
+  const __m128i nibble4 = _mm_set1_epi32(0xf0000);
+  const __m128i nibble5 = _mm_set1_epi32(0xf00000);
+  const __m128i lowPair = _mm_set_epi32(0, 0xffffff, 0, 0xffffff);
+  const __m128i highPair = _mm_set_epi32(0xffff, int32_t(0xff000000), 0xffff, int32_t(0xff000000));
+  uint32_t idx = 0;
+  for (; idx + 10 <= numElements; idx += 8)
+  {
+    // lane = first | second << 16; packed = (first >> 8) | (second >> 8) << 8 | (first >> 4 & 0xf | second & 0xf0) << 16
+    const __m128i lane = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + idx));
+    const __m128i packed = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(lane, 8), byte1),
+                                                     _mm_and_si128(_mm_srli_epi32(lane, 16), byte2)),
+                                        _mm_or_si128(_mm_and_si128(_mm_slli_epi32(lane, 12), nibble4),
+                                                     _mm_and_si128(lane, nibble5)));
+    const __m128i compacted = _mm_or_si128(_mm_and_si128(packed, lowPair), _mm_and_si128(_mm_srli_epi64(packed, 8), highPair));
+    auto *out = dst + idx / 2 * 3;
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out), compacted);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out + 6), _mm_unpackhi_epi64(compacted, compacted));
+  }
+  return idx;
+}
+
+// The inverse of packRaw12Impl(). The second 8-byte load reads 2 bytes past the 12 of this iteration.
+uint32_t unpackRaw12Impl(const uint8_t *src, uint16_t *dst, uint32_t numElements)
+{
+  const __m128i byte2 = _mm_set1_epi32(0xff00);
+  const __m128i nibble2 = _mm_set1_epi32(0xf0);
+  const __m128i nibble5 = _mm_set1_epi32(0xf00000);
+  const __m128i byte4 = _mm_set1_epi32(int32_t(0xff000000));
+  const __m128i lowPair = _mm_set_epi32(0, 0xffffff, 0, 0xffffff);
+  const __m128i highPair = _mm_set_epi32(0xffffff, 0, 0xffffff, 0);
+  uint32_t idx = 0;
+  for (; idx + 10 <= numElements; idx += 8)
+  {
+    const auto *in = src + idx / 2 * 3;
+    const __m128i pairs = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(in)),
+                                             _mm_loadl_epi64(reinterpret_cast<const __m128i *>(in + 6)));
+    // One pair of words, as its 3 bytes, in each 32-bit lane
+    const __m128i packed = _mm_or_si128(_mm_and_si128(pairs, lowPair), _mm_and_si128(_mm_slli_epi64(pairs, 8), highPair));
+    const __m128i first = _mm_or_si128(_mm_and_si128(_mm_slli_epi32(packed, 8), byte2),
+                                       _mm_and_si128(_mm_srli_epi32(packed, 12), nibble2));
+    const __m128i second = _mm_or_si128(_mm_and_si128(_mm_slli_epi32(packed, 16), byte4), _mm_and_si128(packed, nibble5));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + idx), _mm_or_si128(first, second));
+  }
+  return idx;
+}
+} // namespace
+#endif
+
+#if defined(RTD_SIMD128_AVAILABLE)
+
+uint32_t RawToDepthSimd::sh2f128(const uint16_t *src, float_t *dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask)
+{
+  return RawToDepthSimdKernels<Traits128>::sh2f(src, dst, numElements, shiftr, rawMask);
+}
+
+uint32_t RawToDepthSimd::hdrMerge128(const uint16_t *previousRoi, const uint16_t *roi, uint16_t *mergedRoi,
+                                     uint32_t numElements, uint16_t threshold, uint16_t rawMask)
+{
+  return hdrMergeImpl(previousRoi, roi, mergedRoi, numElements, threshold, rawMask);
+}
+
+uint32_t RawToDepthSimd::packRaw12_128(const uint16_t *src, uint8_t *dst, uint32_t numElements)
+{
+  return packRaw12Impl(src, dst, numElements);
+}
+
+uint32_t RawToDepthSimd::unpackRaw12_128(const uint8_t *src, uint16_t *dst, uint32_t numElements)
+{
+  return unpackRaw12Impl(src, dst, numElements);
+}
+
+uint32_t RawToDepthSimd::calculatePhase128(const float_t *rawRoi, float_t *phaseRoi, float_t *signalRoi,
+                                           float_t *snrRoi, float_t *backgroundRoi,
+                                           uint32_t numElements, float_t numberOfSummedValues)
+{
+  return RawToDepthSimdKernels<Traits128>::calculatePhase(rawRoi, phaseRoi, signalRoi, snrRoi, backgroundRoi,
+                                                          numElements, numberOfSummedValues);
+}
+
+uint32_t RawToDepthSimd::calculatePhaseSmooth128(const float_t *frameSmoothed, float_t *phaseSmoothedFrame,
+                                                 const float_t *phaseFrame, float_t *correctedPhaseFrame,
+                                                 uint32_t numElements, float_t maxPhaseError)
+{
+  return RawToDepthSimdKernels<Traits128>::calculatePhaseSmooth(frameSmoothed, phaseSmoothedFrame, phaseFrame,
+                                                                correctedPhaseFrame, numElements, maxPhaseError);
+}
+
+uint32_t RawToDepthSimd::convolveStride3_128(const float_t *kernel, uint32_t kernelSize,
+                                             const float_t *in, float_t *out, uint32_t numElements)
+{
+  return RawToDepthSimdKernels<Traits128>::convolveStride3(kernel, kernelSize, in, out, numElements);
+}
+
+uint32_t RawToDepthSimd::computeWholeFrameRange128(const float_t *smoothedPhases0, const float_t *smoothedPhases1,
+                                                   const float_t *correctedPhases0, const float_t *correctedPhases1,
+                                                   float_t *ranges, float_t *mFrame, uint32_t numElements,
+                                                   float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias)
+{
+  return RawToDepthSimdKernels<Traits128>::computeWholeFrameRange(smoothedPhases0, smoothedPhases1,
+                                                                  correctedPhases0, correctedPhases1,
+                                                                  ranges, mFrame, numElements,
+                                                                  fInt0, fInt1, aFloat, cFloat, bias);
+}
+
+uint32_t RawToDepthSimd::deinterleaveTaps128(const float_t *taps, float_t *planes, uint32_t numElements, std::size_t planeStride)
+{
+  return RawToDepthSimdKernels<Traits128>::deinterleaveTaps(taps, planes, numElements, planeStride);
+}
+
+uint32_t RawToDepthSimd::computeWholeFrameRangePlanar128(const float_t *smoothedPlanes, std::size_t planeStride,
+                                                         const float_t *phases0, const float_t *phases1,
+                                                         float_t *ranges, float_t *mFrame, uint32_t numElements, float_t maxPhaseError,
+                                                         float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias)
+{
+  return RawToDepthSimdKernels<Traits128>::computeWholeFrameRangePlanar(smoothedPlanes, planeStride, phases0, phases1,
+                                                                        ranges, mFrame, numElements, maxPhaseError,
+                                                                        fInt0, fInt1, aFloat, cFloat, bias);
+}
+
+uint32_t RawToDepthSimd::quantizeOutputs128(const OutputRun &run, uint32_t numElements)
+{
+  return RawToDepthSimdKernels<Traits128>::quantizeOutputs(run, numElements);
+}
+
+#else
+
+uint32_t RawToDepthSimd::sh2f128(const uint16_t *, float_t *, uint32_t, uint32_t, uint16_t) { return 0; }
+uint32_t RawToDepthSimd::hdrMerge128(const uint16_t *, const uint16_t *, uint16_t *, uint32_t, uint16_t, uint16_t) { return 0; }
+uint32_t RawToDepthSimd::packRaw12_128(const uint16_t *, uint8_t *, uint32_t) { return 0; }
+uint32_t RawToDepthSimd::unpackRaw12_128(const uint8_t *, uint16_t *, uint32_t) { return 0; }
+uint32_t RawToDepthSimd::calculatePhase128(const float_t *, float_t *, float_t *, float_t *, float_t *, uint32_t, float_t) { return 0; }
+uint32_t RawToDepthSimd::calculatePhaseSmooth128(const float_t *, float_t *, const float_t *, float_t *, uint32_t, float_t) { return 0; }
+uint32_t RawToDepthSimd::convolveStride3_128(const float_t *, uint32_t, const float_t *, float_t *, uint32_t) { return 0; }
+uint32_t RawToDepthSimd::computeWholeFrameRange128(const float_t *, const float_t *, const float_t *, const float_t *,
+                                                   float_t *, float_t *, uint32_t, float_t, float_t, float_t, float_t, float_t) { return 0; }
+uint32_t RawToDepthSimd::deinterleaveTaps128(const float_t *, float_t *, uint32_t, std::size_t) { return 0; }
+uint32_t RawToDepthSimd::computeWholeFrameRangePlanar128(const float_t *, std::size_t, const float_t *, const float_t *,
+                                                         float_t *, float_t *, uint32_t, float_t,
+                                                         float_t, float_t, float_t, float_t, float_t) { return 0; }
+uint32_t RawToDepthSimd::quantizeOutputs128(const OutputRun &, uint32_t) { return 0; }
+
+#endif
@@ -0,0 +1,176 @@
+/**
+ * @file simd256_float.cpp
+ * @brief AVX2 implementations of the RawToDepthDsp hot-path kernels.
+ * This file is compiled with -mavx2 on x86_64, and the kernels are only called
+ * when RawToDepthSimd::detect() has confirmed that the CPU supports AVX2.
+ * On other targets the kernels process no elements.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "RawToDepthSimd.h"
+#include "RawToDepthSimdKernels.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+namespace
+{
+struct Traits256
+{
+  using V = __m256;
+  using M = __m256;
+  static constexpr uint32_t WIDTH { 8 };
+
+  static V load(const float_t *src) { return _mm256_loadu_ps(src); }
+  static void store(float_t *dst, V val) { _mm256_storeu_ps(dst, val); }
+  static V set1(float_t val) { return _mm256_set1_ps(val); }
+  static V add(V a, V b) { return _mm256_add_ps(a, b); }
+  static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static V div(V a, V b) { return _mm256_div_ps(a, b); }
+  static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+  // The 12-bit estimate takes one Newton-Raphson step to reach full precision.
+  static V rsqrt(V a)
+  {
+    V est = _mm256_rsqrt_ps(a);
+    V halfAEst2 = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5F), a), _mm256_mul_ps(est, est));
+    return _mm256_mul_ps(est, _mm256_sub_ps(_mm256_set1_ps(1.5F), halfAEst2));
+  }
+  static V max(V a, V b) { return _mm256_max_ps(a, b); }
+  static V trunc(V a) { return _mm256_round_ps(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+  static M cmple(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+  static M cmplt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  static M cmpgt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  static M cmpge(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+  static M andM(M a, M b) { return _mm256_and_ps(a, b); }
+  static M andNotM(M a, M b) { return _mm256_andnot_ps(a, b); } // ~a & b
+  static V select(M mask, V a, V b) { return _mm256_blendv_ps(b, a, mask); }
+
+  // De-interleave four (A,B,C) pixels into one 128-bit register per tap.
+  static void load3x4(const float_t *src, __m128 &a, __m128 &b, __m128 &c)
+  {
+    __m128 in0 = _mm_loadu_ps(src);     // A0 B0 C0 A1
+    __m128 in1 = _mm_loadu_ps(src + 4); // B1 C1 A2 B2
+    __m128 in2 = _mm_loadu_ps(src + 8); // C2 A3 B3 C3
+
+    __m128 a23 = _mm_shuffle_ps(in1, in2, _MM_SHUFFLE(1, 1, 2, 2));
+    a = _mm_shuffle_ps(in0, a23, _MM_SHUFFLE(2, 0, 3, 0));
+
+    __m128 b01 = _mm_shuffle_ps(in0, in1, _MM_SHUFFLE(0, 0, 1, 1));
+    __m128 b23 = _mm_shuffle_ps(in1, in2, _MM_SHUFFLE(2, 2, 3, 3));
+    b = _mm_shuffle_ps(b01, b23, _MM_SHUFFLE(2, 0, 2, 0));
+
+    __m128 c01 = _mm_shuffle_ps(in0, in1, _MM_SHUFFLE(1, 1, 2, 2));
+    __m128 c23 = _mm_shuffle_ps(in2, in2, _MM_SHUFFLE(3, 3, 0, 0));
+    c = _mm_shuffle_ps(c01, c23, _MM_SHUFFLE(2, 0, 2, 0));
+  }
+
+  static void load3(const float_t *src, V &a, V &b, V &c)
+  {
+    __m128 aLo;
+    __m128 bLo;
+    __m128 cLo;
+    __m128 aHi;
+    __m128 bHi;
+    __m128 cHi;
+    load3x4(src, aLo, bLo, cLo);
+    load3x4(src + 12, aHi, bHi, cHi);
+    a = _mm256_set_m128(aHi, aLo);
+    b = _mm256_set_m128(bHi, bLo);
+    c = _mm256_set_m128(cHi, cLo);
+  }
+
+  static V loadU16(const uint16_t *src, uint16_t rawMask, uint32_t shiftr)
+  {
+    __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    raw = _mm_and_si128(raw, _mm_set1_epi16(int16_t(rawMask)));
+    raw = _mm_srl_epi16(raw, _mm_cvtsi32_si128(int32_t(shiftr)));
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(raw));
+  }
+
+  // Converts integral values to 16 bits as a scalar (uint16_t) cast does here: the low bits of an int32 (see Traits128).
+  // The pack works within each 128-bit lane, so the two lanes' words are gathered into the low half afterwards.
+  static void storeU16(uint16_t *dst, V val)
+  {
+    const __m256i words = _mm256_srai_epi32(_mm256_slli_epi32(_mm256_cvttps_epi32(val), 16), 16);
+    const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(words, words), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm256_castsi256_si128(packed));
+  }
+};
+} // namespace
+
+uint32_t RawToDepthSimd::sh2f256(const uint16_t *src, float_t *dst, uint32_t numElements, uint32_t shiftr, uint16_t rawMask)
+{
+  return RawToDepthSimdKernels<Traits256>::sh2f(src, dst, numElements, shiftr, rawMask);
+}
+
+uint32_t RawToDepthSimd::calculatePhase256(const float_t *rawRoi, float_t *phaseRoi, float_t *signalRoi,
+                                           float_t *snrRoi, float_t *backgroundRoi,
+                                           uint32_t numElements, float_t numberOfSummedValues)
+{
+  return RawToDepthSimdKernels<Traits256>::calculatePhase(rawRoi, phaseRoi, signalRoi, snrRoi, backgroundRoi,
+                                                          numElements, numberOfSummedValues);
+}
+
+uint32_t RawToDepthSimd::calculatePhaseSmooth256(const float_t *frameSmoothed, float_t *phaseSmoothedFrame,
+                                                 const float_t *phaseFrame, float_t *correctedPhaseFrame,
+                                                 uint32_t numElements, float_t maxPhaseError)
+{
+  return RawToDepthSimdKernels<Traits256>::calculatePhaseSmooth(frameSmoothed, phaseSmoothedFrame, phaseFrame,
+                                                                correctedPhaseFrame, numElements, maxPhaseError);
+}
+
+uint32_t RawToDepthSimd::convolveStride3_256(const float_t *kernel, uint32_t kernelSize,
+                                             const float_t *in, float_t *out, uint32_t numElements)
+{
+  return RawToDepthSimdKernels<Traits256>::convolveStride3(kernel, kernelSize, in, out, numElements);
+}
+
+uint32_t RawToDepthSimd::computeWholeFrameRange256(const float_t *smoothedPhases0, const float_t *smoothedPhases1,
+                                                   const float_t *correctedPhases0, const float_t *correctedPhases1,
+                                                   float_t *ranges, float_t *mFrame, uint32_t numElements,
+                                                   float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias)
+{
+  return RawToDepthSimdKernels<Traits256>::computeWholeFrameRange(smoothedPhases0, smoothedPhases1,
+                                                                  correctedPhases0, correctedPhases1,
+                                                                  ranges, mFrame, numElements,
+                                                                  fInt0, fInt1, aFloat, cFloat, bias);
+}
+
+uint32_t RawToDepthSimd::deinterleaveTaps256(const float_t *taps, float_t *planes, uint32_t numElements, std::size_t planeStride)
+{
+  return RawToDepthSimdKernels<Traits256>::deinterleaveTaps(taps, planes, numElements, planeStride);
+}
+
+uint32_t RawToDepthSimd::computeWholeFrameRangePlanar256(const float_t *smoothedPlanes, std::size_t planeStride,
+                                                         const float_t *phases0, const float_t *phases1,
+                                                         float_t *ranges, float_t *mFrame, uint32_t numElements, float_t maxPhaseError,
+                                                         float_t fInt0, float_t fInt1, float_t aFloat, float_t cFloat, float_t bias)
+{
+  return RawToDepthSimdKernels<Traits256>::computeWholeFrameRangePlanar(smoothedPlanes, planeStride, phases0, phases1,
+                                                                        ranges, mFrame, numElements, maxPhaseError,
+                                                                        fInt0, fInt1, aFloat, cFloat, bias);
+}
+
+uint32_t RawToDepthSimd::quantizeOutputs256(const OutputRun &run, uint32_t numElements)
+{
+  return RawToDepthSimdKernels<Traits256>::quantizeOutputs(run, numElements);
+}
+
+#else
+
+uint32_t RawToDepthSimd::sh2f256(const uint16_t *, float_t *, uint32_t, uint32_t, uint16_t) { return 0; }
+uint32_t RawToDepthSimd::calculatePhase256(const float_t *, float_t *, float_t *, float_t *, float_t *, uint32_t, float_t) { return 0; }
+uint32_t RawToDepthSimd::calculatePhaseSmooth256(const float_t *, float_t *, const float_t *, float_t *, uint32_t, float_t) { return 0; }
+uint32_t RawToDepthSimd::convolveStride3_256(const float_t *, uint32_t, const float_t *, float_t *, uint32_t) { return 0; }
+uint32_t RawToDepthSimd::computeWholeFrameRange256(const float_t *, const float_t *, const float_t *, const float_t *,
+                                                   float_t *, float_t *, uint32_t, float_t, float_t, float_t, float_t, float_t) { return 0; }
+uint32_t RawToDepthSimd::deinterleaveTaps256(const float_t *, float_t *, uint32_t, std::size_t) { return 0; }
+uint32_t RawToDepthSimd::computeWholeFrameRangePlanar256(const float_t *, std::size_t, const float_t *, const float_t *,
+                                                         float_t *, float_t *, uint32_t, float_t,
+                                                         float_t, float_t, float_t, float_t, float_t) { return 0; }
+uint32_t RawToDepthSimd::quantizeOutputs256(const OutputRun &, uint32_t) { return 0; }
+
+#endif
@@ -0,0 +1,236 @@
+/**
+ * @file smoothSeparable_float.cpp
+ * @brief Size-specific optimizer-friendly implementations of smoothing raw iTOF
+ * data using 32-bit floating-point operations on the CPU.
+ *
+ * The smoothing kernels are separable, so the data is smoothed by a vertical (column) pass
+ * followed by a horizontal (row) pass. Both passes are templated on the kernel coefficients,
+ * so the taps are unrolled at compile time and the loop over the pixels of a row vectorizes.
+ * The edges are copied unfiltered, and the sums are accumulated in the same order as
+ * smoothRaw(), which remains the general-purpose reference. The same passes smooth the
+ * tap-planar working layout of whole-frame processing (smoothPlanes()).
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "RawToDepthDsp.h"
+#include "RawToDepthSimd.h"
+#include "FloatVectorPool.h"
+#include "RtdMetadata.h"
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+namespace
+{
+template <const auto &KERNEL>
+constexpr std::size_t kernelSize() { return std::tuple_size<std::decay_t<decltype(KERNEL)>>::value; }
+
+template <const auto &KERNEL, std::size_t... TAPS>
+inline float_t convolveTaps(const float_t *src, std::size_t stride, std::index_sequence<TAPS...> /*taps*/)
+{
+  return (... + (KERNEL[TAPS] * src[TAPS * stride]));
+}
+
+// The dot product of KERNEL with src[0], src[stride], ... src[(size-1)*stride].
+template <const auto &KERNEL>
+inline float_t convolve(const float_t *src, std::size_t stride)
+{
+  return convolveTaps<KERNEL>(src, stride, std::make_index_sequence<kernelSize<KERNEL>()>{});
+}
+
+// Smooths numPlanes images of size[0] rows of size[1] pixels, stored one after the other. Each pixel is
+// TAP_STRIDE interleaved taps, which are filtered independently: 3 for the raw frame layout, 1 for tap planes.
+template <const auto &ROW_KERNEL, const auto &COLUMN_KERNEL, std::size_t TAP_STRIDE>
+void smoothSeparable(const float_t *roi, float_t *smoothedRoi, std::array<uint32_t,2> size, std::size_t numPlanes)
+{
+  static_assert(kernelSize<ROW_KERNEL>() % 2 == 1 && kernelSize<COLUMN_KERNEL>() % 2 == 1, "Smoothing kernels must have odd sizes.");
+  constexpr std::size_t rowHalfSize { kernelSize<ROW_KERNEL>() / 2 };
+  constexpr std::size_t columnHalfSize { kernelSize<COLUMN_KERNEL>() / 2 };
+
+  const std::size_t numRows = size[0];
+  const std::size_t rowPitch = TAP_STRIDE * size[1];
+
+  SCOPED_VEC_F(vSmoothedRoi, numPlanes * numRows * rowPitch);
+
+  // Vertical pass. The top and bottom columnHalfSize rows of each plane are copied out unfiltered.
+  for (std::size_t planeIdx = 0; planeIdx < numPlanes; planeIdx++)
+  {
+    const std::size_t planeOffset = planeIdx * numRows * rowPitch;
+    for (std::size_t rowIdx = 0; rowIdx < numRows; rowIdx++)
+    {
+      const float_t *src = roi + planeOffset + rowIdx * rowPitch;
+      float_t *dst = vSmoothedRoi.data() + planeOffset + rowIdx * rowPitch;
+      if (rowIdx < columnHalfSize || rowIdx + columnHalfSize >= numRows)
+      {
+        std::copy(src, src + rowPitch, dst);
+        continue;
+      }
+
+      const float_t *top = src - columnHalfSize * rowPitch;
+      for (std::size_t idx = 0; idx < rowPitch; idx++)
+      {
+        dst[idx] = convolve<COLUMN_KERNEL>(top + idx, rowPitch);
+      }
+    }
+  }
+
+  // Horizontal pass. The left and right rowHalfSize pixels are copied out unfiltered.
+  constexpr std::size_t edge { TAP_STRIDE * rowHalfSize };
+  for (std::size_t rowIdx = 0; rowIdx < numPlanes * numRows; rowIdx++)
+  {
+    const float_t *src = vSmoothedRoi.data() + rowIdx * rowPitch;
+    float_t *dst = smoothedRoi + rowIdx * rowPitch;
+    if (rowPitch <= 2 * edge)
+    {
+      std::copy(src, src + rowPitch, dst);
+      continue;
+    }
+
+    std::copy(src, src + edge, dst);
+    std::copy(src + rowPitch - edge, src + rowPitch, dst + rowPitch - edge);
+    for (std::size_t idx = edge; idx < rowPitch - edge; idx++)
+    {
+      dst[idx] = convolve<ROW_KERNEL>(src + idx - edge, TAP_STRIDE);
+    }
+  }
+}
+
+template <const auto &ROW_KERNEL, const auto &COLUMN_KERNEL>
+void smoothSeparable(const RtdVec &roi, RtdVec &smoothedRoi, std::array<uint32_t,2> size)
+{
+  assert(roi.size() == smoothedRoi.size());
+  assert(roi.size() == std::size_t(NUM_GPIXEL_PHASES) * size[0] * size[1]);
+  smoothSeparable<ROW_KERNEL, COLUMN_KERNEL, NUM_GPIXEL_PHASES>(roi.data(), smoothedRoi.data(), size, 1);
+}
+
+using SmoothFunction = void (*)(const RtdVec &, RtdVec &, std::array<uint32_t,2>);
+using SmoothPlanesFunction = void (*)(const float_t *, float_t *, std::array<uint32_t,2>, std::size_t);
+
+struct SmoothSpecialization
+{
+  uint32_t rowKernelIdx;
+  uint32_t columnKernelIdx;
+  SmoothFunction smooth;
+  SmoothPlanesFunction smoothPlanes;
+};
+
+// The kernel combinations selected by RawToDepthV2_float::reset() for each binning, and the 7x15 variant.
+const std::array<SmoothSpecialization, 4> SMOOTH_SPECIALIZATIONS
+{{
+  { 1, 1, smoothSeparable<SMOOTHING_KERNEL_1, SMOOTHING_KERNEL_1>, smoothSeparable<SMOOTHING_KERNEL_1, SMOOTHING_KERNEL_1, 1> },
+  { 1, 2, smoothSeparable<SMOOTHING_KERNEL_1, SMOOTHING_KERNEL_2>, smoothSeparable<SMOOTHING_KERNEL_1, SMOOTHING_KERNEL_2, 1> },
+  { 2, 3, smoothSeparable<SMOOTHING_KERNEL_2, SMOOTHING_KERNEL_3>, smoothSeparable<SMOOTHING_KERNEL_2, SMOOTHING_KERNEL_3, 1> },
+  { 3, 6, smoothSeparable<SMOOTHING_KERNEL_3, SMOOTHING_KERNEL_6>, smoothSeparable<SMOOTHING_KERNEL_3, SMOOTHING_KERNEL_6, 1> },
+}};
+} // namespace
+
+bool RawToDepthDsp::smoothSeparable(const std::vector<float_t> &roiSummed, std::vector<float_t> &roiSmoothed, std::array<uint32_t,2> size,
+                                    uint32_t _rowKernelIdx, uint32_t _columnKernelIdx)
+{
+  for (const auto &specialization : SMOOTH_SPECIALIZATIONS)
+  {
+    if (specialization.rowKernelIdx == _rowKernelIdx && specialization.columnKernelIdx == _columnKernelIdx)
+    {
+      specialization.smooth(roiSummed, roiSmoothed, size);
+      return true;
+    }
+  }
+  return false;
+}
+
+void RawToDepthDsp::smoothPlanes(const std::vector<float_t> &planes, std::vector<float_t> &smoothedPlanes, std::array<uint32_t,2> size,
+                                 uint32_t numPlanes, uint32_t rowKernelIdx, uint32_t columnKernelIdx)
+{
+  const auto planeSize = std::size_t(size[0]) * size[1];
+  assert(planes.size() >= numPlanes * planeSize);
+  assert(smoothedPlanes.size() >= numPlanes * planeSize);
+
+  // As in smoothSummedData(), the filters are skipped if they're disabled or larger than the image.
+  if ( (rowKernelIdx == 0 && columnKernelIdx == 0) ||
+       (_fKernels[rowKernelIdx].size() > size[1] || _fKernels[columnKernelIdx].size() > size[0]))
+  {
+    std::copy_n(planes.begin(), numPlanes * planeSize, smoothedPlanes.begin());
+    return;
+  }
+
+  for (const auto &specialization : SMOOTH_SPECIALIZATIONS)
+  {
+    if (specialization.rowKernelIdx == rowKernelIdx && specialization.columnKernelIdx == columnKernelIdx)
+    {
+      specialization.smoothPlanes(planes.data(), smoothedPlanes.data(), size, numPlanes);
+      return;
+    }
+  }
+
+  // There is no planar smoothRaw(). Other kernel combinations are smoothed in the raw frame layout.
+  SCOPED_VEC_F(taps, NUM_GPIXEL_PHASES * planeSize);
+  SCOPED_VEC_F(smoothedTaps, NUM_GPIXEL_PHASES * planeSize);
+  for (std::size_t planeIdx = 0; planeIdx < numPlanes; planeIdx += NUM_GPIXEL_PHASES)
+  {
+    interleaveTaps(planes.data() + planeIdx * planeSize, taps.data(), planeSize, planeSize);
+    smoothRaw(taps, smoothedTaps, size, rowKernelIdx, columnKernelIdx);
+    deinterleaveTaps(smoothedTaps.data(), smoothedPlanes.data() + planeIdx * planeSize, planeSize, planeSize);
+  }
+}
+
+void RawToDepthDsp::deinterleaveTaps(const float_t *taps, float_t *planes, std::size_t numPixels, std::size_t planeStride)
+{
+  std::size_t idx = RawToDepthSimd::deinterleaveTaps(taps, planes, uint32_t(numPixels), planeStride);
+  for (; idx < numPixels; idx++)
+  {
+    planes[idx] = taps[3 * idx];
+    planes[planeStride + idx] = taps[3 * idx + 1];
+    planes[2 * planeStride + idx] = taps[3 * idx + 2];
+  }
+}
+
+void RawToDepthDsp::interleaveTaps(const float_t *planes, float_t *taps, std::size_t numPixels, std::size_t planeStride)
+{
+  for (std::size_t idx = 0; idx < numPixels; idx++)
+  {
+    taps[3 * idx] = planes[idx];
+    taps[3 * idx + 1] = planes[planeStride + idx];
+    taps[3 * idx + 2] = planes[2 * planeStride + idx];
+  }
+}
+
+void RawToDepthDsp::transposeRaw(const std::vector<float_t> &roi, std::vector<float_t> &roi_t, std::array<uint32_t,2> size) {
+  assert(roi.size() == roi_t.size());
+
+  auto inPitch = size[1]*3U;
+  auto outPitch = size[0]*3U;
+  auto columnStart = 0U;
+  auto rowStart = 0U;
+
+  for (auto rowIdx=0; rowIdx<size[0]; rowIdx++) {
+    auto inIdx = columnStart;
+    auto outIdx = rowStart;
+    for (auto colIdx=0; colIdx<size[1]; colIdx++) {
+      roi_t[outIdx]   = roi[inIdx++];
+      roi_t[outIdx+1] = roi[inIdx++];
+      roi_t[outIdx+2] = roi[inIdx++];
+      outIdx += outPitch;
+    }
+    columnStart += inPitch;
+    rowStart += 3;
+  }
+}
+
+// unused. Placeholder.
+void RawToDepthDsp::smoothRaw3x5(const std::vector<float_t> &roi, std::vector<float_t> &smoothedRoi, std::array<uint32_t,2> size) {}
+
+void RawToDepthDsp::smoothRaw5x7(const std::vector<float_t> &roi, std::vector<float_t> &smoothedRoi, std::array<uint32_t,2> size)
+{
+  assert(size[0] >= SMOOTHING_KERNEL_3.size());
+  assert(size[1] >= SMOOTHING_KERNEL_2.size());
+  ::smoothSeparable<SMOOTHING_KERNEL_2, SMOOTHING_KERNEL_3>(roi, smoothedRoi, size);
+}
+
+void RawToDepthDsp::smoothRaw7x15(const std::vector<float_t> &roi, std::vector<float_t> &smoothedRoi, std::array<uint32_t,2> size)
+{
+  assert(size[0] >= SMOOTHING_KERNEL_6.size());
+  assert(size[1] >= SMOOTHING_KERNEL_3.size());
+  ::smoothSeparable<SMOOTHING_KERNEL_3, SMOOTHING_KERNEL_6>(roi, smoothedRoi, size);
+}
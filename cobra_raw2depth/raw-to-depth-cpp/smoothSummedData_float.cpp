@@ -19,11 +19,6 @@
 #include <iostream>
 #include <sstream>
 
-#define SmoothRaw5x7HKernelSize 5
-#define SmoothRaw5x7VKernelSize 7
-#define SmoothRaw7x15HKernelSize 7
-#define SmoothRaw7x15VKernelSize 15
-
 void RawToDepthDsp::smoothRaw(const std::vector<float_t> &roiSummed, std::vector<float_t> &roiSmoothed, std::array<uint32_t,2> size,
                               uint32_t _rowKernelIdx, uint32_t _columnKernelIdx)
 {
@@ -122,7 +117,6 @@ void RawToDepthDsp::smoothSummedData(const std::vector<float_t> &roiSummed, std:
   const auto numCols = size[1];
   const auto numPixels = numRows * numCols;
   assert(roiSmoothed.size() == roiSummed.size());
-  std::fill(roiSmoothed.begin(), roiSmoothed.end(), 0.0F);
 
   const auto &rowKernel_s = _fKernels[_rowKernelIdx];
   const auto &columnKernel_s = _fKernels[_columnKernelIdx];
@@ -138,19 +132,9 @@ void RawToDepthDsp::smoothSummedData(const std::vector<float_t> &roiSummed, std:
     return;
   }
 
-  if (rowKernelSize == SmoothRaw5x7HKernelSize && 
-      columnKernelSize == SmoothRaw5x7VKernelSize && 
-      doAcceleratedVersion)
-  {
-    smoothRaw5x7(roiSummed, roiSmoothed, size);
-    return;
-  }
-
-  if (rowKernelSize == SmoothRaw7x15HKernelSize && 
-      columnKernelSize == SmoothRaw7x15VKernelSize && 
-      doAcceleratedVersion)
+  // The kernel combination is dispatched once per frame to a compile-time specialization, if there is one.
+  if (doAcceleratedVersion && smoothSeparable(roiSummed, roiSmoothed, size, _rowKernelIdx, _columnKernelIdx))
   {
-    smoothRaw7x15(roiSummed, roiSmoothed, size);
     return;
   }
 
@@ -0,0 +1,240 @@
+/**
+ * @file FastTimers.cpp
+ * @brief Low-overhead timers with per-thread counters, summed up and published by a background thread.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "FastTimers.h"
+#include "LumoLogger.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr std::array<const char *, NUM_FAST_TIMERS> FAST_TIMER_NAMES = {
+#define FAST_TIMER_NAME(id, name) name,
+  FAST_TIMER_LIST(FAST_TIMER_NAME)
+#undef FAST_TIMER_NAME
+};
+
+struct TimerTotals
+{
+  uint64_t count = 0;
+  uint64_t ticks = 0;
+  uint64_t maxTicks = 0;
+};
+
+/**
+ * @brief The counters of all threads. The mutex is only taken when a thread records its first measurement, when a
+ *        thread exits and when the counters are summed up, never on the hot path.
+ */
+struct Registry
+{
+  std::mutex mutex;
+  std::vector<std::unique_ptr<FastTimerThreadCounters>> threads;
+  std::array<TimerTotals, NUM_FAST_TIMERS> retired {};   ///< The counters of the threads that have exited
+  std::array<TimerTotals, NUM_FAST_TIMERS> published {}; ///< The totals at the last publish()
+  std::array<uint64_t, NUM_FAST_TIMERS> maxTicksEver {};
+  std::shared_ptr<const std::string> lastReport = std::make_shared<const std::string>();
+
+  std::mutex publisherMutex;
+  std::condition_variable publisherCondition;
+  std::thread publisher;
+  bool stopPublisher = false;
+};
+
+Registry &registry()
+{
+  // Never destroyed, so that threads that exit after main() returns can still retire their counters
+  static auto *s_registry = new Registry;
+  return *s_registry;
+}
+
+/**
+ * @brief Marks the counters of a thread as retired when the thread exits, so that the publisher can free them.
+ */
+struct ThreadRetirer
+{
+  FastTimerThreadCounters *counters;
+  ~ThreadRetirer() { counters->retired.store(true, std::memory_order_release); }
+};
+
+/**
+ * @brief Sums the counters of all threads into totals, folding the threads that have exited into the retired
+ *        totals. Takes the maximums since the last call if clearMax is set. The registry must be locked.
+ */
+std::array<TimerTotals, NUM_FAST_TIMERS> sumThreads(Registry &reg, bool clearMax)
+{
+  auto totals = reg.retired;
+  for (auto &total : totals)
+  {
+    total.maxTicks = 0;
+  }
+
+  for (auto thread = reg.threads.begin(); thread != reg.threads.end();)
+  {
+    bool retired = (*thread)->retired.load(std::memory_order_acquire);
+    for (uint32_t id = 0; id < NUM_FAST_TIMERS; id++)
+    {
+      auto &counters = (*thread)->timers[id];
+      auto count = counters.count.load(std::memory_order_relaxed);
+      auto ticks = counters.ticks.load(std::memory_order_relaxed);
+      auto maxTicks = clearMax ? counters.maxTicks.exchange(0, std::memory_order_relaxed) :
+                                 counters.maxTicks.load(std::memory_order_relaxed);
+      totals[id].count += count;
+      totals[id].ticks += ticks;
+      totals[id].maxTicks = std::max(totals[id].maxTicks, maxTicks);
+      if (retired)
+      {
+        reg.retired[id].count += count;
+        reg.retired[id].ticks += ticks;
+      }
+    }
+    thread = retired ? reg.threads.erase(thread) : thread + 1;
+  }
+
+  for (uint32_t id = 0; id < NUM_FAST_TIMERS; id++)
+  {
+    reg.maxTicksEver[id] = std::max(reg.maxTicksEver[id], totals[id].maxTicks);
+  }
+  return totals;
+}
+
+} // namespace
+
+FastTimerThreadCounters *FastTimers::registerThread()
+{
+  auto &reg = registry();
+  auto counters = std::make_unique<FastTimerThreadCounters>();
+  auto *countersP = counters.get();
+  {
+    std::scoped_lock registryLock(reg.mutex);
+    reg.threads.push_back(std::move(counters));
+  }
+  static thread_local ThreadRetirer t_retirer { countersP };
+  return countersP;
+}
+
+double FastTimers::ticksPerMicrosecond()
+{
+  static double s_ticksPerUs = 0;
+  static std::once_flag s_calibrated;
+  std::call_once(s_calibrated, []() {
+#if defined(__aarch64__)
+    uint64_t frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    s_ticksPerUs = double(frequency) / 1e6;
+#elif defined(__x86_64__) || defined(__i386__)
+    // The TSC runs at a constant rate on the processors this runs on; measure it against the monotonic clock.
+    constexpr auto CALIBRATION_TIME = std::chrono::milliseconds(10);
+    auto clock0 = std::chrono::steady_clock::now();
+    auto ticks0 = ticks();
+    std::this_thread::sleep_for(CALIBRATION_TIME);
+    auto ticks1 = ticks();
+    auto clock1 = std::chrono::steady_clock::now();
+    auto elapsedUs = std::chrono::duration<double, std::micro>(clock1 - clock0).count();
+    s_ticksPerUs = double(ticks1 - ticks0) / elapsedUs;
+#else
+    s_ticksPerUs = 1000.0; // ticks() falls back to CLOCK_MONOTONIC nanoseconds
+#endif
+  });
+  return s_ticksPerUs;
+}
+
+const char *FastTimers::name(FastTimerId id)
+{
+  return id < NUM_FAST_TIMERS ? FAST_TIMER_NAMES[id] : "unknown";
+}
+
+std::string FastTimers::publish()
+{
+  auto ticksPerUs = ticksPerMicrosecond();
+  auto &reg = registry();
+  std::scoped_lock registryLock(reg.mutex);
+  auto totals = sumThreads(reg, true);
+
+  std::stringstream out;
+  out << std::fixed << std::setprecision(1);
+  for (uint32_t id = 0; id < NUM_FAST_TIMERS; id++)
+  {
+    auto count = totals[id].count - reg.published[id].count;
+    auto ticks = totals[id].ticks - reg.published[id].ticks;
+    if (count == 0)
+    {
+      continue;
+    }
+    auto avgUs = double(ticks) / double(count) / ticksPerUs;
+    auto maxUs = double(totals[id].maxTicks) / ticksPerUs;
+    LLogDebug("fast_timer:name=" << FAST_TIMER_NAMES[id] << ",count=" << count << ",avgUs=" << avgUs << ",maxUs=" << maxUs);
+    out << "fast_timer:name=" << FAST_TIMER_NAMES[id] << ",count=" << count <<
+      ",avgUs=" << avgUs << ",maxUs=" << maxUs << "\n";
+  }
+  reg.published = totals;
+
+  auto report = out.str();
+  std::atomic_store(&reg.lastReport, std::make_shared<const std::string>(report));
+  return report;
+}
+
+std::shared_ptr<const std::string> FastTimers::getLastReport()
+{
+  return std::atomic_load(&registry().lastReport);
+}
+
+FastTimerStats FastTimers::getStats(FastTimerId id)
+{
+  auto ticksPerUs = ticksPerMicrosecond();
+  auto &reg = registry();
+  std::scoped_lock registryLock(reg.mutex);
+  auto totals = sumThreads(reg, false);
+
+  FastTimerStats stats;
+  stats.count = totals[id].count;
+  stats.totalUs = double(totals[id].ticks) / ticksPerUs;
+  stats.maxUs = double(reg.maxTicksEver[id]) / ticksPerUs;
+  return stats;
+}
+
+void FastTimers::startPublisher(uint32_t intervalMs)
+{
+  auto &reg = registry();
+  std::scoped_lock publisherLock(reg.publisherMutex);
+  if (reg.publisher.joinable())
+  {
+    return;
+  }
+  reg.stopPublisher = false;
+  reg.publisher = std::thread([&reg, intervalMs]() {
+    std::unique_lock<std::mutex> lock(reg.publisherMutex);
+    while (!reg.publisherCondition.wait_for(lock, std::chrono::milliseconds(intervalMs), [&reg]() { return reg.stopPublisher; }))
+    {
+      lock.unlock();
+      publish();
+      lock.lock();
+    }
+  });
+}
+
+void FastTimers::stopPublisher()
+{
+  auto &reg = registry();
+  std::thread publisher;
+  {
+    std::scoped_lock publisherLock(reg.publisherMutex);
+    reg.stopPublisher = true;
+    publisher = std::move(reg.publisher);
+  }
+  reg.publisherCondition.notify_all();
+  if (publisher.joinable())
+  {
+    publisher.join();
+  }
+}
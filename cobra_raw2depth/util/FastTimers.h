@@ -0,0 +1,166 @@
+/**
+ * @file FastTimers.h
+ * @brief Timers for the per-ROI and per-frame hot paths that are cheap enough to leave enabled in production.
+ *
+ * Unlike LumoTimers, which looks its timers up by name under a mutex, every timer has an ID that is registered at
+ * compile time in FAST_TIMER_LIST, and every thread accumulates into its own block of counters, so that timing a
+ * scope is two reads of the CPU's timestamp counter (rdtsc on x86, cntvct_el0 on ARM) and three stores that no
+ * other thread writes. The blocks of all threads are summed up by FastTimers::publish(), normally called from the
+ * publisher thread started with FastTimers::startPublisher(), which logs the count, average and maximum of each timer
+ * over the last interval and keeps the report for getLastReport().
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * @brief The timers, as X(ID, name). Add new timers here; FAST_TIMER_<ID> is the ID passed to FastTimers.
+ */
+#define FAST_TIMER_LIST(X) \
+  X(RTD_PROCESS_ROI,    "RawToDepthV2_float::processRoi()") \
+  X(RTD_FRAME_HANDOFF,  "RawToDepthV2_float::processWholeFrame()") \
+  X(RTD_WHOLE_FRAME,    "RawToDepthV2_float::localProcessFrame()") \
+  X(RTD_FILL_AND_BIN,   "RawToDepthV2_float::localProcessFrame() -- fill and bin") \
+  X(RTD_CALC_PHASE,     "RawToDepthV2_float::localProcessFrame() -- calc phase") \
+  X(RTD_BANDS,          "RawToDepthV2_float::localProcessFrame() -- smooth, calc phase smooth, range, median, nearest neighbor") \
+  X(RTD_MINMAX,         "RawToDepthV2_float::localProcessFrame() -- minmax") \
+  X(RTD_FRAME_LOOP,     "RawToDepth frame loop") \
+  X(STRIPE_PROCESS_ROI, "RawToDepthStripe_float::processRoi()") \
+  X(STRIPE_WHOLE_FRAME, "RawToDepthStripe_float::processWholeFrame()") \
+  X(STRIPE_DSP,         "RawToDepthStripe_float::processStripe()") \
+  X(SENSOR_HEAD_RTD,    "SensorHeadThread::rtdLoop() -- processRoi")
+
+enum FastTimerId : uint32_t
+{
+#define FAST_TIMER_ENUM(id, name) FAST_TIMER_##id,
+  FAST_TIMER_LIST(FAST_TIMER_ENUM)
+#undef FAST_TIMER_ENUM
+  NUM_FAST_TIMERS
+};
+
+constexpr uint32_t DEFAULT_FAST_TIMERS_PUBLISH_INTERVAL_MS { 10000 };
+
+/**
+ * @brief The counters of one timer. Only the owning thread writes count and ticks, so it updates them with plain
+ *        relaxed stores instead of atomic read-modify-writes; the publisher only reads them. maxTicks is cleared by
+ *        the publisher after each interval, which can lose a maximum recorded at the same moment.
+ */
+struct FastTimerCounters
+{
+  std::atomic<uint64_t> count { 0 };
+  std::atomic<uint64_t> ticks { 0 };
+  std::atomic<uint64_t> maxTicks { 0 };
+};
+
+/**
+ * @brief The counters of every timer for one thread, on cache lines of their own.
+ */
+struct alignas(64) FastTimerThreadCounters
+{
+  std::array<FastTimerCounters, NUM_FAST_TIMERS> timers;
+  std::atomic_bool retired { false }; ///< Set when the thread exits; the publisher then folds the counters into its totals
+};
+
+/**
+ * @brief The statistics of a timer, summed over all threads.
+ */
+struct FastTimerStats
+{
+  uint64_t count = 0;
+  double totalUs = 0;
+  double maxUs = 0;
+};
+
+class FastTimers {
+public:
+  /**
+   * @brief Reads the timestamp counter. The ticks are only comparable on the same machine; see ticksPerMicrosecond().
+   */
+  static uint64_t ticks()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    struct timespec time {};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return uint64_t(time.tv_sec) * 1000000000ULL + uint64_t(time.tv_nsec);
+#endif
+  }
+
+  /**
+   * @brief Adds one measurement to a timer of the calling thread.
+   */
+  static void record(FastTimerId id, uint64_t elapsedTicks)
+  {
+    auto &counters = threadCounters().timers[id];
+    counters.count.store(counters.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    counters.ticks.store(counters.ticks.load(std::memory_order_relaxed) + elapsedTicks, std::memory_order_relaxed);
+    if (elapsedTicks > counters.maxTicks.load(std::memory_order_relaxed))
+    {
+      counters.maxTicks.store(elapsedTicks, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @brief Times a scope: measures from construction to destruction.
+   */
+  class Scoped {
+  public:
+    explicit Scoped(FastTimerId id) : _id(id), _start(ticks()) {}
+    ~Scoped() { record(_id, ticks() - _start); }
+    Scoped(Scoped &other) = delete;
+    Scoped(Scoped &&other) = delete;
+    Scoped &operator=(Scoped &rhs) = delete;
+    Scoped &operator=(Scoped &&rhs) = delete;
+
+  private:
+    const FastTimerId _id;
+    const uint64_t _start;
+  };
+
+  /**
+   * @brief Sums the counters of all threads, logs the timers that were used since the last call and saves the report.
+   *
+   * @return The report: one "fast_timer:name=...,count=...,avgUs=...,maxUs=..." line per timer used in the interval
+   */
+  static std::string publish();
+
+  /**
+   * @brief Starts a thread that calls publish() every intervalMs. Does nothing if the publisher is already running.
+   */
+  static void startPublisher(uint32_t intervalMs = DEFAULT_FAST_TIMERS_PUBLISH_INTERVAL_MS);
+  static void stopPublisher();
+
+  static std::shared_ptr<const std::string> getLastReport(); ///< The report of the last publish(); empty before the first
+  static FastTimerStats getStats(FastTimerId id);            ///< The totals of a timer since the start of the process
+  static double ticksPerMicrosecond();
+  static const char *name(FastTimerId id);
+
+private:
+  static FastTimerThreadCounters &threadCounters()
+  {
+    // A plain pointer, so that the thread local needs no initialization guard
+    static thread_local FastTimerThreadCounters *t_counters = nullptr;
+    if (t_counters == nullptr)
+    {
+      t_counters = registerThread();
+    }
+    return *t_counters;
+  }
+  static FastTimerThreadCounters *registerThread();
+};
@@ -7,118 +7,275 @@
  */
 
 #include "FloatVectorPool.h"
+#include "HugePages.h"
+#include "MemoryBudget.h"
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <thread>
 
-std::shared_ptr<FloatVectorPool> FloatVectorPool::_inst;
-std::mutex FloatVectorPool::_getterMutex;
+namespace
+{
+enum class EntryState : uint32_t { BUSY, FREE, DROPPED };
 
-int FloatVectorPool::size() {
-  auto lockedPool = getInst();
-  return (int)lockedPool.inst->_vectors.size();
-}
+struct ThreadCache;
 
-bool FloatVectorPool::exists(std::shared_ptr<std::vector<float_t>> vec) {
-  auto lockedPool = getInst();
-  for (auto idx=0; idx<lockedPool.inst->_vectors.size(); idx++) {
-    if (vec.get()==lockedPool.inst->_vectors.at(idx).get()) 
-    {
-      return true;
-    }
+/**
+ * @brief The pool's bookkeeping for one vector. Lives until the pool has dropped the vector
+ * and the last user reference to it is gone (see EntryDeleter).
+ */
+struct Entry {
+  std::shared_ptr<std::vector<float_t>> vec; // The pool's reference. Empty once dropped.
+  std::shared_ptr<ThreadCache> owner;        // The thread whose free lists this vector returns to.
+  uint32_t sizeClass { 0 };
+  std::atomic<EntryState> state { EntryState::BUSY };
+  Entry *next { nullptr };                   // Link in the owner's return stack.
+};
+
+/**
+ * @brief The deleter of every pooled vector. It identifies pooled vectors in release()
+ * through std::get_deleter(), so no search is needed.
+ */
+struct EntryDeleter {
+  Entry *entry;
+  void operator()(std::vector<float_t> *vec) const {
+    delete vec;
+    delete entry;
   }
-  return false;
+};
+
+struct ThreadCache {
+  std::array<std::vector<Entry *>, FloatVectorPool::NUM_SIZE_CLASSES> freeLists;
+  std::atomic<Entry *> returned { nullptr }; // Entries released by other threads.
+  std::atomic<bool> closed { false };        // Set when the owning thread exits.
+  uint64_t clearEpoch { 0 };
+};
+
+std::atomic<uint64_t> clearEpoch { 0 };
+std::atomic<uint64_t> hits { 0 };
+std::atomic<uint64_t> misses { 0 };
+std::atomic<uint64_t> crossThreadReleases { 0 };
+std::atomic<int32_t> numVectors { 0 };
+std::atomic<int32_t> numBusyVectors { 0 };
+std::atomic<int32_t> highWaterBusy { 0 };
+std::atomic<uint64_t> pooledBytes { 0 };
+std::atomic<uint64_t> highWaterBytes { 0 };
+
+template <typename T>
+void updateHighWater(std::atomic<T> &highWater, T value) {
+  auto current = highWater.load(std::memory_order_relaxed);
+  while (value > current &&
+         !highWater.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
 }
 
-int FloatVectorPool::numBusy() {
-  auto lockedPool = getInst();
-  int numBusy = 0;
-  for (auto idx=0; idx<lockedPool.inst->_inUse.size(); idx++)
-  {
-    if (lockedPool.inst->_inUse.at(idx)) 
-    {
-      numBusy++;
-    }
-  }
-  return numBusy;
+uint64_t entryBytes(const Entry *entry) {
+  return uint64_t(FloatVectorPool::getSizeClassCapacity(entry->sizeClass)) * sizeof(float_t);
+}
+
+void drop(Entry *entry) {
+  entry->state.store(EntryState::DROPPED);
+  numVectors.fetch_sub(1, std::memory_order_relaxed);
+  pooledBytes.fetch_sub(entryBytes(entry), std::memory_order_relaxed);
+  MemoryBudget::account(MEMORY_POOL_FLOAT_VECTORS, -int64_t(entryBytes(entry)));
+  auto vec = std::move(entry->vec); // entry might be deleted when vec goes out of scope.
 }
 
-SyncedFloatVectorPool FloatVectorPool::getInst() {
-  std::scoped_lock mutexLock(_getterMutex); // The getter method itself needs to be re-entrant
-  if (_inst) {
-    return SyncedFloatVectorPool(_inst); // This locks the pool
+void dropAll(Entry *entry) {
+  while (entry != nullptr) {
+    auto *next = entry->next;
+    drop(entry);
+    entry = next;
   }
-  
-  _inst = std::make_shared<FloatVectorPool>();
-  return SyncedFloatVectorPool(_inst); // This locks the pool
 }
 
-std::shared_ptr<std::vector<float_t>> FloatVectorPool::get(uint32_t size) {
+void pushFree(ThreadCache &cache, Entry *entry) {
+  auto &freeList = cache.freeLists[entry->sizeClass];
+  // Past the memory budget, free vectors are given back instead of cached.
+  if (freeList.size() >= FloatVectorPool::MAX_FREE_PER_CLASS || MemoryBudget::elasticOverBudget()) {
+    drop(entry);
+    return;
+  }
+  freeList.push_back(entry);
+}
 
-  auto lockedPool = getInst();
-  
-  auto idx = lockedPool.inst->find(size, lockedPool.inst);
-  if (idx >= 0) {
-    lockedPool.inst->_inUse.at(idx) = true;
-    assert(lockedPool.inst->_vectors.size() == lockedPool.inst->_inUse.size());
-    return lockedPool.inst->_vectors.at(idx);
+void drainReturned(ThreadCache &cache) {
+  auto *entry = cache.returned.exchange(nullptr);
+  while (entry != nullptr) {
+    auto *next = entry->next;
+    pushFree(cache, entry);
+    entry = next;
   }
-  lockedPool.inst->_vectors.emplace_back(std::make_shared<std::vector<float_t>>(size));
-  lockedPool.inst->_inUse.emplace_back(true);
-  assert(lockedPool.inst->_vectors.size() == lockedPool.inst->_inUse.size());
-  return lockedPool.inst->_vectors.back();
 }
 
-int FloatVectorPool::find(uint32_t size, std::shared_ptr<FloatVectorPool> inst) {
-  
-  for (auto idx=0; idx<inst->_vectors.size(); idx++) 
-  {
-    if (inst->_vectors.at(idx)->size() == size &&
-	      !inst->_inUse.at(idx))
-    {
-      return idx;
+void purge(ThreadCache &cache) {
+  for (auto &freeList : cache.freeLists) {
+    for (auto *entry : freeList) {
+      drop(entry);
     }
+    freeList.clear();
   }
-  return -1;
+  dropAll(cache.returned.exchange(nullptr));
 }
 
-void FloatVectorPool::release(std::shared_ptr<std::vector<float_t>> vec) {
-  auto lockedPool = getInst();
+/**
+ * @brief Owns the calling thread's cache. On thread exit the free vectors are dropped; vectors
+ * still busy keep the cache alive and are dropped when released.
+ */
+struct ThreadCacheHolder {
+  std::shared_ptr<ThreadCache> cache { std::make_shared<ThreadCache>() };
 
-  for (auto idx=0; idx<lockedPool.inst->_vectors.size(); idx++) 
-  {
-    if (vec.get() == lockedPool.inst->_vectors.at(idx).get()) 
-    { 
-      lockedPool.inst->_inUse.at(idx) = false;
-      return;
-    }
+  ThreadCacheHolder() { cache->clearEpoch = clearEpoch.load(); }
+  ~ThreadCacheHolder() {
+    cache->closed.store(true);
+    purge(*cache);
+  }
+  ThreadCacheHolder(ThreadCacheHolder &other) = delete;
+  ThreadCacheHolder(ThreadCacheHolder &&other) = delete;
+  ThreadCacheHolder &operator=(ThreadCacheHolder &rhs) = delete;
+  ThreadCacheHolder &operator=(ThreadCacheHolder &&rhs) = delete;
+};
+
+ThreadCacheHolder &localHolder() {
+  thread_local ThreadCacheHolder holder;
+  auto &cache = *holder.cache;
+  auto epoch = clearEpoch.load(std::memory_order_acquire);
+  if (cache.clearEpoch != epoch) {
+    purge(cache);
+    cache.clearEpoch = epoch;
   }
-  LLogErr("Could not find vector " << vec.get() << " for release in thread " << std::this_thread::get_id());
+  return holder;
 }
+} // namespace
 
-void FloatVectorPool::clear() {
-  auto lockedPool = getInst();
+uint32_t FloatVectorPool::getSizeClass(uint32_t size) {
+  if (size <= MIN_CLASS_SIZE) {
+    return 0;
+  }
+  // Each power of two [2^msb, 2^(msb+1)) of (size-1) is split into four classes on its next two bits.
+  const uint32_t val = size - 1;
+  const uint32_t msb = 31 - uint32_t(__builtin_clz(val));
+  const uint32_t step = (val >> (msb - 2)) & 3;
+  return 1 + 4 * (msb - 4) + step;
+}
 
-  std::vector<std::shared_ptr<std::vector<float_t>>> vectors;
-  std::vector<bool> inUse;
+std::size_t FloatVectorPool::getSizeClassCapacity(uint32_t sizeClass) {
+  if (sizeClass == 0) {
+    return MIN_CLASS_SIZE;
+  }
+  const uint32_t msb = 4 + (sizeClass - 1) / 4;
+  const uint32_t step = (sizeClass - 1) % 4;
+  return std::size_t(5 + step) << (msb - 2);
+}
 
-  // Only clear the items that aren't currently in use.
-  // Some items might be held by other threads.
-  for (auto idx=0; idx<lockedPool.inst->_inUse.size(); idx++)
+int FloatVectorPool::size() {
+  return numVectors.load();
+}
+
+bool FloatVectorPool::exists(const std::shared_ptr<std::vector<float_t>> &vec) {
+  auto *deleter = std::get_deleter<EntryDeleter>(vec);
+  return deleter != nullptr && deleter->entry->state.load() != EntryState::DROPPED;
+}
+
+int FloatVectorPool::numBusy() {
+  return numBusyVectors.load();
+}
+
+std::shared_ptr<std::vector<float_t>> FloatVectorPool::get(uint32_t size) {
+  auto &holder = localHolder();
+  auto &cache = *holder.cache;
+  auto sizeClass = getSizeClass(size);
+  auto &freeList = cache.freeLists[sizeClass];
+
+  if (freeList.empty() && cache.returned.load(std::memory_order_relaxed) != nullptr) {
+    drainReturned(cache);
+  }
+
+  if (!freeList.empty()) {
+    auto *entry = freeList.back();
+    freeList.pop_back();
+    entry->state.store(EntryState::BUSY, std::memory_order_relaxed);
+    entry->vec->resize(size); // Within the reserved capacity, so no reallocation.
+    hits.fetch_add(1, std::memory_order_relaxed);
+    updateHighWater(highWaterBusy, numBusyVectors.fetch_add(1, std::memory_order_relaxed) + 1);
+    return entry->vec;
+  }
+
+  auto *entry = new Entry;
+  entry->owner = holder.cache;
+  entry->sizeClass = sizeClass;
+  auto *vec = new std::vector<float_t>;
+  vec->reserve(getSizeClassCapacity(sizeClass));
+  HugePages::advise(*vec);
+  vec->resize(size);
+  entry->vec = std::shared_ptr<std::vector<float_t>>(vec, EntryDeleter { entry });
+
+  misses.fetch_add(1, std::memory_order_relaxed);
+  numVectors.fetch_add(1, std::memory_order_relaxed);
+  updateHighWater(highWaterBytes, pooledBytes.fetch_add(entryBytes(entry), std::memory_order_relaxed) + entryBytes(entry));
+  MemoryBudget::account(MEMORY_POOL_FLOAT_VECTORS, int64_t(entryBytes(entry)));
+  updateHighWater(highWaterBusy, numBusyVectors.fetch_add(1, std::memory_order_relaxed) + 1);
+  return entry->vec;
+}
+
+void FloatVectorPool::release(const std::shared_ptr<std::vector<float_t>> &vec) {
+  auto *deleter = std::get_deleter<EntryDeleter>(vec);
+  auto expected = EntryState::BUSY;
+  if (deleter == nullptr ||
+      !deleter->entry->state.compare_exchange_strong(expected, EntryState::FREE, std::memory_order_acq_rel))
   {
-    if (lockedPool.inst->_inUse[idx])
-    {
-      vectors.push_back(lockedPool.inst->_vectors[idx]);
-      inUse.push_back(lockedPool.inst->_inUse[idx]);
-    }
+    LLogErr("Could not find vector " << vec.get() << " for release in thread " << std::this_thread::get_id());
+    return;
   }
+  numBusyVectors.fetch_sub(1, std::memory_order_relaxed);
 
-  assert(vectors.size() == inUse.size());
+  auto *entry = deleter->entry;
+  auto &holder = localHolder();
+  if (entry->owner == holder.cache) {
+    pushFree(*holder.cache, entry);
+    return;
+  }
 
-  lockedPool.inst->_vectors.clear();
-  lockedPool.inst->_inUse.clear();
+  // Return the vector to the thread that allocated it. The local reference keeps the
+  // owner alive in case another thread drops the entry as soon as it is pushed.
+  crossThreadReleases.fetch_add(1, std::memory_order_relaxed);
+  auto owner = entry->owner;
+  if (owner->closed.load()) {
+    drop(entry);
+    return;
+  }
+  entry->next = owner->returned.load(std::memory_order_relaxed);
+  while (!owner->returned.compare_exchange_weak(entry->next, entry)) {}
 
-  lockedPool.inst->_vectors = vectors;
-  lockedPool.inst->_inUse = inUse;
+  // The owner may have exited between the check above and the push; if so nobody else will drain the stack.
+  if (owner->closed.load()) {
+    dropAll(owner->returned.exchange(nullptr));
+  }
+}
+
+void FloatVectorPool::clear() {
+  // Only clear the items that aren't currently in use.
+  // Some items might be held by other threads.
+  clearEpoch.fetch_add(1, std::memory_order_acq_rel);
+  localHolder();
+}
+
+FloatVectorPool::Stats FloatVectorPool::getStats() {
+  Stats stats {};
+  stats.hits = hits.load(std::memory_order_relaxed);
+  stats.misses = misses.load(std::memory_order_relaxed);
+  stats.crossThreadReleases = crossThreadReleases.load(std::memory_order_relaxed);
+  stats.numVectors = numVectors.load(std::memory_order_relaxed);
+  stats.numBusy = numBusyVectors.load(std::memory_order_relaxed);
+  stats.highWaterBusy = highWaterBusy.load(std::memory_order_relaxed);
+  stats.pooledBytes = pooledBytes.load(std::memory_order_relaxed);
+  stats.highWaterBytes = highWaterBytes.load(std::memory_order_relaxed);
+  return stats;
+}
 
-  assert(lockedPool.inst->_vectors.size() == lockedPool.inst->_inUse.size());
+void FloatVectorPool::resetStats() {
+  hits.store(0, std::memory_order_relaxed);
+  misses.store(0, std::memory_order_relaxed);
+  crossThreadReleases.store(0, std::memory_order_relaxed);
+  highWaterBusy.store(numBusyVectors.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  highWaterBytes.store(pooledBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
 }
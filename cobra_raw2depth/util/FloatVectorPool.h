@@ -1,7 +1,12 @@
 /**
  * @file FloatVectorPool.h
  * @brief Implements a dynamic pool for std::vector<float_t>.
- * 
+ *
+ * Vectors are grouped into size classes (four per power of two), and each thread keeps its own
+ * free list for each class, so get() and release() on the same thread take no locks and do not
+ * search. A vector released on a thread other than the one that allocated it is pushed onto
+ * the owning thread's lock-free return stack, and is picked up by that thread on its next miss.
+ *
  * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
  * 
  */
@@ -21,8 +26,6 @@
 #define SCOPED_VEC_F(a, size) auto a##_scoped = FloatVectorPool::ScopedVector(size); auto &a = *(a##_scoped.getVector()); 
 #endif
 
-class SyncedFloatVectorPool;
-
 class FloatVectorPool {
  public:
 
@@ -45,50 +48,40 @@ class FloatVectorPool {
     ScopedVector *operator=(ScopedVector &rhs) = delete;
     ScopedVector *operator=(ScopedVector &&rhs) = delete;
   };
-  
- private:
 
-  static std::shared_ptr<FloatVectorPool> _inst;
-  std::vector<std::shared_ptr<std::vector<float_t>>> _vectors;
-  std::vector<bool> _inUse;
-  std::mutex _mutex;
-  static std::mutex _getterMutex;
+  /**
+   * @brief Pool counters, aggregated over all threads.
+   */
+  struct Stats {
+    uint64_t hits;                 ///< get() calls satisfied from a free list.
+    uint64_t misses;               ///< get() calls that allocated a new vector.
+    uint64_t crossThreadReleases;  ///< release() calls made on a thread other than the allocating thread.
+    int32_t numVectors;            ///< Vectors currently owned by the pool, busy or free.
+    int32_t numBusy;               ///< Vectors currently handed out.
+    int32_t highWaterBusy;         ///< Maximum value of numBusy since the last resetStats().
+    uint64_t pooledBytes;          ///< Capacity, in bytes, of all vectors owned by the pool.
+    uint64_t highWaterBytes;       ///< Maximum value of pooledBytes since the last resetStats().
+  };
 
-  static int find(uint32_t size, std::shared_ptr<FloatVectorPool> inst);
-  static SyncedFloatVectorPool getInst();
+  static constexpr uint32_t MIN_CLASS_SIZE { 16 };
+  static constexpr uint32_t NUM_SIZE_CLASSES { 1 + 4 * 28 };
+  static constexpr uint32_t MAX_FREE_PER_CLASS { 64 }; ///< Per thread. Further releases free the vector.
 
-  
- public:
+  /**
+   * @brief Frees all vectors that are not currently in use. The calling thread's free lists are
+   * emptied immediately, other threads empty theirs on their next get() or release().
+   */
   static void clear();
   static std::shared_ptr<std::vector<float_t>> get(uint32_t size);
-  static void release(std::shared_ptr<std::vector<float_t>> vec);
+  static void release(const std::shared_ptr<std::vector<float_t>> &vec);
 
   static int size(); // used in testing
-  static bool exists(std::shared_ptr<std::vector<float_t>> vec); // used in testing
+  static bool exists(const std::shared_ptr<std::vector<float_t>> &vec); // used in testing
   static int numBusy();
 
-  void lock() { _mutex.lock(); }
-  void unlock() { _mutex.unlock(); }
-};
-
-
-class SyncedFloatVectorPool {
-public:
-  std::shared_ptr<FloatVectorPool> inst;
-
-  explicit SyncedFloatVectorPool(std::shared_ptr<FloatVectorPool> pool) :
-    inst(pool)
-  {
-    inst->lock();
-  }
-
-  ~SyncedFloatVectorPool()
-  {
-    inst->unlock();
-  }
+  static Stats getStats();
+  static void resetStats(); // Zeroes hits/misses and restarts the high-water marks from the current values.
 
-  SyncedFloatVectorPool(SyncedFloatVectorPool &&other) = delete;
-  SyncedFloatVectorPool(SyncedFloatVectorPool &other) = delete;
-  SyncedFloatVectorPool &operator=(SyncedFloatVectorPool &rhs) = delete;
-  SyncedFloatVectorPool &operator=(SyncedFloatVectorPool &&rhs) = delete;
+  static uint32_t getSizeClass(uint32_t size);
+  static std::size_t getSizeClassCapacity(uint32_t sizeClass);
 };
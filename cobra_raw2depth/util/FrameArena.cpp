@@ -0,0 +1,57 @@
+/**
+ * @file FrameArena.cpp
+ * @brief A per-FOV bump allocator for the float buffers used during whole-frame processing.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "FrameArena.h"
+#include "HugePages.h"
+
+std::atomic<uint64_t> FrameArena::_totalHeapAllocations { 0 };
+
+void FrameArena::grow(std::vector<float_t> &buffer, std::size_t size)
+{
+  if (size > buffer.capacity())
+  {
+    buffer.reserve(size);
+    HugePages::advise(buffer);
+    _numHeapAllocations++;
+    _totalHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void FrameArena::reserve(const std::vector<std::size_t> &sizes)
+{
+  while (_buffers.size() < sizes.size())
+  {
+    _buffers.emplace_back(std::make_unique<std::vector<float_t>>());
+  }
+  for (std::size_t idx = 0; idx < sizes.size(); idx++)
+  {
+    grow(*_buffers[idx], sizes[idx]);
+  }
+}
+
+std::vector<float_t> &FrameArena::alloc(std::size_t size)
+{
+  if (_next == _buffers.size())
+  {
+    _buffers.emplace_back(std::make_unique<std::vector<float_t>>());
+  }
+  auto &buffer = *_buffers[_next++];
+  grow(buffer, size);
+  buffer.resize(size);
+  return buffer;
+}
+
+std::size_t FrameArena::getReservedBytes() const
+{
+  std::size_t bytes = 0;
+  for (const auto &buffer : _buffers)
+  {
+    bytes += buffer->capacity() * sizeof(float_t);
+  }
+  return bytes;
+}
@@ -0,0 +1,62 @@
+/**
+ * @file FrameArena.h
+ * @brief A per-FOV bump allocator for the float buffers used during whole-frame processing.
+ *
+ * The arena hands out its buffers in allocation order and is reset at the start of every frame,
+ * so a frame that allocates the same sequence of sizes as the previous one reuses the same memory
+ * without touching the heap. Buffers can be sized up front with reserve(), and any allocation that
+ * has to grow a buffer is counted, so that tests can verify there are no heap allocations in steady state.
+ * Grown buffers are advised for huge pages (see HugePages).
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class FrameArena {
+public:
+  FrameArena() = default;
+  FrameArena(FrameArena &other) = delete;
+  FrameArena(FrameArena &&other) = delete;
+  FrameArena &operator=(FrameArena &rhs) = delete;
+  FrameArena &operator=(FrameArena &&rhs) = delete;
+  ~FrameArena() = default;
+
+  /**
+   * @brief Ensures that the first sizes.size() buffers have at least the given capacities.
+   * Must not be called while buffers from the current frame are in use.
+   */
+  void reserve(const std::vector<std::size_t> &sizes);
+
+  /**
+   * @brief Returns the next buffer, resized to size elements. The contents are not initialized.
+   * The reference stays valid until the next call to reset().
+   */
+  std::vector<float_t> &alloc(std::size_t size);
+
+  /**
+   * @brief Makes all buffers available for reuse. Called at the start of each frame.
+   */
+  void reset() { _next = 0; }
+
+  uint64_t getNumHeapAllocations() const { return _numHeapAllocations; } ///< Allocations that reserved memory, since construction.
+  std::size_t getNumBuffers() const { return _buffers.size(); }
+  std::size_t getReservedBytes() const;
+
+  static uint64_t getTotalHeapAllocations() { return _totalHeapAllocations.load(std::memory_order_relaxed); } ///< Summed over all arenas.
+
+private:
+  void grow(std::vector<float_t> &buffer, std::size_t size);
+
+  // Each buffer is separately allocated so that references remain valid when more buffers are added.
+  std::vector<std::unique_ptr<std::vector<float_t>>> _buffers;
+  std::size_t _next { 0 };
+  uint64_t _numHeapAllocations { 0 };
+  static std::atomic<uint64_t> _totalHeapAllocations;
+};
@@ -0,0 +1,144 @@
+/**
+ * @file FrameScheduler.cpp
+ * @brief A fixed set of threads that run the work of many sources, with priority and fairness between groups of sources.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "FrameScheduler.h"
+#include "LumoAffinity.h"
+#include <algorithm>
+#include <string>
+
+FrameScheduler::FrameScheduler(uint32_t numThreads, std::vector<int> affinity, std::string name, int head, std::string role)
+{
+  numThreads = std::max(numThreads, 1U);
+  _threads.reserve(numThreads);
+  for (uint32_t idx = 0; idx < numThreads; idx++)
+  {
+    _threads.emplace_back(&FrameScheduler::threadLoop, this, numThreads > 1 ? name + " " + std::to_string(idx) : name, head,
+                          affinity, role);
+  }
+}
+
+FrameScheduler::~FrameScheduler()
+{
+  {
+    std::lock_guard lock(_mutex);
+    _quit = true;
+  }
+  _workAvailable.notify_all();
+  for (auto &thread : _threads)
+  {
+    thread.join();
+  }
+}
+
+uint32_t FrameScheduler::addSource(uint32_t group, std::function<void()> runOne)
+{
+  std::lock_guard lock(_mutex);
+  const auto sourceId = _nextSourceId++;
+  auto &source = _sources[sourceId];
+  source.group = group;
+  source.runOne = std::move(runOne);
+  _groups.try_emplace(group);
+  return sourceId;
+}
+
+void FrameScheduler::removeSource(uint32_t sourceId)
+{
+  std::unique_lock lock(_mutex);
+  auto sourceIt = _sources.find(sourceId);
+  if (sourceIt == _sources.end())
+  {
+    return;
+  }
+  sourceIt->second.numPending = 0;
+  _sourceDone.wait(lock, [&sourceIt] { return !sourceIt->second.running; });
+  _sources.erase(sourceIt);
+}
+
+void FrameScheduler::submit(uint32_t sourceId)
+{
+  {
+    std::lock_guard lock(_mutex);
+    auto sourceIt = _sources.find(sourceId);
+    if (sourceIt == _sources.end())
+    {
+      return;
+    }
+    sourceIt->second.numPending++;
+  }
+  _workAvailable.notify_one();
+}
+
+void FrameScheduler::setPriority(uint32_t group, int32_t priority)
+{
+  std::lock_guard lock(_mutex);
+  _groups[group].priority = priority;
+}
+
+/**
+ * @brief Returns the source whose item runs next, or _sources.end() if none is ready. Called with _mutex held.
+ * There are only a few sources (one per FOV of each sensor head), so they are searched in full.
+ */
+std::map<uint32_t, FrameScheduler::Source>::iterator FrameScheduler::nextSource()
+{
+  auto best = _sources.end();
+  const Group *bestGroup = nullptr;
+  for (auto sourceIt = _sources.begin(); sourceIt != _sources.end(); sourceIt++)
+  {
+    const auto &source = sourceIt->second;
+    if (source.running || source.numPending == 0)
+    {
+      continue;
+    }
+
+    const auto &group = _groups[source.group];
+    if (bestGroup == nullptr || group.priority > bestGroup->priority ||
+        (group.priority == bestGroup->priority &&
+         (group.lastServed < bestGroup->lastServed ||
+          (group.lastServed == bestGroup->lastServed && source.lastServed < best->second.lastServed))))
+    {
+      best = sourceIt;
+      bestGroup = &group;
+    }
+  }
+  return best;
+}
+
+void FrameScheduler::threadLoop(std::string name, int head, std::vector<int> affinity, std::string role)
+{
+  PipelineTrace::setThreadName(name, head);
+  LumoAffinity::setThreadRole(role, affinity);
+
+  std::unique_lock lock(_mutex);
+  while (true)
+  {
+    auto sourceIt = _sources.end();
+    _workAvailable.wait(lock, [this, &sourceIt] { return _quit || (sourceIt = nextSource()) != _sources.end(); });
+    if (_quit)
+    {
+      return;
+    }
+
+    auto &source = sourceIt->second;
+    source.numPending--;
+    source.running = true;
+    source.lastServed = ++_served;
+    _groups[source.group].lastServed = _served;
+
+    // removeSource() waits for running to clear, so the source stays valid while the lock is released.
+    lock.unlock();
+    source.runOne();
+    lock.lock();
+
+    source.running = false;
+    _sourceDone.notify_all();
+    if (source.numPending > 0)
+    {
+      _workAvailable.notify_one();
+    }
+  }
+}
@@ -0,0 +1,99 @@
+/**
+ * @file FrameScheduler.h
+ * @brief A fixed set of threads that run the work of many sources (for example, the whole-frame processing of the
+ *        FOVs of all sensor heads), with priority and fairness between groups of sources.
+ *
+ * Each source runs one item of work at a time, in submission order, so that its items may share state. Items of
+ * different sources run in parallel on any of the threads. When a thread becomes free, it runs the next item of the
+ * ready source whose group has the highest priority; between groups of equal priority, the group that was served
+ * least recently goes first, and within a group, the source that was served least recently.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include "PipelineTrace.h"
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class FrameScheduler {
+public:
+  /**
+   * @brief Starts the threads.
+   *
+   * @param numThreads The number of threads that run the work of all of the sources. At least one is started.
+   * @param affinity The processors the threads are allowed to run on (see LumoAffinity). Empty for no restriction.
+   * @param name The name of the threads in the pipeline trace, followed by the thread index if there are several.
+   * @param head The sensor head the threads work for in the pipeline trace (see PipelineTrace::setThreadName()).
+   * @param role The role of the threads in the scheduling profile, which overrides affinity (see LumoAffinity::setThreadRole()).
+   */
+  explicit FrameScheduler(uint32_t numThreads, std::vector<int> affinity = {}, std::string name = "frame_scheduler",
+                          int head = PIPELINE_TRACE_SHARED_HEAD, std::string role = "");
+  FrameScheduler(FrameScheduler &other) = delete;
+  FrameScheduler(FrameScheduler &&other) = delete;
+  FrameScheduler &operator=(FrameScheduler &rhs) = delete;
+  FrameScheduler &operator=(FrameScheduler &&rhs) = delete;
+  ~FrameScheduler(); ///< Items that haven't started are discarded. All sources should have been removed.
+
+  /**
+   * @brief Adds a source of work.
+   *
+   * @param group The group of the source (for example, the sensor head), for priority and fairness.
+   * @param runOne Runs one submitted item of the source. Never called concurrently for the same source.
+   * @return The id of the source, for submit() and removeSource().
+   */
+  uint32_t addSource(uint32_t group, std::function<void()> runOne);
+
+  /**
+   * @brief Removes a source. Its items that haven't started are discarded, and the call waits for the running one.
+   * Must not be called from the source's own runOne().
+   */
+  void removeSource(uint32_t sourceId);
+
+  void submit(uint32_t sourceId); ///< Schedules one call of the source's runOne().
+
+  /**
+   * @brief Sets the priority of a group of sources. Ready sources of a higher priority group always run first.
+   * The default is 0.
+   */
+  void setPriority(uint32_t group, int32_t priority);
+
+  uint32_t getNumThreads() const { return uint32_t(_threads.size()); }
+
+private:
+  struct Source
+  {
+    uint32_t group = 0;
+    std::function<void()> runOne;
+    uint32_t numPending = 0;   ///< Items submitted but not started.
+    bool running = false;      ///< One of the threads is in runOne().
+    uint64_t lastServed = 0;   ///< The _served count when an item of the source last started.
+  };
+
+  struct Group
+  {
+    int32_t priority = 0;
+    uint64_t lastServed = 0;   ///< The _served count when an item of any source in the group last started.
+  };
+
+  std::map<uint32_t, Source>::iterator nextSource();
+  void threadLoop(std::string name, int head, std::vector<int> affinity, std::string role);
+
+  std::mutex _mutex;
+  std::condition_variable _workAvailable;
+  std::condition_variable _sourceDone;
+  std::map<uint32_t, Source> _sources; ///< Guarded by _mutex.
+  std::map<uint32_t, Group> _groups;   ///< Guarded by _mutex.
+  uint32_t _nextSourceId { 0 };        ///< Guarded by _mutex.
+  uint64_t _served { 0 };              ///< The number of items started. Guarded by _mutex.
+  bool _quit { false };
+  std::vector<std::thread> _threads;
+};
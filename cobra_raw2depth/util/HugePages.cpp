@@ -0,0 +1,265 @@
+/**
+ * @file HugePages.cpp
+ * @brief Huge-page backing for the long-lived buffers of the pipeline.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "HugePages.h"
+#include "LumoLogger.h"
+#include <cerrno>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::atomic<HugePages::Mode> HugePages::_mode { HugePages::Mode::OFF };
+
+namespace
+{
+std::atomic<uint64_t> explicitBytes { 0 };
+std::atomic<uint64_t> transparentBytes { 0 };
+std::atomic<uint64_t> regularBytes { 0 };
+std::atomic<uint64_t> advisedBytes { 0 };
+int tlbMissFd { -1 };
+
+std::size_t roundUp(std::size_t value, std::size_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+void *mapAnonymous(std::size_t bytes, unsigned int extraFlags)
+{
+  return mmap(nullptr, bytes, (unsigned int)PROT_READ | (unsigned int)PROT_WRITE,
+              (unsigned int)MAP_PRIVATE | (unsigned int)MAP_ANONYMOUS | extraFlags, -1, 0);
+}
+
+// Writing one byte per page takes the faults, as MAP_POPULATE would, but after the advice has been given
+void touchPages(void *ptr, std::size_t bytes)
+{
+  const auto pageSize = std::size_t(getpagesize());
+  auto *bytePtr = (volatile uint8_t *)ptr;
+  for (std::size_t offset = 0; offset < bytes; offset += pageSize)
+  {
+    bytePtr[offset] = 0;
+  }
+}
+
+// Over-maps by one huge page and trims, so that the buffer starts on a huge page boundary
+void *mapTransparent(std::size_t bytes)
+{
+  auto *raw = (uint8_t *)mapAnonymous(bytes + HugePages::HUGE_PAGE_SIZE, 0);
+  if (raw == MAP_FAILED)
+  {
+    return MAP_FAILED;
+  }
+  auto *aligned = (uint8_t *)roundUp(std::size_t(raw), HugePages::HUGE_PAGE_SIZE);
+  if (aligned > raw)
+  {
+    munmap(raw, aligned - raw);
+  }
+  auto tail = std::size_t(raw + HugePages::HUGE_PAGE_SIZE - aligned);
+  if (tail > 0)
+  {
+    munmap(aligned + bytes, tail);
+  }
+  return aligned;
+}
+
+void startTlbMissCounter()
+{
+  if (tlbMissFd >= 0)
+  {
+    return;
+  }
+  perf_event_attr attr = {};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = (uint64_t)PERF_COUNT_HW_CACHE_DTLB | ((uint64_t)PERF_COUNT_HW_CACHE_OP_READ << 8U) |
+                ((uint64_t)PERF_COUNT_HW_CACHE_RESULT_MISS << 16U);
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  tlbMissFd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (tlbMissFd < 0)
+  {
+    LLogWarning("huge_pages_tlb_counter:errno=" << errno << ":data TLB misses will not be reported");
+  }
+}
+
+// Reads a "Name:   value kB" field of /proc/self/smaps_rollup, in bytes, or -1
+int64_t readRollupBytes(const std::string &rollup, const std::string &name)
+{
+  auto pos = rollup.find("\n" + name + ":");
+  if (pos == std::string::npos)
+  {
+    return -1;
+  }
+  std::istringstream field(rollup.substr(pos + name.size() + 2));
+  int64_t kiloBytes = -1;
+  field >> kiloBytes;
+  return kiloBytes < 0 ? -1 : kiloBytes * 1024;
+}
+}
+
+void HugePages::configure(Mode mode)
+{
+  _mode.store(mode, std::memory_order_relaxed);
+  startTlbMissCounter();
+}
+
+bool HugePages::parseMode(const std::string &name, Mode &mode)
+{
+  for (auto candidate : { Mode::OFF, Mode::TRANSPARENT, Mode::EXPLICIT })
+  {
+    if (name == getModeName(candidate))
+    {
+      mode = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *HugePages::getModeName(Mode mode)
+{
+  switch (mode)
+  {
+  case Mode::TRANSPARENT:
+    return "thp";
+  case Mode::EXPLICIT:
+    return "explicit";
+  default:
+    return "off";
+  }
+}
+
+void *HugePages::allocate(std::size_t &bytes, Mode mode, bool populate)
+{
+  const auto populateFlag = populate ? (unsigned int)MAP_POPULATE : 0U;
+
+  if (mode == Mode::EXPLICIT)
+  {
+    auto hugeBytes = roundUp(bytes, HUGE_PAGE_SIZE);
+    void *data = mapAnonymous(hugeBytes, (unsigned int)MAP_HUGETLB | populateFlag);
+    if (data != MAP_FAILED)
+    {
+      bytes = hugeBytes;
+      explicitBytes.fetch_add(bytes, std::memory_order_relaxed);
+      return data;
+    }
+    mode = Mode::TRANSPARENT;
+  }
+
+  if (mode == Mode::TRANSPARENT)
+  {
+    auto hugeBytes = roundUp(bytes, HUGE_PAGE_SIZE);
+    void *data = mapTransparent(hugeBytes);
+    if (data != MAP_FAILED)
+    {
+      bytes = hugeBytes;
+      auto &counter = madvise(data, bytes, MADV_HUGEPAGE) == 0 ? transparentBytes : regularBytes;
+      counter.fetch_add(bytes, std::memory_order_relaxed);
+      if (populate)
+      {
+        touchPages(data, bytes);
+      }
+      return data;
+    }
+  }
+
+  auto pageBytes = roundUp(bytes, std::size_t(getpagesize()));
+  void *data = mapAnonymous(pageBytes, populateFlag);
+  if (data == MAP_FAILED)
+  {
+    LLogErr("huge_pages_allocate:errno=" << errno << ",bytes=" << bytes << ":failed to map buffer");
+    return nullptr;
+  }
+  bytes = pageBytes;
+  regularBytes.fetch_add(bytes, std::memory_order_relaxed);
+  return data;
+}
+
+void HugePages::release(void *ptr, std::size_t bytes)
+{
+  if (ptr != nullptr)
+  {
+    munmap(ptr, bytes);
+  }
+}
+
+std::shared_ptr<void> HugePages::allocateShared(std::size_t bytes)
+{
+  void *data = allocate(bytes);
+  if (data == nullptr)
+  {
+    return nullptr;
+  }
+  return std::shared_ptr<void>(data, [bytes](void *ptr) { release(ptr, bytes); });
+}
+
+void HugePages::advise(const void *ptr, std::size_t bytes)
+{
+  if (getMode() == Mode::OFF || ptr == nullptr)
+  {
+    return;
+  }
+  auto start = roundUp(std::size_t(ptr), HUGE_PAGE_SIZE);
+  auto end = (std::size_t(ptr) + bytes) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  if (end <= start)
+  {
+    return;
+  }
+  if (madvise((void *)start, end - start, MADV_HUGEPAGE) == 0)
+  {
+    advisedBytes.fetch_add(end - start, std::memory_order_relaxed);
+  }
+}
+
+HugePages::Stats HugePages::getStats()
+{
+  Stats stats = {};
+  stats.explicitBytes = explicitBytes.load(std::memory_order_relaxed);
+  stats.transparentBytes = transparentBytes.load(std::memory_order_relaxed);
+  stats.regularBytes = regularBytes.load(std::memory_order_relaxed);
+  stats.advisedBytes = advisedBytes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+std::string HugePages::getReport()
+{
+  std::ifstream file("/proc/self/smaps_rollup");
+  std::string rollup = "\n";
+  rollup.append(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+  auto hugetlbBytes = readRollupBytes(rollup, "Private_Hugetlb");
+  auto sharedHugetlbBytes = readRollupBytes(rollup, "Shared_Hugetlb");
+  if (hugetlbBytes >= 0 && sharedHugetlbBytes >= 0)
+  {
+    hugetlbBytes += sharedHugetlbBytes;
+  }
+
+  int64_t tlbMisses = -1;
+  uint64_t count = 0;
+  if (tlbMissFd >= 0 && read(tlbMissFd, &count, sizeof(count)) == ssize_t(sizeof(count)))
+  {
+    tlbMisses = int64_t(count);
+  }
+
+  const auto stats = getStats();
+  std::ostringstream report;
+  report << "hugePageMode=" << getModeName(getMode()) <<
+            ",hugePageExplicitBytes=" << stats.explicitBytes <<
+            ",hugePageTransparentBytes=" << stats.transparentBytes <<
+            ",hugePageRegularBytes=" << stats.regularBytes <<
+            ",hugePageAdvisedBytes=" << stats.advisedBytes <<
+            ",rssBytes=" << readRollupBytes(rollup, "Rss") <<
+            ",anonHugeBytes=" << readRollupBytes(rollup, "AnonHugePages") <<
+            ",hugetlbBytes=" << hugetlbBytes <<
+            ",dtlbMisses=" << tlbMisses << "\n";
+  return report.str();
+}
@@ -0,0 +1,88 @@
+/**
+ * @file HugePages.h
+ * @brief Huge-page backing for the long-lived buffers of the pipeline, with a fallback to regular pages
+ *        and a report of how much memory actually ended up on huge pages.
+ *
+ * The mode is set once at startup. In TRANSPARENT mode, buffers are advised with MADV_HUGEPAGE so the kernel
+ * backs their 2 MiB-aligned interiors with transparent huge pages. In EXPLICIT mode, buffers that HugePages
+ * maps itself come from the hugetlbfs pool (MAP_HUGETLB) and fall back to transparent huge pages when the
+ * pool is empty; heap buffers such as std::vectors can only be advised, as in TRANSPARENT mode. In OFF mode
+ * nothing is advised and mapped buffers use regular pages.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class HugePages {
+public:
+  enum class Mode : uint32_t { OFF, TRANSPARENT, EXPLICIT };
+
+  static constexpr std::size_t HUGE_PAGE_SIZE { 2UL * 1024 * 1024 };
+
+  /**
+   * @brief Where the buffers went, in bytes, since startup.
+   */
+  struct Stats {
+    uint64_t explicitBytes;    ///< Mapped from the hugetlbfs pool.
+    uint64_t transparentBytes; ///< Mapped 2 MiB-aligned and advised for transparent huge pages.
+    uint64_t regularBytes;     ///< Mapped with regular pages, in OFF mode or because advice failed.
+    uint64_t advisedBytes;     ///< Interiors of heap buffers advised for transparent huge pages.
+  };
+
+  /**
+   * @brief Sets the mode and starts counting the process' data TLB misses. Call it
+   * before any threads are started, so that the counter is inherited by all of them.
+   */
+  static void configure(Mode mode);
+  static Mode getMode() { return _mode.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Parses "off", "thp" or "explicit". Returns false for anything else.
+   */
+  static bool parseMode(const std::string &name, Mode &mode);
+  static const char *getModeName(Mode mode);
+
+  /**
+   * @brief Maps an anonymous, zeroed buffer of at least bytes bytes in the given mode, falling back from
+   * EXPLICIT to TRANSPARENT to regular pages. bytes is rounded up to the length actually mapped, which must
+   * be passed to release(). Returns nullptr if even the regular mapping failed.
+   *
+   * @param populate Takes the page faults now rather than on first use.
+   */
+  static void *allocate(std::size_t &bytes, Mode mode, bool populate = false);
+  static void *allocate(std::size_t &bytes) { return allocate(bytes, getMode()); }
+  static void release(void *ptr, std::size_t bytes);
+
+  /**
+   * @brief A buffer from allocate() that is released with its last reference.
+   */
+  static std::shared_ptr<void> allocateShared(std::size_t bytes);
+
+  /**
+   * @brief Advises the 2 MiB-aligned interior of an existing buffer for transparent huge pages, unless the
+   * mode is OFF. Buffers smaller than two huge pages may have no such interior, and are left alone.
+   */
+  static void advise(const void *ptr, std::size_t bytes);
+
+  template <typename T>
+  static void advise(const std::vector<T> &vec) { advise(vec.data(), vec.capacity() * sizeof(T)); }
+
+  static Stats getStats();
+
+  /**
+   * @brief One line with the mode, the counters of getStats(), the resident, transparent huge page and
+   * hugetlbfs bytes of the process from /proc/self/smaps_rollup, and the data TLB misses since configure()
+   * (-1 where the counter isn't available).
+   */
+  static std::string getReport();
+
+private:
+  static std::atomic<Mode> _mode;
+};
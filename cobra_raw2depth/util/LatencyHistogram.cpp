@@ -0,0 +1,144 @@
+/**
+ * @file LatencyHistogram.cpp
+ * @brief Lock-free latency histograms for the per-frame traces of the pipeline.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "LatencyHistogram.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+uint32_t LatencyHistogram::bucketIndex(uint64_t valueNs)
+{
+  constexpr uint64_t LINEAR_LIMIT = 2ULL << LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+  constexpr uint64_t MAX_VALUE = (1ULL << LATENCY_HISTOGRAM_MAX_BITS) - 1;
+  valueNs = std::min(valueNs, MAX_VALUE);
+  if (valueNs < LINEAR_LIMIT)
+  {
+    return uint32_t(valueNs);
+  }
+  // Keep the top SUB_BUCKET_BITS + 1 bits of the value; the leading one selects the power of two.
+  auto msb = uint32_t(63 - __builtin_clzll(valueNs));
+  auto shift = msb - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+  return (shift << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) + uint32_t(valueNs >> shift);
+}
+
+uint64_t LatencyHistogram::bucketHighestValue(uint32_t index)
+{
+  constexpr uint32_t LINEAR_LIMIT = 2U << LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+  constexpr uint32_t SUB_BUCKET_MASK = (1U << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) - 1;
+  if (index < LINEAR_LIMIT)
+  {
+    return index;
+  }
+  auto shift = (index >> LATENCY_HISTOGRAM_SUB_BUCKET_BITS) - 1;
+  uint64_t subBucket = (index & SUB_BUCKET_MASK) | (1U << LATENCY_HISTOGRAM_SUB_BUCKET_BITS);
+  return ((subBucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t valueNs)
+{
+  _buckets[bucketIndex(valueNs)].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  auto max = _max.load(std::memory_order_relaxed);
+  while (valueNs > max && !_max.compare_exchange_weak(max, valueNs, std::memory_order_relaxed))
+  {
+  }
+}
+
+uint64_t LatencyHistogram::getPercentile(double fraction) const
+{
+  // The buckets may be updated while they are summed up, so the target is taken from the buckets themselves
+  std::array<uint64_t, LATENCY_HISTOGRAM_NUM_BUCKETS> counts {};
+  uint64_t total = 0;
+  for (uint32_t idx = 0; idx < LATENCY_HISTOGRAM_NUM_BUCKETS; idx++)
+  {
+    counts[idx] = _buckets[idx].load(std::memory_order_relaxed);
+    total += counts[idx];
+  }
+  if (total == 0)
+  {
+    return 0;
+  }
+
+  auto target = std::max(uint64_t(1), uint64_t(std::ceil(std::clamp(fraction, 0.0, 1.0) * double(total))));
+  uint64_t seen = 0;
+  for (uint32_t idx = 0; idx < LATENCY_HISTOGRAM_NUM_BUCKETS; idx++)
+  {
+    seen += counts[idx];
+    if (seen >= target)
+    {
+      return std::min(bucketHighestValue(idx), getMax());
+    }
+  }
+  return getMax();
+}
+
+void LatencyHistogram::reset()
+{
+  for (auto &bucket : _buckets)
+  {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  _count.store(0, std::memory_order_relaxed);
+  _max.store(0, std::memory_order_relaxed);
+}
+
+void FrameLatency::record(const FrameTrace &trace)
+{
+  if (!trace.valid())
+  {
+    return;
+  }
+  // Stage n ends at trace point n + 1 and starts at the closest stamped trace point before it
+  uint64_t start = trace.ns[TRACE_DQBUF];
+  for (uint32_t point = TRACE_RTD_INGEST_DONE; point < NUM_FRAME_TRACE_POINTS; point++)
+  {
+    auto end = trace.ns[point];
+    if (end == 0)
+    {
+      continue;
+    }
+    _histograms[point - 1].record(end >= start ? end - start : 0);
+    start = end;
+  }
+  auto last = trace.ns[TRACE_LAST_PACKET_SENT];
+  if (last != 0)
+  {
+    _histograms[LATENCY_TOTAL].record(last >= trace.ns[TRACE_DQBUF] ? last - trace.ns[TRACE_DQBUF] : 0);
+  }
+}
+
+const char *FrameLatency::stageName(FrameLatencyStage stage)
+{
+  constexpr std::array<const char *, NUM_FRAME_LATENCY_STAGES> NAMES = {
+    "ingest", "rtd_queue", "whole_frame", "chunk", "first_send", "last_send", "total"
+  };
+  return stage < NUM_FRAME_LATENCY_STAGES ? NAMES[stage] : "unknown";
+}
+
+std::string FrameLatency::report(const std::string &prefix) const
+{
+  constexpr double NS_PER_US = 1000.0;
+  std::stringstream out;
+  out << std::fixed << std::setprecision(1);
+  for (uint32_t stage = 0; stage < NUM_FRAME_LATENCY_STAGES; stage++)
+  {
+    const auto &histogram = _histograms[stage];
+    if (histogram.getCount() == 0)
+    {
+      continue;
+    }
+    out << prefix << "stage=" << stageName(FrameLatencyStage(stage)) <<
+      ",count=" << histogram.getCount() <<
+      ",p50Us=" << double(histogram.getPercentile(0.5)) / NS_PER_US <<
+      ",p99Us=" << double(histogram.getPercentile(0.99)) / NS_PER_US <<
+      ",p999Us=" << double(histogram.getPercentile(0.999)) / NS_PER_US <<
+      ",maxUs=" << double(histogram.getMax()) / NS_PER_US << "\n";
+  }
+  return out.str();
+}
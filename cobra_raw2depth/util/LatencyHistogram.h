@@ -0,0 +1,139 @@
+/**
+ * @file LatencyHistogram.h
+ * @brief Per-frame latency tracing from the capture of the last ROI of a frame to the last network packet
+ *        of its point cloud, and the lock-free histograms the traces are recorded into.
+ *
+ * A FrameTrace travels with a frame through the pipeline and is stamped with CLOCK_MONOTONIC at each of the
+ * FrameTracePoint trace points. Once the last packet has been sent, the durations between consecutive trace
+ * points, and the total, are recorded into the LatencyHistograms of a FrameLatency, one per FOV stream.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+/**
+ * @brief The trace points of a frame, in pipeline order.
+ */
+enum FrameTracePoint : uint32_t
+{
+  TRACE_DQBUF,             ///< The last ROI of the frame was dequeued from Video for Linux (or read by the mock)
+  TRACE_RTD_INGEST_DONE,   ///< Raw to depth finished the per-ROI processing of the last ROI
+  TRACE_WHOLE_FRAME_START, ///< The whole-frame processing started
+  TRACE_WHOLE_FRAME_END,   ///< The whole-frame processing produced the FovSegment
+  TRACE_CHUNK_BUILT,       ///< The network chunk was built from the FovSegment
+  TRACE_FIRST_PACKET_SENT, ///< The first packet of the chunk was sent
+  TRACE_LAST_PACKET_SENT,  ///< The last packet of the chunk was sent
+  NUM_FRAME_TRACE_POINTS
+};
+
+/**
+ * @brief The CLOCK_MONOTONIC time stamps of a frame at each FrameTracePoint; zero if the point wasn't reached.
+ */
+struct FrameTrace
+{
+  std::array<uint64_t, NUM_FRAME_TRACE_POINTS> ns {};
+
+  static uint64_t now()
+  {
+    struct timespec time {};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return uint64_t(time.tv_sec) * 1000000000ULL + uint64_t(time.tv_nsec);
+  }
+
+  void stamp(FrameTracePoint point, uint64_t timeNs) { ns[point] = timeNs; }
+  void stamp(FrameTracePoint point) { ns[point] = now(); }
+  bool valid() const { return ns[TRACE_DQBUF] != 0; } ///< False if the frame didn't come from a traced capture
+};
+
+constexpr uint32_t LATENCY_HISTOGRAM_SUB_BUCKET_BITS { 5 };  ///< 32 buckets per power of two; at most 1/32 relative error
+constexpr uint32_t LATENCY_HISTOGRAM_MAX_BITS        { 36 }; ///< Values are clamped to 2^36 ns (about 68 seconds)
+constexpr uint32_t LATENCY_HISTOGRAM_NUM_BUCKETS     { (LATENCY_HISTOGRAM_MAX_BITS - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) << LATENCY_HISTOGRAM_SUB_BUCKET_BITS };
+
+/**
+ * @brief A high dynamic range histogram of nanosecond latencies with log-linear buckets: values below 64 have a
+ *        bucket each, and every power of two above that is split into 32 buckets. Recording is a few relaxed
+ *        atomic increments, so that any thread can record while another one reads the percentiles.
+ */
+class LatencyHistogram {
+public:
+  LatencyHistogram() = default;
+  LatencyHistogram(LatencyHistogram &other) = delete;
+  LatencyHistogram(LatencyHistogram &&other) = delete;
+  LatencyHistogram &operator=(LatencyHistogram &rhs) = delete;
+  LatencyHistogram &operator=(LatencyHistogram &&rhs) = delete;
+  ~LatencyHistogram() = default;
+
+  void record(uint64_t valueNs);
+
+  /**
+   * @brief Gets the value at or below which the given fraction of the recorded values lie.
+   *
+   * @param fraction The percentile as a fraction, e.g. 0.999 for p99.9
+   * @return The largest value that falls into the same bucket as that percentile, or 0 if nothing was recorded
+   */
+  uint64_t getPercentile(double fraction) const;
+  uint64_t getCount() const { return _count.load(std::memory_order_relaxed); }
+  uint64_t getMax() const { return _max.load(std::memory_order_relaxed); }
+  void reset();
+
+  static uint32_t bucketIndex(uint64_t valueNs);
+  static uint64_t bucketHighestValue(uint32_t index);
+
+private:
+  std::array<std::atomic<uint64_t>, LATENCY_HISTOGRAM_NUM_BUCKETS> _buckets {};
+  std::atomic<uint64_t> _count { 0 };
+  std::atomic<uint64_t> _max { 0 };
+};
+
+/**
+ * @brief The stages of a frame, each of which ends at a FrameTracePoint, and the whole path from DQBUF to the last packet.
+ */
+enum FrameLatencyStage : uint32_t
+{
+  LATENCY_INGEST,      ///< DQBUF to RTD ingest done
+  LATENCY_RTD_QUEUE,   ///< RTD ingest done to whole-frame start
+  LATENCY_WHOLE_FRAME, ///< Whole-frame start to end
+  LATENCY_CHUNK,       ///< Whole-frame end to chunk built, including the wait for the output stage
+  LATENCY_FIRST_SEND,  ///< Chunk built to first packet sent, including the wait for the network streamer
+  LATENCY_LAST_SEND,   ///< First packet sent to last packet sent
+  LATENCY_TOTAL,       ///< DQBUF to last packet sent
+  NUM_FRAME_LATENCY_STAGES
+};
+
+/**
+ * @brief The latency histograms of one FOV stream.
+ */
+class FrameLatency {
+public:
+  FrameLatency() = default;
+  FrameLatency(FrameLatency &other) = delete;
+  FrameLatency(FrameLatency &&other) = delete;
+  FrameLatency &operator=(FrameLatency &rhs) = delete;
+  FrameLatency &operator=(FrameLatency &&rhs) = delete;
+  ~FrameLatency() = default;
+
+  /**
+   * @brief Records the stages of a frame whose last packet has been sent. Stages whose trace points weren't
+   *        stamped are skipped.
+   */
+  void record(const FrameTrace &trace);
+  const LatencyHistogram &getHistogram(FrameLatencyStage stage) const { return _histograms[stage]; }
+
+  /**
+   * @brief Formats p50/p99/p999/max of each stage in microseconds, one line per stage, each starting with prefix.
+   *        Returns an empty string if no frame was recorded.
+   */
+  std::string report(const std::string &prefix) const;
+
+  static const char *stageName(FrameLatencyStage stage);
+
+private:
+  std::array<LatencyHistogram, NUM_FRAME_LATENCY_STAGES> _histograms;
+};
@@ -8,9 +8,22 @@
 
 #include "LumoAffinity.h"
 #include "LumoLogger.h"
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
 
 constexpr int CPU_COUNT { 6 };
+constexpr int MIN_FIFO_PRIORITY { 1 };
+constexpr int MAX_FIFO_PRIORITY { 99 };
+
+std::mutex LumoAffinity::s_profileMutex;
+std::map<std::string, ThreadProfile> LumoAffinity::s_profiles;
+bool LumoAffinity::s_lockMemory { false };
 
 bool LumoAffinity::isNCB() {
     static int _isNCB = -1;
@@ -63,3 +76,163 @@ void LumoAffinity::setAffinity(std::vector<int> processors) {
     }
     setAffinity(&cpuSet);
 }
+
+/**
+ * @brief Parses one line of a scheduling profile (see loadProfile())
+ *
+ * @return false if the line is malformed
+ */
+bool LumoAffinity::parseProfileLine(const std::string &line, std::map<std::string, ThreadProfile> &profiles, bool &lockMemory) {
+    auto start = line.find_first_not_of(" \t");
+    if (start == std::string::npos || line[start] == '#') {
+        return true;
+    }
+    auto equals = line.find('=');
+    if (equals == std::string::npos || equals == start) {
+        return false;
+    }
+    auto key = line.substr(start, line.find_last_not_of(" \t", equals - 1) + 1 - start);
+    std::istringstream value(line.substr(equals + 1));
+
+    if (key == "mlockall") {
+        int lock = 0;
+        if (!(value >> lock)) {
+            return false;
+        }
+        lockMemory = lock != 0;
+        return true;
+    }
+
+    std::string processors;
+    if (!std::getline(value, processors, ':')) {
+        return false;
+    }
+    ThreadProfile profile;
+    processors.erase(0, processors.find_first_not_of(" \t"));
+    processors.erase(processors.find_last_not_of(" \t\r") + 1);
+    if (processors != "any") {
+        std::istringstream list(processors);
+        std::string processor;
+        const auto numProcessors = sysconf(_SC_NPROCESSORS_CONF);
+        while (std::getline(list, processor, ',')) {
+            char *end = nullptr;
+            auto cpu = strtol(processor.c_str(), &end, 10);
+            if (processor.empty() || *end != '\0' || cpu < 0 || cpu >= numProcessors || cpu >= CPU_SETSIZE) {
+                return false;
+            }
+            profile.cpus.push_back(int(cpu));
+        }
+        if (profile.cpus.empty()) {
+            return false;
+        }
+    }
+    if (!value.eof() && !(value >> profile.fifoPriority)) {
+        return false;
+    }
+    if (profile.fifoPriority != 0 && (profile.fifoPriority < MIN_FIFO_PRIORITY || profile.fifoPriority > MAX_FIFO_PRIORITY)) {
+        return false;
+    }
+    profiles[key] = profile;
+    return true;
+}
+
+/**
+ * @brief Loads a scheduling profile, which replaces the built-in processor assignments of the threads of the roles it lists
+ *        (see the ROLE_ constants) on any platform. Call before the threads are started.
+ *
+ * Each line of the file is either ROLE=PROCESSORS[:PRIORITY], where PROCESSORS is a comma-separated list of processors
+ * or "any" and PRIORITY is a SCHED_FIFO priority (1 to 99), or mlockall=0|1. Blank lines and lines starting with # are
+ * ignored. A profile is usually written for one platform, since the processor numbers depend on it.
+ *
+ * @return false if the file can't be read or has a malformed line; the previous profile is kept
+ */
+bool LumoAffinity::loadProfile(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        LLogErr("loadProfile_open:path=" << path << ",errno=" << errno);
+        return false;
+    }
+
+    std::map<std::string, ThreadProfile> profiles;
+    bool lockMemory = false;
+    std::string line;
+    for (int lineNum = 1; std::getline(file, line); lineNum++) {
+        if (!parseProfileLine(line, profiles, lockMemory)) {
+            LLogErr("loadProfile_parse:path=" << path << ",line=" << lineNum);
+            return false;
+        }
+    }
+
+    std::lock_guard lock(s_profileMutex);
+    s_profiles = std::move(profiles);
+    s_lockMemory = lockMemory;
+    return true;
+}
+
+/**
+ * @brief Gets the profile of a thread role
+ *
+ * @return false if the loaded profile doesn't list the role
+ */
+bool LumoAffinity::getProfile(const std::string &role, ThreadProfile &profile) {
+    std::lock_guard lock(s_profileMutex);
+    auto entry = s_profiles.find(role);
+    if (entry == s_profiles.end()) {
+        return false;
+    }
+    profile = entry->second;
+    return true;
+}
+
+/**
+ * @brief Applies the scheduling profile of a role to the calling thread, or the default processors (on the NCB only)
+ *        if the profile doesn't list the role
+ *
+ * @param role The role of the calling thread (see the ROLE_ constants)
+ * @param defaultProcessors The processors of the role without a profile, empty for any
+ */
+void LumoAffinity::setThreadRole(const std::string &role, const std::vector<int> &defaultProcessors) {
+    ThreadProfile profile;
+    if (!getProfile(role, profile)) {
+        if (!defaultProcessors.empty()) {
+            setAffinity(defaultProcessors);
+        }
+        return;
+    }
+
+    if (!profile.cpus.empty()) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for (auto processor : profile.cpus) {
+            CPU_SET(processor, &cpuSet);
+        }
+        setAffinity(&cpuSet);
+    }
+
+    if (profile.fifoPriority > 0) {
+        struct sched_param param {};
+        param.sched_priority = profile.fifoPriority;
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error != 0) {
+            LLogWarning("setschedparam_failed:role=" << role << ",priority=" << profile.fifoPriority << ",error=" << error);
+        }
+    }
+}
+
+bool LumoAffinity::getLockMemory() {
+    std::lock_guard lock(s_profileMutex);
+    return s_lockMemory;
+}
+
+/**
+ * @brief Locks the current and future pages of the process into memory, so that page faults don't delay the real-time threads
+ *
+ * @return false if the pages couldn't be locked (for example, without CAP_IPC_LOCK)
+ */
+bool LumoAffinity::lockMemory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        LLogWarning("mlockall_failed:errno=" << errno);
+        return false;
+    }
+    return true;
+}
@@ -9,8 +9,19 @@
  */
 
 #include <sched.h>
+#include <map>
+#include <mutex>
+#include <string>
 #include <vector>
 
+/**
+ * @brief The processors and the scheduling of the threads of one role in a scheduling profile
+ */
+struct ThreadProfile {
+    std::vector<int> cpus;  // the processors the threads may run on, empty for any
+    int fifoPriority { 0 }; // SCHED_FIFO priority (1 to 99), 0 for the default time-sharing scheduler
+};
+
 class LumoAffinity {
 public:
     static constexpr int A72_0 { 4 };
@@ -21,7 +32,26 @@ public:
     static constexpr int A53_3 { 3 };
     static void setAffinity(int processor);
     static void setAffinity(std::vector<int> processors);
+
+    // The thread roles of a scheduling profile
+    static constexpr const char *ROLE_CAPTURE { "capture" };         // V4L or mock capture stage of each sensor head
+    static constexpr const char *ROLE_RTD { "rtd" };                 // raw to depth ROI ingest stage of each sensor head
+    static constexpr const char *ROLE_OUTPUT { "output" };           // point cloud output stage of each sensor head
+    static constexpr const char *ROLE_WHOLE_FRAME { "whole_frame" }; // whole frame processing and its band helpers
+    static constexpr const char *ROLE_NETWORK { "network" };         // network event loops and pipeline modules
+    static constexpr const char *ROLE_TIMESYNC { "timesync" };       // time synchronization set up
+
+    static bool loadProfile(const std::string &path);
+    static bool getProfile(const std::string &role, ThreadProfile &profile);
+    static void setThreadRole(const std::string &role, const std::vector<int> &defaultProcessors = {});
+    static bool getLockMemory();
+    static bool lockMemory();
 private:
     static void setAffinity(cpu_set_t *cpuSetP);
     static bool isNCB();
+    static bool parseProfileLine(const std::string &line, std::map<std::string, ThreadProfile> &profiles, bool &lockMemory);
+
+    static std::mutex s_profileMutex;
+    static std::map<std::string, ThreadProfile> s_profiles; // guarded by s_profileMutex
+    static bool s_lockMemory;                               // guarded by s_profileMutex
 };
@@ -6,6 +6,9 @@
  */
 
 #include "LumoLogger.h"
+#include "SpscRing.h"
+#include <cstdlib>
+#include <mutex>
 #include <chrono>
 #include <string>
 #include <cstring>
@@ -21,6 +24,7 @@ static const int NS_PER_MS  { 1000000 };
 LumoLogger *LumoLogger::_inst { nullptr };
 std::array<char, LUMO_LOG_TAG_SIZE> LumoLogger::_id = { LUMO_LOG_TAG };
 std::atomic_uint LumoLogger::logLevel { LUMO_LOG_INFO };
+std::atomic<uint32_t> LumoLogger::_rateLimit { LumoLogger::DEFAULT_RATE_LIMIT };
 
 // Force construction at startup -- otherwise log might not
 // be opened in syslog case if we log directly to syslog
@@ -53,38 +57,50 @@ void LumoLogger::setId(std::string idString)
   _id[copiedLen] = '\0';
 }
 
-static time_t getNowTime()
-{
-  auto now = std::chrono::system_clock::now();
-  return std::chrono::system_clock::to_time_t(now);
-}
+static const int64_t MS_PER_SECOND { 1000 };
+static const auto ASYNC_DRAIN_INTERVAL { std::chrono::milliseconds(2) };
 
-static void getNowTimeSecAndMs(int &sec, int &msec)
+bool LumoLogRateLimit::allow(uint32_t &suppressed)
 {
-  struct timespec now_ts {};
-  if (clock_gettime(CLOCK_REALTIME, &now_ts) < 0)
+  const auto limit = LumoLogger::getRateLimit();
+  if (limit == 0)
+  {
+    suppressed = _numSuppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  const int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  auto windowStartMs = _windowStartMs.load(std::memory_order_relaxed);
+  if ((windowStartMs == 0 || nowMs - windowStartMs >= MS_PER_SECOND) &&
+      _windowStartMs.compare_exchange_strong(windowStartMs, nowMs, std::memory_order_relaxed))
   {
-      return; // in case of failure return start of epoch because we can't log (because we use this function to log)
+    _numInWindow.store(0, std::memory_order_relaxed);
   }
-  struct tm now_tm {};
-  if (localtime_r(&now_ts.tv_sec, &now_tm) == NULL)
+
+  if (_numInWindow.fetch_add(1, std::memory_order_relaxed) >= limit)
   {
-      return; // in case of failure return start of epoch because we can't log (because we use this function to log)
+    _numSuppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
   }
-  sec = now_tm.tm_sec;
-  msec = (int)(now_ts.tv_nsec / NS_PER_MS);
+  suppressed = _numSuppressed.exchange(0, std::memory_order_relaxed);
+  return true;
 }
 
 #if defined(__unix__) && !defined(LOG_TO_CONSOLE)
 
-void LumoLogger::logString(int priority, const char *func, int line, std::string message)
+static void writeRecord(int priority, const char *func, int line, const struct timespec &time, const char *message)
 {
   std::stringstream logStream;
 
   int nowS = 0;
   int nowMs = 0;
 
-  getNowTimeSecAndMs(nowS, nowMs);
+  struct tm nowTm {};
+  if (localtime_r(&time.tv_sec, &nowTm) != NULL)
+  {
+    nowS = nowTm.tm_sec;
+    nowMs = (int)(time.tv_nsec / NS_PER_MS);
+  }
   logStream << std::setw(2) << std::setfill('0') << nowS << " " << std::setw(3) << std::setfill('0') << nowMs << " " << func << ":" << line << " " << message;
   syslog(priority, "%s", logStream.str().c_str());    /* NOLINT(hicpp-vararg) Calling Linux vararg API */
 }
@@ -92,12 +108,13 @@ void LumoLogger::logString(int priority, const char *func, int line, std::string
 #else
 
 // No millisecond timestamps when running on PC
-void LumoLogger::logString(int priority, const char *func, int line, std::string message)
+static void writeRecord(int priority, const char *func, int line, const struct timespec &time, const char *message)
 {
-  auto nowTime = getNowTime();
-  
+  struct tm nowTm {};
+  localtime_r(&time.tv_sec, &nowTm);
+
   std::stringstream logStream;
-  logStream << std::put_time(std::localtime(&nowTime), "%Y-%m-%d %X") << _id.data() << "[" << getpid() << "]: " << func << ":" << line << " " << message;
+  logStream << std::put_time(&nowTm, "%Y-%m-%d %X") << LumoLogger::getId() << "[" << getpid() << "]: " << func << ":" << line << " " << message;
 
   if (priority == LUMO_LOG_WARNING || priority == LUMO_LOG_ERR)
   {
@@ -111,6 +128,199 @@ void LumoLogger::logString(int priority, const char *func, int line, std::string
 
 #endif
 
+namespace
+{
+
+/**
+ * @brief A log record as queued by the logging thread, formatted except for the timestamp and the location.
+ */
+struct AsyncRecord
+{
+  int priority { 0 };
+  const char *func { nullptr }; ///< __func__, which has static storage.
+  int line { 0 };
+  struct timespec time {};
+  std::array<char, LumoLogger::MAX_ASYNC_RECORD + 1> message {};
+};
+
+using AsyncRing = SpscRing<AsyncRecord>;
+
+/**
+ * @brief The rings of the threads that have logged since startAsync(), and the thread that drains them.
+ */
+struct AsyncState
+{
+  std::mutex mutex; ///< Guards rings, and makes the drain thread and flush() take turns as the consumer of the rings.
+  std::vector<std::shared_ptr<AsyncRing>> rings;
+  std::atomic_bool enabled { false };
+  std::atomic_bool quitNow { false };
+  std::thread drainThread;
+  std::mutex startMutex; ///< Serializes startAsync() and stopAsync().
+  uint64_t numDroppedExited { 0 };   ///< Dropped by the threads whose rings were released. Guarded by mutex.
+  uint64_t numDroppedReported { 0 }; ///< Guarded by mutex.
+};
+
+AsyncState &asyncState()
+{
+  static AsyncState state;
+  return state;
+}
+
+// The ring of this thread, registered with the drain thread on first use. The drain thread releases it once the
+// thread has exited and its records are written.
+AsyncRing &threadRing()
+{
+  thread_local std::shared_ptr<AsyncRing> ring;
+  if (ring == nullptr)
+  {
+    ring = std::make_shared<AsyncRing>(LumoLogger::ASYNC_RING_SIZE);
+    auto &state = asyncState();
+    std::scoped_lock lock(state.mutex);
+    state.rings.push_back(ring);
+  }
+  return *ring;
+}
+
+// The records dropped so far. Called with AsyncState::mutex held.
+uint64_t numDropped(const AsyncState &state)
+{
+  uint64_t numDropped = state.numDroppedExited;
+  for (const auto &ring : state.rings)
+  {
+    numDropped += ring->getStats().dropped;
+  }
+  return numDropped;
+}
+
+// Writes the queued records. Called with AsyncState::mutex held.
+void drainRings(AsyncState &state)
+{
+  for (const auto &ring : state.rings)
+  {
+    for (auto *record = ring->front(); record != nullptr; record = ring->front())
+    {
+      writeRecord(record->priority, record->func, record->line, record->time, record->message.data());
+      ring->pop();
+    }
+  }
+
+  // The rings of the threads that have exited, which are empty now
+  for (auto it = state.rings.begin(); it != state.rings.end();)
+  {
+    if (it->use_count() > 1)
+    {
+      ++it;
+      continue;
+    }
+    state.numDroppedExited += (*it)->getStats().dropped;
+    it = state.rings.erase(it);
+  }
+
+  auto dropped = numDropped(state);
+  if (dropped > state.numDroppedReported)
+  {
+    struct timespec now {};
+    clock_gettime(CLOCK_REALTIME, &now);
+    auto message = std::to_string(dropped - state.numDroppedReported) + " log records dropped, the log rings were full";
+    writeRecord(LUMO_LOG_WARNING, __func__, __LINE__, now, message.c_str());
+    state.numDroppedReported = dropped;
+  }
+}
+
+} // namespace
+
+void LumoLogger::logString(int priority, const char *func, int line, std::string message, uint32_t suppressed)
+{
+  if (suppressed > 0)
+  {
+    message += " [" + std::to_string(suppressed) + " suppressed]";
+  }
+
+  struct timespec now {};
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  if (!asyncState().enabled.load(std::memory_order_acquire))
+  {
+    writeRecord(priority, func, line, now, message.c_str());
+    return;
+  }
+
+  auto &ring = threadRing();
+  auto *record = ring.beginPush();
+  if (record == nullptr)
+  {
+    ring.countDrop();
+    return;
+  }
+  record->priority = priority;
+  record->func = func;
+  record->line = line;
+  record->time = now;
+  auto length = message.copy(record->message.data(), MAX_ASYNC_RECORD);
+  record->message[length] = '\0';
+  ring.commitPush();
+}
+
+void LumoLogger::startAsync()
+{
+  auto &state = asyncState();
+  std::scoped_lock startLock(state.startMutex);
+  if (state.drainThread.joinable())
+  {
+    return;
+  }
+
+  static bool atExitRegistered = false;
+  if (!atExitRegistered)
+  {
+    atExitRegistered = true;
+    std::atexit(LumoLogger::stopAsync);
+  }
+
+  state.quitNow = false;
+  state.drainThread = std::thread([&state]()
+  {
+    while (!state.quitNow.load(std::memory_order_acquire))
+    {
+      {
+        std::scoped_lock lock(state.mutex);
+        drainRings(state);
+      }
+      std::this_thread::sleep_for(ASYNC_DRAIN_INTERVAL);
+    }
+  });
+  state.enabled.store(true, std::memory_order_release);
+}
+
+void LumoLogger::stopAsync()
+{
+  auto &state = asyncState();
+  std::scoped_lock startLock(state.startMutex);
+  if (!state.drainThread.joinable())
+  {
+    return;
+  }
+
+  state.enabled.store(false, std::memory_order_release);
+  state.quitNow.store(true, std::memory_order_release);
+  state.drainThread.join();
+  flush();
+}
+
+void LumoLogger::flush()
+{
+  auto &state = asyncState();
+  std::scoped_lock lock(state.mutex);
+  drainRings(state);
+}
+
+uint64_t LumoLogger::getNumDropped()
+{
+  auto &state = asyncState();
+  std::scoped_lock lock(state.mutex);
+  return numDropped(state);
+}
+
 void LumoLogger::setLogLevel(unsigned int level)
 {
   LumoLogger::logLevel = level;
@@ -1,6 +1,11 @@
 /**
  * @file LumoLogger.h
  * @brief Logging for the RawToDepth repo.
+ *
+ * The log level is checked before the message is formatted, and each call site is rate limited (see
+ * LumoLogger::setRateLimit()), so a fault that repeats on every ROI doesn't flood the log. After LumoLogger::startAsync(),
+ * the logging thread only copies the formatted record into a lock-free ring of its own, and a background thread writes
+ * the records to syslog (or the console), so logging never blocks the capture and processing threads.
  * 
  * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
  */
@@ -14,7 +19,9 @@
 #include <set>
 #include <string>
 #include <sstream>
+#include <array>
 #include <atomic>
+#include <cstdint>
 
 #if defined(__unix__)
 #include <unistd.h>
@@ -44,9 +51,13 @@
 #define LLog(_level,_expr)                      \
 {                                               \
     if ((_level) <= LumoLogger::logLevel) {     \
-        std::stringstream msgStream;            \
-        msgStream << _expr;                     /* NOLINT(bugprone-macro-parentheses) prevents using a literal C string */ \
-        LumoLogger::logString((_level), (const char *)__func__, __LINE__, msgStream.str());  \
+        static LumoLogRateLimit lumoLogRateLimit; \
+        uint32_t lumoLogSuppressed = 0;         \
+        if (lumoLogRateLimit.allow(lumoLogSuppressed)) { \
+            std::stringstream msgStream;        \
+            msgStream << _expr;                 /* NOLINT(bugprone-macro-parentheses) prevents using a literal C string */ \
+            LumoLogger::logString((_level), (const char *)__func__, __LINE__, msgStream.str(), lumoLogSuppressed);  \
+        }                                       \
     }                                           \
 }
 
@@ -75,6 +86,25 @@
 
 #define LUMO_LOG_TAG_SIZE 32
 
+/**
+ * @brief The rate limit of one LLog() call site: at most LumoLogger::getRateLimit() records per second.
+ */
+class LumoLogRateLimit
+{
+ public:
+  /**
+   * @brief Returns true if the call site may log now, and counts the record as suppressed otherwise.
+   *
+   * @param suppressed Receives the number of records suppressed since the last one allowed.
+   */
+  bool allow(uint32_t &suppressed);
+
+ private:
+  std::atomic<int64_t> _windowStartMs { 0 }; ///< The start of the current one-second window, or 0 before the first record.
+  std::atomic<uint32_t> _numInWindow { 0 };
+  std::atomic<uint32_t> _numSuppressed { 0 };
+};
+
 class LumoLogger
 {
  private:
@@ -101,7 +131,33 @@ class LumoLogger
   }
 
   static void setId(std::string idString);
+  static const char *getId() { return _id.data(); }
   static void setLogLevel(unsigned int level);
-  static void logString(int priority, const char *func, int line, std::string message);
+  /**
+   * @brief Writes a record, or queues it for the background thread after startAsync().
+   *
+   * @param suppressed The number of records of the call site suppressed by its rate limit since the last one.
+   */
+  static void logString(int priority, const char *func, int line, std::string message, uint32_t suppressed = 0);
   static std::atomic_uint logLevel;
+
+  /**
+   * @brief Writes the records on a background thread from now on. The records still queued are written by stopAsync(),
+   *        which also runs at exit(). Records longer than MAX_ASYNC_RECORD are truncated.
+   */
+  static void startAsync();
+  static void stopAsync(); ///< Writes the queued records, and writes the records synchronously from now on.
+  static void flush();     ///< Writes the records queued so far, from the calling thread.
+  static uint64_t getNumDropped(); ///< Records dropped because the ring of their thread was full.
+
+  ///< Sets the number of records per second allowed for each LLog() call site, or 0 for no limit.
+  static void setRateLimit(uint32_t recordsPerSecond) { _rateLimit = recordsPerSecond; }
+  static uint32_t getRateLimit() { return _rateLimit; }
+
+  static constexpr std::size_t MAX_ASYNC_RECORD { 256 };    ///< Characters of the message kept by the ring.
+  static constexpr uint32_t ASYNC_RING_SIZE { 256 };        ///< Records queued per thread.
+  static constexpr uint32_t DEFAULT_RATE_LIMIT { 100 };
+
+ private:
+  static std::atomic<uint32_t> _rateLimit;
 };
@@ -179,6 +179,10 @@ std::string LumoTimers::report()
   }
 
   _lastReport = totalMessage.str();
+  if (*_lastReportShared != _lastReport)
+  {
+    _lastReportShared = std::make_shared<const std::string>(_lastReport);
+  }
   return totalMessage.str();
 }
 
@@ -10,6 +10,7 @@
 
 #include "LumoLogger.h"
 #include <map>
+#include <memory>
 #include <string>
 #include <cstdint>
 #include <chrono>
@@ -160,6 +161,8 @@ private: //fields
   std::string _reportName;
   /// Holds the report generated the last time the report() method returned a non-empty string
   std::string _lastReport;
+  /// The same report, shared so that it can be handed to other threads without copying. Replaced when the report changes.
+  std::shared_ptr<const std::string> _lastReportShared { std::make_shared<const std::string>() };
   /// All start/stop operations are protected by this mutex.
   std::mutex _mutex;
   /// if RTD_DETAILED_BENCHMARKING_DIR is defined, report timing results as a json file, rotating through this many files.
@@ -173,6 +176,7 @@ public: // methods
   void stop(std::string timerName);
   std::string report();
   std::string getLastReport() { return _lastReport; }
+  std::shared_ptr<const std::string> getLastReportShared() { return _lastReportShared; }
   
   explicit LumoTimers() = default;
   explicit LumoTimers(std::string reportName);
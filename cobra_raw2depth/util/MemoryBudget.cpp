@@ -0,0 +1,249 @@
+/**
+ * @file MemoryBudget.cpp
+ * @brief One memory budget for the pools of the whole process, and the accounting of what each of them holds.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "MemoryBudget.h"
+#include "LumoLogger.h"
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <mutex>
+#include <sstream>
+
+std::atomic<uint64_t> MemoryBudget::_budgetBytes { 0 };
+
+namespace
+{
+constexpr uint64_t UNLIMITED { std::numeric_limits<uint64_t>::max() };
+
+constexpr std::array<const char *, NUM_MEMORY_POOLS> MEMORY_POOL_NAMES = {
+#define MEMORY_POOL_NAME(id, name, elastic) name,
+  MEMORY_POOL_LIST(MEMORY_POOL_NAME)
+#undef MEMORY_POOL_NAME
+};
+
+constexpr std::array<bool, NUM_MEMORY_POOLS> MEMORY_POOL_ELASTIC = {
+#define MEMORY_POOL_ELASTIC_FLAG(id, name, elastic) elastic,
+  MEMORY_POOL_LIST(MEMORY_POOL_ELASTIC_FLAG)
+#undef MEMORY_POOL_ELASTIC_FLAG
+};
+
+struct PoolState
+{
+  std::atomic<uint64_t> usedBytes { 0 };
+  std::atomic<uint64_t> highWaterBytes { 0 };
+  std::atomic<uint64_t> refusals { 0 };
+  uint64_t minBytes { 0 };   ///< Under mutex
+  uint64_t wantBytes { 0 };  ///< Under mutex
+  uint64_t shareBytes { 0 }; ///< Under mutex; of the sized pools
+};
+
+std::mutex mutex; ///< Serializes the requests and releases of the sized pools, which are rare
+std::array<PoolState, NUM_MEMORY_POOLS> pools;
+std::atomic<uint64_t> elasticUsedBytes { 0 };
+std::atomic<uint64_t> elasticShareBytes { UNLIMITED }; ///< What the sized pools leave of the budget
+
+void updateHighWater(PoolState &state, uint64_t value)
+{
+  auto current = state.highWaterBytes.load(std::memory_order_relaxed);
+  while (value > current && !state.highWaterBytes.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+}
+
+/**
+ * @brief Splits the budget between the sized pools, and sets what they leave to the elastic pools. Under mutex.
+ */
+void updateShares(uint64_t budgetBytes)
+{
+  uint64_t sumMin = 0;
+  uint64_t sumWant = 0;
+  for (uint32_t pool = 0; pool < NUM_MEMORY_POOLS; pool++)
+  {
+    if (!MEMORY_POOL_ELASTIC[pool])
+    {
+      sumMin += pools[pool].minBytes;
+      sumWant += pools[pool].wantBytes;
+    }
+  }
+
+  uint64_t sizedBytes = 0;
+  for (uint32_t pool = 0; pool < NUM_MEMORY_POOLS; pool++)
+  {
+    if (MEMORY_POOL_ELASTIC[pool])
+    {
+      continue;
+    }
+    auto &state = pools[pool];
+    if (budgetBytes == 0 || sumWant <= budgetBytes)
+    {
+      state.shareBytes = state.wantBytes;
+    }
+    else if (sumMin < budgetBytes)
+    {
+      // Beyond its minimum, each pool gets a part of the rest in proportion to what it wanted beyond it
+      const double extra = double(budgetBytes - sumMin) * double(state.wantBytes - state.minBytes) / double(sumWant - sumMin);
+      state.shareBytes = state.minBytes + uint64_t(extra);
+    }
+    else
+    {
+      state.shareBytes = state.minBytes;
+    }
+    // Grants made under a larger share are kept until they are released
+    sizedBytes += std::max(state.shareBytes, state.usedBytes.load(std::memory_order_relaxed));
+  }
+  elasticShareBytes.store(budgetBytes == 0 ? UNLIMITED : budgetBytes - std::min(budgetBytes, sizedBytes), std::memory_order_relaxed);
+}
+} // namespace
+
+void MemoryBudget::configure(uint64_t budgetBytes)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  _budgetBytes.store(budgetBytes, std::memory_order_relaxed);
+  updateShares(budgetBytes);
+}
+
+MemoryBudget::Grant MemoryBudget::request(MemoryPoolId pool, uint64_t minBytes, uint64_t wantBytes, const std::string &reason)
+{
+  Grant grant;
+  if (pool >= NUM_MEMORY_POOLS || MEMORY_POOL_ELASTIC[pool])
+  {
+    LLogErr("memory_request:pool=" << name(pool) << ",reason=" << reason << ":not a sized pool; nothing granted");
+    return grant;
+  }
+  wantBytes = std::max(wantBytes, minBytes);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &state = pools[pool];
+  const auto budgetBytes = getBudget();
+  state.minBytes += minBytes;
+  state.wantBytes += wantBytes;
+  updateShares(budgetBytes);
+
+  const auto usedBytes = state.usedBytes.load(std::memory_order_relaxed);
+  const auto available = state.shareBytes > usedBytes ? state.shareBytes - usedBytes : 0;
+  grant._pool = pool;
+  grant._minBytes = minBytes;
+  grant._wantBytes = wantBytes;
+  grant._bytes = std::clamp(available, minBytes, wantBytes);
+  state.usedBytes.fetch_add(grant._bytes, std::memory_order_relaxed);
+  updateHighWater(state, usedBytes + grant._bytes);
+  updateShares(budgetBytes);
+
+  if (grant._bytes < wantBytes)
+  {
+    state.refusals.fetch_add(1, std::memory_order_relaxed);
+    LLogWarning("memory_grant:pool=" << name(pool) << ",reason=" << reason << ",minBytes=" << minBytes << ",wantBytes=" << wantBytes <<
+                ",grantedBytes=" << grant._bytes << ",usedBytes=" << state.usedBytes.load(std::memory_order_relaxed) <<
+                ",shareBytes=" << state.shareBytes << ",budgetBytes=" << budgetBytes << ":memory budget is short; pool reduced");
+  }
+  else
+  {
+    LLogInfo("memory_grant:pool=" << name(pool) << ",reason=" << reason << ",minBytes=" << minBytes << ",wantBytes=" << wantBytes <<
+             ",grantedBytes=" << grant._bytes << ",usedBytes=" << state.usedBytes.load(std::memory_order_relaxed) <<
+             ",shareBytes=" << state.shareBytes << ",budgetBytes=" << budgetBytes);
+  }
+  return grant;
+}
+
+void MemoryBudget::Grant::reset()
+{
+  if (_bytes == 0 && _wantBytes == 0)
+  {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &state = pools[_pool];
+  state.usedBytes.fetch_sub(_bytes, std::memory_order_relaxed);
+  state.minBytes -= _minBytes;
+  state.wantBytes -= _wantBytes;
+  updateShares(getBudget());
+  LLogDebug("memory_release:pool=" << name(_pool) << ",bytes=" << _bytes << ",usedBytes=" << state.usedBytes.load(std::memory_order_relaxed));
+  _bytes = _minBytes = _wantBytes = 0;
+}
+
+bool MemoryBudget::tryAccount(MemoryPoolId pool, uint64_t bytes)
+{
+  if (pool >= NUM_MEMORY_POOLS)
+  {
+    return false;
+  }
+  const auto share = elasticShareBytes.load(std::memory_order_relaxed);
+  auto used = elasticUsedBytes.load(std::memory_order_relaxed);
+  do
+  {
+    if (share != UNLIMITED && (used > share || bytes > share - used))
+    {
+      pools[pool].refusals.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!elasticUsedBytes.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+  auto &state = pools[pool];
+  updateHighWater(state, state.usedBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+  return true;
+}
+
+void MemoryBudget::account(MemoryPoolId pool, int64_t deltaBytes)
+{
+  if (pool >= NUM_MEMORY_POOLS)
+  {
+    return;
+  }
+  auto &state = pools[pool];
+  elasticUsedBytes.fetch_add(uint64_t(deltaBytes), std::memory_order_relaxed); // wraps back for negative deltas
+  updateHighWater(state, state.usedBytes.fetch_add(uint64_t(deltaBytes), std::memory_order_relaxed) + uint64_t(deltaBytes));
+}
+
+bool MemoryBudget::elasticOverBudget()
+{
+  const auto share = elasticShareBytes.load(std::memory_order_relaxed);
+  return share != UNLIMITED && elasticUsedBytes.load(std::memory_order_relaxed) > share;
+}
+
+MemoryPoolStats MemoryBudget::getStats(MemoryPoolId pool)
+{
+  MemoryPoolStats stats;
+  if (pool >= NUM_MEMORY_POOLS)
+  {
+    return stats;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  const auto &state = pools[pool];
+  stats.shareBytes = MEMORY_POOL_ELASTIC[pool] ? elasticShareBytes.load(std::memory_order_relaxed) : state.shareBytes;
+  stats.usedBytes = state.usedBytes.load(std::memory_order_relaxed);
+  stats.highWaterBytes = state.highWaterBytes.load(std::memory_order_relaxed);
+  stats.minBytes = state.minBytes;
+  stats.wantBytes = state.wantBytes;
+  stats.refusals = state.refusals.load(std::memory_order_relaxed);
+  return stats;
+}
+
+const char *MemoryBudget::name(MemoryPoolId pool)
+{
+  return pool < NUM_MEMORY_POOLS ? MEMORY_POOL_NAMES[pool] : "unknown";
+}
+
+std::string MemoryBudget::getReport()
+{
+  std::array<MemoryPoolStats, NUM_MEMORY_POOLS> stats;
+  uint64_t usedBytes = 0;
+  for (uint32_t pool = 0; pool < NUM_MEMORY_POOLS; pool++)
+  {
+    stats[pool] = getStats(MemoryPoolId(pool));
+    usedBytes += stats[pool].usedBytes;
+  }
+  std::ostringstream report;
+  report << "memoryBudgetBytes=" << getBudget() << ",memoryUsedBytes=" << usedBytes << "\n";
+  for (uint32_t pool = 0; pool < NUM_MEMORY_POOLS; pool++)
+  {
+    const auto &pool_stats = stats[pool];
+    report << "memory_pool:name=" << name(MemoryPoolId(pool)) <<
+              ",shareBytes=" << (pool_stats.shareBytes == UNLIMITED ? -1 : int64_t(pool_stats.shareBytes)) <<
+              ",usedBytes=" << pool_stats.usedBytes << ",highWaterBytes=" << pool_stats.highWaterBytes <<
+              ",minBytes=" << pool_stats.minBytes << ",wantBytes=" << pool_stats.wantBytes <<
+              ",refusals=" << pool_stats.refusals << "\n";
+  }
+  return report.str();
+}
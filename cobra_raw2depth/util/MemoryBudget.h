@@ -0,0 +1,145 @@
+/**
+ * @file MemoryBudget.h
+ * @brief One memory budget for the pools of the whole process, and the accounting of what each of them holds.
+ *
+ * Each pool used to size itself on its own, so adding a sensor head or FOVs could only end with the process being
+ * OOM-killed. With a budget (see configure()), the pools share it instead:
+ *   - The sized pools, which allocate their buffers once when they are set up (the V4L capture buffers of each head,
+ *     the recorder batches, the mapping tables), request them with request(): the least they can work with and what
+ *     they would like. When the demands of all of the sized pools fit, each gets what it wants; otherwise each gets
+ *     its minimum plus a part of the rest of the budget in proportion to what it wanted beyond that, and sizes itself
+ *     to what it got (e.g. fewer capture buffers). The demands follow the heads and FOVs that are active and their
+ *     geometry, as the pools request and release their grants when they start and stop.
+ *   - The elastic pools, which grow with use (the FloatVectorPool, the FOVs held by the network pipelines), share
+ *     whatever the sized pools leave. They account for every allocation, and ask with tryAccount() before holding on
+ *     to more memory than they need to make progress; past the budget, the FloatVectorPool stops caching vectors and
+ *     the network pipelines skip FOVs rather than queue more of them.
+ * Without a budget (the default), the sized pools get what they want, and the pools are only accounted for.
+ *
+ * Every grant is logged with its reason, and getReport() lists the share, the usage and the high water mark of each
+ * pool.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief The pools, as X(ID, name, elastic). Add new pools here; MEMORY_POOL_<ID> is the ID passed to MemoryBudget.
+ */
+#define MEMORY_POOL_LIST(X) \
+  X(FLOAT_VECTORS,  "floatVectors",  true) \
+  X(NET_FOVS,       "netFovs",       true) \
+  X(V4L_BUFFERS,    "v4lBuffers",    false) \
+  X(RECORDERS,      "recorders",     false) \
+  X(MAPPING_TABLES, "mappingTables", false)
+
+enum MemoryPoolId : uint32_t
+{
+#define MEMORY_POOL_ENUM(id, name, elastic) MEMORY_POOL_##id,
+  MEMORY_POOL_LIST(MEMORY_POOL_ENUM)
+#undef MEMORY_POOL_ENUM
+  NUM_MEMORY_POOLS
+};
+
+/**
+ * @brief The accounting of one pool.
+ */
+struct MemoryPoolStats
+{
+  uint64_t shareBytes = 0;     ///< What the pool may hold; UINT64_MAX for the elastic pools without a budget
+  uint64_t usedBytes = 0;
+  uint64_t highWaterBytes = 0; ///< The largest usedBytes since startup
+  uint64_t minBytes = 0;       ///< The sum of the minimums of the pool's grants; 0 for the elastic pools
+  uint64_t wantBytes = 0;      ///< The sum of what the pool's grants wanted; 0 for the elastic pools
+  uint64_t refusals = 0;       ///< Requests granted less than they wanted, and tryAccount() calls refused
+};
+
+class MemoryBudget {
+public:
+  /**
+   * @brief Memory granted to a sized pool by request(). It is given back when the grant is destroyed.
+   */
+  class Grant {
+  public:
+    Grant() = default;
+    ~Grant() { reset(); }
+    Grant(Grant &&other) noexcept : _pool(other._pool), _minBytes(other._minBytes), _wantBytes(other._wantBytes), _bytes(other._bytes)
+    {
+      other._bytes = other._minBytes = other._wantBytes = 0;
+    }
+    Grant &operator=(Grant &&rhs) noexcept
+    {
+      if (this != &rhs)
+      {
+        reset();
+        _pool = rhs._pool;
+        _minBytes = rhs._minBytes;
+        _wantBytes = rhs._wantBytes;
+        _bytes = rhs._bytes;
+        rhs._bytes = rhs._minBytes = rhs._wantBytes = 0;
+      }
+      return *this;
+    }
+    Grant(const Grant &other) = delete;
+    Grant &operator=(const Grant &rhs) = delete;
+
+    uint64_t bytes() const { return _bytes; }
+    void reset(); ///< Gives the memory back
+
+  private:
+    friend class MemoryBudget;
+    MemoryPoolId _pool { MEMORY_POOL_FLOAT_VECTORS };
+    uint64_t _minBytes { 0 };
+    uint64_t _wantBytes { 0 };
+    uint64_t _bytes { 0 };
+  };
+
+  /**
+   * @brief Sets the budget of all of the pools, or 0 for no budget. The grants made so far are kept; the shares
+   *        apply to the next requests, and to the elastic pools at once.
+   */
+  static void configure(uint64_t budgetBytes);
+  static uint64_t getBudget() { return _budgetBytes.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Grants memory to a sized pool: wantBytes if it fits into the pool's share, otherwise what is left of the
+   *        share, but never less than minBytes. Logs the grant with its reason.
+   */
+  static Grant request(MemoryPoolId pool, uint64_t minBytes, uint64_t wantBytes, const std::string &reason);
+
+  /**
+   * @brief Accounts bytes to an elastic pool if the elastic pools stay within what the sized pools leave of the budget.
+   *
+   * @return false, without accounting them, otherwise
+   */
+  static bool tryAccount(MemoryPoolId pool, uint64_t bytes);
+
+  /**
+   * @brief Accounts bytes to an elastic pool whether or not they fit, e.g. memory the pool can't do without,
+   *        or, with a negative delta, memory it freed.
+   */
+  static void account(MemoryPoolId pool, int64_t deltaBytes);
+
+  /**
+   * @brief True if the elastic pools hold more than what the sized pools leave of the budget.
+   */
+  static bool elasticOverBudget();
+
+  static MemoryPoolStats getStats(MemoryPoolId pool);
+  static const char *name(MemoryPoolId pool);
+
+  /**
+   * @brief "memoryBudgetBytes=...,memoryUsedBytes=...", followed by one "memory_pool:name=...,shareBytes=...,
+   *        usedBytes=...,highWaterBytes=...,minBytes=...,wantBytes=...,refusals=..." line per pool. Shares without
+   *        a limit are -1.
+   */
+  static std::string getReport();
+
+private:
+  static std::atomic<uint64_t> _budgetBytes;
+};
@@ -0,0 +1,271 @@
+/**
+ * @file PerfCounters.cpp
+ * @brief Per-thread perf_event_open counter groups, summed per pipeline stage and FOV.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "PerfCounters.h"
+#include "LumoLogger.h"
+#include <cerrno>
+#include <iomanip>
+#include <sstream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::atomic<bool> PerfCounters::_enabled { false };
+
+namespace
+{
+constexpr std::array<const char *, NUM_PERF_STAGES> PERF_STAGE_NAMES = {
+#define PERF_STAGE_NAME(id, name) name,
+  PERF_STAGE_LIST(PERF_STAGE_NAME)
+#undef PERF_STAGE_NAME
+};
+
+constexpr std::array<const char *, NUM_PERF_EVENTS> PERF_EVENT_NAMES = {
+  "cycles", "instructions", "l1dMisses", "l2Misses", "branchMisses"
+};
+
+#if defined(__aarch64__)
+constexpr uint64_t ARMV8_L2D_CACHE_REFILL { 0x17 }; ///< The common architectural event, counted by the Cortex-A cores
+#endif
+
+/**
+ * @brief The totals of one stage of one FOV. The threads of an FOV's stage can overlap (e.g. whole-frame processing
+ *        on a pool), so they are added with read-modify-writes; counting is already two system calls per scope.
+ */
+struct StageCounters
+{
+  std::atomic<uint64_t> count { 0 };
+  std::array<std::atomic<uint64_t>, NUM_PERF_EVENTS> values {};
+};
+
+std::array<std::array<StageCounters, PERF_COUNTERS_MAX_FOVS>, NUM_PERF_STAGES> stageCounters;
+std::atomic<uint32_t> availableEvents { 0 }; ///< A bit per PerfEventId that some thread could open
+std::atomic<uint64_t> countingThreads { 0 };
+std::atomic<uint64_t> failedThreads { 0 };
+
+perf_event_attr eventAttr(PerfEventId event)
+{
+  perf_event_attr attr = {};
+  attr.size = sizeof(attr);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = (uint64_t)PERF_FORMAT_GROUP | (uint64_t)PERF_FORMAT_ID;
+  switch (event)
+  {
+  case PERF_EVENT_CYCLES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case PERF_EVENT_INSTRUCTIONS:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case PERF_EVENT_L1D_MISSES:
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = (uint64_t)PERF_COUNT_HW_CACHE_L1D | ((uint64_t)PERF_COUNT_HW_CACHE_OP_READ << 8U) |
+                  ((uint64_t)PERF_COUNT_HW_CACHE_RESULT_MISS << 16U);
+    break;
+  case PERF_EVENT_L2_MISSES:
+#if defined(__aarch64__)
+    attr.type = PERF_TYPE_RAW;
+    attr.config = ARMV8_L2D_CACHE_REFILL;
+#else
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = (uint64_t)PERF_COUNT_HW_CACHE_LL | ((uint64_t)PERF_COUNT_HW_CACHE_OP_READ << 8U) |
+                  ((uint64_t)PERF_COUNT_HW_CACHE_RESULT_MISS << 16U);
+#endif
+    break;
+  default:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+    break;
+  }
+  return attr;
+}
+
+/**
+ * @brief The counter group of one thread: the first event that could be opened leads, and the others that could be
+ *        opened follow it. The group is read with a single read() of the leader, which returns the {value, id} pairs.
+ */
+class ThreadCounters
+{
+public:
+  ThreadCounters()
+  {
+    for (uint32_t event = 0; event < NUM_PERF_EVENTS; event++)
+    {
+      auto attr = eventAttr(PerfEventId(event));
+      // NOLINTNEXTLINE(hicpp-vararg) calling Linux vararg API
+      int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, _leaderFd, 0);
+      if (fd < 0)
+      {
+        continue;
+      }
+      _fds[event] = fd;
+      // NOLINTNEXTLINE(hicpp-vararg) calling Linux vararg API
+      if (ioctl(fd, PERF_EVENT_IOC_ID, &_ids[event]) < 0)
+      {
+        close(fd);
+        _fds[event] = -1;
+        continue;
+      }
+      _leaderFd = _leaderFd < 0 ? fd : _leaderFd;
+      _numOpen++;
+      availableEvents.fetch_or(1U << event, std::memory_order_relaxed);
+    }
+    if (_leaderFd < 0)
+    {
+      if (failedThreads.fetch_add(1, std::memory_order_relaxed) == 0)
+      {
+        LLogWarning("perf_counters_open:errno=" << errno << ":hardware performance counters are not available");
+      }
+      return;
+    }
+    countingThreads.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  ~ThreadCounters()
+  {
+    for (auto fd : _fds)
+    {
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+    }
+  }
+
+  ThreadCounters(ThreadCounters &other) = delete;
+  ThreadCounters(ThreadCounters &&other) = delete;
+  ThreadCounters &operator=(ThreadCounters &rhs) = delete;
+  ThreadCounters &operator=(ThreadCounters &&rhs) = delete;
+
+  bool read(PerfSample &sample) const
+  {
+    if (_leaderFd < 0)
+    {
+      return false;
+    }
+    // nr, then a {value, id} pair per event in the group
+    std::array<uint64_t, 1 + 2 * NUM_PERF_EVENTS> buffer {};
+    const auto bytes = sizeof(uint64_t) * (1 + 2 * _numOpen);
+    if (::read(_leaderFd, buffer.data(), bytes) != ssize_t(bytes))
+    {
+      return false;
+    }
+    sample.fill(0);
+    for (uint64_t idx = 0; idx < buffer[0] && idx < _numOpen; idx++)
+    {
+      const auto value = buffer[1 + 2 * idx];
+      const auto id = buffer[2 + 2 * idx];
+      for (uint32_t event = 0; event < NUM_PERF_EVENTS; event++)
+      {
+        if (_fds[event] >= 0 && _ids[event] == id)
+        {
+          sample[event] = value;
+        }
+      }
+    }
+    return true;
+  }
+
+private:
+  std::array<int, NUM_PERF_EVENTS> _fds { -1, -1, -1, -1, -1 };
+  std::array<uint64_t, NUM_PERF_EVENTS> _ids {};
+  int _leaderFd = -1;
+  uint64_t _numOpen = 0;
+};
+} // namespace
+
+bool PerfCounters::read(PerfSample &sample)
+{
+  // Opened at the thread's first measurement, and closed when it exits
+  static thread_local ThreadCounters t_counters;
+  return t_counters.read(sample);
+}
+
+void PerfCounters::record(PerfStageId stage, uint32_t fovIdx, const PerfSample &start, const PerfSample &end)
+{
+  if (stage >= NUM_PERF_STAGES || fovIdx >= PERF_COUNTERS_MAX_FOVS)
+  {
+    return;
+  }
+  auto &counters = stageCounters[stage][fovIdx];
+  counters.count.fetch_add(1, std::memory_order_relaxed);
+  for (uint32_t event = 0; event < NUM_PERF_EVENTS; event++)
+  {
+    counters.values[event].fetch_add(end[event] - start[event], std::memory_order_relaxed);
+  }
+}
+
+PerfStageStats PerfCounters::getStats(PerfStageId stage, uint32_t fovIdx)
+{
+  PerfStageStats stats;
+  if (stage >= NUM_PERF_STAGES || fovIdx >= PERF_COUNTERS_MAX_FOVS)
+  {
+    return stats;
+  }
+  const auto &counters = stageCounters[stage][fovIdx];
+  stats.count = counters.count.load(std::memory_order_relaxed);
+  for (uint32_t event = 0; event < NUM_PERF_EVENTS; event++)
+  {
+    stats.values[event] = counters.values[event].load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+bool PerfCounters::isAvailable(PerfEventId event)
+{
+  return (availableEvents.load(std::memory_order_relaxed) & (1U << event)) != 0;
+}
+
+const char *PerfCounters::name(PerfStageId stage)
+{
+  return stage < NUM_PERF_STAGES ? PERF_STAGE_NAMES[stage] : "unknown";
+}
+
+std::string PerfCounters::getReport()
+{
+  std::ostringstream report;
+  report << "perfCounters=" << (enabled() ? "on" : "off");
+  if (!enabled())
+  {
+    report << "\n";
+    return report.str();
+  }
+  report << ",perfCounterThreads=" << countingThreads.load(std::memory_order_relaxed) <<
+            ",perfCounterFailedThreads=" << failedThreads.load(std::memory_order_relaxed) << "\n";
+
+  for (uint32_t stage = 0; stage < NUM_PERF_STAGES; stage++)
+  {
+    for (uint32_t fovIdx = 0; fovIdx < PERF_COUNTERS_MAX_FOVS; fovIdx++)
+    {
+      const auto stats = getStats(PerfStageId(stage), fovIdx);
+      if (stats.count == 0)
+      {
+        continue;
+      }
+      auto value = [&](PerfEventId event) { return isAvailable(event) ? int64_t(stats.values[event]) : -1; };
+      report << "perf_counter:stage=" << name(PerfStageId(stage)) << ",fovIdx=" << fovIdx << ",count=" << stats.count;
+      for (uint32_t event = 0; event < NUM_PERF_EVENTS; event++)
+      {
+        report << "," << PERF_EVENT_NAMES[event] << "=" << value(PerfEventId(event));
+        if (event == PERF_EVENT_INSTRUCTIONS)
+        {
+          const auto cycles = value(PERF_EVENT_CYCLES);
+          const auto instructions = value(PERF_EVENT_INSTRUCTIONS);
+          report << ",ipc=" << std::fixed << std::setprecision(2) <<
+                    (cycles > 0 && instructions >= 0 ? double(instructions) / double(cycles) : -1.0);
+        }
+      }
+      report << "\n";
+    }
+  }
+  return report.str();
+}
@@ -0,0 +1,130 @@
+/**
+ * @file PerfCounters.h
+ * @brief Optional hardware performance counters around the pipeline stages, summed per stage and FOV.
+ *
+ * FastTimers tell how long a stage took; these tell why: the cycles, instructions, L1 data cache misses, L2 cache
+ * misses and branch misses the stage spent in user space. Each thread that runs a measured stage opens one
+ * perf_event_open group of its own, counting only itself, at its first measurement; a PerfCounters::Scoped then
+ * reads the group at construction and destruction and adds the difference to the counters of its stage and FOV.
+ * The two reads are system calls, so counting is off unless PerfCounters::configure() enabled it; while it is off,
+ * a Scoped is a single relaxed load. Counters that the processor or kernel doesn't provide (e.g. without access,
+ * see /proc/sys/kernel/perf_event_paranoid) are reported as -1.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief The measured stages, as X(ID, name). Add new stages here; PERF_STAGE_<ID> is the ID passed to PerfCounters.
+ */
+#define PERF_STAGE_LIST(X) \
+  X(RTD_PROCESS_ROI,  "processOneRoi") \
+  X(RTD_WHOLE_FRAME,  "localProcessFrame") \
+  X(RTD_FILL_AND_BIN, "localProcessFrame.fillAndBin") \
+  X(RTD_CALC_PHASE,   "localProcessFrame.calcPhase") \
+  X(RTD_BANDS,        "localProcessFrame.bands") \
+  X(RTD_MINMAX,       "localProcessFrame.minmax") \
+  X(NET_HAND_IN,      "HandInCobraDepth") \
+  X(NET_CPI_CHUNK,    "WorkOnCPIChunk")
+
+enum PerfStageId : uint32_t
+{
+#define PERF_STAGE_ENUM(id, name) PERF_STAGE_##id,
+  PERF_STAGE_LIST(PERF_STAGE_ENUM)
+#undef PERF_STAGE_ENUM
+  NUM_PERF_STAGES
+};
+
+/**
+ * @brief The counted events, in the order of PerfSample.
+ */
+enum PerfEventId : uint32_t
+{
+  PERF_EVENT_CYCLES = 0,
+  PERF_EVENT_INSTRUCTIONS,
+  PERF_EVENT_L1D_MISSES,     ///< L1 data cache read misses
+  PERF_EVENT_L2_MISSES,      ///< L2 data cache refills on ARM; last-level cache read misses elsewhere
+  PERF_EVENT_BRANCH_MISSES,
+  NUM_PERF_EVENTS
+};
+
+constexpr uint32_t PERF_COUNTERS_MAX_FOVS { 8 }; ///< As MAX_ACTIVE_FOVS; measurements of other FOVs are dropped
+
+using PerfSample = std::array<uint64_t, NUM_PERF_EVENTS>;
+
+/**
+ * @brief The totals of one stage of one FOV since startup, summed over all threads.
+ */
+struct PerfStageStats
+{
+  uint64_t count = 0;    ///< The number of measurements
+  PerfSample values {};  ///< Summed over the measurements, or 0 for the unavailable events
+};
+
+class PerfCounters {
+public:
+  /**
+   * @brief Turns the counting on or off. Threads open their counters at their first measurement while it is on.
+   */
+  static void configure(bool enabled) { _enabled.store(enabled, std::memory_order_relaxed); }
+  static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Reads the counters of the calling thread, opening them if it hasn't yet.
+   *
+   * @return false if the thread's counters couldn't be opened or read
+   */
+  static bool read(PerfSample &sample);
+
+  /**
+   * @brief Adds the difference between two samples of the calling thread to a stage of an FOV.
+   */
+  static void record(PerfStageId stage, uint32_t fovIdx, const PerfSample &start, const PerfSample &end);
+
+  /**
+   * @brief Counts a scope: from construction to destruction, if counting was on at construction.
+   */
+  class Scoped {
+  public:
+    Scoped(PerfStageId stage, uint32_t fovIdx) : _stage(stage), _fovIdx(fovIdx), _active(enabled() && read(_start)) {}
+    ~Scoped()
+    {
+      PerfSample end {};
+      if (_active && read(end))
+      {
+        record(_stage, _fovIdx, _start, end);
+      }
+    }
+    Scoped(Scoped &other) = delete;
+    Scoped(Scoped &&other) = delete;
+    Scoped &operator=(Scoped &rhs) = delete;
+    Scoped &operator=(Scoped &&rhs) = delete;
+
+  private:
+    const PerfStageId _stage;
+    const uint32_t _fovIdx;
+    PerfSample _start;
+    const bool _active;
+  };
+
+  static PerfStageStats getStats(PerfStageId stage, uint32_t fovIdx);
+  static bool isAvailable(PerfEventId event); ///< Whether any thread could count the event.
+  static const char *name(PerfStageId stage);
+
+  /**
+   * @brief "perfCounters=off", or "perfCounters=on" with the number of threads counting and of threads whose
+   * counters couldn't be opened, followed by one "perf_counter:stage=...,fovIdx=...,count=...,cycles=...,
+   * instructions=...,ipc=...,l1dMisses=...,l2Misses=...,branchMisses=..." line per stage and FOV measured since
+   * startup. The counts are totals; the unavailable ones are -1.
+   */
+  static std::string getReport();
+
+private:
+  static std::atomic<bool> _enabled;
+};
@@ -0,0 +1,231 @@
+/**
+ * @file PipelineTrace.cpp
+ * @brief Per-thread span ring buffers and the Chrome trace writer.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "PipelineTrace.h"
+#include "LumoLogger.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+constexpr int SHARED_PID { 1000 }; ///< The trace process that holds the threads that serve all sensor heads
+
+namespace {
+
+struct Registry
+{
+  std::mutex mutex;
+  std::vector<std::unique_ptr<PipelineTraceThread>> threads;
+};
+
+Registry &registry()
+{
+  // Never destroyed, so that threads that exit after main() returns can still retire their rings
+  static auto *s_registry = new Registry;
+  return *s_registry;
+}
+
+/**
+ * @brief The name and head given to setThreadName(), which are kept until the thread allocates its ring.
+ */
+struct ThreadIdentity
+{
+  std::string name;
+  int head = PIPELINE_TRACE_SHARED_HEAD;
+};
+
+ThreadIdentity &threadIdentity()
+{
+  static thread_local ThreadIdentity t_identity;
+  return t_identity;
+}
+
+/**
+ * @brief Marks the ring of a thread as retired when the thread exits
+ */
+struct ThreadRetirer
+{
+  PipelineTraceThread *thread;
+  ~ThreadRetirer() { thread->retired.store(true, std::memory_order_release); }
+};
+
+int pidForHead(int head)
+{
+  return head == PIPELINE_TRACE_SHARED_HEAD ? SHARED_PID : head;
+}
+
+/**
+ * @brief Quotes a thread name for JSON. The names are ours, so only quotes and backslashes are escaped.
+ */
+std::string jsonString(const std::string &value)
+{
+  std::string quoted = "\"";
+  for (auto character : value)
+  {
+    if (character == '"' || character == '\\')
+    {
+      quoted += '\\';
+    }
+    quoted += character;
+  }
+  return quoted + "\"";
+}
+
+} // namespace
+
+PipelineTraceThread *PipelineTrace::registerThread()
+{
+  auto thread = std::make_unique<PipelineTraceThread>();
+  auto *threadP = thread.get();
+  const auto &identity = threadIdentity();
+  threadP->tid = int(syscall(SYS_gettid));
+  threadP->head = identity.head;
+  threadP->name = identity.name.empty() ? "thread " + std::to_string(threadP->tid) : identity.name;
+
+  auto &reg = registry();
+  {
+    std::scoped_lock registryLock(reg.mutex);
+    reg.threads.push_back(std::move(thread));
+  }
+  static thread_local ThreadRetirer t_retirer { threadP };
+  return threadP;
+}
+
+void PipelineTrace::setThreadName(const std::string &name, int head)
+{
+  auto &identity = threadIdentity();
+  identity.name = name;
+  identity.head = head;
+  if (t_thread != nullptr)
+  {
+    std::scoped_lock registryLock(registry().mutex);
+    t_thread->name = name;
+    t_thread->head = head;
+  }
+}
+
+void PipelineTrace::start()
+{
+  auto &reg = registry();
+  std::scoped_lock registryLock(reg.mutex);
+  if (enabled())
+  {
+    return;
+  }
+  reg.threads.erase(std::remove_if(reg.threads.begin(), reg.threads.end(),
+                                   [](const std::unique_ptr<PipelineTraceThread> &thread)
+                                   { return thread->retired.load(std::memory_order_acquire); }),
+                    reg.threads.end());
+  s_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PipelineTrace::stop()
+{
+  std::scoped_lock registryLock(registry().mutex);
+  if (enabled())
+  {
+    s_generation.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+int64_t PipelineTrace::write(const std::string &path)
+{
+  struct Span
+  {
+    const char *name;
+    uint64_t startTicks;
+    uint64_t endTicks;
+    int pid;
+    int tid;
+  };
+
+  auto &reg = registry();
+  std::vector<Span> spans;
+  std::set<std::pair<int, int>> threadsSeen;
+  std::string metadata;
+  {
+    std::scoped_lock registryLock(reg.mutex);
+    auto current = s_generation.load(std::memory_order_relaxed);
+    auto generation = current % 2 == 1 ? current : current - 1; // the running trace, or else the last one
+    for (const auto &thread : reg.threads)
+    {
+      auto pid = pidForHead(thread->head);
+      auto next = thread->next.load(std::memory_order_relaxed);
+      auto first = next > PIPELINE_TRACE_EVENTS_PER_THREAD ? next - PIPELINE_TRACE_EVENTS_PER_THREAD : 0;
+      auto numSpans = spans.size();
+      for (auto index = first; index < next; index++)
+      {
+        const auto &event = thread->events[index % PIPELINE_TRACE_EVENTS_PER_THREAD];
+        auto eventGeneration = event.generation.load(std::memory_order_acquire);
+        Span span { event.name.load(std::memory_order_relaxed), event.startTicks.load(std::memory_order_relaxed),
+                    event.endTicks.load(std::memory_order_relaxed), pid, thread->tid };
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (generation != 0 && eventGeneration == generation && event.generation.load(std::memory_order_relaxed) == generation)
+        {
+          spans.push_back(span);
+        }
+      }
+      if (spans.size() > numSpans && threadsSeen.insert({ pid, thread->tid }).second)
+      {
+        metadata += ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid) +
+                    ",\"tid\":" + std::to_string(thread->tid) + ",\"args\":{\"name\":" + jsonString(thread->name) + "}}";
+      }
+    }
+  }
+
+  std::ofstream out(path, std::ios::out | std::ios::trunc);
+  if (!out)
+  {
+    LLogErr("pipeline_trace_open:path=" << path << ",errno=" << errno);
+    return -1;
+  }
+
+  std::set<int> pids;
+  for (const auto &thread : threadsSeen)
+  {
+    pids.insert(thread.first);
+  }
+  // Every event but the first starts with the separator of the previous one
+  out << "{\"traceEvents\":[\n";
+  out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << SHARED_PID << ",\"args\":{\"name\":\"shared\"}}";
+  for (auto pid : pids)
+  {
+    if (pid != SHARED_PID)
+    {
+      out << ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":\"head " << pid << "\"}}";
+    }
+  }
+  out << metadata;
+
+  uint64_t baseTicks = UINT64_MAX;
+  for (const auto &span : spans)
+  {
+    baseTicks = std::min(baseTicks, span.startTicks);
+  }
+  const auto ticksPerUs = FastTimers::ticksPerMicrosecond();
+  out << std::fixed << std::setprecision(3);
+  for (const auto &span : spans)
+  {
+    auto duration = span.endTicks >= span.startTicks ? span.endTicks - span.startTicks : 0;
+    out << ",\n{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":" << span.pid << ",\"tid\":" << span.tid <<
+      ",\"ts\":" << double(span.startTicks - baseTicks) / ticksPerUs << ",\"dur\":" << double(duration) / ticksPerUs << "}";
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  out.close();
+  if (!out)
+  {
+    LLogErr("pipeline_trace_write:path=" << path << ",errno=" << errno);
+    return -1;
+  }
+  return int64_t(spans.size());
+}
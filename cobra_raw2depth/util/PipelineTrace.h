@@ -0,0 +1,144 @@
+/**
+ * @file PipelineTrace.h
+ * @brief Captures spans of the pipeline stages into per-thread ring buffers and writes them as a Chrome trace
+ *        (trace event JSON), which can be opened in Perfetto (ui.perfetto.dev) or chrome://tracing.
+ *
+ * Tracing is off until PipelineTrace::start() is called; while it is off, a Span is a single relaxed load. While it
+ * is on, every thread that records a span gets a ring buffer of its own holding its last
+ * PIPELINE_TRACE_EVENTS_PER_THREAD spans, so recording never takes a lock. PipelineTrace::write() collects the
+ * rings of all threads into a trace file, with the threads grouped by the sensor head given to setThreadName().
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include "FastTimers.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+constexpr uint32_t PIPELINE_TRACE_EVENTS_PER_THREAD { 16384 }; ///< A few seconds of spans at full frame rate
+constexpr int PIPELINE_TRACE_SHARED_HEAD { -1 };               ///< For threads that serve all sensor heads
+
+/**
+ * @brief One span in a thread's ring buffer. The fields are atomics so that write() can read a ring while its thread
+ *        keeps recording; generation is cleared while the other fields are written, so that a torn span is skipped.
+ */
+struct PipelineTraceEvent
+{
+  std::atomic<uint64_t> generation { 0 };
+  std::atomic<const char *> name { nullptr };
+  std::atomic<uint64_t> startTicks { 0 };
+  std::atomic<uint64_t> endTicks { 0 };
+};
+
+/**
+ * @brief The ring buffer of one thread. Only the owning thread writes it.
+ */
+struct PipelineTraceThread
+{
+  std::array<PipelineTraceEvent, PIPELINE_TRACE_EVENTS_PER_THREAD> events;
+  std::atomic<uint64_t> next { 0 }; ///< The number of spans recorded, including the overwritten ones
+  int tid = 0;
+  int head = PIPELINE_TRACE_SHARED_HEAD;
+  std::string name;
+  std::atomic_bool retired { false }; ///< Set when the thread exits; the ring is freed by the next start()
+};
+
+class PipelineTrace {
+public:
+  static bool enabled() { return s_generation.load(std::memory_order_relaxed) % 2 == 1; }
+
+  /**
+   * @brief Starts a new trace, discarding the spans of the previous one. Does nothing if a trace is running.
+   */
+  static void start();
+
+  /**
+   * @brief Stops recording. The spans are kept until the next start(), so that they can be written.
+   */
+  static void stop();
+
+  /**
+   * @brief Writes the spans of the last trace to a Chrome trace file.
+   *
+   * @param path The path of the JSON file to write
+   * @return The number of spans written, or -1 if the file can't be written
+   */
+  static int64_t write(const std::string &path);
+
+  /**
+   * @brief Names the calling thread in the trace and assigns it to a sensor head. Threads that record spans without
+   *        calling this are named after their thread ID and shown with the shared threads.
+   *
+   * @param name The thread name, e.g. "rtd"
+   * @param head The sensor head the thread works for, or PIPELINE_TRACE_SHARED_HEAD
+   */
+  static void setThreadName(const std::string &name, int head = PIPELINE_TRACE_SHARED_HEAD);
+
+  /**
+   * @brief Records a span on the calling thread if tracing is enabled.
+   *
+   * @param name A string literal; only the pointer is stored
+   * @param startTicks The FastTimers::ticks() at the start of the span
+   * @param endTicks The FastTimers::ticks() at the end of the span
+   */
+  static void record(const char *name, uint64_t startTicks, uint64_t endTicks)
+  {
+    auto generation = s_generation.load(std::memory_order_relaxed);
+    if (generation % 2 == 0)
+    {
+      return;
+    }
+    auto &thread = threadRing();
+    auto index = thread.next.load(std::memory_order_relaxed);
+    auto &event = thread.events[index % PIPELINE_TRACE_EVENTS_PER_THREAD];
+    event.generation.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name.store(name, std::memory_order_relaxed);
+    event.startTicks.store(startTicks, std::memory_order_relaxed);
+    event.endTicks.store(endTicks, std::memory_order_relaxed);
+    event.generation.store(generation, std::memory_order_release);
+    thread.next.store(index + 1, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Traces a scope: records a span from construction to destruction if tracing was enabled at construction.
+   */
+  class Span {
+  public:
+    explicit Span(const char *name) : _name(enabled() ? name : nullptr), _start(_name != nullptr ? FastTimers::ticks() : 0) {}
+    ~Span()
+    {
+      if (_name != nullptr)
+      {
+        record(_name, _start, FastTimers::ticks());
+      }
+    }
+    Span(Span &other) = delete;
+    Span(Span &&other) = delete;
+    Span &operator=(Span &rhs) = delete;
+    Span &operator=(Span &&rhs) = delete;
+
+  private:
+    const char *const _name;
+    const uint64_t _start;
+  };
+
+private:
+  static PipelineTraceThread &threadRing()
+  {
+    if (t_thread == nullptr)
+    {
+      t_thread = registerThread();
+    }
+    return *t_thread;
+  }
+  static PipelineTraceThread *registerThread();
+
+  static inline thread_local PipelineTraceThread *t_thread = nullptr; ///< Allocated when the thread records its first span
+
+  static inline std::atomic<uint64_t> s_generation { 0 }; ///< Odd while a trace is running; the spans of a trace carry its generation
+};
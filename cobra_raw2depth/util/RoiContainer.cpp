@@ -0,0 +1,180 @@
+/**
+ * @file RoiContainer.cpp
+ * @brief A memory-mapped reader for the segmented container of recorded raw ROIs.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "RoiContainer.h"
+#include "LumoLogger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+RoiContainerReader::~RoiContainerReader() = default;
+
+bool RoiContainerReader::isContainerPath(const std::string &path)
+{
+  // '<base>_ggg.rois'
+  const std::string extension(ROI_CONTAINER_EXTENSION);
+  const std::size_t suffixSize = 4 + extension.size();
+  if (path.size() <= suffixSize || path.compare(path.size() - extension.size(), extension.size(), extension) != 0)
+  {
+    return false;
+  }
+  auto pos = path.size() - suffixSize;
+  return path[pos] == '_' && std::all_of(path.begin() + long(pos) + 1, path.begin() + long(pos) + 4, ::isdigit);
+}
+
+std::string RoiContainerReader::segmentPath(const std::string &base, uint32_t segmentNum)
+{
+  std::stringstream name;
+  name << base << '_' << std::setfill('0') << std::setw(3) << segmentNum << ROI_CONTAINER_EXTENSION;
+  return name.str();
+}
+
+bool RoiContainerReader::open(const std::string &path)
+{
+  closeSegment();
+  _base = path;
+  _firstSegment = 0;
+  if (isContainerPath(path))
+  {
+    const std::size_t suffixSize = 4 + std::string(ROI_CONTAINER_EXTENSION).size();
+    _base = path.substr(0, path.size() - suffixSize);
+    _firstSegment = uint32_t(std::stoul(path.substr(path.size() - suffixSize + 1, 3)));
+  }
+  return openSegment(_firstSegment);
+}
+
+bool RoiContainerReader::rewind() { return openSegment(_firstSegment); }
+
+void RoiContainerReader::closeSegment()
+{
+  _mapping = nullptr;
+  _mappingSize = 0;
+  _index.clear();
+  _next = 0;
+}
+
+bool RoiContainerReader::openSegment(uint32_t segmentNum)
+{
+  closeSegment();
+  _segment = segmentNum;
+  auto name = segmentPath(_base, segmentNum);
+  int fd = ::open(name.c_str(), O_RDONLY); // NOLINT(hicpp-vararg) calling LINUX vararg API
+  if (fd < 0)
+  {
+    return false;
+  }
+  struct stat statBuf = {};
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &statBuf) == 0 && std::size_t(statBuf.st_size) >= sizeof(RoiContainerHeader))
+  {
+    mapping = mmap(nullptr, std::size_t(statBuf.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    LLogErr("roi_container_map:name=" << name << ",errno=" << errno << ":can't map ROI container");
+    return false;
+  }
+  // The segment is read front to back; have the kernel read ahead of us.
+  madvise(mapping, std::size_t(statBuf.st_size), MADV_SEQUENTIAL);
+  madvise(mapping, std::size_t(statBuf.st_size), MADV_WILLNEED);
+  _mappingSize = std::size_t(statBuf.st_size);
+  auto mappingSize = _mappingSize;
+  _mapping = std::shared_ptr<const uint8_t>((const uint8_t *)mapping, [mappingSize](const uint8_t *ptr) { munmap((void *)ptr, mappingSize); });
+
+  memcpy(&_header, _mapping.get(), sizeof(_header));
+  if (memcmp(_header.magic, ROI_CONTAINER_MAGIC, sizeof(ROI_CONTAINER_MAGIC)) != 0 || _header.version < ROI_CONTAINER_MIN_VERSION ||
+      _header.version > ROI_CONTAINER_VERSION)
+  {
+    LLogErr("roi_container_header:name=" << name << ":not a valid ROI container");
+    closeSegment();
+    return false;
+  }
+
+  if (!buildIndex())
+  {
+    LLogErr("roi_container_index:name=" << name << ":ROI index is outside of the file");
+    closeSegment();
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Copies the index of the current segment, or rebuilds it from the records if the segment was never closed.
+ */
+bool RoiContainerReader::buildIndex()
+{
+  const uint8_t *base = _mapping.get();
+  if (_header.closed != 0)
+  {
+    auto indexBytes = _header.numRois * sizeof(RoiIndexEntry);
+    if (_header.indexOffset > _mappingSize || indexBytes > _mappingSize - _header.indexOffset)
+    {
+      return false;
+    }
+    _index.resize(_header.numRois);
+    memcpy(_index.data(), base + _header.indexOffset, indexBytes);
+    return std::all_of(_index.begin(), _index.end(), [this](const RoiIndexEntry &entry) {
+      return entry.offset >= sizeof(RoiRecordHeader) && entry.offset <= _mappingSize && entry.size <= _mappingSize - entry.offset;
+    });
+  }
+
+  uint64_t offset = _header.headerSize;
+  auto dataEnd = std::min(_header.dataEnd, uint64_t(_mappingSize));
+  while (offset + sizeof(RoiRecordHeader) <= dataEnd)
+  {
+    RoiRecordHeader record {};
+    memcpy(&record, base + offset, sizeof(record));
+    if ((record.type != ROI_RECORD_ROI && record.type != ROI_RECORD_ROI_PACKED12 && record.type != ROI_RECORD_PADDING) ||
+        record.size > dataEnd - offset - sizeof(record))
+    {
+      break; // the rest of the segment was never written
+    }
+    if (record.type != ROI_RECORD_PADDING)
+    {
+      _index.push_back({ offset + sizeof(record), record.size, record.type == ROI_RECORD_ROI_PACKED12 ? ROI_INDEX_PACKED12 : 0,
+                         record.roiNum });
+    }
+    auto recordSize = (sizeof(record) + record.size + ROI_RECORD_ALIGNMENT - 1) / ROI_RECORD_ALIGNMENT * ROI_RECORD_ALIGNMENT;
+    offset += recordSize;
+  }
+  return true;
+}
+
+bool RoiContainerReader::next(RoiContainerRecord &record)
+{
+  while (_mapping != nullptr && _next >= _index.size())
+  {
+    if (!openSegment(_segment + 1))
+    {
+      return false;
+    }
+  }
+  if (_mapping == nullptr)
+  {
+    return false;
+  }
+
+  const auto &entry = _index[_next++];
+  RoiRecordHeader recordHeader {};
+  memcpy(&recordHeader, _mapping.get() + entry.offset - sizeof(recordHeader), sizeof(recordHeader));
+  record.data = _mapping.get() + entry.offset;
+  record.size = entry.size;
+  record.packed12 = (entry.flags & ROI_INDEX_PACKED12) != 0;
+  record.roiNum = entry.roiNum;
+  record.captureNs = recordHeader.captureNs;
+  record.owner = _mapping;
+  return true;
+}
@@ -0,0 +1,137 @@
+/**
+ * @file RoiContainer.h
+ * @brief The on-disk format of recorded raw ROIs, and a reader for it.
+ *
+ * A recording session is stored as a sequence of segment files named '<base>_ggg.rois', where ggg is the
+ * segment number starting from 000. Each segment is laid out as:
+ *   1. A RoiContainerHeader, padded to ROI_CONTAINER_ALIGNMENT bytes, which carries the head and session
+ *      numbers, the session ROI counter of the first ROI in the segment and the number of ROIs it holds.
+ *   2. The records: a RoiRecordHeader followed by the ROI bytes exactly as they were received from the
+ *      sensor, padded to ROI_RECORD_ALIGNMENT bytes. Records of type ROI_RECORD_ROI_PACKED12 (version 2) hold
+ *      the ROI packed to 12 bits per word instead (see RawToDepthDsp::packRaw12()). Records of type
+ *      ROI_RECORD_PADDING carry no ROI and are skipped; they keep the writes aligned for O_DIRECT.
+ *   3. Once the segment has been closed, an index of RoiIndexEntry, one for each ROI, at indexOffset.
+ * The header is rewritten after every write, so a segment that was never closed (e.g., after a power loss)
+ * can still be read up to dataEnd by walking the records.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+constexpr uint32_t ROI_CONTAINER_VERSION   { 2 };
+constexpr uint32_t ROI_CONTAINER_MIN_VERSION { 1 }; ///< The oldest version the reader accepts
+constexpr uint32_t ROI_CONTAINER_ALIGNMENT { 4096 }; ///< Alignment of the header, the writes and the index, as required by O_DIRECT
+constexpr uint32_t ROI_RECORD_ALIGNMENT    { 8 };
+constexpr uint32_t ROI_RECORD_ROI          { 0x30494f52 }; ///< "ROI0"
+constexpr uint32_t ROI_RECORD_ROI_PACKED12 { 0x32314f52 }; ///< "RO12"
+constexpr uint32_t ROI_RECORD_PADDING      { 0x30444150 }; ///< "PAD0"
+constexpr uint32_t ROI_INDEX_PACKED12      { 1 }; ///< RoiIndexEntry::flags of a ROI_RECORD_ROI_PACKED12 record
+constexpr char ROI_CONTAINER_MAGIC[8]      { 'L', 'U', 'M', 'O', 'R', 'O', 'I', 'S' };
+constexpr const char *ROI_CONTAINER_EXTENSION { ".rois" };
+
+struct RoiContainerHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;      ///< Offset of the first record
+  uint32_t headNum;
+  uint32_t sessionNum;
+  uint32_t segmentNum;
+  uint32_t closed;          ///< Non-zero once the index has been written
+  uint64_t firstRoiNum;     ///< The session ROI counter of the first ROI in this segment
+  uint64_t numRois;         ///< The number of ROIs in this segment
+  uint64_t dataEnd;         ///< Offset past the last record
+  uint64_t indexOffset;     ///< Offset of the index; only valid if closed is set
+  uint64_t sessionStartNs;  ///< CLOCK_REALTIME when the session started
+  uint64_t droppedRois;     ///< ROIs of the session dropped by the recorder before this segment was last updated
+};
+
+struct RoiRecordHeader
+{
+  uint32_t type;            ///< ROI_RECORD_ROI, ROI_RECORD_ROI_PACKED12 or ROI_RECORD_PADDING
+  uint32_t size;            ///< Bytes following this header, excluding the padding to ROI_RECORD_ALIGNMENT
+  uint64_t roiNum;          ///< The session ROI counter
+  uint64_t captureNs;       ///< CLOCK_MONOTONIC when the ROI was handed to the recorder
+};
+
+struct RoiIndexEntry
+{
+  uint64_t offset;          ///< Offset of the ROI bytes (after the RoiRecordHeader) within the segment
+  uint32_t size;
+  uint32_t flags;           ///< ROI_INDEX_PACKED12; 0 in version 1
+  uint64_t roiNum;
+};
+
+/**
+ * @brief An ROI of a recorded session, as returned by RoiContainerReader::next()
+ */
+struct RoiContainerRecord
+{
+  const uint8_t *data = nullptr; ///< Points into the mapped segment
+  uint32_t size = 0;
+  bool packed12 = false; ///< data is packed to 12 bits per word; unpacked, the ROI is size / 3 * 4 bytes
+  uint64_t roiNum = 0;
+  uint64_t captureNs = 0;
+  std::shared_ptr<const uint8_t> owner; ///< Keeps the segment mapped while data is in use
+};
+
+/**
+ * @brief Reads the ROIs of a recorded session in order, one segment after the other. Each segment is mapped
+ *        into memory, so the ROIs are handed out without being copied.
+ */
+class RoiContainerReader {
+public:
+  RoiContainerReader() = default;
+  RoiContainerReader(RoiContainerReader &other) = delete;
+  RoiContainerReader(RoiContainerReader &&other) = delete;
+  RoiContainerReader &operator=(RoiContainerReader &rhs) = delete;
+  RoiContainerReader &operator=(RoiContainerReader &&rhs) = delete;
+  ~RoiContainerReader();
+
+  /**
+   * @brief Opens a recorded session.
+   *
+   * @param path The name of a segment file ('<base>_ggg.rois'), in which case the session is read starting
+   *             from that segment; or the base name, in which case it is read from segment 000.
+   * @return false if the first segment can't be opened or is not a valid container
+   */
+  bool open(const std::string &path);
+
+  /**
+   * @brief Gets the next ROI of the session.
+   *
+   * @param record Receives the ROI. The data remains valid for as long as record.owner, or a copy of it, is held.
+   * @return false once all segments have been read
+   */
+  bool next(RoiContainerRecord &record);
+
+  /**
+   * @brief Starts reading from the first segment that was opened again.
+   */
+  bool rewind();
+
+  const RoiContainerHeader &getHeader() const { return _header; } ///< The header of the current segment
+
+  static bool isContainerPath(const std::string &path); ///< True if path names a segment file
+  static std::string segmentPath(const std::string &base, uint32_t segmentNum);
+
+private:
+  bool openSegment(uint32_t segmentNum);
+  bool buildIndex();
+  void closeSegment();
+
+  std::string _base;
+  uint32_t _firstSegment { 0 };
+  uint32_t _segment { 0 };
+  std::shared_ptr<const uint8_t> _mapping; ///< The current segment; unmapped once the last record referring to it is released
+  std::size_t _mappingSize { 0 };
+  RoiContainerHeader _header {};
+  std::vector<RoiIndexEntry> _index;
+  std::size_t _next { 0 };
+};
@@ -0,0 +1,447 @@
+/**
+ * @file RoiRecorder.cpp
+ * @brief Records raw ROIs into the segmented container described in RoiContainer.h, on a background thread.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "RoiRecorder.h"
+#include "LumoLogger.h"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
+
+#define RECORDER_FILE_MODE 0666
+
+namespace
+{
+constexpr std::size_t alignUp(std::size_t size, std::size_t alignment) { return (size + alignment - 1) / alignment * alignment; }
+
+uint64_t nanoseconds(std::chrono::nanoseconds duration) { return uint64_t(duration.count()); }
+
+/**
+ * @brief The configuration, with whole aligned batches, and as many of them as the memory budget grants, but at least two.
+ */
+RoiRecorderConfig budgetedConfig(const RoiRecorderConfig &config, uint32_t headNum, MemoryBudget::Grant &grant)
+{
+  RoiRecorderConfig budgeted = config;
+  budgeted.batchSize = uint32_t(alignUp(std::max(config.batchSize, 2 * ROI_CONTAINER_ALIGNMENT), ROI_CONTAINER_ALIGNMENT));
+  const uint32_t numBatches = std::max(config.numBatches, 2U);
+  grant = MemoryBudget::request(MEMORY_POOL_RECORDERS, 2ULL * budgeted.batchSize, uint64_t(numBatches) * budgeted.batchSize,
+                                "head " + std::to_string(headNum) + " ROI recorder batches");
+  budgeted.numBatches = std::clamp(uint32_t(grant.bytes() / budgeted.batchSize), 2U, numBatches);
+  return budgeted;
+}
+} // namespace
+
+void RoiRecorder::AlignedDeleter::operator()(uint8_t *ptr) const { free(ptr); } // NOLINT(cppcoreguidelines-no-malloc) pairs with aligned_alloc
+
+RoiRecorder::AlignedBuffer RoiRecorder::allocateAligned(std::size_t size)
+{
+  // NOLINTNEXTLINE(cppcoreguidelines-no-malloc) O_DIRECT needs aligned memory
+  return AlignedBuffer((uint8_t *)aligned_alloc(ROI_CONTAINER_ALIGNMENT, alignUp(size, ROI_CONTAINER_ALIGNMENT)));
+}
+
+std::string RoiRecorder::segmentPath(const std::string &prefix, uint32_t headNum, uint32_t sessionNum, uint32_t segmentNum)
+{
+  std::stringstream base;
+  base << prefix << '_' << std::setfill('0') << std::setw(1) << headNum << '_' << std::setw(2) << sessionNum;
+  return RoiContainerReader::segmentPath(base.str(), segmentNum);
+}
+
+RoiRecorder::RoiRecorder(std::string prefix, uint32_t headNum, const RoiRecorderConfig &config) :
+  _prefix(std::move(prefix)),
+  _headNum(headNum),
+  _config(budgetedConfig(config, headNum, _batchGrant)),
+  _batches(_config.numBatches),
+  _writerQueue(_config.numBatches + 8),
+  _freeBatches(_config.numBatches),
+  _headerBuffer(allocateAligned(ROI_CONTAINER_ALIGNMENT))
+{
+  const uint32_t entriesPerBatch { 256 };
+  for (auto &batch : _batches)
+  {
+    _batchMemory.push_back(allocateAligned(_config.batchSize));
+    batch.data = _batchMemory.back().get();
+    if (batch.data == nullptr)
+    {
+      LLogErr("recorder_alloc:head=" << _headNum << ",size=" << _config.batchSize << ":can't allocate recorder batch");
+      continue;
+    }
+    batch.entries.reserve(entriesPerBatch);
+    *_freeBatches.beginPush() = &batch;
+    _freeBatches.commitPush();
+  }
+  _writerThread = std::thread(&RoiRecorder::writerLoop, this);
+}
+
+RoiRecorder::~RoiRecorder()
+{
+  endSession();
+  _writerQueue.quit();
+  if (_writerThread.joinable())
+  {
+    _writerThread.join();
+  }
+}
+
+RoiRecorderStats RoiRecorder::getStats() const
+{
+  RoiRecorderStats stats;
+  stats.recordedRois = _recordedRois.load(std::memory_order_relaxed);
+  stats.droppedRois = _droppedRois.load(std::memory_order_relaxed);
+  stats.bytesWritten = _bytesWritten.load(std::memory_order_relaxed);
+  stats.segments = _segments.load(std::memory_order_relaxed);
+  stats.writeErrors = _writeErrors.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void RoiRecorder::startSession(uint32_t sessionNum, uint64_t maxRois)
+{
+  endSession();
+  _sessionNum = sessionNum;
+  _maxRois = maxRois;
+  _roiNum = 0;
+  _recordedRois.store(0, std::memory_order_relaxed);
+  _droppedRois.store(0, std::memory_order_relaxed);
+  WriterItem item;
+  item.type = WriterItem::Type::START_SESSION;
+  item.sessionNum = sessionNum;
+  pushWriterItem(item);
+  _sessionActive = maxRois > 0;
+}
+
+void RoiRecorder::endSession()
+{
+  if (!_sessionActive)
+  {
+    return;
+  }
+  _sessionActive = false;
+  if (_current != nullptr && _current->length > 0)
+  {
+    sealBatch();
+  }
+  WriterItem item;
+  item.type = WriterItem::Type::END_SESSION;
+  item.sessionNum = _sessionNum;
+  item.recordedRois = _recordedRois.load(std::memory_order_relaxed);
+  item.droppedRois = _droppedRois.load(std::memory_order_relaxed);
+  pushWriterItem(item);
+}
+
+bool RoiRecorder::record(const uint8_t *data, uint32_t size)
+{
+  if (!_sessionActive)
+  {
+    return false;
+  }
+
+  auto roiNum = _roiNum++;
+  // Packing writes straight into the batch, so it costs no more memory bandwidth than the copy.
+  const bool packed = _config.packRaw12 != nullptr && size % (2 * sizeof(uint16_t)) == 0;
+  const uint32_t recordedSize = packed ? size / 4 * 3 : size;
+  auto recordSize = alignUp(sizeof(RoiRecordHeader) + recordedSize, ROI_RECORD_ALIGNMENT);
+  // A sealed batch always has room left for the header of the padding record.
+  if (recordSize + sizeof(RoiRecordHeader) > _config.batchSize)
+  {
+    LLogErr("recorder_roi_too_big:head=" << _headNum << ",size=" << size << ",batchSize=" << _config.batchSize << ":ROI not recorded");
+    _droppedRois.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  if (_current != nullptr && _current->length + recordSize + sizeof(RoiRecordHeader) > _config.batchSize)
+  {
+    sealBatch();
+  }
+  if (_current == nullptr && !takeBatch())
+  {
+    // The writer is behind; dropping the ROI keeps the capture thread from waiting for the disk.
+    _droppedRois.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  RoiRecordHeader record {};
+  record.type = packed ? ROI_RECORD_ROI_PACKED12 : ROI_RECORD_ROI;
+  record.size = recordedSize;
+  record.roiNum = roiNum;
+  record.captureNs = nanoseconds(std::chrono::steady_clock::now().time_since_epoch());
+  memcpy(_current->data + _current->length, &record, sizeof(record));
+  if (packed)
+  {
+    _config.packRaw12(reinterpret_cast<const uint16_t *>(data), _current->data + _current->length + sizeof(record),
+                      size / uint32_t(sizeof(uint16_t)));
+  }
+  else
+  {
+    memcpy(_current->data + _current->length + sizeof(record), data, size);
+  }
+  _current->entries.push_back({ _current->length + sizeof(record), recordedSize, packed ? ROI_INDEX_PACKED12 : 0, roiNum });
+  _current->length += uint32_t(recordSize);
+
+  if (_recordedRois.fetch_add(1, std::memory_order_relaxed) + 1 >= _maxRois)
+  {
+    endSession();
+  }
+  return true;
+}
+
+bool RoiRecorder::takeBatch()
+{
+  Batch **batch = _freeBatches.front();
+  if (batch == nullptr)
+  {
+    return false;
+  }
+  _current = *batch;
+  _freeBatches.pop();
+  _current->length = 0;
+  _current->entries.clear();
+  return true;
+}
+
+/**
+ * @brief Pads the current batch to ROI_CONTAINER_ALIGNMENT and hands it to the writer thread.
+ */
+void RoiRecorder::sealBatch()
+{
+  auto aligned = alignUp(_current->length, ROI_CONTAINER_ALIGNMENT);
+  if (aligned - _current->length < sizeof(RoiRecordHeader))
+  {
+    aligned += ROI_CONTAINER_ALIGNMENT;
+  }
+  RoiRecordHeader padding {};
+  padding.type = ROI_RECORD_PADDING;
+  padding.size = uint32_t(aligned - _current->length - sizeof(padding));
+  memcpy(_current->data + _current->length, &padding, sizeof(padding));
+  _current->length = uint32_t(aligned);
+
+  WriterItem item;
+  item.type = WriterItem::Type::BATCH;
+  item.batch = _current;
+  pushWriterItem(item);
+  _current = nullptr;
+}
+
+void RoiRecorder::pushWriterItem(const WriterItem &item)
+{
+  // The queue has room for all of the batches plus several commands, so this only waits if sessions are
+  // started and ended faster than the writer can open and close segments.
+  WriterItem *slot = _writerQueue.beginPush();
+  while (slot == nullptr)
+  {
+    std::this_thread::yield();
+    slot = _writerQueue.beginPush();
+  }
+  *slot = item;
+  _writerQueue.commitPush();
+}
+
+void RoiRecorder::writerLoop()
+{
+  while (true)
+  {
+    WriterItem *item = _writerQueue.front();
+    if (item == nullptr)
+    {
+      if (!_writerQueue.waitForData())
+      {
+        break;
+      }
+      continue;
+    }
+    handleWriterItem(*item);
+    _writerQueue.pop();
+  }
+  for (WriterItem *item = _writerQueue.front(); item != nullptr; item = _writerQueue.front())
+  {
+    handleWriterItem(*item);
+    _writerQueue.pop();
+  }
+  closeSegment();
+}
+
+void RoiRecorder::handleWriterItem(WriterItem &item)
+{
+  switch (item.type)
+  {
+  case WriterItem::Type::BATCH:
+    writeBatch(*item.batch);
+    *_freeBatches.beginPush() = item.batch; // never full: it has room for all of the batches
+    _freeBatches.commitPush();
+    break;
+  case WriterItem::Type::START_SESSION:
+    closeSegment();
+    _writerSessionNum = item.sessionNum;
+    _segmentNum = 0;
+    _segmentFailed = false;
+    _sessionStartNs = nanoseconds(std::chrono::system_clock::now().time_since_epoch());
+    break;
+  case WriterItem::Type::END_SESSION:
+    closeSegment();
+    if (item.droppedRois != 0)
+    {
+      LLogWarning("recorder_session:head=" << _headNum << ",session=" << item.sessionNum << ",rois=" << item.recordedRois <<
+                  ",dropped=" << item.droppedRois << ",segments=" << _segmentNum << ":ROIs were dropped; the disk can't keep up");
+    }
+    else
+    {
+      LLogInfo("recorder_session:head=" << _headNum << ",session=" << item.sessionNum << ",rois=" << item.recordedRois <<
+               ",dropped=0,segments=" << _segmentNum);
+    }
+    break;
+  }
+}
+
+void RoiRecorder::writeBatch(Batch &batch)
+{
+  if (_fd >= 0 && _writeOffset > _header.headerSize && _writeOffset + batch.length > _config.segmentSize)
+  {
+    closeSegment();
+  }
+  if (_fd < 0 && (_segmentFailed || !openSegment()))
+  {
+    return; // the ROIs in this batch are lost; the error has been logged
+  }
+
+  if (!writeAligned(batch.data, batch.length, _writeOffset))
+  {
+    return;
+  }
+  if (_header.numRois == 0 && !batch.entries.empty())
+  {
+    _header.firstRoiNum = batch.entries.front().roiNum;
+  }
+  for (const auto &entry : batch.entries)
+  {
+    _index.push_back({ _writeOffset + entry.offset, entry.size, entry.flags, entry.roiNum });
+  }
+  _writeOffset += batch.length;
+  _header.numRois = _index.size();
+  _header.dataEnd = _writeOffset;
+  _header.droppedRois = _droppedRois.load(std::memory_order_relaxed);
+  writeHeader();
+}
+
+bool RoiRecorder::openSegment()
+{
+  auto name = segmentPath(_prefix, _headNum, _writerSessionNum, _segmentNum);
+  auto flags = (unsigned int)O_CREAT | (unsigned int)O_TRUNC | (unsigned int)O_WRONLY;
+  _directIo = _config.directIo;
+  // NOLINTNEXTLINE(hicpp-vararg) calling LINUX vararg API
+  _fd = open(name.c_str(), int(_directIo ? flags | (unsigned int)O_DIRECT : flags), RECORDER_FILE_MODE);
+  if (_fd < 0 && _directIo && errno == EINVAL)
+  {
+    // e.g., tmpfs
+    LLogInfo("recorder_no_direct_io:name=" << name << ":file system does not support O_DIRECT; using buffered writes");
+    _directIo = false;
+    _fd = open(name.c_str(), int(flags), RECORDER_FILE_MODE); // NOLINT(hicpp-vararg) calling LINUX vararg API
+  }
+  if (_fd < 0)
+  {
+    LLogErr("recorder_open:name=" << name << ",errno=" << errno << ":can't open segment file; recording of this session disabled");
+    _segmentFailed = true;
+    _writeErrors.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  // Allocating the segment up front keeps the file system from having to find free blocks during each write.
+  int error = posix_fallocate(_fd, 0, off_t(_config.segmentSize));
+  if (error != 0)
+  {
+    LLogWarning("recorder_fallocate:name=" << name << ",error=" << error << ":can't preallocate segment file");
+  }
+
+  _header = {};
+  memcpy(_header.magic, ROI_CONTAINER_MAGIC, sizeof(_header.magic));
+  _header.version = ROI_CONTAINER_VERSION;
+  _header.headerSize = ROI_CONTAINER_ALIGNMENT;
+  _header.headNum = _headNum;
+  _header.sessionNum = _writerSessionNum;
+  _header.segmentNum = _segmentNum;
+  _header.dataEnd = _header.headerSize;
+  _header.sessionStartNs = _sessionStartNs;
+  _writeOffset = _header.headerSize;
+  _index.clear();
+  _segments.fetch_add(1, std::memory_order_relaxed);
+  LLogDebug("recorder_open:name=" << name << ",directIo=" << _directIo);
+  return writeHeader();
+}
+
+/**
+ * @brief Writes the index after the last record, marks the segment as closed, and trims the preallocated space.
+ */
+void RoiRecorder::closeSegment()
+{
+  if (_fd < 0)
+  {
+    return;
+  }
+  auto indexBytes = _index.size() * sizeof(RoiIndexEntry);
+  auto indexBuffer = allocateAligned(std::max(indexBytes, std::size_t(1)));
+  if (indexBuffer != nullptr)
+  {
+    memcpy(indexBuffer.get(), _index.data(), indexBytes);
+    if (writeAligned(indexBuffer.get(), alignUp(indexBytes, ROI_CONTAINER_ALIGNMENT), _writeOffset))
+    {
+      _header.indexOffset = _writeOffset;
+      _header.closed = 1;
+      _header.droppedRois = _droppedRois.load(std::memory_order_relaxed);
+      writeHeader();
+    }
+  }
+  if (_fd >= 0)
+  {
+    if (ftruncate(_fd, off_t(_writeOffset + indexBytes)) < 0)
+    {
+      LLogWarning("recorder_truncate:errno=" << errno << ":can't trim segment file");
+    }
+    fdatasync(_fd);
+    close(_fd);
+    _fd = -1;
+  }
+  _segmentNum++;
+  _index.clear();
+}
+
+bool RoiRecorder::writeHeader()
+{
+  memset(_headerBuffer.get(), 0, ROI_CONTAINER_ALIGNMENT);
+  memcpy(_headerBuffer.get(), &_header, sizeof(_header));
+  return writeAligned(_headerBuffer.get(), ROI_CONTAINER_ALIGNMENT, 0);
+}
+
+/**
+ * @brief Writes an aligned buffer at an aligned offset. On failure the segment is closed as is, and the rest of the session is discarded.
+ */
+bool RoiRecorder::writeAligned(const uint8_t *data, std::size_t size, uint64_t offset)
+{
+  std::size_t pos = 0;
+  while (pos < size)
+  {
+    auto bytesWritten = pwrite(_fd, data + pos, size - pos, off_t(offset + pos));
+    if (bytesWritten < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (bytesWritten <= 0)
+    {
+      LLogErr("recorder_write:head=" << _headNum << ",session=" << _writerSessionNum << ",segment=" << _segmentNum <<
+              ",errno=" << errno << ":can't write segment file; recording of this session disabled");
+      _writeErrors.fetch_add(1, std::memory_order_relaxed);
+      _segmentFailed = true;
+      close(_fd);
+      _fd = -1;
+      return false;
+    }
+    pos += std::size_t(bytesWritten);
+  }
+  _bytesWritten.fetch_add(size, std::memory_order_relaxed);
+  return true;
+}
@@ -0,0 +1,165 @@
+/**
+ * @file RoiRecorder.h
+ * @brief Records raw ROIs into the segmented container described in RoiContainer.h, on a background thread.
+ *
+ * The capture thread copies each ROI into a large aligned batch buffer and hands full batches to the writer
+ * thread, which appends them to a preallocated segment file with a single pwrite() each. Neither the capture
+ * thread's record() nor the batch hand-off ever blocks on the disk: if the writer falls behind and all of
+ * the batches are in use, ROIs are dropped and counted, rather than stalling capture.
+ *
+ * The segment files are opened with O_DIRECT where the file system supports it, so that recording does not
+ * evict the page cache and the cost of a write does not depend on the state of the dirty page writeback.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include "MemoryBudget.h"
+#include "RoiContainer.h"
+#include "SpscRing.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+constexpr uint64_t DEFAULT_RECORDER_SEGMENT_SIZE { 256ULL << 20U }; ///< Bytes preallocated for each segment file
+constexpr uint32_t DEFAULT_RECORDER_BATCH_SIZE   { 4U << 20U };     ///< Bytes written to disk at once
+constexpr uint32_t DEFAULT_RECORDER_NUM_BATCHES  { 8 };             ///< Batches that can be waiting for the disk, if the memory budget allows
+
+struct RoiRecorderConfig
+{
+  uint64_t segmentSize { DEFAULT_RECORDER_SEGMENT_SIZE };
+  uint32_t batchSize { DEFAULT_RECORDER_BATCH_SIZE };
+  uint32_t numBatches { DEFAULT_RECORDER_NUM_BATCHES };
+  bool directIo { true }; ///< Open the segments with O_DIRECT if the file system supports it
+  /// If set, the ROIs are recorded packed to 12 bits per word (ROI_RECORD_ROI_PACKED12) by this function, which packs
+  /// numWords words at src into numWords / 2 * 3 bytes at dst: RawToDepthDsp::packRaw12(), which this library can't call.
+  void (*packRaw12)(const uint16_t *src, uint8_t *dst, uint32_t numWords) { nullptr };
+};
+
+struct RoiRecorderStats
+{
+  uint64_t recordedRois = 0; ///< ROIs of the current or last session copied into a batch
+  uint64_t droppedRois = 0;  ///< ROIs of the current or last session dropped because no batch was free
+  uint64_t bytesWritten = 0; ///< Since construction
+  uint32_t segments = 0;     ///< Segment files started since construction
+  uint32_t writeErrors = 0;  ///< Since construction
+};
+
+class RoiRecorder {
+public:
+  /**
+   * @brief Allocates the batches and starts the writer thread.
+   *
+   * @param prefix The path prefix of the segment files: '<prefix>_h_ss_ggg.rois', where h is the head number
+   *               and ss the session number
+   * @param headNum The head number, used in the file names and the header
+   * @param config The sizes of the segments and batches
+   */
+  RoiRecorder(std::string prefix, uint32_t headNum, const RoiRecorderConfig &config = {});
+  RoiRecorder(RoiRecorder &other) = delete;
+  RoiRecorder(RoiRecorder &&other) = delete;
+  RoiRecorder &operator=(RoiRecorder &rhs) = delete;
+  RoiRecorder &operator=(RoiRecorder &&rhs) = delete;
+  ~RoiRecorder(); ///< Ends the current session and waits for it to be written
+
+  /**
+   * @brief Capture thread only. Ends the current session, if any, and starts recording a new one.
+   *
+   * @param sessionNum The session number, used in the file names and the header
+   * @param maxRois The session ends by itself after this many ROIs have been recorded
+   */
+  void startSession(uint32_t sessionNum, uint64_t maxRois);
+
+  /**
+   * @brief Capture thread only. Writes out the partially filled batch and closes the session's last segment.
+   */
+  void endSession();
+
+  /**
+   * @brief Capture thread only. Copies the ROI into the current batch, packing it if the config has packRaw12.
+   *
+   * @return false if no session is active, or if the ROI was dropped
+   */
+  bool record(const uint8_t *data, uint32_t size);
+
+  bool sessionActive() const { return _sessionActive; } ///< Capture thread only
+  RoiRecorderStats getStats() const;
+
+  /**
+   * @brief The name of a segment file.
+   */
+  static std::string segmentPath(const std::string &prefix, uint32_t headNum, uint32_t sessionNum, uint32_t segmentNum);
+
+private:
+  struct Batch
+  {
+    uint8_t *data { nullptr }; ///< batchSize bytes aligned to ROI_CONTAINER_ALIGNMENT
+    uint32_t length { 0 };     ///< Bytes filled in; a multiple of ROI_CONTAINER_ALIGNMENT once the batch is sealed
+    std::vector<RoiIndexEntry> entries; ///< Offsets relative to the start of the batch
+  };
+  struct WriterItem
+  {
+    enum class Type { BATCH, START_SESSION, END_SESSION } type { Type::BATCH };
+    Batch *batch { nullptr };
+    uint32_t sessionNum { 0 };
+    uint64_t recordedRois { 0 };
+    uint64_t droppedRois { 0 };
+  };
+  struct AlignedDeleter
+  {
+    void operator()(uint8_t *ptr) const;
+  };
+  using AlignedBuffer = std::unique_ptr<uint8_t, AlignedDeleter>;
+
+  static AlignedBuffer allocateAligned(std::size_t size);
+  bool takeBatch();
+  void sealBatch();
+  void pushWriterItem(const WriterItem &item);
+  void writerLoop();
+  void handleWriterItem(WriterItem &item);
+  void writeBatch(Batch &batch);
+  bool openSegment();
+  void closeSegment();
+  bool writeHeader();
+  bool writeAligned(const uint8_t *data, std::size_t size, uint64_t offset);
+
+  const std::string _prefix;
+  const uint32_t _headNum;
+  MemoryBudget::Grant _batchGrant; ///< Before _config, which sizes the batches from it
+  const RoiRecorderConfig _config;
+  std::vector<Batch> _batches;
+  std::vector<AlignedBuffer> _batchMemory;
+  SpscRing<WriterItem> _writerQueue; ///< capture -> writer
+  SpscRing<Batch *> _freeBatches;    ///< writer -> capture
+
+  // Capture thread state
+  Batch *_current { nullptr };
+  bool _sessionActive { false };
+  uint32_t _sessionNum { 0 };
+  uint64_t _maxRois { 0 };
+  uint64_t _roiNum { 0 };
+  std::atomic<uint64_t> _recordedRois { 0 };
+  std::atomic<uint64_t> _droppedRois { 0 };
+
+  // Writer thread state
+  int _fd { -1 };
+  bool _directIo { false };
+  RoiContainerHeader _header {};
+  AlignedBuffer _headerBuffer;
+  std::vector<RoiIndexEntry> _index;
+  uint64_t _writeOffset { 0 };
+  uint32_t _segmentNum { 0 };
+  uint32_t _writerSessionNum { 0 };
+  uint64_t _writerRoiNum { 0 };
+  uint64_t _sessionStartNs { 0 };
+  bool _segmentFailed { false };
+  std::atomic<uint64_t> _bytesWritten { 0 };
+  std::atomic<uint32_t> _segments { 0 };
+  std::atomic<uint32_t> _writeErrors { 0 };
+
+  std::thread _writerThread;
+};
@@ -0,0 +1,195 @@
+/**
+ * @file SpscRing.h
+ * @brief A bounded lock-free ring buffer between exactly one producer thread and one consumer thread.
+ *
+ * The slots are preallocated and reused in place: the producer fills the slot returned by beginPush() and
+ * publishes it with commitPush(), the consumer works on front() and releases it with pop(). Neither side
+ * spins on the other. When the ring is full, the producer either drops the item and records that with
+ * countDrop(), or sleeps in waitForSpace() until the consumer pops. The consumer may sleep in waitForData()
+ * when the ring is empty. Sleeping and waking up a sleeper are the only places a mutex is taken.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief The counters of an SpscRing, for queue depth metrics.
+ */
+struct SpscRingStats
+{
+  uint64_t pushed = 0;   ///< Items published by the producer
+  uint64_t popped = 0;   ///< Items released by the consumer
+  uint64_t dropped = 0;  ///< Items the producer dropped because the ring was full
+  uint32_t depth = 0;    ///< Items currently in the ring
+  uint32_t maxDepth = 0; ///< The largest depth seen so far
+  uint32_t capacity = 0;
+};
+
+template <typename T>
+class SpscRing {
+public:
+  /**
+   * @param capacity The number of slots; rounded up to a power of two.
+   */
+  explicit SpscRing(uint32_t capacity)
+  {
+    uint32_t size = 1;
+    while (size < capacity)
+    {
+      size <<= 1U;
+    }
+    _slots.resize(size);
+    _mask = size - 1;
+  }
+  SpscRing(SpscRing &other) = delete;
+  SpscRing(SpscRing &&other) = delete;
+  SpscRing &operator=(SpscRing &rhs) = delete;
+  SpscRing &operator=(SpscRing &&rhs) = delete;
+  ~SpscRing() = default;
+
+  /**
+   * @brief Producer only. Returns the next free slot to be filled in, or nullptr if the ring is full.
+   */
+  T *beginPush()
+  {
+    auto tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) > _mask)
+    {
+      return nullptr;
+    }
+    return &_slots[tail & _mask];
+  }
+
+  /**
+   * @brief Producer only. Publishes the slot returned by the last beginPush() to the consumer.
+   */
+  void commitPush()
+  {
+    auto tail = _tail.load(std::memory_order_relaxed) + 1;
+    _tail.store(tail, std::memory_order_seq_cst);
+    auto depth = uint32_t(tail - _head.load(std::memory_order_relaxed));
+    if (depth > _maxDepth.load(std::memory_order_relaxed))
+    {
+      _maxDepth.store(depth, std::memory_order_relaxed);
+    }
+
+    // Only take the lock if the consumer may be asleep. The consumer raises _waiting before it checks
+    // for data one last time, so either it sees this item or we see _waiting (both accesses are seq_cst).
+    if (_waiting.load(std::memory_order_seq_cst))
+    {
+      std::lock_guard lock(_mutex);
+      _dataAvailable.notify_one();
+    }
+  }
+
+  /**
+   * @brief Producer only. Records that an item was dropped because beginPush() returned nullptr.
+   */
+  void countDrop() { _dropped.fetch_add(1, std::memory_order_relaxed); }
+
+  /**
+   * @brief Consumer only. Returns the oldest item, or nullptr if the ring is empty.
+   */
+  T *front()
+  {
+    auto head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire))
+    {
+      return nullptr;
+    }
+    return &_slots[head & _mask];
+  }
+
+  /**
+   * @brief Consumer only. Releases the slot returned by front() back to the producer.
+   */
+  void pop()
+  {
+    _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+
+    // As in commitPush(), only take the lock if the producer may be asleep in waitForSpace().
+    if (_producerWaiting.load(std::memory_order_seq_cst))
+    {
+      std::lock_guard lock(_mutex);
+      _spaceAvailable.notify_one();
+    }
+  }
+
+  /**
+   * @brief Consumer only. Sleeps until the ring is not empty or quit() has been called.
+   *
+   * @return false if quit() has been called.
+   */
+  bool waitForData()
+  {
+    std::unique_lock lock(_mutex);
+    _waiting.store(true, std::memory_order_seq_cst);
+    _dataAvailable.wait(lock, [this] {
+      return _quit || _head.load(std::memory_order_relaxed) != _tail.load(std::memory_order_seq_cst);
+    });
+    _waiting.store(false, std::memory_order_relaxed);
+    return !_quit;
+  }
+
+  /**
+   * @brief Producer only. Sleeps until the ring has a free slot or quit() has been called.
+   *
+   * @return false if quit() has been called.
+   */
+  bool waitForSpace()
+  {
+    std::unique_lock lock(_mutex);
+    _producerWaiting.store(true, std::memory_order_seq_cst);
+    _spaceAvailable.wait(lock, [this] {
+      return _quit || _tail.load(std::memory_order_relaxed) - _head.load(std::memory_order_seq_cst) <= _mask;
+    });
+    _producerWaiting.store(false, std::memory_order_relaxed);
+    return !_quit;
+  }
+
+  /**
+   * @brief Wakes up both sides and makes all further calls to waitForData() and waitForSpace() return false.
+   */
+  void quit()
+  {
+    std::lock_guard lock(_mutex);
+    _quit = true;
+    _dataAvailable.notify_all();
+    _spaceAvailable.notify_all();
+  }
+
+  SpscRingStats getStats() const
+  {
+    SpscRingStats stats;
+    stats.popped = _head.load(std::memory_order_relaxed);
+    stats.pushed = _tail.load(std::memory_order_relaxed);
+    stats.dropped = _dropped.load(std::memory_order_relaxed);
+    stats.depth = stats.pushed > stats.popped ? uint32_t(stats.pushed - stats.popped) : 0;
+    stats.maxDepth = _maxDepth.load(std::memory_order_relaxed);
+    stats.capacity = uint32_t(_slots.size());
+    return stats;
+  }
+
+private:
+  static constexpr std::size_t CACHE_LINE_SIZE { 64 };
+
+  std::vector<T> _slots;
+  uint64_t _mask = 0;
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> _head { 0 }; ///< Written by the consumer
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> _tail { 0 }; ///< Written by the producer
+  std::atomic<uint32_t> _maxDepth { 0 };
+  std::atomic<uint64_t> _dropped { 0 };
+  alignas(CACHE_LINE_SIZE) std::atomic_bool _waiting { false }; ///< The consumer is asleep in waitForData()
+  std::atomic_bool _producerWaiting { false };                   ///< The producer is asleep in waitForSpace()
+  std::mutex _mutex;
+  std::condition_variable _dataAvailable;
+  std::condition_variable _spaceAvailable;
+  bool _quit = false; ///< Guarded by _mutex
+};
@@ -0,0 +1,108 @@
+/**
+ * @file WorkerPool.cpp
+ * @brief A fixed set of helper threads that run the tasks of a parallelFor() together with the calling thread.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#include "WorkerPool.h"
+#include "LumoAffinity.h"
+#include "PipelineTrace.h"
+#include <algorithm>
+
+WorkerPool::WorkerPool(uint32_t numHelpers, std::vector<int> affinity, std::string role)
+{
+  _threads.reserve(numHelpers);
+  for (uint32_t idx = 0; idx < numHelpers; idx++)
+  {
+    _threads.emplace_back(&WorkerPool::helperLoop, this, affinity, role);
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard lock(_mutex);
+    _quit = true;
+  }
+  _workAvailable.notify_all();
+  for (auto &thread : _threads)
+  {
+    thread.join();
+  }
+}
+
+void WorkerPool::runTasks(Job &job, uint32_t workerIdx)
+{
+  for (auto taskIdx = job.nextTask.fetch_add(1, std::memory_order_relaxed); taskIdx < job.numTasks;
+       taskIdx = job.nextTask.fetch_add(1, std::memory_order_relaxed))
+  {
+    (*job.task)(taskIdx, workerIdx);
+  }
+}
+
+void WorkerPool::helperLoop(std::vector<int> affinity, std::string role)
+{
+  PipelineTrace::setThreadName("worker_pool");
+  LumoAffinity::setThreadRole(role, affinity);
+
+  std::unique_lock lock(_mutex);
+  while (true)
+  {
+    _workAvailable.wait(lock, [this] { return _quit || !_jobs.empty(); });
+    if (_quit)
+    {
+      return;
+    }
+
+    auto *job = _jobs.front();
+    auto workerIdx = job->numJoined++;
+    if (job->numJoined == job->maxWorkers)
+    {
+      _jobs.pop_front();
+    }
+    job->numActive++;
+
+    lock.unlock();
+    runTasks(*job, workerIdx);
+    lock.lock();
+
+    // The caller may return as soon as numActive reaches zero, after which job is invalid.
+    if (--job->numActive == 0)
+    {
+      _helperDone.notify_all();
+    }
+  }
+}
+
+void WorkerPool::parallelFor(uint32_t numTasks, uint32_t maxWorkers, const std::function<void(uint32_t, uint32_t)> &task)
+{
+  Job job;
+  job.task = &task;
+  job.numTasks = numTasks;
+  job.maxWorkers = std::min({numTasks, maxWorkers, getNumWorkers()});
+
+  if (job.maxWorkers > 1)
+  {
+    {
+      std::lock_guard lock(_mutex);
+      _jobs.push_back(&job);
+    }
+    _workAvailable.notify_all();
+  }
+
+  runTasks(job, 0);
+
+  if (job.maxWorkers > 1)
+  {
+    std::unique_lock lock(_mutex);
+    // No new helpers may join once all of the tasks have been claimed.
+    auto jobIt = std::find(_jobs.begin(), _jobs.end(), &job);
+    if (jobIt != _jobs.end())
+    {
+      _jobs.erase(jobIt);
+    }
+    _helperDone.wait(lock, [&job] { return job.numActive == 0; });
+  }
+}
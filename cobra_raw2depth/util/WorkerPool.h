@@ -0,0 +1,70 @@
+/**
+ * @file WorkerPool.h
+ * @brief A fixed set of helper threads that run the tasks of a parallelFor() together with the calling thread.
+ *
+ * Several threads may call parallelFor() on the same pool at once (for example, one whole-frame thread per FOV);
+ * the helpers are shared between the calls in arrival order. The calling thread always works on its own tasks,
+ * so a parallelFor() completes even if all of the helpers are busy elsewhere.
+ *
+ * @copyright Copyright (C) 2023 Lumotive, Inc. All rights reserved.
+ *
+ */
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+  /**
+   * @brief Starts the helper threads.
+   *
+   * @param numHelpers The number of helper threads. The calling thread of parallelFor() is an additional worker.
+   * @param affinity The processors the helper threads are allowed to run on (see LumoAffinity). Empty for no restriction.
+   * @param role The role of the helper threads in the scheduling profile, which overrides affinity (see LumoAffinity::setThreadRole()).
+   */
+  explicit WorkerPool(uint32_t numHelpers, std::vector<int> affinity = {}, std::string role = "");
+  WorkerPool(WorkerPool &other) = delete;
+  WorkerPool(WorkerPool &&other) = delete;
+  WorkerPool &operator=(WorkerPool &rhs) = delete;
+  WorkerPool &operator=(WorkerPool &&rhs) = delete;
+  ~WorkerPool();
+
+  /**
+   * @brief Calls task(taskIdx, workerIdx) once for each taskIdx in [0, numTasks), and returns once all calls have completed.
+   *
+   * workerIdx identifies the thread running the task within this call, and is less than min(numTasks, maxWorkers,
+   * getNumWorkers()), so that it can be used to index per-worker scratch buffers. The calling thread is worker 0.
+   */
+  void parallelFor(uint32_t numTasks, uint32_t maxWorkers, const std::function<void(uint32_t, uint32_t)> &task);
+
+  uint32_t getNumWorkers() const { return uint32_t(_threads.size()) + 1; } ///< The helpers plus the calling thread.
+
+private:
+  struct Job
+  {
+    const std::function<void(uint32_t, uint32_t)> *task = nullptr;
+    uint32_t numTasks = 0;
+    uint32_t maxWorkers = 0;
+    uint32_t numJoined = 1; ///< The workers that have joined the job, including the caller. Guarded by _mutex.
+    uint32_t numActive = 0; ///< The helpers still running tasks of the job. Guarded by _mutex.
+    std::atomic<uint32_t> nextTask { 0 };
+  };
+
+  static void runTasks(Job &job, uint32_t workerIdx);
+  void helperLoop(std::vector<int> affinity, std::string role);
+
+  std::mutex _mutex;
+  std::condition_variable _workAvailable;
+  std::condition_variable _helperDone;
+  std::deque<Job *> _jobs; ///< Jobs that can accept more workers. Guarded by _mutex.
+  bool _quit { false };
+  std::vector<std::thread> _threads;
+};
@@ -9,6 +9,7 @@ from the DSP. The functionality of this module
 should not be relied upon as it is likely to be
 deprecated in the future.
 """
+import ctypes
 import enum
 import os
 from pathlib import Path
@@ -23,6 +24,13 @@ from cobra_system_control.cobra_log import log
 # location of files saved from r2d / frontend
 IMG_DATA_PATH = Path('/run')
 
+current_dir = os.path.dirname(os.path.abspath(__file__))
+
+# The shift and mask that RawToDepth applies to each raw word
+# (INPUT_RAW_SHIFT and RAW_PIXEL_MASK in RtdMetadata.h)
+INPUT_RAW_SHIFT = 1
+RAW_PIXEL_MASK = 0xfffc
+
 
 class ImageType(enum.Enum):
     """The types of images saved to the /tmp directory when
@@ -40,6 +48,79 @@ IMAGE_PROPERTIES = {
         }
 
 
+class ImageDecodeRoiInfo(ctypes.Structure):
+    """The metadata of a ROI, as decoded by libimage_decode.so
+    (see ImageDecode.h in cobra_raw2depth)"""
+    _fields_ = [
+        ('timestamp_ns', ctypes.c_uint64),
+        ('num_elements', ctypes.c_uint32),
+        ('num_pixel_elements', ctypes.c_uint32),
+        ('roi_start_row', ctypes.c_uint16),
+        ('roi_num_rows', ctypes.c_uint16),
+        ('roi_num_columns', ctypes.c_uint16),
+        ('roi_counter', ctypes.c_uint16),
+        ('roi_id', ctypes.c_uint16),
+        ('sensor_mode', ctypes.c_uint16),
+        ('num_modulation_frequencies', ctypes.c_uint16),
+        ('f0_modulation_index', ctypes.c_uint16),
+        ('f1_modulation_index', ctypes.c_uint16),
+        ('active_fovs_bitmask', ctypes.c_uint16),
+        ('do_tap_accumulation', ctypes.c_uint16),
+        ('reserved', ctypes.c_uint16),
+    ]
+
+    def to_dict(self) -> dict:
+        return {name: getattr(self, name)
+                for name, _ in self._fields_ if name != 'reserved'}
+
+
+def _load_decode_lib():
+    """Loads libimage_decode.so from this package, like libfx3_transfer.so,
+    or else from the library path where the raw2depth build installs it.
+    Returns None if it is in neither place."""
+    for path in (os.path.join(current_dir, 'libimage_decode.so'),
+                 'libimage_decode.so'):
+        try:
+            decode_lib = ctypes.CDLL(path)
+        except OSError:
+            continue
+        decode_lib.imageDecodeRoi.argtypes = [
+            ctypes.c_void_p, ctypes.c_uint32, ctypes.c_void_p,
+            ctypes.c_uint32, ctypes.POINTER(ImageDecodeRoiInfo)]
+        decode_lib.imageDecodeRoi.restype = ctypes.c_int32
+        decode_lib.imageDecodeWords.argtypes = [
+            ctypes.c_void_p, ctypes.c_uint32, ctypes.c_void_p,
+            ctypes.c_uint32, ctypes.c_uint16]
+        decode_lib.imageDecodeWords.restype = ctypes.c_int32
+        return decode_lib
+    return None
+
+
+decode_lib = _load_decode_lib()
+
+
+def _as_bytes(serialized_data) -> bytes:
+    """Undoes pyro's serialization of bytes into a dict, if it was applied"""
+    if isinstance(serialized_data, dict):
+        return serpent.tobytes(serialized_data)
+    return serialized_data
+
+
+def _address(buffer) -> tuple:
+    """Returns a view of any object supporting the buffer protocol (bytes,
+    bytearray, memoryview, numpy array) and the address of its data, without
+    copying it. The view must be kept alive while the address is used."""
+    view = np.frombuffer(buffer, dtype=np.uint8)
+    return view, view.ctypes.data
+
+
+def _check_out(out: np.ndarray, dtype, size: int):
+    if (out.dtype != dtype or out.size < size
+            or not out.flags.c_contiguous or not out.flags.writeable):
+        raise ValueError(f'out must be a writeable, C-contiguous {np.dtype(dtype)} '
+                         f'array of at least {size} elements')
+
+
 def encode(data: np.ndarray) -> bytes:
     """Converts numpy array to bytes prior to shipping over network"""
     return data.tobytes()
@@ -64,12 +145,68 @@ def decode(serialized_data, img_type: ImageType) -> np.ndarray:
         return np.reshape(data_arr, newshape=(-1, 320))
 
 
-def get_and_decode(ir: 'TempImageReader', img_type: ImageType) -> np.ndarray:
+def decode_into(serialized_data, img_type: ImageType,
+                out: np.ndarray) -> np.ndarray:
+    """Like decode(), but fills the caller's array, which can be reused from
+    frame to frame, with a single copy of the data. A RAW image is converted
+    to float as RawToDepth does if out is float32, and copied as is if it is
+    uint16. Returns the part of out that was filled, in the shape decode()
+    returns."""
+    _, dtype = IMAGE_PROPERTIES[img_type]
+    data = np.frombuffer(_as_bytes(serialized_data), dtype=dtype)
+
+    flat = out.reshape(-1)
+    if img_type is ImageType.RAW and out.dtype == np.float32:
+        _check_out(out, np.float32, data.size)
+        if decode_lib is not None:
+            decode_lib.imageDecodeWords(data.ctypes.data, data.size, flat.ctypes.data,
+                                        INPUT_RAW_SHIFT, RAW_PIXEL_MASK)
+        else:
+            np.right_shift(data & RAW_PIXEL_MASK, INPUT_RAW_SHIFT,
+                           out=flat[:data.size], casting='unsafe')
+    else:
+        _check_out(out, dtype, data.size)
+        np.copyto(flat[:data.size], data)
+
+    if img_type is ImageType.RAW:
+        return flat[:data.size]
+    return np.reshape(flat[:data.size], newshape=(-1, 320))
+
+
+def decode_roi(serialized_data, pixels: np.ndarray = None) -> tuple:
+    """Decodes a raw ROI, its metadata row followed by its pixels, with the
+    metadata decoding and float conversion of RawToDepth, in one pass over
+    the data and without intermediate copies. The pixels are written to
+    ``pixels`` if given (a float32 array, reused from frame to frame),
+    otherwise to a new array. Returns the metadata as a dict and the pixels.
+    Needs libimage_decode.so."""
+    if decode_lib is None:
+        raise RuntimeError('libimage_decode.so is not installed')
+
+    src, src_addr = _address(_as_bytes(serialized_data))
+    info = ImageDecodeRoiInfo()
+    if pixels is None:
+        pixels = np.empty(max(src.size // 2, 1), dtype=np.float32)
+    _check_out(pixels, np.float32, 0)
+    flat = pixels.reshape(-1)
+    written = decode_lib.imageDecodeRoi(src_addr, src.size, flat.ctypes.data,
+                                        flat.size, ctypes.byref(info))
+    if written < 0:
+        raise ValueError(f'Could not decode ROI of {src.size} bytes into '
+                         f'{flat.size} pixels: error {written}')
+    return info.to_dict(), flat[:written]
+
+
+def get_and_decode(ir: 'TempImageReader', img_type: ImageType,
+                   out: np.ndarray = None) -> np.ndarray:
     """Uses the image reader to request the temporary
-     image over the network and decode it back into a numpy array."""
+     image over the network and decode it back into a numpy array,
+     or into ``out`` if given (see decode_into())."""
     attempts = 100
     for i in range(attempts):
         try:
+            if out is not None:
+                return decode_into(ir.get(img_type), img_type, out)
             return decode(ir.get(img_type), img_type)
         except (IndexError, ValueError):
             log.debug('Could not get image after attempt %s / %s ,'